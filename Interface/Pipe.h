@@ -7,6 +7,7 @@
 #include "Types.h"
 
 class IPipeThrottler;
+class IFsFile;
 
 class IPipe : public IObject
 {
@@ -44,6 +45,13 @@ public:
 	virtual void resetTransferedBytes(void)=0;
 
 	virtual _i64 getRealTransferredBytes() { return 0; }
+
+	/**
+	* Sends count bytes starting at offset from file directly (e.g. via sendfile).
+	* Only works with stream pipes. Returns false if not supported; fall back to Write then.
+	**/
+	virtual bool supportsSendFile() { return false; }
+	virtual bool SendFile(IFsFile* file, int64 offset, int64 count, int timeoutms=-1) { return false; }
 };
 
 #endif //IPIPE_H
@@ -18,6 +18,12 @@ public:
 	virtual bool addBytes(size_t n_bytes, bool wait)=0;
 	virtual void changeThrottleLimit(size_t bps, bool p_percent_max)=0;
 	virtual void changeThrottleUpdater(IPipeThrottlerUpdater* new_updater)=0;
+
+	/**
+	* Bytes added to this throttler are also charged to the parent. Waiting children
+	* of one parent share its bandwidth according to their weights.
+	**/
+	virtual void setParent(IPipeThrottler* parent, size_t weight)=0;
 };
 
 
@@ -19,22 +19,37 @@
 #include "PipeThrottler.h"
 #include "Server.h"
 #include "Interface/Mutex.h"
+#include "Interface/Condition.h"
 #include "stringtools.h"
+#include <algorithm>
 
 #define DLOG(x) //x
 
+namespace
+{
+	const int64 c_max_burst_ms = 1000;
+	const int64 c_max_wait_ms = 1000;
+	const size_t c_max_flows = 64;
+}
+
+IMutex *PipeThrottler::sched_mutex=NULL;
+std::list<PipeThrottler::SRequest*> PipeThrottler::waiting;
+int64 PipeThrottler::next_seq=0;
+
 PipeThrottler::PipeThrottler(size_t bps,
 	bool percent_max,
 	IPipeThrottlerUpdater* updater)
-	: throttle_bps(bps), percent_max(percent_max), curr_bytes(0),
+	: throttle_bps(bps), percent_max(percent_max), limit_generation(0), curr_bytes(0),
 	lastresettime(0), updater(updater),
 	throttle_state(ThrottleState_Probe),
 	lastprobetime(0), probe_bps(0),
 	throttle_percent(bps), last_probe_result(0),
-	probe_interval(10 * 60 * 1000)
+	probe_interval(10 * 60 * 1000), parent_limited(false), parent(NULL),
+	bucket_bps(0), tokens(0), weight(1), vtime(0)
 {
 	mutex=Server->createMutex();
 	lastupdatetime=Server->getTimeMS();
+	lastrefilltime=lastupdatetime;
 	if(updater!=NULL)
 	{
 		update_time_interval = updater->getUpdateIntervalMs();
@@ -43,43 +58,231 @@ PipeThrottler::PipeThrottler(size_t bps,
 	{
 		update_time_interval = -1;
 	}
+	bucket_bps = isLimiting() ? throttle_bps : 0;
 }
 
 PipeThrottler::~PipeThrottler(void)
 {
+	PipeThrottler* curr_parent;
+	{
+		IScopedLock lock(mutex);
+		curr_parent=parent;
+	}
+
+	std::vector<PipeThrottler*> curr_children;
+	{
+		IScopedLock lock(sched_mutex);
+
+		if(curr_parent!=NULL)
+		{
+			curr_parent->children.erase(std::remove(curr_parent->children.begin(), curr_parent->children.end(), this), curr_parent->children.end());
+			curr_parent->flow_finish.erase(SFlowKey(this, 0));
+		}
+
+		curr_children.swap(children);
+	}
+
+	for(size_t i=0;i<curr_children.size();++i)
+	{
+		IScopedLock lock(curr_children[i]->mutex);
+		curr_children[i]->parent=NULL;
+	}
+
 	Server->destroy(mutex);
 }
 
-bool PipeThrottler::addBytes(size_t new_bytes, bool wait)
+void PipeThrottler::init_mutex()
 {
-	IScopedLock lock(mutex);
+	sched_mutex=Server->createMutex();
+}
 
-	if(throttle_bps==0) return true;
+void PipeThrottler::destroy_mutex()
+{
+	Server->destroy(sched_mutex);
+}
 
+bool PipeThrottler::addBytes(size_t new_bytes, bool wait)
+{
 	int64 ctime=Server->getTimeMS();
 
-	if(updater.get() && update_time_interval>=0 &&
-		ctime-lastupdatetime>update_time_interval)
+	SRequest req;
+	req.bytes=new_bytes;
+	req.cond=NULL;
+	req.limited_below=0;
+	bool limited=false;
+	for(PipeThrottler* node=this;node!=NULL;)
 	{
-		size_t new_throttle_bps = updater->getThrottleLimit(percent_max);
+		node->updateLimit(ctime);
 
-		if (percent_max)
+		IScopedLock lock(node->mutex);
+		node->restartProbe(ctime);
+		if(node->isLimiting())
 		{
-			throttle_percent = new_throttle_bps;
-			if (throttle_percent == 0)
+			limited=true;
+		}
+		req.path.push_back(node);
+		node=node->parent;
+	}
+
+	if(!limited)
+	{
+		chargePath(req, ctime);
+		return true;
+	}
+
+	if(wait)
+	{
+		req.cond=Server->createCondition();
+	}
+
+	IScopedLock lock(sched_mutex);
+
+	for(size_t i=0;i<req.path.size();++i)
+	{
+		req.path[i]->refill(ctime);
+	}
+
+	if(!wait)
+	{
+		bool ret = isEligible(req);
+		for(size_t i=0;i<req.path.size();++i)
+		{
+			req.path[i]->chargeBucket(new_bytes);
+		}
+		lock.relock(NULL);
+		chargePath(req, ctime);
+		return ret;
+	}
+
+	THREAD_ID tid=Server->getThreadID();
+	req.seq=next_seq++;
+	for(size_t i=0;i<req.path.size();++i)
+	{
+		PipeThrottler* node=req.path[i];
+		SFlowKey flow = i==0 ? SFlowKey(NULL, tid) : SFlowKey(req.path[i-1], 0);
+		size_t flow_weight = i==0 ? 1 : req.path[i-1]->weight;
+
+		double& finish=node->flow_finish[flow];
+		double start=(std::max)(node->vtime, finish);
+		finish=start+static_cast<double>(new_bytes)/flow_weight;
+
+		req.flows.push_back(flow);
+		req.start_tags.push_back(start);
+	}
+
+	waiting.push_back(&req);
+
+	bool throttled=false;
+	while(true)
+	{
+		ctime=Server->getTimeMS();
+		for(size_t i=0;i<req.path.size();++i)
+		{
+			req.path[i]->refill(ctime);
+		}
+
+		if(isEligible(req))
+		{
+			SRequest* next=pickRequest(req.path.back());
+			if(next==&req)
 			{
-				throttle_bps = 0;
+				break;
 			}
+
+			//Another request of the same hierarchy goes first. Make sure it is awake.
+			if(next!=NULL)
+			{
+				next->cond->notify_all();
+			}
+			req.cond->wait(&lock, static_cast<int>(c_max_wait_ms));
 		}
 		else
 		{
-			throttle_bps = new_throttle_bps;
+			int64 wait_time=(std::min)(getWaitTime(req), c_max_wait_ms);
+			DLOG(Server->Log("Throttler: Waiting for " + convert(wait_time)+ "ms", LL_DEBUG));
+			req.cond->wait(&lock, static_cast<int>(wait_time));
+		}
+
+		throttled=true;
+	}
+
+	waiting.remove(&req);
+
+	ctime=Server->getTimeMS();
+	for(size_t i=0;i<req.path.size();++i)
+	{
+		PipeThrottler* node=req.path[i];
+		node->vtime=(std::max)(node->vtime, req.start_tags[i]);
+		node->chargeBucket(new_bytes);
+		node->pruneFlows();
+	}
+
+	SRequest* next=pickRequest(req.path.back());
+	if(next!=NULL)
+	{
+		next->cond->notify_all();
+	}
+
+	lock.relock(NULL);
+
+	Server->destroy(req.cond);
+
+	chargePath(req, ctime);
+
+	return !throttled;
+}
+
+void PipeThrottler::updateLimit(int64 ctime)
+{
+	std::shared_ptr<IPipeThrottlerUpdater> curr_updater;
+	bool curr_percent_max;
+	size_t curr_generation;
+	{
+		IScopedLock lock(mutex);
+
+		if(!updater.get() || update_time_interval<0 ||
+			ctime-lastupdatetime<=update_time_interval)
+		{
+			return;
 		}
 
 		lastupdatetime = ctime;
-		if(throttle_bps==0) return true;
+		curr_updater = updater;
+		curr_percent_max = percent_max;
+		curr_generation = limit_generation;
 	}
 
+	//Reads the settings, so no lock is held while doing that
+	size_t new_throttle_bps = curr_updater->getThrottleLimit(curr_percent_max);
+
+	IScopedLock lock(mutex);
+
+	//The limit or the updater was changed while reading the settings
+	if (limit_generation != curr_generation)
+	{
+		return;
+	}
+
+	percent_max = curr_percent_max;
+
+	if (percent_max)
+	{
+		throttle_percent = new_throttle_bps;
+		if (throttle_percent == 0)
+		{
+			throttle_bps = 0;
+		}
+	}
+	else
+	{
+		throttle_bps = new_throttle_bps;
+	}
+
+	publishLimit();
+}
+
+void PipeThrottler::restartProbe(int64 ctime)
+{
 	if (percent_max &&
 		throttle_state == ThrottleState_Throttle
 		&& ctime - lastprobetime > static_cast<int64>(probe_interval))
@@ -87,149 +290,291 @@ bool PipeThrottler::addBytes(size_t new_bytes, bool wait)
 		throttle_state = ThrottleState_Probe;
 		probe_bps = 0;
 		Server->Log("PROBE Starting probing for max speed");
+		publishLimit();
+	}
+}
+
+bool PipeThrottler::isLimiting()
+{
+	return throttle_bps!=0
+		&& !(percent_max && throttle_state == ThrottleState_Probe);
+}
+
+void PipeThrottler::publishLimit()
+{
+	size_t new_bucket_bps = isLimiting() ? throttle_bps : 0;
+
+	IScopedLock lock(sched_mutex);
+
+	if(new_bucket_bps==bucket_bps)
+	{
+		return;
+	}
+
+	if(bucket_bps==0)
+	{
+		tokens=0;
+		lastrefilltime=Server->getTimeMS();
+	}
+
+	bucket_bps=new_bucket_bps;
+
+	notifyWaiters(this);
+}
+
+void PipeThrottler::refill(int64 ctime)
+{
+	if(bucket_bps==0)
+	{
+		tokens=0;
+	}
+	else if(ctime>lastrefilltime)
+	{
+		double max_tokens = static_cast<double>(bucket_bps)*c_max_burst_ms/1000;
+		tokens = (std::min)(max_tokens, tokens + static_cast<double>(ctime-lastrefilltime)*bucket_bps/1000);
+	}
+	lastrefilltime=ctime;
+}
+
+void PipeThrottler::chargeBucket(size_t new_bytes)
+{
+	if(bucket_bps!=0)
+	{
+		tokens -= static_cast<double>(new_bytes);
+	}
+}
+
+void PipeThrottler::countBytes(size_t new_bytes, int64 ctime)
+{
+	if(throttle_bps==0) return;
+
+	updateProbe(ctime);
+
+	curr_bytes += new_bytes;
+
+	if (percent_max
+		&& throttle_state == ThrottleState_Throttle
+		&& curr_bytes > static_cast<size_t>(1.1f*last_probe_result+0.5f))
+	{
+		Server->Log("PROBE Current speed per second at " + PrettyPrintSpeed(curr_bytes) +
+			" 10% higher than max speed during probe at " + PrettyPrintSpeed(static_cast<size_t>(last_probe_result + 0.5f)) +
+			". Reprobing for max speed.", LL_DEBUG);
+		throttle_state = ThrottleState_Probe;
+		probe_bps = 0;
+		publishLimit();
 	}
+}
 
-	if(ctime-lastresettime>1000)
+void PipeThrottler::chargePath(SRequest& req, int64 ctime)
+{
+	for(size_t i=0;i<req.path.size();++i)
 	{
-		if (percent_max && throttle_state == ThrottleState_Probe)
+		PipeThrottler* node=req.path[i];
+		IScopedLock lock(node->mutex);
+
+		//Speed measured below a throttler that ran out of tokens is not the link speed
+		if(i<req.limited_below)
 		{
-			int64 passed_time = ctime - lastresettime;
-			float bps = (curr_bytes * 1000.f) / passed_time;
-			if (bps > 10 * 1024)
+			node->parent_limited=true;
+		}
+
+		node->countBytes(req.bytes, ctime);
+	}
+}
+
+void PipeThrottler::updateProbe(int64 ctime)
+{
+	if(ctime-lastresettime<=1000)
+	{
+		return;
+	}
+
+	if (percent_max && throttle_state == ThrottleState_Probe)
+	{
+		int64 passed_time = ctime - lastresettime;
+		float bps = (curr_bytes * 1000.f) / passed_time;
+		if (parent_limited)
+		{
+			Server->Log("PROBE Discarding current speed of " + PrettyPrintSpeed(static_cast<size_t>(bps + 0.5f)) +
+				" during probing for max speed because a parent throttler limited it", LL_DEBUG);
+		}
+		else if (bps > 10 * 1024)
+		{
+			if (probe_bps == 0)
 			{
-				if (probe_bps == 0)
-				{
-					probe_bps = bps;
-				}
-				else
+				probe_bps = bps;
+			}
+			else
+			{
+				float new_probe_bps = 0.8f*probe_bps + 0.2f*bps;
+				float pdiff = new_probe_bps / probe_bps;
+				if (pdiff > 0.99f && pdiff < 1.01f)
 				{
-					float new_probe_bps = 0.8f*probe_bps + 0.2f*bps;
-					float pdiff = new_probe_bps / probe_bps;
-					if (pdiff > 0.99f && pdiff < 1.01f)
+					throttle_bps = static_cast<size_t>((static_cast<float>(throttle_percent) / 100)*new_probe_bps + 0.5f);
+					Server->Log("PROBE Probing finished at current speed " + PrettyPrintSpeed(static_cast<size_t>(bps + 0.5f))
+						+ " last avg " + PrettyPrintSpeed(static_cast<size_t>(probe_bps + 0.5f))
+						+ " curr avg " + PrettyPrintSpeed(static_cast<size_t>(new_probe_bps + 0.5f))
+						+ " pdiff " + convert(pdiff)
+						+ " throttling "+convert(throttle_percent)+"% to "+PrettyPrintSpeed(throttle_bps), LL_DEBUG);
+					lastprobetime = ctime;
+					throttle_state = ThrottleState_Throttle;
+					publishLimit();
+
+					if (last_probe_result != 0)
 					{
-						throttle_bps = static_cast<size_t>((static_cast<float>(throttle_percent) / 100)*new_probe_bps + 0.5f);
-						Server->Log("PROBE Probing finished at current speed " + PrettyPrintSpeed(static_cast<size_t>(bps + 0.5f))
-							+ " last avg " + PrettyPrintSpeed(static_cast<size_t>(probe_bps + 0.5f))
-							+ " curr avg " + PrettyPrintSpeed(static_cast<size_t>(new_probe_bps + 0.5f))
-							+ " pdiff " + convert(pdiff)
-							+ " throttling "+convert(throttle_percent)+"% to "+PrettyPrintSpeed(throttle_bps), LL_DEBUG);
-						lastprobetime = ctime;
-						throttle_state = ThrottleState_Throttle;
-						
-
-						if (last_probe_result != 0)
+						pdiff = last_probe_result / new_probe_bps;
+						Server->Log("PROBE Curr probe result " + PrettyPrintSpeed(static_cast<size_t>(new_probe_bps + 0.5f))
+							+ " last probe result " + PrettyPrintSpeed(static_cast<size_t>(last_probe_result + 0.5f))
+							+ " pdiff " + convert(pdiff), LL_DEBUG);
+						if (pdiff > 0.95f && pdiff < 1.05f
+							&& probe_interval < 60*60*1000 )
 						{
-							pdiff = last_probe_result / new_probe_bps;
-							Server->Log("PROBE Curr probe result " + PrettyPrintSpeed(static_cast<size_t>(new_probe_bps + 0.5f))
-								+ " last probe result " + PrettyPrintSpeed(static_cast<size_t>(last_probe_result + 0.5f))
-								+ " pdiff " + convert(pdiff), LL_DEBUG);
-							if (pdiff > 0.95f && pdiff < 1.05f
-								&& probe_interval < 60*60*1000 )
-							{
-								probe_interval += 10 * 60 * 1000;
-								Server->Log("PROBE New probe interval: " + PrettyPrintTime(probe_interval), LL_DEBUG);
-							}
+							probe_interval += 10 * 60 * 1000;
+							Server->Log("PROBE New probe interval: " + PrettyPrintTime(probe_interval), LL_DEBUG);
 						}
-						last_probe_result = new_probe_bps;
 					}
-					else
-					{
-						Server->Log("PROBE Probing at current speed " + PrettyPrintSpeed(static_cast<size_t>(bps + 0.5f))
-							+ " last avg " + PrettyPrintSpeed(static_cast<size_t>(probe_bps + 0.5f))
-							+ " curr avg " + PrettyPrintSpeed(static_cast<size_t>(new_probe_bps + 0.5f))
-							+ " pdiff " + convert(pdiff), LL_DEBUG);
-					}
-					probe_bps = new_probe_bps;
+					last_probe_result = new_probe_bps;
 				}
-			}
-			else
-			{
-				Server->Log("PROBE Discarding current speed of " + PrettyPrintSpeed(static_cast<size_t>(bps + 0.5f)) +
-					" during probing for max speed because it is too low", LL_DEBUG);
+				else
+				{
+					Server->Log("PROBE Probing at current speed " + PrettyPrintSpeed(static_cast<size_t>(bps + 0.5f))
+						+ " last avg " + PrettyPrintSpeed(static_cast<size_t>(probe_bps + 0.5f))
+						+ " curr avg " + PrettyPrintSpeed(static_cast<size_t>(new_probe_bps + 0.5f))
+						+ " pdiff " + convert(pdiff), LL_DEBUG);
+				}
+				probe_bps = new_probe_bps;
 			}
 		}
-
-		lastresettime=ctime;
-		curr_bytes=0;
+		else
+		{
+			Server->Log("PROBE Discarding current speed of " + PrettyPrintSpeed(static_cast<size_t>(bps + 0.5f)) +
+				" during probing for max speed because it is too low", LL_DEBUG);
+		}
 	}
 
-	curr_bytes += new_bytes;
+	lastresettime=ctime;
+	curr_bytes=0;
+	parent_limited=false;
+}
 
-	if (percent_max && throttle_state == ThrottleState_Probe)
+void PipeThrottler::pruneFlows()
+{
+	if(flow_finish.size()<=c_max_flows)
 	{
-		return true;
+		return;
 	}
 
-	int64 passed_time=ctime-lastresettime;
+	for(std::map<SFlowKey, double>::iterator it=flow_finish.begin();it!=flow_finish.end();)
+	{
+		if(it->second<=vtime)
+		{
+			flow_finish.erase(it++);
+		}
+		else
+		{
+			++it;
+		}
+	}
+}
 
-	size_t maxRateTime=(size_t)(((_i64)curr_bytes*1000)/throttle_bps);
-	if(passed_time>0)
+bool PipeThrottler::isEligible(SRequest& req)
+{
+	for(size_t i=0;i<req.path.size();++i)
 	{
-		size_t bps=(size_t)(((_i64)curr_bytes*1000)/passed_time);
+		if(req.path[i]->bucket_bps!=0
+			&& req.path[i]->tokens<=0)
+		{
+			return false;
+		}
+	}
+	return true;
+}
 
-		if (throttle_state == ThrottleState_Throttle
-			&& curr_bytes > static_cast<size_t>(1.1f*last_probe_result+0.5f))
+int64 PipeThrottler::getWaitTime(SRequest& req)
+{
+	int64 ret=1;
+	for(size_t i=0;i<req.path.size();++i)
+	{
+		PipeThrottler* node=req.path[i];
+		if(node->bucket_bps!=0
+			&& node->tokens<=0)
 		{
-			Server->Log("PROBE Current speed per second at " + PrettyPrintSpeed(curr_bytes) +
-				" 10% higher than max speed during probe at " + PrettyPrintSpeed(static_cast<size_t>(last_probe_result + 0.5f)) +
-				". Reprobing for max speed.", LL_DEBUG);
-			throttle_state = ThrottleState_Probe;
-			probe_bps = 0;
-			return true;
+			int64 wait_time = static_cast<int64>((1-node->tokens)*1000/node->bucket_bps)+1;
+			ret=(std::max)(ret, wait_time);
+			req.limited_below=(std::max)(req.limited_below, i);
 		}
+	}
+	return ret;
+}
 
-		if(bps>throttle_bps)
-		{		
-			unsigned int sleepTime=(unsigned int)(maxRateTime-passed_time);
+PipeThrottler::SRequest* PipeThrottler::pickRequest(PipeThrottler* root)
+{
+	std::vector<SRequest*> candidates;
+	for(std::list<SRequest*>::iterator it=waiting.begin();it!=waiting.end();++it)
+	{
+		if((*it)->path.back()==root
+			&& isEligible(**it))
+		{
+			candidates.push_back(*it);
+		}
+	}
 
-			if(sleepTime>0)
+	//Select top-down: at each level the flow with the smallest start tag
+	size_t depth=0;
+	while(candidates.size()>1)
+	{
+		SRequest* best=NULL;
+		size_t best_idx=0;
+		for(size_t i=0;i<candidates.size();++i)
+		{
+			size_t idx=candidates[i]->path.size()-1-depth;
+			if(best==NULL
+				|| candidates[i]->start_tags[idx]<best->start_tags[best_idx]
+				|| (candidates[i]->start_tags[idx]==best->start_tags[best_idx]
+					&& candidates[i]->seq<best->seq) )
 			{
-				if(wait)
-				{
-					DLOG(Server->Log("Throttler: Sleeping for " + convert(sleepTime)+ "ms", LL_DEBUG));
-					Server->wait(sleepTime);
-
-					if(Server->getTimeMS()-lastresettime>1000)
-					{
-						curr_bytes=0;
-						lastresettime=Server->getTimeMS();
-					}
-				}
-
-				return false;
+				best=candidates[i];
+				best_idx=idx;
 			}
 		}
-	}
-	else if(curr_bytes>=throttle_bps)
-	{
-		if (throttle_state == ThrottleState_Throttle
-			&& curr_bytes > static_cast<size_t>(1.1f*last_probe_result + 0.5f))
+
+		SFlowKey best_flow=best->flows[best_idx];
+		if(best_flow.first==NULL)
 		{
-			Server->Log("PROBE 2 Current speed per second at " + PrettyPrintSpeed(curr_bytes) +
-				" significantly higher than max speed during probe at " + PrettyPrintSpeed(static_cast<size_t>(last_probe_result + 0.5f)) +
-				". Reprobing for max speed.", LL_DEBUG);
-			throttle_state = ThrottleState_Probe;
-			probe_bps = 0;
-			return true;
+			return best;
 		}
 
-		if(wait)
+		std::vector<SRequest*> next_candidates;
+		for(size_t i=0;i<candidates.size();++i)
 		{
-			DLOG(Server->Log("Throttler: Sleeping for " + convert(maxRateTime)+ "ms", LL_DEBUG));
-			Server->wait(static_cast<unsigned int>(maxRateTime));
+			if(candidates[i]->flows[candidates[i]->path.size()-1-depth]==best_flow)
+			{
+				next_candidates.push_back(candidates[i]);
+			}
 		}
-		curr_bytes=0;
-		lastresettime=Server->getTimeMS();
-		return false;
+		candidates.swap(next_candidates);
+		++depth;
 	}
 
-	return true;
+	return candidates.empty() ? NULL : candidates[0];
+}
+
+void PipeThrottler::notifyWaiters(PipeThrottler* node)
+{
+	for(std::list<SRequest*>::iterator it=waiting.begin();it!=waiting.end();++it)
+	{
+		if(std::find((*it)->path.begin(), (*it)->path.end(), node)!=(*it)->path.end())
+		{
+			(*it)->cond->notify_all();
+		}
+	}
 }
 
 void PipeThrottler::changeThrottleLimit(size_t bps, bool p_percent_max)
 {
 	IScopedLock lock(mutex);
 
+	++limit_generation;
 	percent_max = p_percent_max;
 
 	if (percent_max)
@@ -240,11 +585,55 @@ void PipeThrottler::changeThrottleLimit(size_t bps, bool p_percent_max)
 	{
 		throttle_bps = bps;
 	}
+
+	publishLimit();
 }
 
 void PipeThrottler::changeThrottleUpdater(IPipeThrottlerUpdater* new_updater)
 {
 	IScopedLock lock(mutex);
 
+	++limit_generation;
 	updater.reset(new_updater);
 }
+
+void PipeThrottler::setParent(IPipeThrottler* new_parent, size_t new_weight)
+{
+	PipeThrottler* p=dynamic_cast<PipeThrottler*>(new_parent);
+
+	for(PipeThrottler* node=p;node!=NULL;)
+	{
+		if(node==this)
+		{
+			return;
+		}
+
+		IScopedLock lock(node->mutex);
+		node=node->parent;
+	}
+
+	IScopedLock lock(mutex);
+	IScopedLock sched_lock(sched_mutex);
+
+	weight=(std::max)(new_weight, static_cast<size_t>(1));
+
+	if(p==parent)
+	{
+		return;
+	}
+
+	if(parent!=NULL)
+	{
+		parent->children.erase(std::remove(parent->children.begin(), parent->children.end(), this), parent->children.end());
+		parent->flow_finish.erase(SFlowKey(this, 0));
+	}
+
+	parent=p;
+
+	if(parent!=NULL)
+	{
+		parent->children.push_back(this);
+	}
+
+	notifyWaiters(this);
+}
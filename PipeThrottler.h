@@ -1,10 +1,23 @@
 #pragma once
 
 #include "Interface/PipeThrottler.h"
+#include "Interface/Types.h"
 #include <memory>
+#include <vector>
+#include <list>
+#include <map>
 
 class IMutex;
+class ICondition;
 
+/**
+* Token bucket which can be nested into a hierarchy (e.g. global -> client -> stream).
+* Waiting callers of one hierarchy are served in start-time fair queueing order,
+* weighted per child throttler and per calling thread on the leaf.
+* Limit and probing state is protected by the per-throttler mutex. The buckets and the
+* queueing state are protected by sched_mutex, which is only locked if a throttler on the
+* path is limiting. Lock order is mutex before sched_mutex.
+*/
 class PipeThrottler : public IPipeThrottler
 {
 public:
@@ -18,6 +31,11 @@ public:
 
 	virtual void changeThrottleUpdater(IPipeThrottlerUpdater* new_updater);
 
+	virtual void setParent(IPipeThrottler* new_parent, size_t new_weight);
+
+	static void init_mutex();
+	static void destroy_mutex();
+
 private:
 	enum ThrottleState
 	{
@@ -25,19 +43,72 @@ private:
 		ThrottleState_Throttle
 	};
 
+	typedef std::pair<PipeThrottler*, THREAD_ID> SFlowKey;
+
+	struct SRequest
+	{
+		size_t bytes;
+		int64 seq;
+		ICondition* cond;
+		size_t limited_below;
+		std::vector<PipeThrottler*> path;
+		std::vector<SFlowKey> flows;
+		std::vector<double> start_tags;
+	};
+
+	//Locks mutex
+	void updateLimit(int64 ctime);
+
+	//mutex has to be locked
+	void restartProbe(int64 ctime);
+	bool isLimiting();
+	void countBytes(size_t new_bytes, int64 ctime);
+	void updateProbe(int64 ctime);
+	void publishLimit();
+
+	//sched_mutex has to be locked
+	void refill(int64 ctime);
+	void chargeBucket(size_t new_bytes);
+	void pruneFlows();
+
+	static bool isEligible(SRequest& req);
+	static SRequest* pickRequest(PipeThrottler* root);
+	static int64 getWaitTime(SRequest& req);
+	static void notifyWaiters(PipeThrottler* node);
+
+	//Locks mutex of each throttler on the path
+	static void chargePath(SRequest& req, int64 ctime);
+
+	IMutex* mutex;
+
 	size_t throttle_bps;
 	bool percent_max;
+	size_t limit_generation;
 	int64 update_time_interval;
 	size_t curr_bytes;
 	int64 lastresettime;
 	int64 lastupdatetime;
-	std::auto_ptr<IPipeThrottlerUpdater> updater;
+	std::shared_ptr<IPipeThrottlerUpdater> updater;
 	ThrottleState throttle_state;
 	int64 lastprobetime;
 	float probe_bps;
 	size_t throttle_percent;
 	float last_probe_result;
 	size_t probe_interval;
+	bool parent_limited;
+	PipeThrottler* parent;
+
+	size_t bucket_bps;
+	double tokens;
+	int64 lastrefilltime;
+
+	size_t weight;
+	std::vector<PipeThrottler*> children;
+
+	double vtime;
+	std::map<SFlowKey, double> flow_finish;
 
-	IMutex *mutex;
+	static IMutex *sched_mutex;
+	static std::list<SRequest*> waiting;
+	static int64 next_seq;
 };
\ No newline at end of file
@@ -203,6 +203,7 @@ void CServer::setup(void)
 #endif
 
 	CQuery::init_mutex();
+	PipeThrottler::init_mutex();
 
 #ifdef MODE_WIN
 	File::init_mutex();
@@ -339,6 +340,7 @@ CServer::~CServer()
 #ifndef NO_SQLITE
 	CDatabase::destroyMutex();
 #endif
+	PipeThrottler::destroy_mutex();
 
 #ifdef MODE_WIN
 	File::destroy_mutex();
@@ -24,9 +24,14 @@
 #include <memory.h>
 #include <errno.h>
 #endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 #include "Server.h"
+#include "Interface/File.h"
 #include "Interface/PipeThrottler.h"
 #include "stringtools.h"
+#include <algorithm>
 
 CStreamPipe::CStreamPipe( SOCKET pSocket)
 	: transfered_bytes(0)
@@ -260,6 +265,57 @@ bool CStreamPipe::hasError(void)
 	return has_error;
 }
 
+bool CStreamPipe::supportsSendFile()
+{
+#ifdef __linux__
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool CStreamPipe::SendFile(IFsFile* file, int64 offset, int64 count, int timeoutms)
+{
+#ifdef __linux__
+	off_t foffset = static_cast<off_t>(offset);
+	while (count > 0)
+	{
+		int rc = selectSocketWrite(s, timeoutms);
+		if (rc <= 0)
+		{
+			if (rc < 0)
+			{
+				has_error = true;
+			}
+			return false;
+		}
+
+		size_t tosend = static_cast<size_t>((std::min)(count, static_cast<int64>(1024 * 1024)));
+		ssize_t sent = sendfile(s, file->getOsHandle(), &foffset, tosend);
+		if (sent < 0)
+		{
+			if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				continue;
+			}
+			has_error = true;
+			return false;
+		}
+		else if (sent == 0)
+		{
+			//File got truncated
+			return false;
+		}
+
+		doThrottle(sent, true, true);
+		count -= sent;
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+
 SOCKET CStreamPipe::getSocket(void)
 {
 	return s;
@@ -33,6 +33,9 @@ public:
 
 	virtual bool Flush( int timeoutms=-1 );
 
+	virtual bool supportsSendFile();
+	virtual bool SendFile(IFsFile* file, int64 offset, int64 count, int timeoutms=-1);
+
 private:
 	SOCKET s;
 	bool doThrottle(size_t new_bytes, bool outgoing, bool wait);
@@ -0,0 +1,67 @@
+#include "cdc.h"
+
+namespace
+{
+	//18 and 14 of the most significant bits. A byte only influences
+	//the upper bits of the fingerprint for the next 64 bytes.
+	const uint64 c_mask_small = 0xFFFFC00000000000ULL;
+	const uint64 c_mask_large = 0xFFFC000000000000ULL;
+
+	class GearTable
+	{
+	public:
+		GearTable()
+		{
+			//splitmix64 with a fixed seed. Client and server have to
+			//use the same table.
+			uint64 state = 0x55524241434b5550ULL;
+			for (size_t i = 0; i < 256; ++i)
+			{
+				state += 0x9E3779B97F4A7C15ULL;
+				uint64 z = state;
+				z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+				z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+				table[i] = z ^ (z >> 31);
+			}
+		}
+
+		uint64 table[256];
+	};
+
+	GearTable gear;
+}
+
+unsigned int cdc_chunk_size(const char* buf, unsigned int bsize)
+{
+	if (bsize <= c_cdc_min_size)
+	{
+		return bsize;
+	}
+
+	unsigned int n = bsize < c_cdc_max_size ? bsize : c_cdc_max_size;
+	unsigned int normal = n < c_cdc_avg_size ? n : c_cdc_avg_size;
+
+	const unsigned char* ubuf = reinterpret_cast<const unsigned char*>(buf);
+	uint64 fp = 0;
+	unsigned int i = c_cdc_min_size;
+
+	for (; i < normal; ++i)
+	{
+		fp = (fp << 1) + gear.table[ubuf[i]];
+		if (!(fp & c_mask_small))
+		{
+			return i + 1;
+		}
+	}
+
+	for (; i < n; ++i)
+	{
+		fp = (fp << 1) + gear.table[ubuf[i]];
+		if (!(fp & c_mask_large))
+		{
+			return i + 1;
+		}
+	}
+
+	return n;
+}
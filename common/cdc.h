@@ -0,0 +1,12 @@
+#pragma once
+
+#include "../Interface/Types.h"
+
+//Content-defined chunking (FastCDC with normalized chunk sizes)
+const unsigned int c_cdc_min_size = 16 * 1024;
+const unsigned int c_cdc_avg_size = 64 * 1024;
+const unsigned int c_cdc_max_size = 256 * 1024;
+
+//Returns the size of the chunk starting at buf. bsize has to be at least
+//c_cdc_max_size unless buf contains the end of the data.
+unsigned int cdc_chunk_size(const char* buf, unsigned int bsize);
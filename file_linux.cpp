@@ -67,6 +67,7 @@
 #define pread64 pread
 #else
 #include <linux/fs.h>
+#include <linux/fiemap.h>
 
 #if !defined(BLKGETSIZE64) && defined(__i386__) && defined(__x86_64__)
 #define BLKGETSIZE64 _IOR(0x12,114,size_t)
@@ -468,8 +469,59 @@ IFsFile::SSparseExtent File::nextSparseExtent()
 
 std::vector<IFsFile::SFileExtent> File::getFileExtents(int64 starting_offset, int64 block_size, bool& more_data)
 {
-	//TODO: Implement using FIEMAP?
-	return std::vector<SFileExtent>();
+	std::vector<IFsFile::SFileExtent> ret;
+	more_data = false;
+
+#ifdef FS_IOC_FIEMAP
+	std::vector<char> buf;
+	buf.resize(4096);
+
+	struct fiemap* fm = reinterpret_cast<struct fiemap*>(buf.data());
+	fm->fm_start = starting_offset;
+	fm->fm_length = FIEMAP_MAX_OFFSET - starting_offset;
+	fm->fm_flags = 0;
+	fm->fm_extent_count = static_cast<__u32>((buf.size() - sizeof(struct fiemap)) / sizeof(struct fiemap_extent));
+
+	if (ioctl(fd, FS_IOC_FIEMAP, fm) != 0)
+	{
+		return ret;
+	}
+
+	if (fm->fm_mapped_extents == fm->fm_extent_count
+		&& fm->fm_mapped_extents > 0
+		&& !(fm->fm_extents[fm->fm_mapped_extents - 1].fe_flags & FIEMAP_EXTENT_LAST))
+	{
+		more_data = true;
+	}
+
+	for (__u32 i = 0; i < fm->fm_mapped_extents; ++i)
+	{
+		const struct fiemap_extent& fe = fm->fm_extents[i];
+
+		//Skip extents without a fixed location on the volume
+		if (fe.fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC
+			| FIEMAP_EXTENT_ENCODED | FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_NOT_ALIGNED))
+		{
+			continue;
+		}
+
+		if (!ret.empty()
+			&& ret.back().offset + ret.back().size == static_cast<int64>(fe.fe_logical)
+			&& ret.back().volume_offset + ret.back().size == static_cast<int64>(fe.fe_physical))
+		{
+			ret.back().size += fe.fe_length;
+			continue;
+		}
+
+		IFsFile::SFileExtent ext;
+		ext.offset = fe.fe_logical;
+		ext.size = fe.fe_length;
+		ext.volume_offset = fe.fe_physical;
+		ret.push_back(ext);
+	}
+#endif
+
+	return ret;
 }
 
 IFsFile::os_file_handle File::getOsHandle(bool release_handle)
@@ -87,7 +87,7 @@
 
 
 CClientThread::CClientThread(SOCKET pSocket, CTCPFileServ* pParent)
-	: extra_buffer(NULL), waiting_for_chunk(false)
+	: extra_buffer(NULL), waiting_for_chunk(false), cdc_file_open(false), cdc_hashes(NULL)
 {
 	int_socket=pSocket;
 
@@ -122,7 +122,7 @@ CClientThread::CClientThread(SOCKET pSocket, CTCPFileServ* pParent)
 }
 
 CClientThread::CClientThread(IPipe *pClientpipe, CTCPFileServ* pParent, std::vector<char>* extra_buffer)
-	: extra_buffer(extra_buffer), waiting_for_chunk(false)
+	: extra_buffer(extra_buffer), waiting_for_chunk(false), cdc_file_open(false), cdc_hashes(NULL)
 {
 	stopped=false;
 	killable=false;
@@ -148,6 +148,12 @@ CClientThread::CClientThread(IPipe *pClientpipe, CTCPFileServ* pParent, std::vec
 CClientThread::~CClientThread()
 {
 	delete bufmgr;
+	delete cdc_hashes;
+	while(!next_chunks.empty())
+	{
+		delete next_chunks.front().cdc_hashes;
+		next_chunks.pop();
+	}
 	if(mutex!=NULL)
 	{
 		Server->destroy(mutex);
@@ -603,6 +609,19 @@ bool CClientThread::ProcessPacket(CRData *data)
 
 				ScopedShareActive scoped_share_active(o_filename);
 
+				if(id!=ID_GET_FILE_METADATA_ONLY)
+				{
+					std::auto_ptr<IFile> virtual_file(FileServ::openVirtualFile(filename));
+					if(virtual_file.get()!=NULL)
+					{
+						if(!sendFullFile(virtual_file.get(), start_offset, with_hashes))
+						{
+							Log("Sending file "+o_filename+" failed", LL_INFO);
+						}
+						break;
+					}
+				}
+
 #ifndef LINUX
 				DWORD extra_flags = 0;
 				if (id == ID_GET_FILE_METADATA_ONLY)
@@ -1275,6 +1294,16 @@ bool CClientThread::ProcessPacket(CRData *data)
 					Handle_ID_BLOCK_REQUEST(data);
 				}
 			}break;
+		case ID_CDC_HASHES:
+			{
+				if(state==CS_BLOCKHASH)
+				{
+					if(!Handle_ID_CDC_HASHES(data))
+					{
+						return false;
+					}
+				}
+			}break;
 		case ID_GET_FILE_HASH_AND_METADATA:
 			{
 				if(!GetFileHashAndMetadata(data))
@@ -1736,6 +1765,12 @@ bool CClientThread::GetFileBlockdiff(CRData *data, bool with_metadata)
 		resumed = true;
 	}
 
+	bool cdc = (flags1 & c_blockdiff_flag_cdc)!=0 && !is_script;
+
+	cdc_file_open = false;
+	delete cdc_hashes;
+	cdc_hashes = NULL;
+
 	Log("Sending file (chunked) "+o_filename, LL_DEBUG);
 
 	bool allow_exec;
@@ -1887,7 +1922,13 @@ bool CClientThread::GetFileBlockdiff(CRData *data, bool with_metadata)
 			Log("Could not open file "+filename+". " + errstr, metadata_id != 0 ? LL_ERROR : LL_INFO);
 			return true;
 		}
-		
+
+		srv_file = FileServ::openVirtualFile(filename);
+		if(srv_file!=NULL)
+		{
+			CloseHandle(hFile);
+			hFile=INVALID_HANDLE_VALUE;
+		}
 	}
 
 	currfilepart=0;
@@ -1896,17 +1937,24 @@ bool CClientThread::GetFileBlockdiff(CRData *data, bool with_metadata)
 
 	if(!is_script)
 	{
+		if(srv_file!=NULL)
+		{
+			curr_filesize = srv_file->Size();
+		}
+		else
+		{
 #ifdef _WIN32
-		LARGE_INTEGER filesize;
-		GetFileSizeEx(hFile, &filesize);
+			LARGE_INTEGER filesize;
+			GetFileSizeEx(hFile, &filesize);
 
-		curr_filesize=filesize.QuadPart;
+			curr_filesize=filesize.QuadPart;
 #else
-		struct stat64 stat_buf;
-		fstat64(hFile, &stat_buf);
+			struct stat64 stat_buf;
+			fstat64(hFile, &stat_buf);
 
-		curr_filesize=stat_buf.st_size;
+			curr_filesize=stat_buf.st_size;
 #endif
+		}
 
 		if (curr_filesize > c_checkpoint_dist)
 		{
@@ -1935,7 +1983,9 @@ bool CClientThread::GetFileBlockdiff(CRData *data, bool with_metadata)
 	if(next_checkpoint>curr_filesize && curr_filesize>0)
 		next_checkpoint=curr_filesize;
 
-	if(!is_script)
+	bool virtual_file = !is_script && srv_file!=NULL;
+
+	if(!is_script && !virtual_file)
 	{
 		srv_file = Server->openFileFromHandle((void*)hFile, filename);
 
@@ -1960,7 +2010,7 @@ bool CClientThread::GetFileBlockdiff(CRData *data, bool with_metadata)
 	chunk.hashsize = curr_hash_size;
 	chunk.requested_filesize = requested_filesize;
 	chunk.pipe_file_user = pipe_file_user.get();
-	chunk.with_sparse = is_script ? false : with_sparse;
+	chunk.with_sparse = (is_script || cdc || virtual_file) ? false : with_sparse;
 	chunk.s_filename = s_filename;
 	chunk.cbt_hash_file_info = cbt_hash_file_info;
 	pipe_file_user.release();
@@ -1971,6 +2021,8 @@ bool CClientThread::GetFileBlockdiff(CRData *data, bool with_metadata)
 
 	queueChunk(chunk);
 
+	cdc_file_open = cdc;
+
 	return true;
 }
 
@@ -2001,6 +2053,41 @@ bool CClientThread::Handle_ID_BLOCK_REQUEST(CRData *data)
 	return true;
 }
 
+bool CClientThread::Handle_ID_CDC_HASHES(CRData *data)
+{
+	char last;
+	if(!data->getChar(&last))
+		return false;
+
+	if(data->getLeft()%big_hash_size!=0)
+		return false;
+
+	if(cdc_hashes==NULL)
+	{
+		cdc_hashes = new std::vector<char>;
+	}
+
+	cdc_hashes->insert(cdc_hashes->end(), data->getCurrDataPtr(), data->getCurrDataPtr()+data->getLeft());
+
+	if(last==1)
+	{
+		if(cdc_file_open)
+		{
+			SChunk chunk;
+			chunk.cdc_hashes = cdc_hashes;
+			queueChunk(chunk);
+		}
+		else
+		{
+			delete cdc_hashes;
+		}
+		cdc_hashes = NULL;
+		cdc_file_open = false;
+	}
+
+	return true;
+}
+
 bool CClientThread::getNextChunk(SChunk *chunk, bool has_error)
 {
 	IScopedLock lock(mutex);
@@ -2160,6 +2247,12 @@ bool CClientThread::GetFileHashAndMetadata( CRData* data )
 		return false;
 	}
 
+	IFile* virtual_file = FileServ::openVirtualFile(filename);
+	if(virtual_file!=NULL)
+	{
+		tf.reset(virtual_file);
+	}
+
 	unsigned int read;
 	std::vector<char> buffer;
 	buffer.resize(32768);
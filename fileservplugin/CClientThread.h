@@ -50,13 +50,13 @@ struct SSendData
 struct SChunk
 {
 	SChunk()
-		: msg(ID_ILLEGAL), update_file(NULL), pipe_file_user(NULL), cbt_hash_file_info()
+		: msg(ID_ILLEGAL), update_file(NULL), pipe_file_user(NULL), cbt_hash_file_info(), cdc_hashes(NULL)
 	{
 
 	}
 
 	explicit SChunk(char msg)
-		: msg(msg), update_file(NULL), pipe_file_user(NULL), cbt_hash_file_info()
+		: msg(msg), update_file(NULL), pipe_file_user(NULL), cbt_hash_file_info(), cdc_hashes(NULL)
 	{
 
 	}
@@ -73,6 +73,7 @@ struct SChunk
 	bool with_sparse;
 	std::string s_filename;
 	IFileServ::CbtHashFileInfo cbt_hash_file_info;
+	std::vector<char>* cdc_hashes;
 };
 
 struct SLPData
@@ -130,6 +131,7 @@ private:
 
 	bool GetFileBlockdiff(CRData *data, bool with_metadata);
 	bool Handle_ID_BLOCK_REQUEST(CRData *data);
+	bool Handle_ID_CDC_HASHES(CRData *data);
 
 	bool GetFileHashAndMetadata(CRData* data);
 
@@ -206,4 +208,7 @@ private:
 	bool has_socket;
 
 	std::vector<char>* extra_buffer;
+
+	bool cdc_file_open;
+	std::vector<char>* cdc_hashes;
 };
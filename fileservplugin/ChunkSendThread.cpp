@@ -28,6 +28,8 @@
 #include "../Interface/File.h"
 #include "../Interface/Server.h"
 #include "../common/adler32.h"
+#include "../common/cdc.h"
+#include <algorithm>
 
 #ifndef _WIN32
 #include <errno.h>
@@ -57,6 +59,47 @@ namespace
 
 		return true;
 	}
+
+	class CdcHashIdxLess
+	{
+	public:
+		CdcHashIdxLess(const char* hashes)
+			: hashes(hashes)
+		{}
+
+		bool operator()(_u32 a, _u32 b) const
+		{
+			return memcmp(hashes + a*big_hash_size, hashes + b*big_hash_size, big_hash_size) < 0;
+		}
+
+	private:
+		const char* hashes;
+	};
+
+	bool find_cdc_hash(const char* hashes, const std::vector<_u32>& sorted_idx, const char* hash, _u32& idx)
+	{
+		size_t lo = 0;
+		size_t hi = sorted_idx.size();
+		while (lo < hi)
+		{
+			size_t mid = lo + (hi - lo) / 2;
+			int cmp = memcmp(hashes + sorted_idx[mid] * big_hash_size, hash, big_hash_size);
+			if (cmp == 0)
+			{
+				idx = sorted_idx[mid];
+				return true;
+			}
+			else if (cmp < 0)
+			{
+				lo = mid + 1;
+			}
+			else
+			{
+				hi = mid;
+			}
+		}
+		return false;
+	}
 }
 
 
@@ -108,6 +151,14 @@ void ChunkSendThread::operator()(void)
 
 			file_extents.clear();
 		}
+		else if (chunk.cdc_hashes != NULL)
+		{
+			if (!sendCdc(*chunk.cdc_hashes))
+			{
+				has_error = true;
+			}
+			delete chunk.cdc_hashes;
+		}
 		else if (chunk.msg == ID_FLUSH_SOCKET)
 		{
 			Server->Log("Received flush.", LL_DEBUG);
@@ -682,6 +733,179 @@ bool ChunkSendThread::sendChunk(SChunk *chunk)
 	return true;
 }
 
+bool ChunkSendThread::sendCdc(const std::vector<char>& cdc_hashes)
+{
+	if (file == NULL)
+	{
+		return false;
+	}
+
+	const char* hashes = cdc_hashes.empty() ? NULL : &cdc_hashes[0];
+	std::vector<_u32> sorted_idx(cdc_hashes.size() / big_hash_size);
+	for (size_t i = 0; i < sorted_idx.size(); ++i)
+	{
+		sorted_idx[i] = static_cast<_u32>(i);
+	}
+	std::sort(sorted_idx.begin(), sorted_idx.end(), CdcHashIdxLess(hashes));
+
+	Log("Sending file with content defined chunking. Known chunks: " + convert(sorted_idx.size()), LL_DEBUG);
+
+	std::vector<char> buf(c_cdc_max_size * 2);
+	size_t buf_start = 0;
+	size_t buf_end = 0;
+	int64 read_pos = 0;
+	MD5 file_hash;
+
+	_u32 run_start = 0;
+	_u32 run_len = 0;
+
+	while (true)
+	{
+		if (buf_end - buf_start < c_cdc_max_size
+			&& read_pos < curr_file_size)
+		{
+			if (buf_start > 0)
+			{
+				memmove(&buf[0], &buf[buf_start], buf_end - buf_start);
+				buf_end -= buf_start;
+				buf_start = 0;
+			}
+
+			while (buf_end < buf.size()
+				&& read_pos < curr_file_size)
+			{
+				_u32 toread = static_cast<_u32>((std::min)(static_cast<int64>(buf.size() - buf_end), curr_file_size - read_pos));
+				bool readerr = false;
+				_u32 r = file->Read(read_pos, &buf[buf_end], toread, &readerr);
+
+				if (readerr)
+				{
+					unsigned int readerr_code = getSystemErrorCode();
+					Server->Log("Reading from file \"" + file->getFilename() + "\" at position " + convert(read_pos) + " failed (code: " + convert(readerr_code) + ")(cdc).", LL_ERROR);
+					FileServ::callErrorCallback(s_filename, file->getFilename(), read_pos, "code: " + convert(readerr_code));
+					return sendError(ERR_READING_FAILED, readerr_code);
+				}
+
+				if (r == 0)
+				{
+					//File got smaller. Pad with zeros like whole block transfers.
+					memset(&buf[buf_end], 0, toread);
+					r = toread;
+				}
+
+				buf_end += r;
+				read_pos += r;
+			}
+		}
+
+		if (buf_start == buf_end)
+		{
+			break;
+		}
+
+		unsigned int chunk_size = cdc_chunk_size(&buf[buf_start], static_cast<unsigned int>(buf_end - buf_start));
+		const char* chunk_data = &buf[buf_start];
+
+		MD5 chunk_hash(reinterpret_cast<unsigned char*>(const_cast<char*>(chunk_data)), chunk_size);
+		file_hash.update(reinterpret_cast<unsigned char*>(const_cast<char*>(chunk_data)), chunk_size);
+
+		const char* digest = reinterpret_cast<const char*>(chunk_hash.raw_digest_int());
+
+		_u32 idx;
+		bool found;
+		if (run_len > 0
+			&& run_start + run_len < sorted_idx.size()
+			&& memcmp(hashes + (run_start + run_len)*big_hash_size, digest, big_hash_size) == 0)
+		{
+			idx = run_start + run_len;
+			found = true;
+		}
+		else
+		{
+			found = find_cdc_hash(hashes, sorted_idx, digest, idx);
+		}
+
+		if (found
+			&& run_len > 0
+			&& idx == run_start + run_len
+			&& run_len < c_cdc_max_match_run)
+		{
+			++run_len;
+		}
+		else
+		{
+			if (run_len > 0
+				&& !sendCdcMatch(run_start, run_len))
+			{
+				return false;
+			}
+			run_len = 0;
+
+			if (found)
+			{
+				run_start = idx;
+				run_len = 1;
+			}
+			else
+			{
+				char header[1 + sizeof(_u32)];
+				header[0] = ID_CDC_DATA;
+				_u32 le_size = little_endian(chunk_size);
+				memcpy(header + 1, &le_size, sizeof(le_size));
+
+				if (parent->SendInt(header, sizeof(header)) == SOCKET_ERROR
+					|| parent->SendInt(chunk_data, chunk_size) == SOCKET_ERROR)
+				{
+					Log("Error sending cdc data", LL_DEBUG);
+					return false;
+				}
+
+				if (FileServ::isPause()) Sleep(500);
+			}
+		}
+
+		buf_start += chunk_size;
+	}
+
+	if (run_len > 0
+		&& !sendCdcMatch(run_start, run_len))
+	{
+		return false;
+	}
+
+	file_hash.finalize();
+
+	char end_msg[1 + big_hash_size];
+	end_msg[0] = ID_CDC_END;
+	memcpy(end_msg + 1, file_hash.raw_digest_int(), big_hash_size);
+
+	if (parent->SendInt(end_msg, sizeof(end_msg), true) == SOCKET_ERROR)
+	{
+		Log("Error sending cdc end", LL_DEBUG);
+		return false;
+	}
+
+	return true;
+}
+
+bool ChunkSendThread::sendCdcMatch(_u32 first_idx, _u32 count)
+{
+	char msg[1 + 2 * sizeof(_u32)];
+	msg[0] = ID_CDC_MATCH;
+	_u32 le_first_idx = little_endian(first_idx);
+	_u32 le_count = little_endian(count);
+	memcpy(msg + 1, &le_first_idx, sizeof(_u32));
+	memcpy(msg + 1 + sizeof(_u32), &le_count, sizeof(_u32));
+
+	//Flushed so that the server sees progress while unchanged data is read
+	if (parent->SendInt(msg, sizeof(msg), true) == SOCKET_ERROR)
+	{
+		Log("Error sending cdc match", LL_DEBUG);
+		return false;
+	}
+	return true;
+}
+
 bool ChunkSendThread::sendError( _u32 errorcode1, _u32 errorcode2 )
 {
 	char buffer[1+sizeof(_u32)*2];
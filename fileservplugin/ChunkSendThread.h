@@ -6,6 +6,7 @@
 #include "../Interface/File.h"
 #include "../md5.h"
 #include <memory>
+#include <vector>
 
 class ScopedPipeFileUser;
 class CClientThread;
@@ -21,8 +22,12 @@ public:
 
 	bool sendChunk(SChunk *chunk);
 
+	bool sendCdc(const std::vector<char>& cdc_hashes);
+
 private:
 
+	bool sendCdcMatch(_u32 first_idx, _u32 count);
+
 	bool sendError(_u32 errorcode1, _u32 errorcode2);
 
 	CClientThread *parent;
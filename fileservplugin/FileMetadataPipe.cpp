@@ -71,7 +71,7 @@ FileMetadataPipe::FileMetadataPipe( IPipe* pipe, const std::string& cmd )
 #endif
 	metadata_state(MetadataState_Wait),
 		errpipe(Server->createMemoryPipe()),
-	metadata_file(NULL)
+	metadata_file(NULL), transmit_file(NULL), transmit_wait_pipe(NULL)
 {
 	metadata_buffer.resize(4096);
 	init();
@@ -658,6 +658,13 @@ void FileMetadataPipe::cleanupOnForceShutdown()
 		PipeSessions::fileMetadataDone(public_fn.substr(1), server_token);
 	}
 
+	if (transmit_wait_pipe != NULL)
+	{
+		transmit_wait_pipe->Write(std::string());
+		transmit_wait_pipe = NULL;
+		transmit_file = NULL;
+	}
+
 	metadata_file.reset();
 
 #ifdef _WIN32
@@ -711,6 +718,10 @@ void FileMetadataPipe::cleanupOnForceShutdown()
 				&& msg_data.getVoidPtr(reinterpret_cast<void**>(&transmit_wait_pipe))
 				&& msg_data.getStr(&server_token))
 			{
+				//The sender waits for the file to be transmitted before freeing it
+				transmit_wait_pipe->Write(std::string());
+				transmit_wait_pipe = NULL;
+				transmit_file = NULL;
 				PipeSessions::fileMetadataDone(public_fn.substr(1), server_token);
 			}
 		}
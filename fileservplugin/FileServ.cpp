@@ -35,6 +35,7 @@ IFileServ::ITokenCallbackFactory* FileServ::token_callback_factory = NULL;
 std::map<std::string, std::string> FileServ::fn_redirects;
 std::map<std::string, size_t> FileServ::active_shares;
 FileServ::IReadErrorCallback* FileServ::read_error_callback = NULL;
+FileServ::IFileOpenCallback* FileServ::file_open_callback = NULL;
 std::vector<std::string> FileServ::read_error_files;
 std::map<std::pair<std::string, std::string>, IFileServ::CbtHashFileInfo> FileServ::cbt_hash_files;
 
@@ -361,6 +362,21 @@ void FileServ::registerReadErrorCallback(IReadErrorCallback * cb)
 	read_error_callback = cb;
 }
 
+void FileServ::registerFileOpenCallback(IFileOpenCallback * cb)
+{
+	file_open_callback = cb;
+}
+
+IFile* FileServ::openVirtualFile(const std::string & path)
+{
+	if (file_open_callback == NULL)
+	{
+		return NULL;
+	}
+
+	return file_open_callback->openVirtualFile(path);
+}
+
 void FileServ::clearReadErrors()
 {
 	IScopedLock lock(mutex);
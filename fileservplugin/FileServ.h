@@ -59,6 +59,10 @@ public:
 
 	virtual void registerReadErrorCallback(IReadErrorCallback* cb);
 
+	virtual void registerFileOpenCallback(IFileOpenCallback* cb);
+
+	static IFile* openVirtualFile(const std::string& path);
+
 	void clearReadErrors();
 
 	static void clearReadErrorFile(const std::string& filepath);
@@ -107,6 +111,8 @@ private:
 
 	static IReadErrorCallback* read_error_callback;
 
+	static IFileOpenCallback* file_open_callback;
+
 	static std::vector<std::string> read_error_files;
 
 	static std::map<std::pair<std::string, std::string>, CbtHashFileInfo> cbt_hash_files;
@@ -40,6 +40,13 @@ public:
 		virtual void onReadError(const std::string& sharename, const std::string& filepath, int64 pos, const std::string& msg) = 0;
 	};
 
+	class IFileOpenCallback
+	{
+	public:
+		//Returns NULL if the file should be sent as stored on disk
+		virtual IFile* openVirtualFile(const std::string& path) = 0;
+	};
+
 
 	virtual void shareDir(const std::string &name, const std::string &path, const std::string& identity, bool allow_exec)=0;
 	virtual bool removeDir(const std::string &name, const std::string& identity)=0;
@@ -59,6 +66,7 @@ public:
 	virtual bool hasActiveTransfers(const std::string& sharename, const std::string& server_token) = 0;
 	virtual bool registerFnRedirect(const std::string& source_fn, const std::string& target_fn) = 0;
 	virtual void registerReadErrorCallback(IReadErrorCallback* cb) = 0;
+	virtual void registerFileOpenCallback(IFileOpenCallback* cb) = 0;
 	virtual void registerScriptPipeFile(const std::string& script_fn, IPipeFileExt* pipe_file) = 0;
 	virtual void clearReadErrors() = 0;
 
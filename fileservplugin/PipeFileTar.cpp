@@ -104,6 +104,11 @@ namespace
 		return strtoll(extract_digits(val).c_str(), NULL, 8);
 	}
 
+	//Small files are sent from the stdout buffer of the pipe while the next headers are parsed.
+	//Their data has to stay well inside the part of the buffer that is kept after reading.
+	const size_t c_max_pending_files = 64;
+	const int64 c_max_pending_bytes = 8 * 1024 * 1024;
+
 	bool check_header_checksum(const std::string& header)
 	{
 		int64 checksum = extract_number(header, 148, 8);
@@ -137,20 +142,23 @@ namespace
 
 PipeFileTar::PipeFileTar(const std::string & pCmd, int backupnum, int64 fn_random, std::string output_fn, const std::string& server_token, const std::string& identity)
 	: pipe_file(new PipeFileStore(new PipeFile(pCmd))), file_offset(0), mutex(Server->createMutex()), backupnum(backupnum), has_next(false), output_fn(output_fn), fn_random(fn_random),
-	server_token(server_token), identity(identity), hash_pos(0)
+	server_token(server_token), identity(identity), hash_pos(0), pending_bytes(0)
 {
 	sha_def_init(&sha_ctx);
 }
 
 PipeFileTar::PipeFileTar(PipeFileStore* pipe_file, const STarFile& tar_file, int64 file_offset, int backupnum, int64 fn_random, std::string output_fn, const std::string& server_token, const std::string& identity)
 	: pipe_file(pipe_file), tar_file(tar_file), file_offset(file_offset), mutex(Server->createMutex()), backupnum(backupnum), has_next(false), output_fn(output_fn), fn_random(fn_random),
-	server_token(server_token), identity(identity), hash_pos(0)
+	server_token(server_token), identity(identity), hash_pos(0), pending_bytes(0)
 {
 	sha_def_init(&sha_ctx);
 }
 
 PipeFileTar::~PipeFileTar()
 {
+	//The metadata pipe may still be sending pending small files
+	waitPendingFiles(0, 0);
+
 	pipe_file->decr();
 	if (pipe_file->refcount == 0)
 	{
@@ -670,6 +678,10 @@ std::string PipeFileTar::getStdErr()
 
 				if (!is_dir && !is_symlink && !is_special)
 				{
+					lock.relock(NULL);
+					waitPendingFiles(0, 0);
+					lock.relock(mutex.get());
+
 					pipe_file->inc();
 					has_next = true;
 					PipeSessions::injectPipeSession(remote_fn,
@@ -700,8 +712,28 @@ std::string PipeFileTar::getStdErr()
 			{
 				++small_files;
 				std::string curr_metadata = buildCurrMetadata();
+
+				SPendingFile pending_file;
+				pipe_file->inc();
+				pending_file.file = new PipeFileTar(pipe_file, tar_file, file_offset, backupnum, fn_random, output_fn, server_token, identity);
+				pending_file.waitpipe = Server->createMemoryPipe();
+				pending_file.size = size;
+
 				lock.relock(NULL);
-				PipeSessions::transmitFileMetadataAndFiledataWait(public_fn, curr_metadata, server_token, identity, this);
+
+				if (PipeSessions::transmitFileMetadataAndFiledata(public_fn, curr_metadata, server_token, identity,
+					pending_file.file, pending_file.waitpipe))
+				{
+					pending_files.push_back(pending_file);
+					pending_bytes += size;
+					waitPendingFiles(c_max_pending_files, c_max_pending_bytes);
+				}
+				else
+				{
+					delete pending_file.file;
+					delete pending_file.waitpipe;
+				}
+
 				lock.relock(mutex.get());
 			}
 		}
@@ -712,6 +744,10 @@ std::string PipeFileTar::getStdErr()
 		}
 	}
 
+	lock.relock(NULL);
+	waitPendingFiles(0, 0);
+	lock.relock(mutex.get());
+
 	if (small_files > 0)
 	{
 		CWData smallfilemsg;
@@ -726,6 +762,24 @@ std::string PipeFileTar::getStdErr()
 	return stderr_ret;
 }
 
+void PipeFileTar::waitPendingFiles(size_t max_files, int64 max_bytes)
+{
+	while (!pending_files.empty()
+		&& (pending_files.size() > max_files
+			|| pending_bytes > max_bytes))
+	{
+		SPendingFile& pending_file = pending_files.front();
+
+		std::string read_ret;
+		pending_file.waitpipe->Read(&read_ret);
+
+		pending_bytes -= pending_file.size;
+		delete pending_file.file;
+		delete pending_file.waitpipe;
+		pending_files.pop_front();
+	}
+}
+
 bool PipeFileTar::getExitCode(int & exit_code)
 {
 	if (has_next)
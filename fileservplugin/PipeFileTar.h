@@ -4,6 +4,7 @@
 #include "PipeFile.h"
 #include <memory>
 #include <set>
+#include <deque>
 #include <sys/stat.h>
 #include "../stringtools.h"
 
@@ -124,10 +125,19 @@ public:
 
 private:
 
+	struct SPendingFile
+	{
+		PipeFileTar* file;
+		IPipe* waitpipe;
+		int64 size;
+	};
+
 	std::string buildCurrMetadata();
 
 	bool readHeader(bool* has_error);
 
+	void waitPendingFiles(size_t max_files, int64 max_bytes);
+
 	int64 file_offset;	
 
 	STarFile tar_file;
@@ -149,5 +159,8 @@ private:
 
 	std::string server_token;
 	std::string identity;
+
+	std::deque<SPendingFile> pending_files;
+	int64 pending_bytes;
 };
 
@@ -465,10 +465,21 @@ void PipeSessions::transmitFileMetadata(const std::string & public_fn, const std
 }
 
 void PipeSessions::transmitFileMetadataAndFiledataWait(const std::string & public_fn, const std::string & metadata, const std::string & server_token, const std::string & identity, IFile* file)
+{
+	std::auto_ptr<IPipe> waitpipe(Server->createMemoryPipe());
+
+	if (transmitFileMetadataAndFiledata(public_fn, metadata, server_token, identity, file, waitpipe.get()))
+	{
+		std::string read_ret;
+		waitpipe->Read(&read_ret);
+	}
+}
+
+bool PipeSessions::transmitFileMetadataAndFiledata(const std::string & public_fn, const std::string & metadata, const std::string & server_token, const std::string & identity, IFile * file, IPipe * waitpipe)
 {
 	if (public_fn.empty() || next(public_fn, 0, "urbackup/"))
 	{
-		return;
+		return false;
 	}
 
 	std::string sharename = getuntil("/", public_fn);
@@ -487,8 +498,7 @@ void PipeSessions::transmitFileMetadataAndFiledataWait(const std::string & publi
 	datamsg.addChar(METADATA_PIPE_SEND_RAW_FILEDATA);
 	datamsg.addString("f" + public_fn);
 	datamsg.addVoidPtr(file);
-	std::auto_ptr<IPipe> waitpipe(Server->createMemoryPipe());
-	datamsg.addVoidPtr(waitpipe.get());
+	datamsg.addVoidPtr(waitpipe);
 	datamsg.addString(server_token);
 
 	IScopedLock lock(mutex);
@@ -505,13 +515,12 @@ void PipeSessions::transmitFileMetadataAndFiledataWait(const std::string & publi
 
 		it->second.input_pipe->Write(metadatamsg.getDataPtr(), metadatamsg.getDataSize());
 
-		lock.relock(NULL);
-		std::string read_ret;
-		waitpipe->Read(&read_ret);
+		return true;
 	}
 	else
 	{
 		Server->Log("No active metadata listener for \"urbackup/FILE_METADATA|" + server_token + "\" (send wait)", LL_WARNING);
+		return false;
 	}
 }
 
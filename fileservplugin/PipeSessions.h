@@ -73,6 +73,9 @@ public:
 	static void transmitFileMetadataAndFiledataWait(const std::string& public_fn, const std::string& metadata,
 		const std::string& server_token, const std::string& identity, IFile* file);
 
+	static bool transmitFileMetadataAndFiledata(const std::string& public_fn, const std::string& metadata,
+		const std::string& server_token, const std::string& identity, IFile* file, IPipe* waitpipe);
+
 	static void fileMetadataDone(const std::string& public_fn, const std::string& server_token);
 
 	static bool isShareActive(const std::string& sharename, const std::string& server_token);
@@ -14,4 +14,8 @@ const unsigned int chunkhash_single_size=big_hash_size+small_hash_size*(c_checkp
 
 const unsigned int c_reconnection_tries=30;
 
+const unsigned char c_blockdiff_flag_cdc=2;
+const unsigned int c_cdc_hashes_per_packet=4096;
+const unsigned int c_cdc_max_match_run=256;
+
 #endif //CHUNK_SETTINGS_H
\ No newline at end of file
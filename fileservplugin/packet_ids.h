@@ -28,10 +28,14 @@ const uchar ID_BLOCK_REQUEST=9;
 		const uchar ID_NO_CHANGE=15;
 		const uchar ID_BLOCK_HASH=16;
 		const uchar ID_BLOCK_ERROR=18;
+		const uchar ID_CDC_MATCH=21;
+		const uchar ID_CDC_DATA=22;
+		const uchar ID_CDC_END=23;
 const uchar ID_GET_FILE_HASH_AND_METADATA=10;
 		const uchar ID_FILE_HASH_AND_METADATA=17;
 const uchar ID_INFORM_METADATA_STREAM_END=11;
 const uchar ID_FLUSH_SOCKET=13;
+const uchar ID_CDC_HASHES=19;
 const uchar ID_SCRIPT_FINISH=14;
 const uchar ID_FREE_SERVER_FILE = 18;
 
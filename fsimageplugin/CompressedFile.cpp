@@ -36,7 +36,7 @@ const size_t c_header_size = sizeof(headerMagic) + sizeof(__int64) + sizeof(__in
 
 CompressedFile::CompressedFile( std::string pFilename, int pMode )
 	: hotCache(NULL), error(false), currentPosition(0),
-	  finished(false), filesize(0), noMagic(false)
+	  finished(false), filesize(0), noMagic(false), mutex(Server->createMutex())
 {
 	uncompressedFile = Server->openFile(pFilename, pMode);
 
@@ -71,7 +71,7 @@ CompressedFile::CompressedFile( std::string pFilename, int pMode )
 CompressedFile::CompressedFile(IFile* file, bool openExisting, bool readOnly)
 	: hotCache(NULL), error(false), currentPosition(0),
 	finished(false), uncompressedFile(file), filesize(0), readOnly(readOnly),
-	noMagic(false)
+	noMagic(false), mutex(Server->createMutex())
 {
 	if(openExisting)
 	{
@@ -98,6 +98,7 @@ CompressedFile::~CompressedFile()
 	}
 
 	delete uncompressedFile;
+	Server->destroy(mutex);
 }
 
 bool CompressedFile::hasError()
@@ -189,6 +190,8 @@ bool CompressedFile::Seek( _i64 spos )
 
 _u32 CompressedFile::Read(_i64 spos, char* buffer, _u32 bsize, bool *has_error)
 {
+	IScopedLock lock(mutex);
+
 	if(!Seek(spos))
 	{
 		if (has_error) *has_error = true;
@@ -263,6 +266,8 @@ std::string CompressedFile::Read( _u32 tr, bool *has_error)
 
 std::string CompressedFile::Read(_i64 spos, _u32 tr, bool *has_error)
 {
+	IScopedLock lock(mutex);
+
 	if(!Seek(spos))
 	{
 		if (has_error) *has_error = true;
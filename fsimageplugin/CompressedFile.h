@@ -5,6 +5,7 @@
 
 #include "../Interface/Server.h"
 #include "../Interface/File.h"
+#include "../Interface/Mutex.h"
 #include "LRUMemCache.h"
 
 
@@ -71,4 +72,6 @@ private:
 	bool readOnly;
 
 	bool noMagic;
+
+	IMutex* mutex;
 };
@@ -23,6 +23,8 @@ public:
 	virtual ~IVHDFile() {}
 	virtual bool Seek(_i64 offset)=0;
 	virtual bool Read(char* buffer, size_t bsize, size_t &read)=0;
+	//Does not change the current position. Safe to call from multiple threads on read only files
+	virtual bool Read(_i64 offset, char* buffer, size_t bsize, size_t &read)=0;
 	virtual _u32 Write(const char *buffer, _u32 bsize, bool *has_error=NULL)=0;
 	virtual bool isOpen(void)=0;
 	virtual uint64 getSize(void)=0;
@@ -278,6 +278,23 @@ bool CowFile::Read(char* buffer, size_t bsize, size_t& read_bytes)
 	}
 }
 
+bool CowFile::Read(_i64 offset, char* buffer, size_t bsize, size_t& read_bytes)
+{
+	if(!is_open) return false;
+
+	ssize_t r=pread64(fd, buffer, bsize, offset);
+	if( r<0 )
+	{
+		read_bytes=0;
+		return false;
+	}
+	else
+	{
+		read_bytes=r;
+		return true;
+	}
+}
+
 _u32 CowFile::Write(const char* buffer, _u32 bsize, bool *has_error)
 {
 	if(!is_open) return 0;
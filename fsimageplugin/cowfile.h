@@ -13,6 +13,7 @@ public:
 
 	virtual bool Seek(_i64 offset);
 	virtual bool Read(char* buffer, size_t bsize, size_t &read_bytes);
+	virtual bool Read(_i64 offset, char* buffer, size_t bsize, size_t &read_bytes);
 	virtual _u32 Write(const char *buffer, _u32 bsize, bool *has_error);
 	virtual bool isOpen(void);
 	virtual uint64 getSize(void);
@@ -24,6 +24,7 @@
 #include <memory.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <memory>
 #include "FileWrapper.h"
 #include "ClientBitmap.h"
 
@@ -42,9 +43,27 @@ const int64 unixtime_offset=946684800;
 
 const unsigned int sector_size=512;
 
+namespace
+{
+	const int c_block_unresolved=-3;
+	const int c_block_mixed=-2;
+	const int c_block_zero=-1;
+	const unsigned char c_sector_zero=0xFF;
+	const size_t c_max_mixed_blocks=4096;
+
+	const char blockmap_magic[]="URBACKUP VHD BLOCKMAP#1.0";
+	const unsigned char c_map_zero=0xFF;
+	const unsigned char c_map_mixed=0xFE;
+
+	const unsigned char c_bitmap_unknown=0;
+	const unsigned char c_bitmap_full=1;
+	const unsigned char c_bitmap_partial=2;
+	const unsigned char c_bitmap_empty=3;
+}
+
 VHDFile::VHDFile(const std::string &fn, bool pRead_only, uint64 pDstsize, unsigned int pBlocksize, bool fast_mode, bool compress)
 	: dstsize(pDstsize), blocksize(pBlocksize), fast_mode(fast_mode), bitmap_offset(0), bitmap_dirty(false), volume_offset(0), finished(false),
-	file(NULL)
+	file(NULL), block_map_mutex(Server->createSharedMutex()), read_chain_init(false), read_chain_flat(false)
 {
 	compressed_file=NULL;
 	parent=NULL;
@@ -138,7 +157,8 @@ VHDFile::VHDFile(const std::string &fn, bool pRead_only, uint64 pDstsize, unsign
 }
 
 VHDFile::VHDFile(const std::string &fn, const std::string &parent_fn, bool pRead_only, bool fast_mode, bool compress, uint64 pDstsize)
-	: fast_mode(fast_mode), bitmap_offset(0), bitmap_dirty(false), volume_offset(0), finished(false), file(NULL)
+	: fast_mode(fast_mode), bitmap_offset(0), bitmap_dirty(false), volume_offset(0), finished(false), file(NULL),
+	block_map_mutex(Server->createSharedMutex()), read_chain_init(false), read_chain_flat(false)
 {
 	compressed_file=NULL;
 	curr_offset=0;
@@ -248,6 +268,7 @@ VHDFile::~VHDFile()
 	}
 	delete file;
 	delete parent;
+	Server->destroy(block_map_mutex);
 }
 
 bool VHDFile::write_header(bool diff)
@@ -883,6 +904,471 @@ bool VHDFile::Read(char* buffer, size_t bsize, size_t &read)
 	return true;
 }
 
+bool VHDFile::Read(_i64 offset, char* buffer, size_t bsize, size_t &read)
+{
+	read=0;
+
+	bool init;
+	{
+		IScopedReadLock lock(block_map_mutex);
+		init=read_chain_init;
+	}
+
+	if(!init)
+	{
+		IScopedWriteLock lock(block_map_mutex);
+		if(!read_chain_init)
+		{
+			initReadChain();
+		}
+	}
+
+	if(!read_chain_flat)
+	{
+		IScopedWriteLock lock(block_map_mutex);
+		uint64 orig_offset=curr_offset;
+		Seek(offset);
+		bool ret=Read(buffer, bsize, read);
+		curr_offset=orig_offset;
+		return ret;
+	}
+
+	uint64 pos=(uint64)offset+volume_offset;
+
+	if(pos>=dstsize)
+	{
+		return false;
+	}
+
+	size_t toread=(size_t)(std::min)((uint64)bsize, dstsize-pos);
+	std::vector<unsigned char> sector_levels;
+
+	while(read<toread)
+	{
+		unsigned int block=(unsigned int)(pos/blocksize);
+		size_t blockoffset=(size_t)(pos%blocksize);
+		size_t wantread=(std::min)(toread-read, (size_t)blocksize-blockoffset);
+
+		int level=getBlockLevel(block, sector_levels);
+
+		if(level==c_block_unresolved)
+		{
+			return false;
+		}
+		else if(level==c_block_zero)
+		{
+			memset(&buffer[read], 0, wantread);
+		}
+		else if(level>=0)
+		{
+			if(!readBlockData(level, block, blockoffset, &buffer[read], wantread))
+			{
+				return false;
+			}
+		}
+		else
+		{
+			size_t done=0;
+			while(done<wantread)
+			{
+				size_t run_start=blockoffset+done;
+				unsigned char slevel=sector_levels[run_start/sector_size];
+				size_t run_end=(run_start/sector_size+1)*sector_size;
+				while(run_end<blockoffset+wantread
+					&& sector_levels[run_end/sector_size]==slevel)
+				{
+					run_end+=sector_size;
+				}
+				size_t run=(std::min)(run_end, blockoffset+wantread)-run_start;
+
+				if(slevel==c_sector_zero)
+				{
+					memset(&buffer[read+done], 0, run);
+				}
+				else if(!readBlockData(slevel, block, run_start, &buffer[read+done], run))
+				{
+					return false;
+				}
+
+				done+=run;
+			}
+		}
+
+		read+=wantread;
+		pos+=wantread;
+	}
+
+	return true;
+}
+
+void VHDFile::initReadChain()
+{
+	read_chain_init=true;
+	read_chain_flat=read_only;
+
+	VHDFile* curr=this;
+	while(curr!=NULL)
+	{
+		if(!curr->read_only
+			|| curr->blocksize!=blocksize)
+		{
+			read_chain_flat=false;
+		}
+		read_chain.push_back(curr);
+		curr=curr->parent;
+	}
+
+	if(read_chain.size()>=c_sector_zero)
+	{
+		read_chain_flat=false;
+	}
+
+	if(read_chain_flat)
+	{
+		block_levels.resize(batsize, c_block_unresolved);
+		loadBlockMap();
+	}
+}
+
+bool VHDFile::loadBlockMap()
+{
+	std::auto_ptr<IFile> map_file(Server->openFile(backing_file->getFilename()+".blockmap", MODE_READ));
+	if(map_file.get()==NULL)
+	{
+		return false;
+	}
+
+	size_t header_size=sizeof(blockmap_magic)+3*sizeof(_u32);
+	if(map_file->Size()!=(_i64)(header_size+read_chain.size()*16+batsize))
+	{
+		return false;
+	}
+
+	std::string data=map_file->Read((_u32)map_file->Size());
+	if(data.size()!=(size_t)map_file->Size()
+		|| memcmp(data.data(), blockmap_magic, sizeof(blockmap_magic))!=0)
+	{
+		return false;
+	}
+
+	_u32 map_blocksize, map_batsize, map_depth;
+	memcpy(&map_blocksize, data.data()+sizeof(blockmap_magic), sizeof(_u32));
+	memcpy(&map_batsize, data.data()+sizeof(blockmap_magic)+sizeof(_u32), sizeof(_u32));
+	memcpy(&map_depth, data.data()+sizeof(blockmap_magic)+2*sizeof(_u32), sizeof(_u32));
+
+	if(little_endian(map_blocksize)!=blocksize
+		|| little_endian(map_batsize)!=batsize
+		|| little_endian(map_depth)!=read_chain.size())
+	{
+		return false;
+	}
+
+	for(size_t i=0;i<read_chain.size();++i)
+	{
+		if(memcmp(data.data()+header_size+i*16, read_chain[i]->footer.uid, 16)!=0)
+		{
+			Server->Log("Block map of VHD file \""+getFilename()+"\" does not match the parent chain. Ignoring it.", LL_INFO);
+			return false;
+		}
+	}
+
+	const unsigned char* entries=reinterpret_cast<const unsigned char*>(data.data()+header_size+read_chain.size()*16);
+	for(unsigned int i=0;i<batsize;++i)
+	{
+		if(entries[i]==c_map_zero)
+		{
+			block_levels[i]=c_block_zero;
+		}
+		else if(entries[i]==c_map_mixed)
+		{
+			block_levels[i]=c_block_mixed;
+		}
+		else if(entries[i]<read_chain.size())
+		{
+			block_levels[i]=entries[i];
+		}
+		else
+		{
+			block_levels.assign(batsize, c_block_unresolved);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool VHDFile::writeBlockMap()
+{
+	std::string map_fn=backing_file->getFilename()+".blockmap";
+
+	if(parent!=NULL)
+	{
+		{
+			IScopedWriteLock lock(parent->block_map_mutex);
+			if(!parent->read_chain_init)
+			{
+				parent->initReadChain();
+			}
+		}
+
+		if(!parent->read_chain_flat
+			|| parent->blocksize!=blocksize
+			|| parent->read_chain.size()+1>=c_map_mixed)
+		{
+			Server->deleteFile(map_fn);
+			return false;
+		}
+	}
+
+	std::string data(blockmap_magic, sizeof(blockmap_magic));
+	_u32 header_vals[3]={little_endian((_u32)blocksize), little_endian((_u32)batsize), 0};
+	size_t depth=0;
+	std::string uids;
+	for(VHDFile* curr=this;curr!=NULL;curr=curr->parent)
+	{
+		uids.append(curr->footer.uid, 16);
+		++depth;
+	}
+	header_vals[2]=little_endian((_u32)depth);
+	data.append(reinterpret_cast<char*>(header_vals), sizeof(header_vals));
+	data+=uids;
+
+	size_t entries_off=data.size();
+	data.resize(entries_off+batsize, (char)c_map_zero);
+
+	std::vector<unsigned char> own_bitmap(bitmap_size);
+	for(unsigned int block=0;block<batsize;++block)
+	{
+		unsigned char state=c_bitmap_empty;
+		unsigned int bat_off=big_endian(bat[block]);
+		if(bat_off!=0xFFFFFFFF)
+		{
+			state=block<block_bitmap_state.size() ? block_bitmap_state[block] : c_bitmap_unknown;
+			if(state==c_bitmap_unknown)
+			{
+				bool has_error=false;
+				if(file->Read((int64)bat_off*sector_size, reinterpret_cast<char*>(own_bitmap.data()), bitmap_size, &has_error)!=bitmap_size)
+				{
+					Server->Log("Error reading bitmap while creating block map of VHD file \""+getFilename()+"\"", LL_WARNING);
+					Server->deleteFile(map_fn);
+					return false;
+				}
+				state=bitmapState(own_bitmap.data(), block);
+			}
+		}
+
+		unsigned char entry=c_map_zero;
+		if(state==c_bitmap_full)
+		{
+			entry=0;
+		}
+		else if(state==c_bitmap_partial)
+		{
+			entry=c_map_mixed;
+		}
+		else if(parent!=NULL && block<parent->batsize)
+		{
+			int level=parent->getResolvedLevel(block);
+			if(level==c_block_unresolved)
+			{
+				Server->deleteFile(map_fn);
+				return false;
+			}
+			else if(level==c_block_mixed)
+			{
+				entry=c_map_mixed;
+			}
+			else if(level>=0)
+			{
+				entry=(unsigned char)(level+1);
+			}
+		}
+		data[entries_off+block]=(char)entry;
+	}
+
+	std::auto_ptr<IFile> map_file(Server->openFile(map_fn, MODE_WRITE));
+	if(map_file.get()==NULL
+		|| map_file->Write(data)!=data.size())
+	{
+		Server->Log("Error writing block map of VHD file \""+getFilename()+"\"", LL_WARNING);
+		map_file.reset();
+		Server->deleteFile(map_fn);
+		return false;
+	}
+
+	return true;
+}
+
+unsigned char VHDFile::bitmapState(const unsigned char* bm, unsigned int block)
+{
+	uint64 block_start=(uint64)block*blocksize;
+	if(block_start>=dstsize)
+	{
+		return c_bitmap_empty;
+	}
+
+	size_t n_sectors=(size_t)(((std::min)((uint64)blocksize, dstsize-block_start)+sector_size-1)/sector_size);
+	bool has_set=false;
+	bool has_unset=false;
+
+	size_t j=0;
+	for(;j+8<=n_sectors;j+=8)
+	{
+		if(bm[j/8]==0xFF) has_set=true;
+		else if(bm[j/8]==0) has_unset=true;
+		else return c_bitmap_partial;
+	}
+	for(;j<n_sectors;++j)
+	{
+		if((bm[j/8] & (1<<(7-j%8)))!=0) has_set=true;
+		else has_unset=true;
+	}
+
+	if(has_set && has_unset) return c_bitmap_partial;
+	return has_set ? c_bitmap_full : c_bitmap_empty;
+}
+
+int VHDFile::getResolvedLevel(unsigned int block)
+{
+	{
+		IScopedReadLock lock(block_map_mutex);
+		int level=block_levels[block];
+		if(level!=c_block_unresolved)
+		{
+			return level;
+		}
+	}
+
+	std::vector<unsigned char> sector_levels;
+	int level=resolveBlock(block, sector_levels);
+
+	if(level!=c_block_unresolved)
+	{
+		IScopedWriteLock lock(block_map_mutex);
+		block_levels[block]=level;
+	}
+
+	return level;
+}
+
+int VHDFile::getBlockLevel(unsigned int block, std::vector<unsigned char>& sector_levels)
+{
+	{
+		IScopedReadLock lock(block_map_mutex);
+
+		int level=block_levels[block];
+		if(level==c_block_mixed)
+		{
+			std::map<unsigned int, std::vector<unsigned char> >::iterator it=mixed_blocks.find(block);
+			if(it!=mixed_blocks.end())
+			{
+				sector_levels=it->second;
+				return level;
+			}
+		}
+		else if(level!=c_block_unresolved)
+		{
+			return level;
+		}
+	}
+
+	int level=resolveBlock(block, sector_levels);
+
+	if(level==c_block_unresolved)
+	{
+		return level;
+	}
+
+	IScopedWriteLock lock(block_map_mutex);
+	block_levels[block]=level;
+	if(level==c_block_mixed
+		&& mixed_blocks.size()<c_max_mixed_blocks)
+	{
+		mixed_blocks[block]=sector_levels;
+	}
+
+	return level;
+}
+
+int VHDFile::resolveBlock(unsigned int block, std::vector<unsigned char>& sector_levels)
+{
+	uint64 block_start=(uint64)block*blocksize;
+	size_t n_sectors=(size_t)(((std::min)((uint64)blocksize, dstsize-block_start)+sector_size-1)/sector_size);
+	sector_levels.assign(n_sectors, c_sector_zero);
+
+	size_t n_assigned=0;
+	std::vector<unsigned char> level_bitmap(bitmap_size);
+
+	for(size_t i=0;i<read_chain.size() && n_assigned<n_sectors;++i)
+	{
+		VHDFile* vhd=read_chain[i];
+		if(block>=vhd->batsize)
+		{
+			continue;
+		}
+
+		unsigned int bat_off=big_endian(vhd->bat[block]);
+		if(bat_off==0xFFFFFFFF)
+		{
+			continue;
+		}
+
+		uint64 dataoffset=(uint64)bat_off*(uint64)sector_size;
+		bool has_error=false;
+		if(vhd->file->Read((int64)dataoffset, reinterpret_cast<char*>(level_bitmap.data()), bitmap_size, &has_error)!=bitmap_size)
+		{
+			Server->Log("Error reading bitmap of block "+convert(block)+" in VHD file \""+vhd->getFilename()+"\"", LL_ERROR);
+			return c_block_unresolved;
+		}
+
+		for(size_t j=0;j<n_sectors;++j)
+		{
+			if(sector_levels[j]==c_sector_zero
+				&& (level_bitmap[j/8] & (1<<(7-j%8)))!=0)
+			{
+				sector_levels[j]=(unsigned char)i;
+				++n_assigned;
+			}
+		}
+	}
+
+	if(n_assigned==0)
+	{
+		return c_block_zero;
+	}
+
+	for(size_t j=1;j<n_sectors;++j)
+	{
+		if(sector_levels[j]!=sector_levels[0])
+		{
+			return c_block_mixed;
+		}
+	}
+
+	return sector_levels[0];
+}
+
+bool VHDFile::readBlockData(size_t level, unsigned int block, size_t blockoffset, char* buffer, size_t bsize)
+{
+	VHDFile* vhd=read_chain[level];
+	uint64 dataoffset=(uint64)big_endian(vhd->bat[block])*(uint64)sector_size;
+	int64 spos=(int64)(dataoffset+vhd->bitmap_size+blockoffset);
+
+	bool has_error=false;
+	_u32 rc=vhd->file->Read(spos, buffer, (_u32)bsize, &has_error);
+	if(rc!=bsize)
+	{
+		if(has_error)
+		{
+			Server->Log("Error reading from VHD file \""+vhd->getFilename()+"\" at position " + convert(spos) + ".", LL_ERROR);
+			return false;
+		}
+		memset(&buffer[rc], 0, bsize-rc);
+	}
+
+	return true;
+}
+
 _u32 VHDFile::Write(const char *buffer, _u32 bsize, bool *has_error)
 {
 	if(read_only)
@@ -1123,6 +1609,15 @@ bool VHDFile::has_block(bool use_parent)
 
 void VHDFile::switchBitmap(uint64 new_offset)
 {
+	if(!read_only && currblock<batsize)
+	{
+		if(block_bitmap_state.size()<batsize)
+		{
+			block_bitmap_state.resize(batsize, c_bitmap_unknown);
+		}
+		block_bitmap_state[currblock]=bitmapState(bitmap.data(), (unsigned int)currblock);
+	}
+
 	if(fast_mode && !read_only && bitmap_dirty && bitmap_offset!=0)
 	{
 		file->Seek(bitmap_offset);
@@ -1350,6 +1845,11 @@ bool VHDFile::finish()
 		}
 	}
 
+	if(!read_only)
+	{
+		writeBlockMap();
+	}
+
 	if(parent!=NULL)
 	{
 		if(!parent->finish())
@@ -1,6 +1,9 @@
 #include "../Interface/Server.h"
 #include "../Interface/File.h"
+#include "../Interface/SharedMutex.h"
 #include "IVHDFile.h"
+#include <map>
+#include <vector>
 
 #ifndef sun
 #pragma pack(push)
@@ -84,6 +87,7 @@ public:
 	
 	bool Seek(_i64 offset);
 	bool Read(char* buffer, size_t bsize, size_t &read);
+	bool Read(_i64 offset, char* buffer, size_t bsize, size_t &read);
 	uint64 getSize(void);
 	uint64 getRealSize(void);
 	uint64 usedSize(void);
@@ -147,6 +151,15 @@ private:
 
 	void print_last_error();
 
+	void initReadChain();
+	bool loadBlockMap();
+	bool writeBlockMap();
+	unsigned char bitmapState(const unsigned char* bm, unsigned int block);
+	int getResolvedLevel(unsigned int block);
+	int getBlockLevel(unsigned int block, std::vector<unsigned char>& sector_levels);
+	int resolveBlock(unsigned int block, std::vector<unsigned char>& sector_levels);
+	bool readBlockData(size_t level, unsigned int block, size_t blockoffset, char* buffer, size_t bsize);
+
 	bool read_only;
 
 	IFsFile* backing_file;
@@ -187,4 +200,13 @@ private:
 	_i64 volume_offset;
 
 	bool finished;
+
+	//Flattened view of the parent chain for positional reads
+	ISharedMutex* block_map_mutex;
+	bool read_chain_init;
+	bool read_chain_flat;
+	std::vector<VHDFile*> read_chain;
+	std::vector<int> block_levels;
+	std::map<unsigned int, std::vector<unsigned char> > mixed_blocks;
+	std::vector<unsigned char> block_bitmap_state;
 };
@@ -117,13 +117,8 @@ namespace
 		if(strcmp(path, volume_path) != 0)
 			return -ENOENT;
 
-		if(!vhdfile->Seek(offset+global_offset))
-		{
-			return -EINVAL;
-		}
-		
 		size_t read;
-		if(!vhdfile->Read(buf, size, read))
+		if(!vhdfile->Read(offset+global_offset, buf, size, read))
 		{
 			return -EINVAL;
 		}
@@ -210,7 +205,7 @@ DLLEXPORT void LoadActions(IServer* pServer)
 	
 	fuse_set_signal_handlers(fuse_get_session(ffuse));
 	
-	int rc = fuse_loop(ffuse);
+	int rc = fuse_loop_mt(ffuse);
 	
 	fuse_unmount(mountpoint.c_str(), ch);
 	
@@ -58,7 +58,7 @@ namespace
 	};
 }
 
-CHTTPAction::CHTTPAction(const std::string &pName, const std::string pContext, const std::string &pGETStr, const std::string pPOSTStr, const str_map &pRawPARAMS, IPipe *pOutput)
+CHTTPAction::CHTTPAction(const std::string &pName, const std::string pContext, const std::string &pGETStr, const std::string pPOSTStr, const str_map &pRawPARAMS, IPipe *pOutput, bool pStreamChunked)
 {
 	name=pName;
 	GETStr=pGETStr;
@@ -66,6 +66,7 @@ CHTTPAction::CHTTPAction(const std::string &pName, const std::string pContext, c
 	RawPARAMS=pRawPARAMS;
 	output=pOutput;
 	context=pContext;
+	stream_chunked=pStreamChunked;
 }
 
 #define MAP(x,y) { std::map<std::string, std::string>::iterator iter=RawPARAMS.find(x); if(iter!=RawPARAMS.end() ) PARAMS.insert(std::pair<std::string, std::string>(y, iter->second) ); }
@@ -84,6 +85,11 @@ void CHTTPAction::operator()(void)
 	MAP("REMOTE_ADDR", "REMOTE_ADDR");
 	MAP("X-FORWARDED-FOR", "HTTP_X_FORWARDED_FOR")
 
+	if(stream_chunked)
+	{
+		PARAMS["STREAM_CHUNKED"]="1";
+	}
+
 	PipeOutputStream pipe_output_stream(output);
 
 	THREAD_ID tid=0;
@@ -7,7 +7,7 @@ class IPipe;
 class CHTTPAction : public IThread, public IObject
 {
 public:
-	CHTTPAction(const std::string &pName, const std::string pContext, const std::string &pGETStr, const std::string pPOSTStr, const str_map &pRawPARAMS, IPipe *pOutput);
+	CHTTPAction(const std::string &pName, const std::string pContext, const std::string &pGETStr, const std::string pPOSTStr, const str_map &pRawPARAMS, IPipe *pOutput, bool pStreamChunked);
 
 	void operator()(void);
 private:
@@ -19,5 +19,6 @@ private:
 	std::string context;
 
 	IPipe *output;
+	bool stream_chunked;
 
 };
@@ -18,6 +18,7 @@
 
 #include "../vld.h"
 #include <stdlib.h>
+#include <algorithm>
 #include "HTTPClient.h"
 #include "../Interface/Pipe.h"
 #include "../Interface/Thread.h"
@@ -33,7 +34,6 @@
 extern CHTTPService* http_service;
 
 const int HTTP_STATE_COMMAND=0;
-const int HTTP_STATE_HEADER=1;
 const int HTTP_STATE_READY=2;
 const int HTTP_STATE_CONTENT=3;
 const int HTTP_STATE_WAIT_FOR_THREAD=4;
@@ -41,6 +41,7 @@ const int HTTP_STATE_KEEPALIVE=5;
 const int HTTP_STATE_DONE=6;
 
 const int HTTP_MAX_KEEPALIVE=15000;
+const size_t HTTP_MAX_HEADER_SIZE=64*1024;
 
 IMutex *CHTTPClient::share_mutex=NULL;
 std::map<std::string, SShareProxy> CHTTPClient::shared_connections;
@@ -51,7 +52,6 @@ void CHTTPClient::Init(THREAD_ID pTID, IPipe *pPipe, const std::string& pEndpoin
 	pipe=pPipe;
 	do_quit=false;
 	http_g_state=HTTP_STATE_COMMAND;
-	http_state=0;
 	request_num=0;
 	request_ticket=ILLEGAL_THREADPOOL_TICKET;
 	fileupload=false;
@@ -72,45 +72,77 @@ void CHTTPClient::ReceivePackets(IRunOtherCallback* run_other)
 {
 	std::string data;
 	size_t rc=pipe->Read(&data);
-	if( rc>0 )
+	if( rc==0 )
 	{
-		for(size_t i=0;i<rc;++i)
+		do_quit=true;
+		return;
+	}
+
+	if( http_g_state==HTTP_STATE_KEEPALIVE )
+	{
+		reset();
+		http_g_state=HTTP_STATE_COMMAND;
+	}
+
+	if( http_g_state!=HTTP_STATE_COMMAND && http_g_state!=HTTP_STATE_CONTENT )
+	{
+		return;
+	}
+
+	http_buffer.append(data.data(), rc);
+
+	if( http_g_state==HTTP_STATE_COMMAND )
+	{
+		size_t hstart=http_buffer.find_first_not_of("\r\n");
+		if( hstart==std::string::npos )
 		{
-			char ch=data[i];
-			switch(http_g_state)
-			{
-			case HTTP_STATE_KEEPALIVE:
-				reset();
-				http_g_state=HTTP_STATE_COMMAND;
-				//fallthrough
-			case HTTP_STATE_COMMAND:
-				processCommand(ch);
-				break;
-			case HTTP_STATE_HEADER:
-				processHeader(ch);
-				break;
-			case HTTP_STATE_CONTENT:
-				processContent(ch);
-				break;
-			}
+			http_buffer.clear();
+			return;
+		}
 
-			if(http_g_state==HTTP_STATE_READY )
-			{
-				if(	processRequest() )
-				{
-					http_g_state=HTTP_STATE_WAIT_FOR_THREAD;
-				}
-				else
-					do_quit=true;
+		size_t hend=http_buffer.find("\r\n\r\n", hstart);
+		size_t hend_len=4;
+		size_t lf_hend=http_buffer.find("\n\n", hstart);
+		if( lf_hend!=std::string::npos && (hend==std::string::npos || lf_hend<hend) )
+		{
+			hend=lf_hend;
+			hend_len=2;
+		}
 
-				break;
+		if( hend==std::string::npos )
+		{
+			if( http_buffer.size()>HTTP_MAX_HEADER_SIZE )
+			{
+				Server->Log("HTTP request header too large", LL_DEBUG);
+				do_quit=true;
 			}
+			return;
+		}
 
+		if( !processHeader(http_buffer.substr(hstart, hend-hstart)) )
+		{
+			do_quit=true;
+			return;
 		}
+
+		http_buffer.erase(0, hend+hend_len);
 	}
-	else
+
+	if( http_g_state==HTTP_STATE_CONTENT )
 	{
-		do_quit=true;
+		processContent();
+	}
+
+	if( http_g_state==HTTP_STATE_READY )
+	{
+		http_buffer.clear();
+
+		if(	processRequest() )
+		{
+			http_g_state=HTTP_STATE_WAIT_FOR_THREAD;
+		}
+		else
+			do_quit=true;
 	}
 }
 
@@ -235,130 +267,90 @@ bool CHTTPClient::Run(IRunOtherCallback* run_other)
 	return true;
 }
 
-void CHTTPClient::processCommand(char ch)
+bool CHTTPClient::processHeader(const std::string& header)
 {
-	switch(http_state)
+	size_t lstart=0;
+	bool first_line=true;
+	while( lstart<=header.size() )
 	{
-	case 0:
-		if( ch!=' ' )
-			http_state=1;
-		else
-			break;
-	case 1:
-		if( ch==' ' && !http_method.empty() )
-			http_state=2;
-		else if( ch!=' ' )
-			http_method+=(char)toupper(ch);
-		break;
-	case 2:
-		if( ch!=' ' && ch!='\r' && ch!='\n' )
-		{
-			tmp+=ch;
-			break;
-		}
-		else if( (ch==' ' || ch=='\r' || ch=='\n' ) && !tmp.empty() )
+		size_t lend=header.find('\n', lstart);
+		if( lend==std::string::npos )
+			lend=header.size();
+
+		std::string line=header.substr(lstart, lend-lstart);
+		if( !line.empty() && line[line.size()-1]=='\r' )
+			line.erase(line.size()-1);
+
+		lstart=lend+1;
+
+		if( first_line )
 		{
-			if( tmp=="HTTP/1.0" )
-				http_version=10;
-			else if( tmp=="HTTP/1.1" )
-				http_version=11;
-			else
+			first_line=false;
+
+			std::vector<std::string> toks;
+			Tokenize(line, toks, " ");
+			std::vector<std::string> cmd;
+			for(size_t i=0;i<toks.size();++i)
 			{
-				if( tmp.size()>http_query.size() )
-					http_query=tmp;
+				if( !toks[i].empty() )
+					cmd.push_back(toks[i]);
 			}
-			tmp.clear();
 
-			if( ch=='\r' || ch=='\n'  )
-				http_state=4;
-			else
-				break;
+			if( cmd.size()<2 )
+				return false;
+
+			http_method=cmd[0];
+			strupper(&http_method);
+			http_query=cmd[1];
+			http_version=11;
+			if( cmd.size()>2 && cmd[2]=="HTTP/1.0" )
+				http_version=10;
+
+			continue;
 		}
-	case 3:
-		if( ch=='\n' )
-			http_state=4;
-		else if( ch=='\r' )
-			break;
-	case 4:
-		http_g_state=HTTP_STATE_HEADER;
-		http_state=0;
-		tmp.clear();
+
+		size_t sep=line.find(':');
+		if( sep==std::string::npos )
+			continue;
+
+		std::string key=line.substr(0, sep);
+		strupper(&key);
+		size_t vstart=line.find_first_not_of(' ', sep+1);
+		std::string value;
+		if( vstart!=std::string::npos )
+			value=line.substr(vstart);
+
+		http_params.insert(std::pair<std::string, std::string>(key, value) );
 	}
-}
 
-void CHTTPClient::processHeader(char ch)
-{
-	switch(http_state)
+	if( first_line )
+		return false;
+
+	if( http_method=="POST")
 	{
-	case 0:
-		if( ch=='\r' || ch=='\n' )
-			http_state=1;
-		else 
+		str_map::iterator iter=http_params.find("CONTENT-LENGTH");
+		if( iter!=http_params.end() )
 		{
-			if( ch!=':' )
-				http_header_key+=(char)toupper(ch);
-			else
+			http_remaining_content=atoi(iter->second.c_str() );
+			if( http_remaining_content>0 )
 			{
-				http_state=3;
-			}
-			break;
-		}
-	case 1:
-		if( ch=='\n' )
-			http_state=2;
-		else
-			break;
-	case 2:
-		if( http_method=="POST")
-		{
-			str_map::iterator iter=http_params.find("CONTENT-LENGTH");
-			if( iter!=http_params.end() )
-			{
-				http_remaining_content=atoi(iter->second.c_str() );
-				if( http_remaining_content>0 )
-				{
-					http_g_state=HTTP_STATE_CONTENT;
-					break;
-				}
+				http_g_state=HTTP_STATE_CONTENT;
+				return true;
 			}
 		}
-		http_g_state=HTTP_STATE_READY;
-		break;
-
-	case 3:
-		if( ch!=' ')
-			http_state=4;
-		else
-			break;
-	case 4:
-		if( ch!='\r' && ch!='\n' )
-		{
-			tmp+=ch;
-			break;
-		}
-		else
-		{
-			http_params.insert(std::pair<std::string, std::string>(http_header_key, tmp) );
-			tmp.clear();
-			http_header_key.clear();
-			http_state=5;
-		}
-	case 5:
-		if( ch=='\n' )
-			http_state=0;
-		else
-			break;
 	}
+	http_g_state=HTTP_STATE_READY;
+	return true;
 }
 
-void CHTTPClient::processContent(char ch)
+void CHTTPClient::processContent(void)
 {
-	if( http_remaining_content>0 )
-	{
-		http_content+=ch;
-		--http_remaining_content;
-	}
-	if( http_remaining_content<=0 )
+	size_t toadd=(std::min)(http_remaining_content, http_buffer.size());
+	http_content.append(http_buffer, 0, toadd);
+	http_buffer.erase(0, toadd);
+	http_remaining_content-=toadd;
+
+	if( http_remaining_content==0 )
 	{
 		http_g_state=HTTP_STATE_READY;
 		
@@ -537,7 +529,7 @@ bool CHTTPClient::processRequest(void)
 #ifdef _WIN32
 			rp = greplace("\\", "_", rp);
 #endif
-			CHTTPFile *file_handler=new CHTTPFile(http_service->getRoot()+rp, pipe);
+			CHTTPFile *file_handler=new CHTTPFile(http_service->getRoot()+rp, pipe, http_params);
 			request_ticket=Server->getThreadPool()->execute(file_handler);
 			request_handler=file_handler;
 			return true;
@@ -547,7 +539,7 @@ bool CHTTPClient::processRequest(void)
 
 		pl=NULL;
 		http_params["REMOTE_ADDR"]=endpoint;
-		CHTTPAction *action_handler=new CHTTPAction(name,context,gparams, http_content, http_params, pipe);
+		CHTTPAction *action_handler=new CHTTPAction(name,context,gparams, http_content, http_params, pipe, http_version>=11);
 		request_ticket=Server->getThreadPool()->execute(action_handler, "http dynamic request");
 		request_handler=action_handler;
 		return true;
@@ -562,9 +554,7 @@ void CHTTPClient::reset(void)
 	http_method.clear();
 	http_query.clear();
 	http_content.clear();
-	http_state=0;
-	tmp.clear();
-	http_header_key.clear();
+	http_buffer.clear();
 	request_ticket=ILLEGAL_THREADPOOL_TICKET;
 	fileupload=false;
 }
@@ -30,9 +30,8 @@ public:
 
 private:
 
-	inline void processCommand(char ch);
-	inline void processHeader(char ch);
-	inline void processContent(char ch);
+	inline bool processHeader(const std::string& header);
+	inline void processContent(void);
 	inline bool processRequest(void);
 	inline void reset(void);
 
@@ -48,12 +47,10 @@ private:
 	std::string http_content;
 	int http_version;
 	int http_g_state;
-	int http_state;
 	unsigned int http_keepalive_start;
 	unsigned int http_keepalive_count;
 	size_t http_remaining_content;
-	std::string tmp;
-	std::string http_header_key;
+	std::string http_buffer;
 	bool fileupload;
 	std::string endpoint;
 
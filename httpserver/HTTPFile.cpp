@@ -19,6 +19,7 @@
 #include "HTTPFile.h"
 #include "MIMEType.h"
 #include "IndexFiles.h"
+#include "StaticFileCache.h"
 
 #include "../Interface/Server.h"
 #include "../Interface/File.h"
@@ -26,9 +27,120 @@
 
 #include "../stringtools.h"
 
-#define FP_READ_SIZE 8192
+#include <memory>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
 
-CHTTPFile::CHTTPFile(std::string pFilename, IPipe *pOutput)
+#define FP_READ_SIZE 32768
+#define SENDFILE_MIN_SIZE 65536
+
+namespace
+{
+	std::string opaqueTag(const std::string& etag)
+	{
+		if(next(etag, 0, "W/"))
+			return etag.substr(2);
+		return etag;
+	}
+
+	//Weak comparison with every entity tag in an If-None-Match list
+	bool etagListMatches(const std::string& list, const std::string& etag)
+	{
+		std::string opaque=opaqueTag(etag);
+		size_t pos=0;
+		while(pos<list.size())
+		{
+			while(pos<list.size() && (list[pos]==' ' || list[pos]=='\t' || list[pos]==','))
+				++pos;
+
+			if(pos>=list.size())
+				break;
+
+			if(list[pos]=='*')
+				return true;
+
+			size_t start=pos;
+			if(list.compare(pos, 2, "W/")==0)
+				pos+=2;
+
+			if(pos<list.size() && list[pos]=='"')
+			{
+				size_t end=list.find('"', pos+1);
+				if(end==std::string::npos)
+					return false;
+				pos=end+1;
+			}
+			else
+			{
+				pos=(std::min)(list.find(',', pos), list.size());
+			}
+
+			if(opaqueTag(trim(list.substr(start, pos-start)))==opaque)
+				return true;
+		}
+		return false;
+	}
+
+	bool parseHttpDate(const std::string& str, int64& t)
+	{
+		static const char* months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+		char month[4] = {};
+		struct tm tm = {};
+		if(sscanf(str.c_str(), "%*3s, %2d %3s %4d %2d:%2d:%2d GMT",
+			&tm.tm_mday, month, &tm.tm_year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec)!=6)
+		{
+			return false;
+		}
+
+		tm.tm_mon=-1;
+		for(int i=0;i<12;++i)
+		{
+			if(strcmp(month, months[i])==0)
+			{
+				tm.tm_mon=i;
+				break;
+			}
+		}
+		if(tm.tm_mon<0)
+			return false;
+
+		tm.tm_year-=1900;
+#ifdef _WIN32
+		time_t tt=_mkgmtime(&tm);
+#else
+		time_t tt=timegm(&tm);
+#endif
+		if(tt==static_cast<time_t>(-1))
+			return false;
+
+		t=tt;
+		return true;
+	}
+
+	bool parseRangeNum(const std::string& str, int64& val)
+	{
+		if(str.empty())
+			return false;
+
+		for(size_t i=0;i<str.size();++i)
+		{
+			if(str[i]<'0' || str[i]>'9')
+				return false;
+		}
+
+		if(str.size()>18)
+			val=0x7FFFFFFFFFFFFFFFLL;
+		else
+			val=watoi64(str);
+		return true;
+	}
+}
+
+CHTTPFile::CHTTPFile(std::string pFilename, IPipe *pOutput, const str_map &pRawPARAMS)
+	: RawPARAMS(pRawPARAMS)
 {
 	filename=pFilename;
 	output=pOutput;
@@ -40,19 +152,156 @@ std::string CHTTPFile::getContentType(void)
 	return MIMEType::getMIMEType(ext);
 }
 
+bool CHTTPFile::acceptsGzip(void)
+{
+	str_map::iterator it=RawPARAMS.find("ACCEPT-ENCODING");
+	if(it==RawPARAMS.end())
+		return false;
+
+	std::string ae=strlower(it->second);
+	size_t pos=ae.find("gzip");
+	if(pos==std::string::npos)
+		return false;
+
+	std::string params=ae.substr(pos+4);
+	params=params.substr(0, params.find(","));
+	return params.find("q=0")==std::string::npos
+		|| params.find("q=0.")!=std::string::npos;
+}
+
+bool CHTTPFile::notModified(const SStaticFile& file, const std::string& etag)
+{
+	str_map::iterator it=RawPARAMS.find("IF-NONE-MATCH");
+	if(it!=RawPARAMS.end())
+	{
+		return etagListMatches(it->second, etag);
+	}
+
+	it=RawPARAMS.find("IF-MODIFIED-SINCE");
+	int64 since;
+	if(it!=RawPARAMS.end()
+		&& parseHttpDate(trim(it->second), since))
+	{
+		return file.mtime<=since;
+	}
+
+	return false;
+}
+
+bool CHTTPFile::parseRange(int64 size, int64& start, int64& end, bool& unsatisfiable)
+{
+	unsatisfiable=false;
+
+	str_map::iterator it=RawPARAMS.find("RANGE");
+	if(it==RawPARAMS.end())
+		return false;
+
+	//Malformed ranges are ignored and the whole file is sent
+	std::string range=strlower(trim(it->second));
+	if(!next(range, 0, "bytes=") || range.find(",")!=std::string::npos)
+		return false;
+
+	range=range.substr(6);
+	size_t dash=range.find("-");
+	if(dash==std::string::npos)
+		return false;
+
+	std::string s_start=trim(range.substr(0, dash));
+	std::string s_end=trim(range.substr(dash+1));
+
+	if(s_start.empty())
+	{
+		int64 suffix;
+		if(!parseRangeNum(s_end, suffix))
+			return false;
+
+		if(suffix==0)
+		{
+			unsatisfiable=true;
+			return true;
+		}
+		start=(std::max)(static_cast<int64>(0), size-suffix);
+		end=size-1;
+	}
+	else
+	{
+		if(!parseRangeNum(s_start, start))
+			return false;
+
+		end=size-1;
+		if(!s_end.empty())
+		{
+			int64 last;
+			if(!parseRangeNum(s_end, last) || last<start)
+				return false;
+			end=(std::min)(last, size-1);
+		}
+	}
+
+	if(start>=size)
+	{
+		unsatisfiable=true;
+	}
+	return true;
+}
+
+bool CHTTPFile::sendBody(const SStaticFile& file, const std::string& header, int64 start, int64 len)
+{
+	if(file.in_memory)
+	{
+		return output->Write(header+file.data.substr(static_cast<size_t>(start), static_cast<size_t>(len)));
+	}
+
+	std::auto_ptr<IFsFile> fp(Server->openFile(file.filename));
+	if(fp.get()==NULL)
+	{
+		return false;
+	}
+
+	if(!output->Write(header))
+	{
+		return false;
+	}
+
+	if(len>=SENDFILE_MIN_SIZE && output->supportsSendFile())
+	{
+		return output->SendFile(fp.get(), start, len);
+	}
+
+	std::string buf;
+	buf.resize(FP_READ_SIZE);
+	int64 pos=start;
+	while(pos<start+len)
+	{
+		_u32 toread=static_cast<_u32>((std::min)(static_cast<int64>(FP_READ_SIZE), start+len-pos));
+		_u32 read=fp->Read(pos, &buf[0], toread);
+		if(read==0)
+		{
+			return false;
+		}
+		if(!output->Write(buf.data(), read))
+		{
+			return false;
+		}
+		pos+=read;
+	}
+
+	return true;
+}
+
 void CHTTPFile::operator ()(void)
 {
 	Server->Log("Sending file \""+filename+"\"", LL_DEBUG);
-	IFile *fp=Server->openFile(filename);
+	std::shared_ptr<const SStaticFile> file=StaticFileCache::get(filename);
 
-	if( fp==NULL )
+	if( file.get()==NULL )
 	{
 		const std::vector<std::string> idxf=IndexFiles::getIndexFiles();
 		for(size_t i=0;i<idxf.size();++i)
 		{
 			std::string fn=filename+"/"+idxf[i];
-			fp=Server->openFile(fn);
-			if( fp!=NULL )
+			file=StaticFileCache::get(fn);
+			if( file.get()!=NULL )
 			{
 				filename=fn;
 				break;
@@ -62,34 +311,80 @@ void CHTTPFile::operator ()(void)
 
 	std::string ct=getContentType();
 
-	if( fp==NULL )
+	if( file.get()==NULL )
 	{
 		output->Write("HTTP/1.1 404 Not Found\r\nContent-Type: text/html\r\nContent-Length: 22\r\n\r\nSorry. File not found.");
 		return;
 	}
 
-	std::string status="HTTP/1.1 200 ok\r\n";
-
 	std::string cache_header = "Cache-Control: no-cache";
 	if (ExtractFileName(filename).find(".chash-")!=std::string::npos)
 	{
 		cache_header = "Cache-Control: max-age=365000000, immutable";
 	}
 
-	std::string header="Server: CS\r\nContent-Type: "+ct+"\r\n"+cache_header+"\r\nConnection: Keep-Alive\r\nKeep-Alive: timeout=15, max=95\r\nContent-Length: "+convert(fp->Size())+"\r\n\r\n";
+	bool use_gzip = !file->data_gzip.empty() && acceptsGzip();
+	const std::string& etag = use_gzip ? file->etag_gzip : file->etag;
+
+	std::string common_header="Server: CS\r\n"+cache_header+"\r\nETag: "+etag+"\r\nLast-Modified: "+file->last_modified+"\r\n";
+	if(!file->data_gzip.empty())
+	{
+		common_header+="Vary: Accept-Encoding\r\n";
+	}
+	common_header+="Connection: Keep-Alive\r\nKeep-Alive: timeout=15, max=95\r\n";
+
+	if(notModified(*file, etag))
+	{
+		output->Write("HTTP/1.1 304 Not Modified\r\n"+common_header+"\r\n");
+		return;
+	}
+
+	if(use_gzip)
+	{
+		Server->Log("Sending file: "+filename+" (gzip)", LL_DEBUG);
+		output->Write("HTTP/1.1 200 ok\r\n"+common_header+"Content-Type: "+ct+"\r\nContent-Encoding: gzip\r\nContent-Length: "
+			+convert(file->data_gzip.size())+"\r\n\r\n"+file->data_gzip);
+		return;
+	}
+
+	int64 start=0;
+	int64 end=file->size-1;
+	bool unsatisfiable;
+	bool has_range=parseRange(file->size, start, end, unsatisfiable);
+
+	//If-Range needs a strong validator
+	str_map::iterator if_range=RawPARAMS.find("IF-RANGE");
+	if(has_range && if_range!=RawPARAMS.end()
+		&& (next(file->etag, 0, "W/") || trim(if_range->second)!=file->etag)
+		&& trim(if_range->second)!=file->last_modified)
+	{
+		has_range=false;
+		start=0;
+		end=file->size-1;
+	}
+
+	if(has_range && unsatisfiable)
+	{
+		output->Write("HTTP/1.1 416 Range Not Satisfiable\r\n"+common_header+"Content-Range: bytes */"+convert(file->size)+"\r\nContent-Length: 0\r\n\r\n");
+		return;
+	}
+
+	std::string status="HTTP/1.1 200 ok\r\n";
+	std::string header=common_header+"Content-Type: "+ct+"\r\nAccept-Ranges: bytes\r\n";
+	if(has_range)
+	{
+		status="HTTP/1.1 206 Partial Content\r\n";
+		header+="Content-Range: bytes "+convert(start)+"-"+convert(end)+"/"+convert(file->size)+"\r\n";
+	}
+	header+="Content-Length: "+convert(end-start+1)+"\r\n\r\n";
 
 	Server->Log("Sending file: "+filename, LL_DEBUG);
-	output->Write(status+header);
-	
-	size_t bytes=0;
-	std::string buf;
-	while( (buf=fp->Read(FP_READ_SIZE)).size()>0 )
+
+	if(!sendBody(*file, status+header, start, end-start+1))
 	{
-		bytes+=buf.size();
-		output->Write(buf);
+		Server->Log("Sending file: "+filename+" failed", LL_DEBUG);
+		return;
 	}
 
 	Server->Log("Sending file: "+filename+" done", LL_DEBUG);
-
-	Server->destroy(fp);
 }
@@ -1,19 +1,27 @@
+#include "../Interface/Types.h"
 #include "../Interface/Thread.h"
 #include "../Interface/Object.h"
 
 #include <string>
 
 class IPipe;
+struct SStaticFile;
 
 class CHTTPFile : public IThread, public IObject
 {
 public:
-	CHTTPFile(std::string pFilename, IPipe *pOutput);
+	CHTTPFile(std::string pFilename, IPipe *pOutput, const str_map &pRawPARAMS);
 	std::string getContentType(void);
 	std::string getIndexFiles(void);
 	void operator()(void);
 
 private:
+	bool acceptsGzip(void);
+	bool notModified(const SStaticFile& file, const std::string& etag);
+	bool parseRange(int64 size, int64& start, int64& end, bool& unsatisfiable);
+	bool sendBody(const SStaticFile& file, const std::string& header, int64 start, int64 len);
+
 	std::string filename;
 	IPipe *output;
+	str_map RawPARAMS;
 };
@@ -0,0 +1,270 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "StaticFileCache.h"
+#include "MIMEType.h"
+
+#include "../Interface/Server.h"
+#include "../Interface/File.h"
+#include "../Interface/Mutex.h"
+
+#include "../stringtools.h"
+#include "../common/miniz.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <memory.h>
+
+namespace
+{
+	const int64 max_cached_file_size = 4 * 1024 * 1024;
+	const size_t max_cache_size = 64 * 1024 * 1024;
+	const int64 min_cached_file_age = 2;
+
+	std::string httpDate(int64 t)
+	{
+		time_t tt = static_cast<time_t>(t);
+		struct tm gt;
+#ifdef _WIN32
+		gmtime_s(&gt, &tt);
+#else
+		gmtime_r(&tt, &gt);
+#endif
+		char buf[64];
+		size_t len = strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &gt);
+		return std::string(buf, len);
+	}
+
+	std::string fnvHash(const std::string& data)
+	{
+		uint64 hash = 14695981039346656037ULL;
+		for (size_t i = 0; i < data.size(); ++i)
+		{
+			hash ^= static_cast<unsigned char>(data[i]);
+			hash *= 1099511628211ULL;
+		}
+		return bytesToHex(reinterpret_cast<const unsigned char*>(&hash), sizeof(hash));
+	}
+
+	void addLittleEndian32(std::string& data, unsigned int val)
+	{
+		for (size_t i = 0; i < 4; ++i)
+		{
+			data += static_cast<char>((val >> (i * 8)) & 0xFF);
+		}
+	}
+}
+
+IMutex* StaticFileCache::mutex = NULL;
+std::map<std::string, std::shared_ptr<const SStaticFile> > StaticFileCache::files;
+size_t StaticFileCache::cache_size = 0;
+
+void StaticFileCache::init_mutex(void)
+{
+	mutex = Server->createMutex();
+}
+
+void StaticFileCache::destroy_mutex(void)
+{
+	Server->destroy(mutex);
+}
+
+std::shared_ptr<const SStaticFile> StaticFileCache::get(const std::string& filename)
+{
+	int64 size;
+	int64 mtime;
+	int64 ctime;
+	std::string validator;
+	if (!statFile(filename, size, mtime, ctime, validator))
+	{
+		return std::shared_ptr<const SStaticFile>();
+	}
+
+	bool cache;
+	{
+		IScopedLock lock(mutex);
+		std::map<std::string, std::shared_ptr<const SStaticFile> >::iterator it = files.find(filename);
+		if (it != files.end())
+		{
+			if (it->second->validator == validator)
+			{
+				return it->second;
+			}
+
+			if (it->second->in_memory)
+			{
+				cache_size -= it->second->data.size() + it->second->data_gzip.size();
+			}
+			files.erase(it);
+		}
+
+		cache = size <= max_cached_file_size
+			&& cache_size + size <= max_cache_size;
+	}
+
+	int64 now = static_cast<int64>(time(NULL));
+	if (now - mtime <= min_cached_file_age
+		|| now - ctime <= min_cached_file_age)
+	{
+		//Could still be rewritten without changing the validator
+		return load(filename, size, mtime, validator, false);
+	}
+
+	std::shared_ptr<SStaticFile> file = load(filename, size, mtime, validator, cache);
+
+	if (file.get() == NULL)
+	{
+		return std::shared_ptr<const SStaticFile>();
+	}
+
+	IScopedLock lock(mutex);
+	std::map<std::string, std::shared_ptr<const SStaticFile> >::iterator it = files.find(filename);
+	if (it != files.end())
+	{
+		//Loaded concurrently
+		return it->second;
+	}
+
+	if (file->in_memory)
+	{
+		cache_size += file->data.size() + file->data_gzip.size();
+	}
+	files[filename] = file;
+	return file;
+}
+
+bool StaticFileCache::statFile(const std::string& filename, int64& size, int64& mtime, int64& ctime, std::string& validator)
+{
+#ifdef _WIN32
+	struct _stat64 buf;
+	if (_stat64(filename.c_str(), &buf) != 0)
+	{
+		return false;
+	}
+	if ((buf.st_mode & _S_IFREG) == 0)
+	{
+		return false;
+	}
+#else
+	struct stat buf;
+	if (stat(filename.c_str(), &buf) != 0)
+	{
+		return false;
+	}
+	if (!S_ISREG(buf.st_mode))
+	{
+		return false;
+	}
+#endif
+	size = buf.st_size;
+	mtime = buf.st_mtime;
+	ctime = buf.st_ctime;
+#if defined(_WIN32)
+	validator = convert(size) + "-" + convert(mtime) + "-" + convert(ctime);
+#elif defined(__APPLE__) || defined(__FreeBSD__)
+	validator = convert(size) + "-" + convert(mtime) + "." + convert(static_cast<int64>(buf.st_mtimespec.tv_nsec))
+		+ "-" + convert(ctime) + "." + convert(static_cast<int64>(buf.st_ctimespec.tv_nsec))
+		+ "-" + convert(static_cast<int64>(buf.st_ino));
+#else
+	validator = convert(size) + "-" + convert(mtime) + "." + convert(static_cast<int64>(buf.st_mtim.tv_nsec))
+		+ "-" + convert(ctime) + "." + convert(static_cast<int64>(buf.st_ctim.tv_nsec))
+		+ "-" + convert(static_cast<int64>(buf.st_ino));
+#endif
+	return true;
+}
+
+std::shared_ptr<SStaticFile> StaticFileCache::load(const std::string& filename, int64 size, int64 mtime, const std::string& validator, bool cache)
+{
+	std::shared_ptr<SStaticFile> ret(new SStaticFile);
+	ret->filename = filename;
+	ret->size = size;
+	ret->mtime = mtime;
+	ret->validator = validator;
+	ret->last_modified = httpDate(mtime);
+	ret->in_memory = false;
+
+	if (!cache)
+	{
+		//Read from disk on every request, so the content is not tied to the validator
+		ret->etag = "W/\"" + fnvHash(validator) + "\"";
+		return ret;
+	}
+
+	std::auto_ptr<IFile> f(Server->openFile(filename, MODE_READ));
+	if (f.get() == NULL)
+	{
+		return std::shared_ptr<SStaticFile>();
+	}
+
+	ret->data.resize(static_cast<size_t>(size));
+	if (size > 0
+		&& f->Read(&ret->data[0], static_cast<_u32>(size)) != size)
+	{
+		Server->Log("Error reading file \"" + filename + "\" for static file cache", LL_WARNING);
+		return std::shared_ptr<SStaticFile>();
+	}
+
+	ret->in_memory = true;
+	std::string hash = fnvHash(ret->data);
+	ret->etag = "\"" + hash + "\"";
+
+	if (isCompressible(filename))
+	{
+		std::string compressed = gzipCompress(ret->data);
+		if (!compressed.empty()
+			&& compressed.size() < ret->data.size())
+		{
+			ret->data_gzip = compressed;
+			ret->etag_gzip = "\"" + hash + "-gz\"";
+		}
+	}
+
+	return ret;
+}
+
+bool StaticFileCache::isCompressible(const std::string& filename)
+{
+	std::string ct = MIMEType::getMIMEType(findextension(filename));
+	return next(ct, 0, "text/")
+		|| ct.find("javascript") != std::string::npos
+		|| ct.find("json") != std::string::npos
+		|| ct.find("xml") != std::string::npos;
+}
+
+std::string StaticFileCache::gzipCompress(const std::string& data)
+{
+	size_t out_len = 0;
+	void* out = tdefl_compress_mem_to_heap(data.data(), data.size(), &out_len,
+		tdefl_create_comp_flags_from_zip_params(9, -MZ_DEFAULT_WINDOW_BITS, MZ_DEFAULT_STRATEGY));
+
+	if (out == NULL)
+	{
+		return std::string();
+	}
+
+	std::string ret("\x1f\x8b\x08\x00\x00\x00\x00\x00\x02\xff", 10);
+	ret.append(static_cast<char*>(out), out_len);
+	mz_free(out);
+
+	addLittleEndian32(ret, static_cast<unsigned int>(mz_crc32(MZ_CRC32_INIT,
+		reinterpret_cast<const unsigned char*>(data.data()), data.size())));
+	addLittleEndian32(ret, static_cast<unsigned int>(data.size()));
+
+	return ret;
+}
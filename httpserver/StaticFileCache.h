@@ -0,0 +1,43 @@
+#include <string>
+#include <map>
+#include <memory>
+#include "../Interface/Types.h"
+
+class IMutex;
+
+struct SStaticFile
+{
+	std::string filename;
+	int64 size;
+	int64 mtime;
+	std::string validator;
+	std::string etag;
+	std::string etag_gzip;
+	std::string last_modified;
+	bool in_memory;
+	std::string data;
+	std::string data_gzip;
+};
+
+class StaticFileCache
+{
+public:
+	static void init_mutex(void);
+	static void destroy_mutex(void);
+
+	//Returns NULL if the file does not exist. Small files are kept in memory (and
+	//gzip compressed if useful) until their size, modification/change time or inode
+	//changes. Files changed within the last seconds are not kept in memory, as a
+	//rewrite could leave all of those unchanged at the file system's time granularity.
+	static std::shared_ptr<const SStaticFile> get(const std::string& filename);
+
+private:
+	static bool statFile(const std::string& filename, int64& size, int64& mtime, int64& ctime, std::string& validator);
+	static std::shared_ptr<SStaticFile> load(const std::string& filename, int64 size, int64 mtime, const std::string& validator, bool cache);
+	static bool isCompressible(const std::string& filename);
+	static std::string gzipCompress(const std::string& data);
+
+	static IMutex* mutex;
+	static std::map<std::string, std::shared_ptr<const SStaticFile> > files;
+	static size_t cache_size;
+};
@@ -150,6 +150,32 @@ public:
 	};
 
 
+	struct SScriptStats
+	{
+		SScriptStats()
+			: runs(0), total_time_ms(0), max_time_ms(0) {}
+
+		int64 runs;
+		int64 total_time_ms;
+		int64 max_time_ms;
+	};
+
+	class IPreparedScript : public IObject
+	{
+	public:
+		virtual int64 run(const Param& params, int64& ret2, std::string& state, std::string& global_data, const SInterpreterFunctions& funcs) = 0;
+
+		virtual SScriptStats getStats(bool reset) = 0;
+	};
+
+
 	virtual std::string compileScript(const std::string& script) = 0;
 	virtual int64 runScript(const std::string& script, const Param& params, int64& ret2, std::string& state, std::string& global_data, const SInterpreterFunctions& funcs) = 0;
+
+	/**
+	* Keeps a pool of Lua states with the compiled script loaded. Each run gets
+	* its own environment table, so runs do not see each other's globals.
+	* Returns NULL if the script cannot be loaded. Free with Remove().
+	**/
+	virtual IPreparedScript* prepareScript(const std::string& compiled_script) = 0;
 };
\ No newline at end of file
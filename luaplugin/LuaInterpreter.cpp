@@ -1,8 +1,10 @@
 #include "LuaInterpreter.h"
 #include "src/lua.hpp"
 #include "../Interface/Server.h"
+#include "../Interface/Mutex.h"
 #include "../common/data.h"
 #include <assert.h>
+#include <algorithm>
 #define MINIZ_NO_ZLIB_COMPATIBLE_NAMES
 #include "../common/miniz.h"
 #include "../stringtools.h"
@@ -32,6 +34,8 @@ namespace
 
 namespace
 {
+	const size_t c_max_idle_states = 4;
+
 	class ScopedLuaState
 	{
 		lua_State* state;
@@ -338,6 +342,115 @@ namespace
 		lua_call(state, 0, LUA_MULTRET);
 		return 1;
 	}
+
+	lua_State* new_script_state()
+	{
+		lua_State* state = luaL_newstate();
+		if (state == NULL)
+		{
+			return NULL;
+		}
+
+		luaL_openlibs_custom(state);
+
+		lua_pushcfunction(state, l_mail);
+		lua_setglobal(state, "mail");
+		lua_pushcfunction(state, l_require);
+		lua_setglobal(state, "require");
+		lua_pushcfunction(state, l_download);
+		lua_setglobal(state, "download");
+
+		return state;
+	}
+
+	bool push_data_table(lua_State* state, const std::string& data, const std::string& name)
+	{
+		if (data.empty())
+		{
+			lua_newtable(state);
+		}
+		else if (!unserialize_table(state, data))
+		{
+			Server->Log("Error unserializing " + name + " data", LL_ERROR);
+			return false;
+		}
+		return true;
+	}
+
+	std::string serialize_data_table(lua_State* state, const std::string& name)
+	{
+		std::string ret;
+		if (lua_istable(state, -1))
+		{
+			ret = serialize_table(state);
+		}
+		lua_pop(state, 1);
+
+		if (ret.empty())
+		{
+			Server->Log("Error serializing " + name + " data", LL_WARNING);
+		}
+		return ret;
+	}
+
+	int64 run_in_env(lua_State* state, int func_ref, const ILuaInterpreter::Param& params, int64& ret2,
+		std::string& state_data, std::string& global_data, const ILuaInterpreter::SInterpreterFunctions& funcs)
+	{
+		lua_rawgeti(state, LUA_REGISTRYINDEX, func_ref);
+		int func_idx = lua_gettop(state);
+
+		lua_newtable(state);
+		lua_newtable(state);
+		lua_pushglobaltable(state);
+		lua_setfield(state, -2, "__index");
+		lua_setmetatable(state, -2);
+		int env_idx = lua_gettop(state);
+
+		set_param(state, params);
+		lua_setfield(state, env_idx, "params");
+
+		if (!push_data_table(state, state_data, "state"))
+			return -1;
+		lua_setfield(state, env_idx, "state");
+
+		if (!push_data_table(state, global_data, "global"))
+			return -1;
+		lua_setfield(state, env_idx, "global");
+
+		lua_pushvalue(state, env_idx);
+		if (lua_setupvalue(state, func_idx, 1) == NULL)
+		{
+			Server->Log("Lua script has no environment", LL_ERROR);
+			return -1;
+		}
+
+		lua_pushlightuserdata(state, const_cast<ILuaInterpreter::SInterpreterFunctions*>(&funcs));
+		lua_setglobal(state, "_g_funcs");
+
+		lua_pushvalue(state, func_idx);
+		int rc = lua_pcall(state, 0, LUA_MULTRET, 0);
+		if (rc) {
+			Server->Log(std::string("Error running lua script: ") + lua_tostring(state, -1), LL_ERROR);
+			return -1;
+		}
+
+		int nresults = lua_gettop(state) - env_idx;
+		if (nresults > 1)
+		{
+			ret2 = lua_tointeger(state, -1);
+			lua_pop(state, 1);
+		}
+		int64 ret = nresults > 0 ? lua_tointeger(state, -1) : 0;
+		lua_settop(state, env_idx);
+
+		lua_getfield(state, env_idx, "state");
+		state_data = serialize_data_table(state, "state");
+
+		lua_getfield(state, env_idx, "global");
+		global_data = serialize_data_table(state, "global");
+
+		return ret;
+	}
 }
 
 std::string LuaInterpreter::compileScript(const std::string & script)
@@ -372,7 +485,7 @@ int64 LuaInterpreter::runScript(const std::string& script, const ILuaInterpreter
 {
 	ret2 = -1;
 
-	lua_State* state = luaL_newstate();
+	lua_State* state = new_script_state();
 	if (state == NULL)
 	{
 		return -1;
@@ -380,8 +493,6 @@ int64 LuaInterpreter::runScript(const std::string& script, const ILuaInterpreter
 
 	ScopedLuaState scoped_state(state);
 
-	luaL_openlibs_custom(state);
-
 	int rc = luaL_loadbuffer(state, script.c_str(), script.size(), "script");
 	if (rc) {
 		Server->Log(std::string("Error loading lua script: ") + lua_tostring(state, -1), LL_ERROR);
@@ -394,32 +505,15 @@ int64 LuaInterpreter::runScript(const std::string& script, const ILuaInterpreter
 	lua_pushlightuserdata(state, const_cast<ILuaInterpreter::SInterpreterFunctions*>(&funcs));
 	lua_setglobal(state, "_g_funcs");
 
-	lua_pushcfunction(state, l_mail);
-	lua_setglobal(state, "mail");
-	lua_pushcfunction(state, l_require);
-	lua_setglobal(state, "require");
-	lua_pushcfunction(state, l_download);
-	lua_setglobal(state, "download");
-
-	if (state_data.empty())
+	if (!push_data_table(state, state_data, "state"))
 	{
-		lua_newtable(state);
-	}
-	else if (!unserialize_table(state, state_data))
-	{
-		Server->Log("Error unserializing state data", LL_ERROR);
 		return -1;
 	}
 
 	lua_setglobal(state, "state");
 
-	if (global_data.empty())
+	if (!push_data_table(state, global_data, "global"))
 	{
-		lua_newtable(state);
-	}
-	else if (!unserialize_table(state, global_data))
-	{
-		Server->Log("Error unserializing global data", LL_ERROR);
 		return -1;
 	}
 
@@ -441,19 +535,127 @@ int64 LuaInterpreter::runScript(const std::string& script, const ILuaInterpreter
 
 	lua_getglobal(state, "state");
 
-	state_data = serialize_table(state);
-	if (state_data.empty())
+	state_data = serialize_data_table(state, "state");
+
+	lua_getglobal(state, "global");
+
+	global_data = serialize_data_table(state, "global");
+	
+	return ret;
+}
+
+ILuaInterpreter::IPreparedScript* LuaInterpreter::prepareScript(const std::string& compiled_script)
+{
+	LuaPreparedScript* ret = new LuaPreparedScript(compiled_script);
+	if (!ret->prewarm())
 	{
-		Server->Log("Error serializing state data", LL_WARNING);
+		delete ret;
+		return NULL;
 	}
+	return ret;
+}
 
-	lua_getglobal(state, "global");
+LuaPreparedScript::LuaPreparedScript(const std::string& script)
+	: script(script), mutex(Server->createMutex())
+{
+}
 
-	global_data = serialize_table(state);
-	if (global_data.empty())
+LuaPreparedScript::~LuaPreparedScript()
+{
+	for (size_t i = 0; i < idle_states.size(); ++i)
 	{
-		Server->Log("Error serializing global data", LL_WARNING);
+		lua_close(idle_states[i].state);
+	}
+	Server->destroy(mutex);
+}
+
+bool LuaPreparedScript::prewarm()
+{
+	SPooledState pstate;
+	if (!createState(pstate))
+	{
+		return false;
+	}
+
+	idle_states.push_back(pstate);
+	return true;
+}
+
+bool LuaPreparedScript::createState(SPooledState& pstate)
+{
+	pstate.state = new_script_state();
+	if (pstate.state == NULL)
+	{
+		return false;
+	}
+
+	int rc = luaL_loadbuffer(pstate.state, script.c_str(), script.size(), "script");
+	if (rc) {
+		Server->Log(std::string("Error loading lua script: ") + lua_tostring(pstate.state, -1), LL_ERROR);
+		lua_close(pstate.state);
+		pstate.state = NULL;
+		return false;
+	}
+
+	pstate.func_ref = luaL_ref(pstate.state, LUA_REGISTRYINDEX);
+	return true;
+}
+
+int64 LuaPreparedScript::run(const ILuaInterpreter::Param& params, int64& ret2,
+	std::string& state_data, std::string& global_data, const ILuaInterpreter::SInterpreterFunctions& funcs)
+{
+	ret2 = -1;
+	int64 starttime = Server->getTimeMS();
+
+	SPooledState pstate;
+	pstate.state = NULL;
+	{
+		IScopedLock lock(mutex);
+		if (!idle_states.empty())
+		{
+			pstate = idle_states.back();
+			idle_states.pop_back();
+		}
+	}
+
+	if (pstate.state == NULL
+		&& !createState(pstate))
+	{
+		return -1;
+	}
+
+	int64 ret = run_in_env(pstate.state, pstate.func_ref, params, ret2, state_data, global_data, funcs);
+
+	lua_settop(pstate.state, 0);
+	lua_pushnil(pstate.state);
+	lua_setglobal(pstate.state, "_g_funcs");
+
+	int64 passed = Server->getTimeMS() - starttime;
+
+	IScopedLock lock(mutex);
+	++stats.runs;
+	stats.total_time_ms += passed;
+	stats.max_time_ms = (std::max)(stats.max_time_ms, passed);
+
+	if (idle_states.size() < c_max_idle_states)
+	{
+		idle_states.push_back(pstate);
+	}
+	else
+	{
+		lua_close(pstate.state);
+	}
+
+	return ret;
+}
+
+ILuaInterpreter::SScriptStats LuaPreparedScript::getStats(bool reset)
+{
+	IScopedLock lock(mutex);
+	ILuaInterpreter::SScriptStats ret = stats;
+	if (reset)
+	{
+		stats = ILuaInterpreter::SScriptStats();
 	}
-	
 	return ret;
 }
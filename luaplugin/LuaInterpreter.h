@@ -1,8 +1,12 @@
 #pragma once
 #include <string>
+#include <vector>
 #include "../Interface/Types.h"
 #include "ILuaInterpreter.h"
 
+struct lua_State;
+class IMutex;
+
 class LuaInterpreter : public ILuaInterpreter
 {
 public:
@@ -11,4 +15,33 @@ public:
 	virtual int64 runScript(const std::string& script, const Param& params, int64& ret2,
 		std::string& state_data, std::string& global_data, const SInterpreterFunctions& funcs);
 
-};
\ No newline at end of file
+	virtual IPreparedScript* prepareScript(const std::string& compiled_script);
+};
+
+class LuaPreparedScript : public ILuaInterpreter::IPreparedScript
+{
+public:
+	LuaPreparedScript(const std::string& script);
+	~LuaPreparedScript();
+
+	bool prewarm();
+
+	virtual int64 run(const ILuaInterpreter::Param& params, int64& ret2,
+		std::string& state_data, std::string& global_data, const ILuaInterpreter::SInterpreterFunctions& funcs);
+
+	virtual ILuaInterpreter::SScriptStats getStats(bool reset);
+
+private:
+	struct SPooledState
+	{
+		lua_State* state;
+		int func_ref;
+	};
+
+	bool createState(SPooledState& pstate);
+
+	std::string script;
+	IMutex* mutex;
+	std::vector<SPooledState> idle_states;
+	ILuaInterpreter::SScriptStats stats;
+};
\ No newline at end of file
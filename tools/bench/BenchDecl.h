@@ -0,0 +1,6 @@
+#pragma once
+
+//Forced include for repository sources compiled into the benchmarks with -DDEF_SERVER
+#include "../../Interface/Server.h"
+
+extern IServer* Server;
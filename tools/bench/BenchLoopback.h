@@ -0,0 +1,212 @@
+#pragma once
+
+#include "../../Interface/Types.h"
+#include "BenchUtil.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <iostream>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+
+/**
+* Loopback file server with injected latency for the download benchmarks.
+* Requests are 8 byte file ids, answers the id followed by file_size bytes.
+* Each connection answers its requests one after another with a fixed
+* service time per file, and holds every answer back until rtt_us after
+* the request arrived.
+*/
+struct SLoopbackConfig
+{
+	int64 rtt_us;
+	int64 service_us;
+	size_t file_size;
+};
+
+inline bool bench_read_full(int s, char* buf, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t r = recv(s, buf, len, 0);
+		if (r <= 0)
+		{
+			return false;
+		}
+		buf += r;
+		len -= r;
+	}
+	return true;
+}
+
+inline bool bench_write_full(int s, const char* buf, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t r = send(s, buf, len, MSG_NOSIGNAL);
+		if (r <= 0)
+		{
+			return false;
+		}
+		buf += r;
+		len -= r;
+	}
+	return true;
+}
+
+class LoopbackConnection
+{
+public:
+	LoopbackConnection(int s, const SLoopbackConfig& config)
+		: s(s), config(config), eof(false)
+	{
+		reader_thread = std::thread(&LoopbackConnection::reader, this);
+		responder_thread = std::thread(&LoopbackConnection::responder, this);
+	}
+
+	~LoopbackConnection()
+	{
+		reader_thread.join();
+		responder_thread.join();
+		close(s);
+	}
+
+private:
+	struct SRequest
+	{
+		uint64_t id;
+		int64 recv_time;
+	};
+
+	void reader()
+	{
+		uint64_t id;
+		while (bench_read_full(s, reinterpret_cast<char*>(&id), sizeof(id)))
+		{
+			SRequest req;
+			req.id = id;
+			req.recv_time = bench_time_ns() / 1000;
+			std::lock_guard<std::mutex> lock(mutex);
+			requests.push_back(req);
+			cond.notify_one();
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		eof = true;
+		cond.notify_one();
+	}
+
+	void responder()
+	{
+		std::vector<char> buf(sizeof(uint64_t) + config.file_size, 'x');
+		int64 service_done = 0;
+		while (true)
+		{
+			SRequest req;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				while (requests.empty() && !eof)
+				{
+					cond.wait(lock);
+				}
+				if (requests.empty())
+				{
+					return;
+				}
+				req = requests.front();
+				requests.pop_front();
+			}
+
+			//Files are read one after another per connection
+			service_done = (std::max)(service_done, req.recv_time) + config.service_us;
+			int64 send_time = (std::max)(service_done, req.recv_time + config.rtt_us);
+			std::this_thread::sleep_until(std::chrono::steady_clock::time_point(std::chrono::microseconds(send_time)));
+
+			memcpy(&buf[0], &req.id, sizeof(req.id));
+			if (!bench_write_full(s, &buf[0], buf.size()))
+			{
+				return;
+			}
+		}
+	}
+
+	int s;
+	SLoopbackConfig config;
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::deque<SRequest> requests;
+	bool eof;
+	std::thread reader_thread;
+	std::thread responder_thread;
+};
+
+class LoopbackFileServer
+{
+public:
+	LoopbackFileServer(size_t n_streams, const SLoopbackConfig& config)
+	{
+		int ls = socket(AF_INET, SOCK_STREAM, 0);
+		sockaddr_in addr = {};
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		addr.sin_port = 0;
+		socklen_t addr_len = sizeof(addr);
+		if (bind(ls, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0
+			|| listen(ls, static_cast<int>(n_streams)) != 0
+			|| getsockname(ls, reinterpret_cast<sockaddr*>(&addr), &addr_len) != 0)
+		{
+			std::cerr << "Error setting up listening socket" << std::endl;
+			abort();
+		}
+
+		for (size_t i = 0; i < n_streams; ++i)
+		{
+			int cs = socket(AF_INET, SOCK_STREAM, 0);
+			if (connect(cs, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+			{
+				std::cerr << "Error connecting" << std::endl;
+				abort();
+			}
+			set_nodelay(cs);
+			client_sockets.push_back(cs);
+
+			int ss = accept(ls, NULL, NULL);
+			set_nodelay(ss);
+			connections.push_back(new LoopbackConnection(ss, config));
+		}
+		close(ls);
+	}
+
+	~LoopbackFileServer()
+	{
+		for (size_t i = 0; i < client_sockets.size(); ++i)
+		{
+			shutdown(client_sockets[i], SHUT_WR);
+		}
+		for (size_t i = 0; i < connections.size(); ++i)
+		{
+			delete connections[i];
+			close(client_sockets[i]);
+		}
+	}
+
+	int clientSocket(size_t stream)
+	{
+		return client_sockets[stream];
+	}
+
+private:
+	static void set_nodelay(int s)
+	{
+		int one = 1;
+		setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+
+	std::vector<int> client_sockets;
+	std::vector<LoopbackConnection*> connections;
+};
@@ -0,0 +1,780 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "BenchServer.h"
+#include "../../Interface/Thread.h"
+#include "../../Mutex_lin.h"
+#include "../../Condition_lin.h"
+#include "../../SharedMutex_lin.h"
+#include "../../file.h"
+#include "../../stringtools.h"
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <random>
+#include <vector>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+IServer* Server = NULL;
+
+namespace
+{
+	BenchServer* bench_server_inst = NULL;
+
+	class BenchThreadPool : public IThreadPool
+	{
+	public:
+		BenchThreadPool()
+			: next_ticket(1)
+		{
+		}
+
+		~BenchThreadPool()
+		{
+			Shutdown();
+		}
+
+		virtual THREADPOOL_TICKET execute(IThread *runnable, const std::string& name)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			THREADPOOL_TICKET ticket = next_ticket++;
+			threads[ticket].reset(new std::thread(&BenchThreadPool::run, runnable));
+			return ticket;
+		}
+
+		virtual void executeWait(IThread *runnable, const std::string& name)
+		{
+			waitFor(execute(runnable, name), -1);
+		}
+
+		virtual bool isRunning(THREADPOOL_TICKET ticket)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			return threads.find(ticket) != threads.end();
+		}
+
+		virtual bool waitFor(std::vector<THREADPOOL_TICKET> tickets, int timems)
+		{
+			for (size_t i = 0; i < tickets.size(); ++i)
+			{
+				waitFor(tickets[i], timems);
+			}
+			return true;
+		}
+
+		virtual bool waitFor(THREADPOOL_TICKET ticket, int timems)
+		{
+			std::shared_ptr<std::thread> t;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				std::map<THREADPOOL_TICKET, std::shared_ptr<std::thread> >::iterator it = threads.find(ticket);
+				if (it == threads.end())
+				{
+					return true;
+				}
+				t = it->second;
+				threads.erase(it);
+			}
+			t->join();
+			return true;
+		}
+
+		virtual void Shutdown()
+		{
+			std::vector<THREADPOOL_TICKET> tickets;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				for (std::map<THREADPOOL_TICKET, std::shared_ptr<std::thread> >::iterator it = threads.begin();
+					it != threads.end(); ++it)
+				{
+					tickets.push_back(it->first);
+				}
+			}
+			waitFor(tickets, -1);
+		}
+
+	private:
+		static void run(IThread* runnable)
+		{
+			(*runnable)();
+		}
+
+		std::mutex mutex;
+		THREADPOOL_TICKET next_ticket;
+		std::map<THREADPOOL_TICKET, std::shared_ptr<std::thread> > threads;
+	};
+
+	int64 steady_ms()
+	{
+		return std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	void run_thread(IThread* thread)
+	{
+		(*thread)();
+	}
+}
+
+void bench_init(void)
+{
+	if (bench_server_inst == NULL)
+	{
+		bench_server_inst = new BenchServer;
+		Server = bench_server_inst;
+	}
+}
+
+BenchServer* bench_server(void)
+{
+	return bench_server_inst;
+}
+
+BenchServer::BenchServer()
+	: loglevel(LL_WARNING), simulated_clock(false), sim_time_ms(0),
+	start_time_ms(steady_ms()), tmpdir("/tmp"), failbits(0),
+	threadpool(new BenchThreadPool), settings_reader_func(NULL)
+{
+}
+
+void BenchServer::setSimulatedClock(bool b)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	simulated_clock = b;
+	sim_time_ms = 0;
+}
+
+void BenchServer::advanceClock(int64 ms)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	sim_time_ms += ms;
+}
+
+void BenchServer::setSettingsReaderFunc(SettingsReaderFunc func)
+{
+	settings_reader_func = func;
+}
+
+void BenchServer::unsupported(const std::string& name)
+{
+	std::cerr << "BenchServer: IServer::" << name << " is not supported in benchmarks" << std::endl;
+	abort();
+}
+
+void BenchServer::setLogLevel(int LogLevel)
+{
+	loglevel = LogLevel;
+}
+
+void BenchServer::Log(const std::string &pStr, int LogLevel)
+{
+	if (LogLevel >= loglevel)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		std::cerr << pStr << std::endl;
+	}
+}
+
+std::string BenchServer::getServerParameter(const std::string &key)
+{
+	return getServerParameter(key, std::string());
+}
+
+std::string BenchServer::getServerParameter(const std::string &key, const std::string &def)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	str_map::iterator it = server_params.find(key);
+	if (it != server_params.end())
+	{
+		return it->second;
+	}
+	return def;
+}
+
+void BenchServer::setServerParameter(const std::string &key, const std::string &value)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	server_params[key] = value;
+}
+
+int64 BenchServer::getTimeSeconds(void)
+{
+	return getTimeMS() / 1000;
+}
+
+int64 BenchServer::getTimeMS(void)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (simulated_clock)
+	{
+		return sim_time_ms;
+	}
+	return steady_ms() - start_time_ms;
+}
+
+void BenchServer::destroy(IObject *obj)
+{
+	if (obj != NULL)
+	{
+		obj->Remove();
+	}
+}
+
+void BenchServer::wait(unsigned int ms)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (simulated_clock)
+		{
+			sim_time_ms += ms;
+			return;
+		}
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+IMutex* BenchServer::createMutex(void)
+{
+	return new CMutex;
+}
+
+ISharedMutex* BenchServer::createSharedMutex()
+{
+	return new SharedMutex;
+}
+
+ICondition* BenchServer::createCondition(void)
+{
+	return new CCondition;
+}
+
+bool BenchServer::createThread(IThread *thread, const std::string& name, CreateThreadFlags flags)
+{
+	std::thread t(run_thread, thread);
+	t.detach();
+	return true;
+}
+
+void BenchServer::setCurrentThreadName(const std::string& name)
+{
+}
+
+IThreadPool * BenchServer::getThreadPool(void)
+{
+	return threadpool.get();
+}
+
+IThreadPool* BenchServer::createThreadPool(size_t max_threads, size_t max_waiting_threads, const std::string& idle_name)
+{
+	return new BenchThreadPool;
+}
+
+THREAD_ID BenchServer::getThreadID(void)
+{
+	return static_cast<THREAD_ID>(std::hash<std::thread::id>()(std::this_thread::get_id()));
+}
+
+IFsFile* BenchServer::openFile(std::string pFilename, int pMode)
+{
+	File *file=new File;
+	if(!file->Open(pFilename, pMode) )
+	{
+		delete file;
+		return NULL;
+	}
+	return file;
+}
+
+IFsFile* BenchServer::openFileFromHandle(void *handle, const std::string& pFilename)
+{
+	File *file=new File;
+	if(!file->Open(handle, pFilename) )
+	{
+		delete file;
+		return NULL;
+	}
+	return file;
+}
+
+IFsFile* BenchServer::openTemporaryFile(void)
+{
+	File *file=new File;
+	if(!file->OpenTemporaryFile(tmpdir) )
+	{
+		delete file;
+		return NULL;
+	}
+	return file;
+}
+
+IFile* BenchServer::openMemoryFile(void)
+{
+	return openTemporaryFile();
+}
+
+bool BenchServer::deleteFile(std::string pFilename)
+{
+	return unlink(pFilename.c_str())==0;
+}
+
+bool BenchServer::fileExists(std::string pFilename)
+{
+	struct stat buf;
+	return stat(pFilename.c_str(), &buf)==0;
+}
+
+std::string BenchServer::getServerWorkingDir(void)
+{
+	char buf[4096];
+	if (getcwd(buf, sizeof(buf)) == NULL)
+	{
+		return std::string();
+	}
+	return buf;
+}
+
+void BenchServer::setTemporaryDirectory(const std::string &dir)
+{
+	tmpdir = dir;
+}
+
+unsigned int BenchServer::getRandomNumber(void)
+{
+	static thread_local std::mt19937 rng(std::random_device{}());
+	return rng();
+}
+
+std::vector<unsigned int> BenchServer::getRandomNumbers(size_t n)
+{
+	std::vector<unsigned int> ret;
+	ret.resize(n);
+	for (size_t i = 0; i < n; ++i)
+	{
+		ret[i] = getRandomNumber();
+	}
+	return ret;
+}
+
+void BenchServer::randomFill(char *buf, size_t blen)
+{
+	for (size_t i = 0; i < blen; ++i)
+	{
+		buf[i] = static_cast<char>(getRandomNumber());
+	}
+}
+
+unsigned int BenchServer::getSecureRandomNumber(void)
+{
+	return getRandomNumber();
+}
+
+std::vector<unsigned int> BenchServer::getSecureRandomNumbers(size_t n)
+{
+	return getRandomNumbers(n);
+}
+
+void BenchServer::secureRandomFill(char *buf, size_t blen)
+{
+	randomFill(buf, blen);
+}
+
+void BenchServer::setFailBit(size_t failbit)
+{
+	failbits |= failbit;
+}
+
+void BenchServer::clearFailBit(size_t failbit)
+{
+	failbits &= ~failbit;
+}
+
+size_t BenchServer::getFailBits(void)
+{
+	return failbits;
+}
+
+void BenchServer::setLogFile(const std::string &plf, std::string chown_user)
+{
+	unsupported("setLogFile");
+}
+
+void BenchServer::setLogCircularBufferSize(size_t size)
+{
+	unsupported("setLogCircularBufferSize");
+}
+
+std::vector<SCircularLogEntry> BenchServer::getCicularLogBuffer(size_t minid)
+{
+	unsupported("getCicularLogBuffer");
+	return std::vector<SCircularLogEntry>();
+}
+
+bool BenchServer::Write(THREAD_ID tid, const std::string &str, bool cached)
+{
+	unsupported("Write");
+	return bool();
+}
+
+bool BenchServer::WriteRaw(THREAD_ID tid, const char *buf, size_t bsize, bool cached)
+{
+	unsupported("WriteRaw");
+	return bool();
+}
+
+void BenchServer::setContentType(THREAD_ID tid, const std::string &str)
+{
+	unsupported("setContentType");
+}
+
+void BenchServer::addHeader(THREAD_ID tid, const std::string &str)
+{
+	unsupported("addHeader");
+}
+
+THREAD_ID BenchServer::Execute(const std::string &action, const std::string &context, str_map &GET, str_map &POST, str_map &PARAMS, IOutputStream *req)
+{
+	unsupported("Execute");
+	return THREAD_ID();
+}
+
+std::string BenchServer::Execute(const std::string &action, const std::string &context, str_map &GET, str_map &POST, str_map &PARAMS)
+{
+	unsupported("Execute");
+	return std::string();
+}
+
+void BenchServer::AddAction(IAction *action)
+{
+	unsupported("AddAction");
+}
+
+bool BenchServer::RemoveAction(IAction *action)
+{
+	unsupported("RemoveAction");
+	return bool();
+}
+
+void BenchServer::setActionContext(std::string context)
+{
+	unsupported("setActionContext");
+}
+
+void BenchServer::resetActionContext(void)
+{
+	unsupported("resetActionContext");
+}
+
+bool BenchServer::LoadDLL(const std::string &name)
+{
+	unsupported("LoadDLL");
+	return bool();
+}
+
+bool BenchServer::UnloadDLL(const std::string &name)
+{
+	unsupported("UnloadDLL");
+	return bool();
+}
+
+ITemplate* BenchServer::createTemplate(std::string pFile)
+{
+	unsupported("createTemplate");
+	return NULL;
+}
+
+IPipe * BenchServer::createMemoryPipe(void)
+{
+	unsupported("createMemoryPipe");
+	return NULL;
+}
+
+ISettingsReader* BenchServer::createFileSettingsReader(const std::string& pFile)
+{
+	unsupported("createFileSettingsReader");
+	return NULL;
+}
+
+ISettingsReader* BenchServer::createDBSettingsReader(THREAD_ID tid, DATABASE_ID pIdentifier, const std::string &pTable, const std::string &pSQL)
+{
+	unsupported("createDBSettingsReader");
+	return NULL;
+}
+
+ISettingsReader* BenchServer::createDBSettingsReader(IDatabase *db, const std::string &pTable, const std::string &pSQL)
+{
+	unsupported("createDBSettingsReader");
+	return NULL;
+}
+
+ISettingsReader* BenchServer::createDBMemSettingsReader(THREAD_ID tid, DATABASE_ID pIdentifier, const std::string &pTable, const std::string &pSQL)
+{
+	if (settings_reader_func != NULL)
+	{
+		return settings_reader_func(pSQL);
+	}
+	unsupported("createDBMemSettingsReader");
+	return NULL;
+}
+
+ISettingsReader* BenchServer::createDBMemSettingsReader(IDatabase *db, const std::string &pTable, const std::string &pSQL)
+{
+	if (settings_reader_func != NULL)
+	{
+		return settings_reader_func(pSQL);
+	}
+	unsupported("createDBMemSettingsReader");
+	return NULL;
+}
+
+ISettingsReader* BenchServer::createMemorySettingsReader(const std::string &pData)
+{
+	unsupported("createMemorySettingsReader");
+	return NULL;
+}
+
+IPipeThrottler* BenchServer::createPipeThrottler(size_t bps, bool percent_max)
+{
+	unsupported("createPipeThrottler");
+	return NULL;
+}
+
+IPipeThrottler* BenchServer::createPipeThrottler(IPipeThrottlerUpdater* updater)
+{
+	unsupported("createPipeThrottler");
+	return NULL;
+}
+
+bool BenchServer::openDatabase(std::string pFile, DATABASE_ID pIdentifier, const str_map& params, std::string pEngine)
+{
+	unsupported("openDatabase");
+	return bool();
+}
+
+IDatabase* BenchServer::getDatabase(THREAD_ID tid, DATABASE_ID pIdentifier)
+{
+	//Settings are read with the settings reader function instead
+	return NULL;
+}
+
+void BenchServer::destroyAllDatabases(void)
+{
+	unsupported("destroyAllDatabases");
+}
+
+void BenchServer::destroyDatabases(THREAD_ID tid)
+{
+	unsupported("destroyDatabases");
+}
+
+void BenchServer::clearDatabases(THREAD_ID tid)
+{
+	unsupported("clearDatabases");
+}
+
+ISessionMgr * BenchServer::getSessionMgr(void)
+{
+	unsupported("getSessionMgr");
+	return NULL;
+}
+
+IPlugin* BenchServer::getPlugin(THREAD_ID tid, PLUGIN_ID pIdentifier)
+{
+	unsupported("getPlugin");
+	return NULL;
+}
+
+std::string BenchServer::ConvertToUTF16(const std::string &input)
+{
+	unsupported("ConvertToUTF16");
+	return std::string();
+}
+
+std::string BenchServer::ConvertToUTF32(const std::string &input)
+{
+	unsupported("ConvertToUTF32");
+	return std::string();
+}
+
+std::wstring BenchServer::ConvertToWchar(const std::string &input)
+{
+	unsupported("ConvertToWchar");
+	return std::wstring();
+}
+
+std::string BenchServer::ConvertFromWchar(const std::wstring &input)
+{
+	unsupported("ConvertFromWchar");
+	return std::string();
+}
+
+std::string BenchServer::ConvertFromUTF16(const std::string &input)
+{
+	unsupported("ConvertFromUTF16");
+	return std::string();
+}
+
+std::string BenchServer::ConvertFromUTF32(const std::string &input)
+{
+	unsupported("ConvertFromUTF32");
+	return std::string();
+}
+
+std::string BenchServer::GenerateHexMD5(const std::string &input)
+{
+	unsupported("GenerateHexMD5");
+	return std::string();
+}
+
+std::string BenchServer::GenerateBinaryMD5(const std::string &input)
+{
+	unsupported("GenerateBinaryMD5");
+	return std::string();
+}
+
+void BenchServer::StartCustomStreamService(IService *pService, std::string pServiceName, unsigned short pPort, int pMaxClientsPerThread, BindTarget bindTarget)
+{
+	unsupported("StartCustomStreamService");
+}
+
+IPipe* BenchServer::ConnectStream(std::string pServer, unsigned short pPort, unsigned int pTimeoutms)
+{
+	unsupported("ConnectStream");
+	return NULL;
+}
+
+IPipe * BenchServer::PipeFromSocket(SOCKET pSocket)
+{
+	unsupported("PipeFromSocket");
+	return NULL;
+}
+
+void BenchServer::DisconnectStream(IPipe *pipe)
+{
+	unsupported("DisconnectStream");
+}
+
+std::string BenchServer::LookupHostname(const std::string& pIp)
+{
+	unsupported("LookupHostname");
+	return std::string();
+}
+
+bool BenchServer::RegisterPluginPerThreadModel(IPluginMgr *pPluginMgr, std::string pName)
+{
+	unsupported("RegisterPluginPerThreadModel");
+	return bool();
+}
+
+bool BenchServer::RegisterPluginThreadsafeModel(IPluginMgr *pPluginMgr, std::string pName)
+{
+	unsupported("RegisterPluginThreadsafeModel");
+	return bool();
+}
+
+PLUGIN_ID BenchServer::StartPlugin(std::string pName, str_map &params)
+{
+	unsupported("StartPlugin");
+	return PLUGIN_ID();
+}
+
+bool BenchServer::RestartPlugin(PLUGIN_ID pIdentifier)
+{
+	unsupported("RestartPlugin");
+	return bool();
+}
+
+unsigned int BenchServer::getNumRequests(void)
+{
+	unsupported("getNumRequests");
+	return 0;
+}
+
+void BenchServer::addRequest(void)
+{
+	unsupported("addRequest");
+}
+
+POSTFILE_KEY BenchServer::getPostFileKey()
+{
+	unsupported("getPostFileKey");
+	return POSTFILE_KEY();
+}
+
+void BenchServer::addPostFile(POSTFILE_KEY pfkey, const std::string &name, const SPostfile &pf)
+{
+	unsupported("addPostFile");
+}
+
+SPostfile BenchServer::getPostFile(POSTFILE_KEY pfkey, const std::string &name)
+{
+	unsupported("getPostFile");
+	return SPostfile();
+}
+
+void BenchServer::clearPostFiles(POSTFILE_KEY pfkey)
+{
+	unsupported("clearPostFiles");
+}
+
+void BenchServer::registerDatabaseFactory(const std::string &pEngineName, IDatabaseFactory *factory)
+{
+	unsupported("registerDatabaseFactory");
+}
+
+bool BenchServer::hasDatabaseFactory(const std::string &pEngineName)
+{
+	unsupported("hasDatabaseFactory");
+	return bool();
+}
+
+bool BenchServer::attachToDatabase(const std::string &pFile, const std::string &pName, DATABASE_ID pIdentifier)
+{
+	unsupported("attachToDatabase");
+	return bool();
+}
+
+bool BenchServer::setDatabaseAllocationChunkSize(DATABASE_ID pIdentifier, size_t allocation_chunk_size)
+{
+	unsupported("setDatabaseAllocationChunkSize");
+	return bool();
+}
+
+void BenchServer::waitForStartupComplete(void)
+{
+	unsupported("waitForStartupComplete");
+}
+
+void BenchServer::shutdown(void)
+{
+	unsupported("shutdown");
+}
+
+std::string BenchServer::secureRandomString(size_t len)
+{
+	static const char chars[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+	std::string ret;
+	ret.resize(len);
+	randomFill(&ret[0], len);
+	for (size_t i = 0; i < len; ++i)
+	{
+		ret[i] = chars[static_cast<unsigned char>(ret[i]) % (sizeof(chars) - 1)];
+	}
+	return ret;
+}
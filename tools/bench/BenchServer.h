@@ -0,0 +1,160 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#pragma once
+
+#include "../../Interface/Server.h"
+#include "../../Interface/ThreadPool.h"
+#include <map>
+#include <memory>
+#include <mutex>
+
+/**
+* Minimal IServer implementation for the standalone benchmarks in tools/bench.
+* Only the services needed by the benchmarked code (logging, time, locking,
+* threads, files, random numbers) are implemented, everything else aborts.
+* The clock can be switched to a simulated clock which only advances
+* through wait(), so that time dependent code can be simulated deterministically.
+* Settings readers for database queries are created by a function the
+* benchmark sets, which gets the query.
+*/
+class BenchServer : public IServer
+{
+public:
+	typedef ISettingsReader* (*SettingsReaderFunc)(const std::string& sql);
+
+	BenchServer();
+
+	void setSimulatedClock(bool b);
+	void advanceClock(int64 ms);
+	void setSettingsReaderFunc(SettingsReaderFunc func);
+
+	virtual void setLogLevel(int LogLevel);
+	virtual void setLogFile(const std::string &plf, std::string chown_user="");
+	virtual void setLogCircularBufferSize(size_t size);
+	virtual std::vector<SCircularLogEntry> getCicularLogBuffer(size_t minid);
+	virtual void Log(const std::string &pStr, int LogLevel=LL_INFO);
+	virtual bool Write(THREAD_ID tid, const std::string &str, bool cached=true);
+	virtual bool WriteRaw(THREAD_ID tid, const char *buf, size_t bsize, bool cached=true);
+	virtual std::string getServerParameter(const std::string &key);
+	virtual std::string getServerParameter(const std::string &key, const std::string &def);
+	virtual void setServerParameter(const std::string &key, const std::string &value);
+	virtual void setContentType(THREAD_ID tid, const std::string &str);
+	virtual void addHeader(THREAD_ID tid, const std::string &str);
+	virtual THREAD_ID Execute(const std::string &action, const std::string &context, str_map &GET, str_map &POST, str_map &PARAMS, IOutputStream *req);
+	virtual std::string Execute(const std::string &action, const std::string &context, str_map &GET, str_map &POST, str_map &PARAMS);
+	virtual void AddAction(IAction *action);
+	virtual bool RemoveAction(IAction *action);
+	virtual void setActionContext(std::string context);
+	virtual void resetActionContext(void);
+	virtual int64 getTimeSeconds(void);
+	virtual int64 getTimeMS(void);
+	virtual bool LoadDLL(const std::string &name);
+	virtual bool UnloadDLL(const std::string &name);
+	virtual void destroy(IObject *obj);
+	virtual void wait(unsigned int ms);
+	virtual ITemplate* createTemplate(std::string pFile);
+	virtual IMutex* createMutex(void);
+	virtual ISharedMutex* createSharedMutex();
+	virtual ICondition* createCondition(void);
+	virtual bool createThread(IThread *thread, const std::string& name=std::string(), CreateThreadFlags flags = CreateThreadFlags_None);
+	virtual void setCurrentThreadName(const std::string& name);
+	virtual IPipe * createMemoryPipe(void);
+	virtual IThreadPool * getThreadPool(void);
+	virtual ISettingsReader* createFileSettingsReader(const std::string& pFile);
+	virtual ISettingsReader* createDBSettingsReader(THREAD_ID tid, DATABASE_ID pIdentifier, const std::string &pTable, const std::string &pSQL="");
+	virtual ISettingsReader* createDBSettingsReader(IDatabase *db, const std::string &pTable, const std::string &pSQL="");
+	virtual ISettingsReader* createDBMemSettingsReader(THREAD_ID tid, DATABASE_ID pIdentifier, const std::string &pTable, const std::string &pSQL = "");
+	virtual ISettingsReader* createDBMemSettingsReader(IDatabase *db, const std::string &pTable, const std::string &pSQL = "");
+	virtual ISettingsReader* createMemorySettingsReader(const std::string &pData);
+	virtual IPipeThrottler* createPipeThrottler(size_t bps, bool percent_max);
+	virtual IPipeThrottler* createPipeThrottler(IPipeThrottlerUpdater* updater);
+	virtual IThreadPool* createThreadPool(size_t max_threads, size_t max_waiting_threads, const std::string& idle_name);
+	virtual bool openDatabase(std::string pFile, DATABASE_ID pIdentifier, const str_map& params = str_map(), std::string pEngine="sqlite");
+	virtual IDatabase* getDatabase(THREAD_ID tid, DATABASE_ID pIdentifier);
+	virtual void destroyAllDatabases(void);
+	virtual void destroyDatabases(THREAD_ID tid);
+	virtual void clearDatabases(THREAD_ID tid);
+	virtual ISessionMgr * getSessionMgr(void);
+	virtual IPlugin* getPlugin(THREAD_ID tid, PLUGIN_ID pIdentifier);
+	virtual THREAD_ID getThreadID(void);
+	virtual std::string ConvertToUTF16(const std::string &input);
+	virtual std::string ConvertToUTF32(const std::string &input);
+	virtual std::wstring ConvertToWchar(const std::string &input);
+	virtual std::string ConvertFromWchar(const std::wstring &input);
+	virtual std::string ConvertFromUTF16(const std::string &input);
+	virtual std::string ConvertFromUTF32(const std::string &input);
+	virtual std::string GenerateHexMD5(const std::string &input);
+	virtual std::string GenerateBinaryMD5(const std::string &input);
+	virtual void StartCustomStreamService(IService *pService, std::string pServiceName, unsigned short pPort, int pMaxClientsPerThread=-1, BindTarget bindTarget=BindTarget_All);
+	virtual IPipe* ConnectStream(std::string pServer, unsigned short pPort, unsigned int pTimeoutms=0);
+	virtual IPipe * PipeFromSocket(SOCKET pSocket);
+	virtual void DisconnectStream(IPipe *pipe);
+	virtual std::string LookupHostname(const std::string& pIp);
+	virtual bool RegisterPluginPerThreadModel(IPluginMgr *pPluginMgr, std::string pName);
+	virtual bool RegisterPluginThreadsafeModel(IPluginMgr *pPluginMgr, std::string pName);
+	virtual PLUGIN_ID StartPlugin(std::string pName, str_map &params);
+	virtual bool RestartPlugin(PLUGIN_ID pIdentifier);
+	virtual unsigned int getNumRequests(void);
+	virtual void addRequest(void);
+	virtual IFsFile* openFile(std::string pFilename, int pMode=0);
+	virtual IFsFile* openFileFromHandle(void *handle, const std::string& pFilename);
+	virtual IFsFile* openTemporaryFile(void);
+	virtual IFile* openMemoryFile(void);
+	virtual bool deleteFile(std::string pFilename);
+	virtual bool fileExists(std::string pFilename);
+	virtual POSTFILE_KEY getPostFileKey();
+	virtual void addPostFile(POSTFILE_KEY pfkey, const std::string &name, const SPostfile &pf);
+	virtual SPostfile getPostFile(POSTFILE_KEY pfkey, const std::string &name);
+	virtual void clearPostFiles(POSTFILE_KEY pfkey);
+	virtual std::string getServerWorkingDir(void);
+	virtual void setTemporaryDirectory(const std::string &dir);
+	virtual void registerDatabaseFactory(const std::string &pEngineName, IDatabaseFactory *factory);
+	virtual bool hasDatabaseFactory(const std::string &pEngineName);
+	virtual bool attachToDatabase(const std::string &pFile, const std::string &pName, DATABASE_ID pIdentifier);
+	virtual bool setDatabaseAllocationChunkSize(DATABASE_ID pIdentifier, size_t allocation_chunk_size);
+	virtual void waitForStartupComplete(void);
+	virtual void shutdown(void);
+	virtual unsigned int getRandomNumber(void);
+	virtual std::vector<unsigned int> getRandomNumbers(size_t n);
+	virtual void randomFill(char *buf, size_t blen);
+	virtual unsigned int getSecureRandomNumber(void);
+	virtual std::vector<unsigned int> getSecureRandomNumbers(size_t n);
+	virtual void secureRandomFill(char *buf, size_t blen);
+	virtual std::string secureRandomString(size_t len);
+	virtual void setFailBit(size_t failbit);
+	virtual void clearFailBit(size_t failbit);
+	virtual size_t getFailBits(void);
+
+private:
+	void unsupported(const std::string& name);
+
+	int loglevel;
+	bool simulated_clock;
+	int64 sim_time_ms;
+	int64 start_time_ms;
+	std::mutex mutex;
+	str_map server_params;
+	std::string tmpdir;
+	size_t failbits;
+	std::auto_ptr<IThreadPool> threadpool;
+	SettingsReaderFunc settings_reader_func;
+};
+
+void bench_init(void);
+BenchServer* bench_server(void);
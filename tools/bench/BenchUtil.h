@@ -0,0 +1,43 @@
+#pragma once
+
+#include "../../Interface/Types.h"
+#include <vector>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <iostream>
+#include <stdlib.h>
+
+inline int64 bench_time_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline size_t bench_arg(int argc, char* argv[], int idx, size_t def)
+{
+	if (idx < argc)
+	{
+		return static_cast<size_t>(atoll(argv[idx]));
+	}
+	return def;
+}
+
+inline int64 bench_percentile(std::vector<int64>& vals, double p)
+{
+	if (vals.empty())
+	{
+		return 0;
+	}
+	size_t idx = static_cast<size_t>(p*(vals.size() - 1));
+	std::nth_element(vals.begin(), vals.begin() + idx, vals.end());
+	return vals[idx];
+}
+
+inline void bench_print_percentiles(const std::string& name, std::vector<int64>& vals_ns)
+{
+	std::cout << name << " (us): p50=" << bench_percentile(vals_ns, 0.5) / 1000.0
+		<< " p99=" << bench_percentile(vals_ns, 0.99) / 1000.0
+		<< " p99.9=" << bench_percentile(vals_ns, 0.999) / 1000.0
+		<< " max=" << bench_percentile(vals_ns, 1.0) / 1000.0 << std::endl;
+}
@@ -0,0 +1,303 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+
+/**
+* Transferred bytes of an incremental file transfer with fixed blocks and
+* with content-defined chunks, for edits that shift data.
+* The base file is a synthetic SQL dump. Each workload modifies it and
+* counts the protocol bytes in both directions:
+* - fixed: per 512KB block the server sends the block request with the
+*   MD5 and 4KB Adler-32 hashes of the base file. The client answers
+*   ID_NO_CHANGE, the changed 4KB chunks (ID_UPDATE_CHUNK) or the whole
+*   block, followed by ID_BLOCK_HASH, like ChunkSendThread.
+* - cdc: the server sends the MD5 of every base file chunk
+*   (ID_CDC_HASHES). The client chunks with cdc_chunk_size and sends runs
+*   of known chunks (ID_CDC_MATCH), unknown chunks (ID_CDC_DATA) and the
+*   file hash (ID_CDC_END).
+* Usage: bench_cdc_transfer [file_mb=64]
+*/
+
+#include "BenchServer.h"
+#include "BenchUtil.h"
+#include "../../common/cdc.h"
+#include "../../common/adler32.h"
+#include "../../md5.h"
+#include "../../fileservplugin/chunk_settings.h"
+#include "../../stringtools.h"
+#include <vector>
+#include <string>
+#include <map>
+#include <iostream>
+#include <iomanip>
+#include <stdlib.h>
+#include <string.h>
+
+namespace
+{
+	struct STransfer
+	{
+		STransfer()
+			: to_client(0), to_server(0)
+		{}
+
+		int64 to_client;
+		int64 to_server;
+	};
+
+	std::string create_dump(size_t size, unsigned int seed)
+	{
+		std::string ret;
+		ret.reserve(size + 256);
+		srand(seed);
+		for (size_t id = 0; ret.size() < size; ++id)
+		{
+			ret += "INSERT INTO `files` VALUES (" + convert(id) + ",'";
+			size_t name_len = 8 + rand() % 40;
+			for (size_t i = 0; i < name_len; ++i)
+			{
+				ret += static_cast<char>('a' + rand() % 26);
+			}
+			ret += "'," + convert(rand()) + "," + convert(rand() % 1000) + ");\n";
+		}
+		ret.resize(size);
+		return ret;
+	}
+
+	std::string md5_of(const char* data, size_t size)
+	{
+		MD5 md5(reinterpret_cast<unsigned char*>(const_cast<char*>(data)), static_cast<unsigned int>(size));
+		return std::string(reinterpret_cast<char*>(md5.raw_digest_int()), big_hash_size);
+	}
+
+	STransfer transfer_fixed(const std::string& base, const std::string& data)
+	{
+		STransfer ret;
+		for (size_t pos = 0; pos < data.size(); pos += c_checkpoint_dist)
+		{
+			size_t block_size = (std::min)(static_cast<size_t>(c_checkpoint_dist), data.size() - pos);
+			if (pos >= base.size())
+			{
+				//Request without hashes, the client sends the whole block
+				ret.to_client += 2 + sizeof(_i64);
+				ret.to_server += c_chunk_padding + block_size + 1 + sizeof(_i64) + big_hash_size;
+				continue;
+			}
+
+			ret.to_client += 2 + sizeof(_i64) + chunkhash_single_size;
+
+			size_t base_block_size = (std::min)(static_cast<size_t>(c_checkpoint_dist), base.size() - pos);
+			bool sent_update = false;
+			for (size_t off = 0; off < block_size; off += c_small_hash_dist)
+			{
+				size_t r = (std::min)(static_cast<size_t>(c_small_hash_dist), block_size - off);
+				bool changed = off + r > base_block_size;
+				if (!changed)
+				{
+					size_t base_r = (std::min)(static_cast<size_t>(c_small_hash_dist), base_block_size - off);
+					changed = urb_adler32(urb_adler32(0, NULL, 0), &data[pos + off], static_cast<unsigned int>(r))
+						!= urb_adler32(urb_adler32(0, NULL, 0), &base[pos + off], static_cast<unsigned int>(base_r));
+				}
+				if (changed)
+				{
+					ret.to_server += c_chunk_padding + r;
+					sent_update = true;
+				}
+			}
+
+			if (!sent_update
+				&& (block_size != base_block_size
+					|| md5_of(&data[pos], block_size) != md5_of(&base[pos], base_block_size)))
+			{
+				ret.to_server += c_chunk_padding + block_size + 1 + sizeof(_i64) + big_hash_size;
+			}
+			else if (!sent_update)
+			{
+				ret.to_server += 1 + sizeof(_i64);
+			}
+			else
+			{
+				ret.to_server += 1 + sizeof(_i64) + big_hash_size;
+			}
+		}
+		return ret;
+	}
+
+	std::vector<std::string> cdc_hashes(const std::string& data)
+	{
+		std::vector<std::string> ret;
+		size_t pos = 0;
+		while (pos < data.size())
+		{
+			unsigned int chunk_size = cdc_chunk_size(&data[pos], static_cast<unsigned int>((std::min)(data.size() - pos, static_cast<size_t>(c_cdc_max_size))));
+			ret.push_back(md5_of(&data[pos], chunk_size));
+			pos += chunk_size;
+		}
+		return ret;
+	}
+
+	STransfer transfer_cdc(const std::string& base, const std::string& data)
+	{
+		STransfer ret;
+		std::vector<std::string> hashes = cdc_hashes(base);
+		ret.to_client += hashes.size()*big_hash_size + 2 * (hashes.size() / c_cdc_hashes_per_packet + 1);
+
+		std::map<std::string, _u32> hash_idx;
+		for (size_t i = hashes.size(); i-- > 0;)
+		{
+			hash_idx[hashes[i]] = static_cast<_u32>(i);
+		}
+
+		const int64 match_size = 1 + 2 * sizeof(_u32);
+		_u32 run_start = 0;
+		_u32 run_len = 0;
+		size_t pos = 0;
+		while (pos < data.size())
+		{
+			unsigned int chunk_size = cdc_chunk_size(&data[pos], static_cast<unsigned int>((std::min)(data.size() - pos, static_cast<size_t>(c_cdc_max_size))));
+			std::string digest = md5_of(&data[pos], chunk_size);
+
+			_u32 idx = 0;
+			bool found;
+			if (run_len > 0
+				&& run_start + run_len < hashes.size()
+				&& hashes[run_start + run_len] == digest)
+			{
+				idx = run_start + run_len;
+				found = true;
+			}
+			else
+			{
+				std::map<std::string, _u32>::iterator it = hash_idx.find(digest);
+				found = it != hash_idx.end();
+				if (found)
+				{
+					idx = it->second;
+				}
+			}
+
+			if (found
+				&& run_len > 0
+				&& idx == run_start + run_len
+				&& run_len < c_cdc_max_match_run)
+			{
+				++run_len;
+			}
+			else
+			{
+				if (run_len > 0)
+				{
+					ret.to_server += match_size;
+				}
+				run_len = 0;
+
+				if (found)
+				{
+					run_start = idx;
+					run_len = 1;
+				}
+				else
+				{
+					ret.to_server += 1 + sizeof(_u32) + chunk_size;
+				}
+			}
+
+			pos += chunk_size;
+		}
+
+		if (run_len > 0)
+		{
+			ret.to_server += match_size;
+		}
+
+		ret.to_server += 1 + big_hash_size;
+		return ret;
+	}
+
+	std::string kb(int64 bytes)
+	{
+		return convert(bytes / 1024) + "KB";
+	}
+
+	void run_workload(const std::string& name, const std::string& base, const std::string& data)
+	{
+		STransfer fixed = transfer_fixed(base, data);
+		STransfer cdc = transfer_cdc(base, data);
+
+		std::cout << std::left << std::setw(28) << name
+			<< " fixed: up=" << std::setw(9) << kb(fixed.to_server) << " down=" << std::setw(8) << kb(fixed.to_client)
+			<< " cdc: up=" << std::setw(9) << kb(cdc.to_server) << " down=" << kb(cdc.to_client) << std::endl;
+	}
+
+	std::string insert_rows(const std::string& base, size_t pos, size_t n)
+	{
+		pos = base.find('\n', pos) + 1;
+		std::string rows;
+		for (size_t i = 0; i < n; ++i)
+		{
+			rows += "INSERT INTO `files` VALUES (" + convert(1000000000 + i) + ",'inserted row',1,2);\n";
+		}
+		return base.substr(0, pos) + rows + base.substr(pos);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	bench_init();
+
+	size_t file_size = bench_arg(argc, argv, 1, 64) * 1024 * 1024;
+
+	std::string base = create_dump(file_size, 0);
+
+	int64 start = bench_time_ns();
+	size_t n_chunks = cdc_hashes(base).size();
+	int64 elapsed = bench_time_ns() - start;
+	std::cout << "file_mb=" << file_size / 1024 / 1024 << " cdc chunks=" << n_chunks
+		<< " avg chunk=" << file_size / n_chunks / 1024 << "KB"
+		<< " chunking+md5 MB/s=" << (file_size / 1024.0 / 1024.0) / (elapsed / 1000000000.0) << std::endl;
+
+	run_workload("unchanged", base, base);
+
+	std::string data = base;
+	for (size_t i = 0; i < 100; ++i)
+	{
+		data[(i * 7919 * 4096) % data.size()] ^= 1;
+	}
+	run_workload("100 in-place byte changes", base, data);
+
+	run_workload("append 1MB", base, base + create_dump(1024 * 1024, 2));
+
+	data = base;
+	data.insert(data.begin() + 1000, 'x');
+	run_workload("insert 1 byte at 1000", base, data);
+
+	run_workload("insert 100 rows at middle", base, insert_rows(base, base.size() / 2, 100));
+
+	data = base;
+	for (size_t pos = base.size(); pos > 1024 * 1024; pos -= 1024 * 1024)
+	{
+		data = insert_rows(data, pos - 1024 * 1024, 1);
+	}
+	run_workload("insert 1 row every 1MB", base, data);
+
+	data = base;
+	data.erase(10 * 1024 * 1024 % data.size(), 4096);
+	run_workload("delete 4KB at 10MB", base, data);
+
+	return 0;
+}
@@ -0,0 +1,260 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+
+/**
+* Storage used by daily backups of a large file that changes a little every
+* day (like a VM image or database file), as plain files and in the chunk
+* store. Each backup writes the new version as a new file (no reflinks) and
+* adds it to the chunk store. Every version is read back through
+* ChunkStore::openFile and compared. Then the oldest backups are deleted
+* and ChunkStore::releaseUnused() frees the chunks only they used.
+* Reports stored bytes, store and read MB/s.
+* Usage: bench_chunk_store [file_mb=256] [versions=7] [changes_per_version=20]
+*/
+
+#include "BenchServer.h"
+#include "BenchUtil.h"
+#include "urbackupserver/ChunkStore.h"
+#include "urbackupserver/server.h"
+#include "urbackupserver/server_settings.h"
+#include "urbackupcommon/os_functions.h"
+#include "MemorySettingsReader.h"
+#include "../../stringtools.h"
+#include <vector>
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+//The parts of BackupServer and ServerLogger ChunkStore and server_settings.cpp use
+bool BackupServer::isImageSnapshotsEnabled()
+{
+	return false;
+}
+
+bool BackupServer::canReflink()
+{
+	return false;
+}
+
+void ServerLogger::Log(logid_t logid, const std::string &pStr, int LogLevel)
+{
+	if (LogLevel >= LL_WARNING)
+	{
+		std::cerr << pStr << std::endl;
+	}
+}
+
+namespace
+{
+	std::string backupfolder;
+
+	ISettingsReader* settings_reader(const std::string& sql)
+	{
+		return new CMemorySettingsReader("backupfolder=" + backupfolder + "\n");
+	}
+
+	int64 dir_size(const std::string& path)
+	{
+		int64 ret = 0;
+		std::vector<SFile> files = getFiles(path);
+		for (size_t i = 0; i < files.size(); ++i)
+		{
+			if (files[i].isdir)
+			{
+				ret += dir_size(path + "/" + files[i].name);
+			}
+			else
+			{
+				ret += files[i].size;
+			}
+		}
+		return ret;
+	}
+
+	void write_file(const std::string& fn, const std::string& data)
+	{
+		std::auto_ptr<IFile> f(Server->openFile(fn, MODE_WRITE));
+		if (f.get() == NULL
+			|| f->Write(data) != data.size())
+		{
+			std::cerr << "Error writing " << fn << std::endl;
+			abort();
+		}
+	}
+
+	bool read_equals(const std::string& fn, const std::string& data)
+	{
+		std::auto_ptr<IFsFile> f(ChunkStore::openFile(fn, MODE_READ_SEQUENTIAL));
+		if (f.get() == NULL
+			|| f->Size() != static_cast<int64>(data.size()))
+		{
+			return false;
+		}
+
+		std::vector<char> buf(1024 * 1024);
+		size_t pos = 0;
+		_u32 r;
+		while ((r = f->Read(buf.data(), static_cast<_u32>(buf.size()))) > 0)
+		{
+			if (pos + r > data.size()
+				|| memcmp(buf.data(), &data[pos], r) != 0)
+			{
+				return false;
+			}
+			pos += r;
+		}
+		return pos == data.size();
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	bench_init();
+	bench_server()->setSettingsReaderFunc(settings_reader);
+	ServerSettings::init_mutex();
+	ChunkStore::initMutex();
+
+	size_t file_size = bench_arg(argc, argv, 1, 256) * 1024 * 1024;
+	size_t n_versions = bench_arg(argc, argv, 2, 7);
+	size_t n_changes = bench_arg(argc, argv, 3, 20);
+
+	char dir_template[] = "/tmp/bench_chunk_store_XXXXXX";
+	if (mkdtemp(dir_template) == NULL)
+	{
+		abort();
+	}
+	backupfolder = dir_template;
+
+	//The chunk store database goes to urbackup/chunkindex in the working directory
+	char wd_template[] = "/tmp/bench_chunk_store_wd_XXXXXX";
+	if (mkdtemp(wd_template) == NULL
+		|| chdir(wd_template) != 0
+		|| !os_create_dir("urbackup"))
+	{
+		abort();
+	}
+
+	std::string data(file_size, 0);
+	srand(0);
+	for (size_t i = 0; i < data.size(); ++i)
+	{
+		data[i] = static_cast<char>(rand());
+	}
+
+	ChunkStore chunk_store(backupfolder, logid_t());
+	if (chunk_store.has_error())
+	{
+		std::cerr << "Error opening chunk store" << std::endl;
+		return 1;
+	}
+
+	std::vector<std::string> versions;
+	std::vector<std::string> paths;
+	int64 store_ns = 0;
+	for (size_t v = 0; v < n_versions; ++v)
+	{
+		if (v > 0)
+		{
+			//Scattered 4KB writes and some appended data
+			for (size_t i = 0; i < n_changes; ++i)
+			{
+				size_t off = (static_cast<size_t>(rand()) * 4096) % (data.size() - 4096);
+				for (size_t j = 0; j < 4096; ++j)
+				{
+					data[off + j] = static_cast<char>(rand());
+				}
+			}
+			data.append(64 * 1024, static_cast<char>(v));
+		}
+		versions.push_back(data);
+
+		std::string dir = backupfolder + "/client/backup_" + convert(v);
+		os_create_dir_recursive(dir);
+		paths.push_back(dir + "/image.raw");
+		write_file(paths.back(), data);
+
+		int64 start = bench_time_ns();
+		if (!chunk_store.storeFile(paths.back()))
+		{
+			std::cerr << "Error storing " << paths.back() << std::endl;
+			return 1;
+		}
+		store_ns += bench_time_ns() - start;
+	}
+
+	int64 logical = 0;
+	for (size_t v = 0; v < versions.size(); ++v)
+	{
+		logical += versions[v].size();
+	}
+
+	int64 read_ns = 0;
+	for (size_t v = 0; v < versions.size(); ++v)
+	{
+		int64 start = bench_time_ns();
+		if (!read_equals(paths[v], versions[v]))
+		{
+			std::cerr << "Content of " << paths[v] << " differs" << std::endl;
+			return 1;
+		}
+		read_ns += bench_time_ns() - start;
+	}
+
+	int64 stored = dir_size(backupfolder);
+	std::cout << "file_mb=" << file_size / 1024 / 1024 << " versions=" << n_versions << " changes/version=" << n_changes
+		<< " plain files=" << PrettyPrintBytes(logical) << " chunk store=" << PrettyPrintBytes(stored)
+		<< " (" << (stored * 100 / logical) << "%)"
+		<< " store MB/s=" << static_cast<int64>((logical / 1024.0 / 1024.0) / (store_ns / 1000000000.0))
+		<< " read MB/s=" << static_cast<int64>((logical / 1024.0 / 1024.0) / (read_ns / 1000000000.0))
+		<< std::endl;
+
+	//Cleanup of the older half of the backups
+	size_t n_delete = n_versions / 2;
+	for (size_t v = 0; v < n_delete; ++v)
+	{
+		Server->deleteFile(paths[v]);
+		os_remove_dir(ExtractFilePath(paths[v]));
+	}
+
+	int64 start = bench_time_ns();
+	chunk_store.releaseUnused();
+	int64 release_ns = bench_time_ns() - start;
+
+	for (size_t v = n_delete; v < versions.size(); ++v)
+	{
+		if (!read_equals(paths[v], versions[v]))
+		{
+			std::cerr << "Content of " << paths[v] << " differs after cleanup" << std::endl;
+			return 1;
+		}
+	}
+
+	int64 stored_after = dir_size(backupfolder);
+	std::cout << "deleted " << n_delete << " backups: chunk store=" << PrettyPrintBytes(stored_after)
+		<< " freed=" << PrettyPrintBytes(stored - stored_after)
+		<< " release ms=" << release_ns / 1000000 << std::endl;
+
+	ChunkStore::shutdown();
+
+	os_remove_nonempty_dir(backupfolder);
+	os_remove_nonempty_dir(wd_template);
+
+	return 0;
+}
@@ -0,0 +1,274 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+
+/**
+* Web interface asset load: N sessions request a set of static files
+* (JavaScript and CSS assets plus images) through CHTTPFile in a loop. Like
+* a browser, every session accepts gzip and (unless revalidate=0)
+* revalidates files it has already seen with If-None-Match. The response
+* is written into a pipe that only counts bytes. Reports requests/s, bytes sent per request and
+* latency percentiles.
+* Usage: bench_http_static [sessions=200] [duration_ms=5000] [asset_kb=100]
+*   [revalidate=1]
+* Build with BENCH_DEFS=-DBENCH_HTTP_NO_PARAMS against trees whose
+* CHTTPFile does not take the request headers (no caching or validators).
+*/
+
+#include "BenchServer.h"
+#include "BenchUtil.h"
+#include "httpserver/HTTPFile.h"
+#include "httpserver/MIMEType.h"
+#include "httpserver/IndexFiles.h"
+#ifndef BENCH_HTTP_NO_PARAMS
+#include "httpserver/StaticFileCache.h"
+#endif
+#include "../../Interface/Pipe.h"
+#include "../../Interface/File.h"
+#include "../../stringtools.h"
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <map>
+#include <iostream>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace
+{
+	std::atomic<bool> do_stop(false);
+	std::atomic<bool> do_start(false);
+
+	class CountingPipe : public IPipe
+	{
+	public:
+		CountingPipe()
+			: written(0)
+		{
+		}
+
+		virtual size_t Read(char *buffer, size_t bsize, int timeoutms = -1) { return 0; }
+		virtual bool Write(const char *buffer, size_t bsize, int timeoutms = -1, bool flush = true)
+		{
+			if (header.empty())
+			{
+				header.assign(buffer, (std::min)(bsize, static_cast<size_t>(1024)));
+			}
+			written += bsize;
+			return true;
+		}
+		virtual size_t Read(std::string *ret, int timeoutms = -1) { return 0; }
+		virtual bool Write(const std::string &str, int timeoutms = -1, bool flush = true)
+		{
+			return Write(str.data(), str.size(), timeoutms, flush);
+		}
+		virtual bool Flush(int timeoutms = -1) { return true; }
+		virtual bool isWritable(int timeoutms = 0) { return true; }
+		virtual bool isReadable(int timeoutms = 0) { return false; }
+		virtual bool hasError(void) { return false; }
+		virtual void shutdown(void) {}
+		virtual size_t getNumElements(void) { return 0; }
+		virtual void addThrottler(IPipeThrottler *throttler) {}
+		virtual void addOutgoingThrottler(IPipeThrottler *throttler) {}
+		virtual void addIncomingThrottler(IPipeThrottler *throttler) {}
+		virtual _i64 getTransferedBytes(void) { return written; }
+		virtual void resetTransferedBytes(void) { written = 0; }
+
+		void reset()
+		{
+			header.clear();
+			written = 0;
+		}
+
+		std::string header;
+		int64 written;
+	};
+
+	std::string response_etag(const std::string& header)
+	{
+		size_t pos = header.find("\r\nETag: ");
+		if (pos == std::string::npos)
+		{
+			return std::string();
+		}
+		pos += 8;
+		return header.substr(pos, header.find("\r\n", pos) - pos);
+	}
+
+	struct SSessionResult
+	{
+		SSessionResult()
+			: n_requests(0), n_not_modified(0), bytes(0)
+		{}
+
+		size_t n_requests;
+		size_t n_not_modified;
+		int64 bytes;
+		std::vector<int64> latencies_ns;
+	};
+
+	void session(const std::vector<std::string>* files, bool revalidate, SSessionResult* result)
+	{
+		std::map<std::string, std::string> etags;
+		CountingPipe pipe;
+
+		while (!do_start)
+		{
+			std::this_thread::yield();
+		}
+
+		size_t idx = 0;
+		while (!do_stop)
+		{
+			const std::string& fn = (*files)[idx % files->size()];
+			++idx;
+
+			str_map params;
+			params["ACCEPT-ENCODING"] = "gzip, deflate";
+			std::map<std::string, std::string>::iterator it = etags.find(fn);
+			if (it != etags.end())
+			{
+				params["IF-NONE-MATCH"] = it->second;
+			}
+
+			pipe.reset();
+			int64 start = bench_time_ns();
+#ifdef BENCH_HTTP_NO_PARAMS
+			CHTTPFile req(fn, &pipe);
+#else
+			CHTTPFile req(fn, &pipe, params);
+#endif
+			req();
+			result->latencies_ns.push_back(bench_time_ns() - start);
+
+			++result->n_requests;
+			result->bytes += pipe.written;
+			if (next(pipe.header, 0, "HTTP/1.1 304"))
+			{
+				++result->n_not_modified;
+			}
+
+			std::string etag = response_etag(pipe.header);
+			if (revalidate && !etag.empty())
+			{
+				etags[fn] = etag;
+			}
+		}
+	}
+
+	std::vector<std::string> create_assets(const std::string& dir, size_t asset_size)
+	{
+		std::vector<std::string> ret;
+		std::string text;
+		while (text.size() < asset_size)
+		{
+			text += "function f" + convert(text.size()) + "(a, b) { return a.value + b.value; }\n";
+		}
+		text.resize(asset_size);
+
+		std::string binary(16 * 1024, 0);
+		for (size_t i = 0; i < binary.size(); ++i)
+		{
+			binary[i] = static_cast<char>(rand());
+		}
+
+		const char* names[] = { "app.js", "lib.js", "status.js", "backups.js", "style.css",
+			"logo.png", "icon1.png", "icon2.png", "icon3.png", "bg.png" };
+		for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i)
+		{
+			std::string fn = dir + "/" + names[i];
+			std::auto_ptr<IFile> f(Server->openFile(fn, MODE_WRITE));
+			const std::string& data = findextension(fn) == "png" ? binary : text;
+			if (f.get() == NULL
+				|| f->Write(data) != data.size())
+			{
+				std::cerr << "Error writing " << fn << std::endl;
+				abort();
+			}
+			ret.push_back(fn);
+		}
+		return ret;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	bench_init();
+	add_default_mimetypes();
+	add_default_indexfiles();
+#ifndef BENCH_HTTP_NO_PARAMS
+	StaticFileCache::init_mutex();
+#endif
+
+	size_t n_sessions = bench_arg(argc, argv, 1, 200);
+	int64 duration_ms = static_cast<int64>(bench_arg(argc, argv, 2, 5000));
+	size_t asset_size = bench_arg(argc, argv, 3, 100) * 1024;
+	bool revalidate = bench_arg(argc, argv, 4, 1) != 0;
+
+	char dir_template[] = "/tmp/bench_http_XXXXXX";
+	if (mkdtemp(dir_template) == NULL)
+	{
+		abort();
+	}
+	std::vector<std::string> files = create_assets(dir_template, asset_size);
+
+	//Files changed within the last seconds are not kept in memory
+	std::this_thread::sleep_for(std::chrono::seconds(3));
+
+	std::vector<SSessionResult> results(n_sessions);
+	std::vector<std::thread> threads;
+	for (size_t i = 0; i < n_sessions; ++i)
+	{
+		threads.push_back(std::thread(session, &files, revalidate, &results[i]));
+	}
+
+	int64 start = bench_time_ns();
+	do_start = true;
+	std::this_thread::sleep_for(std::chrono::milliseconds(duration_ms));
+	do_stop = true;
+	for (size_t i = 0; i < threads.size(); ++i)
+	{
+		threads[i].join();
+	}
+	int64 elapsed = bench_time_ns() - start;
+
+	SSessionResult total;
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		total.n_requests += results[i].n_requests;
+		total.n_not_modified += results[i].n_not_modified;
+		total.bytes += results[i].bytes;
+		total.latencies_ns.insert(total.latencies_ns.end(), results[i].latencies_ns.begin(), results[i].latencies_ns.end());
+	}
+
+	std::cout << "sessions=" << n_sessions << " asset_kb=" << asset_size / 1024 << " revalidate=" << revalidate
+		<< " requests/s=" << static_cast<int64>(total.n_requests / (elapsed / 1000000000.0))
+		<< " not modified=" << (total.n_requests > 0 ? total.n_not_modified * 100 / total.n_requests : 0) << "%"
+		<< " bytes/request=" << (total.n_requests > 0 ? total.bytes / static_cast<int64>(total.n_requests) : 0)
+		<< std::endl;
+	bench_print_percentiles("request latency", total.latencies_ns);
+
+	for (size_t i = 0; i < files.size(); ++i)
+	{
+		unlink(files[i].c_str());
+	}
+	rmdir(dir_template);
+
+	return 0;
+}
@@ -0,0 +1,537 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+
+/**
+* Incremental image hashing over a sparse image file with a synthetic
+* used block bitmap. Every 512KB VHD block with used 4KB blocks is read
+* block by block, hashed (unused blocks as zero blocks) and compared with
+* the previous hash in a hashdata file, like
+* ImageThread::sendIncrImageThread. changed_pct of the used VHD blocks
+* have a different previous hash.
+* "inline" reads the previous hash with a separate Seek/Read per VHD block
+* and hashes on the reading thread (as before). "pipelined" reads the
+* hashdata in batches of 4096 entries and hashes on a pool of worker
+* threads with up to threads*4 VHD blocks in flight, completing them in
+* order (threads=0 hashes inline, as the client does on single core
+* machines). The image is in the page cache after the setup, so this
+* measures the CPU side.
+* Usage: bench_image_hash [image_mb=1024] [used_pct=50] [changed_pct=1] [threads=4]
+*/
+
+#include "BenchServer.h"
+#include "BenchUtil.h"
+#include "../../Interface/File.h"
+#include "../../urbackupcommon/sha2/sha2.h"
+#include "../../stringtools.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <string>
+#include <memory>
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+namespace
+{
+	const unsigned int c_blocksize = 4096;
+	const unsigned int c_vhdblocksize = 512 * 1024;
+	const int64 c_blocks_per_vhdblock = c_vhdblocksize / c_blocksize;
+	const unsigned int c_hashsize = 32;
+	const size_t c_hashdata_read_batch = 4096;
+
+	struct SImage
+	{
+		int fd;
+		int64 blocks;
+		std::vector<bool> bitmap;
+		std::string hashdata_fn;
+		char zeroblock[c_blocksize];
+	};
+
+	class BlockReader
+	{
+	public:
+		BlockReader(SImage& image)
+			: image(image)
+		{
+		}
+
+		~BlockReader()
+		{
+			for (size_t i = 0; i < free_bufs.size(); ++i)
+			{
+				delete[] free_bufs[i];
+			}
+		}
+
+		char* readBlock(int64 block)
+		{
+			if (!image.bitmap[static_cast<size_t>(block)])
+			{
+				return NULL;
+			}
+			char* buf;
+			if (free_bufs.empty())
+			{
+				buf = new char[c_blocksize];
+			}
+			else
+			{
+				buf = free_bufs.back();
+				free_bufs.pop_back();
+			}
+			if (pread(image.fd, buf, c_blocksize, block*c_blocksize) != c_blocksize)
+			{
+				abort();
+			}
+			return buf;
+		}
+
+		void releaseBuffer(char* buf)
+		{
+			free_bufs.push_back(buf);
+		}
+
+	private:
+		SImage& image;
+		std::vector<char*> free_bufs;
+	};
+
+	struct SHashJob
+	{
+		int64 block;
+		std::vector<char*> bufs;
+		bool done;
+		bool has_hashdata;
+		char hashdata[c_hashsize];
+		unsigned char digest[SHA256_DIGEST_SIZE];
+	};
+
+	void hash_job(SHashJob* job, const char* zeroblock)
+	{
+		sha256_ctx shactx;
+		sha256_init(&shactx);
+		for (size_t i = 0; i < job->bufs.size(); ++i)
+		{
+			const char* buf = job->bufs[i] != NULL ? job->bufs[i] : zeroblock;
+			sha256_update(&shactx, reinterpret_cast<const unsigned char*>(buf), c_blocksize);
+		}
+		sha256_final(&shactx, job->digest);
+	}
+
+	class HasherPool
+	{
+	public:
+		HasherPool(size_t nthreads, const char* zeroblock)
+			: zeroblock(zeroblock), do_stop(false)
+		{
+			for (size_t i = 0; i < nthreads; ++i)
+			{
+				threads.push_back(std::thread(&HasherPool::run, this));
+			}
+		}
+
+		~HasherPool()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				do_stop = true;
+				cond.notify_all();
+			}
+			for (size_t i = 0; i < threads.size(); ++i)
+			{
+				threads[i].join();
+			}
+		}
+
+		void add(SHashJob* job)
+		{
+			if (threads.empty())
+			{
+				return;
+			}
+			std::lock_guard<std::mutex> lock(mutex);
+			queue.push_back(job);
+			cond.notify_all();
+		}
+
+		void wait(SHashJob* job)
+		{
+			if (threads.empty())
+			{
+				hash_job(job, zeroblock);
+				job->done = true;
+				return;
+			}
+			std::unique_lock<std::mutex> lock(mutex);
+			while (!job->done)
+			{
+				cond.wait(lock);
+			}
+		}
+
+	private:
+		void run()
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			while (true)
+			{
+				while (queue.empty() && !do_stop)
+				{
+					cond.wait(lock);
+				}
+				if (queue.empty())
+				{
+					return;
+				}
+				SHashJob* job = queue.front();
+				queue.pop_front();
+
+				lock.unlock();
+				hash_job(job, zeroblock);
+				lock.lock();
+
+				job->done = true;
+				cond.notify_all();
+			}
+		}
+
+		const char* zeroblock;
+		bool do_stop;
+		std::mutex mutex;
+		std::condition_variable cond;
+		std::deque<SHashJob*> queue;
+		std::vector<std::thread> threads;
+	};
+
+	bool vhdblock_has_data(SImage& image, int64 i)
+	{
+		for (int64 j = i; j < image.blocks && j < i + c_blocks_per_vhdblock; ++j)
+		{
+			if (image.bitmap[static_cast<size_t>(j)])
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void fill_block(char* buf, int64 block)
+	{
+		uint64_t x = static_cast<uint64_t>(block) * 2654435761ULL + 1;
+		for (size_t i = 0; i < c_blocksize; i += sizeof(x))
+		{
+			x ^= x << 13;
+			x ^= x >> 7;
+			x ^= x << 17;
+			memcpy(buf + i, &x, sizeof(x));
+		}
+	}
+
+	void create_image(const std::string& dir, int64 image_size, size_t used_pct, size_t changed_pct, SImage& image)
+	{
+		std::string image_fn = dir + "/image";
+		image.fd = open(image_fn.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+		if (image.fd == -1
+			|| ftruncate(image.fd, image_size) != 0)
+		{
+			std::cerr << "Error creating " << image_fn << std::endl;
+			abort();
+		}
+		unlink(image_fn.c_str());
+
+		image.blocks = image_size / c_blocksize;
+		image.bitmap.resize(static_cast<size_t>(image.blocks));
+		memset(image.zeroblock, 0, c_blocksize);
+
+		image.hashdata_fn = dir + "/hashdata";
+		std::auto_ptr<IFile> hashdata(Server->openFile(image.hashdata_fn, MODE_WRITE));
+		if (hashdata.get() == NULL)
+		{
+			abort();
+		}
+
+		srand(0);
+		char buf[c_blocksize];
+		for (int64 i = 0; i < image.blocks; i += c_blocks_per_vhdblock)
+		{
+			char digest[c_hashsize] = {};
+			if (static_cast<size_t>(rand() % 100) < used_pct)
+			{
+				SHashJob job;
+				for (int64 j = i; j < image.blocks && j < i + c_blocks_per_vhdblock; ++j)
+				{
+					//Partially used VHD blocks
+					if (rand() % 10 != 0)
+					{
+						image.bitmap[static_cast<size_t>(j)] = true;
+						fill_block(buf, j);
+						if (pwrite(image.fd, buf, c_blocksize, j*c_blocksize) != c_blocksize)
+						{
+							abort();
+						}
+					}
+				}
+
+				BlockReader reader(image);
+				for (int64 j = i; j < image.blocks && j < i + c_blocks_per_vhdblock; ++j)
+				{
+					job.bufs.push_back(reader.readBlock(j));
+				}
+				hash_job(&job, image.zeroblock);
+				for (size_t j = 0; j < job.bufs.size(); ++j)
+				{
+					if (job.bufs[j] != NULL)
+					{
+						reader.releaseBuffer(job.bufs[j]);
+					}
+				}
+
+				memcpy(digest, job.digest, c_hashsize);
+				if (static_cast<size_t>(rand() % 100) < changed_pct)
+				{
+					digest[0] ^= 1;
+				}
+			}
+			if (hashdata->Write(digest, c_hashsize) != c_hashsize)
+			{
+				abort();
+			}
+		}
+	}
+
+	struct SResult
+	{
+		SResult()
+			: changed(0), unchanged(0), checksum(0)
+		{}
+
+		int64 changed;
+		int64 unchanged;
+		uint64_t checksum;
+	};
+
+	void compare_job(SHashJob* job, SResult& result)
+	{
+		if (!job->has_hashdata || memcmp(job->hashdata, job->digest, c_hashsize) != 0)
+		{
+			++result.changed;
+			result.checksum = result.checksum * 31 + static_cast<uint64_t>(job->block);
+		}
+		else
+		{
+			++result.unchanged;
+		}
+	}
+
+	void release_job(BlockReader& reader, SHashJob* job)
+	{
+		for (size_t i = 0; i < job->bufs.size(); ++i)
+		{
+			if (job->bufs[i] != NULL)
+			{
+				reader.releaseBuffer(job->bufs[i]);
+			}
+		}
+	}
+
+	SResult run_inline(SImage& image)
+	{
+		SResult result;
+		std::auto_ptr<IFile> hashdatafile(Server->openFile(image.hashdata_fn, MODE_READ));
+		BlockReader reader(image);
+		SHashJob job;
+		for (int64 i = 0; i < image.blocks; i += c_blocks_per_vhdblock)
+		{
+			if (!vhdblock_has_data(image, i))
+			{
+				continue;
+			}
+
+			int64 currvhdblock = i / c_blocks_per_vhdblock;
+			job.block = i;
+			job.has_hashdata = false;
+			if (hashdatafile->Size() >= (currvhdblock + 1)*c_hashsize)
+			{
+				hashdatafile->Seek(currvhdblock*c_hashsize);
+				job.has_hashdata = hashdatafile->Read(job.hashdata, c_hashsize) == c_hashsize;
+			}
+
+			job.bufs.clear();
+			for (int64 j = i; j < image.blocks && j < i + c_blocks_per_vhdblock; ++j)
+			{
+				job.bufs.push_back(reader.readBlock(j));
+			}
+			hash_job(&job, image.zeroblock);
+			compare_job(&job, result);
+			release_job(reader, &job);
+		}
+		return result;
+	}
+
+	class HashdataReader
+	{
+	public:
+		HashdataReader(IFile* hashdatafile)
+			: hashdatafile(hashdatafile), buf_start(-1), buf_count(0),
+			hashdata_size(hashdatafile->Size())
+		{
+		}
+
+		bool get(int64 hnum, char* out)
+		{
+			if (hashdata_size < (hnum + 1)*c_hashsize)
+			{
+				return false;
+			}
+
+			if (buf_start < 0
+				|| hnum < buf_start
+				|| hnum >= buf_start + buf_count)
+			{
+				int64 toread = (std::min)(static_cast<int64>(c_hashdata_read_batch), hashdata_size / c_hashsize - hnum);
+				buf.resize(static_cast<size_t>(toread)*c_hashsize);
+				_u32 read = hashdatafile->Read(hnum*c_hashsize, buf.data(), static_cast<_u32>(buf.size()));
+				buf_count = read / c_hashsize;
+				if (buf_count == 0)
+				{
+					buf_start = -1;
+					return false;
+				}
+				buf_start = hnum;
+			}
+
+			memcpy(out, &buf[static_cast<size_t>(hnum - buf_start)*c_hashsize], c_hashsize);
+			return true;
+		}
+
+	private:
+		IFile* hashdatafile;
+		std::vector<char> buf;
+		int64 buf_start;
+		int64 buf_count;
+		int64 hashdata_size;
+	};
+
+	SResult run_pipelined(SImage& image, size_t nthreads)
+	{
+		SResult result;
+		std::auto_ptr<IFile> hashdatafile(Server->openFile(image.hashdata_fn, MODE_READ));
+		BlockReader reader(image);
+		HashdataReader hashdata_reader(hashdatafile.get());
+		HasherPool hasher(nthreads, image.zeroblock);
+		size_t max_pending = (std::max)(static_cast<size_t>(2), nthreads * 4);
+		std::deque<SHashJob*> pending;
+
+		int64 i = 0;
+		while (i < image.blocks || !pending.empty())
+		{
+			if (i < image.blocks
+				&& pending.size() < max_pending)
+			{
+				if (vhdblock_has_data(image, i))
+				{
+					SHashJob* job = new SHashJob;
+					job->block = i;
+					job->done = false;
+					job->has_hashdata = hashdata_reader.get(i / c_blocks_per_vhdblock, job->hashdata);
+					for (int64 j = i; j < image.blocks && j < i + c_blocks_per_vhdblock; ++j)
+					{
+						job->bufs.push_back(reader.readBlock(j));
+					}
+					hasher.add(job);
+					pending.push_back(job);
+				}
+				i += c_blocks_per_vhdblock;
+				continue;
+			}
+
+			std::auto_ptr<SHashJob> job(pending.front());
+			pending.pop_front();
+			hasher.wait(job.get());
+			compare_job(job.get(), result);
+			release_job(reader, job.get());
+		}
+		return result;
+	}
+
+	void print_result(const std::string& name, SImage& image, const SResult& result, int64 elapsed_ns)
+	{
+		int64 vhdblocks = result.changed + result.unchanged;
+		std::cout << name << ": vhd blocks=" << vhdblocks << " changed=" << result.changed
+			<< " MB/s=" << (vhdblocks*(c_vhdblocksize / 1024.0 / 1024.0)) / (elapsed_ns / 1000000000.0)
+			<< " checksum=" << result.checksum << std::endl;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	bench_init();
+
+	int64 image_size = static_cast<int64>(bench_arg(argc, argv, 1, 1024)) * 1024 * 1024;
+	size_t used_pct = bench_arg(argc, argv, 2, 50);
+	size_t changed_pct = bench_arg(argc, argv, 3, 1);
+	size_t nthreads = bench_arg(argc, argv, 4, 4);
+
+	char dir_template[] = "/tmp/bench_image_XXXXXX";
+	if (mkdtemp(dir_template) == NULL)
+	{
+		abort();
+	}
+
+	SImage image;
+	create_image(dir_template, image_size, used_pct, changed_pct, image);
+
+	std::cout << "image_mb=" << image_size / 1024 / 1024 << " used_pct=" << used_pct
+		<< " changed_pct=" << changed_pct << " threads=" << nthreads
+		<< " cpus=" << std::thread::hardware_concurrency() << std::endl;
+
+	for (size_t i = 0; i < 3; ++i)
+	{
+		int64 start = bench_time_ns();
+		SResult res_inline = run_inline(image);
+		print_result("inline", image, res_inline, bench_time_ns() - start);
+
+		start = bench_time_ns();
+		SResult res_batched = run_pipelined(image, 0);
+		print_result("pipelined threads=0", image, res_batched, bench_time_ns() - start);
+
+		start = bench_time_ns();
+		SResult res_pipelined = run_pipelined(image, nthreads);
+		print_result("pipelined threads=" + convert(nthreads), image, res_pipelined, bench_time_ns() - start);
+
+		if (res_inline.checksum != res_pipelined.checksum
+			|| res_batched.checksum != res_pipelined.checksum)
+		{
+			std::cerr << "Changed blocks differ" << std::endl;
+			abort();
+		}
+	}
+
+	close(image.fd);
+	unlink(image.hashdata_fn.c_str());
+	rmdir(dir_template);
+
+	return 0;
+}
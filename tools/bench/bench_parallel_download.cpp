@@ -0,0 +1,185 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+
+/**
+* Loopback benchmark for parallel download streams. A server thread per
+* connection answers file requests sequentially (fixed service time per file)
+* and delays each answer by the injected round trip time. The client keeps a
+* fixed number of requests queued per connection (like FileClient) and
+* distributes the file ids over N connections. Completed downloads are
+* accounted with the MaxFileId used by file backups, and an in-order consumer
+* (like the metadata thread) measures how long a finished file waits until
+* all earlier files are finished as well.
+* Usage: bench_parallel_download [files=20000] [rtt_ms=50] [queue=100]
+*   [service_us=100] [file_kb=4]
+*/
+
+#include "BenchServer.h"
+#include "BenchUtil.h"
+#include "BenchLoopback.h"
+#include "urbackupserver/FileBackup.h"
+#include <thread>
+#include <mutex>
+#include <vector>
+#include <iostream>
+
+namespace
+{
+	struct SConfig
+	{
+		size_t n_files;
+		size_t queue;
+		SLoopbackConfig loopback;
+	};
+
+	class Dispatcher
+	{
+	public:
+		Dispatcher(size_t n_files, MaxFileId& max_file_id)
+			: n_files(n_files), next_id(0), max_file_id(max_file_id)
+		{
+		}
+
+		bool next(size_t stream, uint64_t& id)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (next_id >= n_files)
+			{
+				return false;
+			}
+			id = next_id++;
+			max_file_id.setMinDownloaded(static_cast<size_t>(id), stream);
+			//The file list is processed in order, after the download is queued
+			max_file_id.setMaxPreProcessed(static_cast<size_t>(id));
+			return true;
+		}
+
+	private:
+		std::mutex mutex;
+		size_t n_files;
+		size_t next_id;
+		MaxFileId& max_file_id;
+	};
+
+	void client_stream(int s, size_t stream, const SConfig& config, Dispatcher* dispatcher,
+		MaxFileId* max_file_id, std::vector<int64>* done_times)
+	{
+		std::vector<char> buf(sizeof(uint64_t) + config.loopback.file_size);
+		size_t outstanding = 0;
+		bool has_more = true;
+		while (true)
+		{
+			while (has_more && outstanding < config.queue)
+			{
+				uint64_t id;
+				if (!dispatcher->next(stream, id))
+				{
+					has_more = false;
+					break;
+				}
+				if (!bench_write_full(s, reinterpret_cast<char*>(&id), sizeof(id)))
+				{
+					abort();
+				}
+				++outstanding;
+			}
+
+			if (outstanding == 0)
+			{
+				break;
+			}
+
+			if (!bench_read_full(s, &buf[0], buf.size()))
+			{
+				abort();
+			}
+			uint64_t id;
+			memcpy(&id, &buf[0], sizeof(id));
+			(*done_times)[id] = bench_time_ns();
+			max_file_id->setMaxDownloaded(static_cast<size_t>(id));
+			--outstanding;
+		}
+	}
+
+	void run(size_t n_streams, const SConfig& config)
+	{
+		LoopbackFileServer server(n_streams, config.loopback);
+
+		MaxFileId max_file_id;
+		Dispatcher dispatcher(config.n_files, max_file_id);
+		std::vector<int64> done_times(config.n_files);
+		std::vector<int64> wait_times;
+		wait_times.reserve(config.n_files);
+
+		int64 start_time = bench_time_ns();
+		std::vector<std::thread> threads;
+		for (size_t i = 0; i < n_streams; ++i)
+		{
+			threads.push_back(std::thread(client_stream, server.clientSocket(i), i, config,
+				&dispatcher, &max_file_id, &done_times));
+		}
+
+		//In order consumer
+		for (size_t id = 0; id < config.n_files; ++id)
+		{
+			while (!max_file_id.isFinished(id))
+			{
+				std::this_thread::sleep_for(std::chrono::microseconds(100));
+			}
+			wait_times.push_back(bench_time_ns() - done_times[id]);
+		}
+		double secs = (bench_time_ns() - start_time) / 1000000000.0;
+
+		for (size_t i = 0; i < threads.size(); ++i)
+		{
+			threads[i].join();
+		}
+
+		double files_ps = config.n_files / secs;
+		std::cout << "streams=" << n_streams
+			<< " files/s=" << static_cast<int64>(files_ps)
+			<< " MB/s=" << files_ps*config.loopback.file_size / (1024 * 1024)
+			<< std::endl;
+		bench_print_percentiles("  in order wait after download", wait_times);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	bench_init();
+
+	SConfig config;
+	config.n_files = bench_arg(argc, argv, 1, 20000);
+	config.loopback.rtt_us = static_cast<int64>(bench_arg(argc, argv, 2, 50)) * 1000;
+	config.queue = bench_arg(argc, argv, 3, 100);
+	config.loopback.service_us = static_cast<int64>(bench_arg(argc, argv, 4, 100));
+	config.loopback.file_size = bench_arg(argc, argv, 5, 4) * 1024;
+
+	std::cout << "files=" << config.n_files << " rtt_ms=" << config.loopback.rtt_us / 1000
+		<< " queue=" << config.queue << " service_us=" << config.loopback.service_us
+		<< " file_kb=" << config.loopback.file_size / 1024 << std::endl;
+
+	size_t streams[] = { 1, 2, 4, 8 };
+	for (size_t i = 0; i < sizeof(streams) / sizeof(streams[0]); ++i)
+	{
+		run(streams[i], config);
+	}
+
+	return 0;
+}
@@ -0,0 +1,160 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+
+/**
+* Simulation of many throttled backup streams sharing one global link limit.
+* Each client gets a throttler below the global throttler (every second client
+* with weight 2) and one stream thread which sends fixed size blocks through it.
+* Reports link utilisation (achieved rate / limit) and Jain's fairness index of
+* the per client rates normalised by weight. Usage:
+* bench_pipe_throttler [clients=50] [duration_ms=5000] [limit_kbps=20480] [block_kb=32]
+* Build with -DBENCH_FLAT_THROTTLER (e.g. against a tree without
+* IPipeThrottler::setParent) to let all streams share the global throttler
+* directly.
+*/
+
+#include "BenchServer.h"
+#include "BenchUtil.h"
+#include "PipeThrottler.h"
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <iostream>
+
+namespace
+{
+	std::atomic<bool> do_stop(false);
+
+	void stream(IPipeThrottler* throttler, size_t block_size, std::atomic<int64>* sent_bytes)
+	{
+		while (!do_stop)
+		{
+			throttler->addBytes(block_size, true);
+			*sent_bytes += block_size;
+		}
+	}
+
+	double jain_index(const std::vector<double>& vals)
+	{
+		double sum = 0;
+		double sum_sq = 0;
+		for (size_t i = 0; i < vals.size(); ++i)
+		{
+			sum += vals[i];
+			sum_sq += vals[i] * vals[i];
+		}
+		if (sum_sq == 0)
+		{
+			return 0;
+		}
+		return sum*sum / (vals.size()*sum_sq);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	bench_init();
+#ifndef BENCH_FLAT_THROTTLER
+	PipeThrottler::init_mutex();
+#endif
+
+	size_t n_clients = bench_arg(argc, argv, 1, 50);
+	size_t duration_ms = bench_arg(argc, argv, 2, 5000);
+	size_t limit_bps = bench_arg(argc, argv, 3, 20480) * 1024;
+	size_t block_size = bench_arg(argc, argv, 4, 32) * 1024;
+
+	PipeThrottler global_throttler(limit_bps, false, NULL);
+
+	std::vector<size_t> weights(n_clients);
+	std::vector<PipeThrottler*> client_throttlers(n_clients);
+	for (size_t i = 0; i < n_clients; ++i)
+	{
+		weights[i] = (i % 2 == 0) ? 1 : 2;
+#ifdef BENCH_FLAT_THROTTLER
+		client_throttlers[i] = &global_throttler;
+#else
+		client_throttlers[i] = new PipeThrottler(0, false, NULL);
+		client_throttlers[i]->setParent(&global_throttler, weights[i]);
+#endif
+	}
+
+	std::vector<std::atomic<int64> > sent_counter(n_clients);
+	std::vector<std::thread> threads;
+	for (size_t i = 0; i < n_clients; ++i)
+	{
+		sent_counter[i] = 0;
+		threads.push_back(std::thread(stream, client_throttlers[i], block_size, &sent_counter[i]));
+	}
+
+	//Skip the initial burst
+	std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+	std::vector<int64> sent(n_clients);
+	for (size_t i = 0; i < n_clients; ++i)
+	{
+		sent[i] = sent_counter[i];
+	}
+	int64 start_time = bench_time_ns();
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(duration_ms));
+
+	double secs = (bench_time_ns() - start_time) / 1000000000.0;
+	for (size_t i = 0; i < n_clients; ++i)
+	{
+		sent[i] = sent_counter[i] - sent[i];
+	}
+
+	do_stop = true;
+	for (size_t i = 0; i < threads.size(); ++i)
+	{
+		threads[i].join();
+	}
+
+	int64 total = 0;
+	std::vector<double> rates(n_clients);
+	std::vector<double> weighted_rates(n_clients);
+	double min_weighted = -1;
+	double max_weighted = 0;
+	for (size_t i = 0; i < n_clients; ++i)
+	{
+		total += sent[i];
+		rates[i] = sent[i] / secs;
+		weighted_rates[i] = rates[i] / weights[i];
+		if (min_weighted < 0 || weighted_rates[i] < min_weighted)
+		{
+			min_weighted = weighted_rates[i];
+		}
+		max_weighted = (std::max)(max_weighted, weighted_rates[i]);
+	}
+
+	std::cout << "clients=" << n_clients << " duration_ms=" << duration_ms
+		<< " limit_kbps=" << limit_bps / 1024 << " block_kb=" << block_size / 1024 << std::endl;
+	std::cout << "link utilisation: " << (total / secs) / limit_bps * 100 << "%" << std::endl;
+	std::cout << "jain index (rate/weight): " << jain_index(weighted_rates) << std::endl;
+	std::cout << "jain index (rate): " << jain_index(rates) << std::endl;
+	std::cout << "min/max rate/weight: " << (max_weighted > 0 ? min_weighted / max_weighted : 0) << std::endl;
+
+#ifndef BENCH_FLAT_THROTTLER
+	for (size_t i = 0; i < n_clients; ++i)
+	{
+		delete client_throttlers[i];
+	}
+#endif
+
+	return 0;
+}
@@ -0,0 +1,188 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+
+/**
+* Discrete time simulation (1ms steps, simulated server clock) of a client
+* keeping requests in flight to a server behind a link with fixed one-way
+* delay and limited request rate, with an unbounded queue before the
+* bottleneck (netem-style delay, bufferbloat). Compares fixed queue depths
+* with the adaptive QueueDepthEstimator. Reports the achieved rate as share of
+* the link capacity, the round trip times seen by the requests and the average
+* number of requests in flight.
+* Usage: bench_queue_depth [simulated seconds=60]
+*/
+
+#include "BenchServer.h"
+#include "BenchUtil.h"
+#include "urbackupcommon/fileclient/QueueDepthEstimator.h"
+#include <deque>
+#include <vector>
+#include <iostream>
+#include <iomanip>
+
+namespace
+{
+	struct SScenario
+	{
+		const char* name;
+		int64 one_way_delay_ms;
+		double requests_per_ms;
+	};
+
+	struct SResult
+	{
+		double utilisation;
+		int64 rtt_p50;
+		int64 rtt_p99;
+		double avg_in_flight;
+	};
+
+	struct SRequest
+	{
+		int64 sent_time;
+		int64 arrive_time;
+	};
+
+	SResult simulate(const SScenario& scenario, size_t fixed_depth, size_t fixed_low, int64 sim_ms)
+	{
+		BenchServer* server = bench_server();
+		server->setSimulatedClock(true);
+
+		QueueDepthEstimator estimator(4, 100, 10000);
+
+		const int64 warmup_ms = 10000;
+		const int64 request_bytes = 4096;
+
+		std::deque<SRequest> to_server;
+		std::deque<SRequest> bottleneck;
+		std::deque<SRequest> to_client;
+		double service_credit = 0;
+		size_t in_flight = 0;
+
+		int64 done = 0;
+		std::vector<int64> rtts;
+		double in_flight_sum = 0;
+
+		for (int64 t = 0; t < sim_ms; ++t)
+		{
+			size_t depth = fixed_depth;
+			size_t low = fixed_low;
+			if (fixed_depth == 0)
+			{
+				depth = estimator.getDepth();
+				low = estimator.getLowDepth();
+			}
+
+			if (in_flight <= low)
+			{
+				while (in_flight < depth)
+				{
+					estimator.requestSent();
+					SRequest req;
+					req.sent_time = t;
+					req.arrive_time = t + scenario.one_way_delay_ms;
+					to_server.push_back(req);
+					++in_flight;
+				}
+			}
+
+			while (!to_server.empty()
+				&& to_server.front().arrive_time <= t)
+			{
+				bottleneck.push_back(to_server.front());
+				to_server.pop_front();
+			}
+
+			service_credit += scenario.requests_per_ms;
+			while (service_credit >= 1 && !bottleneck.empty())
+			{
+				SRequest req = bottleneck.front();
+				bottleneck.pop_front();
+				req.arrive_time = t + scenario.one_way_delay_ms;
+				to_client.push_back(req);
+				service_credit -= 1;
+			}
+			if (bottleneck.empty())
+			{
+				service_credit = (std::min)(service_credit, 1.0);
+			}
+
+			while (!to_client.empty()
+				&& to_client.front().arrive_time <= t)
+			{
+				estimator.requestDone(t);
+				estimator.addDeliveredBytes(request_bytes);
+				if (t >= warmup_ms)
+				{
+					++done;
+					rtts.push_back(t - to_client.front().sent_time);
+				}
+				to_client.pop_front();
+				--in_flight;
+			}
+
+			if (t >= warmup_ms)
+			{
+				in_flight_sum += in_flight;
+			}
+
+			server->advanceClock(1);
+		}
+
+		int64 measured_ms = sim_ms - warmup_ms;
+		SResult ret;
+		ret.utilisation = done / (scenario.requests_per_ms*measured_ms);
+		ret.rtt_p50 = bench_percentile(rtts, 0.5);
+		ret.rtt_p99 = bench_percentile(rtts, 0.99);
+		ret.avg_in_flight = in_flight_sum / measured_ms;
+		return ret;
+	}
+
+	void print_result(const std::string& name, const SResult& res)
+	{
+		std::cout << "  " << std::left << std::setw(22) << name << std::right
+			<< " util=" << std::setw(6) << std::fixed << std::setprecision(1) << res.utilisation * 100 << "%"
+			<< " rtt p50=" << std::setw(5) << res.rtt_p50 << "ms"
+			<< " p99=" << std::setw(5) << res.rtt_p99 << "ms"
+			<< " in flight=" << std::setprecision(0) << res.avg_in_flight << std::endl;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	bench_init();
+
+	int64 sim_ms = static_cast<int64>(bench_arg(argc, argv, 1, 60)) * 1000;
+
+	SScenario scenarios[] = {
+		{ "LAN, tiny files (1ms rtt, 20k req/s)", 0, 20 },
+		{ "WAN (50ms rtt, 2k req/s)", 25, 2 },
+		{ "Satellite (600ms rtt, 100 req/s)", 300, 0.1 },
+	};
+
+	for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); ++i)
+	{
+		std::cout << scenarios[i].name << std::endl;
+		print_result("fixed files (3000)", simulate(scenarios[i], 3000, 3000, sim_ms));
+		print_result("fixed chunks (1000/100)", simulate(scenarios[i], 1000, 100, sim_ms));
+		print_result("adaptive", simulate(scenarios[i], 0, 0, sim_ms));
+	}
+
+	return 0;
+}
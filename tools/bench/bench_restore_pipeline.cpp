@@ -0,0 +1,273 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+
+/**
+* Restore of many small files from the loopback file server (see
+* BenchLoopback.h) over N streams. Every received file is written to a
+* temporary directory with the repository's file implementation. The file
+* metadata (owner, times, mode, as applied by the client's
+* FileMetadataDownloadThread on Linux) is either applied after all downloads
+* have finished, as before, or by a separate thread while the files are
+* still downloading. Reports the total restore time and how long metadata
+* application took after the last file arrived.
+* Usage: bench_restore_pipeline [files=5000] [rtt_ms=2] [queue=1]
+*   [service_us=50] [file_kb=4]
+*/
+
+#include "BenchServer.h"
+#include "BenchUtil.h"
+#include "BenchLoopback.h"
+#include "../../Interface/File.h"
+#include "../../stringtools.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <iostream>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdlib.h>
+
+namespace
+{
+	struct SConfig
+	{
+		size_t n_files;
+		size_t queue;
+		SLoopbackConfig loopback;
+	};
+
+	class ApplyQueue
+	{
+	public:
+		ApplyQueue()
+			: done(false)
+		{
+		}
+
+		void push(size_t id)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			queue.push_back(id);
+			cond.notify_one();
+		}
+
+		void finish()
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			done = true;
+			cond.notify_one();
+		}
+
+		bool pop(size_t& id)
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			while (queue.empty() && !done)
+			{
+				cond.wait(lock);
+			}
+			if (queue.empty())
+			{
+				return false;
+			}
+			id = queue.front();
+			queue.pop_front();
+			return true;
+		}
+
+	private:
+		std::mutex mutex;
+		std::condition_variable cond;
+		std::deque<size_t> queue;
+		bool done;
+	};
+
+	std::string file_name(const std::string& dir, size_t id)
+	{
+		return dir + "/" + convert(id);
+	}
+
+	void apply_metadata(const std::string& fn)
+	{
+		if (lchown(fn.c_str(), getuid(), getgid()) != 0)
+		{
+			abort();
+		}
+		struct timespec tss[2];
+		tss[0].tv_sec = 1500000000;
+		tss[0].tv_nsec = 0;
+		tss[1] = tss[0];
+		if (utimensat(0, fn.c_str(), tss, AT_SYMLINK_NOFOLLOW) != 0)
+		{
+			abort();
+		}
+		if (chmod(fn.c_str(), 0640) != 0)
+		{
+			abort();
+		}
+	}
+
+	void apply_thread(const std::string& dir, ApplyQueue* apply_queue)
+	{
+		size_t id;
+		while (apply_queue->pop(id))
+		{
+			apply_metadata(file_name(dir, id));
+		}
+	}
+
+	void client_stream(int s, const SConfig& config, const std::string& dir,
+		std::atomic<size_t>* next_id, ApplyQueue* apply_queue)
+	{
+		std::vector<char> buf(sizeof(uint64_t) + config.loopback.file_size);
+		size_t outstanding = 0;
+		bool has_more = true;
+		while (true)
+		{
+			while (has_more && outstanding < config.queue)
+			{
+				uint64_t id = (*next_id)++;
+				if (id >= config.n_files)
+				{
+					has_more = false;
+					break;
+				}
+				if (!bench_write_full(s, reinterpret_cast<char*>(&id), sizeof(id)))
+				{
+					abort();
+				}
+				++outstanding;
+			}
+
+			if (outstanding == 0)
+			{
+				break;
+			}
+
+			if (!bench_read_full(s, &buf[0], buf.size()))
+			{
+				abort();
+			}
+			uint64_t id;
+			memcpy(&id, &buf[0], sizeof(id));
+			--outstanding;
+
+			std::auto_ptr<IFile> f(Server->openFile(file_name(dir, id), MODE_WRITE));
+			if (f.get() == NULL
+				|| f->Write(&buf[sizeof(uint64_t)], static_cast<_u32>(config.loopback.file_size)) != config.loopback.file_size)
+			{
+				std::cerr << "Error writing file" << std::endl;
+				abort();
+			}
+			f.reset();
+
+			if (apply_queue != NULL)
+			{
+				apply_queue->push(id);
+			}
+		}
+	}
+
+	void run(size_t n_streams, bool pipelined, const SConfig& config)
+	{
+		char dir_template[] = "/tmp/bench_restore_XXXXXX";
+		if (mkdtemp(dir_template) == NULL)
+		{
+			abort();
+		}
+		std::string dir = dir_template;
+
+		LoopbackFileServer server(n_streams, config.loopback);
+
+		std::atomic<size_t> next_id(0);
+		ApplyQueue apply_queue;
+		int64 start_time = bench_time_ns();
+
+		std::thread applier;
+		if (pipelined)
+		{
+			applier = std::thread(apply_thread, dir, &apply_queue);
+		}
+
+		std::vector<std::thread> threads;
+		for (size_t i = 0; i < n_streams; ++i)
+		{
+			threads.push_back(std::thread(client_stream, server.clientSocket(i), config, dir,
+				&next_id, pipelined ? &apply_queue : NULL));
+		}
+		for (size_t i = 0; i < threads.size(); ++i)
+		{
+			threads[i].join();
+		}
+		int64 download_done_time = bench_time_ns();
+
+		if (pipelined)
+		{
+			apply_queue.finish();
+			applier.join();
+		}
+		else
+		{
+			for (size_t id = 0; id < config.n_files; ++id)
+			{
+				apply_metadata(file_name(dir, id));
+			}
+		}
+		int64 end_time = bench_time_ns();
+
+		std::cout << "streams=" << n_streams << " metadata=" << (pipelined ? "pipelined" : "at end ")
+			<< " total=" << (end_time - start_time) / 1000000 << "ms"
+			<< " files/s=" << static_cast<int64>(config.n_files / ((end_time - start_time) / 1000000000.0))
+			<< " metadata after last download=" << (end_time - download_done_time) / 1000000 << "ms"
+			<< std::endl;
+
+		for (size_t id = 0; id < config.n_files; ++id)
+		{
+			unlink(file_name(dir, id).c_str());
+		}
+		rmdir(dir.c_str());
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	bench_init();
+
+	SConfig config;
+	config.n_files = bench_arg(argc, argv, 1, 5000);
+	config.loopback.rtt_us = static_cast<int64>(bench_arg(argc, argv, 2, 2)) * 1000;
+	config.queue = bench_arg(argc, argv, 3, 1);
+	config.loopback.service_us = static_cast<int64>(bench_arg(argc, argv, 4, 50));
+	config.loopback.file_size = bench_arg(argc, argv, 5, 4) * 1024;
+
+	std::cout << "files=" << config.n_files << " rtt_ms=" << config.loopback.rtt_us / 1000
+		<< " queue=" << config.queue << " service_us=" << config.loopback.service_us
+		<< " file_kb=" << config.loopback.file_size / 1024 << std::endl;
+
+	size_t streams[] = { 1, 4 };
+	for (size_t i = 0; i < sizeof(streams) / sizeof(streams[0]); ++i)
+	{
+		run(streams[i], false, config);
+		run(streams[i], true, config);
+	}
+
+	return 0;
+}
@@ -0,0 +1,225 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+
+/**
+* Scheduler style settings access: N threads go over all clients in a
+* loop, like the client main loops and the throttle updater. Each access
+* gets the client's ServerSettings, checks the four backup windows and
+* reads the update frequencies and the time dependent speed limits.
+* Settings come from memory settings readers with time span schedules.
+* A group of clients has its own settings. Unless change_ms=0, another
+* thread invalidates all cached settings every change_ms milliseconds,
+* like saving settings in the web interface does.
+* Reports accesses/s and access latency percentiles.
+* Usage: bench_server_settings [clients=2000] [threads=4] [duration_ms=5000] [change_ms=1000]
+*/
+
+#include "BenchServer.h"
+#include "BenchUtil.h"
+#include "urbackupserver/server_settings.h"
+#include "urbackupserver/server.h"
+#include "urbackupcommon/os_functions.h"
+#include "MemorySettingsReader.h"
+#include "../../stringtools.h"
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <iostream>
+#include <time.h>
+#include <stdlib.h>
+
+//The parts of BackupServer and os_functions server_settings.cpp uses
+bool BackupServer::isImageSnapshotsEnabled()
+{
+	return false;
+}
+
+bool BackupServer::canReflink()
+{
+	return false;
+}
+
+int64 os_atoi64(const std::string &str)
+{
+	return strtoll(str.c_str(), NULL, 10);
+}
+
+std::string os_strftime(std::string fs)
+{
+	time_t rawtime;
+	char buffer[100];
+	time(&rawtime);
+	struct tm *timeinfo = localtime(&rawtime);
+	strftime(buffer, 100, fs.c_str(), timeinfo);
+	return buffer;
+}
+
+namespace
+{
+	std::atomic<bool> do_stop(false);
+	std::atomic<bool> do_start(false);
+
+	const char* global_settings =
+		"backup_window_incr_file=mon-fri/8:00-12:00,13:00-18:00;sat,sun/0-24\n"
+		"backup_window_full_file=sat,sun/0-24\n"
+		"backup_window_incr_image=1-5/19-24,0-7;6,7/0-24\n"
+		"backup_window_full_image=6-7/0-24\n"
+		"update_freq_incr=18000;3600@1-5/8-18\n"
+		"update_freq_full=2592000\n"
+		"update_freq_image_incr=604800;86400@6,7/0-24\n"
+		"update_freq_image_full=5184000\n"
+		"internet_speed=100000;5000@1-5/8-12,13-18;20000@1-5/12-13\n"
+		"global_internet_speed=1000000;50000@1-5/8-18\n"
+		"local_speed=-1;50000@1-5/8-18\n"
+		"global_local_speed=-1\n";
+
+	const char* client_settings =
+		"group_id=0\n"
+		"overwrite=true\n"
+		"backup_window_incr_file=1-7/0-6,22-24\n"
+		"internet_speed=20000@1-5/0-24;50000@6,7/0-24\n";
+
+	ISettingsReader* settings_reader(const std::string& sql)
+	{
+		std::string clientid = getafter("clientid=", sql);
+		if (clientid == "0")
+		{
+			return new CMemorySettingsReader(global_settings);
+		}
+		//Every tenth client has its own settings
+		if (watoi(clientid) % 10 == 0)
+		{
+			return new CMemorySettingsReader(client_settings);
+		}
+		return new CMemorySettingsReader("group_id=0\n");
+	}
+
+	struct SResult
+	{
+		SResult()
+			: n_accesses(0), n_in_window(0)
+		{}
+
+		size_t n_accesses;
+		size_t n_in_window;
+		std::vector<int64> latencies_ns;
+	};
+
+	void scheduler(int first_client, int n_clients, SResult* result)
+	{
+		while (!do_start)
+		{
+			std::this_thread::yield();
+		}
+
+		int clientid = first_client;
+		while (!do_stop)
+		{
+			int64 start = bench_time_ns();
+
+			ServerSettings settings(NULL, clientid);
+			settings.getSettings();
+			bool in_window = ServerSettings::isInTimeSpan(settings.getBackupWindowIncrFile())
+				|| ServerSettings::isInTimeSpan(settings.getBackupWindowFullFile())
+				|| ServerSettings::isInTimeSpan(settings.getBackupWindowIncrImage())
+				|| ServerSettings::isInTimeSpan(settings.getBackupWindowFullImage());
+			int freq = settings.getUpdateFreqFileIncr() + settings.getUpdateFreqFileFull()
+				+ settings.getUpdateFreqImageIncr() + settings.getUpdateFreqImageFull();
+			int speed = settings.getInternetSpeed() + settings.getGlobalInternetSpeed()
+				+ settings.getLocalSpeed() + settings.getGlobalLocalSpeed();
+
+			//Sampled, so that the latency vector stays small
+			if (result->n_accesses % 16 == 0)
+			{
+				result->latencies_ns.push_back(bench_time_ns() - start);
+			}
+
+			++result->n_accesses;
+			if (in_window && freq > 0 && speed != 0)
+			{
+				++result->n_in_window;
+			}
+
+			++clientid;
+			if (clientid >= first_client + n_clients)
+			{
+				clientid = first_client;
+			}
+		}
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	bench_init();
+	bench_server()->setSettingsReaderFunc(settings_reader);
+	ServerSettings::init_mutex();
+
+	int n_clients = static_cast<int>(bench_arg(argc, argv, 1, 2000));
+	size_t n_threads = bench_arg(argc, argv, 2, 4);
+	int64 duration_ms = static_cast<int64>(bench_arg(argc, argv, 3, 5000));
+	int64 change_ms = static_cast<int64>(bench_arg(argc, argv, 4, 1000));
+
+	std::vector<SResult> results(n_threads);
+	std::vector<std::thread> threads;
+	int per_thread = n_clients / static_cast<int>(n_threads);
+	for (size_t i = 0; i < n_threads; ++i)
+	{
+		threads.push_back(std::thread(scheduler, 1 + static_cast<int>(i)*per_thread, per_thread, &results[i]));
+	}
+
+	int64 start = bench_time_ns();
+	do_start = true;
+	size_t n_changes = 0;
+	int64 end = start + duration_ms * 1000000;
+	while (bench_time_ns() < end)
+	{
+		int64 wait_ms = change_ms > 0 ? change_ms : duration_ms;
+		std::this_thread::sleep_for(std::chrono::milliseconds((std::min)(wait_ms, (end - bench_time_ns()) / 1000000 + 1)));
+		if (change_ms > 0 && bench_time_ns() < end)
+		{
+			ServerSettings::updateAll();
+			++n_changes;
+		}
+	}
+	do_stop = true;
+	for (size_t i = 0; i < threads.size(); ++i)
+	{
+		threads[i].join();
+	}
+	int64 elapsed = bench_time_ns() - start;
+
+	SResult total;
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		total.n_accesses += results[i].n_accesses;
+		total.n_in_window += results[i].n_in_window;
+		total.latencies_ns.insert(total.latencies_ns.end(), results[i].latencies_ns.begin(), results[i].latencies_ns.end());
+	}
+
+	std::cout << "clients=" << n_clients << " threads=" << n_threads << " settings changes=" << n_changes
+		<< " accesses/s=" << static_cast<int64>(total.n_accesses / (elapsed / 1000000000.0))
+		<< " in window=" << (total.n_accesses > 0 ? total.n_in_window * 100 / total.n_accesses : 0) << "%"
+		<< std::endl;
+	bench_print_percentiles("access latency", total.latencies_ns);
+
+	ServerSettings::clear_cache();
+
+	return 0;
+}
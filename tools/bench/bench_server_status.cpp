@@ -0,0 +1,172 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+/**
+* Load test for ServerStatus: N backup sessions update their progress
+* (done bytes, speed) in a loop while web UI readers poll the
+* status of all clients. Reports writer/reader throughput and writer latency
+* percentiles. Usage:
+* bench_server_status [sessions=200] [readers=4] [duration_ms=5000]
+*   [reader poll interval ms=0] [writer work between updates us=0]
+* Builds against both the current server_status.cpp and a
+* baseline copy (see Makefile, STATUS_SRC), so it only uses API that
+* exists in both.
+*/
+
+#include "BenchServer.h"
+#include "BenchUtil.h"
+#include "urbackupserver/server_status.h"
+#include "../../stringtools.h"
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+
+namespace
+{
+	std::atomic<bool> do_stop(false);
+	std::atomic<bool> do_start(false);
+	std::atomic<size_t> n_started(0);
+
+	void writer(size_t idx, int64 work_ns, std::vector<int64>* latencies_ns, size_t* n_updates)
+	{
+		std::string clientname = "client" + convert(idx);
+		logid_t logid(0, 0);
+		size_t pid = ServerStatus::startProcess(clientname, sa_incr_file, "", logid, false);
+		++n_started;
+		while (!do_start)
+		{
+			std::this_thread::yield();
+		}
+
+		int64 done_bytes = 0;
+		size_t n = 0;
+		while (!do_stop)
+		{
+			int64 start = bench_time_ns();
+			done_bytes += 4096;
+			ServerStatus::setProcessDoneBytes(clientname, pid, done_bytes, done_bytes * 2);
+			ServerStatus::setProcessSpeed(clientname, pid, 100.0);
+			if ((n & 15) == 0)
+			{
+				latencies_ns->push_back(bench_time_ns() - start);
+			}
+			++n;
+
+			int64 work_end = bench_time_ns() + work_ns;
+			while (bench_time_ns() < work_end)
+			{
+			}
+		}
+		*n_updates = n;
+		ServerStatus::stopProcess(clientname, pid);
+	}
+
+	void reader(int poll_ms, size_t n_sessions, size_t* n_reads, std::vector<int64>* latencies_ns)
+	{
+		while (!do_start)
+		{
+			std::this_thread::yield();
+		}
+		size_t n = 0;
+		while (!do_stop)
+		{
+			int64 start = bench_time_ns();
+			std::vector<SStatus> st = ServerStatus::getStatus();
+			latencies_ns->push_back(bench_time_ns() - start);
+			if (st.size() != n_sessions)
+			{
+				std::cerr << "Unexpected number of clients: " << st.size() << std::endl;
+				abort();
+			}
+			++n;
+			if (poll_ms > 0)
+			{
+				Server->wait(poll_ms);
+			}
+		}
+		*n_reads = n;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	bench_init();
+	ServerStatus::init_mutex();
+
+	size_t n_sessions = bench_arg(argc, argv, 1, 200);
+	size_t n_readers = bench_arg(argc, argv, 2, 4);
+	size_t duration_ms = bench_arg(argc, argv, 3, 5000);
+	int poll_ms = static_cast<int>(bench_arg(argc, argv, 4, 0));
+	int64 work_ns = static_cast<int64>(bench_arg(argc, argv, 5, 0))*1000;
+
+	std::vector<std::vector<int64> > w_lat(n_sessions);
+	std::vector<size_t> w_n(n_sessions);
+	std::vector<std::vector<int64> > r_lat(n_readers);
+	std::vector<size_t> r_n(n_readers);
+
+	std::vector<std::thread> threads;
+	for (size_t i = 0; i < n_sessions; ++i)
+	{
+		threads.push_back(std::thread(writer, i, work_ns, &w_lat[i], &w_n[i]));
+	}
+	for (size_t i = 0; i < n_readers; ++i)
+	{
+		threads.push_back(std::thread(reader, poll_ms, n_sessions, &r_n[i], &r_lat[i]));
+	}
+
+	while (n_started < n_sessions)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	do_start = true;
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(duration_ms));
+	do_stop = true;
+	for (size_t i = 0; i < threads.size(); ++i)
+	{
+		threads[i].join();
+	}
+
+	std::vector<int64> all_w;
+	size_t total_w = 0;
+	for (size_t i = 0; i < n_sessions; ++i)
+	{
+		all_w.insert(all_w.end(), w_lat[i].begin(), w_lat[i].end());
+		total_w += w_n[i];
+	}
+	std::vector<int64> all_r;
+	size_t total_r = 0;
+	for (size_t i = 0; i < n_readers; ++i)
+	{
+		all_r.insert(all_r.end(), r_lat[i].begin(), r_lat[i].end());
+		total_r += r_n[i];
+	}
+
+	double secs = duration_ms / 1000.0;
+	std::cout << "sessions=" << n_sessions << " readers=" << n_readers
+		<< " duration_ms=" << duration_ms << " poll_ms=" << poll_ms
+		<< " work_us=" << work_ns/1000 << std::endl;
+	std::cout << "writer updates/s: " << static_cast<int64>(total_w / secs) << std::endl;
+	bench_print_percentiles("writer update latency", all_w);
+	std::cout << "reader getStatus/s: " << static_cast<int64>(total_r / secs) << std::endl;
+	bench_print_percentiles("reader getStatus latency", all_r);
+
+	return 0;
+}
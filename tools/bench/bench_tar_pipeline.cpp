@@ -0,0 +1,303 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+
+/**
+* Synthetic tar stream of small members, as produced by a script backup.
+* A "script" thread writes the tar stream into a pipe. The parser reads
+* the ustar headers and the member data from the pipe, like PipeFileTar,
+* and hands every member to a transmit thread, like the metadata pipe. The
+* transmit thread writes the members into a local socket pair and a
+* server thread reads them and computes a checksum.
+* The parser either waits for every member to be transmitted before it
+* parses the next header (window=1, as before) or keeps up to 64 members
+* or 8MB in flight. Reports members/s and the time the parser spent
+* waiting for the transmit thread.
+* Usage: bench_tar_pipeline [members=20000] [member_kb=4]
+*/
+
+#include "BenchServer.h"
+#include "BenchUtil.h"
+#include "BenchLoopback.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <string>
+#include <iostream>
+#include <stdio.h>
+#include <unistd.h>
+
+namespace
+{
+	const size_t c_tar_block = 512;
+
+	struct SMember
+	{
+		std::string data;
+		bool done;
+	};
+
+	class TransmitQueue
+	{
+	public:
+		TransmitQueue()
+			: stop(false)
+		{
+		}
+
+		void push(SMember* member)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			queue.push_back(member);
+			cond.notify_all();
+		}
+
+		SMember* pop()
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			while (queue.empty() && !stop)
+			{
+				cond.wait(lock);
+			}
+			if (queue.empty())
+			{
+				return NULL;
+			}
+			SMember* ret = queue.front();
+			queue.pop_front();
+			return ret;
+		}
+
+		void setDone(SMember* member)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			member->done = true;
+			cond.notify_all();
+		}
+
+		void waitDone(SMember* member)
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			while (!member->done)
+			{
+				cond.wait(lock);
+			}
+		}
+
+		void finish()
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+			cond.notify_all();
+		}
+
+	private:
+		std::mutex mutex;
+		std::condition_variable cond;
+		std::deque<SMember*> queue;
+		bool stop;
+	};
+
+	bool read_full(int fd, char* buf, size_t len)
+	{
+		while (len > 0)
+		{
+			ssize_t r = read(fd, buf, len);
+			if (r <= 0)
+			{
+				return false;
+			}
+			buf += r;
+			len -= r;
+		}
+		return true;
+	}
+
+	void write_full(int fd, const char* buf, size_t len)
+	{
+		while (len > 0)
+		{
+			ssize_t r = write(fd, buf, len);
+			if (r <= 0)
+			{
+				abort();
+			}
+			buf += r;
+			len -= r;
+		}
+	}
+
+	void script_thread(int fd, size_t n_members, size_t member_size)
+	{
+		size_t padded_size = (member_size + c_tar_block - 1) / c_tar_block*c_tar_block;
+		std::vector<char> member(c_tar_block + padded_size, 'x');
+		for (size_t i = 0; i < n_members; ++i)
+		{
+			memset(&member[0], 0, c_tar_block);
+			snprintf(&member[0], 100, "dir%d/file%d", static_cast<int>(i / 100), static_cast<int>(i));
+			snprintf(&member[124], 12, "%011o", static_cast<unsigned int>(member_size));
+			memcpy(&member[257], "ustar", 5);
+			write_full(fd, &member[0], member.size());
+		}
+		std::vector<char> end(2 * c_tar_block, 0);
+		write_full(fd, &end[0], end.size());
+		close(fd);
+	}
+
+	void transmit_thread(int s, TransmitQueue* queue)
+	{
+		SMember* member;
+		while ((member = queue->pop()) != NULL)
+		{
+			uint64_t size = member->data.size();
+			if (!bench_write_full(s, reinterpret_cast<char*>(&size), sizeof(size))
+				|| !bench_write_full(s, member->data.data(), member->data.size()))
+			{
+				abort();
+			}
+			queue->setDone(member);
+		}
+		shutdown(s, SHUT_WR);
+	}
+
+	void server_thread(int s, size_t* n_received, uint64_t* checksum)
+	{
+		std::vector<char> buf;
+		uint64_t size;
+		while (bench_read_full(s, reinterpret_cast<char*>(&size), sizeof(size)))
+		{
+			buf.resize(size);
+			if (size > 0 && !bench_read_full(s, &buf[0], size))
+			{
+				abort();
+			}
+			for (size_t i = 0; i < buf.size(); ++i)
+			{
+				*checksum = *checksum * 31 + static_cast<unsigned char>(buf[i]);
+			}
+			++*n_received;
+		}
+	}
+
+	void run(size_t n_members, size_t member_size, size_t max_files, size_t max_bytes)
+	{
+		int pipefds[2];
+		int sockets[2];
+		if (pipe(pipefds) != 0
+			|| socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0)
+		{
+			abort();
+		}
+
+		int64 start_time = bench_time_ns();
+
+		TransmitQueue queue;
+		size_t n_received = 0;
+		uint64_t checksum = 0;
+		std::thread script(script_thread, pipefds[1], n_members, member_size);
+		std::thread transmit(transmit_thread, sockets[0], &queue);
+		std::thread server(server_thread, sockets[1], &n_received, &checksum);
+
+		std::deque<SMember*> pending;
+		size_t pending_bytes = 0;
+		int64 wait_ns = 0;
+		std::vector<char> header(c_tar_block);
+		size_t n_parsed = 0;
+		while (read_full(pipefds[0], &header[0], header.size())
+			&& header[0] != 0)
+		{
+			size_t size = strtoul(std::string(&header[124], 11).c_str(), NULL, 8);
+			size_t padded_size = (size + c_tar_block - 1) / c_tar_block*c_tar_block;
+
+			SMember* member = new SMember;
+			member->done = false;
+			member->data.resize(padded_size);
+			if (padded_size > 0 && !read_full(pipefds[0], &member->data[0], padded_size))
+			{
+				abort();
+			}
+			member->data.resize(size);
+			++n_parsed;
+
+			queue.push(member);
+			pending.push_back(member);
+			pending_bytes += size;
+
+			int64 wait_start = bench_time_ns();
+			while (!pending.empty()
+				&& (pending.size() >= max_files
+					|| pending_bytes >= max_bytes))
+			{
+				queue.waitDone(pending.front());
+				pending_bytes -= pending.front()->data.size();
+				delete pending.front();
+				pending.pop_front();
+			}
+			wait_ns += bench_time_ns() - wait_start;
+		}
+
+		while (!pending.empty())
+		{
+			queue.waitDone(pending.front());
+			delete pending.front();
+			pending.pop_front();
+		}
+
+		queue.finish();
+		script.join();
+		transmit.join();
+		server.join();
+		close(pipefds[0]);
+		close(sockets[0]);
+		close(sockets[1]);
+
+		int64 end_time = bench_time_ns();
+
+		if (n_received != n_members || n_parsed != n_members)
+		{
+			std::cerr << "Received " << n_received << " of " << n_members << " members" << std::endl;
+			abort();
+		}
+
+		std::cout << "window=" << max_files << " files/" << max_bytes / 1024 << "KB"
+			<< " members/s=" << static_cast<int64>(n_members / ((end_time - start_time) / 1000000000.0))
+			<< " MB/s=" << (n_members*member_size / 1024.0 / 1024.0) / ((end_time - start_time) / 1000000000.0)
+			<< " parser waiting=" << wait_ns / 1000000 << "ms"
+			<< " checksum=" << checksum << std::endl;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	bench_init();
+
+	size_t n_members = bench_arg(argc, argv, 1, 20000);
+	size_t member_size = bench_arg(argc, argv, 2, 4) * 1024;
+
+	std::cout << "members=" << n_members << " member_kb=" << member_size / 1024 << std::endl;
+
+	for (size_t i = 0; i < 3; ++i)
+	{
+		run(n_members, member_size, 1, 8 * 1024 * 1024);
+		run(n_members, member_size, 64, 8 * 1024 * 1024);
+	}
+
+	return 0;
+}
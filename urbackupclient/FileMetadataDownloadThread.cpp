@@ -101,10 +101,110 @@ const _u32 ID_METADATA_OS = ID_METADATA_OS_WIN;
 const _u32 ID_METADATA_OS = ID_METADATA_OS_UNIX;
 #endif
 
+namespace
+{
+	class MetadataStreamFile : public IFile
+	{
+	public:
+		MetadataStreamFile(IFile* f, FileMetadataDownloadThread& metadata_thread, int64 pos)
+			: f(f), metadata_thread(metadata_thread), pos(pos)
+		{}
+
+		virtual std::string Read(_u32 tr, bool *has_error = NULL)
+		{
+			std::string ret;
+			ret.resize(tr);
+			if (tr > 0)
+			{
+				ret.resize(Read(&ret[0], tr, has_error));
+			}
+			return ret;
+		}
+
+		virtual std::string Read(int64 spos, _u32 tr, bool *has_error = NULL)
+		{
+			return f->Read(spos, tr, has_error);
+		}
+
+		virtual _u32 Read(char* buffer, _u32 bsize, bool *has_error = NULL)
+		{
+			_u32 read = 0;
+			while (read < bsize)
+			{
+				bool complete = metadata_thread.isMetadataComplete();
+				_u32 r = f->Read(pos, buffer + read, bsize - read, has_error);
+				pos += r;
+				read += r;
+
+				if (read < bsize)
+				{
+					if (complete
+						|| (has_error != NULL && *has_error))
+					{
+						break;
+					}
+					metadata_thread.waitForMetadata();
+				}
+			}
+			return read;
+		}
+
+		virtual _u32 Read(int64 spos, char* buffer, _u32 bsize, bool *has_error = NULL)
+		{
+			return f->Read(spos, buffer, bsize, has_error);
+		}
+
+		virtual _u32 Write(const std::string &tw, bool *has_error = NULL) { return 0; }
+		virtual _u32 Write(int64 spos, const std::string &tw, bool *has_error = NULL) { return 0; }
+		virtual _u32 Write(const char* buffer, _u32 bsiz, bool *has_error = NULL) { return 0; }
+		virtual _u32 Write(int64 spos, const char* buffer, _u32 bsiz, bool *has_error = NULL) { return 0; }
+
+		virtual bool Seek(_i64 spos)
+		{
+			pos = spos;
+			return true;
+		}
+
+		virtual _i64 Size(void) { return f->Size(); }
+		virtual _i64 RealSize() { return f->RealSize(); }
+		virtual bool PunchHole(_i64 spos, _i64 size) { return false; }
+		virtual bool Sync() { return false; }
+		virtual std::string getFilename(void) { return f->getFilename(); }
+
+		int64 getPos()
+		{
+			return pos;
+		}
+
+	private:
+		IFile* f;
+		FileMetadataDownloadThread& metadata_thread;
+		int64 pos;
+	};
+}
+
+FileMetadataApplyThread::FileMetadataApplyThread(FileMetadataDownloadThread& metadata_thread)
+	: metadata_thread(metadata_thread)
+{
+
+}
+
+void FileMetadataApplyThread::operator()()
+{
+	metadata_thread.applyDownloadedMetadata();
+}
+
 FileMetadataDownloadThread::FileMetadataDownloadThread(RestoreFiles& restore, FileClient& fc, const std::string& client_token)
-	: restore(restore), fc(fc), client_token(client_token), has_error(false), error_logging(true)
+	: restore(restore), fc(fc), client_token(client_token), has_error(false), error_logging(true),
+	mutex(Server->createMutex()), cond(Server->createCondition()), download_done(false), apply_stop(false),
+	apply_error(false), apply_pos(0), apply_ticket(ILLEGAL_THREADPOOL_TICKET)
 {
+	buffer.resize(32768);
+}
 
+FileMetadataDownloadThread::~FileMetadataDownloadThread()
+{
+	stopApply();
 }
 
 void FileMetadataDownloadThread::operator()()
@@ -115,6 +215,13 @@ void FileMetadataDownloadThread::operator()()
 	{
 		restore.log("Error creating temporary file for metadata", LL_ERROR);
 	}
+	else
+	{
+		metadata_tmp_fn = tmp_f->getFilename();
+
+		apply_thread.reset(new FileMetadataApplyThread(*this));
+		apply_ticket = Server->getThreadPool()->execute(apply_thread.get(), "file restore metadata apply");
+	}
 	
 	std::string remote_fn = "SCRIPT|urbackup/FILE_METADATA|"+client_token;
 
@@ -135,12 +242,15 @@ void FileMetadataDownloadThread::operator()()
 		fc.FinishScript(remote_fn);
 	}
 
-	metadata_tmp_fn = tmp_f->getFilename();
+	IScopedLock lock(mutex.get());
+	download_done = true;
+	cond->notify_all();
 }
 
 bool FileMetadataDownloadThread::applyMetadata(const str_map& path_mapping)
 {
-	buffer.resize(32768);
+	stopApply();
+
 	std::auto_ptr<IFile> metadata_f(Server->openFile(metadata_tmp_fn, MODE_READ_SEQUENTIAL));
 
 	if(metadata_f.get()==NULL)
@@ -151,9 +261,94 @@ bool FileMetadataDownloadThread::applyMetadata(const str_map& path_mapping)
 
 	restore.log("Applying file metadata...", LL_INFO);
 
+	for (size_t i = 0; i < pending_metadata.size(); ++i)
+	{
+		SPendingMetadata& pending = pending_metadata[i];
+
+		if (pending.applied)
+		{
+			continue;
+		}
+
+		std::string os_path = pending.os_path;
+		str_map::const_iterator it_pm = path_mapping.find(os_path);
+		if (it_pm != path_mapping.end())
+		{
+			os_path = it_pm->second;
+		}
+
+		if (!metadata_f->Seek(pending.offset)
+			|| !applyOsMetadata(metadata_f.get(), os_path))
+		{
+			restore.log("Error saving metadata. Could not save OS specific metadata to \"" + os_path + "\"", LL_ERROR);
+			return false;
+		}
+
+		pending.applied = true;
+	}
+
+	if (apply_error)
+	{
+		return false;
+	}
+
+	if (!metadata_f->Seek(apply_pos))
+	{
+		restore.log("Error seeking to " + convert(apply_pos) + " in metadata file at \"" + metadata_tmp_fn + "\". " + os_last_error_str(), LL_ERROR);
+		return false;
+	}
+
 	do 
 	{
+		bool has_entry;
 		char ch;
+		std::string os_path;
+		bool is_dir;
+		if (!readMetadataPath(metadata_f.get(), has_entry, ch, os_path, is_dir))
+		{
+			return false;
+		}
+
+		if (!has_entry)
+		{
+			return true;
+		}
+
+		str_map::const_iterator it_pm = path_mapping.find(os_path);
+		if (it_pm != path_mapping.end())
+		{
+			os_path = it_pm->second;
+		}
+
+		bool ok=false;
+		if(ch & ID_METADATA_OS)
+		{
+			ok = applyOsMetadata(metadata_f.get(), os_path);
+		}
+		else
+		{
+			restore.log("Wrong metadata. This metadata is not for this operating system! (id=" + convert(ch)+")", LL_ERROR);
+		}
+
+		if(!ok)
+		{
+			restore.log("Error saving metadata. Could not save OS specific metadata to \"" + os_path + "\"", LL_ERROR);
+			return false;
+		}
+
+	} while (true);
+
+	Server->Log("Loop exit in " + std::string(__FUNCTION__), LL_ERROR);
+	assert(false);
+	return true;
+}
+
+bool FileMetadataDownloadThread::readMetadataPath(IFile* metadata_f, bool& has_entry, char& ch, std::string& os_path, bool& is_dir)
+{
+	has_entry = false;
+
+	do 
+	{
 		if(metadata_f->Read(reinterpret_cast<char*>(&ch), sizeof(ch))!=sizeof(ch))
 		{
 			return true;
@@ -211,12 +406,12 @@ bool FileMetadataDownloadThread::applyMetadata(const str_map& path_mapping)
 
 			restore.log("Applying metadata of file \"" + curr_fn + "\"", LL_DEBUG);
 
-			bool is_dir = (curr_fn[0]=='d' || curr_fn[0]=='l');
+			is_dir = (curr_fn[0]=='d' || curr_fn[0]=='l');
 
 #ifdef _WIN32
-			std::string os_path;
+			os_path.clear();
 #else
-            std::string os_path = os_file_sep();
+            os_path = os_file_sep();
 #endif
 			std::vector<std::string> fs_toks;
 			Tokenize(curr_fn.substr(1), fs_toks, "/");
@@ -235,34 +430,168 @@ bool FileMetadataDownloadThread::applyMetadata(const str_map& path_mapping)
 				}
 			}
 
-			str_map::const_iterator it_pm = path_mapping.find(os_path);
-			if (it_pm != path_mapping.end())
+			has_entry = true;
+			return true;
+		}
+
+	} while (true);
+}
+
+void FileMetadataDownloadThread::fileDone(const std::string& destfn, const std::string& final_destfn)
+{
+	IScopedLock lock(mutex.get());
+	new_done_files.push_back(std::make_pair(destfn, final_destfn));
+	cond->notify_all();
+}
+
+bool FileMetadataDownloadThread::isMetadataComplete()
+{
+	IScopedLock lock(mutex.get());
+	return download_done || apply_stop;
+}
+
+void FileMetadataDownloadThread::waitForMetadata()
+{
+	{
+		IScopedLock lock(mutex.get());
+		if (!download_done && !apply_stop
+			&& new_done_files.empty())
+		{
+			cond->wait(&lock, 1000);
+		}
+	}
+
+	applyDoneFiles();
+}
+
+void FileMetadataDownloadThread::applyDownloadedMetadata()
+{
+	std::auto_ptr<IFile> metadata_f(Server->openFile(metadata_tmp_fn, MODE_READ));
+	apply_record_f.reset(Server->openFile(metadata_tmp_fn, MODE_READ));
+
+	if (metadata_f.get() == NULL
+		|| apply_record_f.get() == NULL)
+	{
+		Server->Log("Cannot open metadata file at \"" + metadata_tmp_fn + "\" while downloading. Applying metadata after the download. " + os_last_error_str(), LL_DEBUG);
+		apply_record_f.reset();
+		return;
+	}
+
+	MetadataStreamFile stream_f(metadata_f.get(), *this, 0);
+
+	while (true)
+	{
+		applyDoneFiles();
+
+		{
+			IScopedLock lock(mutex.get());
+			if (apply_stop || apply_error)
 			{
-				os_path = it_pm->second;
+				break;
 			}
+		}
+
+		bool has_entry;
+		char ch;
+		std::string os_path;
+		bool is_dir;
+		if (!readMetadataPath(&stream_f, has_entry, ch, os_path, is_dir)
+			|| !has_entry
+			|| !(ch & ID_METADATA_OS))
+		{
+			break;
+		}
+
+		int64 os_offset = stream_f.getPos();
 
-			bool ok=false;
-			if(ch & ID_METADATA_OS)
+		std::map<std::string, std::string>::iterator it = done_files.find(os_path);
+		if (!is_dir
+			&& it != done_files.end())
+		{
+			bool ok = applyOsMetadata(&stream_f, it->second);
+			done_files.erase(it);
+
+			if (!ok)
 			{
-				ok = applyOsMetadata(metadata_f.get(), os_path);
+				restore.log("Error saving metadata. Could not save OS specific metadata to \"" + os_path + "\"", LL_ERROR);
+				IScopedLock lock(mutex.get());
+				apply_error = true;
+				break;
 			}
-			else
+		}
+		else
+		{
+			if (!skipOsMetadata(&stream_f))
 			{
-				restore.log("Wrong metadata. This metadata is not for this operating system! (id=" + convert(ch)+")", LL_ERROR);
+				break;
 			}
 
-			if(!ok)
+			if (!is_dir)
 			{
-				restore.log("Error saving metadata. Could not save OS specific metadata to \"" + os_path + "\"", LL_ERROR);
-				return false;
-			}			
+				pending_idx[os_path] = pending_metadata.size();
+			}
+
+			pending_metadata.push_back(SPendingMetadata(os_offset, os_path));
 		}
 
-	} while (true);
+		apply_pos = stream_f.getPos();
+	}
 
-	Server->Log("Loop exit in " + std::string(__FUNCTION__), LL_ERROR);
-	assert(false);
-	return true;
+	apply_record_f.reset();
+}
+
+void FileMetadataDownloadThread::applyDoneFiles()
+{
+	std::vector<std::pair<std::string, std::string> > curr_done_files;
+	{
+		IScopedLock lock(mutex.get());
+		if (apply_error)
+		{
+			return;
+		}
+		curr_done_files.swap(new_done_files);
+	}
+
+	for (size_t i = 0; i < curr_done_files.size(); ++i)
+	{
+		std::map<std::string, size_t>::iterator it = pending_idx.find(curr_done_files[i].first);
+		if (it == pending_idx.end())
+		{
+			done_files[curr_done_files[i].first] = curr_done_files[i].second;
+			continue;
+		}
+
+		SPendingMetadata& pending = pending_metadata[it->second];
+		pending_idx.erase(it);
+
+		if (!apply_record_f->Seek(pending.offset)
+			|| !applyOsMetadata(apply_record_f.get(), curr_done_files[i].second))
+		{
+			restore.log("Error saving metadata. Could not save OS specific metadata to \"" + curr_done_files[i].second + "\"", LL_ERROR);
+			IScopedLock lock(mutex.get());
+			apply_error = true;
+			return;
+		}
+
+		pending.applied = true;
+	}
+}
+
+void FileMetadataDownloadThread::stopApply()
+{
+	if (apply_ticket == ILLEGAL_THREADPOOL_TICKET)
+	{
+		return;
+	}
+
+	{
+		IScopedLock lock(mutex.get());
+		apply_stop = true;
+		cond->notify_all();
+	}
+
+	Server->getThreadPool()->waitFor(apply_ticket);
+	apply_ticket = ILLEGAL_THREADPOOL_TICKET;
 }
 
 #ifdef _WIN32
@@ -542,6 +871,74 @@ bool FileMetadataDownloadThread::applyOsMetadata( IFile* metadata_f, const std::
 	return !has_error;
 }
 
+bool FileMetadataDownloadThread::skipOsMetadata(IFile* metadata_f)
+{
+	int64 win32_magic_and_size[2];
+	if(metadata_f->Read(reinterpret_cast<char*>(win32_magic_and_size), sizeof(win32_magic_and_size))!=sizeof(win32_magic_and_size)
+		|| win32_magic_and_size[1]!=win32_meta_magic)
+	{
+		return false;
+	}
+
+	_u32 stat_data_size;
+	if(metadata_f->Read(reinterpret_cast<char*>(&stat_data_size), sizeof(_u32))!=sizeof(_u32))
+	{
+		return false;
+	}
+
+	stat_data_size = little_endian(stat_data_size);
+
+	std::vector<char> stat_data;
+	stat_data.resize(stat_data_size);
+	if(stat_data_size<1
+		|| metadata_f->Read(stat_data.data(), static_cast<_u32>(stat_data.size()))!=stat_data.size())
+	{
+		return false;
+	}
+
+	while(true)
+	{
+		char cont = 0;
+		if(metadata_f->Read(&cont, sizeof(cont))!=sizeof(cont))
+		{
+			return false;
+		}
+
+		if(cont==0)
+		{
+			break;
+		}
+
+		std::vector<char> stream_id;
+		stream_id.resize(metadata_id_size);
+
+		if(metadata_f->Read(stream_id.data(), metadata_id_size)!=metadata_id_size)
+		{
+			return false;
+		}
+
+		WIN32_STREAM_ID_INT* curr_stream_id =
+			reinterpret_cast<WIN32_STREAM_ID_INT*>(stream_id.data());
+
+		int64 skip = static_cast<int64>(curr_stream_id->dwStreamNameSize) + curr_stream_id->Size;
+
+		while(skip>0)
+		{
+			_u32 toread = static_cast<_u32>((std::min)(static_cast<int64>(buffer.size()), skip));
+
+			if(metadata_f->Read(buffer.data(), toread)!=toread)
+			{
+				return false;
+			}
+
+			skip-=toread;
+		}
+	}
+
+	unsigned int read_data_checksum =0;
+	return metadata_f->Read(reinterpret_cast<char*>(&read_data_checksum), sizeof(read_data_checksum))==sizeof(read_data_checksum);
+}
+
 #else //_WIN32
 
 namespace
@@ -999,6 +1396,95 @@ bool FileMetadataDownloadThread::applyOsMetadata( IFile* metadata_f, const std::
     return true;
 }
 
+bool FileMetadataDownloadThread::skipOsMetadata(IFile* metadata_f)
+{
+	int64 unix_magic_and_size[2];
+	if(metadata_f->Read(reinterpret_cast<char*>(unix_magic_and_size), sizeof(unix_magic_and_size))!=sizeof(unix_magic_and_size)
+		|| unix_magic_and_size[1]!=unix_meta_magic)
+	{
+		return false;
+	}
+
+	_u32 stat_data_size;
+	if(metadata_f->Read(reinterpret_cast<char*>(&stat_data_size), sizeof(_u32))!=sizeof(_u32))
+	{
+		return false;
+	}
+
+	stat_data_size = little_endian(stat_data_size);
+
+	std::vector<char> stat_data;
+	stat_data.resize(stat_data_size);
+	if(stat_data_size<1
+		|| metadata_f->Read(stat_data.data(), static_cast<_u32>(stat_data.size()))!=stat_data.size())
+	{
+		return false;
+	}
+
+	int64 num_eattr_keys;
+	if(metadata_f->Read(reinterpret_cast<char*>(&num_eattr_keys), sizeof(num_eattr_keys))!=sizeof(num_eattr_keys))
+	{
+		return false;
+	}
+
+	num_eattr_keys = little_endian(num_eattr_keys);
+
+	for(int64 i=0;i<num_eattr_keys;++i)
+	{
+		unsigned int key_size;
+		if(metadata_f->Read(reinterpret_cast<char*>(&key_size), sizeof(key_size))!=sizeof(key_size))
+		{
+			return false;
+		}
+
+		key_size = little_endian(key_size);
+
+		if (key_size > 1 * 1024 * 1024)
+		{
+			return false;
+		}
+
+		std::string eattr_key;
+		eattr_key.resize(key_size);
+
+		if(key_size>0
+			&& metadata_f->Read(&eattr_key[0], static_cast<_u32>(eattr_key.size()))!=eattr_key.size())
+		{
+			return false;
+		}
+
+		unsigned int val_size;
+		if(metadata_f->Read(reinterpret_cast<char*>(&val_size), sizeof(val_size))!=sizeof(val_size))
+		{
+			return false;
+		}
+
+		val_size = little_endian(val_size);
+
+		if (val_size == UINT_MAX)
+		{
+			continue;
+		}
+
+		if (val_size > 10 * 1024 * 1024)
+		{
+			return false;
+		}
+
+		std::string eattr_val;
+		eattr_val.resize(val_size);
+
+		if(val_size>0
+			&& metadata_f->Read(&eattr_val[0], static_cast<_u32>(eattr_val.size()))!=eattr_val.size())
+		{
+			return false;
+		}
+	}
+
+	unsigned int read_data_checksum =0;
+	return metadata_f->Read(reinterpret_cast<char*>(&read_data_checksum), sizeof(read_data_checksum))==sizeof(read_data_checksum);
+}
+
 #endif //_WIN32
 
 
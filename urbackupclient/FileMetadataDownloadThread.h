@@ -1,14 +1,31 @@
 #pragma once
 #include "../urbackupcommon/fileclient/FileClient.h"
 #include "../Interface/Thread.h"
+#include "../Interface/ThreadPool.h"
+#include "../Interface/Mutex.h"
+#include "../Interface/Condition.h"
 #include "RestoreFiles.h"
 
 namespace client {
 
+class FileMetadataDownloadThread;
+
+class FileMetadataApplyThread : public IThread
+{
+public:
+	FileMetadataApplyThread(FileMetadataDownloadThread& metadata_thread);
+
+	virtual void operator()();
+
+private:
+	FileMetadataDownloadThread& metadata_thread;
+};
+
 class FileMetadataDownloadThread : public IThread
 {
 public:
 	FileMetadataDownloadThread(RestoreFiles& restore, FileClient& fc, const std::string& client_token);
+	~FileMetadataDownloadThread();
 
 	virtual void operator()();
 
@@ -20,7 +37,34 @@ public:
 
 	int64 getTransferredBytes();
 
+	void fileDone(const std::string& destfn, const std::string& final_destfn);
+
+	void applyDownloadedMetadata();
+
+	bool isMetadataComplete();
+
+	void waitForMetadata();
+
 private:
+	struct SPendingMetadata
+	{
+		SPendingMetadata(int64 offset, const std::string& os_path)
+			: offset(offset), os_path(os_path), applied(false)
+		{}
+
+		int64 offset;
+		std::string os_path;
+		bool applied;
+	};
+
+	bool readMetadataPath(IFile* metadata_f, bool& has_entry, char& ch, std::string& os_path, bool& is_dir);
+
+	bool skipOsMetadata(IFile* metadata_f);
+
+	void applyDoneFiles();
+
+	void stopApply();
+
 	RestoreFiles& restore;
 	FileClient& fc;
 	const std::string& client_token;
@@ -30,6 +74,20 @@ private:
 	bool has_error;
 	std::string metadata_tmp_fn;
 	volatile bool error_logging;
+
+	std::auto_ptr<IMutex> mutex;
+	std::auto_ptr<ICondition> cond;
+	bool download_done;
+	bool apply_stop;
+	bool apply_error;
+	std::vector<std::pair<std::string, std::string> > new_done_files;
+	std::map<std::string, std::string> done_files;
+	std::vector<SPendingMetadata> pending_metadata;
+	std::map<std::string, size_t> pending_idx;
+	int64 apply_pos;
+	std::auto_ptr<IFile> apply_record_f;
+	std::auto_ptr<FileMetadataApplyThread> apply_thread;
+	THREADPOOL_TICKET apply_ticket;
 };
 
 } //namespace client
@@ -18,6 +18,8 @@
 
 #include "../Interface/Server.h"
 #include "../Interface/ThreadPool.h"
+#include "../Interface/Mutex.h"
+#include "../Interface/Condition.h"
 #include "../stringtools.h"
 
 #include "../fsimageplugin/IFSImageFactory.h"
@@ -36,6 +38,8 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <memory>
+#include <deque>
+#include <thread>
 
 extern IFSImageFactory *image_fak;
 
@@ -123,6 +127,219 @@ void ImageThread::createShadowData(str_map & other_vols, CWData & shadow_data)
 const unsigned int c_vhdblocksize=(1024*1024/2);
 const unsigned int c_hashsize=32;
 
+namespace
+{
+	const size_t hashdata_read_batch = 4096;
+	const size_t max_hash_threads = 8;
+
+	class HashdataReader
+	{
+	public:
+		HashdataReader(IFile* hashdatafile)
+			: hashdatafile(hashdatafile), buf_start(-1), buf_count(0),
+			hashdata_size(hashdatafile->Size())
+		{
+		}
+
+		bool get(int64 hnum, char* out)
+		{
+			if (hashdata_size < (hnum + 1)*c_hashsize)
+			{
+				return false;
+			}
+
+			if (buf_start<0
+				|| hnum<buf_start
+				|| hnum >= buf_start + buf_count)
+			{
+				int64 toread = (std::min)(static_cast<int64>(hashdata_read_batch), hashdata_size / c_hashsize - hnum);
+				buf.resize(static_cast<size_t>(toread)*c_hashsize);
+				_u32 read = hashdatafile->Read(hnum*c_hashsize, buf.data(), static_cast<_u32>(buf.size()));
+				buf_count = read / c_hashsize;
+				if (buf_count == 0)
+				{
+					Server->Log("Reading hashdata failed!", LL_ERROR);
+					buf_start = -1;
+					return false;
+				}
+				buf_start = hnum;
+			}
+
+			memcpy(out, &buf[static_cast<size_t>(hnum - buf_start)*c_hashsize], c_hashsize);
+			return true;
+		}
+
+	private:
+		IFile* hashdatafile;
+		std::vector<char> buf;
+		int64 buf_start;
+		int64 buf_count;
+		int64 hashdata_size;
+	};
+
+	struct SHashJob
+	{
+		int64 block;
+		std::vector<char*> bufs;
+		bool mixed;
+		bool hash;
+		bool done;
+		bool has_hashdata;
+		char hashdata[c_hashsize];
+		unsigned char digest[SHA256_DIGEST_SIZE];
+	};
+
+	class BlockHasher
+	{
+	public:
+		BlockHasher(unsigned int blocksize, const char* zeroblockbuf, size_t nthreads, bool background_prio)
+			: blocksize(blocksize), zeroblockbuf(zeroblockbuf), background_prio(background_prio),
+			do_stop(false), mutex(Server->createMutex()), cond(Server->createCondition())
+		{
+			for (size_t i = 0; i < nthreads; ++i)
+			{
+				workers.push_back(new Worker(*this));
+				tickets.push_back(Server->getThreadPool()->execute(workers[i], "image block hash"));
+			}
+		}
+
+		~BlockHasher()
+		{
+			{
+				IScopedLock lock(mutex.get());
+				do_stop = true;
+				cond->notify_all();
+			}
+			Server->getThreadPool()->waitFor(tickets);
+			for (size_t i = 0; i < workers.size(); ++i)
+			{
+				delete workers[i];
+			}
+		}
+
+		void add(SHashJob* job)
+		{
+			if (!job->hash || workers.empty())
+			{
+				return;
+			}
+
+			IScopedLock lock(mutex.get());
+			queue.push_back(job);
+			cond->notify_all();
+		}
+
+		void wait(SHashJob* job)
+		{
+			if (workers.empty())
+			{
+				if (!job->done)
+				{
+					hash(job);
+					job->done = true;
+				}
+				return;
+			}
+
+			IScopedLock lock(mutex.get());
+			while (!job->done)
+			{
+				cond->wait(&lock);
+			}
+		}
+
+	private:
+		class Worker : public IThread
+		{
+		public:
+			Worker(BlockHasher& hasher)
+				: hasher(hasher)
+			{}
+
+			void operator()()
+			{
+				hasher.run();
+			}
+
+		private:
+			BlockHasher& hasher;
+		};
+
+		void run()
+		{
+			ScopedBackgroundPrio prio(false);
+			if (background_prio)
+			{
+				prio.enable();
+			}
+
+			IScopedLock lock(mutex.get());
+			while (true)
+			{
+				while (queue.empty() && !do_stop)
+				{
+					cond->wait(&lock);
+				}
+
+				if (queue.empty())
+				{
+					return;
+				}
+
+				SHashJob* job = queue.front();
+				queue.pop_front();
+
+				lock.relock(NULL);
+				hash(job);
+				lock.relock(mutex.get());
+
+				job->done = true;
+				cond->notify_all();
+			}
+		}
+
+		void hash(SHashJob* job)
+		{
+			sha256_ctx shactx;
+			sha256_init(&shactx);
+			for (size_t i = 0; i < job->bufs.size(); ++i)
+			{
+				if (job->bufs[i] != NULL)
+				{
+					sha256_update(&shactx, reinterpret_cast<unsigned char*>(job->bufs[i]), blocksize);
+				}
+				else
+				{
+					sha256_update(&shactx, reinterpret_cast<const unsigned char*>(zeroblockbuf), blocksize);
+				}
+			}
+			sha256_final(&shactx, job->digest);
+		}
+
+		unsigned int blocksize;
+		const char* zeroblockbuf;
+		bool background_prio;
+		bool do_stop;
+		std::auto_ptr<IMutex> mutex;
+		std::auto_ptr<ICondition> cond;
+		std::deque<SHashJob*> queue;
+		std::vector<Worker*> workers;
+		std::vector<THREADPOOL_TICKET> tickets;
+	};
+
+	void release_job_buffers(IFilesystem* fs, SHashJob* job)
+	{
+		for (size_t i = 0; i < job->bufs.size(); ++i)
+		{
+			if (job->bufs[i] != NULL)
+			{
+				fs->releaseBuffer(job->bufs[i]);
+				job->bufs[i] = NULL;
+			}
+		}
+	}
+}
+
 bool ImageThread::sendFullImageThread(void)
 {
 	bool has_error=true;
@@ -512,7 +729,6 @@ void ImageThread::removeShadowCopyThread(int save_id)
 bool ImageThread::sendIncrImageThread(void)
 {
 	char *zeroblockbuf=NULL;
-	std::vector<char*> blockbufs;
 
 	bool has_error=true;
 	bool with_checksum=image_inf->with_checksum;
@@ -646,6 +862,8 @@ bool ImageThread::sendIncrImageThread(void)
 				std::vector<char> buf;
 				buf.resize(4096);
 
+				HashdataReader hashdata_reader(hashdatafile);
+
 				hdat_img->Seek(sizeof(int));
 				_u32 read;
 				int64 imgpos = 0;
@@ -685,20 +903,8 @@ bool ImageThread::sendIncrImageThread(void)
 							}
 							else
 							{
-								bool has_hashdata = false;
 								char hashdata_buf[c_hashsize];
-								int64 hnum = imgpos / c_vhdblocksize;
-								if (hashdatafile->Size() >= (hnum + 1)*c_hashsize)
-								{
-									if (hashdatafile->Read(hnum*c_hashsize, hashdata_buf, c_hashsize) != c_hashsize)
-									{
-										Server->Log("Reading hashdata failed!", LL_ERROR);
-									}
-									else
-									{
-										has_hashdata = true;
-									}
-								}
+								bool has_hashdata = hashdata_reader.get(imgpos / c_vhdblocksize, hashdata_buf);
 
 								if (has_hashdata
 									&& memcmp(hashdata_buf, &buf[i], c_hashsize) == 0)
@@ -810,8 +1016,6 @@ bool ImageThread::sendIncrImageThread(void)
 				}
 			}
 			
-			blockbufs.clear();
-			blockbufs.resize(blocks_per_vhdblock);
 			delete []zeroblockbuf;
 			zeroblockbuf=new char[blocksize];
 			memset(zeroblockbuf, 0, blocksize);
@@ -819,159 +1023,89 @@ bool ImageThread::sendIncrImageThread(void)
 			clientSend = new ClientSend(pipe, blocksize+sizeof(int64), 2000);
 			THREADPOOL_TICKET send_ticket=Server->getThreadPool()->execute(clientSend, "incr image transfer");
 
-			int64 startpos = image_inf->startpos < 0 ? 0 : image_inf->startpos;
-			for(int64 i=startpos,blocks=drivesize/blocksize;i<blocks;i+= blocks_per_vhdblock)
+			size_t hash_threads = (std::min)(static_cast<size_t>(std::thread::hardware_concurrency()), max_hash_threads);
+			if (hash_threads <= 1)
 			{
-				++update_cnt;
-				if(update_cnt>10
-					&& blockcnt>=0)
-				{
-					ClientConnector::updateRunningPc(image_inf->running_process_id, (int)(((float)i / (float)blocks)*100.f + 0.5f));
-					update_cnt=0;
-				}
-				currvhdblock=i/ blocks_per_vhdblock;
-
-#ifdef _DEBUG
-				for (size_t k = 0; k<blockbufs.size(); ++k)
-				{
-					assert(blockbufs[k] == NULL);
-				}
-#endif
+				hash_threads = 0;
+			}
+			size_t max_pending = (std::max)(static_cast<size_t>(2), hash_threads * 4);
 
-				bool has_data = false;
+			HashdataReader hashdata_reader(hashdatafile);
+			BlockHasher hasher(blocksize, zeroblockbuf, hash_threads, IndexThread::backgroundBackupsEnabled(std::string()));
+			std::deque<SHashJob*> pending;
 
-				if (cbt_bitmap.empty())
+			int64 blocks = drivesize / blocksize;
+			int64 i = image_inf->startpos < 0 ? 0 : image_inf->startpos;
+			while (run
+				&& (i < blocks || !pending.empty()) )
+			{
+				if (i < blocks
+					&& pending.size() < max_pending)
 				{
-					for (int64 j = i; j < blocks && j < i + blocks_per_vhdblock; ++j)
+					++update_cnt;
+					if(update_cnt>10
+						&& blockcnt>=0)
 					{
-						if (fs->hasBlock(j))
-						{
-							has_data = true;
-						}
+						ClientConnector::updateRunningPc(image_inf->running_process_id, (int)(((float)i / (float)blocks)*100.f + 0.5f));
+						update_cnt=0;
 					}
-				}
-				else
-				{
-					has_data = cbt_bitmap.get(currvhdblock);
-				}
+					currvhdblock=i/ blocks_per_vhdblock;
 
-				if(has_data)
-				{
-					bool has_hashdata = false;
-					char hashdata_buf[c_hashsize];
-					if (hashdatafile->Size() >= (currvhdblock + 1)*c_hashsize)
-					{
-						hashdatafile->Seek(currvhdblock*c_hashsize);
-						if (hashdatafile->Read(hashdata_buf, c_hashsize) != c_hashsize)
-						{
-							Server->Log("Reading hashdata failed!", LL_ERROR);
-						}
-						else
-						{
-							has_hashdata = true;
-						}
-					}
+					bool has_data = false;
 
-					bool mixed = false;
-					unsigned char digest[SHA256_DIGEST_SIZE];
-					if (has_hashdata || with_checksum)
+					if (cbt_bitmap.empty())
 					{
-						sha256_init(&shactx);
 						for (int64 j = i; j < blocks && j < i + blocks_per_vhdblock; ++j)
 						{
-							char* buf = fs->readBlock(j);
-							if (buf != NULL)
-							{
-								sha256_update(&shactx, (unsigned char*)buf, blocksize);
-								blockbufs[j - i] = buf;
-							}
-							else
-							{
-								if (fs->hasError())
-								{
-									break;
-								}
-								sha256_update(&shactx, (unsigned char*)zeroblockbuf, blocksize);
-								mixed = true;
-								blockbufs[j - i] = NULL;
-							}
-						}
-						if (fs->hasError())
-						{
-							for (size_t i = 0; i < blockbufs.size(); ++i)
+							if (fs->hasBlock(j))
 							{
-								if (blockbufs[i] != NULL)
-								{
-									fs->releaseBuffer(blockbufs[i]);
-									blockbufs[i] = NULL;
-								}
+								has_data = true;
 							}
-							std::string oserrmsg;
-							ImageErrRunning("Error while reading from shadow copy device (2). "+getFsErrMsg());
-							run = false;
-							break;
-						}
-
-						sha256_final(&shactx, digest);
-
-						if (hdat_img.get() != NULL)
-						{
-							if (IndexThread::getShadowId(hdat_vol, hdat_img.get()) != r_shadow_id)
-							{
-								hdat_img.reset();
-							}
-						}
-
-						if (hdat_img.get() != NULL)
-						{
-							hdat_img->Write(sizeof(int) + (i / blocks_per_vhdblock)*c_hashsize, reinterpret_cast<char*>(digest), c_hashsize);
 						}
 					}
+					else
+					{
+						has_data = cbt_bitmap.get(currvhdblock);
+					}
 
-					if(!has_hashdata || memcmp(hashdata_buf, digest, c_hashsize) != 0)
+					if(has_data)
 					{
-						Server->Log("Block did change: "+convert(i)+" mixed="+convert(mixed), LL_DEBUG);
-						bool notify_cs=false;
-						for(int64 j=i;j<blocks && j<i+ blocks_per_vhdblock;++j)
+						std::auto_ptr<SHashJob> job(new SHashJob);
+						job->block = i;
+						job->mixed = false;
+						job->has_hashdata = hashdata_reader.get(currvhdblock, job->hashdata);
+						job->hash = job->has_hashdata || with_checksum;
+						job->done = !job->hash;
+
+						if (job->hash)
 						{
-							if(blockbufs[j-i]!=NULL)
+							for (int64 j = i; j < blocks && j < i + blocks_per_vhdblock; ++j)
 							{
-								char* cb=clientSend->getBuffer();
-								memcpy(cb, &j, sizeof(int64) );
-								memcpy(&cb[sizeof(int64)], blockbufs[j-i], blocksize);
-								clientSend->sendBuffer(cb, sizeof(int64)+blocksize, false);
-								notify_cs=true;
-								lastsendtime=Server->getTimeMS();
-								fs->releaseBuffer(blockbufs[j-i]);
-								blockbufs[j-i]=NULL;
+								char* buf = fs->readBlock(j);
+								if (buf == NULL)
+								{
+									if (fs->hasError())
+									{
+										break;
+									}
+									job->mixed = true;
+								}
+								job->bufs.push_back(buf);
 							}
-						}
-
-						if(notify_cs)
-						{
-							clientSend->notifySendBuffer();
-							if(clientSend->hasError())
+							if (fs->hasError())
 							{
-								Server->Log("Pipe broken -2", LL_ERROR);
-								run=false;
+								release_job_buffers(fs.get(), job.get());
+								ImageErrRunning("Error while reading from shadow copy device (2). "+getFsErrMsg());
+								run = false;
+								break;
 							}
 						}
 
-						if(with_checksum)
-						{
-							char* cb=clientSend->getBuffer();
-							int64 bs=-126;
-							int64 nextblock=(std::min)(blocks, i+ blocks_per_vhdblock);
-							memcpy(cb, &bs, sizeof(int64) );
-							memcpy(cb+sizeof(int64), &nextblock, sizeof(int64));
-							memcpy(cb+2*sizeof(int64), digest, c_hashsize);
-							clientSend->sendBuffer(cb, 2*sizeof(int64)+c_hashsize, true);
-							//Server->Log("Block hash="+base64_encode(digest, c_hashsize), LL_DEBUG);
-						}
+						hasher.add(job.get());
+						pending.push_back(job.release());
 					}
 					else
 					{
-						//Server->Log("Block didn't change: "+convert(i), LL_DEBUG);
 						int64 tt=Server->getTimeMS();
 						if(tt-lastsendtime>10000)
 						{
@@ -982,17 +1116,84 @@ bool ImageThread::sendIncrImageThread(void)
 
 							lastsendtime=tt;
 						}
+					}
+
+					i += blocks_per_vhdblock;
+
+					if(IdleCheckerThread::getPause())
+					{
+						Server->wait(30000);
+					}
+
+					if(Server->getTimeMS() - last_shadowcopy_update > 1*60*60*1000)
+					{
+						updateShadowCopyStarttime(save_id);
+						last_shadowcopy_update = Server->getTimeMS();
+					}
 
-						for(size_t k=0;k<blockbufs.size();++k)
+					continue;
+				}
+
+				std::auto_ptr<SHashJob> job(pending.front());
+				pending.pop_front();
+				hasher.wait(job.get());
+
+				if (job->hash)
+				{
+					if (hdat_img.get() != NULL)
+					{
+						if (IndexThread::getShadowId(hdat_vol, hdat_img.get()) != r_shadow_id)
 						{
-							if(blockbufs[k]!=NULL)
-							{
-								fs->releaseBuffer(blockbufs[k]);
-								blockbufs[k]=NULL;
-							}
+							hdat_img.reset();
+						}
+					}
+
+					if (hdat_img.get() != NULL)
+					{
+						hdat_img->Write(sizeof(int) + (job->block / blocks_per_vhdblock)*c_hashsize, reinterpret_cast<char*>(job->digest), c_hashsize);
+					}
+				}
+
+				if(!job->has_hashdata || memcmp(job->hashdata, job->digest, c_hashsize) != 0)
+				{
+					Server->Log("Block did change: "+convert(job->block)+" mixed="+convert(job->mixed), LL_DEBUG);
+					bool notify_cs=false;
+					for(size_t k=0;k<job->bufs.size();++k)
+					{
+						if(job->bufs[k]!=NULL)
+						{
+							int64 j = job->block + k;
+							char* cb=clientSend->getBuffer();
+							memcpy(cb, &j, sizeof(int64) );
+							memcpy(&cb[sizeof(int64)], job->bufs[k], blocksize);
+							clientSend->sendBuffer(cb, sizeof(int64)+blocksize, false);
+							notify_cs=true;
+							lastsendtime=Server->getTimeMS();
+							fs->releaseBuffer(job->bufs[k]);
+							job->bufs[k]=NULL;
 						}
 					}
-					if(!run)break;
+
+					if(notify_cs)
+					{
+						clientSend->notifySendBuffer();
+						if(clientSend->hasError())
+						{
+							Server->Log("Pipe broken -2", LL_ERROR);
+							run=false;
+						}
+					}
+
+					if(with_checksum)
+					{
+						char* cb=clientSend->getBuffer();
+						int64 bs=-126;
+						int64 nextblock=(std::min)(blocks, job->block+ blocks_per_vhdblock);
+						memcpy(cb, &bs, sizeof(int64) );
+						memcpy(cb+sizeof(int64), &nextblock, sizeof(int64));
+						memcpy(cb+2*sizeof(int64), job->digest, c_hashsize);
+						clientSend->sendBuffer(cb, 2*sizeof(int64)+c_hashsize, true);
+					}
 				}
 				else
 				{
@@ -1006,18 +1207,17 @@ bool ImageThread::sendIncrImageThread(void)
 
 						lastsendtime=tt;
 					}
-				}
 
-				if(IdleCheckerThread::getPause())
-				{
-					Server->wait(30000);
+					release_job_buffers(fs.get(), job.get());
 				}
+			}
 
-				if(Server->getTimeMS() - last_shadowcopy_update > 1*60*60*1000)
-				{
-					updateShadowCopyStarttime(save_id);
-					last_shadowcopy_update = Server->getTimeMS();
-				}
+			while (!pending.empty())
+			{
+				hasher.wait(pending.front());
+				release_job_buffers(fs.get(), pending.front());
+				delete pending.front();
+				pending.pop_front();
 			}
 
 			clientSend->doExit();
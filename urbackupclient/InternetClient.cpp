@@ -33,6 +33,7 @@
 #include "../urbackupcommon/InternetServicePipe2.h"
 #include "../urbackupcommon/internet_pipe_capabilities.h"
 #include "../urbackupcommon/CompressedPipe2.h"
+#include "../urbackupcommon/MultiplexPipe.h"
 
 #include "../stringtools.h"
 
@@ -64,6 +65,8 @@ const unsigned int ic_auth_timeout=10000;
 const unsigned int ic_ping_timeout=6*60*1000;
 const unsigned int ic_backup_running_ping_timeout=60*1000;
 const unsigned int ic_restore_ping_timeout = 60 * 1000;
+const int64 ic_mux_ping_interval = 60 * 1000;
+const int64 ic_mux_dead_timeout = 3 * ic_mux_ping_interval;
 const int ic_sleep_after_auth_errs=2;
 
 const char SERVICE_COMMANDS=0;
@@ -486,8 +489,8 @@ void InternetClient::setStatusMsg(const std::string& msg)
 	status_msg=msg;
 }
 
-InternetClientThread::InternetClientThread(IPipe *cs, const SServerSettings &server_settings)
-	: cs(cs), server_settings(server_settings)
+InternetClientThread::InternetClientThread(IPipe *cs, const SServerSettings &server_settings, bool mux_stream)
+	: cs(cs), server_settings(server_settings), mux_stream(mux_stream)
 {
 }
 
@@ -513,6 +516,13 @@ char *InternetClientThread::getReply(CTCPStack *tcpstack, IPipe *pipe, size_t &r
 
 void InternetClientThread::operator()(void)
 {
+	if(mux_stream)
+	{
+		runMultiplexedService();
+		delete this;
+		return;
+	}
+
 	CTCPStack tcpstack(true);
 	bool finish_ok=false;
 	bool rm_connection=true;
@@ -744,6 +754,9 @@ void InternetClientThread::operator()(void)
 		if(server_settings.internet_compress && server_capa & IPC_COMPRESSED )
 			capa|=IPC_COMPRESSED;
 
+		if(server_capa & IPC_MULTIPLEX)
+			capa|=IPC_MULTIPLEX;
+
 		data.addUInt(capa);
 
 		tcpstack.Send(ics_pipe, data);
@@ -765,6 +778,30 @@ void InternetClientThread::operator()(void)
 	finish_ok=true;
 	InternetClient::resetAuthErr();
 
+	if( capa & IPC_MULTIPLEX )
+	{
+		if(comp_pipe!=NULL)
+		{
+			static_cast<CompressedPipe2*>(comp_pipe)->destroyBackendPipeOnDelete(true);
+		}
+		if( capa & IPC_ENCRYPTED )
+		{
+			ics_pipe->destroyBackendPipeOnDelete(true);
+		}
+		else
+		{
+			delete ics_pipe;
+		}
+		destroy_cs=false;
+
+		MultiplexSession* mux=new MultiplexSession(comm_pipe, false, ic_mux_ping_interval, ic_mux_dead_timeout);
+		mux->start();
+		runMultiplexed(mux);
+		mux->shutdown();
+		mux->release();
+		goto cleanup;
+	}
+
 	while(true)
 	{
 		char *buf;
@@ -866,6 +903,74 @@ cleanup:
 	delete this;
 }
 
+void InternetClientThread::runMultiplexed(MultiplexSession* mux)
+{
+	Server->Log("Running services multiplexed over internet connection", LL_DEBUG);
+
+	IPipe *stream;
+	while((stream=mux->acceptStream(-1))!=NULL)
+	{
+		Server->getThreadPool()->execute(new InternetClientThread(stream, server_settings, true), "internet client stream");
+	}
+
+	Server->Log("Multiplexed internet connection closed", LL_DEBUG);
+}
+
+void InternetClientThread::runMultiplexedService()
+{
+	CTCPStack tcpstack(true);
+	char service=-1;
+
+	{
+		size_t bufsize;
+		char *buf=getReply(&tcpstack, cs, bufsize, ic_auth_timeout);
+		if(buf!=NULL)
+		{
+			CRData rd(buf, bufsize);
+			char id;
+			if(!rd.getChar(&id) || id!=ID_ISC_CONNECT
+				|| !rd.getChar(&service))
+			{
+				service=-1;
+			}
+			delete []buf;
+		}
+	}
+
+	bool destroy_stream=true;
+
+	if(service==SERVICE_COMMANDS || service==SERVICE_FILESRV)
+	{
+		CWData data;
+		data.addChar(ID_ISC_CONNECT_OK);
+		tcpstack.Send(cs, data);
+
+		if(service==SERVICE_COMMANDS)
+		{
+			Server->Log("Started connection to SERVICE_COMMANDS", LL_DEBUG);
+			ClientConnector clientservice;
+			runServiceWrapper(cs, &clientservice);
+			Server->Log("SERVICE_COMMANDS finished", LL_DEBUG);
+			destroy_stream=clientservice.closeSocket();
+		}
+		else
+		{
+			Server->Log("Started connection to SERVICE_FILESRV", LL_DEBUG);
+			IndexThread::getFileSrv()->runClient(cs, NULL);
+			Server->Log("SERVICE_FILESRV finished", LL_DEBUG);
+		}
+	}
+	else
+	{
+		Server->Log("Client service not found", LL_ERROR);
+	}
+
+	if(destroy_stream)
+	{
+		Server->destroy(cs);
+	}
+}
+
 void InternetClientThread::runServiceWrapper(IPipe *pipe, ICustomClient *client)
 {
 	client->Init(Server->getThreadID(), pipe, server_settings.servers[server_settings.selected_server].first);
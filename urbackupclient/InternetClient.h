@@ -12,6 +12,7 @@ class CTCPStack;
 class ICustomClient;
 class IScopedLock;
 class ICondition;
+class MultiplexSession;
 
 struct SServerSettings
 {
@@ -77,7 +78,7 @@ private:
 class InternetClientThread : public IThread
 {
 public:
-	InternetClientThread(IPipe *cs, const SServerSettings &server_settings);
+	InternetClientThread(IPipe *cs, const SServerSettings &server_settings, bool mux_stream=false);
 	void operator()(void);
 
 	char *getReply(CTCPStack *tcpstack, IPipe *pipe, size_t &replysize, unsigned int timeoutms);
@@ -87,6 +88,9 @@ public:
 private:
 	std::string generateRandomBinaryAuthKey(void);
 	void printInfo( IPipe * pipe );
+	void runMultiplexed(MultiplexSession* mux);
+	void runMultiplexedService();
 	IPipe *cs;
 	SServerSettings server_settings;
+	bool mux_stream;
 };
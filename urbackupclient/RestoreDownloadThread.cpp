@@ -17,6 +17,7 @@
 **************************************************************************/
 
 #include "RestoreDownloadThread.h"
+#include "FileMetadataDownloadThread.h"
 #include "../urbackupcommon/file_metadata.h"
 #include "../urbackupcommon/os_functions.h"
 #include "file_permissions.h"
@@ -29,10 +30,12 @@ namespace
 	const size_t queue_items_chunked = 4;
 }
 
-RestoreDownloadThread::RestoreDownloadThread( FileClient& fc, FileClientChunked& fc_chunked, const std::string& client_token, str_map& metadata_path_mapping)
+RestoreDownloadThread::RestoreDownloadThread( FileClient& fc, FileClientChunked& fc_chunked, const std::string& client_token, str_map& metadata_path_mapping,
+	bool inform_metadata_stream_end, client::FileMetadataDownloadThread* metadata_thread)
 	: fc(fc), fc_chunked(fc_chunked), queue_size(0), all_downloads_ok(true),
 	mutex(Server->createMutex()), cond(Server->createCondition()), skipping(false), is_offline(false),
-	client_token(client_token), metadata_path_mapping(metadata_path_mapping)
+	client_token(client_token), metadata_path_mapping(metadata_path_mapping),
+	inform_metadata_stream_end(inform_metadata_stream_end), metadata_thread(metadata_thread)
 {
 
 }
@@ -120,7 +123,7 @@ void RestoreDownloadThread::operator()()
 		}
 	}
 
-	if(!is_offline && !skipping)
+	if(!is_offline && !skipping && inform_metadata_stream_end)
 	{
 		_u32 rc = fc.InformMetadataStreamEnd(client_token, 3);
 
@@ -204,6 +207,7 @@ void RestoreDownloadThread::queueStop()
 bool RestoreDownloadThread::load_file( SQueueItem todl )
 {
 	std::auto_ptr<IFsFile> dest_f;
+	std::string orig_destfn = todl.destfn;
 	
     if(!todl.metadata_only)
 	{
@@ -273,6 +277,14 @@ bool RestoreDownloadThread::load_file( SQueueItem todl )
 		return false;
 	}
 
+	std::string final_destfn = dest_f.get()!=NULL ? dest_f->getFilename() : todl.destfn;
+	dest_f.reset();
+
+	if (metadata_thread != NULL)
+	{
+		metadata_thread->fileDone(orig_destfn, final_destfn);
+	}
+
 	return true;
 }
 
@@ -327,6 +339,7 @@ bool RestoreDownloadThread::load_file_patch( SQueueItem todl )
 	}
 
 	int64 fsize = todl.patch_dl_files.orig_file->Size();
+	std::string final_destfn = todl.patch_dl_files.orig_file->getFilename();
 
 	delete todl.patch_dl_files.orig_file;
 	todl.patch_dl_files.orig_file=NULL;
@@ -343,6 +356,11 @@ bool RestoreDownloadThread::load_file_patch( SQueueItem todl )
 		return false;
 	}
 
+	if (metadata_thread != NULL)
+	{
+		metadata_thread->fileDone(todl.destfn, final_destfn);
+	}
+
 	return true;
 }
 
@@ -487,3 +505,197 @@ bool RestoreDownloadThread::isRenamedFile(const std::string & fn)
 	return renamed_files.find(fn) != renamed_files.end();
 }
 
+
+size_t RestoreDownloadThread::getQueueSize()
+{
+	IScopedLock lock(mutex.get());
+	return queue_size;
+}
+
+ParallelRestoreDownload::ParallelRestoreDownload(FileClient& fc, FileClientChunked& fc_chunked, const std::string& client_token, str_map& metadata_path_mapping,
+	client::FileMetadataDownloadThread* metadata_thread)
+	: client_token(client_token), metadata_path_mapping(metadata_path_mapping), metadata_thread(metadata_thread), primary_stopped(false)
+{
+	SStream* primary = new SStream;
+	primary->fc = &fc;
+	primary->fc_chunked = &fc_chunked;
+	primary->thread = new RestoreDownloadThread(fc, fc_chunked, this->client_token, metadata_path_mapping, true, metadata_thread);
+	streams.push_back(primary);
+}
+
+ParallelRestoreDownload::~ParallelRestoreDownload()
+{
+	for (size_t i = 0; i < streams.size(); ++i)
+	{
+		delete streams[i]->thread;
+		if (i > 0)
+		{
+			delete streams[i]->fc_chunked;
+			delete streams[i]->fc;
+		}
+		delete streams[i];
+	}
+}
+
+void ParallelRestoreDownload::addStream(FileClient* fc, FileClientChunked* fc_chunked)
+{
+	SStream* stream = new SStream;
+	stream->fc = fc;
+	stream->fc_chunked = fc_chunked;
+	stream->thread = new RestoreDownloadThread(*fc, *fc_chunked, client_token, stream->metadata_path_mapping, false, metadata_thread);
+	streams.push_back(stream);
+}
+
+void ParallelRestoreDownload::start()
+{
+	for (size_t i = 0; i < streams.size(); ++i)
+	{
+		streams[i]->ticket = Server->getThreadPool()->execute(streams[i]->thread, "file restore download");
+	}
+}
+
+void ParallelRestoreDownload::addToQueueFull(size_t id, const std::string & remotefn, const std::string & destfn,
+	_i64 predicted_filesize, const FileMetadata & metadata, bool is_script, bool metadata_only, size_t folder_items, IFsFile * orig_file)
+{
+	RestoreDownloadThread* thread;
+	if (metadata_only)
+	{
+		thread = streams[0]->thread;
+	}
+	else
+	{
+		thread = leastLoadedStream();
+	}
+
+	thread->addToQueueFull(id, remotefn, destfn, predicted_filesize, metadata, is_script,
+		metadata_only, folder_items, orig_file);
+}
+
+void ParallelRestoreDownload::addToQueueChunked(size_t id, const std::string & remotefn, const std::string & destfn,
+	_i64 predicted_filesize, const FileMetadata & metadata, bool is_script, IFsFile * orig_file, IFile * chunkhashes)
+{
+	leastLoadedStream()->addToQueueChunked(id, remotefn, destfn, predicted_filesize,
+		metadata, is_script, orig_file, chunkhashes);
+}
+
+void ParallelRestoreDownload::queueStop()
+{
+	for (size_t i = 1; i < streams.size(); ++i)
+	{
+		streams[i]->thread->queueStop();
+	}
+
+	if (streams.size() == 1)
+	{
+		streams[0]->thread->queueStop();
+		primary_stopped = true;
+	}
+}
+
+bool ParallelRestoreDownload::waitForStop(int timeoutms)
+{
+	if (!primary_stopped)
+	{
+		std::vector<THREADPOOL_TICKET> tickets;
+		for (size_t i = 1; i < streams.size(); ++i)
+		{
+			tickets.push_back(streams[i]->ticket);
+		}
+
+		if (!Server->getThreadPool()->waitFor(tickets, timeoutms))
+		{
+			return false;
+		}
+
+		for (size_t i = 1; i < streams.size(); ++i)
+		{
+			metadata_path_mapping.insert(streams[i]->metadata_path_mapping.begin(),
+				streams[i]->metadata_path_mapping.end());
+		}
+
+		streams[0]->thread->queueStop();
+		primary_stopped = true;
+	}
+
+	return Server->getThreadPool()->waitFor(streams[0]->ticket, timeoutms);
+}
+
+bool ParallelRestoreDownload::hasError()
+{
+	for (size_t i = 0; i < streams.size(); ++i)
+	{
+		if (streams[i]->thread->hasError())
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+std::vector<std::pair<std::string, std::string> > ParallelRestoreDownload::getRenameQueue()
+{
+	std::vector<std::pair<std::string, std::string> > ret;
+	for (size_t i = 0; i < streams.size(); ++i)
+	{
+		std::vector<std::pair<std::string, std::string> > rename_queue = streams[i]->thread->getRenameQueue();
+		ret.insert(ret.end(), rename_queue.begin(), rename_queue.end());
+	}
+	return ret;
+}
+
+bool ParallelRestoreDownload::isRenamedFile(const std::string & fn)
+{
+	for (size_t i = 0; i < streams.size(); ++i)
+	{
+		if (streams[i]->thread->isRenamedFile(fn))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+_i64 ParallelRestoreDownload::getReceivedDataBytes(bool with_sparse)
+{
+	_i64 ret = 0;
+	for (size_t i = 0; i < streams.size(); ++i)
+	{
+		ret += streams[i]->fc->getReceivedDataBytes(with_sparse)
+			+ streams[i]->fc_chunked->getReceivedDataBytes(with_sparse);
+	}
+	return ret;
+}
+
+_i64 ParallelRestoreDownload::getTransferredBytes()
+{
+	_i64 ret = 0;
+	for (size_t i = 0; i < streams.size(); ++i)
+	{
+		ret += streams[i]->fc->getTransferredBytes()
+			+ streams[i]->fc_chunked->getTransferredBytes();
+	}
+	return ret;
+}
+
+size_t ParallelRestoreDownload::numStreams()
+{
+	return streams.size();
+}
+
+RestoreDownloadThread* ParallelRestoreDownload::leastLoadedStream()
+{
+	RestoreDownloadThread* ret = streams[0]->thread;
+	size_t min_queue_size = ret->getQueueSize();
+
+	for (size_t i = 1; i < streams.size() && min_queue_size>0; ++i)
+	{
+		size_t queue_size = streams[i]->thread->getQueueSize();
+		if (queue_size < min_queue_size)
+		{
+			min_queue_size = queue_size;
+			ret = streams[i]->thread;
+		}
+	}
+
+	return ret;
+}
@@ -5,8 +5,15 @@
 #include "../Interface/Mutex.h"
 #include "../Interface/Condition.h"
 #include "../urbackupcommon/file_metadata.h"
+#include "../Interface/ThreadPool.h"
 #include <memory>
 #include <set>
+#include <vector>
+
+namespace client
+{
+	class FileMetadataDownloadThread;
+}
 
 namespace
 {
@@ -59,7 +66,8 @@ namespace
 class RestoreDownloadThread : public IThread, public FileClient::QueueCallback, public FileClientChunked::QueueCallback
 {
 public:
-	RestoreDownloadThread(FileClient& fc, FileClientChunked& fc_chunked, const std::string& client_token, str_map& metadata_path_mapping);
+	RestoreDownloadThread(FileClient& fc, FileClientChunked& fc_chunked, const std::string& client_token, str_map& metadata_path_mapping,
+		bool inform_metadata_stream_end, client::FileMetadataDownloadThread* metadata_thread);
 
 	void operator()();
 
@@ -95,6 +103,8 @@ public:
 
 	bool isRenamedFile(const std::string& fn);
 
+	size_t getQueueSize();
+
 private:
 
 	void sleepQueue(IScopedLock& lock);
@@ -119,4 +129,71 @@ private:
 	std::vector<std::pair<std::string, std::string> > rename_queue;
 	str_map& metadata_path_mapping;
 	std::set<std::string> renamed_files;
+
+	bool inform_metadata_stream_end;
+	client::FileMetadataDownloadThread* metadata_thread;
+};
+
+/**
+* Distributes the restore queue over multiple RestoreDownloadThreads, each
+* with its own fileserv connection. Directory metadata items stay on the
+* primary stream in list order. The primary stream is stopped last, so it
+* can inform the server about the end of the metadata stream once all files
+* are downloaded.
+*/
+class ParallelRestoreDownload
+{
+public:
+	ParallelRestoreDownload(FileClient& fc, FileClientChunked& fc_chunked, const std::string& client_token, str_map& metadata_path_mapping,
+		client::FileMetadataDownloadThread* metadata_thread);
+	~ParallelRestoreDownload();
+
+	void addStream(FileClient* fc, FileClientChunked* fc_chunked);
+
+	void start();
+
+	void addToQueueFull(size_t id, const std::string &remotefn, const std::string &destfn,
+		_i64 predicted_filesize, const FileMetadata& metadata, bool is_script, bool metadata_only, size_t folder_items, IFsFile* orig_file);
+
+	void addToQueueChunked(size_t id, const std::string &remotefn, const std::string &destfn,
+		_i64 predicted_filesize, const FileMetadata& metadata, bool is_script, IFsFile* orig_file, IFile* chunkhashes);
+
+	void queueStop();
+
+	bool waitForStop(int timeoutms);
+
+	bool hasError();
+
+	std::vector<std::pair<std::string, std::string> > getRenameQueue();
+
+	bool isRenamedFile(const std::string& fn);
+
+	_i64 getReceivedDataBytes(bool with_sparse);
+
+	_i64 getTransferredBytes();
+
+	size_t numStreams();
+
+private:
+	struct SStream
+	{
+		SStream()
+			: fc(NULL), fc_chunked(NULL), thread(NULL), ticket(ILLEGAL_THREADPOOL_TICKET)
+		{
+		}
+
+		FileClient* fc;
+		FileClientChunked* fc_chunked;
+		RestoreDownloadThread* thread;
+		THREADPOOL_TICKET ticket;
+		str_map metadata_path_mapping;
+	};
+
+	RestoreDownloadThread* leastLoadedStream();
+
+	std::string client_token;
+	str_map& metadata_path_mapping;
+	client::FileMetadataDownloadThread* metadata_thread;
+	std::vector<SStream*> streams;
+	bool primary_stopped;
 };
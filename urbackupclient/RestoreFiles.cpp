@@ -47,6 +47,57 @@ namespace
 	const int64 restore_flag_open_all_files_first = 1 << 4;
 	const int64 restore_flag_reboot_overwrite_all = 1 << 5;
 	const int64 restore_flag_ignore_permissions = 1 << 6;
+	const int64 restore_flag_parallel_download = 1 << 7;
+	const int64 restore_flag_local_copy = 1 << 8;
+
+	const size_t restore_parallel_download_streams = 4;
+
+	const int64 local_copy_min_size = 64 * 1024;
+	const size_t local_copy_max_locations = 4;
+
+	std::string restore_file_hash(str_map& extra)
+	{
+		str_map::iterator it = extra.find("shahash");
+		if (it != extra.end())
+		{
+			return base64_decode_dash(it->second);
+		}
+
+		return base64_decode_dash(extra["thash"]);
+	}
+
+	std::string local_path_key(const std::string& path)
+	{
+#ifdef _WIN32
+		return strlower(path);
+#else
+		return path;
+#endif
+	}
+
+	//Directory names in the files table end with a separator
+	std::string local_dir_key(const std::string& path)
+	{
+		if (!path.empty()
+			&& path[path.size() - 1] == os_file_sep()[0])
+		{
+			return local_path_key(path);
+		}
+		return local_path_key(path + os_file_sep());
+	}
+
+	bool in_other_dir(const std::set<std::string>& dirs, const std::string& dir)
+	{
+		for (std::set<std::string>::const_iterator it = dirs.begin(); it != dirs.end(); ++it)
+		{
+			if (*it != dir
+				&& next(dir, 0, *it))
+			{
+				return true;
+			}
+		}
+		return false;
+	}
 
 	class RestoreUpdaterThread : public IThread
 	{
@@ -412,7 +463,7 @@ void RestoreFiles::operator()()
 
 		restore_updater.update_pc(0, total_size, 0);
 
-		if (!downloadFiles(fc, total_size, restore_updater, open_files))
+		if (!downloadFiles(fc, total_size, restore_updater, open_files, metadata_thread.get()))
 		{
 			restore_failed(*metadata_thread.get(), metadata_dl);
 			is_offline = true;
@@ -950,7 +1001,8 @@ bool RestoreFiles::openFiles(std::map<std::string, IFsFile*>& open_files, bool&
 }
 
 bool RestoreFiles::downloadFiles(FileClient& fc, int64 total_size, ScopedRestoreUpdater& restore_updater,
-	std::map<std::string, IFsFile*>& open_files)
+	std::map<std::string, IFsFile*>& open_files,
+	client::FileMetadataDownloadThread* metadata_thread)
 {
 	std::vector<char> buffer;
 	buffer.resize(32768);
@@ -977,8 +1029,36 @@ bool RestoreFiles::downloadFiles(FileClient& fc, int64 total_size, ScopedRestore
 	std::string share_path;
 	std::string server_path = "clientdl";
 
-	std::auto_ptr<RestoreDownloadThread> restore_download(new RestoreDownloadThread(fc, *fc_chunked, client_token, metadata_path_mapping));
-    THREADPOOL_TICKET restore_download_ticket = Server->getThreadPool()->execute(restore_download.get(), "file restore download");
+	std::auto_ptr<ParallelRestoreDownload> restore_download(new ParallelRestoreDownload(fc, *fc_chunked, client_token, metadata_path_mapping, metadata_thread));
+
+	if (restore_flags & restore_flag_parallel_download)
+	{
+		while (restore_download->numStreams() < restore_parallel_download_streams)
+		{
+			std::auto_ptr<FileClient> stream_fc(new FileClient(false, client_token, 3, true, this, NULL));
+			if (!connectFileClient(*stream_fc))
+			{
+				log("Connecting additional restore download stream failed. Continuing with " + convert(restore_download->numStreams()) + " streams.", LL_WARNING);
+				break;
+			}
+
+			std::auto_ptr<FileClientChunked> stream_fc_chunked = createFcChunked();
+			if (stream_fc_chunked.get() == NULL)
+			{
+				log("Connecting additional restore download stream failed. Continuing with " + convert(restore_download->numStreams()) + " streams.", LL_WARNING);
+				break;
+			}
+
+			stream_fc->setProgressLogCallback(this);
+			stream_fc_chunked->setProgressLogCallback(this);
+
+			restore_download->addStream(stream_fc.release(), stream_fc_chunked.release());
+		}
+
+		log("Downloading files using " + convert(restore_download->numStreams()) + " parallel streams", LL_DEBUG);
+	}
+
+	restore_download->start();
 
 	std::string curr_files_dir;
 	std::vector<SFileAndHash> curr_files;
@@ -1009,6 +1089,11 @@ bool RestoreFiles::downloadFiles(FileClient& fc, int64 total_size, ScopedRestore
 	size_t skip_dir = std::string::npos;
 	bool skip_last_dir = false;
 
+	if (restore_flags & restore_flag_local_copy)
+	{
+		collectLocalFiles(client_dao);
+	}
+
 	do 
 	{
 		read = filelist->Read(buffer.data(), static_cast<_u32>(buffer.size()));
@@ -1126,12 +1211,12 @@ bool RestoreFiles::downloadFiles(FileClient& fc, int64 total_size, ScopedRestore
 					}
 					else
 					{
-						int64 done_bytes = fc.getReceivedDataBytes(true) + fc_chunked->getReceivedDataBytes(true) + skipped_bytes;
+						int64 done_bytes = restore_download->getReceivedDataBytes(true) + skipped_bytes;
 						int pcdone = (std::min)(100,(int)(((float)done_bytes)/((float)total_size/100.f)+0.5f));
 						restore_updater.update_pc(pcdone, total_size, done_bytes);
 					}
 
-					calculateDownloadSpeed(fc, fc_chunked.get());
+					calculateDownloadSpeed(*restore_download);
 				}
 
 				if(!data.isdir || data.name!="..")
@@ -1632,7 +1717,20 @@ bool RestoreFiles::downloadFiles(FileClient& fc, int64 total_size, ScopedRestore
 								}
 
                                 bool calc_hashes=false;
-								if(shahash.empty())
+								std::string restore_hash = base64_decode_dash(extra[hash_key]);
+
+								bool copied_local = false;
+								bool copy_error = false;
+								if (shahash != restore_hash
+									&& (restore_flags & restore_flag_local_copy)
+									&& hasLocalCopy(restore_hash, data.size))
+								{
+									copied_local = copyLocalFile(restore_hash, hash_key == "thash", data.size, local_fn, orig_file.get(), copy_error);
+								}
+
+								if(shahash.empty()
+									&& !copied_local
+									&& !copy_error)
 								{
 									log("Calculating hashes of file \""+local_fn+"\"...", LL_DEBUG);
 									FsExtentIterator extent_iterator(orig_file.get(), 512*1024);
@@ -1657,8 +1755,30 @@ bool RestoreFiles::downloadFiles(FileClient& fc, int64 total_size, ScopedRestore
 										assert(shahash == hashf2->finalize());
 									}
 								}
-								
-								if(shahash!=base64_decode_dash(extra[hash_key]))
+
+								if (copy_error)
+								{
+									//The file was partially overwritten, so its content
+									//cannot be used for a chunked download
+									log("Downloading file \"" + local_fn + "\" completely after copying the local file with the same content failed", LL_WARNING);
+
+									if (!orig_file->Resize(0, false))
+									{
+										log("Cannot truncate file \"" + local_fn + "\" to zero bytes. " + os_last_error_str(), LL_ERROR);
+										has_error = true;
+									}
+									else
+									{
+										restore_download->addToQueueFull(line, server_fn, local_fn,
+											data.size, metadata, false, false, 0, orig_file.release());
+									}
+
+									std::string tmpfn = chunkhashes->getFilename();
+									delete chunkhashes;
+									Server->deleteFile(tmpfn);
+								}
+								else if(shahash!=restore_hash
+									&& !copied_local)
 								{
                                     if(!calc_hashes)
                                     {
@@ -1682,6 +1802,8 @@ bool RestoreFiles::downloadFiles(FileClient& fc, int64 total_size, ScopedRestore
 										}
                                     }
 
+									restore_written_files.insert(local_path_key(local_fn));
+
 									IFsFile* r_orig_file = orig_file.release();
 									restore_download->addToQueueChunked(line, server_fn, local_fn, 
 										data.size, metadata, false, r_orig_file, chunkhashes);
@@ -1742,8 +1864,32 @@ bool RestoreFiles::downloadFiles(FileClient& fc, int64 total_size, ScopedRestore
 						}
 						else
 						{
-							restore_download->addToQueueFull(line, server_fn, local_fn,
-								data.size, metadata, false, false, 0, orig_file);
+							bool copied_local = false;
+							if (restore_flags & restore_flag_local_copy)
+							{
+								bool copy_error = false;
+								copied_local = copyLocalFile(restore_file_hash(extra), extra.find("shahash") == extra.end(),
+									data.size, local_fn, orig_file, copy_error);
+								if (copy_error)
+								{
+									log("Downloading file \"" + local_fn + "\" completely after copying the local file with the same content failed", LL_WARNING);
+								}
+							}
+
+							if (copied_local)
+							{
+								skipped_bytes += data.size;
+
+								restore_download->addToQueueFull(line, server_fn, local_fn,
+									data.size, metadata, false, true, 0, NULL);
+							}
+							else
+							{
+								restore_written_files.insert(local_path_key(local_fn));
+
+								restore_download->addToQueueFull(line, server_fn, local_fn,
+									data.size, metadata, false, false, 0, orig_file);
+							}
 						}
 					}
 				}
@@ -1778,7 +1924,7 @@ bool RestoreFiles::downloadFiles(FileClient& fc, int64 total_size, ScopedRestore
 
     restore_download->queueStop();
 
-    while(!Server->getThreadPool()->waitFor(restore_download_ticket, 1000))
+    while(!restore_download->waitForStop(1000))
     {
         if(total_size==0)
         {
@@ -1786,12 +1932,12 @@ bool RestoreFiles::downloadFiles(FileClient& fc, int64 total_size, ScopedRestore
         }
         else
         {
-			int64 done_bytes = fc.getReceivedDataBytes(true) + fc_chunked->getReceivedDataBytes(true) + skipped_bytes;
+			int64 done_bytes = restore_download->getReceivedDataBytes(true) + skipped_bytes;
             int pcdone = (std::min)(100,(int)(((float)done_bytes)/((float)total_size/100.f)+0.5f));
 			restore_updater.update_pc(pcdone, total_size, done_bytes);
         }
 
-		calculateDownloadSpeed(fc, fc_chunked.get());
+		calculateDownloadSpeed(*restore_download);
     }
 
 #ifdef _WIN32
@@ -1889,7 +2035,7 @@ void RestoreFiles::restore_failed(client::FileMetadataDownloadThread& metadata_t
 	ClientConnector::restoreDone(log_id, status_id, restore_id, false, server_token);
 }
 
-bool RestoreFiles::removeFiles( std::string restore_path, std::string share_path, RestoreDownloadThread* restore_download,
+bool RestoreFiles::removeFiles( std::string restore_path, std::string share_path, ParallelRestoreDownload* restore_download,
 	std::stack<std::vector<std::string> > &folder_files, std::vector<std::string> &deletion_queue, bool& has_include_exclude,
 	const std::vector<int64>& tids, ClientDAO* clientdao, tokens::TokenCache& cache)
 {
@@ -2087,7 +2233,7 @@ bool RestoreFiles::renameFilesOnRestart( std::vector<std::pair<std::string, std:
 #endif
 }
 
-void RestoreFiles::calculateDownloadSpeed(FileClient & fc, FileClientChunked * fc_chunked)
+void RestoreFiles::calculateDownloadSpeed(ParallelRestoreDownload& restore_download)
 {
 	int64 ctime = Server->getTimeMS();
 	if (speed_set_time == 0)
@@ -2097,7 +2243,7 @@ void RestoreFiles::calculateDownloadSpeed(FileClient & fc, FileClientChunked * f
 
 	if (ctime - speed_set_time>10000)
 	{
-		int64 received_data_bytes = fc.getTransferredBytes() + (fc_chunked != NULL ? fc_chunked->getTransferredBytes() : 0);
+		int64 received_data_bytes = restore_download.getTransferredBytes();
 
 		int64 new_bytes = received_data_bytes - last_speed_received_bytes;
 		int64 passed_time = ctime - speed_set_time;
@@ -2203,3 +2349,296 @@ std::pair<IFile*, int64> RestoreFiles::getCbtHashFile(const std::string & fn)
 		return std::make_pair(nf, -1);
 	}
 }
+
+void RestoreFiles::collectLocalFiles(ClientDAO& client_dao)
+{
+	std::vector<char> buffer;
+	buffer.resize(32768);
+
+	FileListParser filelist_parser;
+
+	_u32 read;
+	SFile data;
+	std::map<std::string, std::string> extra;
+
+	std::set<std::string> hashes;
+	std::set<std::string> root_dirs;
+	std::set<std::string> root_file_dirs;
+	size_t depth = 0;
+
+	filelist->Seek(0);
+
+	do
+	{
+		read = filelist->Read(buffer.data(), static_cast<_u32>(buffer.size()));
+
+		for (_u32 i = 0; i<read; ++i)
+		{
+			if (filelist_parser.nextEntry(buffer[i], data, &extra))
+			{
+				if (data.isdir
+					&& data.name == "..")
+				{
+					if (depth > 0)
+					{
+						--depth;
+					}
+					continue;
+				}
+
+				if (depth == 0)
+				{
+					//Only the directories restored to are searched
+					FileMetadata metadata;
+					metadata.read(extra);
+					if (!metadata.orig_path.empty())
+					{
+						if (data.isdir)
+						{
+							root_dirs.insert(local_dir_key(metadata.orig_path));
+						}
+						else
+						{
+							root_file_dirs.insert(local_dir_key(ExtractFilePath(metadata.orig_path, os_file_sep())));
+						}
+					}
+				}
+
+				if (data.isdir)
+				{
+					++depth;
+				}
+				else if (data.size >= local_copy_min_size)
+				{
+					std::string hash = restore_file_hash(extra);
+					if (!hash.empty())
+					{
+						hashes.insert(hash);
+					}
+				}
+			}
+		}
+
+	} while (read>0);
+
+	filelist->Seek(0);
+
+	log("Searching for local files with the same content as " + convert(hashes.size()) + " files to restore...", LL_INFO);
+
+	for (std::set<std::string>::iterator it = root_dirs.begin(); it != root_dirs.end(); ++it)
+	{
+		if (!in_other_dir(root_dirs, *it))
+		{
+			client_dao.getFileLocations(*it, true, hashes, local_copy_max_locations, local_file_locations);
+		}
+	}
+
+	for (std::set<std::string>::iterator it = root_file_dirs.begin(); it != root_file_dirs.end(); ++it)
+	{
+		if (root_dirs.find(*it) == root_dirs.end()
+			&& !in_other_dir(root_dirs, *it))
+		{
+			client_dao.getFileLocations(*it, false, hashes, local_copy_max_locations, local_file_locations);
+		}
+	}
+
+	log("Found local files with the same content for " + convert(local_file_locations.size()) + " files to restore", LL_INFO);
+}
+
+bool RestoreFiles::hasLocalCopy(const std::string & hash, int64 size)
+{
+	return size >= local_copy_min_size
+		&& local_file_locations.find(hash) != local_file_locations.end();
+}
+
+bool RestoreFiles::copyLocalFile(const std::string & hash, bool tree_hash, int64 size, const std::string & local_fn, IFsFile * dst_file, bool& copy_error)
+{
+	if (size < local_copy_min_size)
+	{
+		return false;
+	}
+
+	std::map<std::string, std::vector<SFileLocation> >::iterator it = local_file_locations.find(hash);
+	if (it == local_file_locations.end())
+	{
+		return false;
+	}
+
+	std::string local_key = local_path_key(local_fn);
+
+	for (size_t i = 0; i < it->second.size(); ++i)
+	{
+		SFileLocation& location = it->second[i];
+		std::string location_key = local_path_key(location.path);
+
+		if (location.size != size
+			|| location_key == local_key
+			|| restore_written_files.find(location_key) != restore_written_files.end())
+		{
+			continue;
+		}
+
+		//The cached hash is only valid if the file did not change since it was indexed
+		SFile metadata = getFileMetadataWin(location.path, true);
+		uint64 change_indicator = metadata.last_modified;
+		if (metadata.usn != 0)
+		{
+			change_indicator = metadata.usn;
+		}
+
+		if (metadata.name.empty()
+			|| metadata.isdir
+			|| metadata.size != size
+			|| change_indicator != location.change_indicator)
+		{
+			continue;
+		}
+
+		std::auto_ptr<IFile> src(Server->openFile(os_file_prefix(location.path), MODE_READ_SEQUENTIAL));
+		if (src.get() == NULL)
+		{
+			continue;
+		}
+
+		std::auto_ptr<IHashFunc> hashf;
+		if (tree_hash)
+		{
+			hashf.reset(new TreeHash(NULL));
+		}
+		else
+		{
+			hashf.reset(new HashSha512);
+		}
+
+#ifndef _WIN32
+		if (dst_file == NULL
+			&& local_reflink)
+		{
+			if (!copyFileData(src.get(), NULL, size, hashf.get())
+				|| hashf->finalize() != hash)
+			{
+				log("Local file \"" + location.path + "\" does not have the expected content", LL_DEBUG);
+				continue;
+			}
+
+			if (os_create_reflink(os_file_prefix(local_fn), os_file_prefix(location.path)))
+			{
+				log("Reflinked \"" + local_fn + "\" from local file \"" + location.path + "\" with the same content", LL_DEBUG);
+				restore_written_files.insert(local_key);
+				return true;
+			}
+
+			log("Reflinking local files failed. Copying local files with the same content instead.", LL_DEBUG);
+			local_reflink = false;
+
+			if (!src->Seek(0))
+			{
+				continue;
+			}
+
+			if (tree_hash)
+			{
+				hashf.reset(new TreeHash(NULL));
+			}
+			else
+			{
+				hashf.reset(new HashSha512);
+			}
+		}
+#endif
+
+		std::auto_ptr<IFsFile> new_dst;
+		IFsFile* dst = dst_file;
+		if (dst == NULL)
+		{
+			new_dst.reset(Server->openFile(os_file_prefix(local_fn), MODE_RW_CREATE_RESTORE));
+			dst = new_dst.get();
+
+			if (dst == NULL)
+			{
+				return false;
+			}
+		}
+
+		restore_written_files.insert(local_key);
+
+		if (!copyFileData(src.get(), dst, size, hashf.get()))
+		{
+			log("Error copying local file \"" + location.path + "\" with the same content to \"" + local_fn + "\". " + os_last_error_str(), LL_ERROR);
+			copy_error = true;
+			return false;
+		}
+
+		//The directory cache can be out of date if the change indicator did not change
+		if (hashf->finalize() != hash)
+		{
+			log("Local file \"" + location.path + "\" copied to \"" + local_fn + "\" does not have the expected content", LL_DEBUG);
+			copy_error = true;
+			continue;
+		}
+
+		copy_error = false;
+		log("Copied \"" + local_fn + "\" from local file \"" + location.path + "\" with the same content", LL_DEBUG);
+		return true;
+	}
+
+	return false;
+}
+
+bool RestoreFiles::copyFileData(IFile * src, IFsFile * dst, int64 size, IHashFunc* hashf)
+{
+	if (dst != NULL
+		&& !dst->Seek(0))
+	{
+		return false;
+	}
+
+	std::vector<char> buffer;
+	buffer.resize(512 * 1024);
+
+	int64 copied = 0;
+	while (copied < size)
+	{
+		_u32 toread = static_cast<_u32>((std::min)(size - copied, static_cast<int64>(buffer.size())));
+
+		//The tree hash needs full blocks
+		bool has_read_error = false;
+		_u32 read = src->Read(buffer.data(), toread, &has_read_error);
+		if (has_read_error || read != toread)
+		{
+			return false;
+		}
+
+		hashf->hash(buffer.data(), read);
+
+		if (dst == NULL)
+		{
+			copied += read;
+			continue;
+		}
+
+		_u32 written = 0;
+		while (written < read)
+		{
+			bool has_write_error = false;
+			_u32 w = dst->Write(buffer.data() + written, read - written, &has_write_error);
+			if (has_write_error || w == 0)
+			{
+				return false;
+			}
+			written += w;
+		}
+
+		copied += read;
+	}
+
+	if (dst != NULL
+		&& dst->Size() > size
+		&& !dst->Resize(size, false))
+	{
+		return false;
+	}
+
+	return true;
+}
+
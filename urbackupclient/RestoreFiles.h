@@ -10,8 +10,10 @@
 #include "client.h"
 #include <memory>
 #include <stack>
+#include <set>
 
-class RestoreDownloadThread;
+class ParallelRestoreDownload;
+class IHashFunc;
 
 namespace
 {
@@ -33,7 +35,7 @@ public:
 		client_token(client_token), server_token(server_token), tcpstack(true), filelist_del(NULL), filelist(NULL),
 		log_id(log_id), restore_path(restore_path), single_file(single_file), restore_declined(false), curr_restore_updater(NULL),
 		clean_other(clean_other), ignore_other_fs(ignore_other_fs), restore_flags(restore_flags), last_speed_received_bytes(0), speed_set_time(0),
-		tgroup(tgroup), clientsubname(clientsubname), request_restart(false), is_offline(false)
+		tgroup(tgroup), clientsubname(clientsubname), request_restart(false), is_offline(false), local_reflink(true)
 	{
 
 	}
@@ -79,9 +81,10 @@ private:
 
 	bool openFiles(std::map<std::string, IFsFile*>& open_files, bool& overwrite_failure);
 
-	bool downloadFiles(FileClient& fc, int64 total_size, ScopedRestoreUpdater& restore_updater, std::map<std::string, IFsFile*>& open_files);
+	bool downloadFiles(FileClient& fc, int64 total_size, ScopedRestoreUpdater& restore_updater, std::map<std::string, IFsFile*>& open_files,
+		client::FileMetadataDownloadThread* metadata_thread);
 
-	bool removeFiles( std::string restore_path, std::string share_path, RestoreDownloadThread* restore_download, 
+	bool removeFiles( std::string restore_path, std::string share_path, ParallelRestoreDownload* restore_download, 
 		std::stack<std::vector<std::string> > &folder_files, std::vector<std::string> &deletion_queue, bool& has_include_exclude,
 		const std::vector<int64>& tids, ClientDAO* clientdao, tokens::TokenCache& cache);
 
@@ -95,12 +98,20 @@ private:
 
 	std::auto_ptr<FileClientChunked> createFcChunked();
 
-	void calculateDownloadSpeed(FileClient & fc, FileClientChunked * fc_chunked);
+	void calculateDownloadSpeed(ParallelRestoreDownload& restore_download);
 
 	bool createDirectoryWin(const std::string& dir);
 
 	std::pair<IFile*, int64> getCbtHashFile(const std::string& fn);
 
+	void collectLocalFiles(ClientDAO& client_dao);
+
+	bool hasLocalCopy(const std::string& hash, int64 size);
+
+	bool copyLocalFile(const std::string& hash, bool tree_hash, int64 size, const std::string& local_fn, IFsFile* dst_file, bool& copy_error);
+
+	bool copyFileData(IFile* src, IFsFile* dst, int64 size, IHashFunc* hashf);
+
 	int64 local_process_id;
 
 	int64 restore_id;
@@ -144,4 +155,8 @@ private:
 	bool is_offline;
 
 	std::map<std::string, std::pair<IFile*, int64> > cbt_hash_files;
+
+	std::map<std::string, std::vector<SFileLocation> > local_file_locations;
+	std::set<std::string> restore_written_files;
+	bool local_reflink;
 };
\ No newline at end of file
@@ -19,6 +19,7 @@
 #include "clientdao.h"
 #include "../stringtools.h"
 #include "../Interface/Server.h"
+#include "../Interface/DatabaseCursor.h"
 #include <memory.h>
 
 const int ClientDAO::c_is_group = 0;
@@ -61,6 +62,7 @@ void ClientDAO::prepareQueries()
 	q_get_pattern=db->Prepare("SELECT tvalue FROM misc WHERE tkey=?", false);
 	q_insert_pattern=db->Prepare("INSERT INTO misc (tkey, tvalue) VALUES (?, ?)", false);
 	q_update_pattern=db->Prepare("UPDATE misc SET tvalue=? WHERE tkey=?", false);
+	q_get_files_glob=db->Prepare("SELECT name, data, num FROM files WHERE name GLOB ?", false);
 	prepareQueriesGen();
 }
 
@@ -89,6 +91,7 @@ void ClientDAO::destroyQueries(void)
 	db->destroyQuery(q_get_pattern);
 	db->destroyQuery(q_insert_pattern);
 	db->destroyQuery(q_update_pattern);
+	db->destroyQuery(q_get_files_glob);
 	destroyQueriesGen();
 }
 
@@ -175,12 +178,62 @@ bool ClientDAO::getFiles(std::string path, int tgroup, std::vector<SFileAndHash>
 
 	generation = watoi64(res[0]["generation"]);
 
-	std::string &qdata=res[0]["data"];
+	parseFiles(res[0]["data"], watoi(res[0]["num"]), data);
 
+	return true;
+}
+
+void ClientDAO::getFileLocations(const std::string& dir, bool recursive, const std::set<std::string>& hashes, size_t max_per_hash, std::map<std::string, std::vector<SFileLocation> >& locations)
+{
+	if (hashes.empty())
+	{
+		return;
+	}
+
+	q_get_files_glob->Bind(escapeGlob(dir) + (recursive ? "*" : ""));
+
+	{
+		ScopedDatabaseCursor cur(q_get_files_glob->Cursor());
+
+		db_single_result res;
+		std::vector<SFileAndHash> files;
+		while (cur.next(res))
+		{
+			files.clear();
+			parseFiles(res["data"], watoi(res["num"]), files);
+
+			for (size_t i = 0; i < files.size(); ++i)
+			{
+				if (files[i].isdir
+					|| files[i].issym
+					|| files[i].isspecialf
+					|| files[i].hash.empty()
+					|| hashes.find(files[i].hash) == hashes.end())
+				{
+					continue;
+				}
+
+				std::vector<SFileLocation>& curr_locations = locations[files[i].hash];
+				if (curr_locations.size() < max_per_hash)
+				{
+					SFileLocation location;
+					location.path = res["name"] + files[i].name;
+					location.size = files[i].size;
+					location.change_indicator = files[i].change_indicator;
+					curr_locations.push_back(location);
+				}
+			}
+		}
+	}
+
+	q_get_files_glob->Reset();
+}
+
+void ClientDAO::parseFiles(std::string &qdata, int num, std::vector<SFileAndHash> &data)
+{
 	if(qdata.empty())
-		return true;
+		return;
 
-	int num=watoi(res[0]["num"]);
 	char *ptr=(char*)&qdata[0];
 	while(ptr-(char*)&qdata[0]<num)
 	{
@@ -240,7 +293,6 @@ bool ClientDAO::getFiles(std::string path, int tgroup, std::vector<SFileAndHash>
 
 		data.push_back(f);
 	}
-	return true;
 }
 
 char * constructData(const std::vector<SFileAndHash> &data, size_t &datasize)
@@ -4,6 +4,8 @@
 #include "../Interface/Query.h"
 #include "../urbackupcommon/os_functions.h"
 #include <vector>
+#include <map>
+#include <set>
 #include <memory.h>
 
 #ifndef GUID_DEFINED
@@ -104,6 +106,13 @@ struct SFileAndHash
 	}
 };
 
+struct SFileLocation
+{
+	std::string path;
+	int64 size;
+	uint64 change_indicator;
+};
+
 class ClientDAO
 {
 public:
@@ -122,6 +131,8 @@ public:
 
 	bool getFiles(std::string path, int tgroup, std::vector<SFileAndHash> &data, int64& generation);
 
+	void getFileLocations(const std::string& dir, bool recursive, const std::set<std::string>& hashes, size_t max_per_hash, std::map<std::string, std::vector<SFileLocation> >& locations);
+
 	void addFiles(std::string path, int tgroup, const std::vector<SFileAndHash> &data);
 	void modifyFiles(std::string path, int tgroup, const std::vector<SFileAndHash> &data, int64 target_generation);
 	bool hasFiles(std::string path, int tgroup);
@@ -197,6 +208,8 @@ public:
 	static std::string escapeGlob(const std::string& input);
 
 private:
+
+	static void parseFiles(std::string &qdata, int num, std::vector<SFileAndHash> &data);
 	
 
 	IDatabase *db;
@@ -224,6 +237,7 @@ private:
 	IQuery *q_get_pattern;
 	IQuery *q_insert_pattern;
 	IQuery *q_update_pattern;
+	IQuery *q_get_files_glob;
 
 	//@-SQLGenVariablesBegin
 	IQuery* q_updateShadowCopyStarttime;
@@ -0,0 +1,729 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "MultiplexPipe.h"
+#include "../Interface/Server.h"
+#include "../Interface/Mutex.h"
+#include "../Interface/Condition.h"
+#include "../Interface/Thread.h"
+#include "../Interface/ThreadPool.h"
+#include "../Interface/PipeThrottler.h"
+#include "../stringtools.h"
+#include <memory.h>
+#include <algorithm>
+
+namespace
+{
+	const char MUX_DATA=0;
+	const char MUX_OPEN=1;
+	const char MUX_CLOSE=2;
+	const char MUX_WINDOW=3;
+	const char MUX_PING=4;
+	const char MUX_PONG=5;
+
+	const size_t c_header_size=1+2*sizeof(unsigned int);
+	const size_t c_max_frame_size=32*1024;
+	const int64 c_stream_window=512*1024;
+	const int c_receive_wait=1000;
+
+	std::string encodeUInt(unsigned int v)
+	{
+		v=little_endian(v);
+		return std::string(reinterpret_cast<char*>(&v), sizeof(v));
+	}
+
+	unsigned int decodeUInt(const char* data)
+	{
+		unsigned int v;
+		memcpy(&v, data, sizeof(v));
+		return little_endian(v);
+	}
+}
+
+class MultiplexSessionThread : public IThread
+{
+public:
+	MultiplexSessionThread(MultiplexSession* session, bool sender)
+		: session(session), sender(sender)
+	{
+	}
+
+	void operator()()
+	{
+		if(sender)
+		{
+			session->runSend();
+		}
+		else
+		{
+			session->runReceive();
+		}
+		session->release();
+		delete this;
+	}
+
+private:
+	MultiplexSession* session;
+	bool sender;
+};
+
+MultiplexSession::MultiplexSession(IPipe* backend, bool initiator, int64 ping_interval, int64 dead_timeout)
+	: backend(backend), initiator(initiator), next_id(initiator ? 1 : 2),
+	mutex(Server->createMutex()), stream_cond(Server->createCondition()), send_cond(Server->createCondition()),
+	refcount(1), has_error(false), do_exit(false), send_enabled(initiator),
+	last_receive_time(Server->getTimeMS()), last_send_time(0),
+	ping_interval(ping_interval), dead_timeout(dead_timeout)
+{
+}
+
+MultiplexSession::~MultiplexSession()
+{
+	Server->destroy(backend);
+	Server->destroy(stream_cond);
+	Server->destroy(send_cond);
+	Server->destroy(mutex);
+}
+
+void MultiplexSession::start()
+{
+	addRef();
+	addRef();
+	Server->getThreadPool()->execute(new MultiplexSessionThread(this, false), "mux receive");
+	Server->getThreadPool()->execute(new MultiplexSessionThread(this, true), "mux send");
+}
+
+IPipe* MultiplexSession::openStream(int priority)
+{
+	IScopedLock lock(mutex);
+	if(has_error || do_exit)
+	{
+		return NULL;
+	}
+
+	unsigned int id=next_id;
+	next_id+=2;
+
+	MultiplexStream* stream=new MultiplexStream(this, id, priority);
+	++refcount;
+	streams[id]=stream;
+
+	queueFrame(MUX_OPEN, id, std::string(1, static_cast<char>(priority)), MUX_PRIO_HIGH);
+
+	return stream;
+}
+
+IPipe* MultiplexSession::acceptStream(int timeoutms)
+{
+	IScopedLock lock(mutex);
+	int64 starttime=Server->getTimeMS();
+	while(accept_queue.empty()
+		&& !has_error && !do_exit)
+	{
+		if(!waitFor(&lock, stream_cond, starttime, timeoutms))
+		{
+			return NULL;
+		}
+	}
+
+	if(accept_queue.empty())
+	{
+		return NULL;
+	}
+
+	MultiplexStream* ret=accept_queue.front();
+	accept_queue.pop_front();
+	return ret;
+}
+
+bool MultiplexSession::hasError()
+{
+	IScopedLock lock(mutex);
+	return has_error || do_exit;
+}
+
+int64 MultiplexSession::getLastReceiveTime()
+{
+	IScopedLock lock(mutex);
+	return last_receive_time;
+}
+
+void MultiplexSession::addRef()
+{
+	IScopedLock lock(mutex);
+	++refcount;
+}
+
+void MultiplexSession::release()
+{
+	bool del;
+	{
+		IScopedLock lock(mutex);
+		del = --refcount==0;
+	}
+	if(del)
+	{
+		delete this;
+	}
+}
+
+void MultiplexSession::shutdown()
+{
+	std::deque<MultiplexStream*> unaccepted;
+	{
+		IScopedLock lock(mutex);
+		do_exit=true;
+		unaccepted.swap(accept_queue);
+		send_cond->notify_all();
+		stream_cond->notify_all();
+	}
+
+	for(size_t i=0;i<unaccepted.size();++i)
+	{
+		delete unaccepted[i];
+	}
+}
+
+void MultiplexSession::runReceive()
+{
+	std::string buf;
+	while(true)
+	{
+		{
+			IScopedLock lock(mutex);
+			if(has_error || do_exit)
+			{
+				break;
+			}
+		}
+
+		std::string data;
+		size_t rc=backend->Read(&data, c_receive_wait);
+
+		if(rc==0)
+		{
+			IScopedLock lock(mutex);
+			if(backend->hasError())
+			{
+				Server->Log("Multiplexed connection closed", LL_DEBUG);
+				setError();
+				break;
+			}
+			if(Server->getTimeMS()-last_receive_time>dead_timeout)
+			{
+				Server->Log("Timeout on multiplexed connection", LL_DEBUG);
+				setError();
+				break;
+			}
+			continue;
+		}
+
+		buf.append(data);
+
+		IScopedLock lock(mutex);
+		last_receive_time=Server->getTimeMS();
+		if(!send_enabled)
+		{
+			send_enabled=true;
+			send_cond->notify_all();
+		}
+
+		size_t pos=0;
+		bool ok=true;
+		while(buf.size()-pos>=c_header_size)
+		{
+			char type=buf[pos];
+			unsigned int id=decodeUInt(&buf[pos+1]);
+			unsigned int data_size=decodeUInt(&buf[pos+1+sizeof(unsigned int)]);
+
+			if(data_size>c_max_frame_size)
+			{
+				Server->Log("Multiplexed frame too large ("+convert(data_size)+" bytes)", LL_ERROR);
+				ok=false;
+				break;
+			}
+
+			if(buf.size()-pos<c_header_size+data_size)
+			{
+				break;
+			}
+
+			if(!handleFrame(type, id, &buf[pos+c_header_size], data_size))
+			{
+				ok=false;
+				break;
+			}
+
+			pos+=c_header_size+data_size;
+		}
+
+		if(!ok)
+		{
+			setError();
+			break;
+		}
+
+		buf.erase(0, pos);
+	}
+}
+
+bool MultiplexSession::handleFrame(char type, unsigned int id, const char* data, size_t data_size)
+{
+	std::map<unsigned int, MultiplexStream*>::iterator it=streams.find(id);
+
+	switch(type)
+	{
+	case MUX_DATA:
+		{
+			if(it==streams.end()
+				|| it->second->local_closed)
+			{
+				return true;
+			}
+
+			MultiplexStream* stream=it->second;
+			if(stream->recv_buffer.size()-stream->recv_pos+data_size>c_stream_window)
+			{
+				Server->Log("Multiplexed stream "+convert(id)+" exceeded receive window", LL_ERROR);
+				return false;
+			}
+			stream->recv_buffer.append(data, data_size);
+			stream_cond->notify_all();
+		}break;
+	case MUX_OPEN:
+		{
+			if(it!=streams.end()
+				|| data_size<1
+				|| (id%2==1)!=!initiator)
+			{
+				Server->Log("Invalid open of multiplexed stream "+convert(id), LL_ERROR);
+				return false;
+			}
+
+			MultiplexStream* stream=new MultiplexStream(this, id, static_cast<int>(data[0]));
+			++refcount;
+			streams[id]=stream;
+			accept_queue.push_back(stream);
+			stream_cond->notify_all();
+		}break;
+	case MUX_CLOSE:
+		{
+			if(it!=streams.end())
+			{
+				it->second->remote_closed=true;
+				stream_cond->notify_all();
+			}
+		}break;
+	case MUX_WINDOW:
+		{
+			if(data_size<sizeof(unsigned int))
+			{
+				return false;
+			}
+			if(it!=streams.end())
+			{
+				it->second->send_window+=decodeUInt(data);
+				stream_cond->notify_all();
+			}
+		}break;
+	case MUX_PING:
+		{
+			queueFrame(MUX_PONG, 0, std::string(), MUX_PRIO_HIGH);
+		}break;
+	case MUX_PONG:
+		break;
+	default:
+		Server->Log("Unknown multiplexed frame type "+convert(static_cast<int>(type)), LL_ERROR);
+		return false;
+	}
+
+	return true;
+}
+
+void MultiplexSession::runSend()
+{
+	IScopedLock lock(mutex);
+	while(!has_error)
+	{
+		std::deque<SFrame>* queue=NULL;
+		if(send_enabled)
+		{
+			for(size_t i=0;i<3;++i)
+			{
+				if(!send_queue[i].empty())
+				{
+					queue=&send_queue[i];
+					break;
+				}
+			}
+		}
+
+		if(queue==NULL)
+		{
+			if(do_exit)
+			{
+				break;
+			}
+
+			int64 idle_time=Server->getTimeMS()-last_send_time;
+			if(send_enabled
+				&& idle_time>=ping_interval)
+			{
+				queueFrame(MUX_PING, 0, std::string(), MUX_PRIO_HIGH);
+				continue;
+			}
+
+			send_cond->wait(&lock, send_enabled ? static_cast<int>(ping_interval-idle_time) : c_receive_wait);
+			continue;
+		}
+
+		SFrame frame;
+		frame.type=queue->front().type;
+		frame.id=queue->front().id;
+		frame.data.swap(queue->front().data);
+		queue->pop_front();
+
+		bool more=false;
+		for(size_t i=0;i<3;++i)
+		{
+			if(!send_queue[i].empty())
+			{
+				more=true;
+				break;
+			}
+		}
+
+		lock.relock(NULL);
+
+		std::string msg;
+		msg.reserve(c_header_size+frame.data.size());
+		msg+=frame.type;
+		msg+=encodeUInt(frame.id);
+		msg+=encodeUInt(static_cast<unsigned int>(frame.data.size()));
+		msg+=frame.data;
+
+		//Only flush once everything queued so far is written
+		bool b=backend->Write(msg, -1, !more);
+
+		lock.relock(mutex);
+
+		if(!b)
+		{
+			Server->Log("Error writing to multiplexed connection", LL_DEBUG);
+			setError();
+			break;
+		}
+
+		last_send_time=Server->getTimeMS();
+	}
+}
+
+void MultiplexSession::queueFrame(char type, unsigned int id, const std::string& data, int priority)
+{
+	SFrame frame;
+	frame.type=type;
+	frame.id=id;
+	send_queue[priority].push_back(frame);
+	send_queue[priority].back().data=data;
+	send_cond->notify_all();
+}
+
+void MultiplexSession::setError()
+{
+	has_error=true;
+	stream_cond->notify_all();
+	send_cond->notify_all();
+}
+
+void MultiplexSession::removeStream(MultiplexStream* stream)
+{
+	std::map<unsigned int, MultiplexStream*>::iterator it=streams.find(stream->id);
+	if(it!=streams.end() && it->second==stream)
+	{
+		streams.erase(it);
+	}
+}
+
+bool MultiplexSession::waitFor(IScopedLock* lock, ICondition* cond, int64 starttime, int timeoutms)
+{
+	if(timeoutms<0)
+	{
+		cond->wait(lock);
+		return true;
+	}
+
+	int64 passed=Server->getTimeMS()-starttime;
+	if(passed>=timeoutms)
+	{
+		return false;
+	}
+
+	cond->wait(lock, static_cast<int>(timeoutms-passed));
+	return true;
+}
+
+MultiplexStream::MultiplexStream(MultiplexSession* session, unsigned int id, int priority)
+	: session(session), id(id), priority((std::max)(MUX_PRIO_HIGH, (std::min)(priority, MUX_PRIO_BULK))),
+	recv_pos(0), unacked_bytes(0), send_window(c_stream_window),
+	remote_closed(false), local_closed(false), transferred_bytes(0)
+{
+}
+
+MultiplexStream::~MultiplexStream()
+{
+	{
+		IScopedLock lock(session->mutex);
+		if(!local_closed)
+		{
+			local_closed=true;
+			session->queueFrame(MUX_CLOSE, id, std::string(), priority);
+		}
+		session->removeStream(this);
+	}
+	session->release();
+}
+
+size_t MultiplexStream::Read(char *buffer, size_t bsize, int timeoutms)
+{
+	size_t rc;
+	{
+		IScopedLock lock(session->mutex);
+		if(!waitReadable(&lock, timeoutms))
+		{
+			return 0;
+		}
+		rc=consume(buffer, bsize);
+	}
+
+	doThrottle(rc, false);
+	return rc;
+}
+
+size_t MultiplexStream::Read(std::string *ret, int timeoutms)
+{
+	size_t rc;
+	{
+		IScopedLock lock(session->mutex);
+		if(!waitReadable(&lock, timeoutms))
+		{
+			ret->clear();
+			return 0;
+		}
+		ret->resize(recv_buffer.size()-recv_pos);
+		if(ret->empty())
+		{
+			return 0;
+		}
+		rc=consume(&(*ret)[0], ret->size());
+	}
+
+	doThrottle(rc, false);
+	return rc;
+}
+
+bool MultiplexStream::Write(const char *buffer, size_t bsize, int timeoutms, bool flush)
+{
+	int64 starttime=Server->getTimeMS();
+	size_t written=0;
+	{
+		IScopedLock lock(session->mutex);
+		while(written<bsize)
+		{
+			while(send_window<=0
+				&& !remote_closed && !local_closed
+				&& !session->has_error && !session->do_exit)
+			{
+				if(!session->waitFor(&lock, session->stream_cond, starttime, timeoutms))
+				{
+					return false;
+				}
+			}
+
+			if(remote_closed || local_closed
+				|| session->has_error || session->do_exit)
+			{
+				return false;
+			}
+
+			size_t chunk=(std::min)(bsize-written, (std::min)(c_max_frame_size, static_cast<size_t>(send_window)));
+			session->queueFrame(MUX_DATA, id, std::string(buffer+written, chunk), priority);
+			send_window-=chunk;
+			written+=chunk;
+			transferred_bytes+=chunk;
+		}
+	}
+
+	doThrottle(bsize, true);
+	return true;
+}
+
+bool MultiplexStream::Write(const std::string &str, int timeoutms, bool flush)
+{
+	return Write(str.c_str(), str.size(), timeoutms, flush);
+}
+
+bool MultiplexStream::Flush(int timeoutms)
+{
+	return !hasError();
+}
+
+bool MultiplexStream::isWritable(int timeoutms)
+{
+	IScopedLock lock(session->mutex);
+	int64 starttime=Server->getTimeMS();
+	while(send_window<=0
+		&& !remote_closed && !local_closed
+		&& !session->has_error && !session->do_exit)
+	{
+		if(!session->waitFor(&lock, session->stream_cond, starttime, timeoutms))
+		{
+			return false;
+		}
+	}
+	return send_window>0 && !remote_closed && !local_closed
+		&& !session->has_error && !session->do_exit;
+}
+
+bool MultiplexStream::isReadable(int timeoutms)
+{
+	IScopedLock lock(session->mutex);
+	return waitReadable(&lock, timeoutms)
+		&& recv_buffer.size()>recv_pos;
+}
+
+bool MultiplexStream::hasError(void)
+{
+	IScopedLock lock(session->mutex);
+	if(local_closed)
+	{
+		return true;
+	}
+	return (remote_closed || session->has_error || session->do_exit)
+		&& recv_buffer.size()==recv_pos;
+}
+
+void MultiplexStream::shutdown(void)
+{
+	IScopedLock lock(session->mutex);
+	if(!local_closed)
+	{
+		local_closed=true;
+		session->queueFrame(MUX_CLOSE, id, std::string(), priority);
+		session->stream_cond->notify_all();
+	}
+}
+
+size_t MultiplexStream::getNumElements(void)
+{
+	return 0;
+}
+
+void MultiplexStream::addThrottler(IPipeThrottler *throttler)
+{
+	if(throttler!=NULL)
+	{
+		incoming_throttlers.push_back(throttler);
+		outgoing_throttlers.push_back(throttler);
+	}
+}
+
+void MultiplexStream::addOutgoingThrottler(IPipeThrottler *throttler)
+{
+	if(throttler!=NULL)
+	{
+		outgoing_throttlers.push_back(throttler);
+	}
+}
+
+void MultiplexStream::addIncomingThrottler(IPipeThrottler *throttler)
+{
+	if(throttler!=NULL)
+	{
+		incoming_throttlers.push_back(throttler);
+	}
+}
+
+_i64 MultiplexStream::getTransferedBytes(void)
+{
+	IScopedLock lock(session->mutex);
+	return transferred_bytes;
+}
+
+void MultiplexStream::resetTransferedBytes(void)
+{
+	IScopedLock lock(session->mutex);
+	transferred_bytes=0;
+}
+
+bool MultiplexStream::waitReadable(IScopedLock* lock, int timeoutms)
+{
+	int64 starttime=Server->getTimeMS();
+	while(recv_buffer.size()==recv_pos
+		&& !remote_closed && !local_closed
+		&& !session->has_error && !session->do_exit)
+	{
+		if(!session->waitFor(lock, session->stream_cond, starttime, timeoutms))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+size_t MultiplexStream::consume(char* buffer, size_t bsize)
+{
+	size_t rc=(std::min)(recv_buffer.size()-recv_pos, bsize);
+	if(rc==0)
+	{
+		return 0;
+	}
+
+	memcpy(buffer, recv_buffer.data()+recv_pos, rc);
+	recv_pos+=rc;
+
+	if(recv_pos==recv_buffer.size())
+	{
+		recv_buffer.clear();
+		recv_pos=0;
+	}
+	else if(recv_pos>=c_stream_window/2)
+	{
+		recv_buffer.erase(0, recv_pos);
+		recv_pos=0;
+	}
+
+	transferred_bytes+=rc;
+	unacked_bytes+=rc;
+
+	if(unacked_bytes>=c_stream_window/4
+		&& !remote_closed && !local_closed)
+	{
+		session->queueFrame(MUX_WINDOW, id, encodeUInt(static_cast<unsigned int>(unacked_bytes)), MUX_PRIO_HIGH);
+		unacked_bytes=0;
+	}
+
+	return rc;
+}
+
+void MultiplexStream::doThrottle(size_t new_bytes, bool outgoing)
+{
+	std::vector<IPipeThrottler*>& throttlers = outgoing ? outgoing_throttlers : incoming_throttlers;
+	for(size_t i=0;i<throttlers.size();++i)
+	{
+		throttlers[i]->addBytes(new_bytes, true);
+	}
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include "../Interface/Pipe.h"
+#include "../Interface/Types.h"
+#include <map>
+#include <deque>
+#include <vector>
+#include <string>
+
+class IMutex;
+class ICondition;
+class IScopedLock;
+class MultiplexStream;
+class MultiplexSessionThread;
+
+const int MUX_PRIO_HIGH=0;
+const int MUX_PRIO_NORMAL=1;
+const int MUX_PRIO_BULK=2;
+
+/**
+* Runs many flow-controlled logical streams over one (authenticated, encrypted, compressed) pipe.
+* Frames: [type(1)][stream id(4)][payload size(4)][payload]
+*/
+class MultiplexSession
+{
+public:
+	MultiplexSession(IPipe* backend, bool initiator, int64 ping_interval, int64 dead_timeout);
+
+	void start();
+
+	IPipe* openStream(int priority);
+	IPipe* acceptStream(int timeoutms);
+
+	bool hasError();
+	int64 getLastReceiveTime();
+
+	void addRef();
+	void release();
+
+	void shutdown();
+
+private:
+	~MultiplexSession();
+
+	friend class MultiplexStream;
+	friend class MultiplexSessionThread;
+
+	struct SFrame
+	{
+		char type;
+		unsigned int id;
+		std::string data;
+	};
+
+	void runReceive();
+	void runSend();
+
+	bool handleFrame(char type, unsigned int id, const char* data, size_t data_size);
+
+	void queueFrame(char type, unsigned int id, const std::string& data, int priority);
+	void setError();
+	void removeStream(MultiplexStream* stream);
+
+	bool waitFor(IScopedLock* lock, ICondition* cond, int64 starttime, int timeoutms);
+
+	IPipe* backend;
+	bool initiator;
+	unsigned int next_id;
+
+	IMutex* mutex;
+	ICondition* stream_cond;
+	ICondition* send_cond;
+
+	std::map<unsigned int, MultiplexStream*> streams;
+	std::deque<MultiplexStream*> accept_queue;
+	std::deque<SFrame> send_queue[3];
+
+	size_t refcount;
+	bool has_error;
+	bool do_exit;
+	bool send_enabled;
+
+	int64 last_receive_time;
+	int64 last_send_time;
+	int64 ping_interval;
+	int64 dead_timeout;
+};
+
+class MultiplexStream : public IPipe
+{
+public:
+	MultiplexStream(MultiplexSession* session, unsigned int id, int priority);
+	~MultiplexStream();
+
+	virtual size_t Read(char *buffer, size_t bsize, int timeoutms=-1);
+	virtual bool Write(const char *buffer, size_t bsize, int timeoutms=-1, bool flush=true);
+	virtual size_t Read(std::string *ret, int timeoutms=-1);
+	virtual bool Write(const std::string &str, int timeoutms=-1, bool flush=true);
+
+	virtual bool Flush(int timeoutms=-1);
+
+	virtual bool isWritable(int timeoutms=0);
+	virtual bool isReadable(int timeoutms=0);
+
+	virtual bool hasError(void);
+
+	virtual void shutdown(void);
+
+	virtual size_t getNumElements(void);
+
+	virtual void addThrottler(IPipeThrottler *throttler);
+	virtual void addOutgoingThrottler(IPipeThrottler *throttler);
+	virtual void addIncomingThrottler(IPipeThrottler *throttler);
+
+	virtual _i64 getTransferedBytes(void);
+	virtual void resetTransferedBytes(void);
+
+private:
+	friend class MultiplexSession;
+
+	bool waitReadable(IScopedLock* lock, int timeoutms);
+	size_t consume(char* buffer, size_t bsize);
+	void doThrottle(size_t new_bytes, bool outgoing);
+
+	MultiplexSession* session;
+	unsigned int id;
+	int priority;
+
+	std::string recv_buffer;
+	size_t recv_pos;
+	size_t unacked_bytes;
+	int64 send_window;
+
+	bool remote_closed;
+	bool local_closed;
+
+	_i64 transferred_bytes;
+
+	std::vector<IPipeThrottler*> incoming_throttlers;
+	std::vector<IPipeThrottler*> outgoing_throttlers;
+};
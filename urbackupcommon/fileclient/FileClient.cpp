@@ -49,8 +49,9 @@ namespace
 	const unsigned int DISCOVERY_TIMEOUT=1000; //1sec
 #endif
 
-	const size_t maxQueuedFiles = 3000;
-	const size_t queuedFilesLow = 100;
+	const size_t minQueuedFiles = 4;
+	const size_t initialQueuedFiles = 100;
+	const size_t maxQueuedFiles = 10000;
 
 	std::string ipToString(sockaddr_in sa)
 	{
@@ -97,7 +98,9 @@ FileClient::FileClient(bool enable_find_servers, std::string identity, int proto
 	protocol_version(protocol_version), internet_connection(internet_connection),
 	transferred_bytes(0), reconnection_callback(reconnection_callback),
 	nofreespace_callback(nofreespace_callback), reconnection_timeout(300000), retryBindToNewInterfaces(true),
-	identity(identity), received_data_bytes(0), queue_callback(NULL), dl_off(0),
+	identity(identity), received_data_bytes(0), queue_callback(NULL),
+	queue_estimator(minQueuedFiles, initialQueuedFiles, maxQueuedFiles), queue_sample_pending(false),
+	last_read_time(0), dl_off(0),
 	last_transferred_bytes(0), last_progress_log(0), progress_log_callback(NULL), needs_flush(false),
 	real_transferred_bytes(0), is_downloading(false), sparse_extends_f(NULL), sparse_bytes(0),
 	reconnect_tries(50)
@@ -163,7 +166,7 @@ void FileClient::bindToNewInterfaces()
 				if(std::find(broadcast_iface_addrs.begin(), broadcast_iface_addrs.end(), source_addr.sin_addr.s_addr)!=broadcast_iface_addrs.end())
 					continue;
 
-				int type = SOCK_DGRAM;
+				int type = SOCK_DGRAM;
 #if defined(SOCK_CLOEXEC)
 				type |= SOCK_CLOEXEC;
 #endif
@@ -173,8 +176,8 @@ void FileClient::bindToNewInterfaces()
 					Server->Log(std::string("Error creating socket for interface ")+std::string(ifap->ifa_name), LL_ERROR);
 					continue;
 				}
-#if !defined(SOCK_CLOEXEC)
-				fcntl(udpsock, F_SETFD, fcntl(udpsock, F_GETFD, 0) | FD_CLOEXEC);
+#if !defined(SOCK_CLOEXEC)
+				fcntl(udpsock, F_SETFD, fcntl(udpsock, F_GETFD, 0) | FD_CLOEXEC);
 #endif
 
 				BOOL val=TRUE;
@@ -224,7 +227,7 @@ void FileClient::bindToNewInterfaces()
 		Server->Log("Getting interface ips failed. errno="+convert(errno)+
 			". Server may not listen properly on all network devices when discovering clients.", LL_ERROR);
 
-		int type = SOCK_DGRAM;
+		int type = SOCK_DGRAM;
 #if defined(SOCK_CLOEXEC)
 		type |= SOCK_CLOEXEC;
 #endif
@@ -235,8 +238,8 @@ void FileClient::bindToNewInterfaces()
 		}
 		else
 		{
-#if !defined(SOCK_CLOEXEC)
-			fcntl(udpsock, F_SETFD, fcntl(udpsock, F_GETFD, 0) | FD_CLOEXEC);
+#if !defined(SOCK_CLOEXEC)
+			fcntl(udpsock, F_SETFD, fcntl(udpsock, F_GETFD, 0) | FD_CLOEXEC);
 #endif
 			BOOL val=TRUE;
 			int rc = setsockopt(udpsock, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(BOOL));
@@ -645,6 +648,8 @@ bool FileClient::Reconnect(void)
 {
 	dl_off=0;
 	queued.clear();
+	queue_estimator.reset();
+	queue_sample_pending=false;
 	if(queue_callback!=NULL)
 	{
 		queue_callback->resetQueueFull();
@@ -763,6 +768,7 @@ bool FileClient::Reconnect(void)
 		assert(queued.front().fn == remotefn);
 		assert(!queued.front().finish_script);
 		queued.pop_front();
+		queueItemStarted();
 	}
 
 	_u64 filesize=0;
@@ -815,6 +821,7 @@ bool FileClient::Reconnect(void)
 			) )
 		{
 			rc = tcpsock->Read(&dl_buf[dl_off], BUFFERSIZE-dl_off, 120000);
+			queueDataReceived(rc);
 
 			if (rc != 0)
 			{
@@ -1252,6 +1259,7 @@ bool FileClient::Reconnect(void)
 					IScopedLock lock(mutex);
 					received_data_bytes+=written-off;
 				}
+				queue_estimator.addDeliveredBytes(written-off);
 
 				if( received >= filesize && state==0)
 				{
@@ -1391,6 +1399,46 @@ void FileClient::setReconnectionTimeout(unsigned int t)
 	reconnection_timeout=t;
 }
 
+void FileClient::queueItemStarted()
+{
+	if(queue_sample_pending)
+	{
+		queue_estimator.requestDone(last_read_time);
+	}
+
+	if(dl_off>0)
+	{
+		//The response started with data received together with the previous response
+		queue_estimator.requestDone(last_read_time);
+		queue_sample_pending=false;
+	}
+	else
+	{
+		queue_sample_pending=true;
+	}
+}
+
+void FileClient::queueDataReceived(size_t rc)
+{
+	if(rc==0)
+	{
+		return;
+	}
+
+	last_read_time = Server->getTimeMS();
+
+	if(queue_sample_pending)
+	{
+		queue_sample_pending=false;
+		queue_estimator.requestDone(last_read_time);
+	}
+}
+
+QueueDepthEstimator::SState FileClient::getQueueState()
+{
+	return queue_estimator.getState();
+}
+
 _i64 FileClient::getReceivedDataBytes( bool with_sparse )
 {
 	IScopedLock lock(mutex);
@@ -1434,7 +1482,7 @@ void FileClient::fillQueue()
 		return;
 	}
 
-	if(queued.size()>queuedFilesLow)
+	if(queued.size()>queue_estimator.getLowDepth())
 	{
 		if (needs_flush)
 		{
@@ -1449,8 +1497,9 @@ void FileClient::fillQueue()
 
 	std::vector<SQueueItem> queued_files;
 	int64 queue_starttime = Server->getTimeMS();
+	size_t max_queued = queue_estimator.getDepth();
 
-	while(queued.size()<maxQueuedFiles
+	while(queued.size()<max_queued
 		&& Server->getTimeMS()-queue_starttime<10000)
 	{
 		if(!tcpsock->isWritable())
@@ -1536,6 +1585,7 @@ void FileClient::fillQueue()
 
 		queued.push_back(SQueueItem(queue_fn, finish_script));
 		queued_files.push_back(SQueueItem(queue_fn, finish_script));
+		queue_estimator.requestSent();
 		needs_flush=true;
 	}
 
@@ -1666,6 +1716,7 @@ _u32 FileClient::GetFileHashAndMetadata( std::string remotefn, std::string& hash
 		assert(queued.front().fn == remotefn);
 		assert(!queued.front().finish_script);
 		queued.pop_front();
+		queueItemStarted();
 	}
 
 
@@ -1683,7 +1734,9 @@ _u32 FileClient::GetFileHashAndMetadata( std::string remotefn, std::string& hash
 		if(tcpsock->isReadable() || dl_off==0 || 
 			(firstpacket && dl_buf[0]==ID_GET_FILE_HASH_AND_METADATA && dl_off<1+sizeof(unsigned short) ) )
 		{
-			rc = tcpsock->Read(&dl_buf[dl_off], BUFFERSIZE-dl_off, 120000)+dl_off;
+			rc = tcpsock->Read(&dl_buf[dl_off], BUFFERSIZE-dl_off, 120000);
+			queueDataReceived(rc);
+			rc += dl_off;
 		}
 		else
 		{
@@ -1967,6 +2020,7 @@ _u32 FileClient::FinishScript(std::string remotefn)
 		assert(queued.front().fn == remotefn);
 		assert(queued.front().finish_script);
 		queued.pop_front();
+		queueItemStarted();
 	}
 
 	int tries=20;
@@ -1974,6 +2028,7 @@ _u32 FileClient::FinishScript(std::string remotefn)
 	while(true)
 	{
 		size_t rc = tcpsock->Read(dl_buf, 1, 120000);
+		queueDataReceived(rc);
 
 		if(rc==0)
 		{
@@ -5,6 +5,7 @@
 #include "packet_ids.h"
 #include "../../urbackupcommon/fileclient/tcpstack.h"
 #include "socket_header.h"
+#include "QueueDepthEstimator.h"
 #include "../../Interface/Pipe.h"
 #include "../../Interface/File.h"
 #include "../../Interface/Mutex.h"
@@ -111,6 +112,8 @@ public:
 
 		void resetReceivedDataBytes(bool with_sparse);
 
+		QueueDepthEstimator::SState getQueueState();
+
 		static std::string getErrorString(_u32 ec);
 
 		void setReconnectionTimeout(unsigned int t);
@@ -146,6 +149,10 @@ private:
 
 		void fillQueue();
 
+		void queueItemStarted();
+
+		void queueDataReceived(size_t rc);
+
 		void logProgress(const std::string& remotefn, _u64 filesize, _u64 received);
 
 		
@@ -216,6 +223,9 @@ private:
 		};
 
 		std::deque<SQueueItem> queued;
+		QueueDepthEstimator queue_estimator;
+		bool queue_sample_pending;
+		int64 last_read_time;
 
 		char dl_buf[BUFFERSIZE];
 		size_t dl_off;
@@ -29,6 +29,7 @@
 #include <algorithm>
 #include <limits.h>
 #include "../../common/adler32.h"
+#include "../../common/cdc.h"
 #include "../chunk_hasher.h"
 #include "../../urbackupcommon/os_functions.h"
 
@@ -41,6 +42,54 @@ namespace
 		"Seeking in file failed",
 		"Reading from file failed"
 	};
+
+	const _i64 c_cdc_min_filesize = 4 * c_checkpoint_dist;
+
+	class CdcPipeReader
+	{
+	public:
+		CdcPipeReader(IPipe* pipe)
+			: pipe(pipe), buf(BUFFERSIZE), buf_pos(0), buf_size(0)
+		{}
+
+		bool read(char* out, size_t bsize)
+		{
+			while (bsize > 0)
+			{
+				if (buf_pos == buf_size)
+				{
+					int64 starttime = Server->getTimeMS();
+					size_t r;
+					do
+					{
+						r = pipe->Read(&buf[0], buf.size(), 10000);
+						if (r == 0
+							&& (pipe->hasError()
+								|| Server->getTimeMS() - starttime >= SERVER_TIMEOUT))
+						{
+							return false;
+						}
+					} while (r == 0);
+
+					buf_pos = 0;
+					buf_size = r;
+				}
+
+				size_t tocopy = (std::min)(bsize, buf_size - buf_pos);
+				memcpy(out, &buf[buf_pos], tocopy);
+				buf_pos += tocopy;
+				out += tocopy;
+				bsize -= tocopy;
+			}
+			return true;
+		}
+
+	private:
+		IPipe* pipe;
+		std::vector<char> buf;
+		size_t buf_pos;
+		size_t buf_size;
+	};
 }
 
 int64 get_hashdata_size(int64 hashfilesize)
@@ -67,12 +116,13 @@ FileClientChunked::FileClientChunked(IPipe *pipe, bool del_pipe, CTCPStack *stac
 	  nofreespace_callback(nofreespace_callback), reconnection_timeout(300000), identity(identity), received_data_bytes(0),
 	  parent(prev), queue_only(false), queue_callback(NULL), remote_filesize(-1), ofb_pipe(NULL), hashfilesize(-1), did_queue_fc(false), queued_chunks(0),
 	  last_transferred_bytes(0), last_progress_log(0), progress_log_callback(NULL), reconnected(false), needs_flush(false),
-	  real_transferred_bytes(0), queue_next(false), sparse_bytes(0)
+	  real_transferred_bytes(0), queue_next(false), sparse_bytes(0), cdc_enabled(false)
 {
 	has_error=false;
 	if(parent==NULL)
 	{
 		mutex = Server->createMutex();
+		queue_estimator.reset(new QueueDepthEstimator(c_min_queued_chunks, c_initial_queued_chunks, c_max_queued_chunks));
 	}
 	else
 	{
@@ -83,7 +133,7 @@ FileClientChunked::FileClientChunked(IPipe *pipe, bool del_pipe, CTCPStack *stac
 FileClientChunked::FileClientChunked(void)
 	: pipe(NULL), stack(NULL), destroy_pipe(false), transferred_bytes(0), reconnection_callback(NULL), reconnection_timeout(300000), received_data_bytes(0),
 	  parent(NULL), remote_filesize(-1), ofb_pipe(NULL), hashfilesize(-1), did_queue_fc(false), queued_chunks(0), last_transferred_bytes(0), last_progress_log(0),
-	  progress_log_callback(NULL), reconnected(false), real_transferred_bytes(0), queue_next(false), sparse_bytes(0)
+	  progress_log_callback(NULL), reconnected(false), real_transferred_bytes(0), queue_next(false), sparse_bytes(0), cdc_enabled(false)
 {
 	has_error=true;
 	mutex=NULL;
@@ -119,6 +169,12 @@ _u32 FileClientChunked::GetFilePatch(std::string remotefn, IFile *orig_file, IFi
 	extent_iterator.reset();
 	curr_sparse_extent.offset = -1;
 
+	if(!queue_only && parent==NULL && queued_fcs.empty()
+		&& useCdc(orig_file, is_script))
+	{
+		return GetFilePatchCdc(remotefn, predicted_filesize, file_id, sparse_extents_f);
+	}
+
 	return GetFile(remotefn, predicted_filesize, file_id, sparse_extents_f);
 }
 
@@ -176,34 +232,10 @@ _u32 FileClientChunked::GetFile(std::string remotefn, _i64& filesize_out, int64
 
 	_i64 fileoffset=0;
 
-	m_chunkhashes->Seek(0);
-	hashfilesize=0;
-	if(m_chunkhashes->Read((char*)&hashfilesize, sizeof(_i64))!=sizeof(_i64) )
+	_u32 rc_hashfilesize = readHashfilesize();
+	if(rc_hashfilesize!=ERR_SUCCESS)
 	{
-		Server->Log("Cannot read hashfilesize in FileClientChunked::GetFile", LL_ERROR);
-		return ERR_INT_ERROR;
-	}
-
-	hashfilesize = little_endian(hashfilesize);
-
-	if(hashfilesize<0)
-	{
-		Server->Log("Hashfile size wrong. Hashfile is damaged. Size is "+convert(hashfilesize), LL_ERROR);
-		return ERR_INT_ERROR;
-	}
-
-	if(hashfilesize!=m_file->Size())
-	{
-		Server->Log("Hashfile size differs in FileClientChunked::GetFile "+convert(hashfilesize)+"!="+convert(m_file->Size()), LL_DEBUG);
-		if(m_file->Size()<hashfilesize)
-		{
-			//partial file
-			hashfilesize=m_file->Size();
-		}
-	}
-	else
-	{
-		VLOG(Server->Log("Old filesize="+convert(hashfilesize), LL_DEBUG));
+		return rc_hashfilesize;
 	}
 
 	if(!was_prepared)
@@ -278,18 +310,16 @@ _u32 FileClientChunked::GetFile(std::string remotefn, _i64& filesize_out, int64
 		num_total_chunks=0;
 	}
 
-	size_t queued_chunks_low = c_queued_chunks_low;
-
-	if(queue_only)
-	{
-		queued_chunks_low = c_max_queued_chunks;
-	}
+	bool queue_stopped = false;
 
 	do
 	{
+		size_t max_queued_chunks = queueEstimator()->getDepth();
+		size_t queued_chunks_low = queue_only ? max_queued_chunks : queueEstimator()->getLowDepth();
+
 		if(queuedChunks()<queued_chunks_low && remote_filesize!=-1 && next_chunk<num_total_chunks)
 		{		
-			while(queuedChunks()<c_max_queued_chunks && next_chunk<num_total_chunks)
+			while(queuedChunks()<max_queued_chunks && next_chunk<num_total_chunks)
 			{
 				if(!getPipe()->isWritable())
 				{
@@ -415,7 +445,7 @@ _u32 FileClientChunked::GetFile(std::string remotefn, _i64& filesize_out, int64
 
 		if( ( ( parent==NULL && queued_fcs.empty() ) || !did_queue_fc )
 			&& queuedChunks()<queued_chunks_low && next_chunk>=num_total_chunks
-			&& remote_filesize!=-1)
+			&& remote_filesize!=-1 && !queue_stopped)
 		{
 			if(queue_only)
 			{
@@ -443,6 +473,14 @@ _u32 FileClientChunked::GetFile(std::string remotefn, _i64& filesize_out, int64
 						getPipe()->isWritable() &&
 						queue_callback->getQueuedFileChunked(remotefn, orig_file, patchfile, chunkhashes, hashoutput, predicted_filesize, file_id, is_script) )
 					{
+						if(patch_mode && useCdc(orig_file, is_script))
+						{
+							//Content defined chunking transfers cannot be pipelined. The file is loaded once the queue is empty.
+							queue_callback->unqueueFileChunked(remotefn);
+							queue_stopped = true;
+							break;
+						}
+
 						if(prev==NULL)
 						{
 							did_queue_fc=true;
@@ -647,6 +685,477 @@ _u32 FileClientChunked::GetFile(std::string remotefn, _i64& filesize_out, int64
 }
 
 
+_u32 FileClientChunked::readHashfilesize()
+{
+	m_chunkhashes->Seek(0);
+	hashfilesize=0;
+	if(m_chunkhashes->Read((char*)&hashfilesize, sizeof(_i64))!=sizeof(_i64) )
+	{
+		Server->Log("Cannot read hashfilesize in FileClientChunked::GetFile", LL_ERROR);
+		return ERR_INT_ERROR;
+	}
+
+	hashfilesize = little_endian(hashfilesize);
+
+	if(hashfilesize<0)
+	{
+		Server->Log("Hashfile size wrong. Hashfile is damaged. Size is "+convert(hashfilesize), LL_ERROR);
+		return ERR_INT_ERROR;
+	}
+
+	if(hashfilesize!=m_file->Size())
+	{
+		Server->Log("Hashfile size differs in FileClientChunked::GetFile "+convert(hashfilesize)+"!="+convert(m_file->Size()), LL_DEBUG);
+		if(m_file->Size()<hashfilesize)
+		{
+			//partial file
+			hashfilesize=m_file->Size();
+		}
+	}
+	else
+	{
+		VLOG(Server->Log("Old filesize="+convert(hashfilesize), LL_DEBUG));
+	}
+
+	return ERR_SUCCESS;
+}
+
+bool FileClientChunked::chunkOldFileCdc(std::vector<SCdcOldChunk>& old_chunks, std::vector<char>& old_hashes)
+{
+	std::vector<char> buf(c_cdc_max_size*2);
+	size_t buf_start=0;
+	size_t buf_end=0;
+	_i64 read_pos=0;
+	_i64 chunk_pos=0;
+
+	while(true)
+	{
+		if(buf_end-buf_start<c_cdc_max_size && read_pos<hashfilesize)
+		{
+			memmove(&buf[0], &buf[buf_start], buf_end-buf_start);
+			buf_end-=buf_start;
+			buf_start=0;
+
+			while(buf_end<buf.size() && read_pos<hashfilesize)
+			{
+				_u32 toread = static_cast<_u32>((std::min)(static_cast<_i64>(buf.size()-buf_end), hashfilesize-read_pos));
+				bool read_err=false;
+				_u32 r = m_file->Read(read_pos, &buf[buf_end], toread, &read_err);
+				if(r==0 || read_err)
+				{
+					Server->Log("Error reading base file at position "+convert(read_pos)+" for content defined chunking. "+os_last_error_str(), LL_WARNING);
+					return false;
+				}
+				buf_end+=r;
+				read_pos+=r;
+			}
+		}
+
+		if(buf_start==buf_end)
+		{
+			break;
+		}
+
+		SCdcOldChunk chunk;
+		chunk.offset = chunk_pos;
+		chunk.size = cdc_chunk_size(&buf[buf_start], static_cast<unsigned int>(buf_end-buf_start));
+
+		MD5 chunk_hash(reinterpret_cast<unsigned char*>(&buf[buf_start]), chunk.size);
+		const char* digest = reinterpret_cast<const char*>(chunk_hash.raw_digest_int());
+		old_hashes.insert(old_hashes.end(), digest, digest+big_hash_size);
+		old_chunks.push_back(chunk);
+
+		buf_start+=chunk.size;
+		chunk_pos+=chunk.size;
+	}
+
+	return true;
+}
+
+_u32 FileClientChunked::GetFilePatchCdc(std::string remotefn, _i64& filesize_out, int64 file_id, IFile** sparse_extents_f)
+{
+	getfile_done=false;
+	retval=ERR_SUCCESS;
+	remote_filename=remotefn;
+	curr_file_id = file_id;
+
+	if(getPipe()==NULL)
+		return ERR_ERROR;
+
+	setReconnectTries(50);
+
+	_u32 rc_hashfilesize = readHashfilesize();
+	if(rc_hashfilesize!=ERR_SUCCESS)
+	{
+		return rc_hashfilesize;
+	}
+
+	std::vector<SCdcOldChunk> old_chunks;
+	std::vector<char> old_hashes;
+	if(!chunkOldFileCdc(old_chunks, old_hashes))
+	{
+		Server->Log("Falling back to block diff transfer for \""+remotefn+"\"", LL_INFO);
+		return GetFile(remotefn, filesize_out, file_id, sparse_extents_f);
+	}
+
+	Server->Log("Loading \""+remotefn+"\" with content defined chunking. Base file chunks: "+convert(old_chunks.size()), LL_DEBUG);
+
+	CWData data;
+	data.addUChar( file_id!=0 ? ID_GET_FILE_BLOCKDIFF_WITH_METADATA : ID_GET_FILE_BLOCKDIFF );
+	data.addString( remotefn );
+	data.addString( identity );
+
+	if(file_id!=0)
+	{
+		data.addChar(0);
+		data.addVarInt(file_id);
+		data.addChar(0);
+	}
+
+	data.addInt64( 0 );
+	data.addInt64( hashfilesize );
+	data.addInt64( remote_filesize );
+	data.addUChar( c_blockdiff_flag_cdc );
+
+	int tries = 10;
+	while (stack->Send(getPipe(), data.getDataPtr(), data.getDataSize(), c_default_timeout, false) != data.getDataSize())
+	{
+		Server->Log("Timeout during file request (cdc). Reconnecting...", LL_DEBUG);
+
+		--tries;
+
+		if (tries == 0
+			|| !Reconnect(false))
+		{
+			Server->Log("Timeout during file request (cdc)", LL_ERROR);
+			return ERR_TIMEOUT;
+		}
+	}
+
+	size_t n_hashes = old_chunks.size();
+	size_t hash_idx = 0;
+	do
+	{
+		size_t curr_n = (std::min)(n_hashes-hash_idx, static_cast<size_t>(c_cdc_hashes_per_packet));
+
+		CWData hdata;
+		hdata.addUChar(ID_CDC_HASHES);
+		hdata.addChar(hash_idx+curr_n==n_hashes ? 1 : 0);
+		if(curr_n>0)
+		{
+			hdata.addBuffer(&old_hashes[hash_idx*big_hash_size], curr_n*big_hash_size);
+		}
+
+		if (stack->Send(getPipe(), hdata.getDataPtr(), hdata.getDataSize(), c_default_timeout, false) != hdata.getDataSize())
+		{
+			Server->Log("Timeout sending chunk hashes (cdc)", LL_ERROR);
+			return Cdc_failure(ERR_TIMEOUT, true, filesize_out);
+		}
+
+		hash_idx+=curr_n;
+	} while(hash_idx<n_hashes);
+
+	if(Flush(getPipe())!=ERR_SUCCESS)
+	{
+		return Cdc_failure(ERR_TIMEOUT, true, filesize_out);
+	}
+
+	CdcPipeReader reader(getPipe());
+	MD5 file_hash;
+	std::vector<char> buf(c_cdc_max_size);
+	file_pos = 0;
+	block_pos = 0;
+	remote_filesize = -1;
+	bool has_filesize = false;
+
+	while(true)
+	{
+		char id;
+		if(!reader.read(&id, 1))
+		{
+			Server->Log("Error receiving data (cdc). Connection lost.", LL_WARNING);
+			return Cdc_failure(ERR_CONN_LOST, true, filesize_out);
+		}
+
+		if(!has_filesize
+			&& id!=ID_FILESIZE && id!=ID_COULDNT_OPEN && id!=ID_BASE_DIR_LOST
+			&& id!=ID_READ_ERROR && id!=ID_BLOCK_ERROR)
+		{
+			Server->Log("Unexpected packet ID "+convert(static_cast<int>(id))+" before filesize (cdc)", LL_ERROR);
+			return Cdc_failure(ERR_ERROR, true, filesize_out);
+		}
+
+		switch(id)
+		{
+		case ID_FILESIZE:
+			{
+				_i64 new_remote_filesize;
+				if(!reader.read(reinterpret_cast<char*>(&new_remote_filesize), sizeof(new_remote_filesize)))
+				{
+					return Cdc_failure(ERR_CONN_LOST, true, filesize_out);
+				}
+				remote_filesize = little_endian(new_remote_filesize);
+				has_filesize = true;
+
+				writePatchSize(remote_filesize);
+
+				if(m_hashoutput!=NULL)
+				{
+					m_hashoutput->Seek(0);
+					_i64 endian_remote_filesize = little_endian(remote_filesize);
+					writeFileRepeat(m_hashoutput, (char*)&endian_remote_filesize, sizeof(_i64));
+				}
+			} break;
+		case ID_COULDNT_OPEN:
+			return Cdc_failure(ERR_CANNOT_OPEN_FILE, false, filesize_out);
+		case ID_BASE_DIR_LOST:
+			return Cdc_failure(ERR_BASE_DIR_LOST, false, filesize_out);
+		case ID_READ_ERROR:
+			return Cdc_failure(ERR_READ_ERROR, false, filesize_out);
+		case ID_BLOCK_ERROR:
+			{
+				_u32 ec[2];
+				if(!reader.read(reinterpret_cast<char*>(ec), sizeof(ec)))
+				{
+					return Cdc_failure(ERR_CONN_LOST, true, filesize_out);
+				}
+
+				Server->Log("Received error codes (ID_BLOCK_ERROR) ec1=" + convert(little_endian(ec[0])) + " ec2=" + convert(little_endian(ec[1])), LL_DEBUG);
+
+				setErrorCodes(little_endian(ec[0]), little_endian(ec[1]));
+				return Cdc_failure(ERR_ERRORCODES, false, filesize_out);
+			}
+		case ID_CDC_MATCH:
+			{
+				_u32 match[2];
+				if(!reader.read(reinterpret_cast<char*>(match), sizeof(match)))
+				{
+					return Cdc_failure(ERR_CONN_LOST, true, filesize_out);
+				}
+
+				_u32 first = little_endian(match[0]);
+				_u32 count = little_endian(match[1]);
+
+				if(first>=old_chunks.size() || count>old_chunks.size()-first)
+				{
+					Server->Log("Invalid chunk match "+convert(first)+"+"+convert(count)+" (cdc)", LL_ERROR);
+					return Cdc_failure(ERR_ERROR, true, filesize_out);
+				}
+
+				for(_u32 i=first;i<first+count;++i)
+				{
+					const SCdcOldChunk& chunk = old_chunks[i];
+
+					if(file_pos+chunk.size>remote_filesize)
+					{
+						Server->Log("Chunk match exceeds file size (cdc)", LL_ERROR);
+						return Cdc_failure(ERR_ERROR, true, filesize_out);
+					}
+
+					bool read_err=false;
+					if(m_file->Read(chunk.offset, &buf[0], chunk.size, &read_err)!=chunk.size
+						|| read_err)
+					{
+						Server->Log("Error reading base file at position "+convert(chunk.offset)+" (cdc). "+os_last_error_str(), LL_ERROR);
+						return Cdc_failure(ERR_ERROR, true, filesize_out);
+					}
+
+					if(chunk.offset!=file_pos)
+					{
+						writePatchInt(file_pos, chunk.size, &buf[0]);
+					}
+					else
+					{
+						curr_output_fsize = (std::max)(curr_output_fsize, file_pos+chunk.size);
+					}
+
+					file_hash.update(reinterpret_cast<unsigned char*>(&buf[0]), chunk.size);
+					Cdc_hash(&buf[0], chunk.size);
+				}
+			} break;
+		case ID_CDC_DATA:
+			{
+				_u32 size;
+				if(!reader.read(reinterpret_cast<char*>(&size), sizeof(size)))
+				{
+					return Cdc_failure(ERR_CONN_LOST, true, filesize_out);
+				}
+				size = little_endian(size);
+
+				if(size>buf.size()
+					|| file_pos+size>remote_filesize)
+				{
+					Server->Log("Invalid chunk size "+convert(size)+" (cdc)", LL_ERROR);
+					return Cdc_failure(ERR_ERROR, true, filesize_out);
+				}
+
+				if(!reader.read(&buf[0], size))
+				{
+					return Cdc_failure(ERR_CONN_LOST, true, filesize_out);
+				}
+
+				writePatchInt(file_pos, size, &buf[0]);
+				file_hash.update(reinterpret_cast<unsigned char*>(&buf[0]), size);
+				Cdc_hash(&buf[0], size);
+				addReceivedBytes(size);
+			} break;
+		case ID_CDC_END:
+			{
+				char hash_from_client[big_hash_size];
+				if(!reader.read(hash_from_client, big_hash_size))
+				{
+					return Cdc_failure(ERR_CONN_LOST, true, filesize_out);
+				}
+
+				Cdc_hashFinalizeBlock();
+				file_hash.finalize();
+
+				if(file_pos!=remote_filesize)
+				{
+					Server->Log("File size mismatch after transfer (cdc). Got "+convert(file_pos)+" expected "+convert(remote_filesize), LL_ERROR);
+					return Cdc_failure(ERR_ERROR, false, filesize_out);
+				}
+
+				if(memcmp(hash_from_client, file_hash.raw_digest_int(), big_hash_size)!=0)
+				{
+					Server->Log("File hash wrong after transfer (cdc)", LL_WARNING);
+					return ERR_HASH;
+				}
+
+				if(m_hashoutput!=NULL)
+				{
+					int64 max_hashoutput_size = get_hashdata_size(remote_filesize);
+					if (max_hashoutput_size < m_hashoutput->Size())
+					{
+						m_hashoutput->Resize(max_hashoutput_size, false);
+					}
+				}
+
+				last_chunk_patches.clear();
+
+				Server->Log("Successful. Returning filesize " + convert(remote_filesize), LL_DEBUG);
+				filesize_out = remote_filesize;
+				return ERR_SUCCESS;
+			}
+		default:
+			{
+				Server->Log("Unknown Packet ID "+convert(static_cast<int>(id))+" while loading file "+remote_filename+" (cdc)", LL_ERROR);
+				return Cdc_failure(ERR_ERROR, true, filesize_out);
+			}
+		}
+
+		logTransferProgress();
+	}
+}
+
+void FileClientChunked::Cdc_hash(const char* buf, unsigned int bsize)
+{
+	while(bsize>0)
+	{
+		if(block_pos==0)
+		{
+			md5_hash.init();
+			adler_hash=urb_adler32(0, NULL, 0);
+			adler_remaining=c_chunk_size;
+
+			if(m_hashoutput!=NULL)
+			{
+				m_hashoutput->Seek(chunkhash_file_off+(file_pos/c_checkpoint_dist)*chunkhash_single_size+big_hash_size);
+			}
+		}
+
+		unsigned int tohash = (std::min)(bsize, adler_remaining);
+		md5_hash.update(reinterpret_cast<unsigned char*>(const_cast<char*>(buf)), tohash);
+		adler_hash=urb_adler32(adler_hash, buf, tohash);
+
+		buf+=tohash;
+		bsize-=tohash;
+		adler_remaining-=tohash;
+		block_pos+=tohash;
+		file_pos+=tohash;
+
+		if(adler_remaining==0)
+		{
+			_u32 endian_adler_hash = little_endian(adler_hash);
+			if(m_hashoutput!=NULL)
+			{
+				writeFileRepeat(m_hashoutput, (char*)&endian_adler_hash, small_hash_size);
+			}
+			adler_hash=urb_adler32(0, NULL, 0);
+			adler_remaining=c_chunk_size;
+
+			if(block_pos==c_checkpoint_dist)
+			{
+				Cdc_hashFinalizeBlock();
+			}
+		}
+	}
+}
+
+void FileClientChunked::Cdc_hashFinalizeBlock()
+{
+	if(block_pos==0)
+	{
+		return;
+	}
+
+	if(adler_remaining<c_chunk_size
+		&& m_hashoutput!=NULL)
+	{
+		_u32 endian_adler_hash = little_endian(adler_hash);
+		writeFileRepeat(m_hashoutput, (char*)&endian_adler_hash, small_hash_size);
+	}
+
+	md5_hash.finalize();
+
+	if(m_hashoutput!=NULL)
+	{
+		m_hashoutput->Seek(chunkhash_file_off+((file_pos-1)/c_checkpoint_dist)*chunkhash_single_size);
+		writeFileRepeat(m_hashoutput, (char*)md5_hash.raw_digest_int(), big_hash_size);
+	}
+
+	block_pos=0;
+}
+
+_u32 FileClientChunked::Cdc_failure(_u32 rc, bool reconnect, _i64& filesize_out)
+{
+	if(reconnect)
+	{
+		//Rest of the response cannot be parsed any more
+		Reconnect(false);
+	}
+
+	if(!patch_mode || file_pos==0 || remote_filesize<0)
+	{
+		adjustOutputFilesizeOnFailure(filesize_out);
+		return rc;
+	}
+
+	//Unlike block diff transfers the data after file_pos is not at the
+	//same offset as in the base file, so only keep the received part
+	Cdc_hashFinalizeBlock();
+
+	filesize_out = file_pos;
+	writePatchSize(filesize_out);
+
+	if(m_hashoutput!=NULL)
+	{
+		m_hashoutput->Seek(0);
+		_i64 endian_filesize_out = little_endian(filesize_out);
+		writeFileRepeat(m_hashoutput, (char*)&endian_filesize_out, sizeof(_i64));
+
+		int64 max_hashoutput_size = get_hashdata_size(filesize_out);
+		if (max_hashoutput_size < m_hashoutput->Size())
+		{
+			m_hashoutput->Resize(max_hashoutput_size, false);
+		}
+	}
+
+	Server->Log("Not successful (cdc). Returning filesize "+convert(filesize_out), LL_DEBUG);
+
+	return rc;
+}
+
 _u32 FileClientChunked::handle_data( char* buf, size_t bsize, bool ignore_filesize, bool allow_reconnect, IFile** sparse_extents_f)
 {
 	reconnected=false;
@@ -2075,6 +2584,7 @@ void FileClientChunked::incrQueuedChunks()
 	else
 	{
 		++queued_chunks;
+		queue_estimator->requestSent();
 	}
 }
 
@@ -2087,6 +2597,7 @@ void FileClientChunked::decrQueuedChunks()
 	else
 	{
 		--queued_chunks;
+		queue_estimator->requestDone(Server->getTimeMS());
 	}
 }
 
@@ -2099,7 +2610,30 @@ void FileClientChunked::resetQueuedChunks()
 	else
 	{
 		queued_chunks = 0;
+		queue_estimator->reset();
+	}
+}
+
+QueueDepthEstimator* FileClientChunked::queueEstimator()
+{
+	if(parent)
+	{
+		return parent->queueEstimator();
+	}
+	else
+	{
+		return queue_estimator.get();
+	}
+}
+
+QueueDepthEstimator::SState FileClientChunked::getQueueState()
+{
+	QueueDepthEstimator* estimator = queueEstimator();
+	if(estimator==NULL)
+	{
+		return QueueDepthEstimator::SState();
 	}
+	return estimator->getState();
 }
 
 IPipe* FileClientChunked::ofbPipe()
@@ -2134,8 +2668,11 @@ void FileClientChunked::addReceivedBytes( size_t bytes )
 	}
 	else
 	{
-		IScopedLock lock(mutex);
-		received_data_bytes += bytes;
+		{
+			IScopedLock lock(mutex);
+			received_data_bytes += bytes;
+		}
+		queue_estimator->addDeliveredBytes(bytes);
 	}
 }
 
@@ -2199,6 +2736,20 @@ void FileClientChunked::logTransferProgress()
 	}	
 }
 
+void FileClientChunked::setContentDefinedChunking(bool b)
+{
+	cdc_enabled = b;
+}
+
+bool FileClientChunked::useCdc(IFile* orig_file, bool is_script)
+{
+	bool enabled = parent!=NULL ? parent->cdc_enabled : cdc_enabled;
+
+	return enabled && !is_script
+		&& orig_file!=NULL
+		&& orig_file->Size()>=c_cdc_min_filesize;
+}
+
 void FileClientChunked::setProgressLogCallback( FileClient::ProgressLogCallback* cb )
 {
 	progress_log_callback=cb;
@@ -9,13 +9,15 @@
 #include "../ExtentIterator.h"
 #include <map>
 #include <deque>
+#include <memory>
 
 class IFile;
 class IPipe;
 class CTCPStack;
 
-const unsigned int c_max_queued_chunks=1000;
-const unsigned int c_queued_chunks_low=100;
+const unsigned int c_min_queued_chunks=4;
+const unsigned int c_initial_queued_chunks=100;
+const unsigned int c_max_queued_chunks=4000;
 
 enum EChunkedState
 {
@@ -32,6 +34,12 @@ struct SChunkHashes
 	char small_hash[small_hash_size*(c_checkpoint_dist/c_small_hash_dist)];
 };
 
+struct SCdcOldChunk
+{
+	_i64 offset;
+	unsigned int size;
+};
+
 int64 get_hashdata_size(int64 hashfilesize);
 
 class FileClientChunked
@@ -77,6 +85,8 @@ public:
 
 	void resetReceivedDataBytes(bool with_sparse);
 
+	QueueDepthEstimator::SState getQueueState();
+
 	void addThrottler(IPipeThrottler *throttler);
 
 	IPipe *getPipe();
@@ -87,6 +97,8 @@ public:
 
 	void setProgressLogCallback(FileClient::ProgressLogCallback* cb);
 
+	void setContentDefinedChunking(bool b);
+
 	_u32 getErrorcode1();
 
 	_u32 getErrorcode2();
@@ -105,6 +117,19 @@ private:
 
 	_u32 GetFile(std::string remotefn, _i64& filesize_out, int64 file_id, IFile** sparse_extents_f);
 
+	_u32 GetFilePatchCdc(std::string remotefn, _i64& filesize_out, int64 file_id, IFile** sparse_extents_f);
+
+	_u32 readHashfilesize();
+
+	bool useCdc(IFile* orig_file, bool is_script);
+
+	bool chunkOldFileCdc(std::vector<SCdcOldChunk>& old_chunks, std::vector<char>& old_hashes);
+
+	void Cdc_hash(const char* buf, unsigned int bsize);
+	void Cdc_hashFinalizeBlock();
+
+	_u32 Cdc_failure(_u32 rc, bool reconnect, _i64& filesize_out);
+
 	_u32 handle_data(char* buf, size_t bsize, bool ignore_filesize, bool allow_reconnect, IFile** sparse_extents_f);
 
 	void State_First(void);
@@ -146,6 +171,7 @@ private:
 	void incrQueuedChunks();
 	void decrQueuedChunks();
 	void resetQueuedChunks();
+	QueueDepthEstimator* queueEstimator();
 
 	void addReceivedBytes(size_t bytes);
 
@@ -250,6 +276,7 @@ private:
 	IMutex* mutex;
 
 	FileClientChunked* parent;
+	std::auto_ptr<QueueDepthEstimator> queue_estimator;
 	bool did_queue_fc;
 	std::deque<FileClientChunked*> queued_fcs;
 
@@ -283,6 +310,8 @@ private:
 	IFsFile::SSparseExtent curr_sparse_extent;
 
 	int reconnect_tries;
+
+	bool cdc_enabled;
 };
 
 #endif //FILECLIENTCHUNKED_H
\ No newline at end of file
@@ -0,0 +1,222 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "QueueDepthEstimator.h"
+#include "../../Interface/Server.h"
+#include "../../Interface/Mutex.h"
+#include <algorithm>
+#include <math.h>
+
+namespace
+{
+	const int64 c_min_rtt_window = 10000;
+	const int64 c_min_rtt_window_rtts = 40;
+	const int64 c_probe_rtt_time = 200;
+	const int64 c_min_rate_interval = 100;
+	const size_t c_rate_window = 10;
+	const double c_depth_gain = 2.0;
+}
+
+QueueDepthEstimator::QueueDepthEstimator(size_t min_depth, size_t initial_depth, size_t max_depth)
+	: min_depth(min_depth), initial_depth(initial_depth), max_depth(max_depth), depth(initial_depth),
+	min_rtt(-1), min_rtt_stamp(0), probe_rtt_end(0), probe_min_rtt(-1),
+	interval_start(0), interval_done(0), interval_bytes(0), interval_app_limited(true),
+	rate_samples(c_rate_window, 0), bw_samples(c_rate_window, 0), sample_pos(0),
+	max_rate(0), max_bw(0)
+{
+	mutex = Server->createMutex();
+}
+
+QueueDepthEstimator::~QueueDepthEstimator()
+{
+	Server->destroy(mutex);
+}
+
+void QueueDepthEstimator::requestSent()
+{
+	IScopedLock lock(mutex);
+
+	SSentRequest req;
+	req.time = Server->getTimeMS();
+	//Sent while probing and after the queue drained, so it is not delayed by earlier requests
+	req.probe = probe_rtt_end != 0 && sent_times.size() < min_depth;
+	sent_times.push_back(req);
+
+	if (sent_times.size() >= depth)
+	{
+		interval_app_limited = false;
+	}
+}
+
+void QueueDepthEstimator::requestDone(int64 receive_time)
+{
+	IScopedLock lock(mutex);
+
+	if (sent_times.empty())
+	{
+		return;
+	}
+
+	updateRtt((std::max)(receive_time - sent_times.front().time, static_cast<int64>(0)),
+		sent_times.front().probe, receive_time);
+	sent_times.pop_front();
+
+	++interval_done;
+	updateRate(receive_time);
+}
+
+void QueueDepthEstimator::addDeliveredBytes(int64 bytes)
+{
+	IScopedLock lock(mutex);
+	interval_bytes += bytes;
+}
+
+void QueueDepthEstimator::reset()
+{
+	IScopedLock lock(mutex);
+
+	sent_times.clear();
+	interval_start = 0;
+	interval_done = 0;
+	interval_bytes = 0;
+	interval_app_limited = true;
+}
+
+size_t QueueDepthEstimator::getDepth()
+{
+	IScopedLock lock(mutex);
+	updateDepth(Server->getTimeMS());
+	return depth;
+}
+
+size_t QueueDepthEstimator::getLowDepth()
+{
+	IScopedLock lock(mutex);
+	updateDepth(Server->getTimeMS());
+	return (std::max)(depth * 3 / 4, static_cast<size_t>(1));
+}
+
+QueueDepthEstimator::SState QueueDepthEstimator::getState()
+{
+	IScopedLock lock(mutex);
+
+	SState ret;
+	ret.min_rtt_ms = min_rtt;
+	ret.bandwidth_bps = static_cast<int64>(max_bw);
+	ret.requests_ps = max_rate;
+	ret.depth = depth;
+	ret.in_flight = sent_times.size();
+	ret.probe_rtt = probe_rtt_end != 0;
+	return ret;
+}
+
+void QueueDepthEstimator::updateRtt(int64 rtt, bool probe, int64 ctime)
+{
+	if (probe)
+	{
+		if (probe_min_rtt < 0
+			|| rtt < probe_min_rtt)
+		{
+			probe_min_rtt = rtt;
+		}
+	}
+
+	if (min_rtt < 0
+		|| rtt <= min_rtt)
+	{
+		min_rtt = rtt;
+		min_rtt_stamp = ctime;
+	}
+}
+
+void QueueDepthEstimator::updateRate(int64 ctime)
+{
+	if (interval_start == 0)
+	{
+		interval_start = ctime;
+		return;
+	}
+
+	int64 passed = ctime - interval_start;
+	if (passed < (std::max)(c_min_rate_interval, min_rtt))
+	{
+		return;
+	}
+
+	//Samples taken while probing the round trip time or while the queue
+	//was not filled up only say something if they are higher than the current maximum
+	bool limited = interval_app_limited || probe_rtt_end != 0;
+
+	double rate = (interval_done * 1000.0) / passed;
+	double bw = (interval_bytes * 1000.0) / passed;
+
+	if (!limited || rate > max_rate)
+	{
+		rate_samples[sample_pos] = rate;
+		bw_samples[sample_pos] = bw;
+		sample_pos = (sample_pos + 1) % c_rate_window;
+
+		max_rate = *std::max_element(rate_samples.begin(), rate_samples.end());
+		max_bw = *std::max_element(bw_samples.begin(), bw_samples.end());
+	}
+
+	interval_start = ctime;
+	interval_done = 0;
+	interval_bytes = 0;
+	interval_app_limited = true;
+}
+
+void QueueDepthEstimator::updateDepth(int64 ctime)
+{
+	if (probe_rtt_end != 0)
+	{
+		//Keep probing until a request sent after the queue drained has completed
+		if (ctime < probe_rtt_end
+			|| probe_min_rtt < 0)
+		{
+			return;
+		}
+
+		min_rtt = probe_min_rtt;
+		min_rtt_stamp = ctime;
+		probe_rtt_end = 0;
+		probe_min_rtt = -1;
+	}
+	else if (min_rtt >= 0
+		&& ctime - min_rtt_stamp > (std::max)(c_min_rtt_window, c_min_rtt_window_rtts*min_rtt))
+	{
+		//Drain the queue for a short time so the round trip time
+		//can be measured without queueing delay
+		min_rtt_stamp = ctime;
+		probe_rtt_end = ctime + c_probe_rtt_time + min_rtt;
+		probe_min_rtt = -1;
+		depth = min_depth;
+		return;
+	}
+
+	if (min_rtt < 0 || max_rate <= 0)
+	{
+		depth = initial_depth;
+		return;
+	}
+
+	double bdp = max_rate * (std::max)(min_rtt, static_cast<int64>(1)) / 1000.0;
+	size_t target = static_cast<size_t>(ceil(c_depth_gain * bdp));
+
+	depth = (std::min)((std::max)(target, min_depth), max_depth);
+}
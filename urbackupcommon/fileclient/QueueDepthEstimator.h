@@ -0,0 +1,81 @@
+#pragma once
+
+#include "../../Interface/Types.h"
+#include <deque>
+#include <vector>
+
+class IMutex;
+
+/**
+* Estimates how many requests should be in flight on one connection.
+* Keeps a windowed minimum of the request round trip time and a windowed
+* maximum of the request completion rate. The queue depth is a multiple of
+* their product (the bandwidth-delay product in requests).
+* Periodically (every 10s, or every 40 round trips on slow links) the depth
+* is lowered for a short time to measure the round trip time without
+* queueing delay. Only requests sent after the queue has
+* drained to the lowered depth are used for that measurement.
+*/
+class QueueDepthEstimator
+{
+public:
+	struct SState
+	{
+		int64 min_rtt_ms;
+		int64 bandwidth_bps;
+		double requests_ps;
+		size_t depth;
+		size_t in_flight;
+		bool probe_rtt;
+	};
+
+	QueueDepthEstimator(size_t min_depth, size_t initial_depth, size_t max_depth);
+	~QueueDepthEstimator();
+
+	void requestSent();
+	void requestDone(int64 receive_time);
+	void addDeliveredBytes(int64 bytes);
+	void reset();
+
+	size_t getDepth();
+	size_t getLowDepth();
+
+	SState getState();
+
+private:
+	void updateRtt(int64 rtt, bool probe, int64 ctime);
+	void updateRate(int64 ctime);
+	void updateDepth(int64 ctime);
+
+	IMutex* mutex;
+
+	size_t min_depth;
+	size_t initial_depth;
+	size_t max_depth;
+	size_t depth;
+
+	struct SSentRequest
+	{
+		int64 time;
+		bool probe;
+	};
+
+	std::deque<SSentRequest> sent_times;
+
+	int64 min_rtt;
+	int64 min_rtt_stamp;
+
+	int64 probe_rtt_end;
+	int64 probe_min_rtt;
+
+	int64 interval_start;
+	size_t interval_done;
+	int64 interval_bytes;
+	bool interval_app_limited;
+
+	std::vector<double> rate_samples;
+	std::vector<double> bw_samples;
+	size_t sample_pos;
+	double max_rate;
+	double max_bw;
+};
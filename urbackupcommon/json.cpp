@@ -19,9 +19,49 @@
 #include "json.h"
 #include "../stringtools.h"
 #include "../Interface/Server.h"
+#include <algorithm>
 
 namespace JSON
 {
+	namespace
+	{
+		void escape_append(const char* t, size_t tsize, std::string& r)
+		{
+			for(size_t i=0;i<tsize;++i)
+			{
+				if(t[i]=='\\')
+				{
+					r+="\\\\";
+				}
+				else if(t[i]=='"')
+				{
+					r+="\\\"";
+				}
+				else if(t[i]=='\n')
+				{
+					r+="\\n";
+				}
+				else if(t[i]=='\r')
+				{
+					r+="\\r";
+				}
+				else if(t[i]>=0 && t[i]<32)
+				{
+					std::string hex = byteToHex(static_cast<unsigned char>(t[i]));
+					if(hex.size()<2)
+					{
+						hex="0"+hex;
+					}
+					r+="\\u00"+hex;
+				}
+				else
+				{
+					r+=t[i];
+				}
+			}
+		}
+	}
+
 	//---------------Array-------------------
 	Array::Array(void)
 	{
@@ -65,6 +105,11 @@ namespace JSON
 		return r;
 	}
 
+	const std::vector<Value>& Array::get_data() const
+	{
+		return data;
+	}
+
 	//---------------Object-------------------
 	Object::Object(void)
 	{
@@ -120,7 +165,7 @@ namespace JSON
 		return r;
 	}
 
-	const std::map<std::string, Value>& Object::get_data()
+	const std::map<std::string, Value>& Object::get_data() const
 	{
 		return data;
 	}
@@ -331,38 +376,7 @@ namespace JSON
     std::string Value::escape(const std::string &t) const
 	{
 		std::string r;
-		for(size_t i=0;i<t.size();++i)
-		{
-			if(t[i]=='\\')
-			{
-				r+="\\\\";
-			}
-			else if(t[i]=='"')
-			{
-				r+="\\\"";
-			}
-			else if(t[i]=='\n')
-			{
-				r+="\\n";
-			}
-			else if(t[i]=='\r')
-			{
-				r+="\\r";
-			}
-			else if(t[i]>=0 && t[i]<32)
-			{
-				std::string hex = byteToHex(static_cast<unsigned char>(t[i]));
-				if(hex.size()<2)
-				{
-					hex="0"+hex;
-				}
-				r+="\\u00"+hex;
-			}
-			else
-			{
-				r+=t[i];
-			}
-		}
+		escape_append(t.data(), t.size(), r);
 		return r;
 	}
 
@@ -524,4 +538,217 @@ namespace JSON
 	{
 		return data_type;
 	}
+
+	//---------------StreamWriter-------------------
+	StreamWriter::StreamWriter(IStreamOutput* output, size_t flush_size)
+		: output(output), flush_size(flush_size), ok(true)
+	{
+	}
+
+	void StreamWriter::beginObject(void)
+	{
+		nextElement();
+		buf+="{";
+		has_elements.push_back(false);
+	}
+
+	void StreamWriter::beginObject(const std::string &key)
+	{
+		writeKey(key);
+		buf+="{";
+		has_elements.push_back(false);
+	}
+
+	void StreamWriter::endObject(void)
+	{
+		buf+="}";
+		if(!has_elements.empty())
+			has_elements.pop_back();
+		checkFlush();
+	}
+
+	void StreamWriter::beginArray(void)
+	{
+		nextElement();
+		buf+="[";
+		has_elements.push_back(false);
+	}
+
+	void StreamWriter::beginArray(const std::string &key)
+	{
+		writeKey(key);
+		buf+="[";
+		has_elements.push_back(false);
+	}
+
+	void StreamWriter::endArray(void)
+	{
+		buf+="]";
+		if(!has_elements.empty())
+			has_elements.pop_back();
+		checkFlush();
+	}
+
+	void StreamWriter::set(const std::string &key, const Value &val)
+	{
+		writeKey(key);
+		writeValue(val);
+		checkFlush();
+	}
+
+	void StreamWriter::set(const std::string &key, const Object &val)
+	{
+		writeKey(key);
+		writeObject(val);
+		checkFlush();
+	}
+
+	void StreamWriter::set(const std::string &key, const Array &val)
+	{
+		writeKey(key);
+		writeArray(val);
+		checkFlush();
+	}
+
+	void StreamWriter::setMembers(const Object &val)
+	{
+		const std::map<std::string, Value>& data = val.get_data();
+		for(std::map<std::string, Value>::const_iterator it=data.begin();it!=data.end();++it)
+		{
+			writeKey(it->first);
+			writeValue(it->second);
+		}
+		checkFlush();
+	}
+
+	void StreamWriter::add(const Value &val)
+	{
+		nextElement();
+		writeValue(val);
+		checkFlush();
+	}
+
+	void StreamWriter::add(const Object &val)
+	{
+		nextElement();
+		writeObject(val);
+		checkFlush();
+	}
+
+	void StreamWriter::add(const Array &val)
+	{
+		nextElement();
+		writeArray(val);
+		checkFlush();
+	}
+
+	bool StreamWriter::flush(void)
+	{
+		if(!buf.empty() && ok)
+		{
+			ok = output->write(buf);
+		}
+		buf.clear();
+		return ok;
+	}
+
+	bool StreamWriter::good(void) const
+	{
+		return ok;
+	}
+
+	size_t StreamWriter::depth(void) const
+	{
+		return has_elements.size();
+	}
+
+	void StreamWriter::nextElement(void)
+	{
+		if(has_elements.empty())
+			return;
+
+		if(has_elements.back())
+		{
+			buf+=",";
+		}
+		else
+		{
+			has_elements.back()=true;
+		}
+	}
+
+	void StreamWriter::writeKey(const std::string &key)
+	{
+		nextElement();
+		buf+="\"";
+		escape_append(key.data(), key.size(), buf);
+		buf+="\":";
+	}
+
+	void StreamWriter::writeValue(const Value &val)
+	{
+		switch(val.getType())
+		{
+		case str_type:
+			writeString(val.getString());
+			break;
+		case obj_type:
+			writeObject(val.getObject());
+			break;
+		case array_type:
+			writeArray(val.getArray());
+			break;
+		default:
+			buf+=val.stringify(true);
+		}
+	}
+
+	void StreamWriter::writeObject(const Object &val)
+	{
+		const std::map<std::string, Value>& data = val.get_data();
+		buf+="{";
+		has_elements.push_back(false);
+		for(std::map<std::string, Value>::const_iterator it=data.begin();it!=data.end();++it)
+		{
+			writeKey(it->first);
+			writeValue(it->second);
+			checkFlush();
+		}
+		has_elements.pop_back();
+		buf+="}";
+	}
+
+	void StreamWriter::writeArray(const Array &val)
+	{
+		const std::vector<Value>& data = val.get_data();
+		buf+="[";
+		has_elements.push_back(false);
+		for(size_t i=0;i<data.size();++i)
+		{
+			nextElement();
+			writeValue(data[i]);
+			checkFlush();
+		}
+		has_elements.pop_back();
+		buf+="]";
+	}
+
+	void StreamWriter::writeString(const std::string &str)
+	{
+		buf+="\"";
+		for(size_t i=0;i<str.size();i+=flush_size)
+		{
+			escape_append(str.data()+i, (std::min)(flush_size, str.size()-i), buf);
+			checkFlush();
+		}
+		buf+="\"";
+	}
+
+	void StreamWriter::checkFlush(void)
+	{
+		if(buf.size()>=flush_size)
+		{
+			flush();
+		}
+	}
 }
@@ -23,6 +23,8 @@ namespace JSON
 		void erase(size_t idx);
 
         std::string stringify(bool compressed) const;
+
+		const std::vector<Value>& get_data() const;
 	private:
 		std::vector<Value> data;
 	};
@@ -39,7 +41,7 @@ namespace JSON
 
         std::string stringify(bool compressed) const;
 
-		const std::map<std::string, Value>& get_data();
+		const std::map<std::string, Value>& get_data() const;
 
 	private:
 		std::map<std::string, Value> data;
@@ -126,4 +128,51 @@ namespace JSON
 		void *data;
 		Value_type data_type;
 	};
+
+	class IStreamOutput
+	{
+	public:
+		virtual bool write(const std::string &data)=0;
+	};
+
+	class StreamWriter
+	{
+	public:
+		StreamWriter(IStreamOutput* output, size_t flush_size=32768);
+
+		void beginObject(void);
+		void beginObject(const std::string &key);
+		void endObject(void);
+
+		void beginArray(void);
+		void beginArray(const std::string &key);
+		void endArray(void);
+
+		void set(const std::string &key, const Value &val);
+		void set(const std::string &key, const Object &val);
+		void set(const std::string &key, const Array &val);
+		void setMembers(const Object &val);
+		void add(const Value &val);
+		void add(const Object &val);
+		void add(const Array &val);
+
+		bool flush(void);
+		bool good(void) const;
+		size_t depth(void) const;
+
+	private:
+		void nextElement(void);
+		void writeKey(const std::string &key);
+		void writeValue(const Value &val);
+		void writeObject(const Object &val);
+		void writeArray(const Array &val);
+		void writeString(const std::string &str);
+		void checkFlush(void);
+
+		IStreamOutput* output;
+		size_t flush_size;
+		std::string buf;
+		std::vector<bool> has_elements;
+		bool ok;
+	};
 }
@@ -60,6 +60,23 @@ bool os_create_dir(const std::string &dir);
 
 bool os_create_hardlink(const std::string &linkname, const std::string &fname, bool use_ioref, bool* too_many_links);
 
+bool os_create_reflink(const std::string &linkname, const std::string &fname);
+
+struct SHardlinkOp
+{
+	SHardlinkOp(const std::string &linkname, const std::string &fname, bool use_ioref)
+		: linkname(linkname), fname(fname), use_ioref(use_ioref), ok(false) {}
+
+	std::string linkname;
+	std::string fname;
+	bool use_ioref;
+	bool ok;
+};
+
+//Creates the links ops[begin, end). Links from and to the same directories are created relative
+//to cached directory handles, so ops should be sorted by directory.
+void os_create_hardlinks(std::vector<SHardlinkOp>& ops, size_t begin, size_t end);
+
 int64 os_free_space(const std::string &path);
 
 int64 os_total_space(const std::string &path);
@@ -115,6 +132,11 @@ bool copy_file(const std::string &src, const std::string &dst, bool flush = fals
 class IFile;
 bool copy_file(IFile *fsrc, IFile *fdst, std::string* error_str = NULL);
 
+class IFsFile;
+//Lets dst share the storage of an identical range in src. Returns the number of
+//bytes deduplicated, 0 if the ranges differ and -1 on error
+int64 os_dedupe_file_range(IFsFile* src, int64 src_offset, IFsFile* dst, int64 dst_offset, int64 length);
+
 bool os_path_absolute(const std::string& path);
 
 bool os_sync(const std::string& path);
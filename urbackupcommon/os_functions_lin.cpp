@@ -29,6 +29,7 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <algorithm>
+#include <map>
 #include <memory.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -333,6 +334,61 @@ bool os_create_reflink(const std::string &linkname, const std::string &fname)
 #endif
 }
 
+int64 os_dedupe_file_range(IFsFile* src, int64 src_offset, IFsFile* dst, int64 dst_offset, int64 length)
+{
+#ifdef __linux__
+#ifndef FIDEDUPERANGE
+	struct file_dedupe_range_info
+	{
+		int64_t dest_fd;
+		uint64_t dest_offset;
+		uint64_t bytes_deduped;
+		int32_t status;
+		uint32_t reserved;
+	};
+
+	struct file_dedupe_range
+	{
+		uint64_t src_offset;
+		uint64_t src_length;
+		uint16_t dest_count;
+		uint16_t reserved1;
+		uint32_t reserved2;
+	};
+#define FILE_DEDUPE_RANGE_DIFFERS 1
+#define FIDEDUPERANGE _IOWR(0x94, 54, struct file_dedupe_range)
+#endif
+	int64 buf[(sizeof(file_dedupe_range) + sizeof(file_dedupe_range_info)) / sizeof(int64) + 1] = {};
+	file_dedupe_range* range = reinterpret_cast<file_dedupe_range*>(buf);
+	file_dedupe_range_info* info = reinterpret_cast<file_dedupe_range_info*>(reinterpret_cast<char*>(buf) + sizeof(file_dedupe_range));
+
+	range->src_offset = src_offset;
+	range->src_length = length;
+	range->dest_count = 1;
+	info->dest_fd = dst->getOsHandle();
+	info->dest_offset = dst_offset;
+
+	if (ioctl(src->getOsHandle(), FIDEDUPERANGE, range) != 0)
+	{
+		return -1;
+	}
+
+	if (info->status == FILE_DEDUPE_RANGE_DIFFERS)
+	{
+		return 0;
+	}
+	else if (info->status < 0)
+	{
+		errno = -info->status;
+		return -1;
+	}
+
+	return static_cast<int64>(info->bytes_deduped);
+#else
+	return -1;
+#endif
+}
+
 bool os_create_hardlink(const std::string &linkname, const std::string &fname, bool use_ioref, bool* too_many_links)
 {
 	if(too_many_links!=NULL)
@@ -345,6 +401,113 @@ bool os_create_hardlink(const std::string &linkname, const std::string &fname, b
 	return rc==0;
 }
 
+#ifndef sun
+namespace
+{
+	const size_t c_max_cached_dir_fds=64;
+
+	void close_dir_fds(std::map<std::string, int>& dir_fds)
+	{
+		for(std::map<std::string, int>::iterator it=dir_fds.begin();it!=dir_fds.end();++it)
+		{
+			close(it->second);
+		}
+		dir_fds.clear();
+	}
+
+	int cached_dir_fd(std::map<std::string, int>& dir_fds, const std::string& dir)
+	{
+		std::map<std::string, int>::iterator it=dir_fds.find(dir);
+		if(it!=dir_fds.end())
+		{
+			return it->second;
+		}
+
+		int fd=open64(dir.c_str(), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+		if(fd>=0)
+		{
+			dir_fds[dir]=fd;
+		}
+		return fd;
+	}
+
+	bool create_reflink_at(int src_dir, const std::string& src_name, int dst_dir, const std::string& dst_name)
+	{
+		int src_desc=openat(src_dir, src_name.c_str(), O_RDONLY|O_CLOEXEC);
+		if(src_desc<0)
+		{
+			return false;
+		}
+
+		int dst_desc=openat(dst_dir, dst_name.c_str(), O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, S_IRWXU|S_IRWXG);
+		if(dst_desc<0)
+		{
+			close(src_desc);
+			return false;
+		}
+
+		int rc=ioctl(dst_desc, BTRFS_IOC_CLONE, src_desc);
+
+		close(src_desc);
+		close(dst_desc);
+
+		if(rc)
+		{
+			unlinkat(dst_dir, dst_name.c_str(), 0);
+		}
+
+		return rc==0;
+	}
+}
+#endif
+
+void os_create_hardlinks(std::vector<SHardlinkOp>& ops, size_t begin, size_t end)
+{
+#ifndef sun
+	std::map<std::string, int> dir_fds;
+
+	for(size_t i=begin;i<end;++i)
+	{
+		SHardlinkOp& op=ops[i];
+
+		//Evict before looking up both directories, so that the source
+		//directory fd stays open while the destination one is opened
+		if(dir_fds.size()+2>c_max_cached_dir_fds)
+		{
+			close_dir_fds(dir_fds);
+		}
+
+		int src_dir=cached_dir_fd(dir_fds, ExtractFilePath(op.fname, "/"));
+		int dst_dir=cached_dir_fd(dir_fds, ExtractFilePath(op.linkname, "/"));
+
+		if(src_dir<0 || dst_dir<0)
+		{
+			op.ok=os_create_hardlink(op.linkname, op.fname, op.use_ioref, NULL);
+			continue;
+		}
+
+		std::string src_name=ExtractFileName(op.fname, "/");
+		std::string dst_name=ExtractFileName(op.linkname, "/");
+
+		if(op.use_ioref)
+		{
+			op.ok=create_reflink_at(src_dir, src_name, dst_dir, dst_name);
+		}
+		else
+		{
+			op.ok=linkat(src_dir, src_name.c_str(), dst_dir, dst_name.c_str(), 0)==0;
+		}
+	}
+
+	close_dir_fds(dir_fds);
+#else
+	for(size_t i=begin;i<end;++i)
+	{
+		ops[i].ok=os_create_hardlink(ops[i].linkname, ops[i].fname, ops[i].use_ioref, NULL);
+	}
+#endif
+}
+
 int64 os_free_space(const std::string &path)
 {
 	std::string cp=path;
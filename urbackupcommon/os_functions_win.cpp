@@ -24,6 +24,7 @@
 #include <winsock2.h>
 #include <windows.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <algorithm>
 
 #include <io.h>
@@ -546,6 +547,12 @@ bool os_create_dir(const std::string &dir)
 	return CreateDirectoryW(ConvertToWchar(dir).c_str(), NULL)!=0;
 }
 
+int64 os_dedupe_file_range(IFsFile* src, int64 src_offset, IFsFile* dst, int64 dst_offset, int64 length)
+{
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
 bool os_create_hardlink(const std::string &linkname, const std::string &fname, bool use_ioref, bool* too_many_links)
 {
 	if (use_ioref)
@@ -569,6 +576,14 @@ bool os_create_hardlink(const std::string &linkname, const std::string &fname, b
 	return r!=0;
 }
 
+void os_create_hardlinks(std::vector<SHardlinkOp>& ops, size_t begin, size_t end)
+{
+	for(size_t i=begin;i<end;++i)
+	{
+		ops[i].ok=os_create_hardlink(ops[i].linkname, ops[i].fname, ops[i].use_ioref, NULL);
+	}
+}
+
 int64 os_free_space(const std::string &path)
 {
 	std::string cp=path;
@@ -70,6 +70,7 @@ std::vector<std::string> getSettingsList(void)
 	ret.push_back("internet_full_file_transfer_mode");
 	ret.push_back("local_incr_file_transfer_mode");
 	ret.push_back("internet_incr_file_transfer_mode");
+	ret.push_back("incr_file_transfer_cdc");
 	ret.push_back("local_image_transfer_mode");
 	ret.push_back("internet_image_transfer_mode");
 	ret.push_back("end_to_end_file_backup_verification");
@@ -87,6 +88,8 @@ std::vector<std::string> getSettingsList(void)
 	ret.push_back("internet_full_image_style");
 	ret.push_back("create_linked_user_views");
 	ret.push_back("max_running_jobs_per_client");
+	ret.push_back("local_file_download_streams");
+	ret.push_back("internet_file_download_streams");
 	ret.push_back("cbt_volumes");
 	ret.push_back("cbt_crash_persistent_volumes");
 	ret.push_back("ignore_disk_errors");
@@ -112,6 +115,7 @@ std::vector<std::string> getOnlyServerClientSettingsList(void)
 	ret.push_back("internet_full_file_transfer_mode");
 	ret.push_back("local_incr_file_transfer_mode");
 	ret.push_back("internet_incr_file_transfer_mode");
+	ret.push_back("incr_file_transfer_cdc");
 	ret.push_back("local_image_transfer_mode");
 	ret.push_back("internet_image_transfer_mode");
 	ret.push_back("end_to_end_file_backup_verification");
@@ -127,6 +131,8 @@ std::vector<std::string> getOnlyServerClientSettingsList(void)
 	ret.push_back("internet_full_image_style");
 	ret.push_back("create_linked_user_views");
 	ret.push_back("max_running_jobs_per_client");
+	ret.push_back("local_file_download_streams");
+	ret.push_back("internet_file_download_streams");
 	ret.push_back("cbt_volumes");
 	ret.push_back("cbt_crash_persistent_volumes");
 	ret.push_back("ignore_disk_errors");
@@ -177,6 +183,9 @@ std::vector<std::string> getGlobalSettingsList(void)
 	ret.push_back("use_tmpfiles_images");
 	ret.push_back("tmpdir");
 	ret.push_back("update_stats_cachesize");
+	ret.push_back("file_index_check_rate");
+	ret.push_back("file_index_check_repair");
+	ret.push_back("chunk_dedup");
 	ret.push_back("global_soft_fs_quota");
 	ret.push_back("show_server_updates");
 	ret.push_back("server_url");
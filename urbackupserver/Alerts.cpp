@@ -2,6 +2,8 @@
 #include "../Interface/Database.h"
 #include "database.h"
 #include "../Interface/Server.h"
+#include "../Interface/Mutex.h"
+#include "../Interface/Condition.h"
 #include "server_settings.h"
 #include "../stringtools.h"
 #include "../luaplugin/ILuaInterpreter.h"
@@ -9,6 +11,7 @@
 #include "Mailer.h"
 #define MINIZ_NO_ZLIB_COMPATIBLE_NAMES
 #include "../common/miniz.h"
+#include <algorithm>
 
 extern ILuaInterpreter* lua_interpreter;
 extern IUrlFactory *url_fak;
@@ -63,45 +66,11 @@ std::string get_alert_script(IDatabase* db, int script_id)
 
 namespace
 {
-	struct SScriptParam
-	{
-		std::string name;
-		std::string default_value;
-		std::string type;
-	};
-
-	struct SScript
-	{
-		std::string code;
-		std::vector<SScriptParam> params;
-		std::string global;
-	};
-
-	SScript prepareScript(IDatabase* db, ILuaInterpreter* lua_interpreter, int script_id)
-	{
-		SScript ret;
-		ret.code = get_alert_script(db, script_id);
-
-		if (!ret.code.empty())
-		{
-			ret.code = lua_interpreter->compileScript(ret.code);
-		}
-
-		if (ret.code.empty())
-		{
-			return SScript();
-		}
-
-		db_results res_params = db->Read("SELECT name, default_value, type FROM alert_script_params WHERE script_id="+convert(script_id));
-
-		for (size_t i = 0; i < res_params.size(); ++i)
-		{
-			SScriptParam param = { res_params[i]["name"], res_params[i]["default_value"], res_params[i]["type"] };
-			ret.params.push_back(param);
-		}
-
-		return ret;
-	}
+	const int64 c_startup_wait = 60 * 1000;
+	const int64 c_min_recheck_interval = 60 * 1000;
+	const int64 c_reconcile_interval = 10 * 60 * 1000;
+	const int64 c_stats_interval = 60 * 60 * 1000;
+	const size_t c_max_batch = 100;
 
 	class MailBridge : public ILuaInterpreter::IEMailFunction
 	{
@@ -124,6 +93,62 @@ namespace
 	};
 }
 
+IMutex* Alerts::mutex = NULL;
+ICondition* Alerts::cond = NULL;
+std::multimap<int64, int> Alerts::timers;
+std::map<int, int64> Alerts::client_timers;
+bool Alerts::scripts_changed = false;
+
+Alerts::Alerts()
+	: db(NULL), q_get_alert_client(NULL), q_update_client(NULL)
+{
+}
+
+void Alerts::init_mutex()
+{
+	mutex = Server->createMutex();
+	cond = Server->createCondition();
+}
+
+void Alerts::checkClient(int clientid)
+{
+	IScopedLock lock(mutex);
+	schedule(clientid, 0);
+	cond->notify_all();
+}
+
+void Alerts::updateScripts()
+{
+	IScopedLock lock(mutex);
+	scripts_changed = true;
+	cond->notify_all();
+}
+
+void Alerts::schedule(int clientid, int64 due)
+{
+	std::map<int, int64>::iterator it = client_timers.find(clientid);
+	if (it != client_timers.end())
+	{
+		if (it->second <= due)
+		{
+			return;
+		}
+
+		std::pair<std::multimap<int64, int>::iterator, std::multimap<int64, int>::iterator> range = timers.equal_range(it->second);
+		for (std::multimap<int64, int>::iterator it_timer = range.first; it_timer != range.second; ++it_timer)
+		{
+			if (it_timer->second == clientid)
+			{
+				timers.erase(it_timer);
+				break;
+			}
+		}
+	}
+
+	client_timers[clientid] = due;
+	timers.insert(std::make_pair(due, clientid));
+}
+
 void Alerts::operator()()
 {
 	if (lua_interpreter == NULL)
@@ -131,218 +156,374 @@ void Alerts::operator()()
 		return;
 	}
 
-	IDatabase* db = Server->getDatabase(Server->getThreadID(), URBACKUPDB_SERVER);
+	Server->wait(c_startup_wait);
+
+	db = Server->getDatabase(Server->getThreadID(), URBACKUPDB_SERVER);
 
 	db->Write("UPDATE clients SET alerts_next_check=NULL");
 
-	IQuery* q_get_alert_clients = db->Prepare("SELECT id, name, file_ok, image_ok, alerts_state, strftime('%s', lastbackup) AS lastbackup, "
+	q_get_alert_client = db->Prepare("SELECT id, name, file_ok, image_ok, alerts_state, alerts_next_check, strftime('%s', lastbackup) AS lastbackup, "
 		"strftime('%s', lastseen) AS lastseen, strftime('%s', lastbackup_image) AS lastbackup_image, created, os_simple "
-		"FROM clients WHERE alerts_next_check IS NULL OR alerts_next_check<=?");
-	IQuery* q_update_client = db->Prepare("UPDATE clients SET  file_ok=?, image_ok=?, alerts_next_check=?, alerts_state=? WHERE id=?");
-
-	std::map<int, SScript> alert_scripts;
+		"FROM clients WHERE id=?");
+	q_update_client = db->Prepare("UPDATE clients SET  file_ok=?, image_ok=?, alerts_next_check=?, alerts_state=? WHERE id=?");
+	IQuery* q_get_unscheduled = db->Prepare("SELECT id FROM clients WHERE alerts_next_check IS NULL");
 
-	ILuaInterpreter::SInterpreterFunctions funcs;
 	funcs.mail_func = new MailBridge;
 	funcs.url_func = new UrlBridge;
 
+	int64 last_reconcile = 0;
+	int64 last_stats = Server->getTimeMS();
+
 	while (true)
 	{
-		Server->wait(60*1000);
+		if (Server->getTimeMS() - last_reconcile >= c_reconcile_interval)
+		{
+			//New clients and backup DAO updates reset alerts_next_check
+			//without notifying this thread
+			db_results res = q_get_unscheduled->Read();
+			q_get_unscheduled->Reset();
 
-		q_get_alert_clients->Bind(Server->getTimeMS());
-		db_results res = q_get_alert_clients->Read();
-		q_get_alert_clients->Reset();
+			IScopedLock lock(mutex);
+			for (size_t i = 0; i < res.size(); ++i)
+			{
+				schedule(watoi(res[i]["id"]), 0);
+			}
+
+			last_reconcile = Server->getTimeMS();
+		}
 
-		for (size_t i = 0; i < res.size(); ++i)
+		std::vector<int> due_clients;
+		bool reload_scripts;
 		{
-			int clientid = watoi(res[i]["id"]);
-			ServerSettings server_settings(db, clientid);
-			int script_id = server_settings.getSettings()->alert_script;
-			std::map<int, SScript>::iterator it = alert_scripts.find(script_id);
-			if (it == alert_scripts.end())
-			{
-				alert_scripts[script_id] = prepareScript(db, lua_interpreter, script_id);
-				it = alert_scripts.find(script_id);
-			}			
+			IScopedLock lock(mutex);
 
-			if (!it->second.code.empty())
+			int64 ctime = Server->getTimeMS();
+			while (!scripts_changed
+				&& (timers.empty() || timers.begin()->first > ctime))
 			{
-				ILuaInterpreter::Param params_raw;
-				ILuaInterpreter::Param::params_map& params = *params_raw.u.params;
-				params["clientid"] = clientid;
-				params["clientname"] = res[i]["name"];
-				int update_freq_file_incr = server_settings.getUpdateFreqFileIncr();
-				int update_freq_file_full = server_settings.getUpdateFreqFileIncr();
-				params["incr_file_interval"] = update_freq_file_incr;
-				params["full_file_interval"] = update_freq_file_full;
-				int update_freq_image_incr = server_settings.getUpdateFreqImageIncr();
-				int update_freq_image_full = server_settings.getUpdateFreqImageFull();
-				params["incr_image_interval"] = update_freq_image_incr;
-				params["full_image_interval"] = update_freq_image_full;
-				params["no_images"] = server_settings.getSettings()->no_images;
-				params["no_file_backups"] = server_settings.getSettings()->no_file_backups;
-				params["os_simple"] = res[i]["os_simple"];
-
-				int64 times = Server->getTimeSeconds();
-				int64 created = watoi64(res[i]["created"]);
-				int64 lastbackup_file = watoi64(res[i]["lastbackup"]);
-				int64 lastbackup_image = watoi64(res[i]["lastbackup_image"]);
-
-				params["passed_time_lastseen"] = times - watoi64(res[i]["lastseen"]);
-				params["passed_time_lastbackup_file"] = (std::min)(times - lastbackup_file, times - created);
-				params["passed_time_lastbackup_image"] = (std::min)(times - lastbackup_image, times - created);
-				params["lastbackup_file"] = lastbackup_file;
-				params["lastbackup_image"] = lastbackup_image;
-
-				SSettings* settings = server_settings.getSettings();
-
-				bool complex_file_interval = settings->update_freq_full.find(";") != std::string::npos
-					|| settings->update_freq_incr.find(";") != std::string::npos;
-
-				bool complex_image_interval = settings->update_freq_image_full.find(";") != std::string::npos
-					|| settings->update_freq_image_incr.find(";") != std::string::npos;
-
-				if ( complex_file_interval
-					|| complex_image_interval )
+				int64 wait_time = c_reconcile_interval - (ctime - last_reconcile);
+				if (!timers.empty())
 				{
-					params["complex_interval"] = true;
+					wait_time = (std::min)(wait_time, timers.begin()->first - ctime);
 				}
-				else
+
+				if (wait_time <= 0)
 				{
-					params["complex_interval"] = false;
+					break;
 				}
 
-				bool file_ok = res[i]["file_ok"] == "1";
-				params["file_ok"] = file_ok;
-				bool image_ok = res[i]["image_ok"] == "1";
-				params["image_ok"] = image_ok;
+				cond->wait(&lock, static_cast<int>(wait_time));
+				ctime = Server->getTimeMS();
+			}
 
-				str_map nondefault_params;
-				ParseParamStrHttp(server_settings.getSettings()->alert_params, &nondefault_params);
+			reload_scripts = scripts_changed;
+			scripts_changed = false;
 
-				for (size_t j = 0; j < it->second.params.size(); ++j)
-				{
-					SScriptParam& param = it->second.params[j];
-					str_map::iterator it_param = nondefault_params.find(param.name);
-					std::string val;
-					if (it_param != nondefault_params.end())
-					{
-						val = it_param->second;
-					}
-					else
-					{
-						val = param.default_value;
-					}
-
-					if (param.type == "int")
-					{
-						params[param.name] = watoi(val);
-					}
-					else if (param.type == "num")
-					{
-						params[param.name] = atof(val.c_str());
-					}
-					else if (param.type == "bool")
-					{
-						params[param.name] = val != "0";
-					}
-					else
-					{
-						params[param.name] = val;
-					}
-				}
+			while (!timers.empty()
+				&& timers.begin()->first <= ctime
+				&& due_clients.size() < c_max_batch)
+			{
+				due_clients.push_back(timers.begin()->second);
+				client_timers.erase(timers.begin()->second);
+				timers.erase(timers.begin());
+			}
+		}
 
-				std::string state = res[i]["alerts_state"];
-				int64 ret2;
-				int64 ret = lua_interpreter->runScript(it->second.code, params_raw, ret2, state, it->second.global, funcs);
-				bool needs_update = false;
-				
-				if (ret>=0)
-				{
-					file_ok = !(ret & 1);
-					image_ok = !(ret & 2);
-
-					if (file_ok != params["file_ok"].u.b
-						|| image_ok != params["image_ok"].u.b)
-					{
-						needs_update = true;
-					}
-				}
-				else
-				{
-					Server->Log("Error executing alert script id " + convert(script_id) + ". Return value " + convert(ret) + ".", LL_ERROR);
-				}
+		if (reload_scripts)
+		{
+			logStats();
+			clearScripts();
+			db->Write("UPDATE clients SET alerts_next_check=NULL");
+			last_reconcile = 0;
+		}
 
-				int64 next_check;
-				if (ret2 >= 0)
-				{
-					next_check = Server->getTimeMS() + ret2;
-					needs_update = true;
-				}
-				else
-				{
-					if (!file_ok
-						&& !image_ok)
-					{
-						next_check = Server->getTimeMS() + 1*60*60*1000;
-						needs_update = true;
-					}
-					else
-					{
-						next_check = Server->getTimeMS();
-					}
-				}
+		for (size_t i = 0; i < due_clients.size(); ++i)
+		{
+			evaluateClient(due_clients[i]);
+		}
 
-				if (state != res[i]["alerts_state"])
-				{
-					needs_update = true;
-				}
+		if (Server->getTimeMS() - last_stats >= c_stats_interval)
+		{
+			logStats();
+			last_stats = Server->getTimeMS();
+		}
+	}
+}
+
+Alerts::SScript& Alerts::getScript(int script_id)
+{
+	std::map<int, SScript>::iterator it = alert_scripts.find(script_id);
+	if (it != alert_scripts.end())
+	{
+		return it->second;
+	}
 
-				int i_file_ok = file_ok ? 1 : 0;
-				int i_image_ok = image_ok ? 1 : 0;
+	SScript& ret = alert_scripts[script_id];
 
-				if (settings->no_file_backups
-					&& res[i]["file_ok"] != "-1")
-				{
-					i_file_ok = -1;
-					needs_update = true;
-				}
-				else if (!complex_file_interval
-					&& update_freq_file_incr < 0
-					&& update_freq_file_full < 0
-					&& res[i]["file_ok"] != "-1")
-				{
-					i_file_ok = -1;
-					needs_update = true;
-				}
+	std::string code = get_alert_script(db, script_id);
 
-				if (settings->no_images
-					&& res[i]["image_ok"] != "-1")
-				{
-					i_image_ok = -1;
-					needs_update = true;
-				}
-				else if (!complex_image_interval
-					&& update_freq_image_full < 0
-					&& update_freq_image_incr < 0
-					&& res[i]["image_ok"] != "-1")
-				{
-					i_image_ok = -1;
-					needs_update = true;
-				}
+	if (!code.empty())
+	{
+		code = lua_interpreter->compileScript(code);
+	}
 
-				if (needs_update)
-				{
-					q_update_client->Bind(i_file_ok);
-					q_update_client->Bind(i_image_ok);
-					q_update_client->Bind(next_check);
-					q_update_client->Bind(state);
-					q_update_client->Bind(clientid);
-					q_update_client->Write();
-					q_update_client->Reset();
-				}
-			}
+	if (code.empty())
+	{
+		return ret;
+	}
+
+	ret.script = lua_interpreter->prepareScript(code);
+
+	if (ret.script == NULL)
+	{
+		return ret;
+	}
+
+	db_results res_params = db->Read("SELECT name, default_value, type FROM alert_script_params WHERE script_id="+convert(script_id));
+
+	for (size_t i = 0; i < res_params.size(); ++i)
+	{
+		SScriptParam param = { res_params[i]["name"], res_params[i]["default_value"], res_params[i]["type"] };
+		ret.params.push_back(param);
+	}
+
+	return ret;
+}
+
+void Alerts::clearScripts()
+{
+	for (std::map<int, SScript>::iterator it = alert_scripts.begin(); it != alert_scripts.end(); ++it)
+	{
+		if (it->second.script != NULL)
+		{
+			it->second.script->Remove();
+		}
+	}
+	alert_scripts.clear();
+}
+
+void Alerts::logStats()
+{
+	for (std::map<int, SScript>::iterator it = alert_scripts.begin(); it != alert_scripts.end(); ++it)
+	{
+		if (it->second.script == NULL)
+		{
+			continue;
+		}
+
+		ILuaInterpreter::SScriptStats stats = it->second.script->getStats(true);
+		if (stats.runs == 0)
+		{
+			continue;
+		}
+
+		Server->Log("Alert script id " + convert(it->first) + ": " + convert(stats.runs) + " runs, avg " +
+			convert((stats.total_time_ms * 1000) / stats.runs) + " us, max " + convert(stats.max_time_ms) + " ms", LL_DEBUG);
+	}
+}
+
+void Alerts::evaluateClient(int clientid)
+{
+	q_get_alert_client->Bind(clientid);
+	db_results res = q_get_alert_client->Read();
+	q_get_alert_client->Reset();
+
+	if (res.empty())
+	{
+		return;
+	}
+
+	ServerSettings server_settings(db, clientid);
+	int script_id = server_settings.getSettings()->alert_script;
+	SScript& script = getScript(script_id);
+
+	if (script.script == NULL)
+	{
+		return;
+	}
+
+	ILuaInterpreter::Param params_raw;
+	ILuaInterpreter::Param::params_map& params = *params_raw.u.params;
+	params["clientid"] = clientid;
+	params["clientname"] = res[0]["name"];
+	int update_freq_file_incr = server_settings.getUpdateFreqFileIncr();
+	int update_freq_file_full = server_settings.getUpdateFreqFileIncr();
+	params["incr_file_interval"] = update_freq_file_incr;
+	params["full_file_interval"] = update_freq_file_full;
+	int update_freq_image_incr = server_settings.getUpdateFreqImageIncr();
+	int update_freq_image_full = server_settings.getUpdateFreqImageFull();
+	params["incr_image_interval"] = update_freq_image_incr;
+	params["full_image_interval"] = update_freq_image_full;
+	params["no_images"] = server_settings.getSettings()->no_images;
+	params["no_file_backups"] = server_settings.getSettings()->no_file_backups;
+	params["os_simple"] = res[0]["os_simple"];
+
+	int64 times = Server->getTimeSeconds();
+	int64 created = watoi64(res[0]["created"]);
+	int64 lastbackup_file = watoi64(res[0]["lastbackup"]);
+	int64 lastbackup_image = watoi64(res[0]["lastbackup_image"]);
+
+	params["passed_time_lastseen"] = times - watoi64(res[0]["lastseen"]);
+	params["passed_time_lastbackup_file"] = (std::min)(times - lastbackup_file, times - created);
+	params["passed_time_lastbackup_image"] = (std::min)(times - lastbackup_image, times - created);
+	params["lastbackup_file"] = lastbackup_file;
+	params["lastbackup_image"] = lastbackup_image;
+
+	SSettings* settings = server_settings.getSettings();
+
+	bool complex_file_interval = settings->update_freq_full.find(";") != std::string::npos
+		|| settings->update_freq_incr.find(";") != std::string::npos;
+
+	bool complex_image_interval = settings->update_freq_image_full.find(";") != std::string::npos
+		|| settings->update_freq_image_incr.find(";") != std::string::npos;
+
+	if ( complex_file_interval
+		|| complex_image_interval )
+	{
+		params["complex_interval"] = true;
+	}
+	else
+	{
+		params["complex_interval"] = false;
+	}
+
+	bool file_ok = res[0]["file_ok"] == "1";
+	params["file_ok"] = file_ok;
+	bool image_ok = res[0]["image_ok"] == "1";
+	params["image_ok"] = image_ok;
+
+	str_map nondefault_params;
+	ParseParamStrHttp(server_settings.getSettings()->alert_params, &nondefault_params);
+
+	for (size_t j = 0; j < script.params.size(); ++j)
+	{
+		SScriptParam& param = script.params[j];
+		str_map::iterator it_param = nondefault_params.find(param.name);
+		std::string val;
+		if (it_param != nondefault_params.end())
+		{
+			val = it_param->second;
+		}
+		else
+		{
+			val = param.default_value;
+		}
+
+		if (param.type == "int")
+		{
+			params[param.name] = watoi(val);
+		}
+		else if (param.type == "num")
+		{
+			params[param.name] = atof(val.c_str());
+		}
+		else if (param.type == "bool")
+		{
+			params[param.name] = val != "0";
+		}
+		else
+		{
+			params[param.name] = val;
+		}
+	}
+
+	std::string state = res[0]["alerts_state"];
+	int64 ret2;
+	int64 ret = script.script->run(params_raw, ret2, state, script.global, funcs);
+	bool needs_update = false;
+	
+	if (ret>=0)
+	{
+		file_ok = !(ret & 1);
+		image_ok = !(ret & 2);
+
+		if (file_ok != params["file_ok"].u.b
+			|| image_ok != params["image_ok"].u.b)
+		{
+			needs_update = true;
+		}
+	}
+	else
+	{
+		Server->Log("Error executing alert script id " + convert(script_id) + ". Return value " + convert(ret) + ".", LL_ERROR);
+	}
+
+	int64 next_check;
+	if (ret2 >= 0)
+	{
+		next_check = Server->getTimeMS() + ret2;
+		needs_update = true;
+	}
+	else
+	{
+		if (!file_ok
+			&& !image_ok)
+		{
+			next_check = Server->getTimeMS() + 1*60*60*1000;
+			needs_update = true;
 		}
+		else
+		{
+			next_check = Server->getTimeMS();
+		}
+	}
+
+	if (res[0]["alerts_next_check"].empty())
+	{
+		needs_update = true;
+	}
+
+	{
+		IScopedLock lock(mutex);
+		schedule(clientid, (std::max)(next_check, Server->getTimeMS() + c_min_recheck_interval));
+	}
+
+	if (state != res[0]["alerts_state"])
+	{
+		needs_update = true;
+	}
+
+	int i_file_ok = file_ok ? 1 : 0;
+	int i_image_ok = image_ok ? 1 : 0;
+
+	if (settings->no_file_backups
+		&& res[0]["file_ok"] != "-1")
+	{
+		i_file_ok = -1;
+		needs_update = true;
+	}
+	else if (!complex_file_interval
+		&& update_freq_file_incr < 0
+		&& update_freq_file_full < 0
+		&& res[0]["file_ok"] != "-1")
+	{
+		i_file_ok = -1;
+		needs_update = true;
+	}
+
+	if (settings->no_images
+		&& res[0]["image_ok"] != "-1")
+	{
+		i_image_ok = -1;
+		needs_update = true;
+	}
+	else if (!complex_image_interval
+		&& update_freq_image_full < 0
+		&& update_freq_image_incr < 0
+		&& res[0]["image_ok"] != "-1")
+	{
+		i_image_ok = -1;
+		needs_update = true;
+	}
+
+	if (needs_update)
+	{
+		q_update_client->Bind(i_file_ok);
+		q_update_client->Bind(i_image_ok);
+		q_update_client->Bind(next_check);
+		q_update_client->Bind(state);
+		q_update_client->Bind(clientid);
+		q_update_client->Write();
+		q_update_client->Reset();
 	}
 }
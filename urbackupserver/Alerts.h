@@ -1,13 +1,64 @@
 #pragma once
 
 #include "../Interface/Thread.h"
+#include "../Interface/Types.h"
+#include "../luaplugin/ILuaInterpreter.h"
 #include <string>
+#include <map>
+#include <vector>
 
 class IDatabase;
+class IQuery;
+class IMutex;
+class ICondition;
 std::string get_alert_script(IDatabase* db, int script_id);
 
 class Alerts : public IThread
 {
 public:
+	Alerts();
+
 	void operator()();
+
+	static void init_mutex();
+
+	static void checkClient(int clientid);
+	static void updateScripts();
+
+private:
+	struct SScriptParam
+	{
+		std::string name;
+		std::string default_value;
+		std::string type;
+	};
+
+	struct SScript
+	{
+		SScript()
+			: script(NULL) {}
+
+		ILuaInterpreter::IPreparedScript* script;
+		std::vector<SScriptParam> params;
+		std::string global;
+	};
+
+	SScript& getScript(int script_id);
+	void clearScripts();
+	void evaluateClient(int clientid);
+	void logStats();
+
+	static void schedule(int clientid, int64 due);
+
+	IDatabase* db;
+	IQuery* q_get_alert_client;
+	IQuery* q_update_client;
+	std::map<int, SScript> alert_scripts;
+	ILuaInterpreter::SInterpreterFunctions funcs;
+
+	static IMutex* mutex;
+	static ICondition* cond;
+	static std::multimap<int64, int> timers;
+	static std::map<int, int64> client_timers;
+	static bool scripts_changed;
 };
@@ -0,0 +1,334 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "ChunkIndex.h"
+#include "../Interface/Server.h"
+#include "../Interface/File.h"
+#include "../stringtools.h"
+#include "../common/data.h"
+#include "../urbackupcommon/os_functions.h"
+#include <memory>
+
+MDB_env* ChunkIndex::env = NULL;
+MDB_dbi ChunkIndex::dbi;
+size_t ChunkIndex::map_size = 1 * 1024 * 1024;
+ISharedMutex* ChunkIndex::mutex = NULL;
+
+namespace
+{
+	const char* c_chunk_index_fn = "urbackup/chunkindex/backup_server_chunk_index.lmdb";
+}
+
+void ChunkIndex::initMutex()
+{
+	mutex = Server->createSharedMutex();
+}
+
+void ChunkIndex::shutdown()
+{
+	IScopedWriteLock lock(mutex);
+	if (env != NULL)
+	{
+		mdb_env_close(env);
+		env = NULL;
+	}
+}
+
+ChunkIndex::ChunkIndex()
+	: _has_error(false)
+{
+	if (!open_env())
+	{
+		_has_error = true;
+	}
+}
+
+bool ChunkIndex::has_error()
+{
+	return _has_error;
+}
+
+bool ChunkIndex::open_env()
+{
+	{
+		IScopedReadLock lock(mutex);
+		if (env != NULL)
+		{
+			return true;
+		}
+	}
+
+	IScopedWriteLock lock(mutex);
+	if (env != NULL)
+	{
+		return true;
+	}
+
+	if (!create_env())
+	{
+		if (env != NULL)
+		{
+			mdb_env_close(env);
+			env = NULL;
+		}
+		return false;
+	}
+
+	return true;
+}
+
+bool ChunkIndex::create_env()
+{
+	int rc = mdb_env_create(&env);
+	if (rc)
+	{
+		Server->Log("LMDB: Failed to create chunk index env (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+		env = NULL;
+		return false;
+	}
+
+	{
+		std::auto_ptr<IFile> lmdb_f(Server->openFile(c_chunk_index_fn, MODE_READ));
+		if (lmdb_f.get() != NULL)
+		{
+			while (lmdb_f->Size() > static_cast<_i64>(map_size))
+			{
+				map_size *= 2;
+			}
+		}
+	}
+
+	rc = mdb_env_set_maxreaders(env, 4094);
+	if (rc)
+	{
+		Server->Log("LMDB: Failed to set max readers (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+		return false;
+	}
+
+	rc = mdb_env_set_mapsize(env, map_size);
+	if (rc)
+	{
+		Server->Log("LMDB: Failed to set map size (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+		return false;
+	}
+
+	os_create_dir("urbackup/chunkindex");
+
+	rc = mdb_env_open(env, c_chunk_index_fn, MDB_NOSUBDIR | MDB_NOMETASYNC, 0664);
+	if (rc)
+	{
+		Server->Log("LMDB: Failed to open chunk index database file (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+		return false;
+	}
+
+	MDB_txn* txn;
+	rc = mdb_txn_begin(env, NULL, 0, &txn);
+	if (rc)
+	{
+		Server->Log("LMDB: Failed to open transaction handle for dbi open (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+		return false;
+	}
+
+	rc = mdb_dbi_open(txn, NULL, 0, &dbi);
+	if (rc)
+	{
+		Server->Log("LMDB: Failed to open chunk index database (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+		mdb_txn_abort(txn);
+		return false;
+	}
+
+	rc = mdb_txn_commit(txn);
+	if (rc)
+	{
+		Server->Log("LMDB: Failed to commit txn for dbi handle (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+		return false;
+	}
+
+	return true;
+}
+
+std::vector<SChunkLocation> ChunkIndex::get(const std::vector<std::string>& hashes)
+{
+	std::vector<SChunkLocation> ret(hashes.size());
+
+	if (_has_error)
+	{
+		return ret;
+	}
+
+	IScopedReadLock lock(mutex);
+
+	MDB_txn* txn;
+	int rc = mdb_txn_begin(env, NULL, MDB_RDONLY, &txn);
+	if (rc)
+	{
+		Server->Log("LMDB: Failed to open chunk index read transaction (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+		_has_error = true;
+		return ret;
+	}
+
+	for (size_t i = 0; i < hashes.size(); ++i)
+	{
+		MDB_val mdb_tkey;
+		mdb_tkey.mv_data = const_cast<char*>(hashes[i].data());
+		mdb_tkey.mv_size = hashes[i].size();
+
+		MDB_val mdb_tvalue;
+		rc = mdb_get(txn, dbi, &mdb_tkey, &mdb_tvalue);
+
+		if (rc == MDB_NOTFOUND)
+		{
+			continue;
+		}
+		else if (rc)
+		{
+			Server->Log("LMDB: Failed to read from chunk index (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+			_has_error = true;
+			break;
+		}
+
+		CRData data(static_cast<const char*>(mdb_tvalue.mv_data), mdb_tvalue.mv_size);
+		if (!data.getVarInt(&ret[i].offset)
+			|| !data.getStr2(&ret[i].path))
+		{
+			ret[i] = SChunkLocation();
+		}
+	}
+
+	mdb_txn_abort(txn);
+
+	return ret;
+}
+
+int ChunkIndex::apply_updates(MDB_txn* txn, const std::vector<SChunkIndexUpdate>& updates)
+{
+	for (size_t i = 0; i < updates.size(); ++i)
+	{
+		const SChunkIndexUpdate& update = updates[i];
+
+		MDB_val mdb_tkey;
+		mdb_tkey.mv_data = const_cast<char*>(update.hash.data());
+		mdb_tkey.mv_size = update.hash.size();
+
+		int rc;
+		if (update.loc.path.empty())
+		{
+			rc = mdb_del(txn, dbi, &mdb_tkey, NULL);
+			if (rc == MDB_NOTFOUND)
+			{
+				rc = 0;
+			}
+		}
+		else
+		{
+			CWData vdata;
+			vdata.addVarInt(update.loc.offset);
+			vdata.addString2(update.loc.path);
+
+			MDB_val mdb_tvalue;
+			mdb_tvalue.mv_data = vdata.getDataPtr();
+			mdb_tvalue.mv_size = vdata.getDataSize();
+
+			rc = mdb_put(txn, dbi, &mdb_tkey, &mdb_tvalue, update.overwrite ? 0 : MDB_NOOVERWRITE);
+			if (rc == MDB_KEYEXIST)
+			{
+				rc = 0;
+			}
+		}
+
+		if (rc)
+		{
+			return rc;
+		}
+	}
+
+	return 0;
+}
+
+void ChunkIndex::write(const std::vector<SChunkIndexUpdate>& updates)
+{
+	if (_has_error || updates.empty())
+	{
+		return;
+	}
+
+	while (true)
+	{
+		int rc;
+		{
+			IScopedReadLock lock(mutex);
+
+			MDB_txn* txn;
+			rc = mdb_txn_begin(env, NULL, 0, &txn);
+			if (rc)
+			{
+				Server->Log("LMDB: Failed to open chunk index write transaction (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+				_has_error = true;
+				return;
+			}
+
+			rc = apply_updates(txn, updates);
+
+			if (rc)
+			{
+				mdb_txn_abort(txn);
+			}
+			else
+			{
+				rc = mdb_txn_commit(txn);
+			}
+		}
+
+		if (rc == MDB_MAP_FULL)
+		{
+			if (!increase_map_size())
+			{
+				_has_error = true;
+				return;
+			}
+		}
+		else if (rc)
+		{
+			Server->Log("LMDB: Failed to write to chunk index (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+			_has_error = true;
+			return;
+		}
+		else
+		{
+			return;
+		}
+	}
+}
+
+bool ChunkIndex::increase_map_size()
+{
+	IScopedWriteLock lock(mutex);
+
+	int rc = mdb_env_set_mapsize(env, map_size * 2);
+	if (rc)
+	{
+		Server->Log("LMDB: Failed to increase chunk index map size (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+		return false;
+	}
+
+	map_size *= 2;
+
+	Server->Log("Increased chunk index LMDB database size to " + PrettyPrintBytes(map_size), LL_DEBUG);
+
+	return true;
+}
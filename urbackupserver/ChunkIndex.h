@@ -0,0 +1,59 @@
+#pragma once
+
+#include "../Interface/Types.h"
+#include "../Interface/SharedMutex.h"
+#include "lmdb/lmdb.h"
+#include <string>
+#include <vector>
+
+struct SChunkLocation
+{
+	SChunkLocation()
+		: offset(-1)
+	{}
+
+	SChunkLocation(const std::string& path, int64 offset)
+		: path(path), offset(offset)
+	{}
+
+	std::string path;
+	int64 offset;
+};
+
+struct SChunkIndexUpdate
+{
+	std::string hash;
+	SChunkLocation loc;
+	bool overwrite;
+};
+
+class ChunkIndex
+{
+public:
+	static void initMutex();
+	static void shutdown();
+
+	ChunkIndex();
+
+	bool has_error();
+
+	std::vector<SChunkLocation> get(const std::vector<std::string>& hashes);
+
+	//Entries with an empty path are deleted
+	void write(const std::vector<SChunkIndexUpdate>& updates);
+
+private:
+	static bool create_env();
+	static bool open_env();
+
+	int apply_updates(MDB_txn* txn, const std::vector<SChunkIndexUpdate>& updates);
+
+	bool increase_map_size();
+
+	static MDB_env* env;
+	static MDB_dbi dbi;
+	static size_t map_size;
+	static ISharedMutex* mutex;
+
+	bool _has_error;
+};
@@ -0,0 +1,1212 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "ChunkStore.h"
+#include "../Interface/Server.h"
+#include "../stringtools.h"
+#include "../common/data.h"
+#include "../urbackupcommon/os_functions.h"
+#include "../urbackupcommon/sha2/sha2.h"
+#include "../fileservplugin/chunk_settings.h"
+#include "server_settings.h"
+#include "database.h"
+#include <memory>
+#include <string.h>
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#endif
+
+MDB_env* ChunkStore::env = NULL;
+MDB_dbi ChunkStore::dbi;
+size_t ChunkStore::map_size = 1 * 1024 * 1024;
+std::string ChunkStore::env_store_id;
+ISharedMutex* ChunkStore::mutex = NULL;
+IMutex* ChunkStore::chunk_file_mutex = NULL;
+IMutex* ChunkStore::key_mutex = NULL;
+std::map<std::string, std::string> ChunkStore::keys;
+
+namespace
+{
+	const char* c_chunk_store_dir = "urbackup_chunk_store";
+	const char c_manifest_magic[] = "URBACKUP CHUNKS\n";
+	const size_t c_manifest_magic_size = 16;
+	const size_t c_manifest_id_size = 16;
+	const size_t c_chunk_hash_size = SHA256_DIGEST_SIZE;
+	const size_t c_manifest_header_size = c_manifest_magic_size + sizeof(_u32) + sizeof(_i64) + c_manifest_id_size;
+	const size_t c_store_key_size = 32;
+	const size_t c_rebuild_batch_size = 1000;
+
+	std::string sha256_str(const char* data, size_t size)
+	{
+		//sha256() returns the hex digest
+		sha256_ctx ctx;
+		sha256_init(&ctx);
+		sha256_update(&ctx, reinterpret_cast<const unsigned char*>(data), static_cast<unsigned int>(size));
+		unsigned char digest[SHA256_DIGEST_SIZE];
+		sha256_final(&ctx, digest);
+		return std::string(reinterpret_cast<char*>(digest), SHA256_DIGEST_SIZE);
+	}
+
+	std::string hmac_sha256(const std::string& key, const std::string& msg)
+	{
+		unsigned char ipad[64];
+		unsigned char opad[64];
+		memset(ipad, 0x36, sizeof(ipad));
+		memset(opad, 0x5c, sizeof(opad));
+		for (size_t i = 0; i < key.size() && i < sizeof(ipad); ++i)
+		{
+			ipad[i] ^= static_cast<unsigned char>(key[i]);
+			opad[i] ^= static_cast<unsigned char>(key[i]);
+		}
+
+		unsigned char inner[SHA256_DIGEST_SIZE];
+		sha256_ctx ctx;
+		sha256_init(&ctx);
+		sha256_update(&ctx, ipad, sizeof(ipad));
+		sha256_update(&ctx, reinterpret_cast<const unsigned char*>(msg.data()), static_cast<unsigned int>(msg.size()));
+		sha256_final(&ctx, inner);
+
+		unsigned char outer[SHA256_DIGEST_SIZE];
+		sha256_init(&ctx);
+		sha256_update(&ctx, opad, sizeof(opad));
+		sha256_update(&ctx, inner, sizeof(inner));
+		sha256_final(&ctx, outer);
+
+		return std::string(reinterpret_cast<char*>(outer), SHA256_DIGEST_SIZE);
+	}
+
+	std::string chunk_path(const std::string& chunks_path, const std::string& hash)
+	{
+		std::string hex = bytesToHex(hash);
+		return chunks_path + os_file_sep() + hex.substr(0, 2) + os_file_sep() + hex.substr(2, 2) + os_file_sep() + hex;
+	}
+
+	int64 link_count(IFsFile* f)
+	{
+#ifdef _WIN32
+		BY_HANDLE_FILE_INFORMATION info;
+		if (!GetFileInformationByHandle(f->getOsHandle(), &info))
+		{
+			return -1;
+		}
+		return info.nNumberOfLinks;
+#else
+		struct stat st;
+		if (fstat(f->getOsHandle(), &st) != 0)
+		{
+			return -1;
+		}
+		return st.st_nlink;
+#endif
+	}
+
+	bool write_file_atomic(const std::string& fn, const char* data, size_t size)
+	{
+		std::string tmp_fn = fn + ".new_" + bytesToHex(Server->secureRandomString(8));
+		std::auto_ptr<IFile> f(Server->openFile(os_file_prefix(tmp_fn), MODE_WRITE));
+		if (f.get() == NULL)
+		{
+			os_create_dir_recursive(os_file_prefix(ExtractFilePath(fn, os_file_sep())));
+			f.reset(Server->openFile(os_file_prefix(tmp_fn), MODE_WRITE));
+			if (f.get() == NULL)
+			{
+				return false;
+			}
+		}
+
+		if (f->Write(data, static_cast<_u32>(size)) != size)
+		{
+			f.reset();
+			Server->deleteFile(os_file_prefix(tmp_fn));
+			return false;
+		}
+
+		f.reset();
+
+		if (!os_rename_file(os_file_prefix(tmp_fn), os_file_prefix(fn)))
+		{
+			Server->deleteFile(os_file_prefix(tmp_fn));
+			return false;
+		}
+
+		return true;
+	}
+}
+
+size_t SChunkManifest::numChunks() const
+{
+	return hashes.size() / c_chunk_hash_size;
+}
+
+std::string SChunkManifest::hash(size_t idx) const
+{
+	return hashes.substr(idx*c_chunk_hash_size, c_chunk_hash_size);
+}
+
+int64 SChunkManifest::chunkLength(size_t idx) const
+{
+	return (std::min)(static_cast<int64>(chunksize), filesize - static_cast<int64>(idx)*chunksize);
+}
+
+void ChunkStore::initMutex()
+{
+	mutex = Server->createSharedMutex();
+	chunk_file_mutex = Server->createMutex();
+	key_mutex = Server->createMutex();
+}
+
+void ChunkStore::shutdown()
+{
+	IScopedWriteLock lock(mutex);
+	if (env != NULL)
+	{
+		mdb_env_close(env);
+		env = NULL;
+	}
+}
+
+ChunkStore::ChunkStore(const std::string& backupfolder, logid_t logid)
+	: store_path(backupfolder + os_file_sep() + c_chunk_store_dir),
+	logid(logid), _has_error(false)
+{
+	key = getKey(store_path, true);
+	if (key.empty())
+	{
+		ServerLogger::Log(logid, "Error creating chunk store key in \"" + store_path + "\". " + os_last_error_str(), LL_ERROR);
+		_has_error = true;
+		return;
+	}
+
+	if (!open_env())
+	{
+		_has_error = true;
+	}
+}
+
+bool ChunkStore::has_error()
+{
+	return _has_error;
+}
+
+bool ChunkStore::isManifestSize(int64 size)
+{
+	return size >= static_cast<int64>(c_manifest_header_size + 5 * c_chunk_hash_size)
+		&& (size - c_manifest_header_size - c_chunk_hash_size) % c_chunk_hash_size == 0;
+}
+
+std::string ChunkStore::getKey(const std::string& store_path, bool create)
+{
+	IScopedLock lock(key_mutex);
+
+	std::map<std::string, std::string>::iterator it = keys.find(store_path);
+	if (it != keys.end())
+	{
+		return it->second;
+	}
+
+	std::string key_fn = store_path + os_file_sep() + "key";
+	std::string key;
+	std::auto_ptr<IFile> f(Server->openFile(os_file_prefix(key_fn), MODE_READ));
+	if (f.get() != NULL)
+	{
+		key = f->Read(static_cast<int64>(0), static_cast<_u32>(c_store_key_size));
+		if (key.size() != c_store_key_size)
+		{
+			return std::string();
+		}
+	}
+	else if (create)
+	{
+		key.resize(c_store_key_size);
+		Server->secureRandomFill(&key[0], key.size());
+		if (!write_file_atomic(key_fn, key.data(), key.size()))
+		{
+			return std::string();
+		}
+	}
+	else
+	{
+		return std::string();
+	}
+
+	keys[store_path] = key;
+	return key;
+}
+
+std::string ChunkStore::currentStorePath()
+{
+	ServerSettings settings(Server->getDatabase(Server->getThreadID(), URBACKUPDB_SERVER));
+	return settings.getSettings()->backupfolder + os_file_sep() + c_chunk_store_dir;
+}
+
+bool ChunkStore::open_env()
+{
+	store_id = bytesToHex(sha256_str(key.data(), key.size())).substr(0, 16);
+
+	{
+		IScopedReadLock lock(mutex);
+		if (env != NULL && env_store_id == store_id)
+		{
+			return true;
+		}
+	}
+
+	IScopedWriteLock lock(mutex);
+	if (env != NULL)
+	{
+		if (env_store_id == store_id)
+		{
+			return true;
+		}
+		mdb_env_close(env);
+		env = NULL;
+	}
+
+	std::string env_fn = "urbackup/chunkindex/chunk_store_" + store_id + ".lmdb";
+	bool is_new = os_get_file_type(env_fn) == 0;
+
+	if (!create_env(env_fn)
+		|| (is_new && !rebuild_refs()))
+	{
+		if (env != NULL)
+		{
+			mdb_env_close(env);
+			env = NULL;
+		}
+		if (is_new)
+		{
+			Server->deleteFile(env_fn);
+			Server->deleteFile(env_fn + "-lock");
+		}
+		return false;
+	}
+
+	env_store_id = store_id;
+
+	return true;
+}
+
+bool ChunkStore::create_env(const std::string& env_fn)
+{
+	int rc = mdb_env_create(&env);
+	if (rc)
+	{
+		ServerLogger::Log(logid, "LMDB: Failed to create chunk store env (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+		env = NULL;
+		return false;
+	}
+
+	{
+		std::auto_ptr<IFile> lmdb_f(Server->openFile(env_fn, MODE_READ));
+		if (lmdb_f.get() != NULL)
+		{
+			while (lmdb_f->Size() > static_cast<_i64>(map_size))
+			{
+				map_size *= 2;
+			}
+		}
+	}
+
+	rc = mdb_env_set_maxreaders(env, 4094);
+	if (rc)
+	{
+		ServerLogger::Log(logid, "LMDB: Failed to set max readers (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+		return false;
+	}
+
+	rc = mdb_env_set_mapsize(env, map_size);
+	if (rc)
+	{
+		ServerLogger::Log(logid, "LMDB: Failed to set map size (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+		return false;
+	}
+
+	os_create_dir("urbackup/chunkindex");
+
+	//Lost increments would free chunks that are still in use, so this database is synced on commit
+	rc = mdb_env_open(env, env_fn.c_str(), MDB_NOSUBDIR, 0664);
+	if (rc)
+	{
+		ServerLogger::Log(logid, "LMDB: Failed to open chunk store database file (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+		return false;
+	}
+
+	MDB_txn* txn;
+	rc = mdb_txn_begin(env, NULL, 0, &txn);
+	if (rc)
+	{
+		ServerLogger::Log(logid, "LMDB: Failed to open transaction handle for dbi open (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+		return false;
+	}
+
+	rc = mdb_dbi_open(txn, NULL, 0, &dbi);
+	if (rc)
+	{
+		ServerLogger::Log(logid, "LMDB: Failed to open chunk store database (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+		mdb_txn_abort(txn);
+		return false;
+	}
+
+	rc = mdb_txn_commit(txn);
+	if (rc)
+	{
+		ServerLogger::Log(logid, "LMDB: Failed to commit txn for dbi handle (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+		return false;
+	}
+
+	return true;
+}
+
+bool ChunkStore::rebuild_refs()
+{
+	//Called with the write lock held, so nothing releases chunks while the references are incomplete
+	std::string manifests_path = store_path + os_file_sep() + "manifests";
+	if (!os_directory_exists(os_file_prefix(manifests_path)))
+	{
+		return true;
+	}
+
+	std::vector<SFile> dirs = getFiles(os_file_prefix(manifests_path));
+	if (dirs.empty())
+	{
+		return true;
+	}
+
+	ServerLogger::Log(logid, "Rebuilding chunk store references...", LL_INFO);
+
+	std::vector<SChunkManifest> batch;
+	size_t n_manifests = 0;
+	for (size_t i = 0; i < dirs.size(); ++i)
+	{
+		if (!dirs[i].isdir)
+		{
+			continue;
+		}
+
+		std::string dir = manifests_path + os_file_sep() + dirs[i].name;
+		std::vector<SFile> files = getFiles(os_file_prefix(dir));
+		for (size_t j = 0; j < files.size(); ++j)
+		{
+			std::auto_ptr<IFile> f(Server->openFile(os_file_prefix(dir + os_file_sep() + files[j].name), MODE_READ));
+			SChunkManifest manifest;
+			if (f.get() == NULL
+				|| !readManifest(f.get(), key, manifest))
+			{
+				ServerLogger::Log(logid, "Error reading chunk manifest \"" + dir + os_file_sep() + files[j].name + "\". Its chunks are not referenced.", LL_ERROR);
+				continue;
+			}
+
+			batch.push_back(manifest);
+			++n_manifests;
+
+			if (batch.size() >= c_rebuild_batch_size)
+			{
+				if (!add_refs_locked(batch))
+				{
+					return false;
+				}
+				batch.clear();
+			}
+		}
+	}
+
+	if (!batch.empty()
+		&& !add_refs_locked(batch))
+	{
+		return false;
+	}
+
+	ServerLogger::Log(logid, "Rebuilt chunk store references of " + convert(n_manifests) + " manifests", LL_INFO);
+
+	return true;
+}
+
+bool ChunkStore::add_refs_locked(const std::vector<SChunkManifest>& manifests)
+{
+	int rc;
+	do
+	{
+		MDB_txn* txn;
+		rc = mdb_txn_begin(env, NULL, 0, &txn);
+		if (rc)
+		{
+			ServerLogger::Log(logid, "LMDB: Failed to open chunk store write transaction (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+			return false;
+		}
+
+		for (size_t k = 0; k < manifests.size() && rc == 0; ++k)
+		{
+			rc = apply_refs(txn, manifests[k], true, NULL);
+		}
+
+		if (rc)
+		{
+			mdb_txn_abort(txn);
+		}
+		else
+		{
+			rc = mdb_txn_commit(txn);
+		}
+	} while (rc == MDB_MAP_FULL
+		&& increase_map_size_locked());
+
+	if (rc)
+	{
+		ServerLogger::Log(logid, "LMDB: Failed to write chunk store references (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+		return false;
+	}
+
+	return true;
+}
+
+int ChunkStore::apply_refs(MDB_txn* txn, const SChunkManifest& manifest, bool add, std::vector<std::string>* unused)
+{
+	for (size_t i = 0; i < manifest.numChunks(); ++i)
+	{
+		std::string hash = manifest.hash(i);
+
+		MDB_val mdb_tkey;
+		mdb_tkey.mv_data = const_cast<char*>(hash.data());
+		mdb_tkey.mv_size = hash.size();
+
+		int64 refs = 0;
+		MDB_val mdb_tvalue;
+		int rc = mdb_get(txn, dbi, &mdb_tkey, &mdb_tvalue);
+		if (rc == 0)
+		{
+			CRData data(static_cast<const char*>(mdb_tvalue.mv_data), mdb_tvalue.mv_size);
+			if (!data.getVarInt(&refs))
+			{
+				refs = 0;
+			}
+		}
+		else if (rc != MDB_NOTFOUND)
+		{
+			return rc;
+		}
+		else if (!add)
+		{
+			//Never counted, e.g. because the manifest was read during a rebuild. Leaks the chunk instead of freeing it early.
+			continue;
+		}
+
+		refs += add ? 1 : -1;
+
+		if (refs <= 0)
+		{
+			rc = mdb_del(txn, dbi, &mdb_tkey, NULL);
+			if (unused != NULL)
+			{
+				unused->push_back(hash);
+			}
+		}
+		else
+		{
+			CWData vdata;
+			vdata.addVarInt(refs);
+
+			mdb_tvalue.mv_data = vdata.getDataPtr();
+			mdb_tvalue.mv_size = vdata.getDataSize();
+
+			rc = mdb_put(txn, dbi, &mdb_tkey, &mdb_tvalue, 0);
+		}
+
+		if (rc)
+		{
+			return rc;
+		}
+	}
+
+	return 0;
+}
+
+bool ChunkStore::updateRefs(const std::vector<SChunkManifest>& manifests, bool add, std::vector<std::string>* unused)
+{
+	if (_has_error)
+	{
+		return false;
+	}
+
+	while (true)
+	{
+		if (unused != NULL)
+		{
+			unused->clear();
+		}
+
+		int rc;
+		{
+			IScopedReadLock lock(mutex);
+
+			if (env_store_id != store_id)
+			{
+				ServerLogger::Log(logid, "Backup storage location changed. Stopping to use chunk store \"" + store_path + "\"", LL_ERROR);
+				_has_error = true;
+				return false;
+			}
+
+			MDB_txn* txn;
+			rc = mdb_txn_begin(env, NULL, 0, &txn);
+			if (rc)
+			{
+				ServerLogger::Log(logid, "LMDB: Failed to open chunk store write transaction (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+				_has_error = true;
+				return false;
+			}
+
+			for (size_t i = 0; i < manifests.size() && rc == 0; ++i)
+			{
+				rc = apply_refs(txn, manifests[i], add, unused);
+			}
+
+			if (rc)
+			{
+				mdb_txn_abort(txn);
+			}
+			else
+			{
+				rc = mdb_txn_commit(txn);
+			}
+		}
+
+		if (rc == MDB_MAP_FULL)
+		{
+			if (!increase_map_size())
+			{
+				_has_error = true;
+				return false;
+			}
+		}
+		else if (rc)
+		{
+			ServerLogger::Log(logid, "LMDB: Failed to write to chunk store (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+			_has_error = true;
+			return false;
+		}
+		else
+		{
+			return true;
+		}
+	}
+}
+
+bool ChunkStore::hasRefs(const std::string& hash)
+{
+	IScopedReadLock lock(mutex);
+
+	if (env_store_id != store_id)
+	{
+		return true;
+	}
+
+	MDB_txn* txn;
+	int rc = mdb_txn_begin(env, NULL, MDB_RDONLY, &txn);
+	if (rc)
+	{
+		ServerLogger::Log(logid, "LMDB: Failed to open chunk store read transaction (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+		return true;
+	}
+
+	MDB_val mdb_tkey;
+	mdb_tkey.mv_data = const_cast<char*>(hash.data());
+	mdb_tkey.mv_size = hash.size();
+
+	MDB_val mdb_tvalue;
+	rc = mdb_get(txn, dbi, &mdb_tkey, &mdb_tvalue);
+
+	mdb_txn_abort(txn);
+
+	return rc != MDB_NOTFOUND;
+}
+
+bool ChunkStore::releaseRefs(const SChunkManifest& manifest)
+{
+	std::vector<std::string> unused;
+	if (!updateRefs(std::vector<SChunkManifest>(1, manifest), false, &unused))
+	{
+		return false;
+	}
+
+	removeUnreferenced(unused);
+	return true;
+}
+
+void ChunkStore::removeUnreferenced(const std::vector<std::string>& hashes)
+{
+	//storeFile() waits for this lock after adding its references and then restores chunks removed here
+	IScopedLock lock(chunk_file_mutex);
+
+	for (size_t i = 0; i < hashes.size(); ++i)
+	{
+		if (!hasRefs(hashes[i]))
+		{
+			Server->deleteFile(os_file_prefix(chunk_path(store_path + os_file_sep() + "chunks", hashes[i])));
+		}
+	}
+}
+
+bool ChunkStore::increase_map_size()
+{
+	IScopedWriteLock lock(mutex);
+
+	return increase_map_size_locked();
+}
+
+bool ChunkStore::increase_map_size_locked()
+{
+	int rc = mdb_env_set_mapsize(env, map_size * 2);
+	if (rc)
+	{
+		ServerLogger::Log(logid, "LMDB: Failed to increase chunk store map size (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+		return false;
+	}
+
+	map_size *= 2;
+
+	Server->Log("Increased chunk store LMDB database size to " + PrettyPrintBytes(map_size), LL_DEBUG);
+
+	return true;
+}
+
+bool ChunkStore::chunkExists(const std::string& hash, int64 len)
+{
+	SFile chunk = getFileMetadata(os_file_prefix(chunk_path(store_path + os_file_sep() + "chunks", hash)));
+	return !chunk.name.empty() && chunk.size == len;
+}
+
+bool ChunkStore::writeChunk(const std::string& hash, const char* data, _u32 len)
+{
+	if (!write_file_atomic(chunk_path(store_path + os_file_sep() + "chunks", hash), data, len))
+	{
+		ServerLogger::Log(logid, "Error writing chunk " + bytesToHex(hash) + " to chunk store. " + os_last_error_str(), LL_ERROR);
+		return false;
+	}
+	return true;
+}
+
+std::string ChunkStore::manifestPath(const std::string& id)
+{
+	std::string hex = bytesToHex(id);
+	return store_path + os_file_sep() + "manifests" + os_file_sep() + hex.substr(0, 2) + os_file_sep() + hex;
+}
+
+std::string ChunkStore::serializeManifest(const SChunkManifest& manifest, const std::string& key)
+{
+	CWData data;
+	data.addBuffer(c_manifest_magic, c_manifest_magic_size);
+	data.addUInt(manifest.chunksize);
+	data.addInt64(manifest.filesize);
+	data.addBuffer(manifest.id.data(), manifest.id.size());
+	data.addBuffer(manifest.hashes.data(), manifest.hashes.size());
+
+	std::string ret(data.getDataPtr(), data.getDataSize());
+	return ret + hmac_sha256(key, ret);
+}
+
+bool ChunkStore::readManifest(IFile* f, const std::string& key, SChunkManifest& manifest)
+{
+	int64 size = f->Size();
+	if (!isManifestSize(size))
+	{
+		return false;
+	}
+
+	std::string data = f->Read(static_cast<int64>(0), static_cast<_u32>(size));
+	if (static_cast<int64>(data.size()) != size
+		|| data.compare(0, c_manifest_magic_size, c_manifest_magic, c_manifest_magic_size) != 0)
+	{
+		return false;
+	}
+
+	std::string content = data.substr(0, data.size() - c_chunk_hash_size);
+	if (hmac_sha256(key, content) != data.substr(content.size()))
+	{
+		return false;
+	}
+
+	CRData rdata(content.data() + c_manifest_magic_size, content.size() - c_manifest_magic_size);
+	unsigned int chunksize;
+	_i64 filesize;
+	if (!rdata.getUInt(&chunksize)
+		|| !rdata.getInt64(&filesize)
+		|| chunksize == 0
+		|| filesize < 0)
+	{
+		return false;
+	}
+
+	manifest.chunksize = chunksize;
+	manifest.filesize = filesize;
+	manifest.id = content.substr(c_manifest_magic_size + sizeof(_u32) + sizeof(_i64), c_manifest_id_size);
+	manifest.hashes = content.substr(c_manifest_header_size);
+
+	return static_cast<int64>(manifest.numChunks()) == (filesize + chunksize - 1) / chunksize;
+}
+
+bool ChunkStore::storeFile(const std::string& fn)
+{
+	if (_has_error)
+	{
+		return false;
+	}
+
+	std::auto_ptr<IFsFile> f(Server->openFile(fn, MODE_READ_SEQUENTIAL));
+	if (f.get() == NULL)
+	{
+		ServerLogger::Log(logid, "Error opening \"" + fn + "\" for adding it to the chunk store. " + os_last_error_str(), LL_ERROR);
+		return false;
+	}
+
+	SChunkManifest manifest;
+	manifest.filesize = f->Size();
+	manifest.chunksize = c_checkpoint_dist;
+	manifest.id.resize(c_manifest_id_size);
+	Server->secureRandomFill(&manifest.id[0], manifest.id.size());
+	manifest.hashes.reserve(static_cast<size_t>((manifest.filesize / c_checkpoint_dist + 1)*c_chunk_hash_size));
+
+	std::vector<char> buf(c_checkpoint_dist);
+	for (int64 pos = 0; pos < manifest.filesize; pos += c_checkpoint_dist)
+	{
+		_u32 len = static_cast<_u32>(manifest.chunkLength(manifest.numChunks()));
+		if (f->Read(pos, &buf[0], len) != len)
+		{
+			ServerLogger::Log(logid, "Error reading \"" + fn + "\" for adding it to the chunk store. " + os_last_error_str(), LL_ERROR);
+			return false;
+		}
+
+		std::string hash = sha256_str(&buf[0], len);
+		manifest.hashes += hash;
+
+		if (!chunkExists(hash, len)
+			&& !writeChunk(hash, &buf[0], len))
+		{
+			return false;
+		}
+	}
+
+	if (!updateRefs(std::vector<SChunkManifest>(1, manifest), true, NULL))
+	{
+		return false;
+	}
+
+	std::string manifest_path = manifestPath(manifest.id);
+	std::string tmp_fn = fn + ".chunks_new";
+	bool ok = true;
+	bool disable = false;
+
+	{
+		//Chunks that were unreferenced before the references above were added may have been removed concurrently
+		IScopedLock lock(chunk_file_mutex);
+	}
+
+	for (size_t i = 0; i < manifest.numChunks() && ok; ++i)
+	{
+		_u32 len = static_cast<_u32>(manifest.chunkLength(i));
+		if (!chunkExists(manifest.hash(i), len))
+		{
+			ok = f->Read(i*static_cast<int64>(c_checkpoint_dist), &buf[0], len) == len
+				&& sha256_str(&buf[0], len) == manifest.hash(i)
+				&& writeChunk(manifest.hash(i), &buf[0], len);
+		}
+	}
+
+	if (ok)
+	{
+		std::string data = serializeManifest(manifest, key);
+		std::auto_ptr<IFsFile> manifest_f(Server->openFile(tmp_fn, MODE_WRITE));
+		ok = manifest_f.get() != NULL
+			&& manifest_f->Write(data) == data.size();
+
+		if (ok)
+		{
+			os_create_dir_recursive(os_file_prefix(ExtractFilePath(manifest_path, os_file_sep())));
+			ok = os_create_hardlink(os_file_prefix(manifest_path), tmp_fn, false, NULL);
+			if (!ok)
+			{
+				ServerLogger::Log(logid, "Error linking chunk manifest of \"" + fn + "\" into the chunk store. " + os_last_error_str(), LL_ERROR);
+			}
+		}
+
+		if (ok
+			&& link_count(manifest_f.get()) < 2)
+		{
+			ServerLogger::Log(logid, "File system does not report hardlink counts. Chunk store cannot track which manifests are in use. Disabling it.", LL_ERROR);
+			disable = true;
+			Server->deleteFile(os_file_prefix(manifest_path));
+			ok = false;
+		}
+	}
+
+	f.reset();
+
+	if (ok
+		&& !os_rename_file(tmp_fn, fn))
+	{
+		ServerLogger::Log(logid, "Error replacing \"" + fn + "\" with its chunk manifest. " + os_last_error_str(), LL_ERROR);
+		Server->deleteFile(os_file_prefix(manifest_path));
+		ok = false;
+	}
+
+	if (!ok)
+	{
+		Server->deleteFile(tmp_fn);
+		releaseRefs(manifest);
+		if (disable)
+		{
+			_has_error = true;
+		}
+		return false;
+	}
+
+	return true;
+}
+
+void ChunkStore::releaseUnused()
+{
+	if (_has_error)
+	{
+		return;
+	}
+
+	std::string manifests_path = store_path + os_file_sep() + "manifests";
+	std::vector<SFile> dirs = getFiles(os_file_prefix(manifests_path));
+
+	size_t n_released = 0;
+	int64 released_bytes = 0;
+	for (size_t i = 0; i < dirs.size() && !_has_error; ++i)
+	{
+		if (!dirs[i].isdir)
+		{
+			continue;
+		}
+
+		std::string dir = manifests_path + os_file_sep() + dirs[i].name;
+		std::vector<SFile> files = getFiles(os_file_prefix(dir));
+		for (size_t j = 0; j < files.size() && !_has_error; ++j)
+		{
+			std::string fn = dir + os_file_sep() + files[j].name;
+			std::auto_ptr<IFsFile> f(Server->openFile(os_file_prefix(fn), MODE_READ));
+			if (f.get() == NULL
+				|| link_count(f.get()) != 1)
+			{
+				continue;
+			}
+
+			SChunkManifest manifest;
+			bool read_ok = readManifest(f.get(), key, manifest);
+			f.reset();
+
+			//Removed first, so that an interruption leaks the chunks instead of releasing them twice
+			if (!Server->deleteFile(os_file_prefix(fn)))
+			{
+				continue;
+			}
+
+			if (!read_ok)
+			{
+				ServerLogger::Log(logid, "Error reading unused chunk manifest \"" + fn + "\". Its chunks are not released.", LL_WARNING);
+				continue;
+			}
+
+			releaseRefs(manifest);
+			++n_released;
+			released_bytes += manifest.filesize;
+		}
+	}
+
+	if (n_released > 0)
+	{
+		ServerLogger::Log(logid, "Released chunks of " + convert(n_released) + " unused chunk manifests (" + PrettyPrintBytes(released_bytes) + ")", LL_INFO);
+	}
+}
+
+void ChunkStore::cleanup(const std::string& backupfolder, logid_t logid)
+{
+	if (getKey(backupfolder + os_file_sep() + c_chunk_store_dir, false).empty())
+	{
+		return;
+	}
+
+	ChunkStore chunk_store(backupfolder, logid);
+	chunk_store.releaseUnused();
+}
+
+IFsFile* ChunkStore::openFile(const std::string& fn, int mode)
+{
+	return wrapFile(Server->openFile(fn, mode));
+}
+
+IFsFile* ChunkStore::wrapFile(IFsFile* file)
+{
+	if (file == NULL
+		|| !isManifestSize(file->Size()))
+	{
+		return file;
+	}
+
+	if (file->Read(static_cast<int64>(0), static_cast<_u32>(c_manifest_magic_size)) != std::string(c_manifest_magic, c_manifest_magic_size))
+	{
+		return file;
+	}
+
+	std::string store_path = currentStorePath();
+	std::string key = getKey(store_path, false);
+	SChunkManifest manifest;
+	if (key.empty()
+		|| !readManifest(file, key, manifest))
+	{
+		return file;
+	}
+
+	return new ChunkedFile(file, os_file_prefix(store_path + os_file_sep() + "chunks"), manifest);
+}
+
+bool ChunkStore::isManifest(const std::string& fn)
+{
+	std::auto_ptr<IFsFile> f(openFile(fn, MODE_READ));
+	return dynamic_cast<ChunkedFile*>(f.get()) != NULL;
+}
+
+int64 ChunkStore::contentSize(const std::string& fn, int64 size)
+{
+	if (!isManifestSize(size))
+	{
+		return size;
+	}
+
+	std::auto_ptr<IFsFile> f(openFile(fn, MODE_READ));
+	if (dynamic_cast<ChunkedFile*>(f.get()) == NULL)
+	{
+		return size;
+	}
+	return f->Size();
+}
+
+bool ChunkStore::copyFile(const std::string& src, const std::string& dst, std::string* error_str)
+{
+	std::auto_ptr<IFsFile> fsrc(openFile(src, MODE_READ_SEQUENTIAL));
+	if (dynamic_cast<ChunkedFile*>(fsrc.get()) == NULL)
+	{
+		fsrc.reset();
+		return copy_file(src, dst, false, error_str);
+	}
+
+	std::auto_ptr<IFile> fdst(Server->openFile(dst, MODE_WRITE));
+	if (fdst.get() == NULL)
+	{
+		if (error_str != NULL)
+		{
+			*error_str = os_last_error_str();
+		}
+		return false;
+	}
+
+	return copy_file(fsrc.get(), fdst.get(), error_str);
+}
+
+ChunkedFile::ChunkedFile(IFsFile* manifest_file, const std::string& chunks_path, const SChunkManifest& manifest)
+	: manifest_file(manifest_file), chunks_path(chunks_path), manifest(manifest),
+	pos(0), curr_chunk_idx(std::string::npos), curr_chunk(NULL)
+{
+}
+
+ChunkedFile::~ChunkedFile()
+{
+	Server->destroy(curr_chunk);
+	Server->destroy(manifest_file);
+}
+
+IFile* ChunkedFile::openChunk(size_t idx)
+{
+	if (idx == curr_chunk_idx
+		&& curr_chunk != NULL)
+	{
+		return curr_chunk;
+	}
+
+	Server->destroy(curr_chunk);
+	curr_chunk = NULL;
+	curr_chunk_idx = std::string::npos;
+
+	std::string fn = chunk_path(chunks_path, manifest.hash(idx));
+	IFile* chunk = Server->openFile(fn, MODE_READ);
+	if (chunk == NULL
+		|| chunk->Size() != manifest.chunkLength(idx))
+	{
+		Server->Log("Chunk " + fn + " of \"" + manifest_file->getFilename() + "\" is missing or has the wrong size", LL_ERROR);
+		Server->destroy(chunk);
+		return NULL;
+	}
+
+	curr_chunk = chunk;
+	curr_chunk_idx = idx;
+	return curr_chunk;
+}
+
+std::string ChunkedFile::Read(_u32 tr, bool* has_error)
+{
+	std::string ret;
+	ret.resize(tr);
+	_u32 read = Read(ret.empty() ? NULL : &ret[0], tr, has_error);
+	ret.resize(read);
+	return ret;
+}
+
+std::string ChunkedFile::Read(int64 spos, _u32 tr, bool* has_error)
+{
+	std::string ret;
+	ret.resize(tr);
+	_u32 read = Read(spos, ret.empty() ? NULL : &ret[0], tr, has_error);
+	ret.resize(read);
+	return ret;
+}
+
+_u32 ChunkedFile::Read(char* buffer, _u32 bsize, bool* has_error)
+{
+	_u32 read = Read(pos, buffer, bsize, has_error);
+	pos += read;
+	return read;
+}
+
+_u32 ChunkedFile::Read(int64 spos, char* buffer, _u32 bsize, bool* has_error)
+{
+	_u32 read = 0;
+	while (read < bsize
+		&& spos < manifest.filesize)
+	{
+		size_t idx = static_cast<size_t>(spos / manifest.chunksize);
+		IFile* chunk = openChunk(idx);
+		if (chunk == NULL)
+		{
+			if (has_error != NULL) *has_error = true;
+			break;
+		}
+
+		int64 chunk_off = spos - static_cast<int64>(idx)*manifest.chunksize;
+		_u32 toread = static_cast<_u32>((std::min)(static_cast<int64>(bsize - read), manifest.chunkLength(idx) - chunk_off));
+		_u32 r = chunk->Read(chunk_off, buffer + read, toread, has_error);
+		read += r;
+		spos += r;
+
+		if (r != toread)
+		{
+			if (has_error != NULL) *has_error = true;
+			break;
+		}
+	}
+	return read;
+}
+
+_u32 ChunkedFile::Write(const std::string& tw, bool* has_error)
+{
+	if (has_error != NULL) *has_error = true;
+	return 0;
+}
+
+_u32 ChunkedFile::Write(int64 spos, const std::string& tw, bool* has_error)
+{
+	if (has_error != NULL) *has_error = true;
+	return 0;
+}
+
+_u32 ChunkedFile::Write(const char* buffer, _u32 bsiz, bool* has_error)
+{
+	if (has_error != NULL) *has_error = true;
+	return 0;
+}
+
+_u32 ChunkedFile::Write(int64 spos, const char* buffer, _u32 bsiz, bool* has_error)
+{
+	if (has_error != NULL) *has_error = true;
+	return 0;
+}
+
+bool ChunkedFile::Seek(_i64 spos)
+{
+	pos = spos;
+	return true;
+}
+
+_i64 ChunkedFile::Size(void)
+{
+	return manifest.filesize;
+}
+
+_i64 ChunkedFile::RealSize()
+{
+	return manifest_file->RealSize();
+}
+
+bool ChunkedFile::PunchHole(_i64 spos, _i64 size)
+{
+	return false;
+}
+
+bool ChunkedFile::Sync()
+{
+	return true;
+}
+
+std::string ChunkedFile::getFilename(void)
+{
+	return manifest_file->getFilename();
+}
+
+void ChunkedFile::resetSparseExtentIter()
+{
+}
+
+IFsFile::SSparseExtent ChunkedFile::nextSparseExtent()
+{
+	return SSparseExtent();
+}
+
+bool ChunkedFile::Resize(int64 new_size, bool set_sparse)
+{
+	return false;
+}
+
+std::vector<IFsFile::SFileExtent> ChunkedFile::getFileExtents(int64 starting_offset, int64 block_size, bool& more_data)
+{
+	more_data = false;
+	return std::vector<SFileExtent>();
+}
+
+IFsFile::os_file_handle ChunkedFile::getOsHandle(bool release_handle)
+{
+	//There is no single OS file with the content
+#ifdef _WIN32
+	return INVALID_HANDLE_VALUE;
+#else
+	return -1;
+#endif
+}
+
+IFile* ChunkStoreFileOpenCallback::openVirtualFile(const std::string& path)
+{
+	IFsFile* f = ChunkStore::openFile(path, MODE_READ_SEQUENTIAL);
+	if (dynamic_cast<ChunkedFile*>(f) == NULL)
+	{
+		Server->destroy(f);
+		return NULL;
+	}
+	return f;
+}
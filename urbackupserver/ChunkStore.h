@@ -0,0 +1,164 @@
+#pragma once
+
+#include "../Interface/Types.h"
+#include "../Interface/File.h"
+#include "../Interface/Mutex.h"
+#include "../Interface/SharedMutex.h"
+#include "../fileservplugin/IFileServ.h"
+#include "server_log.h"
+#include "lmdb/lmdb.h"
+#include <string>
+#include <vector>
+#include <map>
+
+//Files at least this large are stored as chunk manifests
+const int64 c_chunk_store_min_size = 2 * 1024 * 1024;
+
+struct SChunkManifest
+{
+	SChunkManifest()
+		: filesize(-1), chunksize(0)
+	{}
+
+	size_t numChunks() const;
+
+	std::string hash(size_t idx) const;
+
+	int64 chunkLength(size_t idx) const;
+
+	int64 filesize;
+	_u32 chunksize;
+	std::string id;
+	//SHA-256 of every chunk, concatenated
+	std::string hashes;
+};
+
+/**
+* Stores large backup files as manifests of SHA-256 addressed chunks.
+* Chunks are files in <backupfolder>/urbackup_chunk_store/chunks and are
+* reference counted in a local LMDB database. Every manifest is hardlinked
+* into urbackup_chunk_store/manifests, so once the store holds the only
+* link no backup uses the manifest anymore and its chunks are released.
+* Manifests are authenticated with a HMAC, so a backed up file cannot
+* pose as a manifest.
+*/
+class ChunkStore
+{
+public:
+	static void initMutex();
+	static void shutdown();
+
+	ChunkStore(const std::string& backupfolder, logid_t logid);
+
+	bool has_error();
+
+	//Replaces the file with a chunk manifest. fn is as passed to Server->openFile
+	bool storeFile(const std::string& fn);
+
+	//Releases the chunks of manifests no backup uses anymore
+	void releaseUnused();
+
+	//Runs releaseUnused() if there is a chunk store in backupfolder
+	static void cleanup(const std::string& backupfolder, logid_t logid);
+
+	//Paths are as passed to Server->openFile. Manifests are opened as ChunkedFile
+	static IFsFile* openFile(const std::string& fn, int mode);
+
+	//Takes ownership of file
+	static IFsFile* wrapFile(IFsFile* file);
+
+	static bool isManifest(const std::string& fn);
+
+	//Size of the file content given the size of the file on disk
+	static int64 contentSize(const std::string& fn, int64 size);
+
+	//Copies a backup file. Manifests are copied as regular files
+	static bool copyFile(const std::string& src, const std::string& dst, std::string* error_str);
+
+	static bool isManifestSize(int64 size);
+
+private:
+	bool open_env();
+	bool create_env(const std::string& env_fn);
+	bool increase_map_size();
+	bool increase_map_size_locked();
+	bool rebuild_refs();
+	bool add_refs_locked(const std::vector<SChunkManifest>& manifests);
+	int apply_refs(MDB_txn* txn, const SChunkManifest& manifest, bool add, std::vector<std::string>* unused);
+
+	bool updateRefs(const std::vector<SChunkManifest>& manifests, bool add, std::vector<std::string>* unused);
+	bool hasRefs(const std::string& hash);
+	bool releaseRefs(const SChunkManifest& manifest);
+	void removeUnreferenced(const std::vector<std::string>& hashes);
+
+	bool chunkExists(const std::string& hash, int64 len);
+	bool writeChunk(const std::string& hash, const char* data, _u32 len);
+	std::string manifestPath(const std::string& id);
+
+	static std::string getKey(const std::string& store_path, bool create);
+	static std::string currentStorePath();
+	static std::string serializeManifest(const SChunkManifest& manifest, const std::string& key);
+	static bool readManifest(IFile* f, const std::string& key, SChunkManifest& manifest);
+
+	static MDB_env* env;
+	static MDB_dbi dbi;
+	static size_t map_size;
+	static std::string env_store_id;
+	static ISharedMutex* mutex;
+	static IMutex* chunk_file_mutex;
+	static IMutex* key_mutex;
+	static std::map<std::string, std::string> keys;
+
+	std::string store_path;
+	std::string key;
+	std::string store_id;
+	logid_t logid;
+	bool _has_error;
+};
+
+/**
+* Read-only view of the file content of a chunk manifest
+*/
+class ChunkedFile : public IFsFile
+{
+public:
+	ChunkedFile(IFsFile* manifest_file, const std::string& chunks_path, const SChunkManifest& manifest);
+	~ChunkedFile();
+
+	virtual std::string Read(_u32 tr, bool* has_error = NULL);
+	virtual std::string Read(int64 spos, _u32 tr, bool* has_error = NULL);
+	virtual _u32 Read(char* buffer, _u32 bsize, bool* has_error = NULL);
+	virtual _u32 Read(int64 spos, char* buffer, _u32 bsize, bool* has_error = NULL);
+	virtual _u32 Write(const std::string& tw, bool* has_error = NULL);
+	virtual _u32 Write(int64 spos, const std::string& tw, bool* has_error = NULL);
+	virtual _u32 Write(const char* buffer, _u32 bsiz, bool* has_error = NULL);
+	virtual _u32 Write(int64 spos, const char* buffer, _u32 bsiz, bool* has_error = NULL);
+	virtual bool Seek(_i64 spos);
+	virtual _i64 Size(void);
+	virtual _i64 RealSize();
+	virtual bool PunchHole(_i64 spos, _i64 size);
+	virtual bool Sync();
+	virtual std::string getFilename(void);
+
+	virtual void resetSparseExtentIter();
+	virtual SSparseExtent nextSparseExtent();
+	virtual bool Resize(int64 new_size, bool set_sparse = true);
+	virtual std::vector<SFileExtent> getFileExtents(int64 starting_offset, int64 block_size, bool& more_data);
+	virtual IFsFile::os_file_handle getOsHandle(bool release_handle = false);
+
+private:
+	IFile* openChunk(size_t idx);
+
+	IFsFile* manifest_file;
+	std::string chunks_path;
+	SChunkManifest manifest;
+	int64 pos;
+	size_t curr_chunk_idx;
+	IFile* curr_chunk;
+};
+
+class ChunkStoreFileOpenCallback : public IFileServ::IFileOpenCallback
+{
+public:
+	virtual IFile* openVirtualFile(const std::string& path);
+};
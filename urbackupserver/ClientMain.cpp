@@ -63,6 +63,7 @@
 #include "ThrottleUpdater.h"
 #include "../fileservplugin/IFileServ.h"
 #include "DataplanDb.h"
+#include "Alerts.h"
 
 extern IUrlFactory *url_fak;
 extern ICryptoFactory *crypto_fak;
@@ -72,6 +73,9 @@ extern IFileServ* fileserv;
 
 const unsigned short serviceport=35623;
 const unsigned int check_time_intervall=5*60*1000;
+const int64 c_schedule_cache_max_age=60*60*1000;
+const int64 c_schedule_stats_intervall=60*60*1000;
+const int64 c_slow_schedule_cycle=10*1000;
 const unsigned int status_update_intervall=1000;
 const unsigned int eta_update_intervall=60000;
 const size_t minfreespace_min=50*1024*1024;
@@ -94,6 +98,8 @@ IMutex* ClientMain::cleanup_mutex = NULL;
 std::map<int, std::vector<SShareCleanup> > ClientMain::cleanup_shares;
 int ClientMain::restore_client_id = -1;
 bool ClientMain::running_backups_allowed=true;
+IMutex* ClientMain::schedule_cache_mutex=NULL;
+int64 ClientMain::schedule_cache_global_generation=0;
 
 
 
@@ -104,7 +110,8 @@ ClientMain::ClientMain(IPipe *pPipe, sockaddr_in pAddr, const std::string &pName
 	  use_file_snapshots(use_file_snapshots), use_image_snapshots(use_image_snapshots), use_reflink(use_reflink),
 	  backup_dao(NULL), client_updated_time(0), continuous_backup(NULL),
 	  clientsubname(pSubName), filebackup_group_offset(filebackup_group_offset), needs_authentification(false),
-	restore_mutex(Server->createMutex())
+	restore_mutex(Server->createMutex()), schedule_cache_generation(-1), schedule_cache_misses(0),
+	schedule_cycles(0), schedule_cycle_time_sum(0), schedule_cycle_time_max(0), last_schedule_stats(0)
 {
 	q_update_lastseen=NULL;
 	pipe=pPipe;
@@ -179,6 +186,7 @@ void ClientMain::init_mutex(void)
 	running_backup_mutex=Server->createMutex();
 	tmpfile_mutex=Server->createMutex();
 	cleanup_mutex=Server->createMutex();
+	schedule_cache_mutex=Server->createMutex();
 }
 
 void ClientMain::destroy_mutex(void)
@@ -186,6 +194,7 @@ void ClientMain::destroy_mutex(void)
 	Server->destroy(running_backup_mutex);
 	Server->destroy(tmpfile_mutex);
 	Server->destroy(cleanup_mutex);
+	Server->destroy(schedule_cache_mutex);
 }
 
 void ClientMain::unloadSQL(void)
@@ -326,6 +335,7 @@ void ClientMain::operator ()(void)
 
 	int64 lastseen = Server->getTimeSeconds();
 	updateLastseen(lastseen);	
+	Alerts::checkClient(clientid);
 		
 	if(!updateCapabilities())
 	{
@@ -429,6 +439,10 @@ void ClientMain::operator ()(void)
 	{
 		if(!skip_checking)
 		{
+			int64 cycle_starttime = Server->getTimeMS();
+
+			checkScheduleCache();
+
 			timeoutRestores();
 
 			bool send_logdata = false;
@@ -482,6 +496,9 @@ void ClientMain::operator ()(void)
 					{
 						ServerStatus::subRunningJob(clientmainname);
 
+						file_schedule_cache.clear();
+						image_schedule_cache.clear();
+
 						if (!backup_queue[i].backup->getResult() &&
 							backup_queue[i].backup->shouldBackoff())
 						{
@@ -555,6 +572,7 @@ void ClientMain::operator ()(void)
 											{
 												backup_dao->setImageBackupComplete(it->first->getBackupId());
 												backup_dao->updateClientLastImageBackup(it->first->getBackupId(), clientid);
+												Alerts::checkClient(clientid);
 											}
 											ServerCleanupThread::unlockImageFromCleanup(it->first->getBackupId());
 											delete it->first;
@@ -846,6 +864,8 @@ void ClientMain::operator ()(void)
 					}
 				}
 			}
+
+			updateSchedulingStats(Server->getTimeMS() - cycle_starttime);
 		}
 
 		std::string msg;
@@ -1090,8 +1110,11 @@ bool ClientMain::isUpdateFull(int tgroup)
 	if(update_freq_incr<0)
 		update_freq_incr=0;
 
-	return !backup_dao->hasRecentFullOrIncrFileBackup(convert(-1*update_freq_full)+" seconds",
-		clientid, convert(-1*update_freq_incr)+" seconds", tgroup).exists;
+	const SScheduleTimes& times = getFileScheduleTimes(tgroup);
+	int64 curr_time = Server->getTimeSeconds();
+
+	return !( (times.last_full>0 && times.last_full>curr_time-update_freq_full)
+		|| (times.last_complete>0 && times.last_complete>curr_time-update_freq_incr) );
 }
 
 bool ClientMain::isUpdateIncr(int tgroup)
@@ -1100,8 +1123,9 @@ bool ClientMain::isUpdateIncr(int tgroup)
 	if( update_freq<0 )
 		return false;
 
-	return !backup_dao->hasRecentIncrFileBackup(convert(-1*update_freq)+" seconds",
-		clientid, tgroup).exists;
+	const SScheduleTimes& times = getFileScheduleTimes(tgroup);
+
+	return !(times.last_complete>0 && times.last_complete>Server->getTimeSeconds()-update_freq);
 }
 
 bool ClientMain::isUpdateFullImage(const std::string &letter)
@@ -1114,8 +1138,11 @@ bool ClientMain::isUpdateFullImage(const std::string &letter)
 	if(update_freq_incr<0)
 		update_freq_incr=0;
 
-	return !backup_dao->hasRecentFullOrIncrImageBackup(convert(-1*update_freq_full)+" seconds",
-		clientid, convert(-1*update_freq_incr)+" seconds", curr_image_version, normalizeVolumeUpper(letter)).exists;
+	const SScheduleTimes& times = getImageScheduleTimes(letter);
+	int64 curr_time = Server->getTimeSeconds();
+
+	return !( (times.last_full>0 && times.last_full>curr_time-update_freq_full)
+		|| (times.last_complete>0 && times.last_complete>curr_time-update_freq_incr) );
 }
 
 bool ClientMain::isUpdateFullImage(void)
@@ -1150,8 +1177,103 @@ bool ClientMain::isUpdateIncrImage(const std::string &letter)
 	if( update_freq<0 )
 		return false;
 
-	return !backup_dao->hasRecentIncrImageBackup(convert(-1*update_freq)+" seconds",
-		clientid, curr_image_version, normalizeVolumeUpper(letter)).exists;
+	const SScheduleTimes& times = getImageScheduleTimes(letter);
+
+	return !(times.last_complete>0 && times.last_complete>Server->getTimeSeconds()-update_freq);
+}
+
+const ClientMain::SScheduleTimes& ClientMain::getFileScheduleTimes(int tgroup)
+{
+	std::map<int, SScheduleTimes>::iterator it = file_schedule_cache.find(tgroup);
+	if(it!=file_schedule_cache.end()
+		&& Server->getTimeMS()-it->second.loadtime<c_schedule_cache_max_age)
+	{
+		return it->second;
+	}
+
+	++schedule_cache_misses;
+
+	ServerBackupDao::SLastBackupTimes last_times = backup_dao->getLastFileBackupTimes(clientid, tgroup);
+
+	SScheduleTimes& times = file_schedule_cache[tgroup];
+	times.last_full = last_times.last_full;
+	times.last_complete = last_times.last_complete;
+	times.loadtime = Server->getTimeMS();
+	return times;
+}
+
+const ClientMain::SScheduleTimes& ClientMain::getImageScheduleTimes(const std::string& letter)
+{
+	std::pair<unsigned int, std::string> key(curr_image_version, normalizeVolumeUpper(letter));
+
+	std::map<std::pair<unsigned int, std::string>, SScheduleTimes>::iterator it = image_schedule_cache.find(key);
+	if(it!=image_schedule_cache.end()
+		&& Server->getTimeMS()-it->second.loadtime<c_schedule_cache_max_age)
+	{
+		return it->second;
+	}
+
+	++schedule_cache_misses;
+
+	ServerBackupDao::SLastBackupTimes last_times = backup_dao->getLastImageBackupTimes(clientid, curr_image_version, key.second);
+
+	SScheduleTimes& times = image_schedule_cache[key];
+	times.last_full = last_times.last_full;
+	times.last_complete = last_times.last_complete;
+	times.loadtime = Server->getTimeMS();
+	return times;
+}
+
+void ClientMain::invalidateScheduleCache()
+{
+	IScopedLock lock(schedule_cache_mutex);
+	++schedule_cache_global_generation;
+}
+
+void ClientMain::checkScheduleCache()
+{
+	int64 generation;
+	{
+		IScopedLock lock(schedule_cache_mutex);
+		generation = schedule_cache_global_generation;
+	}
+
+	if(generation!=schedule_cache_generation)
+	{
+		file_schedule_cache.clear();
+		image_schedule_cache.clear();
+		schedule_cache_generation = generation;
+	}
+}
+
+void ClientMain::updateSchedulingStats(int64 cycle_time)
+{
+	++schedule_cycles;
+	schedule_cycle_time_sum+=cycle_time;
+	schedule_cycle_time_max=(std::max)(schedule_cycle_time_max, cycle_time);
+
+	if(cycle_time>c_slow_schedule_cycle)
+	{
+		ServerLogger::Log(logid, "Scheduling cycle took "+PrettyPrintTime(cycle_time), LL_DEBUG);
+	}
+
+	int64 curr_time = Server->getTimeMS();
+	if(last_schedule_stats==0)
+	{
+		last_schedule_stats = curr_time;
+	}
+	else if(curr_time-last_schedule_stats>c_schedule_stats_intervall)
+	{
+		Server->Log("Scheduling stats for client \""+clientname+"\": "+convert(schedule_cycles)+" cycles, avg cycle time "+
+			convert(schedule_cycle_time_sum/schedule_cycles)+" ms, max cycle time "+convert(schedule_cycle_time_max)+" ms, "+
+			convert(schedule_cache_misses)+" schedule cache misses", LL_DEBUG);
+
+		schedule_cycles=0;
+		schedule_cycle_time_sum=0;
+		schedule_cycle_time_max=0;
+		schedule_cache_misses=0;
+		last_schedule_stats = curr_time;
+	}
 }
 
 std::string ClientMain::sendClientMessageRetry(const std::string &msg, const std::string &errmsg, unsigned int timeout,
@@ -1571,6 +1693,11 @@ bool ClientMain::updateCapabilities(void)
 		{
 			protocol_versions.wtokens_version = watoi(it->second);
 		}
+		it = params.find("CDC");
+		if (it != params.end())
+		{
+			protocol_versions.cdc_version = watoi(it->second);
+		}
 		it=params.find("RESTORE");
 		if(it!=params.end())
 		{
@@ -2164,6 +2291,44 @@ IPipeThrottler *ClientMain::getThrottler(int speed_bps)
 	return client_throttler;
 }
 
+IPipeThrottler *ClientMain::getConnectionThrottler(ServerSettings* server_settings)
+{
+	int speed;
+	IPipeThrottler *global_throttler=NULL;
+	if(internet_connection)
+	{
+		speed=server_settings->getInternetSpeed();
+		int global_speed=server_settings->getGlobalInternetSpeed();
+		if(global_speed!=0
+			&& global_speed!=-1)
+		{
+			global_throttler=BackupServer::getGlobalInternetThrottler(global_speed);
+		}
+	}
+	else
+	{
+		speed=server_settings->getLocalSpeed();
+		int global_speed=server_settings->getGlobalLocalSpeed();
+		if(global_speed!=0
+			&& global_speed!=-1)
+		{
+			global_throttler=BackupServer::getGlobalLocalThrottler(global_speed);
+		}
+	}
+
+	if(global_throttler==NULL
+		&& (speed==0 || speed==-1) )
+	{
+		return NULL;
+	}
+
+	//The client throttler is always put below the global one (unlimited if it has no
+	//limit itself), so that clients share the global bandwidth fairly
+	IPipeThrottler *throttler=getThrottler(speed);
+	throttler->setParent(global_throttler, 1);
+	return throttler;
+}
+
 void ClientMain::updateClientAccessKey()
 {
 	std::string access_key = ServerSettings::generateRandomAuthKey(32);
@@ -2303,18 +2468,7 @@ IPipe *ClientMain::getClientCommandConnection(int timeoutms, std::string* client
 		IPipe *ret=InternetServiceConnector::getConnection(curr_clientname, SERVICE_COMMANDS, timeoutms);
 		if(server_settings!=NULL && ret!=NULL)
 		{
-			int internet_speed=server_settings->getInternetSpeed();
-			if(internet_speed!=0
-				&& internet_speed!=-1)
-			{
-				ret->addThrottler(getThrottler(internet_speed));
-			}
-			int global_internet_speed=server_settings->getGlobalInternetSpeed();
-			if(global_internet_speed!=0
-				&& global_internet_speed!=-1)
-			{
-				ret->addThrottler(BackupServer::getGlobalInternetThrottler(global_internet_speed));
-			}
+			ret->addThrottler(getConnectionThrottler(server_settings));
 		}
 		return ret;
 	}
@@ -2323,18 +2477,7 @@ IPipe *ClientMain::getClientCommandConnection(int timeoutms, std::string* client
 		IPipe *ret=Server->ConnectStream(inet_ntoa(getClientaddr().sin_addr), serviceport, timeoutms);
 		if(server_settings!=NULL && ret!=NULL)
 		{
-			int local_speed=server_settings->getLocalSpeed();
-			if(local_speed!=0
-				&& local_speed!=-1)
-			{
-				ret->addThrottler(getThrottler(local_speed));
-			}
-			int global_local_speed=server_settings->getGlobalLocalSpeed();
-			if(global_local_speed!=0
-				&& global_local_speed!=-1)
-			{
-				ret->addThrottler(BackupServer::getGlobalLocalThrottler(global_local_speed));
-			}
+			ret->addThrottler(getConnectionThrottler(server_settings));
 		}
 		return ret;
 	}
@@ -2357,18 +2500,7 @@ _u32 ClientMain::getClientFilesrvConnection(FileClient *fc, ServerSettings* serv
 
 		if(server_settings!=NULL)
 		{
-			int internet_speed=server_settings->getInternetSpeed();
-			if(internet_speed!=0
-				&& internet_speed!=-1)
-			{
-				fc->addThrottler(getThrottler(internet_speed));
-			}
-			int global_internet_speed=server_settings->getGlobalInternetSpeed();
-			if(global_internet_speed!=0
-				&& global_internet_speed!=-1)
-			{
-				fc->addThrottler(BackupServer::getGlobalInternetThrottler(global_internet_speed));
-			}
+			fc->addThrottler(getConnectionThrottler(server_settings));
 		}
 
 		fc->setReconnectionTimeout(c_internet_fileclient_timeout);
@@ -2382,18 +2514,7 @@ _u32 ClientMain::getClientFilesrvConnection(FileClient *fc, ServerSettings* serv
 
 		if(server_settings!=NULL)
 		{
-			int local_speed=server_settings->getLocalSpeed();
-			if(local_speed!=0
-				&& local_speed!=-1)
-			{
-				fc->addThrottler(getThrottler(local_speed));
-			}
-			int global_local_speed=server_settings->getGlobalLocalSpeed();
-			if(global_local_speed!=0
-				&& global_local_speed!=-1)
-			{
-				fc->addThrottler(BackupServer::getGlobalLocalThrottler(global_local_speed));
-			}
+			fc->addThrottler(getConnectionThrottler(server_settings));
 		}
 
 		return ret;
@@ -2440,39 +2561,13 @@ bool ClientMain::getClientChunkedFilesrvConnection(std::auto_ptr<FileClientChunk
 
 	if(fc_chunked->getPipe()!=NULL && server_settings!=NULL)
 	{
-		int speed;
-		if(internet_connection)
-		{
-			speed=server_settings->getInternetSpeed();
-		}
-		else
-		{
-			speed=server_settings->getLocalSpeed();
-		}
-		if(speed!=0
-			&& speed!=-1)
+		if(protocol_versions.cdc_version>0
+			&& server_settings->getSettings()->incr_file_transfer_cdc)
 		{
-			fc_chunked->addThrottler(getThrottler(speed));
+			fc_chunked->setContentDefinedChunking(true);
 		}
 
-		if(internet_connection)
-		{
-			int global_speed=server_settings->getGlobalInternetSpeed();
-			if(global_speed!=0
-				&& global_speed!=-1)
-			{
-				fc_chunked->addThrottler(BackupServer::getGlobalInternetThrottler(global_speed));
-			}
-		}
-		else
-		{
-			int global_speed=server_settings->getGlobalLocalSpeed();
-			if(global_speed!=0
-				&& global_speed!=-1)
-			{
-				fc_chunked->addThrottler(BackupServer::getGlobalLocalThrottler(global_speed));
-			}
-		}
+		fc_chunked->addThrottler(getConnectionThrottler(server_settings));
 	}
 
 	return true;
@@ -47,7 +47,7 @@ struct SProtocolVersions
 				efi_version(0), file_meta(0), select_sha_version(0),
 				client_bitmap_version(0), cmd_version(0),
 				symbit_version(0), phash_version(0),
-				wtokens_version(0)
+				wtokens_version(0), cdc_version(0)
 			{
 
 			}
@@ -69,6 +69,7 @@ struct SProtocolVersions
 	int symbit_version;
 	int phash_version;
 	int wtokens_version;
+	int cdc_version;
 	std::string os_simple;
 };
 
@@ -241,7 +242,21 @@ public:
 
 	static std::string normalizeVolumeUpper(std::string volume);
 
+	static void invalidateScheduleCache();
+
 private:
+	struct SScheduleTimes
+	{
+		int64 last_full;
+		int64 last_complete;
+		int64 loadtime;
+	};
+
+	const SScheduleTimes& getFileScheduleTimes(int tgroup);
+	const SScheduleTimes& getImageScheduleTimes(const std::string& letter);
+	void checkScheduleCache();
+	void updateSchedulingStats(int64 cycle_time);
+
 	void unloadSQL(void);
 	void prepareSQL(void);
 	void updateLastseen(int64 lastseen);
@@ -264,6 +279,7 @@ private:
 	bool isBackupsRunningOkay(bool file, bool incr=false);	
 	bool updateCapabilities(void);
 	IPipeThrottler *getThrottler(int speed_bps);
+	IPipeThrottler *getConnectionThrottler(ServerSettings* server_settings);
 	bool inBackupWindow(Backup* backup);
 	void updateClientAccessKey();
 	bool isDataplanOkay(bool file);
@@ -393,4 +409,16 @@ private:
 	volatile bool update_capa;
 
 	volatile bool do_reauthenticate;
+
+	std::map<int, SScheduleTimes> file_schedule_cache;
+	std::map<std::pair<unsigned int, std::string>, SScheduleTimes> image_schedule_cache;
+	int64 schedule_cache_generation;
+	int64 schedule_cache_misses;
+	int64 schedule_cycles;
+	int64 schedule_cycle_time_sum;
+	int64 schedule_cycle_time_max;
+	int64 last_schedule_stats;
+
+	static IMutex* schedule_cache_mutex;
+	static int64 schedule_cache_global_generation;
 };
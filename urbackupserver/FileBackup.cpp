@@ -40,6 +40,9 @@
 #include "../urbackupcommon/TreeHash.h"
 #include "../common/data.h"
 #include "PhashLoad.h"
+#include "ServerDownloadThread.h"
+#include "Alerts.h"
+#include "ChunkStore.h"
 
 #ifndef NAME_MAX
 #define NAME_MAX _POSIX_NAME_MAX
@@ -707,7 +710,7 @@ _i64 FileBackup::getIncrementalSize(IFile *f, const std::vector<size_t> &diffs,
 	return rsize;
 }
 
-void FileBackup::calculateDownloadSpeed(int64 ctime, FileClient & fc, FileClientChunked * fc_chunked)
+void FileBackup::calculateDownloadSpeed(int64 ctime, FileClient & fc, FileClientChunked * fc_chunked, ServerDownloadThread* server_download)
 {
 	if (speed_set_time == 0)
 	{
@@ -716,7 +719,8 @@ void FileBackup::calculateDownloadSpeed(int64 ctime, FileClient & fc, FileClient
 
 	if (ctime - speed_set_time>10000)
 	{
-		int64 received_data_bytes = fc.getTransferredBytes() + (fc_chunked != NULL ? fc_chunked->getTransferredBytes() : 0);
+		int64 received_data_bytes = fc.getTransferredBytes() + (fc_chunked != NULL ? fc_chunked->getTransferredBytes() : 0)
+			+ (server_download != NULL ? server_download->getSecondaryTransferredBytes() : 0);
 
 		int64 new_bytes = received_data_bytes - last_speed_received_bytes;
 		int64 passed_time = ctime - speed_set_time;
@@ -733,17 +737,21 @@ void FileBackup::calculateDownloadSpeed(int64 ctime, FileClient & fc, FileClient
 					speed_bpms);
 			}
 
+			ServerStatus::setProcessQueueState(clientname, status_id, fc.getQueueState(),
+				fc_chunked != NULL ? fc_chunked->getQueueState() : QueueDepthEstimator::SState());
+
 			last_speed_received_bytes = received_data_bytes;
 		}
 	}
 }
 
 void FileBackup::calculateEtaFileBackup( int64 &last_eta_update, int64& eta_set_time, int64 ctime, FileClient &fc, FileClientChunked* fc_chunked,
-	int64 linked_bytes, int64 &last_eta_received_bytes, double &eta_estimated_speed, _i64 files_size )
+	int64 linked_bytes, int64 &last_eta_received_bytes, double &eta_estimated_speed, _i64 files_size, ServerDownloadThread* server_download )
 {
 	last_eta_update=ctime;
 
-	int64 received_data_bytes = fc.getReceivedDataBytes(true) + (fc_chunked?fc_chunked->getReceivedDataBytes(true):0) + linked_bytes;
+	int64 received_data_bytes = fc.getReceivedDataBytes(true) + (fc_chunked?fc_chunked->getReceivedDataBytes(true):0) + linked_bytes
+		+ (server_download!=NULL ? server_download->getSecondaryReceivedDataBytes(true) : 0);
 
 	int64 new_bytes =  received_data_bytes - last_eta_received_bytes;
 	int64 passed_time = Server->getTimeMS() - eta_set_time;
@@ -774,6 +782,62 @@ void FileBackup::calculateEtaFileBackup( int64 &last_eta_update, int64& eta_set_
 	}
 }
 
+void FileBackup::addParallelDownloadStreams(ServerDownloadThread* server_download, bool with_chunked)
+{
+	if (client_main->getProtocolVersions().filesrv_protocol_version <= 2)
+	{
+		return;
+	}
+
+	int download_streams;
+	if (client_main->isOnInternetConnection())
+	{
+		download_streams = server_settings->getSettings()->internet_file_download_streams;
+	}
+	else
+	{
+		download_streams = server_settings->getSettings()->local_file_download_streams;
+	}
+
+	std::string identity = client_main->getIdentity();
+
+	for (int i = 1; i < download_streams; ++i)
+	{
+		std::auto_ptr<FileClient> fc(new FileClient(false, identity, client_main->getProtocolVersions().filesrv_protocol_version,
+			client_main->isOnInternetConnection(), client_main, use_tmpfiles ? NULL : client_main));
+
+		_u32 rc = client_main->getClientFilesrvConnection(fc.get(), server_settings.get(), 10000);
+		if (rc != ERR_CONNECTED)
+		{
+			ServerLogger::Log(logid, "Could not open additional download connection to client. Continuing with "
+				+ convert(server_download->getNumStreams()) + " connection(s)", LL_WARNING);
+			break;
+		}
+		fc->setProgressLogCallback(this);
+
+		std::auto_ptr<FileClientChunked> fc_chunked;
+		if (with_chunked)
+		{
+			if (!client_main->getClientChunkedFilesrvConnection(fc_chunked, server_settings.get(), 10000)
+				|| fc_chunked->hasError())
+			{
+				ServerLogger::Log(logid, "Could not open additional chunked download connection to client. Continuing with "
+					+ convert(server_download->getNumStreams()) + " connection(s)", LL_WARNING);
+				break;
+			}
+			fc_chunked->setProgressLogCallback(this);
+			fc_chunked->setDestroyPipe(true);
+		}
+
+		server_download->addSecondaryStream(fc.release(), fc_chunked.release());
+	}
+
+	if (server_download->getNumStreams() > 1)
+	{
+		ServerLogger::Log(logid, "Downloading files using " + convert(server_download->getNumStreams()) + " parallel connections", LL_DEBUG);
+	}
+}
+
 bool FileBackup::doBackup()
 {
 	if(!client_main->handle_not_enough_space(""))
@@ -860,6 +924,7 @@ bool FileBackup::doBackup()
 	{
 		backup_dao->updateClientLastFileBackup(backupid, static_cast<int>(num_issues), clientid);
 		backup_dao->updateFileBackupSetComplete(backupid);
+		Alerts::checkClient(clientid);
 	}
 
 
@@ -1074,7 +1139,13 @@ bool FileBackup::create_hardlink(const std::string & linkname, const std::string
 {
 	if (use_ioref && BackupServer::isReflinkCopy())
 	{
-		return copy_file(fname, linkname);
+		return ChunkStore::copyFile(fname, linkname, NULL);
+	}
+
+	if (use_ioref && ChunkStore::isManifest(fname))
+	{
+		//A reflink would share the manifest without referencing its chunks
+		return ChunkStore::copyFile(fname, linkname, NULL);
 	}
 
 	return os_create_hardlink(linkname, fname, use_ioref, too_many_links);
@@ -1367,7 +1438,7 @@ std::string FileBackup::getSHA256(const std::string& fn)
 	sha256_ctx ctx;
 	sha256_init(&ctx);
 
-	IFile * f=Server->openFile(os_file_prefix(fn), MODE_READ);
+	IFile * f=ChunkStore::openFile(os_file_prefix(fn), MODE_READ);
 
 	if(f==NULL)
 	{
@@ -1394,7 +1465,7 @@ std::string FileBackup::getSHA512(const std::string& fn)
 	sha512_ctx ctx;
 	sha512_init(&ctx);
 
-	IFile * f=Server->openFile(os_file_prefix(fn), MODE_READ);
+	IFile * f=ChunkStore::openFile(os_file_prefix(fn), MODE_READ);
 
 	if(f==NULL)
 	{
@@ -1419,7 +1490,7 @@ std::string FileBackup::getSHA512(const std::string& fn)
 
 std::string FileBackup::getSHADef(const std::string& fn)
 {
-	std::auto_ptr<IFsFile> f(Server->openFile(os_file_prefix(fn), MODE_READ));
+	std::auto_ptr<IFsFile> f(ChunkStore::openFile(os_file_prefix(fn), MODE_READ));
 
 	if (f.get() == NULL)
 	{
@@ -18,6 +18,7 @@ class BackupServerPrepareHash;
 class ServerPingThread;
 class FileIndex;
 class PhashLoad;
+class ServerDownloadThread;
 
 namespace
 {
@@ -74,27 +75,44 @@ class MaxFileId
 public:
 	MaxFileId()
 		: mutex(Server->createMutex()),
-		max_downloaded(std::string::npos), max_preprocessed(0),
-		min_downloaded(0)
+		max_preprocessed(0)
 	{}
 
-	void setMinDownloaded(size_t id)
+	//Downloads within one stream finish in order. Finishing a download
+	//therefore also finishes all earlier downloads of the same stream.
+	//Ids without a stream (std::string::npos) only finish themselves.
+	void setMinDownloaded(size_t id, size_t stream=std::string::npos)
 	{
 		IScopedLock lock(mutex.get());
-		if (max_downloaded>id)
-		{
-			max_downloaded = id;
-		}
-		min_downloaded = id+1;
+		pending_downloads[id] = stream;
 	}
 
 	void setMaxDownloaded(size_t id)
 	{
 		IScopedLock lock(mutex.get());
-		max_downloaded = id + 1;
-		if (max_downloaded >= min_downloaded)
+		std::map<size_t, size_t>::iterator it_id = pending_downloads.find(id);
+		if (it_id == pending_downloads.end())
+		{
+			return;
+		}
+		size_t stream = it_id->second;
+		if (stream == std::string::npos)
+		{
+			pending_downloads.erase(it_id);
+			return;
+		}
+		for (std::map<size_t, size_t>::iterator it = pending_downloads.begin();
+			it != pending_downloads.end() && it->first <= id;)
 		{
-			max_downloaded = std::string::npos;
+			if (it->second == stream)
+			{
+				std::map<size_t, size_t>::iterator it_del = it++;
+				pending_downloads.erase(it_del);
+			}
+			else
+			{
+				++it;
+			}
 		}
 	}
 
@@ -107,7 +125,7 @@ public:
 	bool isFinished(size_t id)
 	{
 		IScopedLock lock(mutex.get());
-		if (id + 1 <= max_downloaded
+		if ( (pending_downloads.empty() || pending_downloads.begin()->first > id)
 			&& id + 1 <= max_preprocessed)
 		{
 			return true;
@@ -117,9 +135,8 @@ public:
 
 private:
 	std::auto_ptr<IMutex> mutex;
-	size_t max_downloaded;
+	std::map<size_t, size_t> pending_downloads;
 	size_t max_preprocessed;
-	size_t min_downloaded;
 };
 
 class FileBackup : public Backup, public FileClient::ProgressLogCallback
@@ -168,9 +185,10 @@ protected:
 	void createHashThreads(bool use_reflink, bool ignore_hash_mismatches);
 	void destroyHashThreads();
 	_i64 getIncrementalSize(IFile *f, const std::vector<size_t> &diffs, bool& backup_with_components, bool all=false);
-	void calculateDownloadSpeed(int64 ctime, FileClient &fc, FileClientChunked* fc_chunked);
+	void calculateDownloadSpeed(int64 ctime, FileClient &fc, FileClientChunked* fc_chunked, ServerDownloadThread* server_download=NULL);
 	void calculateEtaFileBackup( int64 &last_eta_update, int64& eta_set_time, int64 ctime, FileClient &fc, FileClientChunked* fc_chunked,
-		int64 linked_bytes, int64 &last_eta_received_bytes, double &eta_estimated_speed, _i64 files_size );
+		int64 linked_bytes, int64 &last_eta_received_bytes, double &eta_estimated_speed, _i64 files_size, ServerDownloadThread* server_download=NULL );
+	void addParallelDownloadStreams(ServerDownloadThread* server_download, bool with_chunked);
 	bool hasChange(size_t line, const std::vector<size_t> &diffs);
 	bool link_file(const std::string &fn, const std::string &short_fn, const std::string &curr_path,
 		const std::string &os_path, const std::string& sha2, _i64 filesize, bool add_sql, FileMetadata& metadata);
@@ -0,0 +1,339 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "FileIndexChecker.h"
+#include "../Interface/Server.h"
+#include "../Interface/Database.h"
+#include "../stringtools.h"
+#include "database.h"
+#include "FileIndex.h"
+#include "create_files_index.h"
+#include "server_hash.h"
+#include "server_settings.h"
+#include "dao/ServerBackupDao.h"
+#include <algorithm>
+
+namespace
+{
+	const int64 c_startup_wait = 10 * 60 * 1000;
+	const int64 c_disabled_wait = 10 * 60 * 1000;
+	const int64 c_recheck_wait = 10 * 1000;
+	const size_t c_max_slice_size = 1000;
+	const char* c_pos_key = "files_index_check_pos";
+}
+
+FileIndexChecker::FileIndexChecker()
+	: db(NULL), files_db(NULL), q_get_slice(NULL), pos(0), n_inconsistent(0), n_repaired(0)
+{
+}
+
+void FileIndexChecker::operator()()
+{
+	Server->wait(c_startup_wait);
+
+	fileindex.reset(create_lmdb_files_index());
+	if (fileindex.get() == NULL)
+	{
+		Server->Log("File entry index not present. Not running online file entry index check.", LL_WARNING);
+		delete this;
+		return;
+	}
+
+	db = Server->getDatabase(Server->getThreadID(), URBACKUPDB_SERVER);
+	files_db = Server->getDatabase(Server->getThreadID(), URBACKUPDB_SERVER_FILES);
+
+	filesdao.reset(new ServerFilesDao(files_db));
+	backupdao.reset(new ServerBackupDao(db));
+
+	q_get_slice = files_db->Prepare("SELECT id, shahash, filesize, clientid, next_entry, prev_entry, pointed_to FROM files WHERE id>? ORDER BY id ASC LIMIT ?", false);
+
+	ServerBackupDao::CondString str_pos = backupdao->getMiscValue(c_pos_key);
+	if (str_pos.exists)
+	{
+		pos = watoi64(str_pos.value);
+		Server->Log("Resuming online file entry index check at file entry id " + convert(pos), LL_INFO);
+	}
+
+	while (true)
+	{
+		bool repair;
+		int rate;
+		{
+			ServerSettings server_settings(db);
+			rate = server_settings.getSettings()->file_index_check_rate;
+			repair = server_settings.getSettings()->file_index_check_repair;
+		}
+
+		if (rate <= 0)
+		{
+			Server->wait(c_disabled_wait);
+			continue;
+		}
+
+		int64 starttime = Server->getTimeMS();
+
+		size_t slice_size = (std::min)(static_cast<size_t>(rate), c_max_slice_size);
+		std::vector<int64> suspects;
+		size_t n_checked = checkSlice(slice_size, suspects);
+
+		if (!suspects.empty())
+		{
+			//The files table and the delayed file entry index updates are not
+			//changed atomically, so only act on entries which are still
+			//inconsistent a while later
+			Server->wait(c_recheck_wait);
+			recheckSuspects(suspects, repair);
+		}
+
+		if (n_checked < slice_size)
+		{
+			Server->Log("Online file entry index check pass finished. Inconsistent entries: " + convert(n_inconsistent) +
+				" Repaired: " + convert(n_repaired), n_inconsistent>0 ? LL_WARNING : LL_INFO);
+			pos = 0;
+			n_inconsistent = 0;
+			n_repaired = 0;
+		}
+
+		backupdao->delMiscValue(c_pos_key);
+		backupdao->addMiscValue(c_pos_key, convert(pos));
+
+		int64 slice_time = (static_cast<int64>(slice_size) * 60 * 1000) / rate;
+		int64 passed = Server->getTimeMS() - starttime;
+		Server->wait(static_cast<unsigned int>((std::max)(slice_time - passed, static_cast<int64>(1000))));
+	}
+}
+
+size_t FileIndexChecker::checkSlice(size_t slice_size, std::vector<int64>& suspects)
+{
+	files_db->BeginReadTransaction();
+
+	q_get_slice->Bind(pos);
+	q_get_slice->Bind(static_cast<int64>(slice_size));
+	db_results res = q_get_slice->Read();
+	q_get_slice->Reset();
+
+	for (size_t i = 0; i < res.size(); ++i)
+	{
+		SCheckEntry entry;
+		entry.id = watoi64(res[i]["id"]);
+		entry.shahash = res[i]["shahash"];
+		entry.filesize = watoi64(res[i]["filesize"]);
+		entry.clientid = watoi(res[i]["clientid"]);
+		entry.next_entry = watoi64(res[i]["next_entry"]);
+		entry.prev_entry = watoi64(res[i]["prev_entry"]);
+		entry.pointed_to = watoi(res[i]["pointed_to"]);
+
+		if (checkEntry(entry, ECheckMode_Scan) == ECheckResult_Inconsistent)
+		{
+			suspects.push_back(entry.id);
+		}
+
+		pos = entry.id;
+	}
+
+	files_db->EndTransaction();
+
+	return res.size();
+}
+
+void FileIndexChecker::recheckSuspects(const std::vector<int64>& suspects, bool repair)
+{
+	repaired_keys.clear();
+
+	filesdao->BeginWriteTransaction();
+
+	for (size_t i = 0; i < suspects.size(); ++i)
+	{
+		ServerFilesDao::SFindFileEntry fentry = filesdao->getFileEntry(suspects[i]);
+		if (!fentry.exists)
+		{
+			continue;
+		}
+
+		SCheckEntry entry;
+		entry.id = fentry.id;
+		entry.shahash = fentry.shahash;
+		entry.filesize = fentry.filesize;
+		entry.clientid = fentry.clientid;
+		entry.next_entry = fentry.next_entry;
+		entry.prev_entry = fentry.prev_entry;
+		entry.pointed_to = fentry.pointed_to;
+
+		if (checkEntry(entry, repair ? ECheckMode_Repair : ECheckMode_Flag) == ECheckResult_Inconsistent)
+		{
+			++n_inconsistent;
+		}
+	}
+
+	filesdao->endTransaction();
+}
+
+FileIndexChecker::ECheckResult FileIndexChecker::checkEntry(const SCheckEntry& entry, ECheckMode mode)
+{
+	if (entry.filesize < link_file_min_size
+		|| entry.shahash.size() < bytes_in_index)
+	{
+		return ECheckResult_Skip;
+	}
+
+	bool ok = true;
+
+	if (entry.prev_entry != 0
+		&& !checkLink(entry, entry.prev_entry, true, mode))
+	{
+		ok = false;
+	}
+
+	if (entry.next_entry != 0
+		&& !checkLink(entry, entry.next_entry, false, mode))
+	{
+		ok = false;
+	}
+
+	FileIndex::SIndexKey key(entry.shahash.data(), entry.filesize, entry.clientid);
+	int64 index_id = fileindex->get_with_cache_exact(key);
+
+	if (index_id == 0)
+	{
+		ok = false;
+		if (flagIndexRepair("File entry with id " + convert(entry.id) + " is not in the file entry index", entry, mode))
+		{
+			fileindex->put_delayed(key, entry.id);
+			if (entry.pointed_to == 0)
+			{
+				filesdao->setPointedTo(1, entry.id);
+			}
+		}
+	}
+	else if (index_id == entry.id)
+	{
+		if (entry.pointed_to == 0)
+		{
+			ok = false;
+			if (flag("File entry with id " + convert(entry.id) + " is in the file entry index but has pointed_to=0", mode))
+			{
+				filesdao->setPointedTo(1, entry.id);
+			}
+		}
+	}
+	else
+	{
+		ServerFilesDao::SFindFileEntry index_entry = filesdao->getFileEntry(index_id);
+		if (!index_entry.exists
+			|| !sameFile(entry, index_entry))
+		{
+			ok = false;
+			if (flagIndexRepair("File entry index points to invalid file entry id " + convert(index_id) + " instead of file entry id " + convert(entry.id), entry, mode))
+			{
+				fileindex->put_delayed(key, entry.id);
+				if (entry.pointed_to == 0)
+				{
+					filesdao->setPointedTo(1, entry.id);
+				}
+			}
+		}
+		else if (entry.pointed_to != 0)
+		{
+			ok = false;
+			if (flag("File entry with id " + convert(entry.id) + " has pointed_to set, but the file entry index points to id " + convert(index_id), mode))
+			{
+				filesdao->setPointedTo(0, entry.id);
+			}
+		}
+	}
+
+	return ok ? ECheckResult_Ok : ECheckResult_Inconsistent;
+}
+
+bool FileIndexChecker::checkLink(const SCheckEntry& entry, int64 link_id, bool is_prev, ECheckMode mode)
+{
+	std::string link_name = is_prev ? "prev" : "next";
+
+	ServerFilesDao::SFindFileEntry link_entry = filesdao->getFileEntry(link_id);
+
+	if (!link_entry.exists)
+	{
+		//Splitting the chain here is safe. Entries in the detached part
+		//only lose deduplication against the indexed part.
+		if (flag("File entry with id " + convert(entry.id) + " has " + link_name + " entry " + convert(link_id) + " which does not exist", mode))
+		{
+			if (is_prev)
+			{
+				filesdao->setPrevEntry(0, entry.id);
+			}
+			else
+			{
+				filesdao->setNextEntry(0, entry.id);
+			}
+		}
+		return false;
+	}
+
+	int64 back_link = is_prev ? link_entry.next_entry : link_entry.prev_entry;
+
+	if (back_link != entry.id
+		|| !sameFile(entry, link_entry))
+	{
+		if (mode != ECheckMode_Scan)
+		{
+			Server->Log("File entry with id " + convert(entry.id) + " has " + link_name + " entry " + convert(link_id) +
+				" which does not link back to it or belongs to a different file. Rebuild the file entry index to fix this.", LL_ERROR);
+		}
+		return false;
+	}
+
+	return true;
+}
+
+bool FileIndexChecker::flag(const std::string& msg, ECheckMode mode)
+{
+	if (mode == ECheckMode_Scan)
+	{
+		return false;
+	}
+
+	if (mode == ECheckMode_Repair)
+	{
+		Server->Log(msg + ". Repairing.", LL_WARNING);
+		++n_repaired;
+		return true;
+	}
+
+	Server->Log(msg + ".", LL_WARNING);
+	return false;
+}
+
+bool FileIndexChecker::flagIndexRepair(const std::string& msg, const SCheckEntry& entry, ECheckMode mode)
+{
+	if (mode == ECheckMode_Repair
+		&& !repaired_keys.insert(entry.shahash + "|" + convert(entry.filesize) + "|" + convert(entry.clientid)).second)
+	{
+		//The index entry for this key was already replaced during this recheck and
+		//the delayed put is not visible yet. The entry is checked again in the next pass.
+		return false;
+	}
+
+	return flag(msg, mode);
+}
+
+bool FileIndexChecker::sameFile(const SCheckEntry& entry, const ServerFilesDao::SFindFileEntry& other)
+{
+	return other.shahash == entry.shahash
+		&& other.filesize == entry.filesize
+		&& other.clientid == entry.clientid;
+}
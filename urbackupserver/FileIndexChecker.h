@@ -0,0 +1,73 @@
+#pragma once
+
+#include "../Interface/Thread.h"
+#include "../Interface/Types.h"
+#include "dao/ServerFilesDao.h"
+#include <vector>
+#include <set>
+#include <memory>
+#include <string>
+
+class FileIndex;
+class ServerBackupDao;
+
+class FileIndexChecker : public IThread
+{
+public:
+	FileIndexChecker();
+
+	void operator()();
+
+private:
+	enum ECheckResult
+	{
+		ECheckResult_Ok = 0,
+		ECheckResult_Skip = 1,
+		ECheckResult_Inconsistent = 2
+	};
+
+	enum ECheckMode
+	{
+		ECheckMode_Scan = 0,
+		ECheckMode_Flag = 1,
+		ECheckMode_Repair = 2
+	};
+
+	struct SCheckEntry
+	{
+		int64 id;
+		std::string shahash;
+		int64 filesize;
+		int clientid;
+		int64 next_entry;
+		int64 prev_entry;
+		int pointed_to;
+	};
+
+	size_t checkSlice(size_t slice_size, std::vector<int64>& suspects);
+
+	ECheckResult checkEntry(const SCheckEntry& entry, ECheckMode mode);
+
+	bool checkLink(const SCheckEntry& entry, int64 link_id, bool is_prev, ECheckMode mode);
+
+	bool flag(const std::string& msg, ECheckMode mode);
+
+	bool flagIndexRepair(const std::string& msg, const SCheckEntry& entry, ECheckMode mode);
+
+	bool sameFile(const SCheckEntry& entry, const ServerFilesDao::SFindFileEntry& other);
+
+	void recheckSuspects(const std::vector<int64>& suspects, bool repair);
+
+	IDatabase* db;
+	IDatabase* files_db;
+	std::auto_ptr<FileIndex> fileindex;
+	std::auto_ptr<ServerFilesDao> filesdao;
+	std::auto_ptr<ServerBackupDao> backupdao;
+	IQuery* q_get_slice;
+
+	std::set<std::string> repaired_keys;
+
+	int64 pos;
+	int64 n_inconsistent;
+	int64 n_repaired;
+};
@@ -25,6 +25,7 @@
 #include <limits.h>
 #include "../common/adler32.h"
 #include "FileBackup.h"
+#include <string.h>
 
 namespace server
 {
@@ -35,21 +36,143 @@ const _u32 ID_METADATA_NOP = 0;
 const _u32 ID_METADATA_V1 = 1<<3;
 const _u32 ID_RAW_FILE = 1 << 4;
 
+namespace
+{
+	const size_t c_metadata_read_buffer_size = 512*1024;
+	const size_t c_num_apply_workers = 4;
+	const size_t c_max_pending_apply_items = 4096;
+	const int64 c_max_pending_apply_bytes = 64*1024*1024;
+	const int64 c_max_buffered_raw_file_size = 1024*1024;
+	const int c_metadata_poll_wait = 1000;
+
+	class MetadataBufferFile : public IFile
+	{
+	public:
+		MetadataBufferFile()
+			: pos(0) {}
+
+		virtual std::string Read(_u32 tr, bool *has_error=NULL)
+		{
+			std::string ret = Read(pos, tr, has_error);
+			pos += ret.size();
+			return ret;
+		}
+
+		virtual std::string Read(int64 spos, _u32 tr, bool *has_error = NULL)
+		{
+			if (spos >= static_cast<int64>(data.size()))
+			{
+				return std::string();
+			}
+			return data.substr(static_cast<size_t>(spos), tr);
+		}
+
+		virtual _u32 Read(char* buffer, _u32 bsize, bool *has_error=NULL)
+		{
+			_u32 read = Read(pos, buffer, bsize, has_error);
+			pos += read;
+			return read;
+		}
+
+		virtual _u32 Read(int64 spos, char* buffer, _u32 bsize, bool *has_error = NULL)
+		{
+			if (spos >= static_cast<int64>(data.size()))
+			{
+				return 0;
+			}
+			_u32 read = static_cast<_u32>((std::min)(static_cast<size_t>(bsize), data.size() - static_cast<size_t>(spos)));
+			memcpy(buffer, data.data() + spos, read);
+			return read;
+		}
+
+		virtual _u32 Write(const std::string &tw, bool *has_error=NULL)
+		{
+			return Write(tw.data(), static_cast<_u32>(tw.size()), has_error);
+		}
+
+		virtual _u32 Write(int64 spos, const std::string &tw, bool *has_error = NULL)
+		{
+			return Write(spos, tw.data(), static_cast<_u32>(tw.size()), has_error);
+		}
+
+		virtual _u32 Write(const char* buffer, _u32 bsiz, bool *has_error=NULL)
+		{
+			_u32 written = Write(pos, buffer, bsiz, has_error);
+			pos += written;
+			return written;
+		}
+
+		virtual _u32 Write(int64 spos, const char* buffer, _u32 bsiz, bool *has_error = NULL)
+		{
+			if (static_cast<size_t>(spos) + bsiz > data.size())
+			{
+				data.resize(static_cast<size_t>(spos) + bsiz);
+			}
+			memcpy(&data[static_cast<size_t>(spos)], buffer, bsiz);
+			return bsiz;
+		}
+
+		virtual bool Seek(_i64 spos)
+		{
+			pos = static_cast<size_t>(spos);
+			return true;
+		}
+
+		virtual _i64 Size(void)
+		{
+			return data.size();
+		}
+
+		virtual _i64 RealSize()
+		{
+			return data.size();
+		}
+
+		virtual bool PunchHole(_i64 spos, _i64 size)
+		{
+			return false;
+		}
+
+		virtual bool Sync()
+		{
+			return true;
+		}
+
+		virtual std::string getFilename(void)
+		{
+			return "metadata buffer";
+		}
+
+		std::string& getData()
+		{
+			return data;
+		}
+
+	private:
+		std::string data;
+		size_t pos;
+	};
+}
+
 FileMetadataDownloadThread::FileMetadataDownloadThread(FileClient* fc, const std::string& server_token, logid_t logid,
 	int backupid, int clientid, bool use_tmpfiles, std::string tmpfile_path)
-	: fc(fc), server_token(server_token), logid(logid), has_error(false), dry_run(false),
-	backupid(backupid), max_metadata_id(0), clientid(clientid), has_fatal_error(false), has_timeout_error(false),
-	use_tmpfiles(use_tmpfiles), tmpfile_path(tmpfile_path), is_complete(false), is_finished(false), mutex(Server->createMutex()),
-	cond(Server->createCondition()), force_start(false), orig_progress_log_callback(fc->getProgressLogCallback())
+	: fc(fc), server_token(server_token), has_error(false), has_fatal_error(false), has_timeout_error(false),
+	logid(logid), max_metadata_id(0), dry_run(false), backupid(backupid), clientid(clientid),
+	orig_progress_log_callback(fc->getProgressLogCallback()), use_tmpfiles(use_tmpfiles), tmpfile_path(tmpfile_path),
+	read_buf_pos(0), read_buf_size(0), apply_mutex(Server->createMutex()), apply_cond(Server->createCondition()),
+	apply_done_cond(Server->createCondition()), apply_pending(0), apply_pending_bytes(0), apply_raw_sql_pending(0), apply_stop(false), apply_error(false), apply_fatal_error(false),
+	is_complete(false), is_finished(false), force_start(false), mutex(Server->createMutex()), cond(Server->createCondition())
 {
 
 }
 
 FileMetadataDownloadThread::FileMetadataDownloadThread(const std::string& server_token, std::string metadata_tmp_fn,
 	int backupid, int clientid, bool use_tmpfiles, std::string tmpfile_path)
-	: fc(NULL), server_token(server_token), has_error(false), metadata_tmp_fn(metadata_tmp_fn),
-	dry_run(true), backupid(backupid), max_metadata_id(0), clientid(clientid), has_fatal_error(false), has_timeout_error(false),
-	use_tmpfiles(use_tmpfiles), tmpfile_path(tmpfile_path), is_complete(false), is_finished(true), force_start(false)
+	: fc(NULL), server_token(server_token), has_error(false), has_fatal_error(false), has_timeout_error(false),
+	metadata_tmp_fn(metadata_tmp_fn), max_metadata_id(0), dry_run(true), backupid(backupid), clientid(clientid),
+	use_tmpfiles(use_tmpfiles), tmpfile_path(tmpfile_path),
+	read_buf_pos(0), read_buf_size(0), apply_pending(0), apply_pending_bytes(0), apply_raw_sql_pending(0), apply_stop(false), apply_error(false), apply_fatal_error(false),
+	is_complete(false), is_finished(true), force_start(false)
 {
 
 }
@@ -90,8 +213,41 @@ void FileMetadataDownloadThread::operator()()
 bool FileMetadataDownloadThread::applyMetadata( const std::string& backup_metadata_dir,
 	const std::string& backup_dir, INotEnoughSpaceCallback *cb, BackupServerHash* local_hash, FilePathCorrections& filepath_corrections,
 	size_t& num_embedded_files, MaxFileId* max_file_id)
+{
+	if (!dry_run)
+	{
+		startApplyWorkers(cb);
+	}
+
+	bool ret = applyMetadataInt(backup_metadata_dir, backup_dir, cb, local_hash, filepath_corrections,
+		num_embedded_files, max_file_id);
+
+	if (!dry_run)
+	{
+		if (!stopApplyWorkers())
+		{
+			ret = false;
+		}
+
+		if (apply_fatal_error)
+		{
+			has_fatal_error = true;
+		}
+
+		addRawFileEntries(local_hash);
+	}
+
+	return ret;
+}
+
+bool FileMetadataDownloadThread::applyMetadataInt( const std::string& backup_metadata_dir,
+	const std::string& backup_dir, INotEnoughSpaceCallback *cb, BackupServerHash* local_hash, FilePathCorrections& filepath_corrections,
+	size_t& num_embedded_files, MaxFileId* max_file_id)
 {
 	buffer.resize(32768);
+	read_buf.resize(c_metadata_read_buffer_size);
+	read_buf_pos = 0;
+	read_buf_size = 0;
 	int mode = MODE_READ_SEQUENTIAL;
 #ifdef _WIN32
 	mode = MODE_READ_DEVICE;
@@ -353,102 +509,47 @@ bool FileMetadataDownloadThread::applyMetadata( const std::string& backup_metada
 				{
 					break;
 				}
-				cond->wait(&lock, 60000);
+				cond->wait(&lock, c_metadata_poll_wait);
 			}
 
-			std::auto_ptr<IFile> output_f;
-			bool new_metadata_file = false;
-
+			bool apply = false;
 			int ftype = 0;
 
 			if (!dry_run)
 			{
 				ftype = os_get_file_type(os_file_prefix(backup_dir + os_file_sep() + os_path));
 
-				output_f.reset(Server->openFile(os_file_prefix(backup_metadata_dir + os_file_sep() + os_path_metadata), MODE_RW));
+				apply = ftype != 0
+					|| os_get_file_type(os_file_prefix(backup_metadata_dir + os_file_sep() + os_path_metadata)) != 0;
 
-				if (output_f.get() == NULL
-					&& ftype == 0)
+				if (!apply)
 				{
 					ServerLogger::Log(logid, "Metadata file and \"" + backup_dir + os_file_sep() + os_path + "\" do not exist. Skipping applying metdata for this file.", isComplete() ? LL_WARNING : LL_DEBUG);
 				}
-				else if (output_f.get() == NULL)
-				{
-					output_f.reset(Server->openFile(os_file_prefix(backup_metadata_dir + os_file_sep() + os_path_metadata), MODE_RW_CREATE));
-					new_metadata_file = true;
-				}
-
-				if (output_f.get() == NULL
-					&& ftype != 0)
-				{
-					ServerLogger::Log(logid, "Error saving metadata. Could not open output file at \"" + backup_metadata_dir + os_file_sep() + os_path_metadata + "\"", LL_ERROR);
-					return false;
-				}
 			}
 
-			FileMetadata curr_metadata;
-			if(!dry_run && output_f.get() != NULL && !new_metadata_file && !read_metadata(output_f.get(), curr_metadata))
+			//OS specific metadata is verified and buffered here, and written by the apply workers
+			std::auto_ptr<MetadataBufferFile> os_metadata;
+			if (apply)
 			{
-				ServerLogger::Log(logid, "Error reading current metadata", LL_WARNING);
+				os_metadata.reset(new MetadataBufferFile);
 			}
 
-			curr_metadata.exist=true;
-			curr_metadata.created=created;
-			curr_metadata.last_modified = modified;
-			curr_metadata.file_permissions = permissions;
-			curr_metadata.accessed = accessed;
-
-			int64 offset = 0;
-
-			if(!dry_run && output_f.get() != NULL)
-			{
-				int64 truncate_to_bytes;
-				if(!write_file_metadata(output_f.get(), cb, curr_metadata, true, truncate_to_bytes))
-				{
-					ServerLogger::Log(logid, "Error saving metadata. Cannot write common metadata.", LL_ERROR);
-					return false;
-				}
-
-				offset = os_metadata_offset(output_f.get());
-
-				if(offset==-1)
-				{
-					ServerLogger::Log(logid, "Error saving metadata. Metadata offset cannot be calculated at \"" + backup_metadata_dir+os_file_sep()+os_path_metadata + "\"", LL_ERROR);
-					return false;
-				}
-
-				if(!output_f->Seek(offset))
-				{
-					ServerLogger::Log(logid, "Error saving metadata. Could not seek to end of file \"" + backup_metadata_dir+os_file_sep()+os_path_metadata + "\"", LL_ERROR);
-					return false;
-				}
-			}			
-
 			int64 metadata_size=0;
 			bool ok=false;
 			if(ch & ID_METADATA_OS_WIN)
 			{
-				ok = applyWindowsMetadata(metadata_f.get(), output_f.get(), metadata_size, cb, offset, metadataf_pos);
+				ok = applyWindowsMetadata(metadata_f.get(), os_metadata.get(), metadata_size, cb, 0, metadataf_pos);
 			}
             else if(ch & ID_METADATA_OS_UNIX)
             {
-                ok = applyUnixMetadata(metadata_f.get(), output_f.get(), metadata_size, cb, offset, metadataf_pos);
+                ok = applyUnixMetadata(metadata_f.get(), os_metadata.get(), metadata_size, cb, 0, metadataf_pos);
             }
 
 			if(!ok)
 			{
 				ServerLogger::Log(logid, "Error saving metadata. Could not save OS specific metadata to \"" + backup_metadata_dir+os_file_sep()+os_path_metadata + "\"", isComplete() ? LL_ERROR : LL_DEBUG);
 
-				if(!dry_run && output_f.get() != NULL)
-				{
-					output_f.reset();
-					if(!os_file_truncate(os_file_prefix(backup_metadata_dir+os_file_sep()+os_path_metadata),
-						offset))
-					{
-						ServerLogger::Log(logid, "Could not truncate file \"" + backup_metadata_dir+os_file_sep()+os_path_metadata + "\" after error.", LL_ERROR);
-					}
-				}
-
 				if (isComplete())
 				{
 					copyForAnalysis(metadata_f.get());
@@ -456,16 +557,6 @@ bool FileMetadataDownloadThread::applyMetadata( const std::string& backup_metada
 				
 				return false;
 			}
-			else if(!dry_run && output_f.get() != NULL && offset+metadata_size<output_f->Size())
-			{
-				output_f.reset();
-				if(!os_file_truncate(os_file_prefix(backup_metadata_dir+os_file_sep()+os_path_metadata),
-					offset+metadata_size))
-				{
-					ServerLogger::Log(logid, "Error saving metadata. Could not truncate file \"" + backup_metadata_dir+os_file_sep()+os_path_metadata + "\"", LL_ERROR);
-					return false;
-				}
-			}
 
 			max_metadata_id = (std::max)(max_metadata_id, metadata_id);
 
@@ -476,26 +567,35 @@ bool FileMetadataDownloadThread::applyMetadata( const std::string& backup_metada
 				last_metadata_ids.erase(last_metadata_ids.begin(), last_metadata_ids.begin()+4000);
 			}
 
-			bool win_is_symlink = false;
+			if (apply)
+			{
+				bool win_is_symlink = false;
 
 #ifdef _WIN32
-			if (!is_dir)
-			{
-				if (ftype &EFileType_Symlink)
+				if (!is_dir)
 				{
-					win_is_symlink = true;
+					if (ftype &EFileType_Symlink)
+					{
+						win_is_symlink = true;
+					}
 				}
-			}
 #endif
 
-			if(!dry_run && output_f.get() != NULL && !is_dir && !win_is_symlink
-				&& !os_set_file_time(os_file_prefix(backup_dir+os_file_sep()+os_path), created, modified, accessed))
-			{
-				ServerLogger::Log(logid, "Error setting file time of "+backup_dir+os_file_sep()+os_path+" . "+os_last_error_str(), LL_WARNING);
-			}
+				SApplyItem* item = new SApplyItem;
+				item->os_path = backup_dir + os_file_sep() + os_path;
+				item->os_path_metadata = backup_metadata_dir + os_file_sep() + os_path_metadata;
+				item->set_file_time = !is_dir && !win_is_symlink;
+				item->created = created;
+				item->modified = modified;
+				item->accessed = accessed;
+				item->permissions = permissions;
+				item->os_metadata.swap(os_metadata->getData());
+
+				if (!queueApplyItem(item))
+				{
+					return false;
+				}
 
-			if(!dry_run && output_f.get() != NULL)
-			{
 				addFolderItem(curr_fn.substr(1), backup_dir+os_file_sep()+os_path, is_dir, created, modified, accessed, folder_items);
 			}
 		}
@@ -647,36 +747,73 @@ bool FileMetadataDownloadThread::applyMetadata( const std::string& backup_metada
 
 			output_f_size = little_endian(output_f_size);
 
-			while (metadata_f->Size() < metadataf_pos + output_f_size + SHA512_DIGEST_SIZE)
+			//Small embedded files are buffered and written and verified by the apply workers
+			bool buffer_data = !dry_run && output_f_size <= c_max_buffered_raw_file_size;
+			std::string raw_data;
+			std::string checksum;
+
+			if (buffer_data)
 			{
-				IScopedLock lock(mutex.get());
-				if (is_finished)
+				raw_data.resize(static_cast<size_t>(output_f_size));
+				checksum.resize(SHA512_DIGEST_SIZE);
+
+				if ( (!raw_data.empty() && !readRetry(metadata_f.get(), &raw_data[0], raw_data.size()))
+					|| !readRetry(metadata_f.get(), &checksum[0], checksum.size()) )
 				{
-					break;
+					ServerLogger::Log(logid, "Error saving metadata. Output data could not be read. (2) " + os_last_error_str(), LL_ERROR);
+					if (isComplete())
+					{
+						copyForAnalysis(metadata_f.get());
+					}
+					has_fatal_error = true;
+					return false;
 				}
-				cond->wait(&lock, 60000);
-			}
 
-			if (!metadata_f->Seek(metadataf_pos + output_f_size))
+				metadataf_pos += output_f_size + SHA512_DIGEST_SIZE;
+			}
+			else
 			{
-				ServerLogger::Log(logid, "Error seeking in metadata for output file checksum. "+os_last_error_str(), LL_ERROR);
-				if (isComplete())
+				while (metadata_f->Size() < metadataf_pos + output_f_size + SHA512_DIGEST_SIZE)
 				{
-					copyForAnalysis(metadata_f.get());
+					IScopedLock lock(mutex.get());
+					if (is_finished)
+					{
+						break;
+					}
+					cond->wait(&lock, c_metadata_poll_wait);
 				}
-				has_fatal_error = true;
-				return false;
-			}
 
-			std::string checksum = metadata_f->Read(SHA512_DIGEST_SIZE);
-			if (checksum.size() != SHA512_DIGEST_SIZE)
-			{
-				ServerLogger::Log(logid, "Error reading output file checksum. " + os_last_error_str(), LL_ERROR);
-				if (isComplete())
+				//File data is accessed directly below
+				read_buf_pos = 0;
+				read_buf_size = 0;
+
+				if (!metadata_f->Seek(metadataf_pos + output_f_size))
 				{
-					copyForAnalysis(metadata_f.get());
+					ServerLogger::Log(logid, "Error seeking in metadata for output file checksum. "+os_last_error_str(), LL_ERROR);
+					if (isComplete())
+					{
+						copyForAnalysis(metadata_f.get());
+					}
+					has_fatal_error = true;
+					return false;
 				}
-				has_fatal_error = true;
+
+				checksum = metadata_f->Read(SHA512_DIGEST_SIZE);
+				if (checksum.size() != SHA512_DIGEST_SIZE)
+				{
+					ServerLogger::Log(logid, "Error reading output file checksum. " + os_last_error_str(), LL_ERROR);
+					if (isComplete())
+					{
+						copyForAnalysis(metadata_f.get());
+					}
+					has_fatal_error = true;
+					return false;
+				}
+			}
+
+			if ( (!buffer_data || (output_f_size > 4096 && local_hash != NULL))
+				&& !waitApplyIdle(os_path_metadata, output_f_size > 4096 && local_hash != NULL) )
+			{
 				return false;
 			}
 
@@ -685,6 +822,10 @@ bool FileMetadataDownloadThread::applyMetadata( const std::string& backup_metada
 			if (output_f_size > 4096
 				&& local_hash!=NULL)
 			{
+				//Embedded files written by the apply workers have to be in the
+				//database before looking for a file to link to
+				addRawFileEntries(local_hash);
+
 				bool tries_once;
 				std::string ff_last;
 				bool hardlink_limit;
@@ -710,7 +851,38 @@ bool FileMetadataDownloadThread::applyMetadata( const std::string& backup_metada
 				}
 			}
 
-			if (copy_file)
+			if (copy_file && buffer_data)
+			{
+				ServerLogger::Log(logid, "META: Copying file: \"" + os_path + "\"", LL_DEBUG);
+
+				std::auto_ptr<IFile> output_f(Server->openFile(os_file_prefix(os_path), MODE_WRITE));
+
+				if (output_f.get() == NULL)
+				{
+					ServerLogger::Log(logid, "Error opening output file \"" + os_path + "\". " + os_last_error_str(), LL_ERROR);
+					has_fatal_error = true;
+					return false;
+				}
+
+				//Created here, so that the metadata of the file is applied
+				output_f.reset();
+
+				SApplyItem* item = new SApplyItem;
+				item->os_path = os_path;
+				item->os_path_metadata = os_path_metadata;
+				item->is_raw_file = true;
+				item->raw_data.swap(raw_data);
+				item->raw_checksum = checksum;
+				item->raw_add_sql = output_f_size > 4096 && local_hash != NULL;
+
+				if (!queueApplyItem(item))
+				{
+					return false;
+				}
+
+				addRawFileEntries(local_hash);
+			}
+			else if (copy_file)
 			{
 				ServerLogger::Log(logid, "META: Copying file: \"" + os_path + "\"", LL_DEBUG);
 
@@ -808,7 +980,7 @@ bool FileMetadataDownloadThread::applyMetadata( const std::string& backup_metada
 				metadata.set_shahash(checksum);
 				write_file_metadata(os_path_metadata, cb, metadata, false);
 			}
-			else
+			else if (!buffer_data)
 			{
 				metadataf_pos += output_f_size + SHA512_DIGEST_SIZE;
 			}
@@ -1393,27 +1565,306 @@ void FileMetadataDownloadThread::addFolderItem(std::string path, const std::stri
 
 bool FileMetadataDownloadThread::readRetry(IFile * metadata_f, char * buf, size_t bsize)
 {
+	bool finished = false;
 	while (true)
 	{
-		_u32 read = metadata_f->Read(buf, static_cast<_u32>(bsize));
-		if (read != static_cast<_u32>(bsize))
+		size_t avail = read_buf_size - read_buf_pos;
+		if (avail > 0)
 		{
+			size_t tocopy = (std::min)(avail, bsize);
+			memcpy(buf, read_buf.data() + read_buf_pos, tocopy);
+			read_buf_pos += tocopy;
+			buf += tocopy;
+			bsize -= tocopy;
+		}
+
+		if (bsize == 0)
+		{
+			return true;
+		}
+
+		_u32 read;
+		if (bsize >= read_buf.size())
+		{
+			read = metadata_f->Read(buf, static_cast<_u32>(bsize));
 			bsize -= read;
 			buf += read;
+
+			if (bsize == 0)
+			{
+				return true;
+			}
 		}
 		else
 		{
-			return true;
+			read_buf_pos = 0;
+			read_buf_size = metadata_f->Read(&read_buf[0], static_cast<_u32>(read_buf.size()));
+			read = static_cast<_u32>(read_buf_size);
+			if (read_buf_size >= bsize)
+			{
+				continue;
+			}
+		}
+
+		if (finished)
+		{
+			if (read > 0)
+			{
+				continue;
+			}
+			return false;
 		}
+
 		IScopedLock lock(mutex.get());
 		if (is_finished)
 		{
-			break;
+			finished = true;
+		}
+		else
+		{
+			cond->wait(&lock, c_metadata_poll_wait);
+		}
+	}
+}
+
+void FileMetadataDownloadThread::startApplyWorkers(INotEnoughSpaceCallback * cb)
+{
+	apply_stop = false;
+	apply_error = false;
+	apply_pending = 0;
+	apply_pending_bytes = 0;
+	apply_raw_sql_pending = 0;
+	apply_fatal_error = false;
+	apply_queues.resize(c_num_apply_workers);
+	apply_shard_pending.resize(c_num_apply_workers);
+
+	for (size_t i = 0; i < c_num_apply_workers; ++i)
+	{
+		apply_workers.push_back(new FileMetadataApplyWorker(this, i, cb));
+		apply_worker_tickets.push_back(Server->getThreadPool()->execute(apply_workers[i], "fb meta apply worker"));
+	}
+}
+
+bool FileMetadataDownloadThread::stopApplyWorkers()
+{
+	{
+		IScopedLock lock(apply_mutex.get());
+		apply_stop = true;
+		apply_cond->notify_all();
+	}
+
+	Server->getThreadPool()->waitFor(apply_worker_tickets);
+
+	for (size_t i = 0; i < apply_workers.size(); ++i)
+	{
+		delete apply_workers[i];
+	}
+	apply_workers.clear();
+	apply_worker_tickets.clear();
+
+	for (size_t i = 0; i < apply_queues.size(); ++i)
+	{
+		for (size_t j = 0; j < apply_queues[i].size(); ++j)
+		{
+			delete apply_queues[i][j];
+		}
+	}
+	apply_queues.clear();
+	apply_shard_pending.clear();
+
+	return !apply_error;
+}
+
+size_t FileMetadataDownloadThread::applyShard(const std::string & os_path_metadata)
+{
+	//Items of one directory go to the same worker, so they are applied in order
+	std::string dir = ExtractFilePath(os_path_metadata, os_file_sep());
+	return urb_adler32(urb_adler32(0, NULL, 0), dir.data(), static_cast<_u32>(dir.size())) % apply_queues.size();
+}
+
+bool FileMetadataDownloadThread::queueApplyItem(SApplyItem * item)
+{
+	size_t idx = applyShard(item->os_path_metadata);
+	int64 item_bytes = item->os_metadata.size() + item->raw_data.size();
+
+	IScopedLock lock(apply_mutex.get());
+
+	while ( (apply_pending >= c_max_pending_apply_items
+			|| (apply_pending > 0 && apply_pending_bytes + item_bytes > c_max_pending_apply_bytes) )
+		&& !apply_error)
+	{
+		apply_done_cond->wait(&lock);
+	}
+
+	if (apply_error)
+	{
+		delete item;
+		return false;
+	}
+
+	apply_queues[idx].push_back(item);
+	++apply_pending;
+	++apply_shard_pending[idx];
+	apply_pending_bytes += item_bytes;
+	if (item->raw_add_sql)
+	{
+		++apply_raw_sql_pending;
+	}
+	apply_cond->notify_all();
+
+	return true;
+}
+
+bool FileMetadataDownloadThread::waitApplyIdle(const std::string & os_path_metadata, bool wait_raw_sql)
+{
+	if (dry_run)
+	{
+		return true;
+	}
+
+	size_t idx = applyShard(os_path_metadata);
+
+	IScopedLock lock(apply_mutex.get());
+
+	while ( (apply_shard_pending[idx] > 0
+			|| (wait_raw_sql && apply_raw_sql_pending > 0) )
+		&& !apply_error)
+	{
+		apply_done_cond->wait(&lock);
+	}
+
+	return !apply_error;
+}
+
+void FileMetadataDownloadThread::runApplyWorker(size_t idx, INotEnoughSpaceCallback * cb)
+{
+	while (true)
+	{
+		SApplyItem* item;
+		{
+			IScopedLock lock(apply_mutex.get());
+			while (apply_queues[idx].empty()
+				&& !apply_stop)
+			{
+				apply_cond->wait(&lock);
+			}
+
+			if (apply_queues[idx].empty())
+			{
+				return;
+			}
+
+			item = apply_queues[idx].front();
+			apply_queues[idx].pop_front();
+		}
+
+		int64 item_bytes = item->os_metadata.size() + item->raw_data.size();
+		bool is_raw_file = item->is_raw_file;
+		bool raw_add_sql = item->raw_add_sql;
+		bool ok = apply_error
+			|| (is_raw_file ? applyRawItem(*item, cb) : applyItem(*item, cb));
+		delete item;
+
+		IScopedLock lock(apply_mutex.get());
+		--apply_pending;
+		--apply_shard_pending[idx];
+		apply_pending_bytes -= item_bytes;
+		if (raw_add_sql)
+		{
+			--apply_raw_sql_pending;
+		}
+		if (!ok)
+		{
+			apply_error = true;
+			if (is_raw_file)
+			{
+				apply_fatal_error = true;
+			}
+		}
+		apply_done_cond->notify_all();
+	}
+}
+
+bool FileMetadataDownloadThread::applyItem(SApplyItem & item, INotEnoughSpaceCallback * cb)
+{
+	bool new_metadata_file = false;
+	std::auto_ptr<IFile> output_f(Server->openFile(os_file_prefix(item.os_path_metadata), MODE_RW));
+
+	if (output_f.get() == NULL)
+	{
+		output_f.reset(Server->openFile(os_file_prefix(item.os_path_metadata), MODE_RW_CREATE));
+		new_metadata_file = true;
+	}
+
+	if (output_f.get() == NULL)
+	{
+		ServerLogger::Log(logid, "Error saving metadata. Could not open output file at \"" + item.os_path_metadata + "\"", LL_ERROR);
+		return false;
+	}
+
+	FileMetadata curr_metadata;
+	if (!new_metadata_file && !read_metadata(output_f.get(), curr_metadata))
+	{
+		ServerLogger::Log(logid, "Error reading current metadata", LL_WARNING);
+	}
+
+	curr_metadata.exist = true;
+	curr_metadata.created = item.created;
+	curr_metadata.last_modified = item.modified;
+	curr_metadata.file_permissions = item.permissions;
+	curr_metadata.accessed = item.accessed;
+
+	int64 truncate_to_bytes;
+	if (!write_file_metadata(output_f.get(), cb, curr_metadata, true, truncate_to_bytes))
+	{
+		ServerLogger::Log(logid, "Error saving metadata. Cannot write common metadata.", LL_ERROR);
+		return false;
+	}
+
+	int64 offset = os_metadata_offset(output_f.get());
+
+	if (offset == -1)
+	{
+		ServerLogger::Log(logid, "Error saving metadata. Metadata offset cannot be calculated at \"" + item.os_path_metadata + "\"", LL_ERROR);
+		return false;
+	}
+
+	if (!output_f->Seek(offset))
+	{
+		ServerLogger::Log(logid, "Error saving metadata. Could not seek to end of file \"" + item.os_path_metadata + "\"", LL_ERROR);
+		return false;
+	}
+
+	if (!writeRepeatFreeSpace(output_f.get(), item.os_metadata.data(), item.os_metadata.size(), cb))
+	{
+		ServerLogger::Log(logid, "Error saving metadata. Could not save OS specific metadata to \"" + item.os_path_metadata + "\"", LL_ERROR);
+
+		output_f.reset();
+		if (!os_file_truncate(os_file_prefix(item.os_path_metadata), offset))
+		{
+			ServerLogger::Log(logid, "Could not truncate file \"" + item.os_path_metadata + "\" after error.", LL_ERROR);
+		}
+		return false;
+	}
+
+	int64 metadata_size = static_cast<int64>(item.os_metadata.size());
+	if (offset + metadata_size < output_f->Size())
+	{
+		output_f.reset();
+		if (!os_file_truncate(os_file_prefix(item.os_path_metadata), offset + metadata_size))
+		{
+			ServerLogger::Log(logid, "Error saving metadata. Could not truncate file \"" + item.os_path_metadata + "\"", LL_ERROR);
+			return false;
 		}
-		cond->wait(&lock, 60000);
 	}
 
-	return metadata_f->Read(buf, static_cast<_u32>(bsize)) == static_cast<_u32>(bsize);
+	if (item.set_file_time
+		&& !os_set_file_time(os_file_prefix(item.os_path), item.created, item.modified, item.accessed))
+	{
+		ServerLogger::Log(logid, "Error setting file time of " + item.os_path + " . " + os_last_error_str(), LL_WARNING);
+	}
+
+	return true;
 }
 
 void FileMetadataDownloadThread::setComplete()
@@ -1546,6 +1997,80 @@ int check_metadata()
 	return metadata_thread.applyMetadata(std::string(), std::string(), NULL, NULL, corrections, num_embedded_files, NULL)?0:1;
 }
 
+bool FileMetadataDownloadThread::applyRawItem(SApplyItem & item, INotEnoughSpaceCallback * cb)
+{
+	unsigned char dig[SHA512_DIGEST_SIZE];
+	sha512(reinterpret_cast<const unsigned char*>(item.raw_data.data()), static_cast<unsigned int>(item.raw_data.size()), dig);
+
+	if (item.raw_checksum.size() != SHA512_DIGEST_SIZE
+		|| memcmp(item.raw_checksum.data(), dig, SHA512_DIGEST_SIZE) != 0)
+	{
+		ServerLogger::Log(logid, "Data checksum of file \"" + item.os_path + "\" wrong.", LL_ERROR);
+		return false;
+	}
+
+	std::auto_ptr<IFile> output_f(Server->openFile(os_file_prefix(item.os_path), MODE_WRITE));
+
+	if (output_f.get() == NULL)
+	{
+		ServerLogger::Log(logid, "Error opening output file \"" + item.os_path + "\". " + os_last_error_str(), LL_ERROR);
+		return false;
+	}
+
+	if (!item.raw_data.empty()
+		&& !writeRepeatFreeSpace(output_f.get(), item.raw_data.data(), item.raw_data.size(), cb))
+	{
+		ServerLogger::Log(logid, "Error saving metadata. Error writing to output file. " + os_last_error_str(), LL_ERROR);
+		return false;
+	}
+
+	output_f.reset();
+
+	FileMetadata metadata;
+	metadata.exist = true;
+	metadata.set_shahash(item.raw_checksum);
+	write_file_metadata(item.os_path_metadata, cb, metadata, false);
+
+	if (item.raw_add_sql)
+	{
+		SRawFileEntry entry;
+		entry.os_path = item.os_path;
+		entry.os_path_metadata = item.os_path_metadata;
+		entry.checksum = item.raw_checksum;
+		entry.size = item.raw_data.size();
+
+		IScopedLock lock(apply_mutex.get());
+		apply_raw_done.push_back(entry);
+	}
+
+	return true;
+}
+
+void FileMetadataDownloadThread::addRawFileEntries(BackupServerHash * local_hash)
+{
+	std::vector<SRawFileEntry> entries;
+	{
+		IScopedLock lock(apply_mutex.get());
+		entries.swap(apply_raw_done);
+	}
+
+	if (local_hash == NULL)
+	{
+		return;
+	}
+
+	for (size_t i = 0; i < entries.size(); ++i)
+	{
+		local_hash->addFileSQL(backupid, clientid, 0, entries[i].os_path, entries[i].os_path_metadata, entries[i].checksum, entries[i].size,
+			entries[i].size, 0, 0, 0, true);
+	}
+}
+
+void FileMetadataDownloadThread::FileMetadataApplyWorker::operator()()
+{
+	fmdlt->runApplyWorker(idx, cb);
+}
+
 void FileMetadataDownloadThread::FileMetadataApplyThread::operator()()
 {
 	has_success = fmdlt->applyMetadata(backup_metadata_dir, backup_dir, cb, local_hash, filepath_corrections, num_embedded_files, &max_file_id);
@@ -4,7 +4,9 @@
 #include "server_prepare_hash.h"
 #include "../urbackupcommon/chunk_hasher.h"
 #include "server_log.h"
+#include "../Interface/ThreadPool.h"
 #include <memory>
+#include <deque>
 
 class BackupServerHash;
 class FilePathCorrections;
@@ -103,6 +105,63 @@ public:
 
 private:
 
+	struct SApplyItem
+	{
+		SApplyItem()
+			: set_file_time(false), created(0), modified(0), accessed(0),
+			is_raw_file(false), raw_add_sql(false) {}
+
+		std::string os_path;
+		std::string os_path_metadata;
+		bool set_file_time;
+		int64 created;
+		int64 modified;
+		int64 accessed;
+		std::string permissions;
+		std::string os_metadata;
+
+		bool is_raw_file;
+		std::string raw_data;
+		std::string raw_checksum;
+		bool raw_add_sql;
+	};
+
+	struct SRawFileEntry
+	{
+		std::string os_path;
+		std::string os_path_metadata;
+		std::string checksum;
+		int64 size;
+	};
+
+	class FileMetadataApplyWorker : public IThread
+	{
+	public:
+		FileMetadataApplyWorker(FileMetadataDownloadThread* fmdlt, size_t idx, INotEnoughSpaceCallback *cb)
+			: fmdlt(fmdlt), idx(idx), cb(cb) {}
+
+		virtual void operator()();
+
+	private:
+		FileMetadataDownloadThread* fmdlt;
+		size_t idx;
+		INotEnoughSpaceCallback *cb;
+	};
+
+	bool applyMetadataInt(const std::string& backup_metadata_dir, const std::string& backup_dir,
+		INotEnoughSpaceCallback *cb, BackupServerHash* local_hash, FilePathCorrections& filepath_corrections,
+		size_t& num_embedded_files, MaxFileId* max_file_id);
+
+	void startApplyWorkers(INotEnoughSpaceCallback *cb);
+	bool stopApplyWorkers();
+	size_t applyShard(const std::string& os_path_metadata);
+	bool queueApplyItem(SApplyItem* item);
+	bool waitApplyIdle(const std::string& os_path_metadata, bool wait_raw_sql=false);
+	void runApplyWorker(size_t idx, INotEnoughSpaceCallback *cb);
+	bool applyItem(SApplyItem& item, INotEnoughSpaceCallback *cb);
+	bool applyRawItem(SApplyItem& item, INotEnoughSpaceCallback *cb);
+	void addRawFileEntries(BackupServerHash* local_hash);
+
 	void setComplete();
 	void setFinished();
 
@@ -138,6 +197,25 @@ private:
 	std::string tmpfile_path;
 	std::vector<char> buffer;
 
+	std::vector<char> read_buf;
+	size_t read_buf_pos;
+	size_t read_buf_size;
+
+	std::auto_ptr<IMutex> apply_mutex;
+	std::auto_ptr<ICondition> apply_cond;
+	std::auto_ptr<ICondition> apply_done_cond;
+	std::vector<std::deque<SApplyItem*> > apply_queues;
+	std::vector<FileMetadataApplyWorker*> apply_workers;
+	std::vector<THREADPOOL_TICKET> apply_worker_tickets;
+	std::vector<size_t> apply_shard_pending;
+	std::vector<SRawFileEntry> apply_raw_done;
+	size_t apply_pending;
+	int64 apply_pending_bytes;
+	size_t apply_raw_sql_pending;
+	bool apply_stop;
+	bool apply_error;
+	bool apply_fatal_error;
+
 	bool is_complete;
 	bool is_finished;
 	bool force_start;
@@ -230,6 +230,9 @@ bool FullFileBackup::doFileBackup()
 		0, logid, with_hashes, shares_without_snapshot, with_sparse_hashing, metadata_download_thread.get(),
 		backup_with_components, filepath_corrections, max_file_id));
 
+	//Full backups do not use a chunked file client
+	addParallelDownloadStreams(server_download.get(), false);
+
 	bool queue_downloads = client_main->getProtocolVersions().filesrv_protocol_version>2;
 
 	THREADPOOL_TICKET server_download_ticket = 
@@ -304,7 +307,8 @@ bool FullFileBackup::doFileBackup()
 						}
 						else
 						{
-							int64 done_bytes = fc.getReceivedDataBytes(true) + linked_bytes;
+							int64 done_bytes = fc.getReceivedDataBytes(true) + linked_bytes
+								+ server_download->getSecondaryReceivedDataBytes(true);
 							ServerStatus::setProcessDoneBytes(clientname, status_id, done_bytes);
 							ServerStatus::setProcessPcDone(clientname, status_id,
 								(std::min)(100, (int)(((float)done_bytes) / ((float)files_size / 100.f) + 0.5f)));
@@ -316,10 +320,10 @@ bool FullFileBackup::doFileBackup()
 
 					if (ctime - last_eta_update > eta_update_intervall)
 					{
-						calculateEtaFileBackup(last_eta_update, eta_set_time, ctime, fc, NULL, linked_bytes, last_eta_received_bytes, eta_estimated_speed, files_size);
+						calculateEtaFileBackup(last_eta_update, eta_set_time, ctime, fc, NULL, linked_bytes, last_eta_received_bytes, eta_estimated_speed, files_size, server_download.get());
 					}
 
-					calculateDownloadSpeed(ctime, fc, NULL);
+					calculateDownloadSpeed(ctime, fc, NULL, server_download.get());
 
 				} while (server_download->sleepQueue());
 
@@ -624,7 +628,8 @@ bool FullFileBackup::doFileBackup()
 		}
 		else
 		{
-			int64 done_bytes = fc.getReceivedDataBytes(true) + linked_bytes;
+			int64 done_bytes = fc.getReceivedDataBytes(true) + linked_bytes
+				+ server_download->getSecondaryReceivedDataBytes(true);
 			ServerStatus::setProcessDoneBytes(clientname, status_id, done_bytes);
 			ServerStatus::setProcessPcDone(clientname, status_id,
 				(std::min)(100,(int)(((float)done_bytes)/((float)files_size/100.f)+0.5f)));
@@ -636,10 +641,10 @@ bool FullFileBackup::doFileBackup()
 		int64 ctime = Server->getTimeMS();
 		if(ctime-last_eta_update>eta_update_intervall)
 		{
-			calculateEtaFileBackup(last_eta_update, eta_set_time, ctime, fc, NULL, linked_bytes, last_eta_received_bytes, eta_estimated_speed, files_size);
+			calculateEtaFileBackup(last_eta_update, eta_set_time, ctime, fc, NULL, linked_bytes, last_eta_received_bytes, eta_estimated_speed, files_size, server_download.get());
 		}
 
-		calculateDownloadSpeed(ctime, fc, NULL);
+		calculateDownloadSpeed(ctime, fc, NULL, server_download.get());
 	}
 
 	ServerStatus::setProcessSpeed(clientname, status_id, 0);
@@ -946,8 +951,8 @@ bool FullFileBackup::doFileBackup()
 		}
 	}
 
-	_i64 transferred_bytes=fc.getTransferredBytes();
-	_i64 transferred_compressed=fc.getRealTransferredBytes();
+	_i64 transferred_bytes=fc.getTransferredBytes()+server_download->getSecondaryTransferredBytes();
+	_i64 transferred_compressed=fc.getRealTransferredBytes()+server_download->getSecondaryRealTransferredBytes();
 	int64 passed_time=transfer_stop_time-full_backup_starttime;
 	if(passed_time==0) passed_time=1;
 
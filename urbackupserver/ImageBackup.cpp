@@ -41,6 +41,7 @@
 #include "server_ping.h"
 #include "snapshot_helper.h"
 #include "server.h"
+#include "Alerts.h"
 
 const unsigned int status_update_intervall=1000;
 const unsigned int eta_update_intervall=60000;
@@ -315,6 +316,7 @@ bool ImageBackup::doBackup()
 		&& dependencies.empty() )
 	{
 		backup_dao->updateClientLastImageBackup(backupid, clientid);
+		Alerts::checkClient(clientid);
 	}
 
 	if(pingthread!=NULL)
@@ -37,6 +37,7 @@
 #include "database.h"
 #include <algorithm>
 #include "PhashLoad.h"
+#include "ChunkStore.h"
 
 extern std::string server_identity;
 
@@ -508,6 +509,8 @@ bool IncrFileBackup::doFileBackup()
 		incremental_num, logid, with_hashes, shares_without_snapshot, with_sparse_hashing, metadata_download_thread.get(),
 		backup_with_components, filepath_corrections, max_file_id));
 
+	addParallelDownloadStreams(server_download.get(), fc_chunked.get()!=NULL);
+
 	bool queue_downloads = client_main->getProtocolVersions().filesrv_protocol_version>2;
 
 	THREADPOOL_TICKET server_download_ticket = 
@@ -673,7 +676,8 @@ bool IncrFileBackup::doFileBackup()
 						else
 						{
 							int64 done_bytes = fc.getReceivedDataBytes(true)
-								+ (fc_chunked.get() ? fc_chunked->getReceivedDataBytes(true) : 0) + linked_bytes;
+								+ (fc_chunked.get() ? fc_chunked->getReceivedDataBytes(true) : 0) + linked_bytes
+								+ server_download->getSecondaryReceivedDataBytes(true);
 							ServerStatus::setProcessDoneBytes(clientname, status_id, done_bytes);
 							ServerStatus::setProcessPcDone(clientname, status_id,
 								(std::min)(100, (int)(((float)done_bytes) / ((float)files_size / 100.f) + 0.5f)));
@@ -685,10 +689,10 @@ bool IncrFileBackup::doFileBackup()
 
 					if (ctime - last_eta_update > eta_update_intervall)
 					{
-						calculateEtaFileBackup(last_eta_update, eta_set_time, ctime, fc, fc_chunked.get(), linked_bytes, last_eta_received_bytes, eta_estimated_speed, files_size);
+						calculateEtaFileBackup(last_eta_update, eta_set_time, ctime, fc, fc_chunked.get(), linked_bytes, last_eta_received_bytes, eta_estimated_speed, files_size, server_download.get());
 					}
 
-					calculateDownloadSpeed(ctime, fc, fc_chunked.get());
+					calculateDownloadSpeed(ctime, fc, fc_chunked.get(), server_download.get());
 				} while (server_download->sleepQueue());
 
 				if(server_download->isOffline() && !r_offline)
@@ -756,52 +760,67 @@ bool IncrFileBackup::doFileBackup()
 						{
 							std::string srcpath=last_backuppath+local_curr_os_path;
 							std::string src_hashpath = last_backuppath_hashes+local_curr_os_path;
-							if(link_directory_pool(clientid, backuppath+local_curr_os_path, srcpath, dir_pool_path,
-								 BackupServer::isFilesystemTransactionEnabled(), link_dao, link_journal_dao, depth) )
+							std::vector<SDirLinkItem> link_items(2);
+							link_items[0].target_dir = backuppath + local_curr_os_path;
+							link_items[0].src_dir = srcpath;
+							link_items[0].depth = depth;
+							link_items[1].target_dir = backuppath_hashes + local_curr_os_path;
+							link_items[1].src_dir = src_hashpath;
+							link_items[1].depth = depth;
+
+							std::vector<bool> linked;
+							if(link_directory_pool_batch(clientid, link_items, dir_pool_path,
+								BackupServer::isFilesystemTransactionEnabled(), link_dao, link_journal_dao, linked) )
 							{
-								if(link_directory_pool(clientid, backuppath_hashes + local_curr_os_path, src_hashpath, dir_pool_path,
-									BackupServer::isFilesystemTransactionEnabled(), link_dao, link_journal_dao, depth) )
+								skip_dir_completely = 1;
+								dir_linked = true;
+
+								if (copy_last_file_entries)
 								{
-									skip_dir_completely = 1;
-									dir_linked = true;
-
-									if (copy_last_file_entries)
-									{
-										std::vector<ServerFilesDao::SFileEntry> file_entries = filesdao->getFileEntriesFromTemporaryTableGlob(escape_glob_sql(srcpath) + os_file_sep() + "*");
-										for (size_t i = 0; i < file_entries.size(); ++i)
-										{
-											if (file_entries[i].fullpath.size() > srcpath.size())
-											{
-												std::string entry_hashpath;
-												if (next(file_entries[i].hashpath, 0, src_hashpath))
-												{
-													entry_hashpath = backuppath_hashes + local_curr_os_path + file_entries[i].hashpath.substr(src_hashpath.size());
-												}
-
-												addFileEntrySQLWithExisting(backuppath + local_curr_os_path + file_entries[i].fullpath.substr(srcpath.size()), entry_hashpath,
-													file_entries[i].shahash, file_entries[i].filesize, file_entries[i].filesize, incremental_num);
-
-												++num_copied_file_entries;
-											}
-										}
+									std::vector<ServerFilesDao::SFileEntry> file_entries = filesdao->getFileEntriesFromTemporaryTableGlob(escape_glob_sql(srcpath) + os_file_sep() + "*");
+									for (size_t i = 0; i < file_entries.size(); ++i)
+									{
+										if (file_entries[i].fullpath.size() > srcpath.size())
+										{
+											std::string entry_hashpath;
+											if (next(file_entries[i].hashpath, 0, src_hashpath))
+											{
+												entry_hashpath = backuppath_hashes + local_curr_os_path + file_entries[i].hashpath.substr(src_hashpath.size());
+											}
+
+											addFileEntrySQLWithExisting(backuppath + local_curr_os_path + file_entries[i].fullpath.substr(srcpath.size()), entry_hashpath,
+												file_entries[i].shahash, file_entries[i].filesize, file_entries[i].filesize, incremental_num);
 
-										skip_dir_copy_sparse = false;
-									}
-									else
-									{
-										skip_dir_copy_sparse = readd_file_entries_sparse;
+											++num_copied_file_entries;
+										}
 									}
+
+									skip_dir_copy_sparse = false;
 								}
 								else
+								{
+									skip_dir_copy_sparse = readd_file_entries_sparse;
+								}
+							}
+							else
+							{
+								bool remove_err = false;
+								for (size_t i = 0; i < link_items.size(); ++i)
 								{
 									std::auto_ptr<DBScopedSynchronous> link_dao_synchronous;
-									if (!remove_directory_link(backuppath + local_curr_os_path, *link_dao, clientid, link_dao_synchronous))
+									if (linked[i]
+										&& !remove_directory_link(link_items[i].target_dir, *link_dao, clientid, link_dao_synchronous))
 									{
-										ServerLogger::Log(logid, "Could not remove symlinked directory \"" + backuppath + local_curr_os_path + "\" after symlinking metadata directory failed.", LL_ERROR);
-										c_has_error = true;
-										break;
+										ServerLogger::Log(logid, "Could not remove symlinked directory \"" + link_items[i].target_dir + "\" after symlinking the other directory failed.", LL_ERROR);
+										remove_err = true;
 									}
 								}
+
+								if (remove_err)
+								{
+									c_has_error = true;
+									break;
+								}
 							}
 						}
 						if(!dir_linked && (!use_snapshots || indirchange || dir_diff) )
@@ -1352,7 +1371,8 @@ bool IncrFileBackup::doFileBackup()
 		else
 		{
 			int64 done_bytes = fc.getReceivedDataBytes(true)
-				+ (fc_chunked.get() ? fc_chunked->getReceivedDataBytes(true) : 0) + linked_bytes;
+				+ (fc_chunked.get() ? fc_chunked->getReceivedDataBytes(true) : 0) + linked_bytes
+				+ server_download->getSecondaryReceivedDataBytes(true);
 			ServerStatus::setProcessDoneBytes(clientname, status_id, done_bytes);
 			ServerStatus::setProcessPcDone(clientname, status_id,
 				(std::min)(100,(int)(((float)done_bytes)/((float)files_size/100.f)+0.5f)) );
@@ -1364,10 +1384,10 @@ bool IncrFileBackup::doFileBackup()
 		int64 ctime = Server->getTimeMS();
 		if(ctime-last_eta_update>eta_update_intervall)
 		{
-			calculateEtaFileBackup(last_eta_update, eta_set_time, ctime, fc, fc_chunked.get(), linked_bytes, last_eta_received_bytes, eta_estimated_speed, files_size);
+			calculateEtaFileBackup(last_eta_update, eta_set_time, ctime, fc, fc_chunked.get(), linked_bytes, last_eta_received_bytes, eta_estimated_speed, files_size, server_download.get());
 		}
 
-		calculateDownloadSpeed(ctime, fc, fc_chunked.get());
+		calculateDownloadSpeed(ctime, fc, fc_chunked.get(), server_download.get());
 	}
 
 	ServerStatus::setProcessSpeed(clientname, status_id, 0);
@@ -1754,8 +1774,10 @@ bool IncrFileBackup::doFileBackup()
 	running_updater->stop();
 	backup_dao->updateFileBackupRunning(backupid);
 
-	_i64 transferred_bytes=fc.getTransferredBytes()+(fc_chunked.get()?fc_chunked->getTransferredBytes():0);
-	_i64 transferred_compressed=fc.getRealTransferredBytes()+(fc_chunked.get()?fc_chunked->getRealTransferredBytes():0);
+	_i64 transferred_bytes=fc.getTransferredBytes()+(fc_chunked.get()?fc_chunked->getTransferredBytes():0)
+		+server_download->getSecondaryTransferredBytes();
+	_i64 transferred_compressed=fc.getRealTransferredBytes()+(fc_chunked.get()?fc_chunked->getRealTransferredBytes():0)
+		+server_download->getSecondaryRealTransferredBytes();
 	int64 passed_time=incr_backup_stoptime-incr_backup_starttime;
 	ServerLogger::Log(logid, "Transferred "+PrettyPrintBytes(transferred_bytes)+" - Average speed: "+PrettyPrintSpeed((size_t)((transferred_bytes*1000)/(passed_time)) ), LL_INFO );
 	if(transferred_compressed>0)
@@ -2041,7 +2063,7 @@ void IncrFileBackup::addSparseFileEntry( std::string curr_path, SFile &cf, int c
 	if( (*md5ptr>=0 ? *md5ptr : -1* *md5ptr ) % copy_file_entries_sparse_modulo == incremental_num % copy_file_entries_sparse_modulo )
 	{
 		FileMetadata metadata;
-		std::auto_ptr<IFile> last_file(Server->openFile(os_file_prefix(backuppath+local_curr_os_path), MODE_READ));
+		std::auto_ptr<IFile> last_file(ChunkStore::openFile(os_file_prefix(backuppath+local_curr_os_path), MODE_READ));
 		if(!read_metadata(backuppath_hashes+local_curr_os_path, metadata) || last_file.get()==NULL)
 		{
 			ServerLogger::Log(logid, "Error adding sparse file entry. Could not read metadata from "+backuppath_hashes+local_curr_os_path, LL_WARNING);
@@ -26,6 +26,7 @@
 #include "../urbackupcommon/InternetServicePipe.h"
 #include "../urbackupcommon/CompressedPipe2.h"
 #include "../urbackupcommon/CompressedPipe.h"
+#include "../urbackupcommon/MultiplexPipe.h"
 #include "server_settings.h"
 #include "database.h"
 #include "../stringtools.h"
@@ -40,6 +41,8 @@ const unsigned int ping_interval=5*60*1000;
 const unsigned int ping_timeout=30000;
 const unsigned int offline_timeout=ping_interval+10000;
 const unsigned int establish_timeout=60000;
+const int64 mux_ping_interval=60000;
+const int64 mux_dead_timeout=3*mux_ping_interval;
 const int64 max_ecdh_key_age = 6 * 60 * 60 * 1000; //6h
 const std::string restore_prefix = "##restore##";
 
@@ -123,6 +126,7 @@ void InternetServiceConnector::Init(THREAD_ID pTID, IPipe *pPipe, const std::str
 		SSettings *settings=server_settings.getSettings();
 		capa|=IPC_ENCRYPTED;
 		capa|=IPC_COMPRESSED;
+		capa|=IPC_MULTIPLEX;
 
 		compression_level=settings->internet_compression_level;
 		data.addUInt(capa);
@@ -477,6 +481,52 @@ void InternetServiceConnector::ReceivePackets(IRunOtherCallback* run_other)
 								capa_debug_str += std::string("compressed-") + (conn_version == 2 ? "v2" : "v1");
 							}
 
+							if (token_auth)
+							{
+								if (!capa_debug_str.empty()) capa_debug_str += ", ";
+								capa_debug_str += "token auth";
+							}
+
+							if( (capa & IPC_MULTIPLEX) && conn_version==2 )
+							{
+								//All services of this client are opened as streams on this connection from now on
+								if(comp_pipe!=NULL)
+								{
+									comp_pipe->destroyBackendPipeOnDelete(true);
+									comp_pipe=NULL;
+								}
+								if(capa & IPC_ENCRYPTED)
+								{
+									is_pipe->destroyBackendPipeOnDelete(true);
+									is_pipe=NULL;
+								}
+
+								MultiplexSession* mux=new MultiplexSession(comm_pipe, true, mux_ping_interval, mux_dead_timeout);
+								mux->start();
+
+								MultiplexSession* old_mux;
+								{
+									IScopedLock lock(mutex);
+									SClientData& curr_client_data = client_data[clientname];
+									old_mux=curr_client_data.mux;
+									curr_client_data.mux=mux;
+									curr_client_data.last_seen=Server->getTimeMS();
+									curr_client_data.endpoint_name = endpoint_name;
+								}
+
+								if(old_mux!=NULL)
+								{
+									old_mux->shutdown();
+									old_mux->release();
+								}
+
+								Server->Log("Authed+capa for client '"+clientname+"' "
+									+"("+ capa_debug_str+") - multiplexed", LL_DEBUG);
+
+								state=ISS_USED;
+								free_connection=true;
+								break;
+							}
 
 							size_t spare_connections_num;
 
@@ -490,12 +540,6 @@ void InternetServiceConnector::ReceivePackets(IRunOtherCallback* run_other)
 								spare_connections_num = curr_client_data.spare_connections.size();
 							}
 
-							if (token_auth)
-							{
-								if (!capa_debug_str.empty()) capa_debug_str += ", ";
-								capa_debug_str += "token auth";
-							}
-
 							Server->Log("Authed+capa for client '"+clientname+"' "
 								+"("+ capa_debug_str+")"
 								+" - "+convert(spare_connections_num)+" spare connections", LL_DEBUG);
@@ -562,6 +606,40 @@ IPipe *InternetServiceConnector::getConnection(const std::string &clientname, ch
 		if(iter==client_data.end())
 			return NULL;
 
+		if(iter->second.mux!=NULL)
+		{
+			MultiplexSession* mux=iter->second.mux;
+			if(mux->hasError())
+			{
+				iter->second.mux=NULL;
+				lock.relock(NULL);
+				mux->shutdown();
+				mux->release();
+				continue;
+			}
+
+			mux->addRef();
+			lock.relock(NULL);
+
+			int rtime=static_cast<int>(ping_timeout);
+			if(timeoutms!=-1)
+			{
+				rtime=(std::max)(timeoutms-static_cast<int>(Server->getTimeMS()-starttime), 100);
+			}
+
+			IPipe *ret=connectStream(mux, service, rtime);
+			mux->release();
+
+			if(ret!=NULL)
+			{
+				Server->Log("Established multiplexed internet connection. Service="+convert((int)service), LL_DEBUG);
+				return ret;
+			}
+
+			Server->Log("Connecting on multiplexed internet connection failed. Service="+convert((int)service), LL_DEBUG);
+			continue;
+		}
+
 		if(iter->second.spare_connections.empty())
 		{
 			lock.relock(NULL);
@@ -643,6 +721,50 @@ IPipe *InternetServiceConnector::getConnection(const std::string &clientname, ch
 	return NULL;
 }
 
+IPipe *InternetServiceConnector::connectStream(MultiplexSession* mux, char service, int timeoutms)
+{
+	IPipe *stream=mux->openStream(service==SERVICE_COMMANDS ? MUX_PRIO_HIGH : MUX_PRIO_BULK);
+	if(stream==NULL)
+	{
+		return NULL;
+	}
+
+	CTCPStack stream_tcpstack(true);
+	CWData data;
+	data.addChar(ID_ISC_CONNECT);
+	data.addChar(service);
+	stream_tcpstack.Send(stream, data);
+
+	int64 starttime=Server->getTimeMS();
+	int64 passed;
+	while((passed=Server->getTimeMS()-starttime)<timeoutms)
+	{
+		std::string ret;
+		if(stream->Read(&ret, static_cast<int>(timeoutms-passed))==0)
+		{
+			break;
+		}
+
+		stream_tcpstack.AddData((char*)ret.c_str(), ret.size());
+
+		size_t packetsize;
+		char *buf=stream_tcpstack.getPacket(&packetsize);
+		if(buf!=NULL)
+		{
+			bool ok = packetsize>0 && buf[0]==ID_ISC_CONNECT_OK;
+			delete []buf;
+			if(ok)
+			{
+				return stream;
+			}
+			break;
+		}
+	}
+
+	Server->destroy(stream);
+	return NULL;
+}
+
 bool InternetServiceConnector::wantReceive(void)
 {
 	if(has_timeout)
@@ -729,7 +851,23 @@ std::vector<std::pair<std::string, std::string> > InternetServiceConnector::getO
 	std::vector<std::string> todel;
 	for(std::map<std::string, SClientData>::iterator it=client_data.begin();it!=client_data.end();++it)
 	{
-		if(!it->second.spare_connections.empty())
+		if(it->second.mux!=NULL
+			&& it->second.mux->hasError())
+		{
+			it->second.mux->shutdown();
+			it->second.mux->release();
+			it->second.mux=NULL;
+		}
+
+		if(it->second.mux!=NULL)
+		{
+			it->second.last_seen=(std::max)(it->second.last_seen, it->second.mux->getLastReceiveTime());
+			if(ct-it->second.last_seen<offline_timeout)
+			{
+				ret.push_back(std::make_pair(it->first, it->second.endpoint_name));
+			}
+		}
+		else if(!it->second.spare_connections.empty())
 		{
 			if(ct-it->second.last_seen<offline_timeout)
 			{
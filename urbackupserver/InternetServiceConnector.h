@@ -11,6 +11,7 @@ class ICondition;
 class IInternetServicePipe;
 class ICompressedPipe;
 class IECDHKeyExchange;
+class MultiplexSession;
 
 class InternetService : public IService
 {
@@ -32,9 +33,14 @@ class InternetServiceConnector;
 
 struct SClientData
 {
+	SClientData()
+		: last_seen(0), mux(NULL)
+	{}
+
 	std::vector<InternetServiceConnector*> spare_connections;
 	int64 last_seen;
 	std::string endpoint_name;
+	MultiplexSession* mux;
 };
 
 struct SOnetimeToken
@@ -87,6 +93,8 @@ private:
 
 	void cleanup_pipes(bool remove_connection);
 
+	static IPipe *connectStream(MultiplexSession* mux, char service, int timeoutms);
+
 	std::string  generateOnetimeToken(const std::string &clientname);
 	std::string getOnetimeToken(unsigned int id, std::string *cname);
 	static void removeOldTokens(void);
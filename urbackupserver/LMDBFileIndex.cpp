@@ -30,10 +30,14 @@
 #include <memory>
 #include "../Interface/Server.h"
 #include "create_files_index.h"
+#include <algorithm>
 
 MDB_env *LMDBFileIndex::env=NULL;
 MDB_dbi LMDBFileIndex::dbi;
 ISharedMutex* LMDBFileIndex::mutex=NULL;
+IMutex* LMDBFileIndex::readers_mutex=NULL;
+std::vector<LMDBFileIndex*> LMDBFileIndex::readers;
+size_t LMDBFileIndex::env_epoch=0;
 LMDBFileIndex* LMDBFileIndex::fileindex=NULL;
 THREADPOOL_TICKET LMDBFileIndex::fileindex_ticket = ILLEGAL_THREADPOOL_TICKET;
 
@@ -45,6 +49,7 @@ const size_t c_create_commit_n = 10000;
 bool LMDBFileIndex::initFileIndex()
 {
 	mutex = Server->createSharedMutex();
+	readers_mutex = Server->createMutex();
 
 	fileindex=new LMDBFileIndex;
 	fileindex_ticket = Server->getThreadPool()->execute(fileindex, "fileindex writer");
@@ -61,7 +66,8 @@ void LMDBFileIndex::shutdownFileIndex()
 
 
 LMDBFileIndex::LMDBFileIndex(bool no_sync)
-	: _has_error(false), txn(NULL), map_size(c_initial_map_size), it_cursor(NULL), no_sync(no_sync)
+	: _has_error(false), txn(NULL), txn_epoch(0), read_txn(NULL), read_mutex(Server->createMutex()),
+	map_size(c_initial_map_size), it_cursor(NULL), no_sync(no_sync)
 {
 	IScopedWriteLock lock(mutex);
 
@@ -70,10 +76,24 @@ LMDBFileIndex::LMDBFileIndex(bool no_sync)
 		Server->Log("LMDB error creating env", LL_ERROR);
 		_has_error=true;
 	}
+
+	IScopedLock readers_lock(readers_mutex);
+	readers.push_back(this);
 }
 
 LMDBFileIndex::~LMDBFileIndex(void)
 {
+	{
+		IScopedLock readers_lock(readers_mutex);
+		readers.erase(std::find(readers.begin(), readers.end(), this));
+	}
+
+	if(read_txn!=NULL)
+	{
+		mdb_txn_abort(read_txn);
+	}
+
+	Server->destroy(read_mutex);
 }
 
 
@@ -92,6 +112,8 @@ void LMDBFileIndex::begin_txn(unsigned int flags)
 {
 	read_transaction_lock.reset(new IScopedReadLock(mutex));
 
+	txn_epoch = env_epoch;
+
 	int rc = mdb_txn_begin(env, NULL, flags, &txn);
 
 	if(rc)
@@ -102,6 +124,91 @@ void LMDBFileIndex::begin_txn(unsigned int flags)
 	}
 }
 
+//Lookups reuse one read-only transaction per index instance and only lock
+//the per-instance read_mutex, which is only contended by increase_map_size()
+bool LMDBFileIndex::begin_read_txn()
+{
+	read_mutex->Lock();
+
+	int rc;
+	if(read_txn!=NULL)
+	{
+		rc = mdb_txn_renew(read_txn);
+	}
+	else
+	{
+		rc = mdb_txn_begin(env, NULL, MDB_RDONLY, &read_txn);
+	}
+
+	if(rc)
+	{
+		if(read_txn!=NULL)
+		{
+			mdb_txn_abort(read_txn);
+			read_txn=NULL;
+		}
+
+		read_mutex->Unlock();
+
+		Server->Log("LMDB: Failed to open read transaction handle ("+(std::string)mdb_strerror(rc)+")", LL_ERROR);
+		_has_error=true;
+		return false;
+	}
+
+	return true;
+}
+
+void LMDBFileIndex::end_read_txn()
+{
+	mdb_txn_reset(read_txn);
+
+	read_mutex->Unlock();
+}
+
+bool LMDBFileIndex::increase_map_size(const std::string& op)
+{
+	read_transaction_lock.reset();
+
+	IScopedWriteLock lock(mutex);
+
+	if(txn_epoch!=env_epoch)
+	{
+		//Map was already increased by another instance after our transaction started
+		return true;
+	}
+
+	IScopedLock readers_lock(readers_mutex);
+
+	for(size_t i=0;i<readers.size();++i)
+	{
+		readers[i]->read_mutex->Lock();
+	}
+
+	MDB_envinfo env_info;
+	mdb_env_info(env, &env_info);
+
+	map_size = (std::max)(map_size, env_info.me_mapsize)*2;
+
+	int rc = mdb_env_set_mapsize(env, map_size);
+
+	++env_epoch;
+
+	for(size_t i=0;i<readers.size();++i)
+	{
+		readers[i]->read_mutex->Unlock();
+	}
+
+	if(rc)
+	{
+		Server->Log("LMDB: Failed to increase map size ("+(std::string)mdb_strerror(rc)+")", LL_ERROR);
+		return false;
+	}
+
+	Server->Log("Increased LMDB database size to "+PrettyPrintBytes(map_size)+" (on "+op+")", LL_DEBUG);
+
+	return true;
+}
+
 void LMDBFileIndex::create(get_data_callback_t get_data_callback, void *userdata)
 {
 	begin_txn(0);
@@ -207,7 +314,10 @@ void LMDBFileIndex::create(get_data_callback_t get_data_callback, void *userdata
 
 int64 LMDBFileIndex::get(const LMDBFileIndex::SIndexKey& key)
 {
-	begin_txn(MDB_RDONLY);
+	if(!begin_read_txn())
+	{
+		return 0;
+	}
 
 	MDB_val mdb_tkey;
 	mdb_tkey.mv_data=const_cast<void*>(static_cast<const void*>(&key));
@@ -215,7 +325,7 @@ int64 LMDBFileIndex::get(const LMDBFileIndex::SIndexKey& key)
 
 	MDB_val mdb_tvalue;
 
-	int rc=mdb_get(txn, dbi, &mdb_tkey, &mdb_tvalue);
+	int rc=mdb_get(read_txn, dbi, &mdb_tkey, &mdb_tvalue);
 
 	int64 ret = 0;
 	if(rc==MDB_NOTFOUND)
@@ -234,7 +344,7 @@ int64 LMDBFileIndex::get(const LMDBFileIndex::SIndexKey& key)
 		data.getVarInt(&ret);
 	}
 
-	abort_transaction();
+	end_read_txn();
 
 	return ret;
 }
@@ -270,25 +380,11 @@ void LMDBFileIndex::put_internal(const SIndexKey& key, int64 value, int flags, b
 			return;
 		}
 
+		if(!increase_map_size("put"))
 		{
-			read_transaction_lock.reset();
-
-			IScopedWriteLock lock(mutex);
-
-			destroy_env();
-
-			map_size*=2;
-
-			Server->Log("Increased LMDB database size to "+PrettyPrintBytes(map_size)+" (on put)", LL_DEBUG);
-
-			if(!create_env())
-			{
-				Server->Log("Error creating env after database file size increase", LL_ERROR);
-				_has_error=true;
-				start_transaction();
-				return;
-			}
-			
+			_has_error=true;
+			start_transaction();
+			return;
 		}
 
 		start_transaction();
@@ -356,25 +452,11 @@ void LMDBFileIndex::del_internal(const SIndexKey& key, bool log, bool handle_eno
 			return;
 		}
 
+		if(!increase_map_size("delete"))
 		{
-			read_transaction_lock.reset();
-
-			IScopedWriteLock lock(mutex);
-
-			destroy_env();
-
-			map_size*=2;
-
-			Server->Log("Increased LMDB database size to "+PrettyPrintBytes(map_size)+" (on delete)", LL_DEBUG);
-
-			if(!create_env())
-			{
-				Server->Log("Error creating env after database file size increase", LL_ERROR);
-				_has_error=true;
-				start_transaction();
-				return;
-			}
-			
+			_has_error=true;
+			start_transaction();
+			return;
 		}
 
 		start_transaction();
@@ -436,25 +518,11 @@ void LMDBFileIndex::commit_transaction_internal(bool handle_enosp)
 			return;
 		}
 
+		if(!increase_map_size("commit"))
 		{
-			read_transaction_lock.reset();
-
-			IScopedWriteLock lock(mutex);
-
-			destroy_env();
-
-			map_size*=2;
-
-			Server->Log("Increased LMDB database size to "+PrettyPrintBytes(map_size)+" (on commit)", LL_DEBUG);
-
-			if(!create_env())
-			{
-				Server->Log("Error creating env after database file size increase", LL_ERROR);
-				_has_error=true;
-				start_transaction();
-				return;
-			}
-			
+			_has_error=true;
+			start_transaction();
+			return;
 		}
 
 		start_transaction();
@@ -529,7 +597,7 @@ bool LMDBFileIndex::create_env()
 
 		os_create_dir("urbackup/fileindex");
 
-		unsigned int flags = MDB_NOSUBDIR|MDB_NOMETASYNC;
+		unsigned int flags = MDB_NOSUBDIR|MDB_NOMETASYNC|MDB_NOTLS;
 		if(no_sync)
 		{
 			flags|=MDB_NOSYNC;
@@ -588,11 +656,14 @@ size_t LMDBFileIndex::get_map_size()
 
 int64 LMDBFileIndex::get_any_client( const SIndexKey& key )
 {
-	begin_txn(MDB_RDONLY);
+	if(!begin_read_txn())
+	{
+		return 0;
+	}
 
 	MDB_cursor* cursor;
 
-	mdb_cursor_open(txn, dbi, &cursor);
+	mdb_cursor_open(read_txn, dbi, &cursor);
 
 	SIndexKey orig_key = key;
 
@@ -626,7 +697,7 @@ int64 LMDBFileIndex::get_any_client( const SIndexKey& key )
 
 	mdb_cursor_close(cursor);
 
-	abort_transaction();
+	end_read_txn();
 
 	return ret;
 }
@@ -641,11 +712,14 @@ void LMDBFileIndex::abort_transaction()
 
 std::map<int, int64> LMDBFileIndex::get_all_clients( const SIndexKey& key )
 {
-	begin_txn(MDB_RDONLY);
+	if(!begin_read_txn())
+	{
+		return std::map<int, int64>();
+	}
 
 	MDB_cursor* cursor;
 
-	mdb_cursor_open(txn, dbi, &cursor);
+	mdb_cursor_open(read_txn, dbi, &cursor);
 
 	SIndexKey orig_key = key;
 
@@ -683,18 +757,21 @@ std::map<int, int64> LMDBFileIndex::get_all_clients( const SIndexKey& key )
 
 	mdb_cursor_close(cursor);
 
-	abort_transaction();
+	end_read_txn();
 
 	return ret;
 }
 
 int64 LMDBFileIndex::get_prefer_client( const SIndexKey& key )
 {
-	begin_txn(MDB_RDONLY);
+	if(!begin_read_txn())
+	{
+		return 0;
+	}
 
 	MDB_cursor* cursor;
 
-	mdb_cursor_open(txn, dbi, &cursor);
+	mdb_cursor_open(read_txn, dbi, &cursor);
 
 	SIndexKey orig_key = key;
 
@@ -736,7 +813,7 @@ int64 LMDBFileIndex::get_prefer_client( const SIndexKey& key )
 
 	mdb_cursor_close(cursor);
 
-	abort_transaction();
+	end_read_txn();
 
 	return ret;
 }
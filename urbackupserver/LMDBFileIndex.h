@@ -3,7 +3,9 @@
 #include "lmdb/lmdb.h"
 #include "FileIndex.h"
 #include "../Interface/SharedMutex.h"
+#include "../Interface/Mutex.h"
 #include <memory>
+#include <vector>
 
 class LMDBFileIndex : public FileIndex
 {
@@ -54,6 +56,12 @@ private:
 
 	void begin_txn(unsigned int flags);
 
+	bool begin_read_txn();
+
+	void end_read_txn();
+
+	bool increase_map_size(const std::string& op);
+
 	static MDB_env *env;
 	static MDB_dbi dbi;
 	size_t map_size;
@@ -70,6 +78,9 @@ private:
 
 
 	MDB_txn *txn;
+	size_t txn_epoch;
+	MDB_txn *read_txn;
+	IMutex* read_mutex;
 	bool _has_error;
 	MDB_cursor* it_cursor;
 
@@ -83,6 +94,9 @@ private:
 	std::vector<STransactionLogItem> transaction_log;
 
 	static ISharedMutex* mutex;
+	static IMutex* readers_mutex;
+	static std::vector<LMDBFileIndex*> readers;
+	static size_t env_epoch;
 	static LMDBFileIndex* fileindex;
 	static THREADPOOL_TICKET fileindex_ticket;
 
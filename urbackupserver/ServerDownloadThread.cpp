@@ -32,6 +32,7 @@
 #include "../urbackupcommon/os_functions.h"
 #include "server.h"
 #include "FileMetadataDownloadThread.h"
+#include "ChunkStore.h"
 
 namespace
 {
@@ -53,10 +54,13 @@ ServerDownloadThread::ServerDownloadThread( FileClient& fc, FileClientChunked* f
 	is_offline(false), client_main(client_main), filesrv_protocol_version(filesrv_protocol_version), skipping(false), queue_size(0),
 	all_downloads_ok(true), incremental_num(incremental_num), logid(logid), has_timeout(false), with_hashes(with_hashes), with_metadata(client_main->getProtocolVersions().file_meta>0), shares_without_snapshot(shares_without_snapshot),
 	with_sparse_hashing(with_sparse_hashing), exp_backoff(false), num_embedded_metadata_files(0), file_metadata_download(file_metadata_download), num_issues(0), last_snap_num_issues(0), has_disk_error(false), sc_failure_fatal(sc_failure_fatal),
-	tmpfile_num(0), filepath_corrections(filepath_corrections), max_file_id(max_file_id)
+	tmpfile_num(0), filepath_corrections(filepath_corrections), max_file_id(max_file_id), stream_idx(0), primary_stream(NULL),
+	barrier_arrived(0), barrier_generation(0)
 {
 	mutex = Server->createMutex();
 	cond = Server->createCondition();
+	barrier_mutex = Server->createMutex();
+	barrier_cond = Server->createCondition();
 
 	if (BackupServer::useTreeHashing())
 	{
@@ -70,8 +74,79 @@ ServerDownloadThread::ServerDownloadThread( FileClient& fc, FileClientChunked* f
 
 ServerDownloadThread::~ServerDownloadThread()
 {
+	for (size_t i = 0; i < secondary_streams.size(); ++i)
+	{
+		delete secondary_streams[i];
+		delete secondary_fcs[i];
+		delete secondary_fcs_chunked[i];
+	}
+
 	Server->destroy(mutex);
 	Server->destroy(cond);
+	Server->destroy(barrier_mutex);
+	Server->destroy(barrier_cond);
+}
+
+void ServerDownloadThread::addSecondaryStream(FileClient* sfc, FileClientChunked* sfc_chunked)
+{
+	ServerDownloadThread* stream = new ServerDownloadThread(*sfc, sfc_chunked, backuppath, backuppath_hashes, last_backuppath, last_backuppath_complete,
+		hashed_transfer, save_incomplete_file, clientid, clientname, clientsubname, use_tmpfiles, tmpfile_path, server_token, use_reflink, backupid,
+		r_incremental, hashpipe_prepare, client_main, filesrv_protocol_version, incremental_num, logid, with_hashes, shares_without_snapshot,
+		with_sparse_hashing, file_metadata_download, sc_failure_fatal, filepath_corrections, max_file_id);
+
+	stream->primary_stream = this;
+	stream->stream_idx = secondary_streams.size() + 1;
+
+	secondary_streams.push_back(stream);
+	secondary_fcs.push_back(sfc);
+	secondary_fcs_chunked.push_back(sfc_chunked);
+}
+
+size_t ServerDownloadThread::getNumStreams()
+{
+	return secondary_streams.size() + 1;
+}
+
+_i64 ServerDownloadThread::getSecondaryReceivedDataBytes(bool with_sparse)
+{
+	_i64 ret = 0;
+	for (size_t i = 0; i < secondary_streams.size(); ++i)
+	{
+		ret += secondary_fcs[i]->getReceivedDataBytes(with_sparse);
+		if (secondary_fcs_chunked[i] != NULL)
+		{
+			ret += secondary_fcs_chunked[i]->getReceivedDataBytes(with_sparse);
+		}
+	}
+	return ret;
+}
+
+_i64 ServerDownloadThread::getSecondaryTransferredBytes()
+{
+	_i64 ret = 0;
+	for (size_t i = 0; i < secondary_streams.size(); ++i)
+	{
+		ret += secondary_fcs[i]->getTransferredBytes();
+		if (secondary_fcs_chunked[i] != NULL)
+		{
+			ret += secondary_fcs_chunked[i]->getTransferredBytes();
+		}
+	}
+	return ret;
+}
+
+_i64 ServerDownloadThread::getSecondaryRealTransferredBytes()
+{
+	_i64 ret = 0;
+	for (size_t i = 0; i < secondary_streams.size(); ++i)
+	{
+		ret += secondary_fcs[i]->getRealTransferredBytes();
+		if (secondary_fcs_chunked[i] != NULL)
+		{
+			ret += secondary_fcs_chunked[i]->getRealTransferredBytes();
+		}
+	}
+	return ret;
 }
 
 void ServerDownloadThread::operator()( void )
@@ -86,6 +161,11 @@ void ServerDownloadThread::operator()( void )
 		fc.setQueueCallback(this);
 	}
 
+	for (size_t i = 0; i < secondary_streams.size(); ++i)
+	{
+		secondary_tickets.push_back(Server->getThreadPool()->execute(secondary_streams[i], "fbackup load"));
+	}
+
 	while(true)
 	{
 		SQueueItem curr;
@@ -129,6 +209,18 @@ void ServerDownloadThread::operator()( void )
 			skipping = true;
 			continue;
 		}
+		else if(curr.action==EQueueAction_Barrier)
+		{
+			if (primary_stream != NULL)
+			{
+				primary_stream->waitStreamBarrier();
+			}
+			else
+			{
+				waitStreamBarrier();
+			}
+			continue;
+		}
 
 		if(is_offline || skipping)
 		{
@@ -235,7 +327,12 @@ void ServerDownloadThread::operator()( void )
 		}
 	}
 
-	if(!is_offline && !skipping && client_main->getProtocolVersions().file_meta>0)
+	if (!secondary_tickets.empty())
+	{
+		Server->getThreadPool()->waitFor(secondary_tickets);
+	}
+
+	if(primary_stream==NULL && !isOffline() && !skipping && client_main->getProtocolVersions().file_meta>0)
 	{
 		_u32 rc = fc.InformMetadataStreamEnd(server_token, 3);
 
@@ -254,6 +351,19 @@ void ServerDownloadThread::addToQueueFull(size_t id, const std::string &fn, cons
     bool is_script, bool metadata_only, size_t folder_items, const std::string& sha_dig, bool at_front_postpone_quitstop,
 	unsigned int p_script_random, std::string display_fn, bool write_metadata)
 {
+	if (!secondary_streams.empty()
+		&& !is_script && !metadata_only
+		&& !at_front_postpone_quitstop)
+	{
+		ServerDownloadThread* stream = selectStream();
+		if (stream != this)
+		{
+			stream->addToQueueFull(id, fn, short_fn, curr_path, os_path, predicted_filesize, metadata,
+				is_script, metadata_only, folder_items, sha_dig, at_front_postpone_quitstop, p_script_random, display_fn, write_metadata);
+			return;
+		}
+	}
+
 	SQueueItem ni;
 	ni.id = id;
 	ni.fn = fn;
@@ -276,7 +386,7 @@ void ServerDownloadThread::addToQueueFull(size_t id, const std::string &fn, cons
 	if (id != 0
 		&& !at_front_postpone_quitstop)
 	{
-		max_file_id.setMinDownloaded(id);
+		max_file_id.setMinDownloaded(id, stream_idx);
 	}
 
 	if(is_script)
@@ -314,6 +424,18 @@ void ServerDownloadThread::addToQueueChunked(size_t id, const std::string &fn, c
 	const std::string &curr_path, const std::string &os_path, _i64 predicted_filesize, const FileMetadata& metadata,
 	bool is_script, const std::string& sha_dig, unsigned int p_script_random, std::string display_fn)
 {
+	if (!secondary_streams.empty()
+		&& !is_script)
+	{
+		ServerDownloadThread* stream = selectStream();
+		if (stream != this)
+		{
+			stream->addToQueueChunked(id, fn, short_fn, curr_path, os_path, predicted_filesize, metadata,
+				is_script, sha_dig, p_script_random, display_fn);
+			return;
+		}
+	}
+
 	SQueueItem ni;
 	ni.id = id;
 	ni.fn = fn;
@@ -333,7 +455,7 @@ void ServerDownloadThread::addToQueueChunked(size_t id, const std::string &fn, c
 
 	if (id != 0)
 	{
-		max_file_id.setMinDownloaded(id);
+		max_file_id.setMinDownloaded(id, stream_idx);
 	}
 
 	if(is_script)
@@ -364,9 +486,19 @@ void ServerDownloadThread::addToQueueStartShadowcopy(const std::string& fn)
 	ni.patch_dl_files.prepared=false;
 	ni.patch_dl_files.prepare_error=false;
 
-	IScopedLock lock(mutex);
-	dl_queue.push_back(ni);
-	cond->notify_one();
+	{
+		IScopedLock lock(mutex);
+		dl_queue.push_back(ni);
+		cond->notify_one();
+	}
+
+	if (!secondary_streams.empty())
+	{
+		//Other streams may only continue once the shadow copy exists
+		SQueueItem barrier;
+		barrier.action = EQueueAction_Barrier;
+		addToQueueAll(barrier, false);
+	}
 }
 
 void ServerDownloadThread::addToQueueStopShadowcopy(const std::string& fn)
@@ -378,11 +510,78 @@ void ServerDownloadThread::addToQueueStopShadowcopy(const std::string& fn)
 	ni.patch_dl_files.prepared=false;
 	ni.patch_dl_files.prepare_error=false;
 
+	if (!secondary_streams.empty())
+	{
+		//Wait for all streams to finish downloading from the shadow copy
+		SQueueItem barrier;
+		barrier.action = EQueueAction_Barrier;
+		addToQueueAll(barrier, false);
+	}
+
 	IScopedLock lock(mutex);
 	dl_queue.push_back(ni);
 	cond->notify_one();
 }
 
+void ServerDownloadThread::addToQueueAll(const SQueueItem& ni, bool front)
+{
+	for (size_t i = 0; i < secondary_streams.size() + 1; ++i)
+	{
+		ServerDownloadThread* stream = i == 0 ? this : secondary_streams[i - 1];
+		IScopedLock lock(stream->mutex);
+		if (front)
+		{
+			stream->dl_queue.push_front(ni);
+		}
+		else
+		{
+			stream->dl_queue.push_back(ni);
+		}
+		stream->cond->notify_one();
+	}
+}
+
+ServerDownloadThread* ServerDownloadThread::selectStream()
+{
+	ServerDownloadThread* ret = this;
+	size_t min_queue_size;
+	{
+		IScopedLock lock(mutex);
+		min_queue_size = queue_size;
+	}
+
+	for (size_t i = 0; i < secondary_streams.size(); ++i)
+	{
+		IScopedLock lock(secondary_streams[i]->mutex);
+		if (secondary_streams[i]->queue_size < min_queue_size)
+		{
+			min_queue_size = secondary_streams[i]->queue_size;
+			ret = secondary_streams[i];
+		}
+	}
+
+	return ret;
+}
+
+void ServerDownloadThread::waitStreamBarrier()
+{
+	IScopedLock lock(barrier_mutex);
+	size_t generation = barrier_generation;
+	++barrier_arrived;
+	if (barrier_arrived == secondary_streams.size() + 1)
+	{
+		barrier_arrived = 0;
+		++barrier_generation;
+		barrier_cond->notify_all();
+		return;
+	}
+
+	while (generation == barrier_generation)
+	{
+		barrier_cond->wait(&lock);
+	}
+}
+
 void ServerDownloadThread::queueScriptEnd(const SQueueItem &todl)
 {
 	SQueueItem ni;
@@ -618,14 +817,14 @@ bool ServerDownloadThread::load_file(SQueueItem todl)
 
 			filepath_old=last_backuppath+os_file_sep()+FileBackup::convertToOSPathFromFileClient(cfn_short);
 
-			IFile *file_old=Server->openFile(os_file_prefix(filepath_old), MODE_READ);
+			IFile *file_old=ChunkStore::openFile(os_file_prefix(filepath_old), MODE_READ);
 
 			if(file_old==NULL)
 			{
 				if(!last_backuppath_complete.empty())
 				{
 					filepath_old=last_backuppath_complete+os_file_sep()+FileBackup::convertToOSPathFromFileClient(cfn_short);
-					file_old=Server->openFile(os_file_prefix(filepath_old), MODE_READ);
+					file_old=ChunkStore::openFile(os_file_prefix(filepath_old), MODE_READ);
 				}
 				if(file_old==NULL)
 				{
@@ -1020,8 +1219,22 @@ void ServerDownloadThread::hashFile(int64 fileid, std::string dstpath, std::stri
 
 bool ServerDownloadThread::isOffline()
 {
-	IScopedLock lock(mutex);
-	return is_offline;
+	{
+		IScopedLock lock(mutex);
+		if (is_offline)
+		{
+			return true;
+		}
+	}
+
+	for (size_t i = 0; i < secondary_streams.size(); ++i)
+	{
+		if (secondary_streams[i]->isOffline())
+		{
+			return true;
+		}
+	}
+	return false;
 }
 
 void ServerDownloadThread::queueStop()
@@ -1029,26 +1242,53 @@ void ServerDownloadThread::queueStop()
 	SQueueItem ni;
 	ni.action = EQueueAction_Quit;
 
-	IScopedLock lock(mutex);
-	dl_queue.push_back(ni);
-	cond->notify_one();
+	addToQueueAll(ni, false);
 }
 
 bool ServerDownloadThread::isDownloadOk( size_t id )
 {
-	return !download_nok_ids.hasId(id);
+	if (download_nok_ids.hasId(id))
+	{
+		return false;
+	}
+
+	for (size_t i = 0; i < secondary_streams.size(); ++i)
+	{
+		if (!secondary_streams[i]->isDownloadOk(id))
+		{
+			return false;
+		}
+	}
+	return true;
 }
 
 
 bool ServerDownloadThread::isDownloadPartial( size_t id )
 {
-	return download_partial_ids.hasId(id);
+	if (download_partial_ids.hasId(id))
+	{
+		return true;
+	}
+
+	for (size_t i = 0; i < secondary_streams.size(); ++i)
+	{
+		if (secondary_streams[i]->isDownloadPartial(id))
+		{
+			return true;
+		}
+	}
+	return false;
 }
 
 
 size_t ServerDownloadThread::getMaxOkId()
 {
-	return max_ok_id;
+	size_t ret = max_ok_id;
+	for (size_t i = 0; i < secondary_streams.size(); ++i)
+	{
+		ret = (std::max)(ret, secondary_streams[i]->getMaxOkId());
+	}
+	return ret;
 }
 
 std::string ServerDownloadThread::getQueuedFileFull(FileClient::MetadataQueue& metadata, size_t& folder_items, bool& finish_script, int64& file_id)
@@ -1062,6 +1302,11 @@ std::string ServerDownloadThread::getQueuedFileFull(FileClient::MetadataQueue& m
 		for (std::deque<SQueueItem>::iterator it = dl_queue.begin();
 				it != dl_queue.end(); ++it)
 		{
+			if (it->action == EQueueAction_Barrier)
+			{
+				break;
+			}
+
 			if (it->action == EQueueAction_Fileclient &&
 				!it->queued && it->fileclient == EFileClient_Chunked
 				&& max_prepare > 0)
@@ -1132,7 +1377,8 @@ IFsFile * ServerDownloadThread::getTempFile()
 	{
 		size_t num = tmpfile_num++;
 			
-		std::string fn = backuppath + os_file_sep() + tmpfile_dirname + os_file_sep() + convert(num);
+		std::string fn = backuppath + os_file_sep() + tmpfile_dirname + os_file_sep()
+			+ (stream_idx > 0 ? convert(stream_idx) + "_" : "") + convert(num);
 		pfd = Server->openFile(os_file_prefix(fn), MODE_RW_CREATE);
 
 		if (pfd == NULL)
@@ -1208,6 +1454,11 @@ bool ServerDownloadThread::getQueuedFileChunked( std::string& remotefn, IFile*&
 		for(std::deque<SQueueItem>::iterator it=dl_queue.begin();
 			it!=dl_queue.end();++it)
 		{
+			if(it->action==EQueueAction_Barrier)
+			{
+				break;
+			}
+
 			if(it->action==EQueueAction_Fileclient && 
 				!it->queued && it->fileclient==EFileClient_Chunked)
 			{
@@ -1298,7 +1549,7 @@ SPatchDownloadFiles ServerDownloadThread::preparePatchDownloadFiles( const SQueu
 	std::string hashpath_old=last_backuppath+os_file_sep()+".hashes"+os_file_sep()+FileBackup::convertToOSPathFromFileClient(cfn_short);
 	std::string filepath_old=last_backuppath+os_file_sep()+FileBackup::convertToOSPathFromFileClient(cfn_short);
 
-	std::auto_ptr<IFsFile> file_old(Server->openFile(os_file_prefix(filepath_old), MODE_READ));
+	std::auto_ptr<IFsFile> file_old(ChunkStore::openFile(os_file_prefix(filepath_old), MODE_READ));
 
 	if(file_old.get()==NULL)
 	{
@@ -1306,7 +1557,7 @@ SPatchDownloadFiles ServerDownloadThread::preparePatchDownloadFiles( const SQueu
 		if(!last_backuppath_complete.empty())
 		{
 			filepath_old=last_backuppath_complete+os_file_sep()+FileBackup::convertToOSPathFromFileClient(cfn_short);
-			file_old.reset(Server->openFile(os_file_prefix(filepath_old), MODE_READ));
+			file_old.reset(ChunkStore::openFile(os_file_prefix(filepath_old), MODE_READ));
 		}
 		if(file_old.get()==NULL)
 		{
@@ -1487,10 +1738,20 @@ bool ServerDownloadThread::stop_shadowcopy(std::string path)
 
 bool ServerDownloadThread::sleepQueue()
 {
-	IScopedLock lock(mutex);
-	if(queue_size>max_queue_size)
+	size_t total_queue_size;
+	{
+		IScopedLock lock(mutex);
+		total_queue_size = queue_size;
+	}
+
+	for (size_t i = 0; i < secondary_streams.size(); ++i)
+	{
+		IScopedLock lock(secondary_streams[i]->mutex);
+		total_queue_size += secondary_streams[i]->queue_size;
+	}
+
+	if(total_queue_size>max_queue_size*getNumStreams())
 	{
-		lock.relock(NULL);
 		Server->wait(1000);
 		return true;
 	}
@@ -1499,17 +1760,39 @@ bool ServerDownloadThread::sleepQueue()
 
 size_t ServerDownloadThread::getNumEmbeddedMetadataFiles()
 {
-	return num_embedded_metadata_files;
+	size_t ret = num_embedded_metadata_files;
+	for (size_t i = 0; i < secondary_streams.size(); ++i)
+	{
+		ret += secondary_streams[i]->getNumEmbeddedMetadataFiles();
+	}
+	return ret;
 }
 
 size_t ServerDownloadThread::getNumIssues()
 {
-	return num_issues;
+	size_t ret = num_issues;
+	for (size_t i = 0; i < secondary_streams.size(); ++i)
+	{
+		ret += secondary_streams[i]->getNumIssues();
+	}
+	return ret;
 }
 
 bool ServerDownloadThread::getHasDiskError()
 {
-	return has_disk_error;
+	if (has_disk_error)
+	{
+		return true;
+	}
+
+	for (size_t i = 0; i < secondary_streams.size(); ++i)
+	{
+		if (secondary_streams[i]->getHasDiskError())
+		{
+			return true;
+		}
+	}
+	return false;
 }
 
 bool ServerDownloadThread::deleteTempFolder()
@@ -1531,9 +1814,7 @@ void ServerDownloadThread::queueSkip()
 	SQueueItem ni;
 	ni.action = EQueueAction_Skip;
 
-	IScopedLock lock(mutex);
-	dl_queue.push_front(ni);
-	cond->notify_one();
+	addToQueueAll(ni, true);
 }
 
 void ServerDownloadThread::unqueueFileFull( const std::string& fn, bool finish_script)
@@ -1571,8 +1852,22 @@ void ServerDownloadThread::unqueueFileChunked( const std::string& remotefn )
 
 bool ServerDownloadThread::isAllDownloadsOk()
 {
-	IScopedLock lock(mutex);
-	return all_downloads_ok;
+	{
+		IScopedLock lock(mutex);
+		if (!all_downloads_ok)
+		{
+			return false;
+		}
+	}
+
+	for (size_t i = 0; i < secondary_streams.size(); ++i)
+	{
+		if (!secondary_streams[i]->isAllDownloadsOk())
+		{
+			return false;
+		}
+	}
+	return true;
 }
 
 bool ServerDownloadThread::logScriptOutput(std::string cfn, const SQueueItem &todl, std::string& sha_dig, int64 script_start_times, bool& hash_file)
@@ -1867,12 +2162,36 @@ bool ServerDownloadThread::logScriptOutput(std::string cfn, const SQueueItem &to
 
 bool ServerDownloadThread::hasTimeout()
 {
-	return has_timeout;
+	if (has_timeout)
+	{
+		return true;
+	}
+
+	for (size_t i = 0; i < secondary_streams.size(); ++i)
+	{
+		if (secondary_streams[i]->hasTimeout())
+		{
+			return true;
+		}
+	}
+	return false;
 }
 
 bool ServerDownloadThread::shouldBackoff()
 {
-	return exp_backoff;
+	if (exp_backoff)
+	{
+		return true;
+	}
+
+	for (size_t i = 0; i < secondary_streams.size(); ++i)
+	{
+		if (secondary_streams[i]->shouldBackoff())
+		{
+			return true;
+		}
+	}
+	return false;
 }
 
 void ServerDownloadThread::postponeQuitStop( size_t idx )
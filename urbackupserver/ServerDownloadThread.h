@@ -11,6 +11,7 @@
 #include "../Interface/Pipe.h"
 #include "../Interface/File.h"
 #include "../Interface/Thread.h"
+#include "../Interface/ThreadPool.h"
 #include "../urbackupcommon/fileclient/FileClient.h"
 #include "../urbackupcommon/fileclient/FileClientChunked.h"
 #include "ClientMain.h"
@@ -40,7 +41,8 @@ namespace
 		EQueueAction_Quit,
 		EQueueAction_StopShadowcopy,
 		EQueueAction_StartShadowcopy,
-		EQueueAction_Skip
+		EQueueAction_Skip,
+		EQueueAction_Barrier
 	};
 
 	struct SPatchDownloadFiles
@@ -215,8 +217,27 @@ public:
 
 	bool deleteTempFolder();
 
+	//Adds an additional download connection. Plain file downloads are
+	//distributed over all streams. Takes ownership of fc and fc_chunked.
+	//Has to be called before the thread is started.
+	void addSecondaryStream(FileClient* fc, FileClientChunked* fc_chunked);
+
+	size_t getNumStreams();
+
+	_i64 getSecondaryReceivedDataBytes(bool with_sparse);
+
+	_i64 getSecondaryTransferredBytes();
+
+	_i64 getSecondaryRealTransferredBytes();
+
 private:
 
+	ServerDownloadThread* selectStream();
+
+	void addToQueueAll(const SQueueItem& ni, bool front);
+
+	void waitStreamBarrier();
+
 	IFsFile* getTempFile();
 
 	std::string getDLPath(const SQueueItem& todl);
@@ -306,4 +327,16 @@ private:
 	size_t tmpfile_num;
 
 	MaxFileId& max_file_id;
+
+	size_t stream_idx;
+	ServerDownloadThread* primary_stream;
+	std::vector<ServerDownloadThread*> secondary_streams;
+	std::vector<FileClient*> secondary_fcs;
+	std::vector<FileClientChunked*> secondary_fcs_chunked;
+	std::vector<THREADPOOL_TICKET> secondary_tickets;
+
+	IMutex* barrier_mutex;
+	ICondition* barrier_cond;
+	size_t barrier_arrived;
+	size_t barrier_generation;
 };
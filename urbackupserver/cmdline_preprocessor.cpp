@@ -527,6 +527,13 @@ int action_verify_hashes(std::vector<std::string> args)
 	TCLAP::SwitchArg delete_verify_failed_arg("d", "delete-verify-failed",
 		"Delete file entries of files with failed verification", cmd, false);
 
+	TCLAP::SwitchArg resume_arg("r", "resume",
+		"Resume a previously interrupted verification of the same file backup set", cmd, false);
+
+	TCLAP::ValueArg<int> threads_arg("t", "threads",
+		"Number of files verified in parallel per storage device",
+		false, 2, "number", cmd);
+
 	TCLAP::ValueArg<std::string> verify_arg("v", "verify",
 		"Specify file backup(s) to verify",
 		true, "all", "file backup set", cmd);
@@ -552,6 +559,13 @@ int action_verify_hashes(std::vector<std::string> args)
 		real_args.push_back("--delete_verify_failed");
 		real_args.push_back("true");
 	}
+	if(resume_arg.getValue())
+	{
+		real_args.push_back("--verify_resume");
+		real_args.push_back("true");
+	}
+	real_args.push_back("--verify_threads");
+	real_args.push_back(convert(threads_arg.getValue()));
 
 	if(verify_arg.getValue()=="all")
 	{
@@ -27,6 +27,7 @@
 #include "server_dir_links.h"
 #include "server_log.h"
 #include "server_status.h"
+#include "ChunkStore.h"
 
 #if defined(_WIN32) || defined(__APPLE__) || defined(__FreeBSD__)
 #define stat64 stat
@@ -368,7 +369,7 @@ namespace
 					std::string hl_source = dst_folder + os_file_sep() + files[i].name;
 
 					std::string error_str;
-					if (!copy_file(os_file_prefix(src_folder + os_file_sep() + files[i].name), os_file_prefix(hl_source), false, &error_str))
+					if (!ChunkStore::copyFile(os_file_prefix(src_folder + os_file_sep() + files[i].name), os_file_prefix(hl_source), &error_str))
 					{
 						Server->Log("Error copying file from \"" + src_folder + os_file_sep() + files[i].name + "\" to \"" + dst_folder + os_file_sep() + files[i].name + "\". " + error_str, LL_ERROR);
 						if (!ignore_copy_errors)
@@ -487,6 +488,11 @@ namespace
 			return false;
 		}
 
+		if (!copy_with_ext(src, dst_folder + os_file_sep() + src_name_incomplete, ".blockmap"))
+		{
+			return false;
+		}
+
 		//os_sync(dst_folder);
 
 		std::string src_name = ExtractFileName(src);
@@ -526,6 +532,13 @@ namespace
 			return false;
 		}
 
+		if (FileExists(dst_folder + os_file_sep() + src_name_incomplete + ".blockmap")
+			&& !rename_with_ext(dst_folder + os_file_sep() + src_name_incomplete,
+				dst_folder + os_file_sep() + src_name, ".blockmap"))
+		{
+			return false;
+		}
+
 		if (!rename_with_ext(dst_folder + os_file_sep() + src_name_incomplete,
 			dst_folder + os_file_sep() + src_name, ""))
 		{
@@ -27,15 +27,252 @@
 #include "../urbackupcommon/os_functions.h"
 #include "serverinterface/helper.h"
 #include "dao/ServerBackupDao.h"
+#include "../Interface/ThreadPool.h"
+#include "../Interface/Mutex.h"
+#include <algorithm>
+#include <queue>
+#include <thread>
 
 namespace
 {
 const size_t sqlite_data_allocation_chunk_size = 50 * 1024 * 1024; //50MB
+const size_t sort_memory_limit = 512 * 1024 * 1024; //512MB
+const size_t sort_max_threads = 8;
+const size_t sort_run_read_buffer_entries = 8192;
+const int64 sort_min_range_size = 100000;
+
+#pragma pack(1)
+struct SIndexSortEntry
+{
+	FileIndex::SIndexKey key;
+	int64 created;
+	int64 id;
+	int64 next_entry;
+	int64 prev_entry;
+	char pointed_to;
+};
+#pragma pack()
+
+bool sort_entry_less(const SIndexSortEntry& a, const SIndexSortEntry& b)
+{
+	int mres = memcmp(&a.key, &b.key, sizeof(FileIndex::SIndexKey));
+	if (mres != 0)
+		return mres < 0;
+	if (a.created != b.created)
+		return a.created > b.created;
+	return a.id > b.id;
+}
+
+void set_progress(SStartupStatus& status, double pc_done)
+{
+	int last_pc = static_cast<int>(status.pc_done*1000 + 0.5);
+
+	status.pc_done = pc_done;
+
+	int curr_pc = static_cast<int>(status.pc_done*1000 + 0.5);
+
+	if(curr_pc!=last_pc)
+	{
+		Server->Log("Creating files index: "+convert((double)curr_pc/10)+"% finished", LL_INFO);
+	}
+}
+
+class SortRunThread : public IThread
+{
+public:
+	SortRunThread(int64 id_start, int64 id_end, size_t max_entries, size_t thread_idx)
+		: id_start(id_start), id_end(id_end), max_entries(max_entries), thread_idx(thread_idx),
+		has_error(false), n_scanned(0), mutex(Server->createMutex())
+	{
+	}
+
+	void operator()()
+	{
+		IDatabase* db = Server->getDatabase(Server->getThreadID(), URBACKUPDB_SERVER_FILES);
+		if (db == NULL)
+		{
+			Server->Log("Error opening files database in index sort thread", LL_ERROR);
+			has_error = true;
+			return;
+		}
+
+		IQuery* q_read = db->Prepare("SELECT id, shahash, filesize, clientid, next_entry, prev_entry, pointed_to, created FROM files WHERE id>=? AND id<?", false);
+		q_read->Bind(id_start);
+		q_read->Bind(id_end);
+		IDatabaseCursor* cur = q_read->Cursor();
+
+		std::vector<SIndexSortEntry> entries;
+		entries.reserve(max_entries);
+
+		db_single_result res;
+		while (cur->next(res))
+		{
+			const std::string& shahash = res["shahash"];
+			char hash[bytes_in_index] = {};
+			memcpy(hash, shahash.data(), (std::min)(shahash.size(), bytes_in_index));
+
+			SIndexSortEntry entry;
+			entry.key = FileIndex::SIndexKey(hash, watoi64(res["filesize"]), watoi(res["clientid"]));
+			entry.created = watoi64(res["created"]);
+			entry.id = watoi64(res["id"]);
+			entry.next_entry = watoi64(res["next_entry"]);
+			entry.prev_entry = watoi64(res["prev_entry"]);
+			entry.pointed_to = watoi(res["pointed_to"]) != 0 ? 1 : 0;
+			entries.push_back(entry);
+
+			if (entries.size() % 10000 == 0)
+			{
+				IScopedLock lock(mutex.get());
+				n_scanned += 10000;
+			}
+
+			if (entries.size() >= max_entries)
+			{
+				if (!writeRun(entries))
+				{
+					break;
+				}
+			}
+		}
+
+		if (cur->has_error())
+		{
+			has_error = true;
+		}
+
+		if (!has_error && !entries.empty())
+		{
+			writeRun(entries);
+		}
+
+		db->destroyQuery(q_read);
+		Server->destroyDatabases(Server->getThreadID());
+	}
+
+	const std::vector<std::string>& getRuns()
+	{
+		return runs;
+	}
+
+	bool hasError()
+	{
+		return has_error;
+	}
+
+	int64 getScanned()
+	{
+		IScopedLock lock(mutex.get());
+		return n_scanned;
+	}
+
+private:
+	bool writeRun(std::vector<SIndexSortEntry>& entries)
+	{
+		std::sort(entries.begin(), entries.end(), sort_entry_less);
+
+		std::string fn = "urbackup/files_index_sort_" + convert(thread_idx) + "_" + convert(runs.size()) + ".tmp";
+		std::auto_ptr<IFile> f(Server->openFile(fn, MODE_WRITE));
+		if (f.get() == NULL)
+		{
+			Server->Log("Error opening sort run file \"" + fn + "\". " + os_last_error_str(), LL_ERROR);
+			has_error = true;
+			return false;
+		}
+
+		runs.push_back(fn);
+
+		const char* data = reinterpret_cast<const char*>(entries.data());
+		size_t data_size = entries.size()*sizeof(SIndexSortEntry);
+		for (size_t written = 0; written < data_size;)
+		{
+			_u32 towrite = static_cast<_u32>((std::min)(data_size - written, static_cast<size_t>(32 * 1024 * 1024)));
+			if (f->Write(data + written, towrite) != towrite)
+			{
+				Server->Log("Error writing sort run file \"" + fn + "\". " + os_last_error_str(), LL_ERROR);
+				has_error = true;
+				return false;
+			}
+			written += towrite;
+		}
+
+		IScopedLock lock(mutex.get());
+		n_scanned += entries.size() % 10000;
+		entries.clear();
+		return true;
+	}
+
+	int64 id_start;
+	int64 id_end;
+	size_t max_entries;
+	size_t thread_idx;
+	volatile bool has_error;
+	int64 n_scanned;
+	std::auto_ptr<IMutex> mutex;
+	std::vector<std::string> runs;
+};
+
+class SortRunReader
+{
+public:
+	SortRunReader(const std::string& fn)
+		: pos(0)
+	{
+		f.reset(Server->openFile(fn, MODE_READ));
+	}
+
+	bool next(SIndexSortEntry& entry)
+	{
+		if (pos >= buf.size())
+		{
+			if (f.get() == NULL)
+			{
+				return false;
+			}
+
+			buf.resize(sort_run_read_buffer_entries);
+			_u32 read = f->Read(reinterpret_cast<char*>(buf.data()),
+				static_cast<_u32>(buf.size()*sizeof(SIndexSortEntry)));
+			buf.resize(read / sizeof(SIndexSortEntry));
+			pos = 0;
+
+			if (buf.empty())
+			{
+				f.reset();
+				return false;
+			}
+		}
+
+		entry = buf[pos++];
+		return true;
+	}
+
+	bool isOpen()
+	{
+		return f.get() != NULL;
+	}
+
+private:
+	std::auto_ptr<IFile> f;
+	std::vector<SIndexSortEntry> buf;
+	size_t pos;
+};
+
+struct SMergeItem
+{
+	SIndexSortEntry entry;
+	size_t run;
+
+	bool operator<(const SMergeItem& other) const
+	{
+		//priority_queue returns the largest element first
+		return sort_entry_less(other.entry, entry);
+	}
+};
 
 struct SCallbackData
 {
-	IDatabaseCursor* cur;
-	int64 pos;
+	std::vector<SortRunReader*> runs;
+	std::priority_queue<SMergeItem> merge_queue;
 	int64 max_pos;
 	SStartupStatus* status;
 };
@@ -46,31 +283,106 @@ db_results create_callback(size_t n_done, size_t n_rows, void *userdata)
 
 	data->status->processed_file_entries=n_done;
 	
-	int last_pc = static_cast<int>(data->status->pc_done*1000 + 0.5);
-	
 	if(data->max_pos>0)
 	{
-		data->status->pc_done = static_cast<double>(n_rows)/data->max_pos;
-	}
-	
-	int curr_pc = static_cast<int>(data->status->pc_done*1000 + 0.5);
-	
-	if(curr_pc!=last_pc)
-	{
-		Server->Log("Creating files index: "+convert((double)curr_pc/10)+"% finished", LL_INFO);
+		set_progress(*data->status, 0.5 + 0.5*static_cast<double>(n_rows)/data->max_pos);
 	}
 	
 	db_results ret;
-	db_single_result res;
-	
-	if(data->cur->next(res))
+
+	if(!data->merge_queue.empty())
 	{
+		SMergeItem item = data->merge_queue.top();
+		data->merge_queue.pop();
+
+		db_single_result res;
+		res["id"] = convert(item.entry.id);
+		res["shahash"] = std::string(item.entry.key.getHash(), bytes_in_index);
+		res["filesize"] = convert(item.entry.key.getFilesize());
+		res["clientid"] = convert(item.entry.key.getClientid());
+		res["next_entry"] = convert(item.entry.next_entry);
+		res["prev_entry"] = convert(item.entry.prev_entry);
+		res["pointed_to"] = convert(static_cast<int>(item.entry.pointed_to));
 		ret.push_back(res);
+
+		if(data->runs[item.run]->next(item.entry))
+		{
+			data->merge_queue.push(item);
+		}
 	}
 	
 	return ret;
 }
 
+bool sort_file_entries(IDatabase* db, SStartupStatus& status, int64 n_files, std::vector<std::string>& runs)
+{
+	db_results res = db->Read("SELECT MIN(id) AS min_id, MAX(id) AS max_id FROM files");
+	if(res.empty() || res[0]["min_id"].empty())
+	{
+		return true;
+	}
+
+	int64 min_id = watoi64(res[0]["min_id"]);
+	int64 max_id = watoi64(res[0]["max_id"]) + 1;
+
+	size_t n_threads = (std::max)(static_cast<size_t>(1),
+		(std::min)(static_cast<size_t>(std::thread::hardware_concurrency()), sort_max_threads));
+	n_threads = static_cast<size_t>((std::min)(static_cast<int64>(n_threads), (max_id - min_id) / sort_min_range_size + 1));
+
+	size_t max_entries = sort_memory_limit / n_threads / sizeof(SIndexSortEntry);
+
+	Server->Log("Sorting file entries using "+convert(n_threads)+" threads...", LL_INFO);
+
+	std::vector<SortRunThread*> threads;
+	std::vector<THREADPOOL_TICKET> tickets;
+	int64 range_size = (max_id - min_id) / n_threads + 1;
+	for(size_t i=0;i<n_threads;++i)
+	{
+		int64 id_start = min_id + i*range_size;
+		int64 id_end = (std::min)(id_start + range_size, max_id);
+		threads.push_back(new SortRunThread(id_start, id_end, max_entries, i));
+		tickets.push_back(Server->getThreadPool()->execute(threads[i], "files index sort"));
+	}
+
+	while(!Server->getThreadPool()->waitFor(tickets, 1000))
+	{
+		int64 n_scanned = 0;
+		for(size_t i=0;i<threads.size();++i)
+		{
+			n_scanned += threads[i]->getScanned();
+		}
+
+		status.processed_file_entries = static_cast<size_t>(n_scanned);
+		if(n_files>0)
+		{
+			set_progress(status, 0.5*static_cast<double>(n_scanned)/n_files);
+		}
+	}
+
+	bool ret = true;
+	for(size_t i=0;i<threads.size();++i)
+	{
+		if(threads[i]->hasError())
+		{
+			ret = false;
+		}
+		runs.insert(runs.end(), threads[i]->getRuns().begin(), threads[i]->getRuns().end());
+		delete threads[i];
+	}
+
+	Server->Log("Sorted file entries into "+convert(runs.size())+" runs", LL_INFO);
+
+	return ret;
+}
+
+void delete_sort_runs(const std::vector<std::string>& runs)
+{
+	for(size_t i=0;i<runs.size();++i)
+	{
+		Server->deleteFile(runs[i]);
+	}
+}
+
 bool create_files_index_common(FileIndex& fileindex, SStartupStatus& status)
 {
 	Server->destroyAllDatabases();
@@ -156,31 +468,56 @@ bool create_files_index_common(FileIndex& fileindex, SStartupStatus& status)
 	db_files_new->Write("DROP INDEX IF EXISTS files_backupid");
 
 
-	Server->Log("Starting creating files index...", LL_INFO);
+	std::vector<std::string> runs;
+	if(!sort_file_entries(db, status, n_files, runs))
+	{
+		Server->Log("Sorting file entries failed", LL_ERROR);
+		delete_sort_runs(runs);
+		return false;
+	}
 
-	IQuery *q_read=db->Prepare("SELECT id, shahash, filesize, clientid, next_entry, prev_entry, pointed_to FROM files ORDER BY shahash ASC, filesize ASC, clientid ASC, created DESC");
+	Server->Log("Starting creating files index...", LL_INFO);
 
 	SCallbackData data;
-	data.cur=q_read->Cursor();
-	data.pos=0;
 	data.max_pos=n_files;
 	data.status=&status;
 
+	bool runs_ok = true;
+	for(size_t i=0;i<runs.size();++i)
+	{
+		data.runs.push_back(new SortRunReader(runs[i]));
+		if(!data.runs[i]->isOpen())
+		{
+			Server->Log("Error opening sort run \""+runs[i]+"\"", LL_ERROR);
+			runs_ok = false;
+		}
+
+		SMergeItem item;
+		item.run = i;
+		if(data.runs[i]->next(item.entry))
+		{
+			data.merge_queue.push(item);
+		}
+	}
+
+	if(runs_ok)
 	{
 		DBScopedWriteTransaction write_transaction(db_files_new);
 		fileindex.create(create_callback, &data);
 	}
 
-	if(fileindex.has_error())
+	for(size_t i=0;i<data.runs.size();++i)
+	{
+		delete data.runs[i];
+	}
+	delete_sort_runs(runs);
+
+	if(!runs_ok || fileindex.has_error())
 	{
 		return false;
 	}
 	else
 	{
-		if (data.cur->has_error())
-		{
-			return false;
-		}
 
 		Server->Log("Creating backupid index...", LL_INFO);
 
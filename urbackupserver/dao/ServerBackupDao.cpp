@@ -1285,6 +1285,68 @@ ServerBackupDao::CondInt64 ServerBackupDao::hasRecentIncrImageBackup(const std::
 	return ret;
 }
 
+/**
+* @-SQLGenAccess
+* @func SLastBackupTimes ServerBackupDao::getLastFileBackupTimes
+* @return int64 last_full, int64 last_complete
+* @sql
+*       SELECT strftime('%s', MAX(CASE WHEN incremental=0 THEN backuptime END)) AS last_full,
+*			strftime('%s', MAX(CASE WHEN complete=1 THEN backuptime END)) AS last_complete
+*		FROM backups
+*		WHERE clientid=:clientid(int) AND done=1 AND tgroup=:tgroup(int)
+*/
+ServerBackupDao::SLastBackupTimes ServerBackupDao::getLastFileBackupTimes(int clientid, int tgroup)
+{
+	if(q_getLastFileBackupTimes==NULL)
+	{
+		q_getLastFileBackupTimes=db->Prepare("SELECT strftime('%s', MAX(CASE WHEN incremental=0 THEN backuptime END)) AS last_full, strftime('%s', MAX(CASE WHEN complete=1 THEN backuptime END)) AS last_complete FROM backups WHERE clientid=? AND done=1 AND tgroup=?", false);
+	}
+	q_getLastFileBackupTimes->Bind(clientid);
+	q_getLastFileBackupTimes->Bind(tgroup);
+	db_results res=q_getLastFileBackupTimes->Read();
+	q_getLastFileBackupTimes->Reset();
+	SLastBackupTimes ret = { false, 0, 0 };
+	if(!res.empty())
+	{
+		ret.exists=true;
+		ret.last_full=watoi64(res[0]["last_full"]);
+		ret.last_complete=watoi64(res[0]["last_complete"]);
+	}
+	return ret;
+}
+
+/**
+* @-SQLGenAccess
+* @func SLastBackupTimes ServerBackupDao::getLastImageBackupTimes
+* @return int64 last_full, int64 last_complete
+* @sql
+*       SELECT strftime('%s', MAX(CASE WHEN incremental=0 THEN backuptime END)) AS last_full,
+*			strftime('%s', MAX(backuptime)) AS last_complete
+*		FROM backup_images
+*		WHERE clientid=:clientid(int) AND complete=1
+*           AND version=:image_version(int) AND letter=:letter(string)
+*/
+ServerBackupDao::SLastBackupTimes ServerBackupDao::getLastImageBackupTimes(int clientid, int image_version, const std::string& letter)
+{
+	if(q_getLastImageBackupTimes==NULL)
+	{
+		q_getLastImageBackupTimes=db->Prepare("SELECT strftime('%s', MAX(CASE WHEN incremental=0 THEN backuptime END)) AS last_full, strftime('%s', MAX(backuptime)) AS last_complete FROM backup_images WHERE clientid=? AND complete=1 AND version=? AND letter=?", false);
+	}
+	q_getLastImageBackupTimes->Bind(clientid);
+	q_getLastImageBackupTimes->Bind(image_version);
+	q_getLastImageBackupTimes->Bind(letter);
+	db_results res=q_getLastImageBackupTimes->Read();
+	q_getLastImageBackupTimes->Reset();
+	SLastBackupTimes ret = { false, 0, 0 };
+	if(!res.empty())
+	{
+		ret.exists=true;
+		ret.last_full=watoi64(res[0]["last_full"]);
+		ret.last_complete=watoi64(res[0]["last_complete"]);
+	}
+	return ret;
+}
+
 /**
 * @-SQLGenAccess
 * @func void ServerBackupDao::addRestore
@@ -1736,6 +1798,8 @@ void ServerBackupDao::prepareQueries( void )
 	q_hasRecentIncrFileBackup=NULL;
 	q_hasRecentFullOrIncrImageBackup=NULL;
 	q_hasRecentIncrImageBackup=NULL;
+	q_getLastFileBackupTimes=NULL;
+	q_getLastImageBackupTimes=NULL;
 	q_addRestore=NULL;
 	q_getRestorePath=NULL;
 	q_getRestoreIdentity=NULL;
@@ -1813,6 +1877,8 @@ void ServerBackupDao::destroyQueries( void )
 	db->destroyQuery(q_hasRecentIncrFileBackup);
 	db->destroyQuery(q_hasRecentFullOrIncrImageBackup);
 	db->destroyQuery(q_hasRecentIncrImageBackup);
+	db->destroyQuery(q_getLastFileBackupTimes);
+	db->destroyQuery(q_getLastImageBackupTimes);
 	db->destroyQuery(q_addRestore);
 	db->destroyQuery(q_getRestorePath);
 	db->destroyQuery(q_getRestoreIdentity);
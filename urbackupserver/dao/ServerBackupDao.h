@@ -36,6 +36,12 @@ public:
 		int64 indexing_time_ms;
 		int64 duration;
 	};
+	struct SLastBackupTimes
+	{
+		bool exists;
+		int64 last_full;
+		int64 last_complete;
+	};
 	struct SFileBackupInfo
 	{
 		bool exists;
@@ -143,6 +149,8 @@ public:
 	CondInt64 hasRecentIncrFileBackup(const std::string& backup_interval, int clientid, int tgroup);
 	CondInt64 hasRecentFullOrIncrImageBackup(const std::string& backup_interval_full, int clientid, const std::string& backup_interval_incr, int image_version, const std::string& letter);
 	CondInt64 hasRecentIncrImageBackup(const std::string& backup_interval, int clientid, int image_version, const std::string& letter);
+	SLastBackupTimes getLastFileBackupTimes(int clientid, int tgroup);
+	SLastBackupTimes getLastImageBackupTimes(int clientid, int image_version, const std::string& letter);
 	void addRestore(int clientid, const std::string& path, const std::string& identity, int image, const std::string& letter);
 	CondString getRestorePath(int64 restore_id, int clientid);
 	CondString getRestoreIdentity(int64 restore_id, int clientid);
@@ -227,6 +235,8 @@ private:
 	IQuery* q_hasRecentIncrFileBackup;
 	IQuery* q_hasRecentFullOrIncrImageBackup;
 	IQuery* q_hasRecentIncrImageBackup;
+	IQuery* q_getLastFileBackupTimes;
+	IQuery* q_getLastImageBackupTimes;
 	IQuery* q_addRestore;
 	IQuery* q_getRestorePath;
 	IQuery* q_getRestoreIdentity;
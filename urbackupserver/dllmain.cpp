@@ -91,6 +91,9 @@ SStartupStatus startup_status;
 #include "../Interface/DatabaseCursor.h"
 #include <set>
 #include "apps/check_files_index.h"
+#include "FileIndexChecker.h"
+#include "ChunkIndex.h"
+#include "ChunkStore.h"
 #include "../fileservplugin/IFileServ.h"
 #include "../fileservplugin/IFileServFactory.h"
 #include "restore_client.h"
@@ -619,6 +622,7 @@ DLLEXPORT void LoadActions(IServer* pServer)
 		else
 		{
 			fileserv = fileserv_fak->createFileServNoBind();
+			fileserv->registerFileOpenCallback(new ChunkStoreFileOpenCallback);
 		}
 	}
 
@@ -638,6 +642,7 @@ DLLEXPORT void LoadActions(IServer* pServer)
 	ServerStatus::init_mutex();
 	ServerSettings::init_mutex();
 	ClientMain::init_mutex();
+	Alerts::init_mutex();
 	DataplanDb::init();
 	init_log_report();
 
@@ -863,6 +868,8 @@ DLLEXPORT void LoadActions(IServer* pServer)
 	}
 
 	init_chunk_hasher();
+	ChunkIndex::initMutex();
+	ChunkStore::initMutex();
 	ServerCleanupThread::initMutex();
 	ServerAutomaticArchive::initMutex();
 	ServerCleanupThread *server_cleanup=new ServerCleanupThread(CleanupAction());
@@ -884,6 +891,11 @@ DLLEXPORT void LoadActions(IServer* pServer)
 
 	Server->createThread(new ImageMount, "image umount");
 
+	if (!is_leak_check)
+	{
+		Server->createThread(new FileIndexChecker, "files index check");
+	}
+
 	Server->setLogCircularBufferSize(20);
 
 	start_wal_checkpoint_threads();
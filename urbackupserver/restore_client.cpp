@@ -32,6 +32,7 @@
 #include "dao/ServerBackupDao.h"
 #include "dao/ServerCleanupDao.h"
 #include "server.h"
+#include "ChunkStore.h"
 
 extern IFileServ* fileserv;
 
@@ -386,6 +387,11 @@ namespace
 						}
 					}
 				}
+
+				if (!file.isdir && !file.issym)
+				{
+					file.size = ChunkStore::contentSize(os_file_prefix(filename), file.size);
+				}
 				
 				std::string metadatasource;
 				bool recurse_dir = false;
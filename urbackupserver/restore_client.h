@@ -8,6 +8,8 @@
 namespace
 {
 	const int64 restore_flag_ignore_permissions = 1 << 6;
+	const int64 restore_flag_parallel_download = 1 << 7;
+	const int64 restore_flag_local_copy = 1 << 8;
 }
 
 bool create_clientdl_thread(const std::string& curr_clientname, int curr_clientid, int restore_clientid, std::string foldername, std::string hashfoldername,
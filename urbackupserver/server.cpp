@@ -37,6 +37,7 @@
 #include <algorithm>
 #include "ThrottleUpdater.h"
 #include "../fsimageplugin/IFSImageFactory.h"
+#include "Alerts.h"
 
 const int max_offline=5;
 
@@ -535,6 +536,8 @@ void BackupServer::startClients(FileClient &fc)
 								q_update_lastseen->Bind(status.clientid);
 								q_update_lastseen->Write();
 								q_update_lastseen->Reset();
+
+								Alerts::checkClient(status.clientid);
 							}
 
 							ServerStatus::removeStatus(it->first);
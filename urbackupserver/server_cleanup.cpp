@@ -43,6 +43,7 @@
 #include "create_files_index.h"
 #include "../urbackupcommon/WalCheckpointThread.h"
 #include "copy_storage.h"
+#include "ChunkStore.h"
 #include <assert.h>
 #include <set>
 
@@ -103,6 +104,10 @@ void ServerCleanupThread::operator()(void)
 		case ECleanupAction_DeleteFilebackup:
 		{
 			bool b = deleteFileBackup(cleanup_action.backupfolder, cleanup_action.clientid, cleanup_action.backupid, cleanup_action.force_remove);
+			if (b)
+			{
+				ChunkStore::cleanup(cleanup_action.backupfolder, logid);
+			}
 			if (cleanup_action.result != NULL)
 			{
 				*cleanup_action.result = b;
@@ -447,6 +452,8 @@ void ServerCleanupThread::do_cleanup(void)
 		{
 			ServerLogger::Log(logid, "Error getting total used space of backup folder", LL_ERROR);
 		}
+
+		ChunkStore::cleanup(server_settings.getSettings()->backupfolder, logid);
 	}
 
 	ServerLogger::Log(logid, "Updating statistics...", LL_INFO);
@@ -487,6 +494,11 @@ bool ServerCleanupThread::do_cleanup(int64 minspace, bool do_cleanup_other)
 	cleanup_images();
 	cleanup_files();
 
+	{
+		ServerSettings server_settings(db);
+		ChunkStore::cleanup(server_settings.getSettings()->backupfolder, logid);
+	}
+
 	if(do_cleanup_other)
 	{
 		cleanup_other();
@@ -567,6 +579,7 @@ void ServerCleanupThread::do_remove_unknown(void)
 			{
 				Server->Log("Image backup [id="+convert(res_image_backups[j].id)+" path="+res_image_backups[j].path+" clientname="+clientname+"] does not exist. Deleting it from the database.", LL_WARNING);
 				cleanupdao->removeImage(res_image_backups[j].id);
+				ClientMain::invalidateScheduleCache();
 			}
 			else
 			{
@@ -727,6 +740,7 @@ void ServerCleanupThread::do_remove_unknown(void)
 					Server->deleteFile(rm_file+".bitmap");
 					Server->deleteFile(rm_file+".cbitmap");
 					Server->deleteFile(rm_file + ".sync");
+					Server->deleteFile(rm_file + ".blockmap");
 				}
 			}
 		}
@@ -834,6 +848,7 @@ bool ServerCleanupThread::deleteImage(logid_t logid, std::string clientname, std
 		}
 		deleteAndTruncateFile(logid, path + ".cbitmap");
 		deleteAndTruncateFile(logid, path + ".sync");
+		Server->deleteFile(os_file_prefix(path + ".blockmap"));
 
 		if (b && ExtractFileName(ExtractFilePath(path)) != clientname)
 		{
@@ -1019,6 +1034,7 @@ void ServerCleanupThread::cleanup_images(int64 minspace)
 				ServerLogger::Log(logid, "Deleting incomplete image \"" + incomplete_images[i].path + "\" failed.", LL_WARNING);
 			}
 			cleanupdao->removeImage(incomplete_images[i].id);
+			ClientMain::invalidateScheduleCache();
 		}
 	}
 
@@ -1152,6 +1168,8 @@ bool ServerCleanupThread::removeImage(int backupid, ServerSettings* settings,
 			cleanupdao->removeImage(backupid);
 			cleanupdao->removeImageSize(backupid);
 			db->EndTransaction();
+
+			ClientMain::invalidateScheduleCache();
 		}
 		else
 		{
@@ -1366,6 +1384,11 @@ void ServerCleanupThread::cleanup_files(int64 minspace)
 			if(cleanup_one_filebackup_client(clientid, minspace, filebid))
 			{
 				ServerSettings settings(db);
+				if(minspace!=-1)
+				{
+					//Chunks only shared with the deleted backup are only freed by this
+					ChunkStore::cleanup(settings.getSettings()->backupfolder, logid);
+				}
 				int r=hasEnoughFreeSpace(minspace, &settings);
 				if( r==-1 || r==1 )
 						return;
@@ -2652,6 +2675,8 @@ void ServerCleanupThread::removeFileBackupSql( int backupid )
 	filesdao->endTransaction();
 
 	cleanupdao->removeFileBackup(backupid);
+
+	ClientMain::invalidateScheduleCache();
 }
 
 bool ServerCleanupThread::backup_clientlists()
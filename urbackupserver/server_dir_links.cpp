@@ -26,6 +26,12 @@
 #include "../Interface/File.h"
 #include "database.h"
 #include <assert.h>
+#include <set>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 namespace
 {
@@ -98,6 +104,115 @@ namespace
 		return ret;
 	}
 
+	void unreference_new_pool(ServerLinkDao& link_dao, int clientid, const std::string& src_dir, const std::string& target_dir,
+		const std::string& pool_name, int depth)
+	{
+		reference_parents(link_dao, clientid, src_dir, pool_name, depth, true);
+		link_dao.removeDirectoryLink(clientid, src_dir);
+		link_dao.removeDirectoryLinkGlob(clientid, escape_glob_sql(target_dir) + os_file_sep() + "*");
+		link_dao.removeDirectoryLink(clientid, target_dir);
+	}
+
+	bool new_pool_dir(const std::string& pooldir, std::string& pool_name, std::string& link_src_dir)
+	{
+		std::string parent_src_dir;
+		do 
+		{
+			pool_name = ServerSettings::generateRandomAuthKey(10)+convert(Server->getTimeSeconds())+convert(Server->getTimeMS());
+			parent_src_dir = pooldir + os_file_sep() + pool_name.substr(0, 2);
+			link_src_dir = parent_src_dir + os_file_sep() + pool_name;
+		} while (os_directory_exists(os_file_prefix(link_src_dir)));
+
+		if(!os_directory_exists(os_file_prefix(parent_src_dir)) && !os_create_dir_recursive(os_file_prefix(parent_src_dir)))
+		{
+			Server->Log("Could not create directory for pool directory: \""+parent_src_dir+"\"", LL_ERROR);
+			return false;
+		}
+
+		return true;
+	}
+
+#ifndef _WIN32
+	//Creates symlinks relative to cached parent directory handles
+	class SymlinkDirCache
+	{
+	public:
+		~SymlinkDirCache()
+		{
+			clear();
+		}
+
+		bool link(const std::string& target, const std::string& lname)
+		{
+			std::string parent = ExtractFilePath(lname, os_file_sep());
+			std::map<std::string, int>::iterator it = dir_fds.find(parent);
+			if (it == dir_fds.end())
+			{
+				if (dir_fds.size() >= max_dir_fds)
+				{
+					clear();
+				}
+
+				int fd = open(parent.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+				if (fd == -1)
+				{
+					return os_link_symbolic(target, lname);
+				}
+				it = dir_fds.insert(std::make_pair(parent, fd)).first;
+			}
+
+			return symlinkat(target.c_str(), it->second, ExtractFileName(lname, os_file_sep()).c_str()) == 0;
+		}
+
+	private:
+		void clear()
+		{
+			for (std::map<std::string, int>::iterator it = dir_fds.begin(); it != dir_fds.end(); ++it)
+			{
+				close(it->second);
+			}
+			dir_fds.clear();
+		}
+
+		static const size_t max_dir_fds = 64;
+		std::map<std::string, int> dir_fds;
+	};
+#else
+	class SymlinkDirCache
+	{
+	public:
+		bool link(const std::string& target, const std::string& lname)
+		{
+			return os_link_symbolic(os_file_prefix(target), os_file_prefix(lname));
+		}
+	};
+#endif
+
+	const size_t c_remove_batch_size = 256;
+	const int64 c_remove_batch_time = 1000;
+
+	void sync_dirs(std::set<std::string>& dirs)
+	{
+		for (std::set<std::string>::iterator it = dirs.begin(); it != dirs.end(); ++it)
+		{
+			std::auto_ptr<IFile> dir_f(Server->openFile(os_file_prefix(*it), MODE_READ_SEQUENTIAL_BACKUP));
+			if (dir_f.get() != NULL)
+			{
+				dir_f->Sync();
+			}
+		}
+		dirs.clear();
+	}
+
+	struct SPendingDirLink
+	{
+		size_t idx;
+		std::string pool_name;
+		std::string link_src_dir;
+		bool new_pool;
+		int64 journal_id;
+	};
+
 	IMutex* dir_link_mutex;
 	std::map<int, IMutex*> dir_link_client_mutexes;
 }
@@ -197,21 +312,11 @@ bool link_directory_pool( int clientid, const std::string& target_dir, const std
 	}
 	else if(os_directory_exists(os_file_prefix(src_dir)))
 	{
-		std::string parent_src_dir;
-		do 
+		if (!new_pool_dir(pooldir, pool_name, link_src_dir))
 		{
-			pool_name = ServerSettings::generateRandomAuthKey(10)+convert(Server->getTimeSeconds())+convert(Server->getTimeMS());
-			parent_src_dir = pooldir + os_file_sep() + pool_name.substr(0, 2);
-			link_src_dir = parent_src_dir + os_file_sep() + pool_name;
-		} while (os_directory_exists(os_file_prefix(link_src_dir)));
-
-		if(!os_directory_exists(os_file_prefix(parent_src_dir)) && !os_create_dir_recursive(os_file_prefix(parent_src_dir)))
-		{
-			Server->Log("Could not create directory for pool directory: \""+parent_src_dir+"\"", LL_ERROR);
 			return false;
 		}
 
-		std::vector<int64> parent_ids;
 		reference_parents(*link_dao, clientid, src_dir, pool_name, depth, false);
 		link_dao->addDirectoryLink(clientid, pool_name, src_dir);
 		reference_all_sublinks(*link_dao, clientid, src_dir, target_dir);
@@ -236,10 +341,7 @@ bool link_directory_pool( int clientid, const std::string& target_dir, const std
 			if(!transaction)
 			{
 				Server->Log("Error starting filesystem transaction", LL_ERROR);
-				reference_parents(*link_dao, clientid, src_dir, pool_name, depth, true);
-				link_dao->removeDirectoryLink(clientid, src_dir);
-				link_dao->removeDirectoryLinkGlob(clientid, escape_glob_sql(target_dir) + os_file_sep() + "*");
-				link_dao->removeDirectoryLink(clientid, target_dir);
+				unreference_new_pool(*link_dao, clientid, src_dir, target_dir, pool_name, depth);
 				return false;
 			}
 		}
@@ -248,10 +350,7 @@ bool link_directory_pool( int clientid, const std::string& target_dir, const std
 		{
 			Server->Log("Could not rename folder \""+src_dir+"\" to \""+link_src_dir+"\"", LL_ERROR);
 			os_finish_transaction(transaction);
-			reference_parents(*link_dao, clientid, src_dir, pool_name, depth, true);
-			link_dao->removeDirectoryLink(clientid, src_dir);
-			link_dao->removeDirectoryLinkGlob(clientid, escape_glob_sql(target_dir) + os_file_sep() + "*");
-			link_dao->removeDirectoryLink(clientid, target_dir);
+			unreference_new_pool(*link_dao, clientid, src_dir, target_dir, pool_name, depth);
 			
 			if (!with_transaction)
 			{
@@ -267,10 +366,7 @@ bool link_directory_pool( int clientid, const std::string& target_dir, const std
 			Server->Log("Could not create a symbolic link at \""+src_dir+"\" to \""+link_src_dir+"\"", LL_ERROR);
 			os_rename_file(link_src_dir, src_dir, transaction);
 			os_finish_transaction(transaction);
-			reference_parents(*link_dao, clientid, src_dir, pool_name, depth, true);
-			link_dao->removeDirectoryLink(clientid, src_dir);
-			link_dao->removeDirectoryLinkGlob(clientid, escape_glob_sql(target_dir) + os_file_sep() + "*");
-			link_dao->removeDirectoryLink(clientid, target_dir);
+			unreference_new_pool(*link_dao, clientid, src_dir, target_dir, pool_name, depth);
 
 			if (!with_transaction)
 			{
@@ -285,10 +381,7 @@ bool link_directory_pool( int clientid, const std::string& target_dir, const std
 			if(!os_finish_transaction(transaction))
 			{
 				Server->Log("Error finishing filesystem transaction", LL_ERROR);
-				reference_parents(*link_dao, clientid, src_dir, pool_name, depth, true);
-				link_dao->removeDirectoryLink(clientid, src_dir);
-				link_dao->removeDirectoryLinkGlob(clientid, escape_glob_sql(target_dir) + os_file_sep() + "*");
-				link_dao->removeDirectoryLink(clientid, target_dir);
+				unreference_new_pool(*link_dao, clientid, src_dir, target_dir, pool_name, depth);
 				return false;
 			}
 		}
@@ -321,6 +414,168 @@ bool link_directory_pool( int clientid, const std::string& target_dir, const std
 	return true;
 }
 
+bool link_directory_pool_batch(int clientid, const std::vector<SDirLinkItem>& items, const std::string& pooldir, bool with_transaction,
+	ServerLinkDao*& link_dao, ServerLinkJournalDao*& link_journal_dao, std::vector<bool>& linked)
+{
+	linked.assign(items.size(), false);
+
+	bool ret = true;
+
+	if (with_transaction)
+	{
+		for (size_t i = 0; i < items.size(); ++i)
+		{
+			linked[i] = link_directory_pool(clientid, items[i].target_dir, items[i].src_dir, pooldir, true,
+				link_dao, link_journal_dao, items[i].depth);
+			if (!linked[i])
+			{
+				ret = false;
+			}
+		}
+		return ret;
+	}
+
+	if (link_dao == NULL)
+	{
+		link_dao=new ServerLinkDao(Server->getDatabase(Server->getThreadID(), URBACKUPDB_SERVER_LINKS));
+	}
+
+	IDatabase* link_journal_db = Server->getDatabase(Server->getThreadID(), URBACKUPDB_SERVER_LINK_JOURNAL);
+	DBScopedSynchronous synchonous_link_journal(NULL);
+
+	if (link_journal_dao == NULL)
+	{
+		link_journal_dao = new ServerLinkJournalDao(link_journal_db);
+		synchonous_link_journal.reset(link_journal_db);
+	}
+
+	DBScopedSynchronous synchonous_link(link_dao->getDatabase());
+
+	IScopedLock lock(NULL);
+	dir_link_lock_client_mutex(clientid, lock);
+
+	std::vector<SPendingDirLink> pending;
+
+	{
+		DBScopedWriteTransaction link_transaction(link_dao->getDatabase());
+		DBScopedWriteTransaction journal_transaction(link_journal_db);
+
+		for (size_t i = 0; i < items.size(); ++i)
+		{
+			const SDirLinkItem& item = items[i];
+
+			SPendingDirLink curr;
+			curr.idx = i;
+			curr.new_pool = false;
+			curr.journal_id = 0;
+
+			if (os_is_symlink(os_file_prefix(item.src_dir)))
+			{
+				if (!os_get_symlink_target(os_file_prefix(item.src_dir), curr.link_src_dir))
+				{
+					Server->Log("Could not get symlink target of source directory \"" + item.src_dir + "\".", LL_ERROR);
+					ret = false;
+					continue;
+				}
+
+				curr.pool_name = ExtractFileName(curr.link_src_dir);
+
+				if (curr.pool_name.empty())
+				{
+					Server->Log("Error extracting pool name from link source \"" + curr.link_src_dir + "\"", LL_ERROR);
+					ret = false;
+					continue;
+				}
+
+				link_dao->addDirectoryLink(clientid, curr.pool_name, item.target_dir);
+				reference_all_sublinks(*link_dao, clientid, item.src_dir, item.target_dir);
+			}
+			else if (os_directory_exists(os_file_prefix(item.src_dir)))
+			{
+				if (!new_pool_dir(pooldir, curr.pool_name, curr.link_src_dir))
+				{
+					ret = false;
+					continue;
+				}
+
+				curr.new_pool = true;
+
+				reference_parents(*link_dao, clientid, item.src_dir, curr.pool_name, item.depth, false);
+				link_dao->addDirectoryLink(clientid, curr.pool_name, item.src_dir);
+				reference_all_sublinks(*link_dao, clientid, item.src_dir, item.target_dir);
+				link_dao->addDirectoryLink(clientid, curr.pool_name, item.target_dir);
+
+				link_journal_dao->addDirectoryLinkJournalEntry(item.src_dir, curr.link_src_dir);
+				curr.journal_id = link_journal_dao->getLastId();
+			}
+			else
+			{
+				Server->Log("Cannot link directory \"" + item.target_dir + "\" because source directory \"" + item.src_dir + "\" does not exist.", LL_DEBUG);
+				ret = false;
+				continue;
+			}
+
+			pending.push_back(curr);
+		}
+
+		//Journal entries have to be on disk before the renames below
+		journal_transaction.end();
+		link_transaction.end();
+	}
+
+	SymlinkDirCache symlink_cache;
+
+	for (size_t i = 0; i < pending.size(); ++i)
+	{
+		const SPendingDirLink& curr = pending[i];
+		const SDirLinkItem& item = items[curr.idx];
+
+		if (curr.new_pool)
+		{
+			if (!os_rename_file(os_file_prefix(item.src_dir), os_file_prefix(curr.link_src_dir)))
+			{
+				Server->Log("Could not rename folder \"" + item.src_dir + "\" to \"" + curr.link_src_dir + "\"", LL_ERROR);
+				unreference_new_pool(*link_dao, clientid, item.src_dir, item.target_dir, curr.pool_name, item.depth);
+				ret = false;
+				continue;
+			}
+
+			if (!symlink_cache.link(curr.link_src_dir, item.src_dir))
+			{
+				Server->Log("Could not create a symbolic link at \"" + item.src_dir + "\" to \"" + curr.link_src_dir + "\"", LL_ERROR);
+				os_rename_file(curr.link_src_dir, item.src_dir);
+				unreference_new_pool(*link_dao, clientid, item.src_dir, item.target_dir, curr.pool_name, item.depth);
+				ret = false;
+				continue;
+			}
+		}
+
+		if (!symlink_cache.link(curr.link_src_dir, item.target_dir))
+		{
+			Server->Log("Error creating symbolic link from \"" + curr.link_src_dir + "\" to \"" +
+				item.target_dir + "\" -2", LL_ERROR);
+
+			link_dao->removeDirectoryLink(clientid, item.target_dir);
+			link_dao->removeDirectoryLinkGlob(clientid, escape_glob_sql(item.target_dir) + os_file_sep() + "*");
+			ret = false;
+			continue;
+		}
+
+		linked[curr.idx] = true;
+	}
+
+	DBScopedWriteTransaction journal_transaction(link_journal_db);
+	for (size_t i = 0; i < pending.size(); ++i)
+	{
+		if (pending[i].new_pool)
+		{
+			link_journal_dao->removeDirectoryLinkJournalEntry(pending[i].journal_id);
+		}
+	}
+
+	return ret;
+}
+
 bool replay_directory_link_journal( )
 {
 	IScopedLock lock(dir_link_mutex);
@@ -358,7 +613,7 @@ bool replay_directory_link_journal( )
 }
 
 bool remove_directory_link(const std::string & path, ServerLinkDao & link_dao, int clientid,
-	std::auto_ptr<DBScopedSynchronous>& synchronous_link_dao, bool with_transaction)
+	std::auto_ptr<DBScopedSynchronous>& synchronous_link_dao, bool with_transaction, std::set<std::string>* parent_dirs)
 {
 	std::string pool_path;
 	if (!os_get_symlink_target(path, pool_path))
@@ -435,6 +690,11 @@ bool remove_directory_link(const std::string & path, ServerLinkDao & link_dao, i
 		Server->Log("Error removing symlink dir \"" + path + "\"", LL_ERROR);
 	}
 
+	if (parent_dirs != NULL)
+	{
+		parent_dirs->insert(ExtractFilePath(path, os_file_sep()));
+	}
+	else
 	{
 		std::auto_ptr<IFile> dir_f(Server->openFile(os_file_prefix(ExtractFilePath(path, os_file_sep())), MODE_READ_SEQUENTIAL_BACKUP));
 		if (dir_f.get() != NULL)
@@ -459,15 +719,34 @@ namespace
 		SSymlinkCallbackData(ServerLinkDao* link_dao,
 			int clientid, bool with_transaction)
 			: link_dao(link_dao), clientid(clientid),
-			with_transaction(with_transaction)
+			with_transaction(with_transaction), batch_links(0),
+			batch_starttime(Server->getTimeMS())
+		{
+
+		}
+
+		//Parent directories have to be synced before the link removals are committed
+		void commitBatch()
 		{
+			sync_dirs(parent_dirs);
+
+			if (with_transaction)
+			{
+				link_dao->getDatabase()->EndTransaction();
+				link_dao->getDatabase()->BeginWriteTransaction();
+			}
 
+			batch_links = 0;
+			batch_starttime = Server->getTimeMS();
 		}
 
 		ServerLinkDao* link_dao;
 		std::auto_ptr<DBScopedSynchronous> synchronous_link_dao;
 		int clientid;
 		bool with_transaction;
+		std::set<std::string> parent_dirs;
+		size_t batch_links;
+		int64 batch_starttime;
 	};
 
 	bool symlink_callback(const std::string &path, bool* isdir, void* userdata)
@@ -483,8 +762,17 @@ namespace
 
 		SSymlinkCallbackData* data = reinterpret_cast<SSymlinkCallbackData*>(userdata);
 
-		return remove_directory_link(path, *data->link_dao, data->clientid,
-			data->synchronous_link_dao, data->with_transaction);
+		bool ret = remove_directory_link(path, *data->link_dao, data->clientid,
+			data->synchronous_link_dao, false, &data->parent_dirs);
+
+		++data->batch_links;
+		if (data->batch_links >= c_remove_batch_size
+			|| Server->getTimeMS() - data->batch_starttime >= c_remove_batch_time)
+		{
+			data->commitBatch();
+		}
+
+		return ret;
 	}
 }
 
@@ -494,7 +782,24 @@ bool remove_directory_link_dir(const std::string &path, ServerLinkDao& link_dao,
 	dir_link_lock_client_mutex(clientid, lock);
 
 	SSymlinkCallbackData userdata(&link_dao, clientid, with_transaction);
-	return os_remove_nonempty_dir(os_file_prefix(path), symlink_callback, &userdata, delete_root);
+
+	if (with_transaction)
+	{
+		userdata.synchronous_link_dao.reset(new DBScopedSynchronous(link_dao.getDatabase()));
+		link_dao.getDatabase()->BeginWriteTransaction();
+	}
+
+	bool ret = os_remove_nonempty_dir(os_file_prefix(path), symlink_callback, &userdata, delete_root);
+
+	sync_dirs(userdata.parent_dirs);
+
+	if (with_transaction)
+	{
+		link_dao.getDatabase()->EndTransaction();
+		userdata.synchronous_link_dao.reset();
+	}
+
+	return ret;
 }
 
 bool reference_contained_directory_links(ServerLinkDao& link_dao, int clientid, 
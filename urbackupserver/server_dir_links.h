@@ -4,6 +4,8 @@
 #include "dao/ServerLinkJournalDao.h"
 #include <string>
 #include <memory>
+#include <vector>
+#include <set>
 
 void init_dir_link_mutex();
 
@@ -17,10 +19,22 @@ void dir_link_lock_client_mutex(int clientid, IScopedLock& lock);
 bool link_directory_pool(int clientid, const std::string& target_dir, const std::string& src_dir, const std::string& pooldir, bool with_transaction,
 	ServerLinkDao*& link_dao, ServerLinkJournalDao*& link_journal_dao, int depth);
 
+struct SDirLinkItem
+{
+	std::string target_dir;
+	std::string src_dir;
+	int depth;
+};
+
+//Links several directories with one link database and one journal transaction.
+//The source directories must not be contained in each other.
+bool link_directory_pool_batch(int clientid, const std::vector<SDirLinkItem>& items, const std::string& pooldir, bool with_transaction,
+	ServerLinkDao*& link_dao, ServerLinkJournalDao*& link_journal_dao, std::vector<bool>& linked);
+
 bool replay_directory_link_journal();
 
 bool remove_directory_link(const std::string &path, ServerLinkDao& link_dao, int clientid,
-	std::auto_ptr<DBScopedSynchronous>& synchronous_link_dao, bool with_transaction=true);
+	std::auto_ptr<DBScopedSynchronous>& synchronous_link_dao, bool with_transaction=true, std::set<std::string>* parent_dirs=NULL);
 
 bool remove_directory_link_dir(const std::string &path, ServerLinkDao& link_dao, int clientid, bool delete_root=true, bool with_transaction=true);
 
@@ -22,6 +22,7 @@
 #include "../Interface/Server.h"
 #include "../Interface/File.h"
 #include "../Interface/Mutex.h"
+#include "../Interface/ThreadPool.h"
 #include "../common/data.h"
 #include "database.h"
 #include "../urbackupcommon/sha2/sha2.h"
@@ -33,13 +34,41 @@
 #include <memory.h>
 #include "../urbackupcommon/file_metadata.h"
 #include "FileBackup.h"
+#include "server.h"
 #include <assert.h>
+#include <errno.h>
 #ifdef _WIN32
 #include <Windows.h>
 #endif
 
 const size_t freespace_mod=50*1024*1024; //50 MB
 const size_t BUFFER_SIZE=64*1024; //64KB
+const int64 c_dedup_min_blocks=2;
+const int64 c_dedup_max_len=16*1024*1024;
+const size_t c_link_batch_max=256;
+const size_t c_link_threads=4;
+const size_t c_link_min_per_thread=16;
+
+namespace
+{
+	class LinkWorker : public IThread
+	{
+	public:
+		LinkWorker(std::vector<SHardlinkOp>& ops, size_t begin, size_t end)
+			: ops(ops), begin(begin), end(end)
+		{}
+
+		void operator()()
+		{
+			os_create_hardlinks(ops, begin, end);
+		}
+
+	private:
+		std::vector<SHardlinkOp>& ops;
+		size_t begin;
+		size_t end;
+	};
+}
 
 IMutex * delete_mutex=NULL;
 
@@ -56,7 +85,7 @@ void destroy_mutex1(void)
 BackupServerHash::BackupServerHash(IPipe *pPipe, int pClientid, bool use_snapshots, bool use_reflink, bool use_tmpfiles, logid_t logid,
 	bool snapshot_file_inplace, MaxFileId& max_file_id)
 	: use_snapshots(use_snapshots), use_reflink(use_reflink), use_tmpfiles(use_tmpfiles), filesdao(NULL), old_backupfolders_loaded(false),
-	  logid(logid), snapshot_file_inplace(snapshot_file_inplace), max_file_id(max_file_id)
+	  logid(logid), snapshot_file_inplace(snapshot_file_inplace), max_file_id(max_file_id), chunk_dedup(false), chunk_store(false)
 {
 	pipe=pPipe;
 	clientid=pClientid;
@@ -88,6 +117,37 @@ void BackupServerHash::setupDatabase(void)
 	filesdao = new ServerFilesDao(db);
 
 	fileindex=create_lmdb_files_index(); 
+
+	std::string backupfolder;
+	{
+		ServerSettings server_settings(Server->getDatabase(Server->getThreadID(), URBACKUPDB_SERVER));
+		chunk_dedup = server_settings.getSettings()->chunk_dedup
+			&& BackupServer::canReflink() && !BackupServer::isReflinkCopy();
+		//Without reflinks files are split into chunks in the chunk store instead
+		chunk_store = server_settings.getSettings()->chunk_dedup
+			&& !use_reflink && !BackupServer::canReflink() && !BackupServer::isFileSnapshotsEnabled();
+		backupfolder = server_settings.getSettings()->backupfolder;
+	}
+
+	if(chunk_dedup)
+	{
+		chunkindex.reset(new ChunkIndex);
+		if(chunkindex->has_error())
+		{
+			ServerLogger::Log(logid, "HT: Error opening chunk index. Chunk deduplication disabled.", LL_ERROR);
+			chunk_dedup=false;
+		}
+	}
+
+	if(chunk_store)
+	{
+		chunkstore.reset(new ChunkStore(backupfolder, logid));
+		if(chunkstore->has_error())
+		{
+			ServerLogger::Log(logid, "HT: Error opening chunk store. Chunk deduplication disabled.", LL_ERROR);
+			chunk_store=false;
+		}
+	}
 }
 
 void BackupServerHash::deinitDatabase(void)
@@ -99,6 +159,8 @@ void BackupServerHash::deinitDatabase(void)
 
 	delete filesdao;
 	filesdao =NULL;
+
+	chunkindex.reset();
 }
 
 void BackupServerHash::operator()(void)
@@ -107,11 +169,19 @@ void BackupServerHash::operator()(void)
 
 	while(true)
 	{
-		working=false;
+		if(pending_links.empty())
+		{
+			working=false;
+		}
 		std::string data;
-		size_t rc=pipe->Read(&data, static_cast<int>(60000) );
+		size_t rc=pipe->Read(&data, pending_links.empty() ? 60000 : 0);
 		if(rc==0)
 		{
+			if(!pending_links.empty())
+			{
+				flushLinks();
+				continue;
+			}
 			link_logcnt=0;
 			space_logcnt=0;
 			continue;
@@ -120,6 +190,7 @@ void BackupServerHash::operator()(void)
 		working=true;
 		if(data=="exit")
 		{
+			flushLinks();
 			deinitDatabase();
 			Server->Log("server_hash Thread finished - normal");
 			Server->destroyDatabases(Server->getThreadID());
@@ -128,6 +199,7 @@ void BackupServerHash::operator()(void)
 		}
 		else if(data=="flush")
 		{
+			flushLinks();
 			continue;
 		}
 
@@ -141,83 +213,19 @@ void BackupServerHash::operator()(void)
 
 			if(action==EAction_LinkOrCopy)
 			{
-				int64 fileid;
-				rd.getVarInt(&fileid);
-
-				std::string temp_fn;
-				rd.getStr(&temp_fn);
-
-				int backupid;
-				rd.getInt(&backupid);
-
-				int incremental;
-				rd.getInt(&incremental);
-
-				char with_hashes;
-				rd.getChar(&with_hashes);
-
-				std::string tfn;
-				rd.getStr(&tfn);
-
-				std::string hashpath;
-				rd.getStr(&hashpath);
-
-				std::string sha2;
-				if(!rd.getStr(&sha2))
-					ServerLogger::Log(logid, "Reading hash from pipe failed", LL_ERROR);
-
-				if(sha2.size()!=SHA_DEF_DIGEST_SIZE)
-					ServerLogger::Log(logid, "SHA length of file hash of \""+tfn+"\" wrong.", LL_ERROR);
-
-				std::string hashoutput_fn;
-				rd.getStr(&hashoutput_fn);
-
-				std::string old_file_fn;
-				rd.getStr(&old_file_fn);
-
-				int64 t_filesize;
-				rd.getInt64(&t_filesize);
+				SLinkOrCopyItem item;
+				readLinkOrCopyItem(rd, item);
 
-				std::string sparse_extents_fn;
-				rd.getStr(&sparse_extents_fn);
-
-				FileMetadata metadata;
-				metadata.read(rd);
-				metadata.set_shahash(sha2);
-
-				IFile *tf=Server->openFile(os_file_prefix((temp_fn)), MODE_READ_SEQUENTIAL);
-
-				if(tf==NULL)
+				if(!queueLink(item))
 				{
-					ServerLogger::Log(logid, "Error opening file \""+temp_fn+"\" from pipe for reading ec="+convert(os_last_error()), LL_ERROR);
-					has_error=true;
+					flushLinks();
+					linkOrCopy(item);
 				}
-				else
-				{
-					std::auto_ptr<ExtentIterator> extent_iterator;
-					if (!sparse_extents_fn.empty())
-					{
-						IFile* sparse_extents_f = Server->openFile(sparse_extents_fn, MODE_READ);
-
-						if (sparse_extents_f != NULL)
-						{
-							extent_iterator.reset(new ExtentIterator(sparse_extents_f));
-						}
-					}
-
-					addFile(backupid, incremental, tf, tfn, hashpath, sha2,
-						old_file_fn, hashoutput_fn, t_filesize, metadata, with_hashes!=0, extent_iterator.get());
-				}
-
-				if(!hashoutput_fn.empty())
-				{
-					Server->deleteFile(hashoutput_fn);
-				}
-
-				max_file_id.setMaxDownloaded(fileid);
 			}
 			else if(action==EAction_Copy)
 			{
+				flushLinks();
+
 				int64 fileid;
 				bool b = rd.getVarInt(&fileid);
 				assert(b);
@@ -248,7 +256,7 @@ void BackupServerHash::operator()(void)
 					metadata.set_shahash(src_metadata.shahash);
 				}
 
-				std::auto_ptr<IFile> tf(Server->openFile(os_file_prefix(source), MODE_READ_SEQUENTIAL));
+				std::auto_ptr<IFile> tf(ChunkStore::openFile(os_file_prefix(source), MODE_READ_SEQUENTIAL));
 
 				if(!tf.get())
 				{
@@ -279,6 +287,182 @@ void BackupServerHash::operator()(void)
 	}
 }
 
+void BackupServerHash::readLinkOrCopyItem(CRData& rd, SLinkOrCopyItem& item)
+{
+	rd.getVarInt(&item.fileid);
+
+	rd.getStr(&item.temp_fn);
+
+	rd.getInt(&item.backupid);
+
+	rd.getInt(&item.incremental);
+
+	char with_hashes;
+	rd.getChar(&with_hashes);
+
+	rd.getStr(&item.tfn);
+
+	rd.getStr(&item.hashpath);
+
+	if(!rd.getStr(&item.sha2))
+		ServerLogger::Log(logid, "Reading hash from pipe failed", LL_ERROR);
+
+	if(item.sha2.size()!=SHA_DEF_DIGEST_SIZE)
+		ServerLogger::Log(logid, "SHA length of file hash of \""+item.tfn+"\" wrong.", LL_ERROR);
+
+	rd.getStr(&item.hashoutput_fn);
+
+	rd.getStr(&item.old_file_fn);
+
+	rd.getInt64(&item.t_filesize);
+
+	rd.getStr(&item.sparse_extents_fn);
+
+	item.metadata.read(rd);
+	item.metadata.set_shahash(item.sha2);
+	item.with_hashes = with_hashes!=0;
+}
+
+void BackupServerHash::linkOrCopy(SLinkOrCopyItem& item)
+{
+	IFile *tf=Server->openFile(os_file_prefix((item.temp_fn)), MODE_READ_SEQUENTIAL);
+
+	if(tf==NULL)
+	{
+		ServerLogger::Log(logid, "Error opening file \""+item.temp_fn+"\" from pipe for reading ec="+convert(os_last_error()), LL_ERROR);
+		has_error=true;
+	}
+	else
+	{
+		std::auto_ptr<ExtentIterator> extent_iterator;
+		if (!item.sparse_extents_fn.empty())
+		{
+			IFile* sparse_extents_f = Server->openFile(item.sparse_extents_fn, MODE_READ);
+
+			if (sparse_extents_f != NULL)
+			{
+				extent_iterator.reset(new ExtentIterator(sparse_extents_f));
+			}
+		}
+
+		addFile(item.backupid, item.incremental, tf, item.tfn, item.hashpath, item.sha2,
+			item.old_file_fn, item.hashoutput_fn, item.t_filesize, item.metadata, item.with_hashes, extent_iterator.get());
+	}
+
+	if(!item.hashoutput_fn.empty())
+	{
+		Server->deleteFile(item.hashoutput_fn);
+	}
+
+	max_file_id.setMaxDownloaded(item.fileid);
+}
+
+bool BackupServerHash::queueLink(SLinkOrCopyItem& item)
+{
+	if(item.t_filesize<link_file_min_size
+		|| !item.hashoutput_fn.empty()
+		|| snapshot_file_inplace
+		|| (use_snapshots && BackupServer::isReflinkCopy()) )
+	{
+		return false;
+	}
+
+	SFindState find_state;
+	item.existing_file = findFileHash(item.sha2, item.t_filesize, clientid, find_state);
+
+	if(!item.existing_file.exists)
+	{
+		return false;
+	}
+
+	pending_links.push_back(item);
+
+	if(pending_links.size()>=c_link_batch_max)
+	{
+		flushLinks();
+	}
+
+	return true;
+}
+
+void BackupServerHash::flushLinks()
+{
+	if(pending_links.empty())
+	{
+		return;
+	}
+
+	std::vector<std::pair<std::string, size_t> > order;
+	order.reserve(pending_links.size());
+	for(size_t i=0;i<pending_links.size();++i)
+	{
+		order.push_back(std::make_pair(ExtractFilePath(pending_links[i].tfn, os_file_sep()), i));
+	}
+	std::sort(order.begin(), order.end());
+
+	std::vector<SHardlinkOp> ops;
+	ops.reserve(order.size());
+	for(size_t i=0;i<order.size();++i)
+	{
+		SLinkOrCopyItem& item = pending_links[order[i].second];
+		ops.push_back(SHardlinkOp(os_file_prefix(item.tfn), os_file_prefix(item.existing_file.fullpath), use_snapshots));
+	}
+
+	size_t n_threads = (std::min)(c_link_threads, (ops.size() + c_link_min_per_thread - 1) / c_link_min_per_thread);
+	if(n_threads<=1)
+	{
+		os_create_hardlinks(ops, 0, ops.size());
+	}
+	else
+	{
+		size_t per_thread = (ops.size() + n_threads - 1) / n_threads;
+		std::vector<LinkWorker*> workers;
+		std::vector<THREADPOOL_TICKET> tickets;
+		for(size_t begin=0;begin<ops.size();begin+=per_thread)
+		{
+			LinkWorker* worker = new LinkWorker(ops, begin, (std::min)(begin+per_thread, ops.size()));
+			workers.push_back(worker);
+			tickets.push_back(Server->getThreadPool()->execute(worker, "hash link"));
+		}
+		Server->getThreadPool()->waitFor(tickets);
+		for(size_t i=0;i<workers.size();++i)
+		{
+			delete workers[i];
+		}
+	}
+
+	std::vector<char> linked(pending_links.size());
+	for(size_t i=0;i<order.size();++i)
+	{
+		linked[order[i].second] = ops[i].ok;
+	}
+
+	for(size_t i=0;i<pending_links.size();++i)
+	{
+		SLinkOrCopyItem& item = pending_links[i];
+
+		if(!linked[i])
+		{
+			//Retries and falls back to copying
+			linkOrCopy(item);
+			continue;
+		}
+
+		int64 rsize;
+		finishLinkedFile(item.existing_file, item.hashpath, item.hashoutput_fn, item.t_filesize, item.metadata, rsize);
+
+		ServerLogger::Log(logid, "HT: Linked file: \""+item.tfn+"\"", LL_DEBUG);
+		Server->deleteFile(os_file_prefix(item.temp_fn));
+
+		addFileSQL(item.backupid, clientid, item.incremental, item.tfn, item.hashpath, item.sha2, item.t_filesize, rsize,
+			item.existing_file.id, item.existing_file.clientid, item.existing_file.next_entry, false);
+
+		max_file_id.setMaxDownloaded(item.fileid);
+	}
+
+	pending_links.clear();
+}
+
 void BackupServerHash::addFileSQL(int backupid, int clientid, int incremental, const std::string &fp, const std::string &hash_path, const std::string &shahash, _i64 filesize, _i64 rsize, int64 prev_entry, int64 prev_entry_clientid, int64 next_entry, bool update_fileindex)
 {
 	addFileSQL(*filesdao, *fileindex, backupid, clientid, incremental, fp, hash_path, shahash, filesize, rsize, prev_entry, prev_entry_clientid, next_entry, update_fileindex);
@@ -660,7 +844,7 @@ bool BackupServerHash::findFileAndLink(const std::string &tfn, IFile *tf, std::s
 				std::string errmsg;
 				int64 errcode = os_last_error(errmsg);
 
-				IFile *ctf=Server->openFile(os_file_prefix(existing_file.fullpath), MODE_READ);
+				IFile *ctf=ChunkStore::openFile(os_file_prefix(existing_file.fullpath), MODE_READ);
 				if(ctf==NULL)
 				{
 					if(correctPath(existing_file.fullpath, existing_file.hashpath))
@@ -756,96 +940,102 @@ bool BackupServerHash::findFileAndLink(const std::string &tfn, IFile *tf, std::s
 			entryclientid = existing_file.clientid;
 			next_entry=existing_file.next_entry;
 
-			assert(!hash_fn.empty());
-			
-			if(existing_file.rsize!=0 &&
-				existing_file.rsize!=existing_file.filesize)			
-			{
-				rsize=existing_file.rsize;
-			}
-			else
-			{
-				rsize=0;
-			}
+			finishLinkedFile(existing_file, hash_fn, hashoutput_fn, t_filesize, metadata, rsize);
 
-			metadata.rsize=rsize;
+			copy=false;
+			break;
+		}
+	}
 
-			bool write_metadata=true;
+	return !copy;
+}
 
-			if(!hashoutput_fn.empty())
+void BackupServerHash::finishLinkedFile(const ServerFilesDao::SFindFileEntry& existing_file, std::string hash_fn, const std::string& hashoutput_fn,
+	_i64 t_filesize, FileMetadata& metadata, int64& rsize)
+{
+	assert(!hash_fn.empty());
+	
+	if(existing_file.rsize!=0 &&
+		existing_file.rsize!=existing_file.filesize)			
+	{
+		rsize=existing_file.rsize;
+	}
+	else
+	{
+		rsize=0;
+	}
+
+	metadata.rsize=rsize;
+
+	bool write_metadata=true;
+
+	if(!hashoutput_fn.empty())
+	{
+		std::auto_ptr<IFile> src(Server->openFile(os_file_prefix(hashoutput_fn), MODE_READ));
+		if(src.get()!=NULL)
+		{
+			if(!copyFile(src.get(), hash_fn, NULL))
+			{
+				ServerLogger::Log(logid, "Error copying hashoutput to destination -1", LL_ERROR);
+				has_error=true;
+				hash_fn.clear();
+				write_metadata = false;
+			}
+			else
 			{
-				std::auto_ptr<IFile> src(Server->openFile(os_file_prefix(hashoutput_fn), MODE_READ));
-				if(src.get()!=NULL)
+				if(!os_file_truncate(os_file_prefix(hash_fn), get_hashdata_size(t_filesize)))
 				{
-					if(!copyFile(src.get(), hash_fn, NULL))
-					{
-						ServerLogger::Log(logid, "Error copying hashoutput to destination -1", LL_ERROR);
-						has_error=true;
-						hash_fn.clear();
-						write_metadata = false;
-					}
-					else
-					{
-						if(!os_file_truncate(os_file_prefix(hash_fn), get_hashdata_size(t_filesize)))
-						{
-							ServerLogger::Log(logid, "Error truncating hashdata file -1", LL_ERROR);
-						}
-					}
+					ServerLogger::Log(logid, "Error truncating hashdata file -1", LL_ERROR);
 				}
-				else
+			}
+		}
+		else
+		{
+			ServerLogger::Log(logid, "HT: Error opening hashoutput", LL_ERROR);
+			has_error=true;
+			hash_fn.clear();
+			write_metadata = false;
+		}
+	}
+	else if(!existing_file.hashpath.empty())
+	{
+		std::auto_ptr<IFile> ctf(Server->openFile(os_file_prefix(existing_file.hashpath), MODE_READ));
+		if(ctf.get()!=NULL)
+		{
+			int64 hashfilesize = read_hashdata_size(ctf.get());
+			if(hashfilesize!=-1
+				&& hashfilesize == t_filesize)
+			{
+				if(!copyFile(ctf.get(), hash_fn, NULL))
 				{
-					ServerLogger::Log(logid, "HT: Error opening hashoutput", LL_ERROR);
+					ServerLogger::Log(logid, "Error copying hashfile to destination -2", LL_ERROR);
 					has_error=true;
 					hash_fn.clear();
 					write_metadata = false;
 				}
-			}
-			else if(!existing_file.hashpath.empty())
-			{
-				std::auto_ptr<IFile> ctf(Server->openFile(os_file_prefix(existing_file.hashpath), MODE_READ));
-				if(ctf.get()!=NULL)
+				else
 				{
-					int64 hashfilesize = read_hashdata_size(ctf.get());
-					if(hashfilesize!=-1
-						&& hashfilesize == t_filesize)
+					if(!os_file_truncate(os_file_prefix(hash_fn), get_hashdata_size(t_filesize)))
 					{
-						if(!copyFile(ctf.get(), hash_fn, NULL))
-						{
-							ServerLogger::Log(logid, "Error copying hashfile to destination -2", LL_ERROR);
-							has_error=true;
-							hash_fn.clear();
-							write_metadata = false;
-						}
-						else
-						{
-							if(!os_file_truncate(os_file_prefix(hash_fn), get_hashdata_size(t_filesize)))
-							{
-								ServerLogger::Log(logid, "Error truncating hashdata file -2. " + os_last_error_str(), LL_ERROR);
-							}
-						}
-					}
-					else
-					{
-						if (hashfilesize != -1)
-						{
-							Server->Log("File size in meta-data file \"" + existing_file.hashpath + "\" does not match database. From database=" + convert(t_filesize) + " In meta-data=" + convert(hashfilesize), LL_WARNING);
-						}
+						ServerLogger::Log(logid, "Error truncating hashdata file -2. " + os_last_error_str(), LL_ERROR);
 					}
 				}
 			}
-
-			if(write_metadata && !write_file_metadata(hash_fn, this, metadata, false))
+			else
 			{
-				ServerLogger::Log(logid, "Error writing file metadata -1", LL_ERROR);
-				has_error=true;
+				if (hashfilesize != -1)
+				{
+					Server->Log("File size in meta-data file \"" + existing_file.hashpath + "\" does not match database. From database=" + convert(t_filesize) + " In meta-data=" + convert(hashfilesize), LL_WARNING);
+				}
 			}
-
-			copy=false;
-			break;
 		}
 	}
 
-	return !copy;
+	if(write_metadata && !write_file_metadata(hash_fn, this, metadata, false))
+	{
+		ServerLogger::Log(logid, "Error writing file metadata -1", LL_ERROR);
+		has_error=true;
+	}
 }
 
 void BackupServerHash::addFile(int backupid, int incremental, IFile *tf, const std::string &tfn,
@@ -1037,6 +1227,20 @@ void BackupServerHash::addFile(int backupid, int incremental, IFile *tf, const s
 						has_error=true;
 					}
 
+					if(chunk_dedup)
+					{
+						//Reflinked patches already share unchanged data with the previous version
+						dedupChunks(tfn, hash_fn, t_filesize, use_reflink && !orig_fn.empty());
+					}
+
+					if(chunk_store
+						&& t_filesize>=c_chunk_store_min_size
+						&& !chunkstore->storeFile(os_file_prefix(tfn))
+						&& chunkstore->has_error())
+					{
+						chunk_store=false;
+					}
+
 					addFileSQL(backupid, clientid, incremental, tfn, hash_fn, sha2, t_filesize, cow_filesize>0?cow_filesize:t_filesize, 0, 0, 0, tries_once || hardlink_limit);
 				}
 			}
@@ -1482,7 +1686,7 @@ bool BackupServerHash::patchFile(IFile *patch, const std::string &source, const
 		}
 		ObjectScope dst_s(chunk_output_fn);
 
-		IFile *f_source=openFileRetry(source, MODE_READ, errstr);
+		IFile *f_source=ChunkStore::wrapFile(openFileRetry(source, MODE_READ, errstr));
 		if (f_source == NULL)
 		{
 			ServerLogger::Log(logid, "Error opening patch source file \"" + source + "\". "+errstr, LL_ERROR);
@@ -1843,6 +2047,149 @@ bool BackupServerHash::correctPath( std::string& ff, std::string& f_hashpath )
 	return false;
 }
 
+void BackupServerHash::dedupChunks(const std::string& tfn, const std::string& hash_fn, int64 t_filesize, bool index_only)
+{
+	int64 n_blocks = t_filesize/c_checkpoint_dist;
+	if(n_blocks<c_dedup_min_blocks)
+	{
+		return;
+	}
+
+	std::auto_ptr<IFile> hashf(Server->openFile(os_file_prefix(hash_fn), MODE_READ));
+	if(hashf.get()==NULL)
+	{
+		return;
+	}
+
+	int64 hashfilesize;
+	if(hashf->Read(0, reinterpret_cast<char*>(&hashfilesize), sizeof(hashfilesize))!=sizeof(hashfilesize)
+		|| little_endian(hashfilesize)!=t_filesize)
+	{
+		return;
+	}
+
+	std::string sparse_hash = get_sparse_extent_content().substr(0, big_hash_size);
+
+	std::vector<std::string> hashes;
+	std::vector<int64> offsets;
+	for(int64 i=0;i<n_blocks;++i)
+	{
+		std::string hash = hashf->Read(chunkhash_file_off+i*chunkhash_single_size, big_hash_size);
+		if(hash.size()!=big_hash_size)
+		{
+			break;
+		}
+		if(hash==sparse_hash)
+		{
+			continue;
+		}
+		hashes.push_back(hash);
+		offsets.push_back(i*c_checkpoint_dist);
+	}
+
+	hashf.reset();
+
+	std::vector<SChunkLocation> locs;
+	if(index_only)
+	{
+		locs.resize(hashes.size());
+	}
+	else
+	{
+		locs = chunkindex->get(hashes);
+	}
+
+	std::vector<SChunkIndexUpdate> updates;
+	std::auto_ptr<IFsFile> dst;
+	std::auto_ptr<IFsFile> src;
+	std::string src_path;
+	int64 deduped = 0;
+
+	size_t i=0;
+	while(i<hashes.size())
+	{
+		if(locs[i].path.empty() || locs[i].path==tfn)
+		{
+			SChunkIndexUpdate update = { hashes[i], SChunkLocation(tfn, offsets[i]), false };
+			updates.push_back(update);
+			++i;
+			continue;
+		}
+
+		size_t run=1;
+		while(i+run<hashes.size()
+			&& static_cast<int64>(run+1)*c_checkpoint_dist<=c_dedup_max_len
+			&& offsets[i+run]==offsets[i]+static_cast<int64>(run)*c_checkpoint_dist
+			&& locs[i+run].path==locs[i].path
+			&& locs[i+run].offset==locs[i].offset+static_cast<int64>(run)*c_checkpoint_dist)
+		{
+			++run;
+		}
+
+		if(dst.get()==NULL)
+		{
+			dst.reset(Server->openFile(os_file_prefix(tfn), MODE_RW));
+			if(dst.get()==NULL)
+			{
+				ServerLogger::Log(logid, "HT: Error opening \""+tfn+"\" for chunk deduplication. "+os_last_error_str(), LL_WARNING);
+				return;
+			}
+		}
+
+		if(src_path!=locs[i].path)
+		{
+			src.reset(Server->openFile(os_file_prefix(locs[i].path), MODE_READ));
+			src_path=locs[i].path;
+		}
+
+		int64 len = static_cast<int64>(run)*c_checkpoint_dist;
+		int64 rc = -1;
+		if(src.get()!=NULL)
+		{
+			if(src->Size()<locs[i].offset+len)
+			{
+				//Source was truncated
+				rc = 0;
+			}
+			else
+			{
+				rc = os_dedupe_file_range(src.get(), locs[i].offset, dst.get(), offsets[i], len);
+			}
+		}
+
+		if(rc<0 && src.get()!=NULL
+			&& (errno==EOPNOTSUPP || errno==ENOTTY || errno==EXDEV))
+		{
+			ServerLogger::Log(logid, "HT: Chunk deduplication is not supported by the backup storage. Disabling. "+os_last_error_str(), LL_WARNING);
+			chunk_dedup=false;
+			break;
+		}
+		else if(rc<len)
+		{
+			//Source was deleted, truncated (EINVAL) or was modified. Use this file instead.
+			for(size_t j=i;j<i+run;++j)
+			{
+				SChunkIndexUpdate update = { hashes[j], SChunkLocation(tfn, offsets[j]), true };
+				updates.push_back(update);
+			}
+		}
+
+		if(rc>0)
+		{
+			deduped+=rc;
+		}
+
+		i+=run;
+	}
+
+	chunkindex->write(updates);
+
+	if(deduped>0)
+	{
+		ServerLogger::Log(logid, "HT: Deduplicated "+PrettyPrintBytes(deduped)+" of \""+tfn+"\" with chunks of other files", LL_DEBUG);
+	}
+}
+
 bool BackupServerHash::punchHoleOrZero(IFile * tf, int64 offset, int64 size)
 {
 	if (!tf->PunchHole(offset, size))
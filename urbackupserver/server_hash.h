@@ -15,6 +15,10 @@
 #include "../urbackupcommon/chunk_hasher.h"
 #include "server_log.h"
 #include "../urbackupcommon/ExtentIterator.h"
+#include "ChunkIndex.h"
+#include "ChunkStore.h"
+#include "../urbackupcommon/file_metadata.h"
+#include <memory>
 
 class FileMetadata;
 class MaxFileId;
@@ -97,6 +101,31 @@ public:
 		bool use_transaction, bool del_entry, bool detach_dbs, bool with_backupstat, SInMemCorrection* correction);
 
 private:
+	struct SLinkOrCopyItem
+	{
+		int64 fileid;
+		std::string temp_fn;
+		int backupid;
+		int incremental;
+		bool with_hashes;
+		std::string tfn;
+		std::string hashpath;
+		std::string sha2;
+		std::string hashoutput_fn;
+		std::string old_file_fn;
+		int64 t_filesize;
+		std::string sparse_extents_fn;
+		FileMetadata metadata;
+		ServerFilesDao::SFindFileEntry existing_file;
+	};
+
+	void readLinkOrCopyItem(CRData& rd, SLinkOrCopyItem& item);
+	void linkOrCopy(SLinkOrCopyItem& item);
+	bool queueLink(SLinkOrCopyItem& item);
+	void flushLinks();
+	void finishLinkedFile(const ServerFilesDao::SFindFileEntry& existing_file, std::string hash_fn, const std::string& hashoutput_fn,
+		_i64 t_filesize, FileMetadata& metadata, int64& rsize);
+
 	void addFile(int backupid, int incremental, IFile *tf, const std::string &tfn,
 			std::string hash_fn, const std::string &sha2, const std::string &orig_fn, const std::string &hashoutput_fn, int64 t_filesize,
 			FileMetadata& metadata, bool with_hashes, ExtentIterator* extent_iterator);
@@ -134,6 +163,8 @@ private:
 
 	bool punchHoleOrZero(IFile *tf, int64 offset, int64 size);
 
+	void dedupChunks(const std::string& tfn, const std::string& hash_fn, int64 t_filesize, bool index_only);
+
 	std::map<std::pair<std::string, _i64>, std::vector<STmpFile> > files_tmp;
 
 	ServerFilesDao* filesdao;
@@ -176,4 +207,12 @@ private:
 	bool snapshot_file_inplace;
 
 	MaxFileId& max_file_id;
+
+	bool chunk_dedup;
+	std::auto_ptr<ChunkIndex> chunkindex;
+
+	bool chunk_store;
+	std::auto_ptr<ChunkStore> chunkstore;
+
+	std::vector<SLinkOrCopyItem> pending_links;
 };
\ No newline at end of file
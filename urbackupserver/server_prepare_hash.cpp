@@ -30,6 +30,7 @@
 #include <memory.h>
 #include "../common/adler32.h"
 #include "../urbackupcommon/file_metadata.h"
+#include "ChunkStore.h"
 
 namespace
 {
@@ -145,7 +146,7 @@ void BackupServerPrepareHash::operator()(void)
 			IFile *old_file=NULL;
 			if(diff_file)
 			{
-				old_file=Server->openFile(os_file_prefix((old_file_fn)), MODE_READ);
+				old_file=ChunkStore::openFile(os_file_prefix((old_file_fn)), MODE_READ);
 				if(old_file==NULL)
 				{
 					ServerLogger::Log(logid, "Error opening file \""+old_file_fn+"\" for reading. File: old_file. "+os_last_error_str()+" Target path: \""+tfn+"\"", LL_ERROR);
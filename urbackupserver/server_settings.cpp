@@ -22,13 +22,14 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <math.h>
+#include <time.h>
 #ifndef CLIENT_ONLY
 
 #include "server_settings.h"
 #include "../Interface/Server.h"
 #include "server.h"
 
-IMutex *ServerSettings::g_mutex=NULL;
+ISharedMutex *ServerSettings::g_mutex=NULL;
 std::map<int, SSettings*> ServerSettings::g_settings_cache;
 
 //#define CLEAR_SETTINGS_CACHE
@@ -36,7 +37,7 @@ std::map<int, SSettings*> ServerSettings::g_settings_cache;
 void ServerSettings::init_mutex(void)
 {
 	if(g_mutex==NULL)
-		g_mutex=Server->createMutex();
+		g_mutex=Server->createSharedMutex();
 }
 
 void ServerSettings::destroy_mutex(void)
@@ -49,16 +50,16 @@ void ServerSettings::destroy_mutex(void)
 
 void ServerSettings::clear_cache()
 {
-	IScopedLock lock(g_mutex);
+	IScopedWriteLock lock(g_mutex);
 
 	for(std::map<int, SSettings*>::iterator it=g_settings_cache.begin();
 		it!=g_settings_cache.end();)
 	{
-		if(it->second->refcount==0)
+		if(it->second->refcount==1)
 		{
 			std::map<int, SSettings*>::iterator it_curr = it;
 			++it;
-			delete it_curr->second;
+			releaseSettings(it_curr->second);
 			g_settings_cache.erase(it_curr);
 		}
 		else
@@ -69,47 +70,32 @@ void ServerSettings::clear_cache()
 	}
 }
 
-ServerSettings::ServerSettings(IDatabase *db, int pClientid)
-	: local_settings(NULL), clientid(pClientid), db(db)
+void ServerSettings::releaseSettings(SSettings* settings)
 {
-	IScopedLock lock(g_mutex);
-		
-	std::map<int, SSettings*>::iterator iter=g_settings_cache.find(clientid);
-	if(iter!=g_settings_cache.end())
+	assert(settings->refcount > 0);
+	if (--settings->refcount == 0)
 	{
-		++iter->second->refcount;
-		local_settings = iter->second;
+		delete settings;
 	}
-	else
-	{
-		lock.relock(NULL);
-
-		std::auto_ptr<ISettingsReader> settings_client, settings_default, setting_global;
-		createSettingsReaders(settings_default, settings_client, setting_global);
-		local_settings = new SSettings();
-		local_settings->refcount = 1;
-		readSettingsDefault(settings_default.get(), 
-			setting_global.get()!=NULL ? setting_global.get() : settings_default.get());
-		if (settings_client.get() != NULL)
-		{
-			readSettingsClient(settings_client.get());
-		}
-
-		lock.relock(g_mutex);
+}
 
-		iter = g_settings_cache.find(clientid);
+ServerSettings::ServerSettings(IDatabase *db, int pClientid)
+	: local_settings(NULL), clientid(pClientid), db(db)
+{
+	{
+		IScopedReadLock lock(g_mutex);
 
-		if (iter != g_settings_cache.end())
+		std::map<int, SSettings*>::iterator iter=g_settings_cache.find(clientid);
+		if(iter!=g_settings_cache.end())
 		{
-			delete local_settings;
 			++iter->second->refcount;
 			local_settings = iter->second;
+			return;
 		}
-		else
-		{
-			g_settings_cache.insert(std::make_pair(clientid, local_settings));
-		}
-	}	
+	}
+
+	loadSettings();
+	publishSettings(NULL);
 }
 
 void ServerSettings::createSettingsReaders(std::auto_ptr<ISettingsReader>& settings_default,
@@ -134,79 +120,78 @@ void ServerSettings::createSettingsReaders(std::auto_ptr<ISettingsReader>& setti
 	}
 }
 
-ServerSettings::~ServerSettings(void)
+void ServerSettings::loadSettings()
 {
+	local_settings = new SSettings();
+	local_settings->refcount = 1;
+	std::auto_ptr<ISettingsReader> settings_client, settings_default, settings_global;
+	createSettingsReaders(settings_default, settings_client, settings_global);
+	readSettingsDefault(settings_default.get(),
+		settings_global.get() != NULL ? settings_global.get() : settings_default.get());
+	if (settings_client.get() != NULL)
 	{
-		IScopedLock lock(g_mutex);
+		readSettingsClient(settings_client.get());
+	}
+	compileTimeSpans();
+}
 
-		assert(local_settings->refcount > 0);
-		--local_settings->refcount;
+void ServerSettings::publishSettings(SSettings* replaces)
+{
+	IScopedWriteLock lock(g_mutex);
 
-		if (local_settings->refcount == 0)
-		{
-#ifdef CLEAR_SETTINGS_CACHE
-			if (!local_settings->needs_update)
-			{
-				std::map<int, SSettings*>::iterator iter = g_settings_cache.find(clientid);
-				assert(iter != g_settings_cache.end());
-				delete iter->second;
-				g_settings_cache.erase(iter);
-			}
-#endif
-			if (local_settings->needs_update)
-			{
-				std::map<int, SSettings*>::iterator iter = g_settings_cache.find(clientid);
-				assert(iter != g_settings_cache.end());
-				if (local_settings == iter->second)
-				{
-					g_settings_cache.erase(iter);
-				}
+	std::map<int, SSettings*>::iterator iter = g_settings_cache.find(clientid);
 
-				delete local_settings;
-			}
+	if (iter == g_settings_cache.end()
+		|| (replaces != NULL && iter->second == replaces))
+	{
+		if (iter != g_settings_cache.end())
+		{
+			releaseSettings(iter->second);
 		}
+
+		++local_settings->refcount;
+		g_settings_cache[clientid] = local_settings;
+	}
+	else
+	{
+		releaseSettings(local_settings);
+		++iter->second->refcount;
+		local_settings = iter->second;
 	}
 }
 
+ServerSettings::~ServerSettings(void)
+{
+#ifdef CLEAR_SETTINGS_CACHE
+	updateClient(clientid);
+#endif
+	releaseSettings(local_settings);
+}
+
 void ServerSettings::updateAll(void)
 {
-	IScopedLock lock(g_mutex);
+	IScopedWriteLock lock(g_mutex);
 
 	for(std::map<int, SSettings*>::iterator it=g_settings_cache.begin();
-		it!=g_settings_cache.end();)
+		it!=g_settings_cache.end();++it)
 	{
-		if(it->second->refcount==0)
-		{
-			std::map<int, SSettings*>::iterator it_curr = it;
-			++it;
-			delete it_curr->second;
-			g_settings_cache.erase(it_curr);
-		}
-		else
-		{
-			it->second->needs_update=true;
-			++it;
-		}
+		it->second->needs_update=true;
+		releaseSettings(it->second);
 	}
-}
-
-void ServerSettings::updateClient(int clientid)
-{
-	IScopedLock lock(g_mutex);
+	g_settings_cache.clear();
+}
+
+void ServerSettings::updateClient(int clientid)
+{
+	IScopedWriteLock lock(g_mutex);
 
 	std::map<int, SSettings*>::iterator it = g_settings_cache.find(clientid);
 	if(it!=g_settings_cache.end())
 	{
-		if (it->second->refcount == 0)
-		{
-			delete it->second;
-			g_settings_cache.erase(it);
-		}
-		else
-		{
-			it->second->needs_update = true;
-		}
-	}
+		it->second->needs_update = true;
+		releaseSettings(it->second);
+		g_settings_cache.erase(it);
+	}
 }
 
 void ServerSettings::update(bool force_update)
@@ -215,78 +200,28 @@ void ServerSettings::update(bool force_update)
 	{
 		force_update = false;
 
-		IScopedLock lock(g_mutex);
-
-		local_settings->needs_update = true;
-
-		assert(local_settings->refcount > 0);
-		--local_settings->refcount;
+		SSettings* old_local_settings = local_settings;
+		old_local_settings->needs_update = true;
 
-		if (local_settings->refcount == 0)
 		{
+			IScopedReadLock lock(g_mutex);
+
 			std::map<int, SSettings*>::iterator iter = g_settings_cache.find(clientid);
 			if (iter != g_settings_cache.end()
-				&& iter->second == local_settings)
+				&& iter->second != old_local_settings)
 			{
-				delete iter->second;
-				g_settings_cache.erase(iter);
-			}
-			else
-			{
-				if (iter != g_settings_cache.end()
-					&& iter->second != local_settings)
-				{
-					delete local_settings;
-					++iter->second->refcount;
-					local_settings = iter->second;
-					continue;
-				}
-				else
-				{
-					delete local_settings;
-				}
+				++iter->second->refcount;
+				local_settings = iter->second;
 			}
 		}
 
-		std::map<int, SSettings*>::iterator iter = g_settings_cache.find(clientid);
-		if (iter != g_settings_cache.end()
-			&& iter->second != local_settings)
+		if (local_settings == old_local_settings)
 		{
-			++iter->second->refcount;
-			local_settings = iter->second;
-			continue;
+			loadSettings();
+			publishSettings(old_local_settings);
 		}
 
-		SSettings* old_local_settings = local_settings;
-
-		lock.relock(NULL);
-
-		local_settings = new SSettings();
-		local_settings->refcount = 1;
-		std::auto_ptr<ISettingsReader> settings_client, settings_default, settings_global;
-		createSettingsReaders(settings_default, settings_client, settings_global);
-		readSettingsDefault(settings_default.get(),
-			settings_global.get() != NULL ? settings_global.get() : settings_default.get());
-		if (settings_client.get() != NULL)
-		{
-			readSettingsClient(settings_client.get());
-		}
-
-		lock.relock(g_mutex);
-
-		iter = g_settings_cache.find(clientid);
-
-		if (iter==g_settings_cache.end()
-			|| iter->second == old_local_settings)
-		{
-			g_settings_cache[clientid] = local_settings;
-		}
-		else
-		{
-			delete local_settings;
-			++iter->second->refcount;
-			local_settings = iter->second;
-		}
+		releaseSettings(old_local_settings);
 	}
 }
 
@@ -388,9 +323,13 @@ void ServerSettings::readSettingsDefault(ISettingsReader* settings_default,
 	settings->internet_full_file_transfer_mode=settings_default->getValue("internet_full_file_transfer_mode", "raw");
 	settings->local_incr_file_transfer_mode=settings_default->getValue("local_incr_file_transfer_mode", "hashed");
 	settings->internet_incr_file_transfer_mode=settings_default->getValue("internet_incr_file_transfer_mode", "blockhash");
+	settings->incr_file_transfer_cdc=(settings_default->getValue("incr_file_transfer_cdc", "false")=="true");
 	settings->local_image_transfer_mode=settings_default->getValue("local_image_transfer_mode", "hashed");
 	settings->internet_image_transfer_mode=settings_default->getValue("internet_image_transfer_mode", "raw");
 	settings->update_stats_cachesize=static_cast<size_t>(settings_global->getValue("update_stats_cachesize", 200*1024));
+	settings->file_index_check_rate=settings_global->getValue("file_index_check_rate", 6000);
+	settings->file_index_check_repair=(settings_global->getValue("file_index_check_repair", "false")=="true");
+	settings->chunk_dedup=(settings_global->getValue("chunk_dedup", "false")=="true");
 	settings->global_soft_fs_quota= settings_global->getValue("global_soft_fs_quota", "95%");
 	settings->client_quota=settings_default->getValue("client_quota", "");
 	settings->end_to_end_file_backup_verification=(settings_default->getValue("end_to_end_file_backup_verification", "false")=="true");
@@ -403,6 +342,8 @@ void ServerSettings::readSettingsDefault(ISettingsReader* settings_default,
 	settings->verify_using_client_hashes=(settings_default->getValue("verify_using_client_hashes", "false")=="true");
 	settings->internet_readd_file_entries=(settings_default->getValue("internet_readd_file_entries", "true")=="true");
 	settings->max_running_jobs_per_client=atoi(settings_default->getValue("max_running_jobs_per_client", "1").c_str());
+	settings->local_file_download_streams=atoi(settings_default->getValue("local_file_download_streams", "1").c_str());
+	settings->internet_file_download_streams=atoi(settings_default->getValue("internet_file_download_streams", "1").c_str());
 	settings->create_linked_user_views=(settings_default->getValue("create_linked_user_views", "false")=="true");
 	settings->background_backups=(settings_default->getValue("background_backups", "true")=="true");
 	settings->local_incr_image_style=settings_default->getValue("local_incr_image_style", incr_image_style_to_full);
@@ -552,6 +493,7 @@ void ServerSettings::readSettingsClient(ISettingsReader* settings_client)
 	readStringClientSetting(settings_client, "local_full_file_transfer_mode", &settings->local_full_file_transfer_mode);
 	readStringClientSetting(settings_client, "internet_full_file_transfer_mode", &settings->internet_full_file_transfer_mode);
 	readStringClientSetting(settings_client, "internet_incr_file_transfer_mode", &settings->internet_incr_file_transfer_mode);
+	readBoolClientSetting(settings_client, "incr_file_transfer_cdc", &settings->incr_file_transfer_cdc);
 	readStringClientSetting(settings_client, "local_image_transfer_mode", &settings->local_image_transfer_mode);
 	readStringClientSetting(settings_client, "internet_image_transfer_mode", &settings->internet_image_transfer_mode);
 
@@ -572,6 +514,8 @@ void ServerSettings::readSettingsClient(ISettingsReader* settings_client)
 	readBoolClientSetting(settings_client, "internet_readd_file_entries", &settings->internet_readd_file_entries);
 	readBoolClientSetting(settings_client, "background_backups", &settings->background_backups);
 	readIntClientSetting(settings_client, "max_running_jobs_per_client", &settings->max_running_jobs_per_client);
+	readIntClientSetting(settings_client, "local_file_download_streams", &settings->local_file_download_streams);
+	readIntClientSetting(settings_client, "internet_file_download_streams", &settings->internet_file_download_streams);
 	readBoolClientSetting(settings_client, "create_linked_user_views", &settings->create_linked_user_views);
 
 	readStringClientSetting(settings_client, "local_incr_image_style", &settings->local_incr_image_style);
@@ -648,32 +592,27 @@ void ServerSettings::readSizeClientSetting(ISettingsReader* settings_client, con
 
 std::vector<STimeSpan> ServerSettings::getCleanupWindow(void)
 {
-	std::string window=getSettings()->cleanup_window;
-	return getWindow(window);
+	return getSettings()->cleanup_window_spans;
 }
 
 std::vector<STimeSpan> ServerSettings::getBackupWindowIncrFile(void)
 {
-	std::string window=getSettings()->backup_window_incr_file;
-	return getWindow(window);
+	return getSettings()->backup_window_incr_file_spans;
 }
 
 std::vector<STimeSpan> ServerSettings::getBackupWindowFullFile(void)
 {
-	std::string window=getSettings()->backup_window_full_file;
-	return getWindow(window);
+	return getSettings()->backup_window_full_file_spans;
 }
 
 std::vector<STimeSpan> ServerSettings::getBackupWindowIncrImage(void)
 {
-	std::string window=getSettings()->backup_window_incr_image;
-	return getWindow(window);
+	return getSettings()->backup_window_incr_image_spans;
 }
 
 std::vector<STimeSpan> ServerSettings::getBackupWindowFullImage(void)
 {
-	std::string window=getSettings()->backup_window_full_image;
-	return getWindow(window);
+	return getSettings()->backup_window_full_image_spans;
 }
 
 std::vector<std::string> ServerSettings::getBackupVolumes(const std::string& all_volumes, const std::string& all_nonusb_volumes)
@@ -785,25 +724,25 @@ std::string ServerSettings::generateRandomBinaryKey(void)
 int ServerSettings::getUpdateFreqImageIncr()
 {
 	updateInternal(NULL);
-	return static_cast<int>(currentTimeSpanValue(local_settings->update_freq_image_incr)+1);
+	return static_cast<int>(currentTimeSpanValue(local_settings->update_freq_image_incr_values)+1);
 }
 
 int ServerSettings::getUpdateFreqFileIncr()
 {
 	updateInternal(NULL);
-	return static_cast<int>(currentTimeSpanValue(local_settings->update_freq_incr)+1);
+	return static_cast<int>(currentTimeSpanValue(local_settings->update_freq_incr_values)+1);
 }
 
 int ServerSettings::getUpdateFreqImageFull()
 {
 	updateInternal(NULL);
-	return static_cast<int>(currentTimeSpanValue(local_settings->update_freq_image_full)+1);
+	return static_cast<int>(currentTimeSpanValue(local_settings->update_freq_image_full_values)+1);
 }
 
 int ServerSettings::getUpdateFreqFileFull()
 {
 	updateInternal(NULL);
-	return static_cast<int>(currentTimeSpanValue(local_settings->update_freq_full)+1);
+	return static_cast<int>(currentTimeSpanValue(local_settings->update_freq_full_values)+1);
 }
 
 std::string ServerSettings::getImageFileFormat()
@@ -947,83 +886,109 @@ std::vector<std::pair<double, STimeSpan > > ServerSettings::parseTimeSpanValue(s
 
 int ServerSettings::getLocalSpeed()
 {
-	return static_cast<int>(round(currentTimeSpanValue(getSettings()->local_speed)));
+	return static_cast<int>(round(currentTimeSpanValue(getSettings()->local_speed_values)));
 }
 
 int ServerSettings::getGlobalLocalSpeed()
 {
-	return static_cast<int>(round(currentTimeSpanValue(getSettings()->global_local_speed)));
+	return static_cast<int>(round(currentTimeSpanValue(getSettings()->global_local_speed_values)));
 }
 
 int ServerSettings::getInternetSpeed()
 {
-	return static_cast<int>(round(currentTimeSpanValue(getSettings()->internet_speed)));
+	return static_cast<int>(round(currentTimeSpanValue(getSettings()->internet_speed_values)));
 }
 
 int ServerSettings::getGlobalInternetSpeed()
 {
-	return static_cast<int>(round(currentTimeSpanValue(getSettings()->global_internet_speed)));
+	return static_cast<int>(round(currentTimeSpanValue(getSettings()->global_internet_speed_values)));
 }
 
-double ServerSettings::currentTimeSpanValue(std::string time_span_value)
+double ServerSettings::currentTimeSpanValue(const std::vector<std::pair<double, STimeSpan > >& time_span_values)
 {
-	std::vector<std::pair<double, STimeSpan > > time_span_values = parseTimeSpanValue(time_span_value);
-
 	double val = 0;
 	double selected_time_span_duration=25.f*7;
 
+	int dow = 0;
+	float hm = 0;
+	bool have_time = false;
+
 	for(size_t i=0;i<time_span_values.size();++i)
 	{
-		std::vector<STimeSpan> single_time_span;
-		single_time_span.push_back(time_span_values[i].second);
-		if(time_span_values[i].second.duration()<selected_time_span_duration
-			&& ( time_span_values[i].second.dayofweek==-1 
-			     || isInTimeSpan(single_time_span) ) )
+		STimeSpan ts = time_span_values[i].second;
+		if(ts.duration()<selected_time_span_duration)
 		{
-			val = time_span_values[i].first;
-			selected_time_span_duration = time_span_values[i].second.duration();
+			if(ts.dayofweek!=-1 && !have_time)
+			{
+				currentDayAndHour(dow, hm);
+				have_time=true;
+			}
+
+			if(ts.dayofweek==-1
+				|| isInTimeSpan(ts, dow, hm) )
+			{
+				val = time_span_values[i].first;
+				selected_time_span_duration = ts.duration();
+			}
 		}
 	}
 
 	return val;
 }
 
-namespace
+void ServerSettings::compileTimeSpans(void)
 {
-	std::string remLeadingZeros(std::string t)
-	{
-		std::string r;
-		bool in=false;
-		for(size_t i=0;i<t.size();++i)
-		{
-			if(!in && t[i]!='0' )
-				in=true;
+	local_settings->backup_window_incr_file_spans = getWindow(local_settings->backup_window_incr_file);
+	local_settings->backup_window_full_file_spans = getWindow(local_settings->backup_window_full_file);
+	local_settings->backup_window_incr_image_spans = getWindow(local_settings->backup_window_incr_image);
+	local_settings->backup_window_full_image_spans = getWindow(local_settings->backup_window_full_image);
+	local_settings->cleanup_window_spans = getWindow(local_settings->cleanup_window);
+	local_settings->update_freq_incr_values = parseTimeSpanValue(local_settings->update_freq_incr);
+	local_settings->update_freq_full_values = parseTimeSpanValue(local_settings->update_freq_full);
+	local_settings->update_freq_image_incr_values = parseTimeSpanValue(local_settings->update_freq_image_incr);
+	local_settings->update_freq_image_full_values = parseTimeSpanValue(local_settings->update_freq_image_full);
+	local_settings->local_speed_values = parseTimeSpanValue(local_settings->local_speed);
+	local_settings->internet_speed_values = parseTimeSpanValue(local_settings->internet_speed);
+	local_settings->global_local_speed_values = parseTimeSpanValue(local_settings->global_local_speed);
+	local_settings->global_internet_speed_values = parseTimeSpanValue(local_settings->global_internet_speed);
+}
 
-			if(in)
-			{
-				r+=t[i];
-			}
-		}
-		return r;
-	}
+void ServerSettings::currentDayAndHour(int& dow, float& hm)
+{
+	time_t tt=time(NULL);
+	tm lt;
+#ifdef _WIN32
+	localtime_s(&lt, &tt);
+#else
+	localtime_r(&tt, &lt);
+#endif
+
+	dow=lt.tm_wday;
+	if(dow==0) dow=7;
+
+	hm=(float)lt.tm_hour+(float)lt.tm_min*(1.f/60.f);
 }
 
-bool ServerSettings::isInTimeSpan(std::vector<STimeSpan> bw)
+bool ServerSettings::isInTimeSpan(const STimeSpan& ts, int dow, float hm)
+{
+	return ts.dayofweek==dow
+		&& ( (ts.start_hour<=ts.stop_hour && hm>=ts.start_hour && hm<=ts.stop_hour)
+			|| (ts.start_hour>ts.stop_hour && (hm>=ts.start_hour || hm<=ts.stop_hour) ) );
+}
+
+bool ServerSettings::isInTimeSpan(const std::vector<STimeSpan>& bw)
 {
 	if(bw.empty()) return true;
-	int dow=atoi(os_strftime("%w").c_str());
-	if(dow==0) dow=7;
 
-	float hm=(float)atoi(remLeadingZeros(os_strftime("%H")).c_str())+(float)atoi(remLeadingZeros(os_strftime("%M")).c_str())*(1.f/60.f);
+	int dow;
+	float hm;
+	currentDayAndHour(dow, hm);
+
 	for(size_t i=0;i<bw.size();++i)
 	{
-		if(bw[i].dayofweek==dow)
+		if(isInTimeSpan(bw[i], dow, hm))
 		{
-			if( (bw[i].start_hour<=bw[i].stop_hour && hm>=bw[i].start_hour && hm<=bw[i].stop_hour)
-				|| (bw[i].start_hour>bw[i].stop_hour && (hm>=bw[i].start_hour || hm<=bw[i].stop_hour) ) )
-			{
-				return true;
-			}
+			return true;
 		}
 	}
 
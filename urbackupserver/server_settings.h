@@ -3,8 +3,9 @@
 
 #include "../Interface/SettingsReader.h"
 #include "../Interface/Database.h"
-#include "../Interface/Mutex.h"
+#include "../Interface/SharedMutex.h"
 #include <memory>
+#include <atomic>
 
 namespace
 {
@@ -20,14 +21,46 @@ namespace
 	const char* incr_image_style_to_last = "to-last";
 }
 
+struct STimeSpan
+{
+	STimeSpan(void): dayofweek(-1), numdays(7) {}
+	STimeSpan(int dayofweek, float start_hour, float stop_hour):dayofweek(dayofweek), start_hour(start_hour), stop_hour(stop_hour), numdays(1) {}
+	STimeSpan(float start_hour, float stop_hour):dayofweek(0), start_hour(start_hour), stop_hour(stop_hour), numdays(1) {}
+
+	int dayofweek;
+	int numdays;
+	float start_hour;
+	float stop_hour;
+
+	float duration()
+	{
+		if(dayofweek==-1)
+		{
+			return 24.f*numdays;
+		}
+		else
+		{
+			if (stop_hour < start_hour)
+			{
+				return (stop_hour + 24 - start_hour)*numdays;
+			}
+			else
+			{
+				return (stop_hour - start_hour)*numdays;
+			}
+		}
+	}
+};
+
 struct SSettings
 {
 	SSettings()
 		: needs_update(false), refcount(0)
 	{}
 
-	volatile bool needs_update;
-	size_t refcount;
+	std::atomic<bool> needs_update;
+	//Includes the reference of the settings cache
+	std::atomic<size_t> refcount;
 
 	int clientid;
 	std::string backupfolder;
@@ -96,9 +129,13 @@ struct SSettings
 	std::string internet_full_file_transfer_mode;
 	std::string local_incr_file_transfer_mode;
 	std::string internet_incr_file_transfer_mode;
+	bool incr_file_transfer_cdc;
 	std::string local_image_transfer_mode;
 	std::string internet_image_transfer_mode;
 	size_t update_stats_cachesize;
+	int file_index_check_rate;
+	bool file_index_check_repair;
+	bool chunk_dedup;
 	std::string global_soft_fs_quota;
 	std::string client_quota;
 	bool end_to_end_file_backup_verification;
@@ -113,6 +150,8 @@ struct SSettings
 	bool internet_readd_file_entries;
 	std::string client_access_key;
 	int max_running_jobs_per_client;
+	int local_file_download_streams;
+	int internet_file_download_streams;
 	bool background_backups;
 	bool create_linked_user_views;
 	std::string local_incr_image_style;
@@ -134,6 +173,21 @@ struct SSettings
 	int64 internet_image_dataplan_limit;
 	int alert_script;
 	std::string alert_params;
+
+	//Parsed once per settings load
+	std::vector<STimeSpan> backup_window_incr_file_spans;
+	std::vector<STimeSpan> backup_window_full_file_spans;
+	std::vector<STimeSpan> backup_window_incr_image_spans;
+	std::vector<STimeSpan> backup_window_full_image_spans;
+	std::vector<STimeSpan> cleanup_window_spans;
+	std::vector<std::pair<double, STimeSpan> > update_freq_incr_values;
+	std::vector<std::pair<double, STimeSpan> > update_freq_full_values;
+	std::vector<std::pair<double, STimeSpan> > update_freq_image_incr_values;
+	std::vector<std::pair<double, STimeSpan> > update_freq_image_full_values;
+	std::vector<std::pair<double, STimeSpan> > local_speed_values;
+	std::vector<std::pair<double, STimeSpan> > internet_speed_values;
+	std::vector<std::pair<double, STimeSpan> > global_local_speed_values;
+	std::vector<std::pair<double, STimeSpan> > global_internet_speed_values;
 };
 
 struct SLDAPSettings
@@ -156,37 +210,6 @@ struct SLDAPSettings
 	std::map<std::string, std::string> class_rights_map;
 };
 
-struct STimeSpan
-{
-	STimeSpan(void): dayofweek(-1), numdays(7) {}
-	STimeSpan(int dayofweek, float start_hour, float stop_hour):dayofweek(dayofweek), start_hour(start_hour), stop_hour(stop_hour), numdays(1) {}
-	STimeSpan(float start_hour, float stop_hour):dayofweek(0), start_hour(start_hour), stop_hour(stop_hour), numdays(1) {}
-
-	int dayofweek;
-	int numdays;
-	float start_hour;
-	float stop_hour;
-
-	float duration()
-	{
-		if(dayofweek==-1)
-		{
-			return 24.f*numdays;
-		}
-		else
-		{
-			if (stop_hour < start_hour)
-			{
-				return (stop_hour + 24 - start_hour)*numdays;
-			}
-			else
-			{
-				return (stop_hour - start_hour)*numdays;
-			}
-		}
-	}
-};
-
 class ServerSettings
 {
 public:
@@ -225,7 +248,7 @@ public:
 	int getInternetSpeed();
 	int getGlobalInternetSpeed();
 
-	static bool isInTimeSpan(std::vector<STimeSpan> bw);
+	static bool isInTimeSpan(const std::vector<STimeSpan>& bw);
 
 	SLDAPSettings getLDAPSettings();
 
@@ -246,7 +269,13 @@ private:
 
 	std::vector<std::pair<double, STimeSpan > > parseTimeSpanValue(std::string time_span_value);
 
-	double currentTimeSpanValue(std::string time_span_value);
+	double currentTimeSpanValue(const std::vector<std::pair<double, STimeSpan > >& time_span_values);
+
+	void compileTimeSpans(void);
+
+	static void currentDayAndHour(int& dow, float& hm);
+
+	static bool isInTimeSpan(const STimeSpan& ts, int dow, float hm);
 
 
 	float parseTimeDet(std::string t);
@@ -260,6 +289,9 @@ private:
 	void readInt64ClientSetting(ISettingsReader* settings_client, const std::string &name, int64 *output);
 	void readSizeClientSetting(ISettingsReader* settings_client, const std::string &name, size_t *output);
 	void updateInternal(bool* was_updated);
+	void loadSettings();
+	void publishSettings(SSettings* replaces);
+	static void releaseSettings(SSettings* settings);
 	std::map<std::string, std::string> parseLdapMap(const std::string& data);
 
 	SSettings* local_settings;
@@ -269,7 +301,7 @@ private:
 	int clientid;
 
 	static std::map<int, SSettings*> g_settings_cache;
-	static IMutex *g_mutex;
+	static ISharedMutex *g_mutex;
 };
 
 
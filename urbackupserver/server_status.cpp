@@ -27,7 +27,12 @@
 #include <assert.h>
 
 IMutex *ServerStatus::mutex=NULL;
-std::map<std::string, SStatus> ServerStatus::status;
+std::map<std::string, SClientStatus*> ServerStatus::status;
+size_t ServerStatus::status_map_version = 0;
+ISharedMutex *ServerStatus::status_mutex = NULL;
+std::shared_ptr<const SStatusSnapshot> ServerStatus::curr_snapshot;
+size_t ServerStatus::curr_snapshot_map_version = 0;
+IMutex *ServerStatus::snapshot_mutex = NULL;
 int64 ServerStatus::last_status_update;
 size_t ServerStatus::curr_process_id = 0;
 
@@ -37,15 +42,131 @@ bool ServerStatus::server_nospc_fatal=false;
 
 const unsigned int inactive_time_const=30*60*1000;
 
+struct SClientStatus
+{
+	SClientStatus(const std::string& clientname)
+		: mutex(Server->createMutex()), version(1), snapshot_version(0)
+	{
+		std::shared_ptr<SStatus> initial_snapshot(new SStatus);
+		initial_snapshot->client = clientname;
+		snapshot = initial_snapshot;
+	}
+
+	~SClientStatus()
+	{
+		Server->destroy(mutex);
+	}
+
+	IMutex* mutex;
+	SStatus status;
+	size_t version;
+	std::shared_ptr<const SStatus> snapshot;
+	size_t snapshot_version;
+};
+
+/**
+* Looks up the status of one client and locks it. Holds a read lock on the
+* client map for its lifetime, so the entry cannot be removed while in use.
+* Backup threads of different clients therefore do not contend with each other.
+*/
+class ServerStatus::ScopedClientStatus
+{
+public:
+	ScopedClientStatus(const std::string& clientname, bool create)
+		: read_lock(status_mutex), client_lock(NULL), client_status(NULL)
+	{
+		std::map<std::string, SClientStatus*>::iterator it = status.find(clientname);
+		if (it == status.end())
+		{
+			if (!create)
+			{
+				return;
+			}
+
+			read_lock.relock(NULL);
+			{
+				IScopedWriteLock write_lock(status_mutex);
+				SClientStatus*& new_status = status[clientname];
+				if (new_status == NULL)
+				{
+					new_status = new SClientStatus(clientname);
+					++status_map_version;
+				}
+			}
+			read_lock.relock(status_mutex);
+
+			it = status.find(clientname);
+			if (it == status.end())
+			{
+				return;
+			}
+		}
+
+		client_status = it->second;
+		client_lock.relock(client_status->mutex);
+	}
+
+	SStatus* get()
+	{
+		if (client_status == NULL)
+		{
+			return NULL;
+		}
+		return &client_status->status;
+	}
+
+	void changed()
+	{
+		++client_status->version;
+	}
+
+private:
+	IScopedReadLock read_lock;
+	IScopedLock client_lock;
+	SClientStatus* client_status;
+};
+
+const SStatus* SStatusSnapshot::getClient(const std::string& clientname) const
+{
+	std::map<std::string, size_t>::const_iterator it = client_names.find(clientname);
+	if (it == client_names.end())
+	{
+		return NULL;
+	}
+	return clients[it->second].get();
+}
+
+const SStatus* SStatusSnapshot::getClient(int clientid) const
+{
+	std::map<int, size_t>::const_iterator it = client_ids.find(clientid);
+	if (it == client_ids.end())
+	{
+		return NULL;
+	}
+	return clients[it->second].get();
+}
+
 void ServerStatus::init_mutex(void)
 {
 	mutex=Server->createMutex();
+	status_mutex=Server->createSharedMutex();
+	snapshot_mutex=Server->createMutex();
 	last_status_update=Server->getTimeMS();
 }
 
 void ServerStatus::destroy_mutex(void)
 {
+	for (std::map<std::string, SClientStatus*>::iterator it = status.begin();
+		it != status.end(); ++it)
+	{
+		delete it->second;
+	}
+	status.clear();
+	curr_snapshot.reset();
+
 	Server->destroy(mutex);
+	Server->destroy(status_mutex);
+	Server->destroy(snapshot_mutex);
 }
 
 void ServerStatus::updateActive(void)
@@ -58,19 +179,27 @@ void ServerStatus::setOnline(const std::string &clientname, bool bonline)
 {
 	assert(!clientname.empty());
 
-	IScopedLock lock(mutex);
-	SStatus *s=&status[clientname];
-	if(bonline)
 	{
-		*s=SStatus();
+		ScopedClientStatus client_status(clientname, true);
+		SStatus *s = client_status.get();
+		if (s == NULL)
+		{
+			return;
+		}
+		if (bonline)
+		{
+			*s = SStatus();
+		}
+		s->online = bonline;
+		s->client = clientname;
+		s->has_status = true;
+		s->r_online = bonline;
+		client_status.changed();
 	}
-	s->online=bonline;
-	s->client=clientname;
-	s->has_status=true;
-	s->r_online=bonline;
+
 	if(bonline)
 	{
-		last_status_update=Server->getTimeMS();
+		updateActive();
 	}
 }
 
@@ -78,12 +207,20 @@ void ServerStatus::setROnline(const std::string &clientname, bool bonline)
 {
 	assert(!clientname.empty());
 
-	IScopedLock lock(mutex);
-	SStatus *s=&status[clientname];
-	s->r_online=bonline;
+	{
+		ScopedClientStatus client_status(clientname, true);
+		SStatus *s = client_status.get();
+		if (s == NULL)
+		{
+			return;
+		}
+		s->r_online = bonline;
+		client_status.changed();
+	}
+
 	if(bonline)
 	{
-		last_status_update=Server->getTimeMS();
+		updateActive();
 	}
 }
 
@@ -91,43 +228,56 @@ void ServerStatus::setIP(const std::string &clientname, unsigned int ip)
 {
 	assert(!clientname.empty());
 
-	IScopedLock lock(mutex);
-	SStatus *s=&status[clientname];
-	s->ip_addr=ip;
+	ScopedClientStatus client_status(clientname, true);
+	SStatus *s = client_status.get();
+	if (s != NULL)
+	{
+		s->ip_addr = ip;
+		client_status.changed();
+	}
 }
 
 void ServerStatus::setStatusError(const std::string &clientname, SStatusError se)
 {
 	assert(!clientname.empty());
 
-	IScopedLock lock(mutex);
-	SStatus *s=&status[clientname];
-	s->status_error=se;
+	ScopedClientStatus client_status(clientname, true);
+	SStatus *s = client_status.get();
+	if (s != NULL)
+	{
+		s->status_error = se;
+		client_status.changed();
+	}
 }
 
 void ServerStatus::setCommPipe(const std::string &clientname, IPipe *p)
 {
 	assert(!clientname.empty());
 
-	IScopedLock lock(mutex);
-	SStatus *s=&status[clientname];
-	s->comm_pipe=p;
+	ScopedClientStatus client_status(clientname, true);
+	SStatus *s = client_status.get();
+	if (s != NULL)
+	{
+		s->comm_pipe = p;
+		client_status.changed();
+	}
 }
 
 void ServerStatus::stopProcess(const std::string &clientname, size_t id, bool b)
 {
-	IScopedLock lock(mutex);
-	SProcess* proc = getProcessInt(clientname, id);
+	ScopedClientStatus client_status(clientname, false);
+	SProcess* proc = getProcessInt(client_status.get(), id);
 	if(proc!=NULL)
 	{
 		proc->stop=true;
+		client_status.changed();
 	}
 }
 
 bool ServerStatus::isProcessStopped(const std::string &clientname, size_t id)
 {
-	IScopedLock lock(mutex);
-	SProcess* proc = getProcessInt(clientname, id);
+	ScopedClientStatus client_status(clientname, false);
+	SProcess* proc = getProcessInt(client_status.get(), id);
 	if(proc!=NULL)
 	{
 		return proc->stop;
@@ -137,21 +287,80 @@ bool ServerStatus::isProcessStopped(const std::string &clientname, size_t id)
 
 std::vector<SStatus> ServerStatus::getStatus(void)
 {
-	IScopedLock lock(mutex);
+	std::shared_ptr<const SStatusSnapshot> snapshot = getStatusSnapshot();
 	std::vector<SStatus> ret;
-	for(std::map<std::string, SStatus>::iterator it=status.begin();it!=status.end();++it)
+	ret.reserve(snapshot->size());
+	for(size_t i=0;i<snapshot->size();++i)
 	{
-		ret.push_back(it->second);
+		ret.push_back((*snapshot)[i]);
 	}
 	return ret;
 }
 
+std::shared_ptr<const SStatusSnapshot> ServerStatus::getStatusSnapshot(void)
+{
+	IScopedLock snapshot_lock(snapshot_mutex);
+	IScopedReadLock lock(status_mutex);
+
+	bool changed = curr_snapshot.get() == NULL
+		|| curr_snapshot_map_version != status_map_version;
+
+	std::vector<std::shared_ptr<const SStatus> > clients;
+	clients.reserve(status.size());
+
+	for (std::map<std::string, SClientStatus*>::iterator it = status.begin();
+		it != status.end(); ++it)
+	{
+		SClientStatus* client_status = it->second;
+		//Backup threads update their progress continuously. Waiting for each
+		//of them in turn starves the web interface, so reuse the previous
+		//snapshot of a client if its status is being updated right now.
+		if (client_status->mutex->TryLock())
+		{
+			if (client_status->snapshot_version != client_status->version)
+			{
+				client_status->snapshot.reset(new SStatus(client_status->status));
+				client_status->snapshot_version = client_status->version;
+				changed = true;
+			}
+			client_status->mutex->Unlock();
+		}
+		clients.push_back(client_status->snapshot);
+	}
+
+	if (!changed)
+	{
+		return curr_snapshot;
+	}
+
+	std::shared_ptr<SStatusSnapshot> new_snapshot(new SStatusSnapshot);
+	new_snapshot->clients.swap(clients);
+
+	size_t idx = 0;
+	for (std::map<std::string, SClientStatus*>::iterator it = status.begin();
+		it != status.end(); ++it, ++idx)
+	{
+		new_snapshot->client_names[it->first] = idx;
+
+		int clientid = new_snapshot->clients[idx]->clientid;
+		if (clientid != 0)
+		{
+			new_snapshot->client_ids[clientid] = idx;
+		}
+	}
+
+	curr_snapshot = new_snapshot;
+	curr_snapshot_map_version = status_map_version;
+
+	return curr_snapshot;
+}
+
 SStatus ServerStatus::getStatus(const std::string &clientname)
 {
-	IScopedLock lock(mutex);
-	std::map<std::string, SStatus>::iterator iter=status.find(clientname);
-	if(iter!=status.end())
-		return iter->second;
+	ScopedClientStatus client_status(clientname, false);
+	SStatus *s = client_status.get();
+	if (s != NULL)
+		return *s;
 	else
 		return SStatus();
 }
@@ -203,27 +412,35 @@ void ServerStatus::setClientVersionString(const std::string &clientname, const s
 {
 	assert(!clientname.empty());
 
-	IScopedLock lock(mutex);
-	SStatus *s=&status[clientname];
-	s->client_version_string=client_version_string;
+	ScopedClientStatus client_status(clientname, true);
+	SStatus *s = client_status.get();
+	if (s != NULL)
+	{
+		s->client_version_string = client_version_string;
+		client_status.changed();
+	}
 }
 
 void ServerStatus::setOSVersionString(const std::string &clientname, const std::string& os_version_string)
 {
 	assert(!clientname.empty());
 
-	IScopedLock lock(mutex);
-	SStatus *s=&status[clientname];
-	s->os_version_string=os_version_string;
+	ScopedClientStatus client_status(clientname, true);
+	SStatus *s = client_status.get();
+	if (s != NULL)
+	{
+		s->os_version_string = os_version_string;
+		client_status.changed();
+	}
 }
 
 bool ServerStatus::sendToCommPipe( const std::string &clientname, const std::string& msg )
 {
 	assert(!clientname.empty());
 
-	IScopedLock lock(mutex);
-	SStatus *s=&status[clientname];
-	if(s->comm_pipe==NULL)
+	ScopedClientStatus client_status(clientname, false);
+	SStatus *s = client_status.get();
+	if(s==NULL || s->comm_pipe==NULL)
 		return false;
 
 	s->comm_pipe->Write(msg);
@@ -234,8 +451,18 @@ bool ServerStatus::sendToCommPipe( const std::string &clientname, const std::str
 size_t ServerStatus::startProcess( const std::string &clientname, SStatusAction action,
 	const std::string& details, logid_t logid, bool can_stop, int clientid)
 {
-	IScopedLock lock(mutex);
-	SStatus *s=&status[clientname];
+	size_t process_id;
+	{
+		IScopedLock lock(mutex);
+		process_id = ++curr_process_id;
+	}
+
+	ScopedClientStatus client_status(clientname, true);
+	SStatus *s = client_status.get();
+	if (s == NULL)
+	{
+		return process_id;
+	}
 
 	if (s->client.empty())
 	{
@@ -247,24 +474,30 @@ size_t ServerStatus::startProcess( const std::string &clientname, SStatusAction
 		s->clientid = clientid;
 	}
 
-	SProcess new_proc(++curr_process_id, action, details);
+	SProcess new_proc(process_id, action, details);
 	new_proc.logid = logid;
 	new_proc.can_stop = can_stop;
 	s->processes.push_back(new_proc);
+	client_status.changed();
 
 	return new_proc.id;
 }
 
 bool ServerStatus::stopProcess( const std::string &clientname, size_t id )
 {
-	IScopedLock lock(mutex);
-	SStatus *s=&status[clientname];
+	ScopedClientStatus client_status(clientname, false);
+	SStatus *s = client_status.get();
+	if (s == NULL)
+	{
+		return false;
+	}
 
 	std::vector<SProcess>::iterator it = std::find(s->processes.begin(), s->processes.end(), SProcess(id, sa_none, std::string()));
 
 	if(it!=s->processes.end())
 	{
 		s->processes.erase(it);
+		client_status.changed();
 		return true;
 	}
 	else
@@ -275,14 +508,13 @@ bool ServerStatus::stopProcess( const std::string &clientname, size_t id )
 
 bool ServerStatus::changeProcess(const std::string & clientname, size_t id, SStatusAction action)
 {
-	IScopedLock lock(mutex);
-	SStatus *s = &status[clientname];
+	ScopedClientStatus client_status(clientname, false);
+	SProcess* proc = getProcessInt(client_status.get(), id);
 
-	std::vector<SProcess>::iterator it = std::find(s->processes.begin(), s->processes.end(), SProcess(id, sa_none, std::string()));
-
-	if (it != s->processes.end())
+	if (proc != NULL)
 	{
-		it->action = action;
+		proc->action = action;
+		client_status.changed();
 		return true;
 	}
 	else
@@ -291,9 +523,12 @@ bool ServerStatus::changeProcess(const std::string & clientname, size_t id, SSta
 	}
 }
 
-SProcess* ServerStatus::getProcessInt( const std::string &clientname, size_t id )
+SProcess* ServerStatus::getProcessInt( SStatus* s, size_t id )
 {
-	SStatus *s=&status[clientname];
+	if (s == NULL)
+	{
+		return NULL;
+	}
 
 	std::vector<SProcess>::iterator it = std::find(s->processes.begin(), s->processes.end(), SProcess(id, sa_none, std::string()));
 
@@ -309,54 +544,58 @@ SProcess* ServerStatus::getProcessInt( const std::string &clientname, size_t id
 
 void ServerStatus::setProcessQueuesize( const std::string &clientname, size_t id, unsigned int prepare_hashqueuesize, unsigned int hashqueuesize )
 {
-	IScopedLock lock(mutex);
-	SProcess* proc = getProcessInt(clientname, id);
+	ScopedClientStatus client_status(clientname, false);
+	SProcess* proc = getProcessInt(client_status.get(), id);
 
 	if(proc!=NULL)
 	{
 		proc->prepare_hashqueuesize = prepare_hashqueuesize;
 		proc->hashqueuesize = hashqueuesize;
+		client_status.changed();
 	}
 }
 
 void ServerStatus::setProcessStarttime( const std::string &clientname, size_t id, int64 starttime )
 {
-	IScopedLock lock(mutex);
-	SProcess* proc = getProcessInt(clientname, id);
+	ScopedClientStatus client_status(clientname, false);
+	SProcess* proc = getProcessInt(client_status.get(), id);
 
 	if(proc!=NULL)
 	{
 		proc->starttime = starttime;
+		client_status.changed();
 	}
 }
 
 void ServerStatus::setProcessEta( const std::string &clientname, size_t id, int64 eta_ms, int64 eta_set_time )
 {
-	IScopedLock lock(mutex);
-	SProcess* proc = getProcessInt(clientname, id);
+	ScopedClientStatus client_status(clientname, false);
+	SProcess* proc = getProcessInt(client_status.get(), id);
 
 	if(proc!=NULL)
 	{
 		proc->eta_ms = eta_ms;
 		proc->eta_set_time = eta_set_time;
+		client_status.changed();
 	}
 }
 
 void ServerStatus::setProcessEta( const std::string &clientname, size_t id, int64 eta_ms )
 {
-	IScopedLock lock(mutex);
-	SProcess* proc = getProcessInt(clientname, id);
+	ScopedClientStatus client_status(clientname, false);
+	SProcess* proc = getProcessInt(client_status.get(), id);
 
 	if(proc!=NULL)
 	{
 		proc->eta_ms = eta_ms;
+		client_status.changed();
 	}
 }
 
 void ServerStatus::setProcessSpeed(const std::string &clientname, size_t id, double speed_bpms)
 {
-	IScopedLock lock(mutex);
-	SProcess* proc = getProcessInt(clientname, id);
+	ScopedClientStatus client_status(clientname, false);
+	SProcess* proc = getProcessInt(client_status.get(), id);
 
 	if (proc != NULL)
 	{
@@ -366,99 +605,126 @@ void ServerStatus::setProcessSpeed(const std::string &clientname, size_t id, dou
 			proc->past_speed_bpms.pop_front();
 		}
 		proc->speed_bpms = speed_bpms;
+		client_status.changed();
 	}
 }
 
-bool ServerStatus::removeStatus( const std::string &clientname )
+void ServerStatus::setProcessQueueState(const std::string &clientname, size_t id,
+	const QueueDepthEstimator::SState& file_queue, const QueueDepthEstimator::SState& chunk_queue)
 {
-	IScopedLock lock(mutex);
-
-	std::map<std::string, SStatus>::iterator it=status.find(clientname);
+	ScopedClientStatus client_status(clientname, false);
+	SProcess* proc = getProcessInt(client_status.get(), id);
 
-	if(it!=status.end())
+	if (proc != NULL)
 	{
-		status.erase(it);
-		return true;
+		proc->has_queue_state = true;
+		proc->file_queue = file_queue;
+		proc->chunk_queue = chunk_queue;
+		client_status.changed();
 	}
-	else
+}
+
+bool ServerStatus::removeStatus( const std::string &clientname )
+{
+	SClientStatus* removed = NULL;
 	{
-		return false;
+		IScopedWriteLock lock(status_mutex);
+
+		std::map<std::string, SClientStatus*>::iterator it=status.find(clientname);
+
+		if(it==status.end())
+		{
+			return false;
+		}
+
+		removed = it->second;
+		status.erase(it);
+		++status_map_version;
 	}
+
+	delete removed;
+	return true;
 }
 
 void ServerStatus::setProcessPcDone( const std::string &clientname, size_t id, int pcdone )
 {
-	IScopedLock lock(mutex);
-	SProcess* proc = getProcessInt(clientname, id);
+	ScopedClientStatus client_status(clientname, false);
+	SProcess* proc = getProcessInt(client_status.get(), id);
 
 	if(proc!=NULL)
 	{
 		proc->pcdone = pcdone;
+		client_status.changed();
 	}
 }
 
 void ServerStatus::setProcessTotalBytes(const std::string & clientname, size_t id, int64 total_bytes)
 {
-	IScopedLock lock(mutex);
-	SProcess* proc = getProcessInt(clientname, id);
+	ScopedClientStatus client_status(clientname, false);
+	SProcess* proc = getProcessInt(client_status.get(), id);
 
 	if (proc != NULL)
 	{
 		proc->total_bytes = total_bytes;
+		client_status.changed();
 	}
 }
 
 void ServerStatus::setProcessDoneBytes(const std::string & clientname, size_t id, int64 done_bytes)
 {
-	IScopedLock lock(mutex);
-	SProcess* proc = getProcessInt(clientname, id);
+	ScopedClientStatus client_status(clientname, false);
+	SProcess* proc = getProcessInt(client_status.get(), id);
 
 	if (proc != NULL)
 	{
 		proc->done_bytes = done_bytes;
+		client_status.changed();
 	}
 }
 
 void ServerStatus::setProcessDoneBytes(const std::string & clientname, size_t id, int64 done_bytes, int64 total_bytes)
 {
-	IScopedLock lock(mutex);
-	SProcess* proc = getProcessInt(clientname, id);
+	ScopedClientStatus client_status(clientname, false);
+	SProcess* proc = getProcessInt(client_status.get(), id);
 
 	if (proc != NULL)
 	{
 		proc->done_bytes = done_bytes;
 		proc->total_bytes = total_bytes;
+		client_status.changed();
 	}
 }
 
 void ServerStatus::setProcessDetails(const std::string & clientname, size_t id,
 	std::string details, int detail_pc)
 {
-	IScopedLock lock(mutex);
-	SProcess* proc = getProcessInt(clientname, id);
+	ScopedClientStatus client_status(clientname, false);
+	SProcess* proc = getProcessInt(client_status.get(), id);
 
 	if (proc != NULL)
 	{
 		proc->details = details;
 		proc->detail_pc = detail_pc;
+		client_status.changed();
 	}
 }
 
 void ServerStatus::setProcessPaused(const std::string & clientname, size_t id, bool b)
 {
-	IScopedLock lock(mutex);
-	SProcess* proc = getProcessInt(clientname, id);
+	ScopedClientStatus client_status(clientname, false);
+	SProcess* proc = getProcessInt(client_status.get(), id);
 
 	if (proc != NULL)
 	{
 		proc->paused = b;
+		client_status.changed();
 	}
 }
 
 SProcess ServerStatus::getProcess( const std::string &clientname, size_t id )
 {
-	IScopedLock lock(mutex);
-	SProcess* proc = getProcessInt(clientname, id);
+	ScopedClientStatus client_status(clientname, false);
+	SProcess* proc = getProcessInt(client_status.get(), id);
 	if(proc!=NULL)
 	{
 		return *proc;
@@ -471,12 +737,13 @@ SProcess ServerStatus::getProcess( const std::string &clientname, size_t id )
 
 void ServerStatus::setProcessEtaSetTime( const std::string &clientname, size_t id, int64 eta_set_time )
 {
-	IScopedLock lock(mutex);
-	SProcess* proc = getProcessInt(clientname, id);
+	ScopedClientStatus client_status(clientname, false);
+	SProcess* proc = getProcessInt(client_status.get(), id);
 
 	if(proc!=NULL)
 	{
 		proc->eta_set_time = eta_set_time;
+		client_status.changed();
 	}
 }
 
@@ -484,35 +751,51 @@ void ServerStatus::setClientId( const std::string &clientname, int clientid)
 {
 	assert(!clientname.empty());
 
-	IScopedLock lock(mutex);
-	SStatus *s=&status[clientname];
-	s->clientid = clientid;
+	ScopedClientStatus client_status(clientname, true);
+	SStatus *s = client_status.get();
+	if (s != NULL)
+	{
+		s->clientid = clientid;
+		client_status.changed();
+	}
 }
 
 void ServerStatus::addRunningJob( const std::string &clientname )
 {
 	assert(!clientname.empty());
 
-	IScopedLock lock(mutex);
-	SStatus *s=&status[clientname];
-	s->running_jobs+=1;
+	ScopedClientStatus client_status(clientname, true);
+	SStatus *s = client_status.get();
+	if (s != NULL)
+	{
+		s->running_jobs += 1;
+		client_status.changed();
+	}
 }
 
 void ServerStatus::subRunningJob( const std::string &clientname )
 {
 	assert(!clientname.empty());
 
-	IScopedLock lock(mutex);
-	SStatus *s=&status[clientname];
-	s->running_jobs-=1;
+	ScopedClientStatus client_status(clientname, true);
+	SStatus *s = client_status.get();
+	if (s != NULL)
+	{
+		s->running_jobs -= 1;
+		client_status.changed();
+	}
 }
 
 int ServerStatus::numRunningJobs( const std::string &clientname )
 {
 	assert(!clientname.empty());
 
-	IScopedLock lock(mutex);
-	SStatus *s=&status[clientname];
+	ScopedClientStatus client_status(clientname, false);
+	SStatus *s = client_status.get();
+	if (s == NULL)
+	{
+		return 0;
+	}
 	return s->running_jobs;
 }
 
@@ -520,44 +803,48 @@ void ServerStatus::setRestore( const std::string &clientname, ERestore restore )
 {
 	assert(!clientname.empty());
 
-	IScopedLock lock(mutex);
-	SStatus *s=&status[clientname];
-	s->restore = restore;
+	ScopedClientStatus client_status(clientname, true);
+	SStatus *s = client_status.get();
+	if (s != NULL)
+	{
+		s->restore = restore;
+		client_status.changed();
+	}
 }
 
 bool ServerStatus::canRestore( const std::string &clientname, bool& server_confirms)
 {
-	IScopedLock lock(mutex);
-	std::map<std::string, SStatus>::iterator it=status.find(clientname);
-	if(it==status.end())
+	ScopedClientStatus client_status(clientname, false);
+	SStatus *s = client_status.get();
+	if(s==NULL)
 	{
 		return false;
 	}
-	SStatus* s=&it->second;
 	server_confirms = s->restore==ERestore_server_confirms;
 	return s->online && s->r_online && s->restore!=ERestore_disabled;
 }
 
 void ServerStatus::updateLastseen(const std::string & clientname)
 {
-	IScopedLock lock(mutex);
-	std::map<std::string, SStatus>::iterator it = status.find(clientname);
-	if (it == status.end())
+	ScopedClientStatus client_status(clientname, false);
+	SStatus *s = client_status.get();
+	if (s == NULL)
 	{
 		return;
 	}
-	it->second.lastseen = Server->getTimeSeconds();
+	s->lastseen = Server->getTimeSeconds();
+	client_status.changed();
 }
 
 int64 ServerStatus::getLastseen(const std::string & clientname)
 {
-	IScopedLock lock(mutex);
-	std::map<std::string, SStatus>::iterator it = status.find(clientname);
-	if (it == status.end())
+	ScopedClientStatus client_status(clientname, false);
+	SStatus *s = client_status.get();
+	if (s == NULL)
 	{
 		return 0;
 	}
-	return it->second.lastseen;
+	return s->lastseen;
 }
 
 ACTION_IMPL(server_status)
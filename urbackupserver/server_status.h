@@ -4,13 +4,16 @@
 #include <map>
 #include <vector>
 #include <deque>
+#include <memory>
 
 #include "../Interface/Mutex.h"
+#include "../Interface/SharedMutex.h"
 #include "../Interface/Thread.h"
 #include "../Interface/Server.h"
 #include "../Interface/ThreadPool.h"
 
 #include "server_log.h"
+#include "../urbackupcommon/fileclient/QueueDepthEstimator.h"
 
 enum SStatusAction
 {
@@ -58,7 +61,8 @@ struct SProcess
 		 hashqueuesize(0), starttime(0), pcdone(-1), eta_ms(0),
 		 eta_set_time(0), stop(false), details(details),
 		speed_bpms(0), can_stop(false), total_bytes(-1),
-		done_bytes(0), detail_pc(-1), paused(false)
+		done_bytes(0), detail_pc(-1), paused(false),
+		has_queue_state(false), file_queue(), chunk_queue()
 	{
 
 	}
@@ -81,6 +85,9 @@ struct SProcess
 	int64 total_bytes;
 	int64 done_bytes;
 	bool paused;
+	bool has_queue_state;
+	QueueDepthEstimator::SState file_queue;
+	QueueDepthEstimator::SState chunk_queue;
 
 	bool operator==(const SProcess& other) const
 	{
@@ -111,6 +118,30 @@ struct SStatus
 	int64 lastseen;
 };
 
+/**
+* Immutable view of the status of all clients. Per-client entries are shared
+* between snapshots as long as the client status did not change.
+*/
+class SStatusSnapshot
+{
+public:
+	size_t size() const { return clients.size(); }
+	bool empty() const { return clients.empty(); }
+	const SStatus& operator[](size_t idx) const { return *clients[idx]; }
+
+	const SStatus* getClient(const std::string& clientname) const;
+	const SStatus* getClient(int clientid) const;
+
+private:
+	friend class ServerStatus;
+
+	std::vector<std::shared_ptr<const SStatus> > clients;
+	std::map<std::string, size_t> client_names;
+	std::map<int, size_t> client_ids;
+};
+
+struct SClientStatus;
+
 class ServerStatus
 {
 public:
@@ -136,6 +167,7 @@ public:
 	static void destroy_mutex(void);
 
 	static std::vector<SStatus> getStatus(void);
+	static std::shared_ptr<const SStatusSnapshot> getStatusSnapshot(void);
 	static SStatus getStatus(const std::string &clientname);
 
 	static bool isActive(void);
@@ -168,6 +200,9 @@ public:
 	static void setProcessSpeed(const std::string &clientname, size_t id,
 		double speed_bpms);
 
+	static void setProcessQueueState(const std::string &clientname, size_t id,
+		const QueueDepthEstimator::SState& file_queue, const QueueDepthEstimator::SState& chunk_queue);
+
 	static void setProcessEta(const std::string &clientname, size_t id,
 		int64 eta_ms);
 
@@ -201,9 +236,16 @@ public:
 	static SProcess getProcess(const std::string &clientname, size_t id);
 
 private:
-	static SProcess* getProcessInt(const std::string &clientname, size_t id);
+	class ScopedClientStatus;
+
+	static SProcess* getProcessInt(SStatus* s, size_t id);
 
-	static std::map<std::string, SStatus> status;
+	static std::map<std::string, SClientStatus*> status;
+	static size_t status_map_version;
+	static ISharedMutex *status_mutex;
+	static std::shared_ptr<const SStatusSnapshot> curr_snapshot;
+	static size_t curr_snapshot_map_version;
+	static IMutex *snapshot_mutex;
 	static IMutex *mutex;
 	static int64 last_status_update;
 	static size_t curr_process_id;
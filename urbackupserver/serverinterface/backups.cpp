@@ -39,6 +39,7 @@
 #include "../server.h"
 #include "../server_cleanup.h"
 #include "../dao/ServerCleanupDao.h"
+#include "../ChunkStore.h"
 
 extern ICryptoFactory *crypto_fak;
 extern IFileServ* fileserv;
@@ -73,7 +74,7 @@ namespace
 		Server->setContentType(tid, "application/octet-stream");
 		Server->addHeader(tid, "Cache-Control: no-cache");
 		Server->addHeader(tid, "Content-Disposition: attachment; filename=\""+(ExtractFileName(filename))+"\"");
-		IFile *in=Server->openFile(os_file_prefix(filename), MODE_READ);
+		IFile *in=ChunkStore::openFile(os_file_prefix(filename), MODE_READ);
 		if(in!=NULL)
 		{
 			helper.releaseAll();
@@ -646,7 +647,8 @@ namespace backupaccess
 	}
 
     bool get_files_with_tokens(IDatabase* db, int* backupid, int t_clientid, std::string clientname, std::string* fileaccesstokens,
-                               const std::string& u_path, int backupid_offset, JSON::Object& ret)
+                               const std::string& u_path, int backupid_offset, JSON::Object& ret,
+                               JSON::StreamWriter* files_writer)
 	{
 		Helper helper(Server->getThreadID(), NULL, NULL);
 
@@ -765,7 +767,16 @@ namespace backupaccess
 					std::vector<FileMetadata> tmetadata=getMetadata(full_metadata_path, tfiles, path.empty());
 
 					JSON::Array files;
-					for(size_t i=0;i<tfiles.size();++i)
+					if(files_writer!=NULL)
+					{
+						//Access checks passed. The result object is only started now.
+						if(files_writer->depth()==0)
+						{
+							files_writer->beginObject();
+						}
+						files_writer->beginArray("files");
+					}
+					for(size_t i=0;i<tfiles.size() && (files_writer==NULL || files_writer->good());++i)
 					{
 						if(!fn_filter.empty() && tfiles[i].name!=fn_filter)
 						{
@@ -789,10 +800,13 @@ namespace backupaccess
 							obj.set("mod", tmetadata[i].last_modified);
 							obj.set("creat", tmetadata[i].created);
 							obj.set("access", tmetadata[i].accessed);
-							files.add(obj);
+							if(files_writer!=NULL)
+								files_writer->add(obj);
+							else
+								files.add(obj);
 						}
 					}
-					for(size_t i=0;i<tfiles.size();++i)
+					for(size_t i=0;i<tfiles.size() && (files_writer==NULL || files_writer->good());++i)
 					{
 						if(!fn_filter.empty() && tfiles[i].name!=fn_filter)
 						{
@@ -813,7 +827,7 @@ namespace backupaccess
 							JSON::Object obj;
 							obj.set("name", tfiles[i].name);
 							obj.set("dir", tfiles[i].isdir);
-							obj.set("size", tfiles[i].size);
+							obj.set("size", ChunkStore::contentSize(os_file_prefix(full_path + os_file_sep() + tfiles[i].name), tfiles[i].size));
 							obj.set("mod", tmetadata[i].last_modified);
 							obj.set("creat", tmetadata[i].created);
 							obj.set("access", tmetadata[i].accessed);
@@ -821,11 +835,17 @@ namespace backupaccess
 							{
 								obj.set("shahash", base64_encode(reinterpret_cast<const unsigned char*>(tmetadata[i].shahash.c_str()), static_cast<unsigned int>(tmetadata[i].shahash.size())));
 							}
-							files.add(obj);
+							if(files_writer!=NULL)
+								files_writer->add(obj);
+							else
+								files.add(obj);
 						}
 					}
 
-					ret.set("files", files);
+					if(files_writer!=NULL)
+						files_writer->endArray();
+					else
+						ret.set("files", files);
 				}
 				else
 				{
@@ -833,7 +853,7 @@ namespace backupaccess
 
 					if(path_info.is_file)
 					{
-						f.reset(Server->openFile(os_file_prefix(path_info.full_path), MODE_READ));
+						f.reset(ChunkStore::openFile(os_file_prefix(path_info.full_path), MODE_READ));
 					}
 
 					if( (path_info.is_file && f.get()) || os_directory_exists(os_file_prefix(path_info.full_path)) )
@@ -1003,7 +1023,8 @@ namespace backupaccess
 	}
 
 	bool get_image_files(IDatabase* db, int backupid, int t_clientid, std::string clientname,
-			const std::string& u_path, int backupid_offset, bool do_mount, JSON::Object& ret)
+			const std::string& u_path, int backupid_offset, bool do_mount, JSON::Object& ret,
+			JSON::StreamWriter* files_writer)
 	{
 		std::string path;
 		JSON::Object image_backup_info = get_image_info(db, backupid, t_clientid, backupid_offset, path);
@@ -1067,6 +1088,14 @@ namespace backupaccess
 			}			
 			
 			JSON::Array files;
+			if (files_writer != NULL)
+			{
+				if (files_writer->depth() == 0)
+				{
+					files_writer->beginObject();
+				}
+				files_writer->beginArray("files");
+			}
 
 			if (!content_path.empty())
 			{
@@ -1083,7 +1112,7 @@ namespace backupaccess
 
 				std::vector<SFile> tfiles = getFiles(os_file_prefix(content_path), NULL);
 
-				for (size_t i = 0; i<tfiles.size(); ++i)
+				for (size_t i = 0; i<tfiles.size() && (files_writer == NULL || files_writer->good()); ++i)
 				{
 					if (tfiles[i].isdir)
 					{
@@ -1093,11 +1122,14 @@ namespace backupaccess
 						obj.set("mod", tfiles[i].last_modified);
 						obj.set("creat", tfiles[i].created);
 						obj.set("access", tfiles[i].accessed);
-						files.add(obj);
+						if (files_writer != NULL)
+							files_writer->add(obj);
+						else
+							files.add(obj);
 					}
 				}
 
-				for (size_t i = 0; i<tfiles.size(); ++i)
+				for (size_t i = 0; i<tfiles.size() && (files_writer == NULL || files_writer->good()); ++i)
 				{
 					if (!tfiles[i].isdir)
 					{
@@ -1108,12 +1140,18 @@ namespace backupaccess
 						obj.set("creat", tfiles[i].created);
 						obj.set("access", tfiles[i].accessed);
 						obj.set("size", tfiles[i].size);
-						files.add(obj);
+						if (files_writer != NULL)
+							files_writer->add(obj);
+						else
+							files.add(obj);
 					}
 				}
 			}
 
-			ret.set("files", files);
+			if (files_writer != NULL)
+				files_writer->endArray();
+			else
+				ret.set("files", files);
 		}
 
 	
@@ -1125,6 +1163,30 @@ namespace backupaccess
 
 namespace
 {
+	void writeStreamError(JSONStreamOutput& output, JSON::StreamWriter& writer, const JSON::Object& err_ret)
+	{
+		if (writer.depth() == 0)
+		{
+			//Nothing was streamed yet
+			if (output.write(err_ret.stringify(false)))
+			{
+				output.finish();
+			}
+			return;
+		}
+
+		//Close the result object with the error members
+		writer.setMembers(err_ret);
+		while (writer.depth() > 0)
+		{
+			writer.endObject();
+		}
+		if (writer.flush())
+		{
+			output.finish();
+		}
+	}
+
 	bool removeImageBackup(int backupid)
 	{
 		bool result = false;
@@ -1713,6 +1775,16 @@ ACTION_IMPL(backups)
 								restore_flags |= restore_flag_ignore_permissions;
 							}
 
+							if (CURRP["parallel_download"] == "1")
+							{
+								restore_flags |= restore_flag_parallel_download;
+							}
+
+							if (CURRP["local_copy"] == "1")
+							{
+								restore_flags |= restore_flag_local_copy;
+							}
+
 							if(!create_clientdl_thread(clientname, t_clientid, t_clientid, path_info.full_path, path_info.full_metadata_path, CURRP["filter"],
 								path_info.rel_path.empty(), path_info.rel_path, restore_id, status_id, log_id, std::string(),
 								std::vector< std::pair<std::string, std::string> >(), true, true, greplace(os_file_sep(), "/", path_info.rel_path), true,
@@ -1737,25 +1809,30 @@ ACTION_IMPL(backups)
 					}
 					else
 					{
+						//The file list is streamed, the remaining members of ret are written after it.
+						//The result object is started by the listing once all access checks passed.
+						JSONStreamOutput output(tid, &PARAMS);
+						JSON::StreamWriter writer(&output);
+
 						if (has_backupid && backupid < 0)
 						{
-							if (!backupaccess::get_image_files(db, -1 * backupid, t_clientid, clientname, u_path, 0, CURRP["mount"]=="1", ret))
+							if (!backupaccess::get_image_files(db, -1 * backupid, t_clientid, clientname, u_path, 0, CURRP["mount"]=="1", ret, &writer))
 							{
 								JSON::Object err_ret;
 								err_ret.set("err", "internal_error");
-								helper.Write(err_ret.stringify(false));
+								writeStreamError(output, writer, err_ret);
 								return;
 							}
 						}
 						else
 						{
 							if (!backupaccess::get_files_with_tokens(db, has_backupid ? &backupid : NULL, t_clientid, clientname, token_authentication ? &fileaccesstokens : NULL,
-								u_path, 0, ret))
+								u_path, 0, ret, &writer))
 							{
 								JSON::Object err_ret;
 								err_ret.set("err", "access_denied");
 								err_ret.set("errcode", "path_browse_access_denied");
-								helper.Write(err_ret.stringify(false));
+								writeStreamError(output, writer, err_ret);
 								return;
 							}
 						}
@@ -1763,6 +1840,18 @@ ACTION_IMPL(backups)
 						ret.set("clientname", clientname);
 						ret.set("clientid", t_clientid);							
 						ret.set("path", u_path);
+
+						if (writer.depth() == 0)
+						{
+							writer.beginObject();
+						}
+						writer.setMembers(ret);
+						writer.endObject();
+						if (writer.flush())
+						{
+							output.finish();
+						}
+						return;
 					}
 				}
 			}
@@ -1773,5 +1862,5 @@ ACTION_IMPL(backups)
 		ret.set("error", 1);
 	}
 
-    helper.Write(ret.stringify(false));
+    helper.WriteJSON(ret);
 }
@@ -60,6 +60,11 @@ namespace backupaccess
 		std::string clientname, std::string backupfolder, int* backupid, std::string backuppath);
 
 	bool get_files_with_tokens(IDatabase* db, int* backupid, int t_clientid, std::string clientname,
-        std::string* fileaccesstokens, const std::string& u_path, int backupid_offset, JSON::Object& ret);
+        std::string* fileaccesstokens, const std::string& u_path, int backupid_offset, JSON::Object& ret,
+		JSON::StreamWriter* files_writer=NULL);
+
+	bool get_image_files(IDatabase* db, int backupid, int t_clientid, std::string clientname,
+		const std::string& u_path, int backupid_offset, bool do_mount, JSON::Object& ret,
+		JSON::StreamWriter* files_writer=NULL);
 }
 
@@ -24,6 +24,7 @@
 #include "backups.h"
 #include <memory>
 #include "../../common/data.h"
+#include "../ChunkStore.h"
 
 #define MINIZ_NO_ZLIB_COMPATIBLE_NAMES
 #include "../../common/miniz.h"
@@ -279,12 +280,30 @@ bool add_dir(mz_zip_archive& zip_archive, const std::string& archivefoldername,
 		}
 		else
 		{	
-			std::auto_ptr<IFsFile> add_file(Server->openFile(os_file_prefix(filename), MODE_READ_SEQUENTIAL_BACKUP));
+			std::auto_ptr<IFsFile> add_file(ChunkStore::openFile(os_file_prefix(filename), MODE_READ_SEQUENTIAL_BACKUP));
 			if (add_file.get() == NULL)
 			{
 				Server->Log("Error opening file \"" + filename + "\" for ZIP file download. " + os_last_error_str(), LL_ERROR);
 				return false;
 			}
+			ScopedDeleteFn delete_tmp_file((std::string()));
+			if (dynamic_cast<ChunkedFile*>(add_file.get()) != NULL)
+			{
+				//Chunk store files have no OS handle with the content
+				std::auto_ptr<IFsFile> tmp_file(Server->openTemporaryFile());
+				if (tmp_file.get() == NULL)
+				{
+					return false;
+				}
+				delete_tmp_file.reset(tmp_file->getFilename());
+				if (!copy_file(add_file.get(), tmp_file.get())
+					|| !tmp_file->Seek(0))
+				{
+					Server->Log("Error copying file \"" + filename + "\" for ZIP file download. " + os_last_error_str(), LL_ERROR);
+					return false;
+				}
+				add_file.reset(tmp_file.release());
+			}
 			int64 fsize = add_file->Size();
 #ifndef _WIN32
 			int fd = add_file->getOsHandle(true);
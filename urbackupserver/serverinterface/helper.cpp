@@ -21,6 +21,7 @@
 #include "../database.h"
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <algorithm>
 #include "../server_settings.h"
 #include "../../urlplugin/IUrlFactory.h"
@@ -192,6 +193,17 @@ void Helper::WriteTemplate(ITemplate *tmpl)
 	Server->Write( tid, tmpl->getData() );
 }
 
+void Helper::WriteJSON(const JSON::Object& obj)
+{
+	JSONStreamOutput output(tid, PARAMS);
+	JSON::StreamWriter writer(&output);
+	writer.add(obj);
+	if(writer.flush())
+	{
+		output.finish();
+	}
+}
+
 IDatabase *Helper::getDatabase(void)
 {
 	return Server->getDatabase(tid, URBACKUPDB_SERVER);
@@ -607,3 +619,49 @@ std::map<std::string, std::string> Helper::parseRightsString( const std::string&
 	}
 	return ret;
 }
+
+JSONStreamOutput::JSONStreamOutput(THREAD_ID tid, str_map *PARAMS)
+	: tid(tid), chunked(false)
+{
+	if(PARAMS!=NULL)
+	{
+		str_map::iterator it=PARAMS->find("STREAM_CHUNKED");
+		chunked = it!=PARAMS->end() && it->second=="1";
+	}
+
+	if(chunked)
+	{
+		Server->addHeader(tid, "Transfer-Encoding: chunked");
+	}
+}
+
+bool JSONStreamOutput::write(const std::string &data)
+{
+	if(data.empty())
+	{
+		return true;
+	}
+
+	if(chunked)
+	{
+		char chunk_size[32];
+		snprintf(chunk_size, sizeof(chunk_size), "%x\r\n", static_cast<unsigned int>(data.size()));
+		std::string chunk=chunk_size;
+		chunk+=data;
+		chunk+="\r\n";
+		return Server->Write(tid, chunk, false);
+	}
+	else
+	{
+		return Server->Write(tid, data, false);
+	}
+}
+
+bool JSONStreamOutput::finish(void)
+{
+	if(chunked)
+	{
+		return Server->Write(tid, "0\r\n\r\n", false);
+	}
+	return true;
+}
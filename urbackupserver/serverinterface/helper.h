@@ -6,6 +6,7 @@
 #include "../../Interface/Template.h"
 #include "../../Interface/Mutex.h"
 #include "../../urbackupcommon/os_functions.h"
+#include "../../urbackupcommon/json.h"
 
 const int SESSION_ID_ADMIN = 0;
 const int SESSION_ID_INVALID = -1;
@@ -30,6 +31,7 @@ public:
 
 	void Write(std::string str);
 	void WriteTemplate(ITemplate *tmpl);
+	void WriteJSON(const JSON::Object& obj);
 
 	void releaseAll(void);
 
@@ -72,6 +74,20 @@ private:
 	SPrioInfo prio_info;
 };
 
+class JSONStreamOutput : public JSON::IStreamOutput
+{
+public:
+	JSONStreamOutput(THREAD_ID tid, str_map *PARAMS);
+
+	virtual bool write(const std::string &data);
+
+	bool finish(void);
+
+private:
+	THREAD_ID tid;
+	bool chunked;
+};
+
 struct SStartupStatus
 {
 	SStartupStatus(void)
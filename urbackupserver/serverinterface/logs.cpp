@@ -31,6 +31,11 @@ ACTION_IMPL(logs)
 	JSON::Object ret;
 	SUser *session=helper.getSession();
 	if(session!=NULL && session->id==SESSION_ID_INVALID) return;
+
+	JSONStreamOutput output(tid, &PARAMS);
+	JSON::StreamWriter writer(&output);
+	writer.beginObject();
+
 	std::string filter=POST["filter"];
 	std::string s_logid=POST["logid"];
 	int logid=watoi(s_logid);
@@ -139,8 +144,8 @@ ACTION_IMPL(logs)
 			IQuery *q=db->Prepare(qstr);
 			res=q->Read();
 			q->Reset();
-			JSON::Array logs;
-			for(size_t i=0;i<res.size();++i)
+			writer.beginArray("logs");
+			for(size_t i=0;i<res.size() && writer.good();++i)
 			{
 				JSON::Object obj;
 				obj.set("name", res[i]["name"]);
@@ -152,9 +157,9 @@ ACTION_IMPL(logs)
 				obj.set("incremental", watoi(res[i]["incremental"]));
 				obj.set("resumed", watoi(res[i]["resumed"]));
 				obj.set("restore", watoi(res[i]["restore"]));
-				logs.add(obj);
+				writer.add(obj);
 			}
-			ret.set("logs", logs);
+			writer.endArray();
 			ret.set("ll", ll);
 
 			if(POST.find("report_mail")!=POST.end())
@@ -239,11 +244,11 @@ ACTION_IMPL(logs)
 				
 				if(ok)
 				{
-					JSON::Object log;
-					log.set("data", res[0]["logdata"]);
-					log.set("time", watoi64(res[0]["time"]));
-					log.set("clientname", res[0]["name"]);
-					ret.set("log", log);
+					writer.beginObject("log");
+					writer.set("data", res[0]["logdata"]);
+					writer.set("time", watoi64(res[0]["time"]));
+					writer.set("clientname", res[0]["name"]);
+					writer.endObject();
 				}
 			}
 		}
@@ -253,7 +258,12 @@ ACTION_IMPL(logs)
 		ret.set("error", 1);
 	}
 
-    helper.Write(ret.stringify(false));
+	writer.setMembers(ret);
+	writer.endObject();
+	if(writer.flush())
+	{
+		output.finish();
+	}
 }
 
 #endif //CLIENT_ONLY
@@ -23,6 +23,21 @@
 
 void getLastActs(Helper &helper, JSON::Object &ret, std::vector<int> clientids);
 
+namespace
+{
+	JSON::Object queueStateJson(const QueueDepthEstimator::SState& state)
+	{
+		JSON::Object ret;
+		ret.set("min_rtt_ms", state.min_rtt_ms);
+		ret.set("bandwidth_bps", state.bandwidth_bps);
+		ret.set("requests_ps", state.requests_ps);
+		ret.set("depth", state.depth);
+		ret.set("in_flight", state.in_flight);
+		ret.set("probe_rtt", state.probe_rtt);
+		return ret;
+	}
+}
+
 ACTION_IMPL(progress)
 {
 	Helper helper(tid, &POST, &PARAMS);
@@ -63,7 +78,8 @@ ACTION_IMPL(progress)
 		}
 
 		JSON::Array pg;
-		std::vector<SStatus> clients=ServerStatus::getStatus();
+		std::shared_ptr<const SStatusSnapshot> status_snapshot=ServerStatus::getStatusSnapshot();
+		const SStatusSnapshot& clients=*status_snapshot;
 		for(size_t i=0;i<clients.size();++i)
 		{
 			int curr_clientid = clients[i].clientid;
@@ -98,7 +114,7 @@ ACTION_IMPL(progress)
 					obj.set("speed_bpms", clients[i].processes[j].speed_bpms);
 
 					JSON::Array past_speed_bpms;
-					for (std::deque<double>::iterator it = clients[i].processes[j].past_speed_bpms.begin();
+					for (std::deque<double>::const_iterator it = clients[i].processes[j].past_speed_bpms.begin();
 					it != clients[i].processes[j].past_speed_bpms.end(); ++it)
 					{
 						past_speed_bpms.add(*it);
@@ -106,6 +122,12 @@ ACTION_IMPL(progress)
 
 					obj.set("past_speed_bpms", past_speed_bpms);
 
+					if (clients[i].processes[j].has_queue_state)
+					{
+						obj.set("file_queue", queueStateJson(clients[i].processes[j].file_queue));
+						obj.set("chunk_queue", queueStateJson(clients[i].processes[j].chunk_queue));
+					}
+
 					if (clients[i].processes[j].can_stop 
 						&& (all_stop_rights
 							|| std::find(stop_clientids.begin(), stop_clientids.end(), curr_clientid) != stop_clientids.end() ) )
@@ -83,12 +83,15 @@ ACTION_IMPL(scripts)
 				q->Reset();
 			}
 
+			Alerts::updateScripts();
+
 			ret.set("saved_ok", true);
 		}
 		else if (sa == "rm_alert"
 			&& id != 1)
 		{
 			db->Write("DELETE FROM alert_scripts WHERE id=" + convert(id));
+			Alerts::updateScripts();
 			id = 1;
 		}
 
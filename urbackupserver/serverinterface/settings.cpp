@@ -174,6 +174,7 @@ JSON::Object getJSONClientSettings(ServerSettings &settings)
 	SET_SETTING(internet_full_file_transfer_mode);
 	SET_SETTING(local_incr_file_transfer_mode);
 	SET_SETTING(internet_incr_file_transfer_mode);
+	SET_SETTING(incr_file_transfer_cdc);
 	SET_SETTING(local_image_transfer_mode);
 	SET_SETTING(internet_image_transfer_mode);
 	SET_SETTING(end_to_end_file_backup_verification);
@@ -190,6 +191,8 @@ JSON::Object getJSONClientSettings(ServerSettings &settings)
 	SET_SETTING(internet_full_image_style);
 	SET_SETTING(create_linked_user_views);
 	SET_SETTING(max_running_jobs_per_client);
+	SET_SETTING(local_file_download_streams);
+	SET_SETTING(internet_file_download_streams);
 	SET_SETTING(cbt_volumes);
 	SET_SETTING(cbt_crash_persistent_volumes);
 	SET_SETTING(ignore_disk_errors);
@@ -240,6 +243,9 @@ void getGeneralSettings(JSON::Object& obj, IDatabase *db, ServerSettings &settin
 	SET_SETTING(use_tmpfiles_images);
 	SET_SETTING(tmpdir);
 	SET_SETTING(update_stats_cachesize);
+	SET_SETTING(file_index_check_rate);
+	SET_SETTING(file_index_check_repair);
+	SET_SETTING(chunk_dedup);
 	SET_SETTING(use_incremental_symlinks);
 	SET_SETTING(show_server_updates);
 	SET_SETTING(server_url);
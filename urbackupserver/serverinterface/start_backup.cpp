@@ -66,7 +66,7 @@ ACTION_IMPL(start_backup)
 
 	if(session!=NULL && !s_start_client.empty() && helper.getRights("start_backup")=="all")
 	{
-		std::vector<SStatus> client_status=ServerStatus::getStatus();
+		std::shared_ptr<const SStatusSnapshot> client_status=ServerStatus::getStatusSnapshot();
 
 		std::vector<std::string> sv_start_client;
 		Tokenize(s_start_client, sv_start_client, ",");
@@ -89,34 +89,26 @@ ACTION_IMPL(start_backup)
 			obj.set("start_type", start_type);
 			obj.set("clientid", start_clientid);
 
-			bool found_client=false;
-			for(size_t i=0;i<client_status.size();++i)
+			const SStatus* curr_client=client_status->getClient(start_clientid);
+			if(curr_client!=NULL)
 			{
-				if(client_status[i].clientid==start_clientid)
+				if(!curr_client->r_online || curr_client->comm_pipe==NULL)
 				{
-					found_client=true;
-					
-					if(!client_status[i].r_online || client_status[i].comm_pipe==NULL)
+					obj.set("start_ok", false);
+				}
+				else
+				{
+					if(client_start_backup(curr_client->comm_pipe, start_type) )
 					{
-						obj.set("start_ok", false);
+						obj.set("start_ok", true);
 					}
 					else
 					{
-						if(client_start_backup(client_status[i].comm_pipe, start_type) )
-						{
-							obj.set("start_ok", true);
-						}
-						else
-						{
-							obj.set("start_ok", false);
-						}
+						obj.set("start_ok", false);
 					}
-
-					break;
 				}
 			}
-
-			if(!found_client)
+			else
 			{
 				obj.set("start_ok", false);
 			}
@@ -513,6 +513,11 @@ ACTION_IMPL(status)
 
 	SUser *session=helper.getSession();
 	if(session!=NULL && session->id==SESSION_ID_INVALID) return;
+
+	JSONStreamOutput output(tid, &PARAMS);
+	JSON::StreamWriter writer(&output);
+	writer.beginObject();
+
 	if(session!=NULL && (rights=="all" || !clientids.empty()) )
 	{
 		if (rights == "all" && POST.find("stop_show") != POST.end())
@@ -617,7 +622,7 @@ ACTION_IMPL(status)
 			BackupServer::updateDeletePending();
 		}
 
-		JSON::Array status;
+		writer.beginArray("status");
 		IDatabase *db=helper.getDatabase();
 		std::string filter;
 		if(!clientids.empty())
@@ -634,9 +639,10 @@ ACTION_IMPL(status)
 			"strftime('"+helper.getTimeFormatString()+"', lastbackup_image) AS lastbackup_image, last_filebackup_issues, os_simple, os_version_str, client_version_str, cg.name AS groupname, file_ok, image_ok FROM "
 			" clients c LEFT OUTER JOIN settings_db.si_client_groups cg ON c.groupid = cg.id "+filter+" ORDER BY name");
 
-		std::vector<SStatus> client_status=ServerStatus::getStatus();
+		std::shared_ptr<const SStatusSnapshot> status_snapshot=ServerStatus::getStatusSnapshot();
+		const SStatusSnapshot& client_status=*status_snapshot;
 
-		for(size_t i=0;i<res.size();++i)
+		for(size_t i=0;i<res.size() && writer.good();++i)
 		{
 			JSON::Object stat;
 			int clientid=watoi(res[i]["id"]);
@@ -678,54 +684,52 @@ ACTION_IMPL(status)
 			std::string os_simple = res[i]["os_simple"];
 			int i_status=0;
 			bool online=false;
-			SStatus *curr_status=NULL;
+			const SStatus *curr_status=NULL;
 			JSON::Array processes;
 			int64 lastseen = watoi64(res[i]["lastseen"]);
 
-			for(size_t j=0;j<client_status.size();++j)
+			const SStatus *curr_client=client_status.getClient(clientname);
+			if(curr_client!=NULL && curr_client->client==clientname)
 			{
-				if(client_status[j].client==clientname)
+				if(curr_client->r_online==true)
 				{
-					if(client_status[j].r_online==true)
-					{
-						curr_status=&client_status[j];
-						online=true;
-					}
+					curr_status=curr_client;
+					online=true;
+				}
 
-					unsigned char *ips=(unsigned char*)&client_status[j].ip_addr;
-					ip=convert(ips[0])+"."+convert(ips[1])+"."+convert(ips[2])+"."+convert(ips[3]);
+				unsigned char *ips=(unsigned char*)&curr_client->ip_addr;
+				ip=convert(ips[0])+"."+convert(ips[1])+"."+convert(ips[2])+"."+convert(ips[3]);
 
-					client_version_string=client_status[j].client_version_string;
-					os_version_string=client_status[j].os_version_string;
+				client_version_string=curr_client->client_version_string;
+				os_version_string=curr_client->os_version_string;
 
-					if (client_status[j].lastseen > lastseen)
-					{
-						lastseen = client_status[j].lastseen;
-					}
+				if (curr_client->lastseen > lastseen)
+				{
+					lastseen = curr_client->lastseen;
+				}
 
-					switch(client_status[j].status_error)
+				switch(curr_client->status_error)
+				{
+				case se_ident_error:
+					i_status=11; break;
+				case se_too_many_clients:
+					i_status=12; break;
+				case se_authentication_error:
+					i_status=13; break;
+				default:
+					if(!curr_client->processes.empty())
 					{
-					case se_ident_error:
-						i_status=11; break;
-					case se_too_many_clients:
-						i_status=12; break;
-					case se_authentication_error:
-						i_status=13; break;
-					default:
-						if(!client_status[j].processes.empty())
-						{
-							i_status = client_status[j].processes[0].action;
-						}
+						i_status = curr_client->processes[0].action;
 					}
+				}
 
-					for(size_t k=0;k<client_status[j].processes.size();++k)
-					{
-						SProcess& process = client_status[j].processes[k];
-						JSON::Object proc;
-						proc.set("action", process.action);
-						proc.set("pcdone", process.pcdone);
-						processes.add(proc);
-					}
+				for(size_t k=0;k<curr_client->processes.size();++k)
+				{
+					const SProcess& process = curr_client->processes[k];
+					JSON::Object proc;
+					proc.set("action", process.action);
+					proc.set("pcdone", process.pcdone);
+					processes.add(proc);
 				}
 			}
 
@@ -738,7 +742,7 @@ ACTION_IMPL(status)
 			stat.set("processes", processes);
 			stat.set("lastseen", lastseen);
 
-			status.add(stat);
+			writer.add(stat);
 		}
 
 		if(rights=="all")
@@ -789,7 +793,7 @@ ACTION_IMPL(status)
 				stat.set("image_ok", false);
 				stat.set("rejected", true);
 
-				status.add(stat);
+				writer.add(stat);
 			}
 
 			if (has_ident_error_clients)
@@ -802,6 +806,8 @@ ACTION_IMPL(status)
 				}
 			}
 		}
+		writer.endArray();
+
 		JSON::Array extra_clients;
 
 		if(rights=="all")
@@ -833,7 +839,6 @@ ACTION_IMPL(status)
 			ret.set("allow_modify_clients", true);
 		}
 
-		ret.set("status", status);
 		ret.set("extra_clients", extra_clients);
 		ret.set("server_identity", helper.getStrippedServerIdentity());
 
@@ -878,7 +883,12 @@ ACTION_IMPL(status)
 	{
 		ret.set("error", 1);
 	}
-    helper.Write(ret.stringify(false));
+	writer.setMembers(ret);
+	writer.endObject();
+	if(writer.flush())
+	{
+		output.finish();
+	}
 }
 
 #endif //CLIENT_ONLY
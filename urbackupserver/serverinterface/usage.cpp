@@ -134,9 +134,12 @@ ACTION_IMPL(usage)
 {
 	Helper helper(tid, &POST, &PARAMS);
 
-	JSON::Object ret;
 	SUser *session=helper.getSession();
 	if(session!=NULL && session->id==SESSION_ID_INVALID) return;
+
+	JSONStreamOutput output(tid, &PARAMS);
+	JSON::StreamWriter ret(&output);
+	ret.beginObject();
 	if(session!=NULL )
 	{
 		IDatabase *db=helper.getDatabase();
@@ -145,17 +148,17 @@ ACTION_IMPL(usage)
 			IQuery *q=db->Prepare("SELECT (bytes_used_files+bytes_used_images) AS used, bytes_used_files, bytes_used_images, name FROM clients ORDER BY (bytes_used_files+bytes_used_images) DESC");
 			db_results res=q->Read();
 		
-			JSON::Array usage;
-			for(size_t i=0;i<res.size();++i)
+			ret.beginArray("usage");
+			for(size_t i=0;i<res.size() && ret.good();++i)
 			{
 				JSON::Object obj;
 				obj.set("used",atof(res[i]["used"].c_str()));
 				obj.set("files",atof(res[i]["bytes_used_files"].c_str()));
 				obj.set("images",atof(res[i]["bytes_used_images"].c_str()));
 				obj.set("name",res[i]["name"]);
-				usage.add(obj);
+				ret.add(obj);
 			}
-			ret.set("usage", usage);
+			ret.endArray();
 		}
 		if(helper.getRights("reset_statistics")=="all")
 		{
@@ -171,7 +174,11 @@ ACTION_IMPL(usage)
 	{
 		ret.set("error", 1);
 	}
-    helper.Write(ret.stringify(false));
+	ret.endObject();
+	if(ret.flush())
+	{
+		output.finish();
+	}
 }
 
 #endif //CLIENT_ONLY
@@ -20,6 +20,9 @@
 #include "../Interface/Server.h"
 #include "../Interface/File.h"
 #include "../Interface/DatabaseCursor.h"
+#include "../Interface/ThreadPool.h"
+#include "../Interface/Mutex.h"
+#include "../Interface/Condition.h"
 #include "database.h"
 #include "../stringtools.h"
 #include <iostream>
@@ -35,11 +38,23 @@
 #include "serverinterface/helper.h"
 #include "server.h"
 #include "../urbackupcommon/TreeHash.h"
+#include <algorithm>
+#include <deque>
+
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/stat.h>
+#endif
 
 const _u32 c_read_blocksize=4096;
 const size_t draw_segments=30;
 const size_t c_speed_size=15;
 const size_t c_max_l_length=80;
+const size_t c_verify_batch_files=10000;
+const int64 c_verify_max_inflight_bytes=1LL*1024*1024*1024;
+const size_t c_verify_default_threads_per_device=2;
+
+IMutex* verify_progress_mutex=NULL;
 
 void draw_progress(std::string curr_fn, _i64 curr_verified, _i64 verify_size)
 {
@@ -112,6 +127,7 @@ public:
 	{
 		int64 add = curr - curr_last;
 		curr_last = curr;
+		IScopedLock lock(verify_progress_mutex);
 		curr_verified += add;
 		draw_progress(curr_fn, curr_verified, verify_size);
 	}
@@ -126,7 +142,7 @@ private:
 bool verify_file(db_single_result &res, _i64 &curr_verified, _i64 verify_size, bool& missing, const std::string& backuppath)
 {
 	std::string fp=res["fullpath"];
-	std::auto_ptr<IFsFile> f(Server->openFile(os_file_prefix(fp), MODE_READ));
+	std::auto_ptr<IFsFile> f(ChunkStore::openFile(os_file_prefix(fp), MODE_READ));
 	if( f.get()==NULL )
 	{
 		std::cout << std::endl;
@@ -205,14 +221,271 @@ bool verify_file(db_single_result &res, _i64 &curr_verified, _i64 verify_size, b
 	return true;
 }
 
+namespace
+{
+	struct SVerifyItem
+	{
+		db_single_result res;
+		std::string backuppath;
+		int64 device;
+		int64 volume_offset;
+		int64 filesize;
+
+	};
+
+	bool verify_item_less(const SVerifyItem* a, const SVerifyItem* b)
+	{
+		if (a->device != b->device)
+			return a->device < b->device;
+		return a->volume_offset < b->volume_offset;
+	}
+
+	void get_disk_location(const std::string& fp, int64& device, int64& volume_offset)
+	{
+		device = 0;
+		volume_offset = -1;
+
+		std::auto_ptr<IFsFile> f(Server->openFile(os_file_prefix(fp), MODE_READ));
+		if (f.get() == NULL)
+		{
+			return;
+		}
+
+		bool more_data;
+		std::vector<IFsFile::SFileExtent> extents = f->getFileExtents(0, c_read_blocksize, more_data);
+		if (!extents.empty())
+		{
+			volume_offset = extents[0].volume_offset;
+		}
+
+#ifndef _WIN32
+		struct stat st;
+		if (fstat(static_cast<int>(f->getOsHandle()), &st) == 0)
+		{
+			device = static_cast<int64>(st.st_dev);
+		}
+#endif
+	}
+
+	class ParallelVerify
+	{
+	public:
+		ParallelVerify(_i64& curr_verified, _i64 verify_size, size_t threads_per_device)
+			: curr_verified(curr_verified), verify_size(verify_size), threads_per_device(threads_per_device),
+			inflight_bytes(0), inflight_items(0), do_stop(false),
+			mutex(Server->createMutex()), cond(Server->createCondition())
+		{
+		}
+
+		~ParallelVerify()
+		{
+			{
+				IScopedLock lock(mutex.get());
+				do_stop = true;
+				cond->notify_all();
+			}
+			Server->getThreadPool()->waitFor(tickets);
+			for (size_t i = 0; i < workers.size(); ++i)
+			{
+				delete workers[i];
+			}
+			for (std::map<int64, std::deque<SVerifyItem*> >::iterator it = queues.begin(); it != queues.end(); ++it)
+			{
+				for (size_t i = 0; i < it->second.size(); ++i)
+				{
+					delete it->second[i];
+				}
+			}
+		}
+
+		void add(SVerifyItem* item)
+		{
+			IScopedLock lock(mutex.get());
+			while (inflight_items > 0
+				&& inflight_bytes + item->filesize > c_verify_max_inflight_bytes)
+			{
+				cond->wait(&lock);
+			}
+
+			std::map<int64, std::deque<SVerifyItem*> >::iterator it = queues.find(item->device);
+			if (it == queues.end())
+			{
+				it = queues.insert(std::make_pair(item->device, std::deque<SVerifyItem*>())).first;
+				for (size_t i = 0; i < threads_per_device; ++i)
+				{
+					Worker* worker = new Worker(*this, item->device);
+					workers.push_back(worker);
+					tickets.push_back(Server->getThreadPool()->execute(worker, "verify hashes"));
+				}
+			}
+
+			it->second.push_back(item);
+			inflight_bytes += item->filesize;
+			++inflight_items;
+			cond->notify_all();
+		}
+
+		void wait()
+		{
+			IScopedLock lock(mutex.get());
+			while (inflight_items > 0)
+			{
+				cond->wait(&lock);
+			}
+		}
+
+		void getResults(std::vector<std::pair<int64, std::string> >& ret_failed, std::vector<int64>& ret_missing)
+		{
+			IScopedLock lock(mutex.get());
+			ret_failed.swap(failed);
+			ret_missing.swap(missing);
+			failed.clear();
+			missing.clear();
+		}
+
+	private:
+		class Worker : public IThread
+		{
+		public:
+			Worker(ParallelVerify& verify, int64 device)
+				: verify(verify), device(device)
+			{}
+
+			void operator()()
+			{
+				verify.run(device);
+			}
+
+		private:
+			ParallelVerify& verify;
+			int64 device;
+		};
+
+		void run(int64 device)
+		{
+			IScopedLock lock(mutex.get());
+			std::deque<SVerifyItem*>& queue = queues[device];
+			while (true)
+			{
+				while (queue.empty() && !do_stop)
+				{
+					cond->wait(&lock);
+				}
+
+				if (queue.empty())
+				{
+					return;
+				}
+
+				std::auto_ptr<SVerifyItem> item(queue.front());
+				queue.pop_front();
+
+				lock.relock(NULL);
+				bool is_missing = false;
+				bool ok = verify_file(item->res, curr_verified, verify_size, is_missing, item->backuppath);
+				lock.relock(mutex.get());
+
+				if (!ok)
+				{
+					if (!is_missing)
+					{
+						failed.push_back(std::make_pair(watoi64(item->res["id"]), item->res["fullpath"]));
+					}
+					else
+					{
+						missing.push_back(watoi64(item->res["id"]));
+					}
+				}
+
+				inflight_bytes -= item->filesize;
+				--inflight_items;
+				cond->notify_all();
+			}
+		}
+
+		_i64& curr_verified;
+		_i64 verify_size;
+		size_t threads_per_device;
+		int64 inflight_bytes;
+		size_t inflight_items;
+		bool do_stop;
+		std::auto_ptr<IMutex> mutex;
+		std::auto_ptr<ICondition> cond;
+		std::map<int64, std::deque<SVerifyItem*> > queues;
+		std::vector<Worker*> workers;
+		std::vector<THREADPOOL_TICKET> tickets;
+		std::vector<std::pair<int64, std::string> > failed;
+		std::vector<int64> missing;
+	};
+
+	std::string join_ids(const std::vector<int64>& ids)
+	{
+		std::string ret;
+		for (size_t i = 0; i < ids.size(); ++i)
+		{
+			if (i > 0)
+				ret += ",";
+			ret += convert(ids[i]);
+		}
+		return ret;
+	}
+
+	void split_ids(const std::string& str, std::vector<int64>& ids)
+	{
+		std::vector<std::string> toks;
+		Tokenize(str, toks, ",");
+		for (size_t i = 0; i < toks.size(); ++i)
+		{
+			if (!toks[i].empty())
+				ids.push_back(watoi64(toks[i]));
+		}
+	}
+
+	void write_verify_checkpoint(const std::string& fn, const std::string& arg, int64 last_id, _i64 curr_verified, bool is_okay,
+		const std::vector<int64>& missing_files, const std::vector<int64>& todelete)
+	{
+		writestring(arg + "\n" + convert(last_id) + "\n" + convert(curr_verified) + "\n" + (is_okay ? "1" : "0") + "\n"
+			+ join_ids(missing_files) + "\n" + join_ids(todelete) + "\n", fn);
+	}
+}
+
 bool verify_hashes(std::string arg)
 {
 	IDatabase *db=Server->getDatabase(Server->getThreadID(), URBACKUPDB_SERVER);
 
 	std::string working_dir=(Server->getServerWorkingDir());
 	std::string v_output_fn=working_dir+os_file_sep()+"urbackup"+os_file_sep()+"verification_result.txt";
+	std::string v_checkpoint_fn=working_dir+os_file_sep()+"urbackup"+os_file_sep()+"verification_checkpoint.txt";
+
+	int64 resume_id=0;
+	_i64 resume_verified=0;
+	bool resume_okay=true;
+	std::vector<int64> missing_files;
+	std::vector<int64> todelete;
+	if(Server->getServerParameter("verify_resume")=="true")
+	{
+		std::vector<std::string> checkpoint;
+		Tokenize(getFile(v_checkpoint_fn), checkpoint, "\n");
+		if(checkpoint.size()>=4 && checkpoint[0]==arg)
+		{
+			resume_id=watoi64(checkpoint[1]);
+			resume_verified=watoi64(checkpoint[2]);
+			resume_okay=checkpoint[3]=="1";
+			if(checkpoint.size()>=6)
+			{
+				split_ids(checkpoint[4], missing_files);
+				split_ids(checkpoint[5], todelete);
+			}
+			Server->Log("Resuming verification after file entry "+convert(resume_id), LL_INFO);
+		}
+		else
+		{
+			Server->Log("No matching verification checkpoint found. Starting from the beginning.", LL_INFO);
+		}
+	}
+
 	std::fstream v_failure;
-	v_failure.open(v_output_fn.c_str(), std::ios::out|std::ios::binary);
+	v_failure.open(v_output_fn.c_str(), std::ios::out|std::ios::binary|(resume_id>0 ? std::ios::app : std::ios::trunc));
 	if( !v_failure.is_open() )
 		Server->Log("Could not open \""+v_output_fn+"\" for writing", LL_ERROR);
 	else
@@ -368,58 +641,105 @@ bool verify_hashes(std::string arg)
 
 	std::cout << "To be verified: " << PrettyPrintBytes(verify_size) << " of files" << std::endl;
 
-	_i64 crowid=0;
+	if(resume_id>0)
+	{
+		curr_verified=resume_verified;
+	}
 
-	IQuery *q_get_files = files_db->Prepare("SELECT id, fullpath, shahash, filesize, backupid FROM files WHERE "+filter, false);
+	size_t threads_per_device=c_verify_default_threads_per_device;
+	std::string s_verify_threads=Server->getServerParameter("verify_threads");
+	if(!s_verify_threads.empty())
+	{
+		threads_per_device=(std::max)(1, watoi(s_verify_threads));
+	}
+
+	IQuery *q_get_files = files_db->Prepare("SELECT id, fullpath, shahash, filesize, backupid FROM files WHERE id>"+convert(resume_id)+" AND ("+filter+") ORDER BY id ASC", false);
 	IQuery* q_get_backuppath = db->Prepare("SELECT path FROM backups WHERE id=?", false);
 
-	bool is_okay=true;
+	bool is_okay=resume_okay;
 
 	IDatabaseCursor* cursor = q_get_files->Cursor();
 
-	std::vector<int64> todelete;
-	std::vector<int64> missing_files;
 	std::map<int, std::string> backuppaths;
 
-	db_single_result res_single;
-	while(cursor->next(res_single))
+	verify_progress_mutex=Server->createMutex();
+
 	{
-		int backupid = watoi(res_single["backupid"]);
-		std::string backuppath;
-		std::map<int, std::string>::iterator it_backuppath = backuppaths.find(backupid);
-		if (it_backuppath == backuppaths.end())
+		ParallelVerify parallel_verify(curr_verified, verify_size, threads_per_device);
+
+		std::vector<SVerifyItem*> batch;
+		bool has_next=true;
+		while(has_next)
 		{
-			q_get_backuppath->Bind(backupid);
-			db_results res_backuppath = q_get_backuppath->Read();
-			q_get_backuppath->Reset();
-			if (!res_backuppath.empty())
+			db_single_result res_single;
+			has_next = cursor->next(res_single);
+			if(has_next)
 			{
-				backuppath = res_backuppath[0]["path"];
-				backuppaths.insert(std::make_pair(backupid, backuppath));
+				int backupid = watoi(res_single["backupid"]);
+				std::string backuppath;
+				std::map<int, std::string>::iterator it_backuppath = backuppaths.find(backupid);
+				if (it_backuppath == backuppaths.end())
+				{
+					q_get_backuppath->Bind(backupid);
+					db_results res_backuppath = q_get_backuppath->Read();
+					q_get_backuppath->Reset();
+					if (!res_backuppath.empty())
+					{
+						backuppath = res_backuppath[0]["path"];
+						backuppaths.insert(std::make_pair(backupid, backuppath));
+					}
+				}
+				else
+				{
+					backuppath = it_backuppath->second;
+				}
+
+				SVerifyItem* item = new SVerifyItem;
+				item->res = res_single;
+				item->backuppath = backuppath;
+				item->filesize = watoi64(res_single["filesize"]);
+				get_disk_location(res_single["fullpath"], item->device, item->volume_offset);
+				batch.push_back(item);
 			}
-		}
-		else
-		{
-			backuppath = it_backuppath->second;
-		}
 
-		bool is_missing=false;
-		if(! verify_file( res_single, curr_verified, verify_size, is_missing, backuppath) )
-		{
-			if(!is_missing)
+			if(batch.size()>=c_verify_batch_files
+				|| (!has_next && !batch.empty()) )
 			{
-				v_failure << "Verification of \"" << (res_single["fullpath"]) << "\" failed\r\n";
-				is_okay=false;
+				int64 last_id = watoi64(batch[batch.size()-1]->res["id"]);
+
+				std::sort(batch.begin(), batch.end(), verify_item_less);
+
+				for(size_t i=0;i<batch.size();++i)
+				{
+					parallel_verify.add(batch[i]);
+				}
+				batch.clear();
+
+				parallel_verify.wait();
+
+				std::vector<std::pair<int64, std::string> > failed;
+				std::vector<int64> missing;
+				parallel_verify.getResults(failed, missing);
+
+				for(size_t i=0;i<failed.size();++i)
+				{
+					v_failure << "Verification of \"" << failed[i].second << "\" failed\r\n";
+					is_okay=false;
 
-				if(delete_failed)
+					if(delete_failed)
+					{
+						todelete.push_back(failed[i].first);
+					}
+				}
+				missing_files.insert(missing_files.end(), missing.begin(), missing.end());
+
+				if(v_failure.is_open())
 				{
-					todelete.push_back(watoi64(res_single["id"]));
+					v_failure.flush();
 				}
+
+				write_verify_checkpoint(v_checkpoint_fn, arg, last_id, curr_verified, is_okay, missing_files, todelete);
 			}
-			else
-			{
-				missing_files.push_back(watoi64(res_single["id"]));
-			}			
 		}
 	}
 
@@ -434,6 +754,8 @@ bool verify_hashes(std::string arg)
 	files_db->destroyQuery(q_get_files);
 	db->destroyQuery(q_get_backuppath);
 
+	Server->deleteFile(v_checkpoint_fn);
+
 	IQuery* q_get_file = files_db->Prepare("SELECT id, fullpath, shahash, filesize, backupid FROM files WHERE id=?");
 
 	if (missing_files.size() > 0)
@@ -497,5 +819,8 @@ bool verify_hashes(std::string arg)
 	}
 	
 
+	Server->destroy(verify_progress_mutex);
+	verify_progress_mutex=NULL;
+
 	return is_okay;
 }
\ No newline at end of file